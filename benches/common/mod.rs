@@ -0,0 +1,89 @@
+//! Shared setup for the criterion benchmarks
+//!
+//! Criterion reports the mean and median per run and keeps named
+//! baselines under `target/criterion`; [`bench_latency`] adds per-call
+//! p50/p99 on top, which is what frame pacing cares about.
+
+#![allow(dead_code)]
+
+use criterion::measurement::WallTime;
+use criterion::{BenchmarkGroup, BenchmarkId};
+use ghoststream::capture::TestPattern;
+use ghoststream::{Frame, FrameFormat, Resolution};
+
+use std::fmt::Display;
+use std::time::{Duration, Instant};
+
+/// Resolutions every benchmark runs at
+pub const RESOLUTIONS: [(&str, Resolution); 4] = [
+    ("720p", Resolution::HD_720P),
+    ("1080p", Resolution::FHD_1080P),
+    ("1440p", Resolution::QHD_1440P),
+    ("4k", Resolution::UHD_4K),
+];
+
+/// Warm-up of every [`bench_latency`] run; its calls are left out of the
+/// percentiles
+pub const WARM_UP: Duration = Duration::from_secs(3);
+
+/// Frames of each pattern cycled through, so encoders see real motion
+/// (one 4K NV12 clip is ~370 MB)
+pub const CLIP_FRAMES: u64 = 30;
+
+/// `count` consecutive frames of `pattern` in `format`
+pub fn clip(pattern: TestPattern, size: Resolution, format: FrameFormat, count: u64) -> Vec<Frame> {
+    (0..count)
+        .map(|i| {
+            pattern
+                .render(i, size.width, size.height, format)
+                .expect("test pattern renders")
+        })
+        .collect()
+}
+
+/// Benchmark `f` and print its per-call p50/p99 next to criterion's
+/// summary
+///
+/// Criterion runs the routine during warm-up too; batches that start
+/// within [`WARM_UP`] of the first are not sampled.
+pub fn bench_latency<F: FnMut()>(
+    group: &mut BenchmarkGroup<WallTime>,
+    name: &str,
+    parameter: impl Display,
+    mut f: F,
+) {
+    let mut samples: Vec<Duration> = Vec::new();
+    let mut first: Option<Instant> = None;
+    let label = format!("{}/{}", name, parameter);
+
+    group.warm_up_time(WARM_UP);
+    group.bench_function(BenchmarkId::new(name, parameter), |b| {
+        b.iter_custom(|iters| {
+            let warming_up = first.get_or_insert_with(Instant::now).elapsed() < WARM_UP;
+            let mut total = Duration::ZERO;
+            for _ in 0..iters {
+                let start = Instant::now();
+                f();
+                let elapsed = start.elapsed();
+                total += elapsed;
+                if !warming_up {
+                    samples.push(elapsed);
+                }
+            }
+            total
+        })
+    });
+
+    if samples.is_empty() {
+        return;
+    }
+    samples.sort_unstable();
+    let at = |q: f64| samples[((samples.len() - 1) as f64 * q).round() as usize];
+    println!(
+        "{:<48} p50 {:>10.3?}  p99 {:>10.3?}  ({} calls)",
+        label,
+        at(0.50),
+        at(0.99),
+        samples.len()
+    );
+}
@@ -0,0 +1,86 @@
+//! Per-frame encode cost of every available backend over synthetic
+//! desktop content
+//!
+//! Backends that are not present on the machine are skipped. Narrow the
+//! run with a filter, e.g. `cargo bench --bench encode -- nvenc/hevc`.
+
+mod common;
+
+use common::{bench_latency, clip, CLIP_FRAMES, RESOLUTIONS};
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use ghoststream::capture::TestPattern;
+use ghoststream::encode::{create_encoder_with_backend, EncoderBackend};
+use ghoststream::{Codec, EncoderConfig, FrameFormat};
+
+use std::hint::black_box;
+use std::time::Duration;
+
+const BACKENDS: [(&str, EncoderBackend); 4] = [
+    ("nvenc", EncoderBackend::Nvenc),
+    ("qsv", EncoderBackend::Qsv),
+    ("amf", EncoderBackend::Amf),
+    ("software", EncoderBackend::Software),
+];
+
+const CODECS: [(&str, Codec); 3] = [
+    ("h264", Codec::H264),
+    ("hevc", Codec::Hevc),
+    ("av1", Codec::Av1),
+];
+
+/// 60 fps in microseconds
+const FRAME_US: i64 = 16_667;
+
+fn encode(c: &mut Criterion) {
+    let mut group = c.benchmark_group("encode");
+    group.sample_size(20);
+    group.measurement_time(Duration::from_secs(10));
+    // One element per frame, so throughput reads as fps
+    group.throughput(Throughput::Elements(1));
+
+    for (res_name, size) in RESOLUTIONS {
+        for pattern in TestPattern::ALL {
+            let frames = clip(pattern, size, FrameFormat::Nv12, CLIP_FRAMES);
+
+            for (backend_name, backend) in BACKENDS {
+                for (codec_name, codec) in CODECS {
+                    let config = EncoderConfig::default()
+                        .with_codec(codec)
+                        .with_resolution(size.width, size.height)
+                        .with_bitrate_kbps(bitrate_kbps(size.width * size.height));
+                    let mut encoder = match create_encoder_with_backend(config, backend)
+                        .and_then(|mut encoder| encoder.init().map(|_| encoder))
+                    {
+                        Ok(encoder) => encoder,
+                        Err(e) => {
+                            eprintln!("Skipping {}/{}: {}", backend_name, codec_name, e);
+                            continue;
+                        }
+                    };
+
+                    let mut index = 0u64;
+                    let name = format!("{}/{}/{}", backend_name, codec_name, pattern);
+                    bench_latency(&mut group, &name, res_name, || {
+                        let mut frame = frames[(index % CLIP_FRAMES) as usize].share();
+                        frame.pts = index as i64 * FRAME_US;
+                        frame.duration = FRAME_US;
+                        index += 1;
+                        black_box(encoder.encode(&frame).unwrap());
+                    });
+                    let _ = encoder.flush();
+                }
+            }
+        }
+    }
+
+    group.finish();
+}
+
+/// Bitrate a stream of this size would typically get
+fn bitrate_kbps(pixels: u32) -> u32 {
+    // ~12 Mbit/s at 1080p60, scaled by area
+    (pixels as u64 * 12_000 / (1920 * 1080)) as u32
+}
+
+criterion_group!(benches, encode);
+criterion_main!(benches);
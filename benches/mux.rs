@@ -0,0 +1,104 @@
+//! Container write throughput for `AvMuxer` and `FileOutput`
+//!
+//! Packets are encoded once up front (software H.264 over the motion
+//! pattern); each iteration then muxes the whole clip to a temporary
+//! file.
+
+mod common;
+
+use common::{bench_latency, clip, CLIP_FRAMES, RESOLUTIONS};
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use ghoststream::capture::TestPattern;
+use ghoststream::encode::{create_encoder_with_backend, EncoderBackend};
+use ghoststream::output::{AvMuxer, Container, FileOutput, OutputSink};
+use ghoststream::types::CodecParams;
+use ghoststream::{Codec, EncoderConfig, FrameFormat, Packet, Resolution};
+
+use std::time::Duration;
+
+/// Frames encoded per clip (two seconds at 60 fps)
+const PACKETS: u64 = 120;
+
+/// 60 fps in microseconds
+const FRAME_US: i64 = 16_667;
+
+/// Encoded clip and the parameters to mux it with
+fn encoded_clip(size: Resolution) -> Option<(CodecParams, Vec<Packet>)> {
+    let config = EncoderConfig::default()
+        .with_codec(Codec::H264)
+        .with_resolution(size.width, size.height)
+        .with_bitrate_kbps(12_000);
+    let mut encoder = match create_encoder_with_backend(config, EncoderBackend::Software)
+        .and_then(|mut encoder| encoder.init().map(|_| encoder))
+    {
+        Ok(encoder) => encoder,
+        Err(e) => {
+            eprintln!("Skipping mux benchmarks: {}", e);
+            return None;
+        }
+    };
+
+    let frames = clip(TestPattern::Motion, size, FrameFormat::Nv12, CLIP_FRAMES);
+    let mut packets = Vec::new();
+    for i in 0..PACKETS {
+        let mut frame = frames[(i % CLIP_FRAMES) as usize].share();
+        frame.pts = i as i64 * FRAME_US;
+        frame.duration = FRAME_US;
+        packets.extend(encoder.encode(&frame).ok()?);
+    }
+    packets.extend(encoder.flush().ok()?);
+    Some((encoder.codec_params()?, packets))
+}
+
+fn mux(c: &mut Criterion) {
+    let runtime = tokio::runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()
+        .expect("tokio runtime");
+    let dir = tempfile::tempdir().expect("temporary directory");
+
+    let mut group = c.benchmark_group("mux");
+    group.sample_size(20);
+    group.measurement_time(Duration::from_secs(5));
+
+    for (name, size) in RESOLUTIONS {
+        let Some((params, packets)) = encoded_clip(size) else {
+            return;
+        };
+        let bytes: usize = packets.iter().map(Packet::size).sum();
+        group.throughput(Throughput::Bytes(bytes as u64));
+
+        let path = dir.path().join(format!("avmuxer-{}.mkv", name));
+        bench_latency(&mut group, "avmuxer_mkv", name, || {
+            let mut muxer = AvMuxer::new(&path, "matroska").unwrap();
+            muxer.add_video_stream(&params).unwrap();
+            muxer.start().unwrap();
+            for packet in &packets {
+                muxer.write_video(packet).unwrap();
+            }
+            muxer.finish().unwrap();
+        });
+
+        for container in [Container::Matroska, Container::Mp4] {
+            let path = dir
+                .path()
+                .join(format!("file-{}.{}", name, container.extension()));
+            let bench = format!("file_output_{}", container.extension());
+            bench_latency(&mut group, &bench, name, || {
+                runtime.block_on(async {
+                    let mut output = FileOutput::new(path.clone(), container);
+                    output.init_with_codec(Some(&params)).await.unwrap();
+                    for packet in &packets {
+                        output.write(packet).await.unwrap();
+                    }
+                    output.finish().await.unwrap();
+                })
+            });
+        }
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, mux);
+criterion_main!(benches);
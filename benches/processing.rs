@@ -0,0 +1,72 @@
+//! Frame processing hot paths: scaling, colour conversion and the
+//! processing graph
+//!
+//! ```text
+//! cargo bench --bench processing -- --save-baseline main
+//! cargo bench --bench processing -- --baseline main
+//! ```
+
+mod common;
+
+use common::{bench_latency, RESOLUTIONS};
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use ghoststream::capture::TestPattern;
+use ghoststream::processing::hdr::bgra_to_p010;
+use ghoststream::processing::{convert_colorspace, process_frame, scale_frame};
+use ghoststream::{FrameFormat, Resolution};
+
+use std::hint::black_box;
+
+fn processing(c: &mut Criterion) {
+    let mut group = c.benchmark_group("processing");
+
+    for (name, size) in RESOLUTIONS {
+        let frame = TestPattern::Motion.render_bgra(0, size.width, size.height);
+        let input = &frame.data[..];
+        let half = Resolution::new(size.width / 2, size.height / 2);
+
+        group.throughput(Throughput::Bytes(input.len() as u64));
+
+        bench_latency(&mut group, "scale_frame_half", name, || {
+            black_box(
+                scale_frame(input, size.width, size.height, half.width, half.height).unwrap(),
+            );
+        });
+
+        bench_latency(&mut group, "convert_bgra_nv12", name, || {
+            black_box(
+                convert_colorspace(
+                    input,
+                    FrameFormat::Bgra,
+                    FrameFormat::Nv12,
+                    size.width,
+                    size.height,
+                )
+                .unwrap(),
+            );
+        });
+
+        bench_latency(&mut group, "bgra_to_p010", name, || {
+            black_box(bgra_to_p010(input, size.width as usize, size.height as usize).unwrap());
+        });
+
+        bench_latency(&mut group, "process_frame_nv12", name, || {
+            black_box(process_frame(&frame, None, Some(FrameFormat::Nv12)).unwrap());
+        });
+
+        // What the pipeline does for a 1080p stream of a larger desktop
+        if size != Resolution::FHD_1080P {
+            bench_latency(&mut group, "process_frame_nv12_1080p", name, || {
+                black_box(
+                    process_frame(&frame, Some(Resolution::FHD_1080P), Some(FrameFormat::Nv12))
+                        .unwrap(),
+                );
+            });
+        }
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, processing);
+criterion_main!(benches);
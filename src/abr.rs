@@ -0,0 +1,369 @@
+//! Network-adaptive bitrate for streaming outputs
+//!
+//! Samples the send-side [`LinkStats`] of RTMP/SRT outputs and steers the
+//! running encoder through [`EncoderControl`]: the bitrate drops by a
+//! factor as soon as a link backs up and climbs back in small steps once
+//! it has stayed clear (AIMD). Pinned at the floor and still congested,
+//! it falls back to the next lower resolution, and returns once the link
+//! has headroom again.
+
+use crate::config::EncoderConfig;
+use crate::output::{LinkSnapshot, LinkStats};
+use crate::pipeline::EncoderControl;
+use crate::types::Resolution;
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// Adaptive bitrate settings
+#[derive(Debug, Clone)]
+pub struct AbrConfig {
+    /// Bitrate floor in kbps
+    pub min_kbps: u32,
+    /// Bitrate ceiling in kbps at the original resolution
+    pub max_kbps: u32,
+    /// Sampling interval
+    pub interval: Duration,
+    /// Factor applied to the bitrate on congestion
+    pub decrease: f64,
+    /// Step added once the link has been clear for `clear_intervals`
+    pub increase_kbps: u32,
+    pub clear_intervals: u32,
+    /// Share of wall time spent blocked in writes that counts as congested
+    pub busy_threshold: f64,
+    /// Writer queue depth (packets) that counts as congested
+    pub queue_threshold: u64,
+    /// Lower resolutions to fall back to, largest first
+    pub fallbacks: Vec<Resolution>,
+    /// Congested intervals at the floor before falling back
+    pub fallback_intervals: u32,
+    /// Encoder resolution the ceiling applies to (None = unknown; the
+    /// ceiling is not scaled on fallback)
+    pub resolution: Option<Resolution>,
+}
+
+impl Default for AbrConfig {
+    fn default() -> Self {
+        Self {
+            min_kbps: 1000,
+            max_kbps: 6000,
+            interval: Duration::from_millis(500),
+            decrease: 0.7,
+            increase_kbps: 250,
+            clear_intervals: 4,
+            busy_threshold: 0.5,
+            queue_threshold: 30,
+            fallbacks: Vec::new(),
+            fallback_intervals: 3,
+            resolution: None,
+        }
+    }
+}
+
+impl AbrConfig {
+    /// Range from the encoder's bitrate down to a fifth of it
+    pub fn for_encoder(config: &EncoderConfig) -> Self {
+        Self {
+            min_kbps: (config.bitrate_kbps / 5).max(300),
+            max_kbps: config.bitrate_kbps,
+            resolution: config.resolution,
+            ..Default::default()
+        }
+    }
+
+    pub fn with_range(mut self, min_kbps: u32, max_kbps: u32) -> Self {
+        self.min_kbps = min_kbps.min(max_kbps);
+        self.max_kbps = max_kbps;
+        self
+    }
+
+    /// Fall back through `resolutions` (largest first) as a last resort
+    pub fn with_fallbacks(mut self, resolutions: Vec<Resolution>) -> Self {
+        self.fallbacks = resolutions;
+        self
+    }
+}
+
+/// What the controller wants the encoder to do
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum AbrDecision {
+    Hold,
+    /// New bitrate in kbps
+    Bitrate(u32),
+    /// New resolution (None = the original) at a bitrate in kbps
+    Resolution(Option<Resolution>, u32),
+}
+
+/// AIMD bitrate controller over link samples
+#[derive(Debug)]
+pub struct AbrController {
+    config: AbrConfig,
+    bitrate: u32,
+    /// 0 = original resolution, n = `fallbacks[n - 1]`
+    level: usize,
+    previous: Vec<LinkSnapshot>,
+    clear: u32,
+    floored: u32,
+}
+
+impl AbrController {
+    pub fn new(config: AbrConfig, bitrate_kbps: u32) -> Self {
+        let bitrate = bitrate_kbps.clamp(config.min_kbps, config.max_kbps.max(config.min_kbps));
+        Self {
+            config,
+            bitrate,
+            level: 0,
+            previous: Vec::new(),
+            clear: 0,
+            floored: 0,
+        }
+    }
+
+    /// Current bitrate in kbps
+    pub fn bitrate(&self) -> u32 {
+        self.bitrate
+    }
+
+    /// Carry on from a bitrate set from outside (within the range)
+    pub fn set_bitrate(&mut self, kbps: u32) {
+        self.bitrate = kbps.clamp(self.config.min_kbps, self.ceiling(self.level));
+        self.clear = 0;
+        self.floored = 0;
+    }
+
+    /// Current resolution (None = the original)
+    pub fn resolution(&self) -> Option<Resolution> {
+        match self.level {
+            0 => self.config.resolution,
+            n => Some(self.config.fallbacks[n - 1]),
+        }
+    }
+
+    /// Feed one sample per link, taken `elapsed` after the previous one
+    pub fn update(&mut self, links: &[LinkSnapshot], elapsed: Duration) -> AbrDecision {
+        let previous = std::mem::replace(&mut self.previous, links.to_vec());
+        if previous.len() != links.len() || elapsed.is_zero() {
+            return AbrDecision::Hold;
+        }
+
+        let congested = previous
+            .iter()
+            .zip(links)
+            .any(|(before, now)| self.congested(before, now, elapsed));
+
+        if congested {
+            self.clear = 0;
+            if self.bitrate > self.config.min_kbps {
+                let lowered = (self.bitrate as f64 * self.config.decrease).round() as u32;
+                self.bitrate = lowered.max(self.config.min_kbps);
+                return AbrDecision::Bitrate(self.bitrate);
+            }
+
+            self.floored += 1;
+            if self.floored >= self.config.fallback_intervals
+                && self.level < self.config.fallbacks.len()
+            {
+                self.floored = 0;
+                self.level += 1;
+                return AbrDecision::Resolution(self.resolution(), self.bitrate);
+            }
+            return AbrDecision::Hold;
+        }
+
+        self.floored = 0;
+        self.clear += 1;
+        if self.clear < self.config.clear_intervals {
+            return AbrDecision::Hold;
+        }
+        self.clear = 0;
+
+        let ceiling = self.ceiling(self.level);
+        if self.bitrate < ceiling {
+            self.bitrate = (self.bitrate + self.config.increase_kbps).min(ceiling);
+            return AbrDecision::Bitrate(self.bitrate);
+        }
+        if self.level > 0 {
+            self.level -= 1;
+            return AbrDecision::Resolution(self.resolution(), self.bitrate);
+        }
+        AbrDecision::Hold
+    }
+
+    /// Did the link back up between two samples?
+    fn congested(&self, before: &LinkSnapshot, now: &LinkSnapshot, elapsed: Duration) -> bool {
+        let blocked = now.write_time.saturating_sub(before.write_time);
+        let busy = blocked.as_secs_f64() / elapsed.as_secs_f64();
+
+        // More than one interval of video stuck in the muxer
+        let interval_bytes =
+            self.bitrate as f64 * 1000.0 / 8.0 * self.config.interval.as_secs_f64();
+
+        busy > self.config.busy_threshold
+            || now.queued_packets > self.config.queue_threshold
+            || now.packets_dropped > before.packets_dropped
+            || now.errors > before.errors
+            || now.buffered_bytes as f64 > interval_bytes
+    }
+
+    /// Ceiling at `level`, scaled by pixel count from the original
+    fn ceiling(&self, level: usize) -> u32 {
+        let (Some(original), true) = (self.config.resolution, level > 0) else {
+            return self.config.max_kbps;
+        };
+        let fallback = self.config.fallbacks[level - 1];
+        let ratio = fallback.pixels() as f64 / original.pixels().max(1) as f64;
+        ((self.config.max_kbps as f64 * ratio.min(1.0)) as u32).max(self.config.min_kbps)
+    }
+}
+
+/// Run a controller against `links` until `running` clears, applying its
+/// decisions through `control`
+///
+/// Each step starts from the configuration last queued on `control`, so
+/// changes made by hand stick; a bitrate set by hand becomes the
+/// controller's starting point.
+pub fn spawn(
+    mut config: AbrConfig,
+    control: EncoderControl,
+    links: Vec<Arc<LinkStats>>,
+    running: Arc<AtomicBool>,
+) -> tokio::task::JoinHandle<()> {
+    let initial = control.config();
+    if config.resolution.is_none() {
+        config.resolution = initial.resolution;
+    }
+    tokio::spawn(async move {
+        let interval = config.interval;
+        let mut controller = AbrController::new(config, initial.bitrate_kbps);
+        // Bitrate last queued by this controller
+        let mut applied = initial.bitrate_kbps;
+        let mut last = Instant::now();
+        tracing::info!(
+            "Adaptive bitrate watching {} link(s) from {}kbps",
+            links.len(),
+            controller.bitrate()
+        );
+
+        while running.load(Ordering::SeqCst) {
+            tokio::time::sleep(interval).await;
+            let samples: Vec<LinkSnapshot> = links.iter().map(|link| link.snapshot()).collect();
+            let elapsed = last.elapsed();
+            last = Instant::now();
+
+            let current = control.config();
+            if current.bitrate_kbps != applied {
+                controller.set_bitrate(current.bitrate_kbps);
+                applied = current.bitrate_kbps;
+            }
+
+            let (resolution, bitrate) = match controller.update(&samples, elapsed) {
+                AbrDecision::Hold => continue,
+                AbrDecision::Bitrate(kbps) => (controller.resolution(), kbps),
+                AbrDecision::Resolution(resolution, kbps) => {
+                    tracing::warn!("Adaptive bitrate switching to {:?}", resolution);
+                    (resolution, kbps)
+                }
+            };
+            tracing::debug!("Adaptive bitrate: {}kbps", bitrate);
+
+            let mut next = current.clone();
+            next.resolution = resolution;
+            next.bitrate_kbps = bitrate;
+            next.max_bitrate_kbps = current.max_bitrate_kbps.map(|max| {
+                (max as u64 * bitrate as u64 / current.bitrate_kbps.max(1) as u64) as u32
+            });
+            applied = bitrate;
+            if control.reconfigure(next).is_err() {
+                break;
+            }
+        }
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn sample(write_ms: u64, queued: u64) -> LinkSnapshot {
+        LinkSnapshot {
+            write_time: Duration::from_millis(write_ms),
+            queued_packets: queued,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn test_aimd() {
+        let config = AbrConfig::default().with_range(1000, 6000);
+        let mut abr = AbrController::new(config, 6000);
+        let tick = Duration::from_millis(500);
+
+        assert_eq!(abr.update(&[sample(0, 0)], tick), AbrDecision::Hold);
+        // Blocked 400ms of 500ms: multiplicative decrease
+        assert_eq!(
+            abr.update(&[sample(400, 0)], tick),
+            AbrDecision::Bitrate(4200)
+        );
+        // Queue backing up
+        assert_eq!(
+            abr.update(&[sample(400, 50)], tick),
+            AbrDecision::Bitrate(2940)
+        );
+
+        // Additive increase only after four clear intervals
+        for _ in 0..3 {
+            assert_eq!(abr.update(&[sample(400, 0)], tick), AbrDecision::Hold);
+        }
+        assert_eq!(
+            abr.update(&[sample(400, 0)], tick),
+            AbrDecision::Bitrate(3190)
+        );
+    }
+
+    #[test]
+    fn test_set_bitrate() {
+        let mut abr = AbrController::new(AbrConfig::default().with_range(1000, 6000), 2000);
+        let tick = Duration::from_millis(500);
+        abr.update(&[sample(0, 0)], tick);
+
+        // Congestion lowers from the bitrate set by hand, not the old one
+        abr.set_bitrate(5000);
+        assert_eq!(
+            abr.update(&[sample(400, 0)], tick),
+            AbrDecision::Bitrate(3500)
+        );
+        abr.set_bitrate(9000);
+        assert_eq!(abr.bitrate(), 6000);
+    }
+
+    #[test]
+    fn test_resolution_fallback() {
+        let config = AbrConfig {
+            resolution: Some(Resolution::FHD_1080P),
+            fallbacks: vec![Resolution::HD_720P],
+            ..Default::default()
+        }
+        .with_range(1000, 6000);
+        let mut abr = AbrController::new(config, 1000);
+        let tick = Duration::from_millis(500);
+
+        abr.update(&[sample(0, 0)], tick);
+        let mut write_ms = 0;
+        let mut congested = |abr: &mut AbrController| {
+            write_ms += 400;
+            abr.update(&[sample(write_ms, 0)], tick)
+        };
+        assert_eq!(congested(&mut abr), AbrDecision::Hold);
+        assert_eq!(congested(&mut abr), AbrDecision::Hold);
+        assert_eq!(
+            congested(&mut abr),
+            AbrDecision::Resolution(Some(Resolution::HD_720P), 1000)
+        );
+        // No lower rendition left
+        assert_eq!(congested(&mut abr), AbrDecision::Hold);
+
+        // 720p ceiling is 4/9 of 6000
+        assert_eq!(abr.ceiling(1), 2666);
+    }
+}
@@ -3,10 +3,16 @@
 //! Captures audio from desktop (monitor) or application sources.
 
 use crate::error::{Error, Result};
+use crate::threading::{self, ThreadRole};
+use super::ring::{sample_ring, RingConsumer, RingProducer};
 use super::types::{AudioFrame, ChannelLayout, SampleFormat};
 
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// Audio the ring between the callback and the reader can hold
+const RING_MS: usize = 500;
 
 /// Audio source type
 #[derive(Debug, Clone, PartialEq, Eq)]
@@ -82,7 +88,9 @@ pub trait AudioCapture: Send + Sync {
 pub struct PipeWireAudioCapture {
     config: AudioCaptureConfig,
     running: Arc<AtomicBool>,
-    frame_rx: Option<crossbeam_channel::Receiver<AudioFrame>>,
+    ring: Option<RingConsumer>,
+    /// Frames handed out (or lost to overruns) so far, for timestamps
+    frames_read: u64,
     _thread_handle: Option<std::thread::JoinHandle<()>>,
 }
 
@@ -92,10 +100,56 @@ impl PipeWireAudioCapture {
         Ok(Self {
             config,
             running: Arc::new(AtomicBool::new(false)),
-            frame_rx: None,
+            ring: None,
+            frames_read: 0,
             _thread_handle: None,
         })
     }
+
+    /// Bytes per interleaved sample frame
+    fn frame_bytes(&self) -> usize {
+        self.config.channels.channels() as usize * self.config.format.bytes_per_sample()
+    }
+
+    /// Copy captured samples into `buf` (whole frames only), waiting up to
+    /// `timeout` for the first ones to arrive
+    ///
+    /// Stops where an overrun lost samples: [`Self::take_overruns`] then
+    /// reports them, so the caller can fill the gap in place (and may get
+    /// 0 bytes if the gap comes first).
+    pub fn read(&mut self, buf: &mut [u8], timeout: Duration) -> Result<usize> {
+        let frame_bytes = self.frame_bytes();
+        let len = buf.len() / frame_bytes * frame_bytes;
+        let ring = self.ring.as_mut().ok_or(Error::CaptureNotStarted)?;
+
+        let deadline = Instant::now() + timeout;
+        while ring.available() < frame_bytes && !ring.at_gap() {
+            if ring.is_closed() {
+                return Err(Error::CaptureEnded);
+            }
+            let left = deadline.saturating_duration_since(Instant::now());
+            if left.is_zero() {
+                return Err(Error::Timeout("Audio frame timeout".into()));
+            }
+            ring.wait(left);
+        }
+
+        let read = ring.pop(&mut buf[..len]);
+        self.frames_read += (read / frame_bytes) as u64;
+        Ok(read)
+    }
+
+    /// Frames the capture callback dropped at the current read position
+    /// because the reader fell behind
+    pub fn take_overruns(&mut self) -> u64 {
+        let frame_bytes = self.frame_bytes();
+        let Some(ring) = self.ring.as_mut() else {
+            return 0;
+        };
+        let frames = (ring.take_overrun() / frame_bytes) as u64;
+        self.frames_read += frames;
+        frames
+    }
 }
 
 #[async_trait::async_trait]
@@ -107,15 +161,18 @@ impl AudioCapture for PipeWireAudioCapture {
 
         self.running.store(true, Ordering::SeqCst);
 
-        let (frame_tx, frame_rx) = crossbeam_channel::bounded::<AudioFrame>(16);
-        self.frame_rx = Some(frame_rx);
+        let capacity = self.config.sample_rate as usize * RING_MS / 1000 * self.frame_bytes();
+        let (producer, consumer) = sample_ring(capacity)?;
+        self.ring = Some(consumer);
+        self.frames_read = 0;
 
         let config = self.config.clone();
         let running = self.running.clone();
 
         // Spawn PipeWire capture thread
         let handle = std::thread::spawn(move || {
-            if let Err(e) = run_pipewire_capture(config, running.clone(), frame_tx) {
+            threading::enter(ThreadRole::Audio);
+            if let Err(e) = run_pipewire_capture(config, running.clone(), producer) {
                 tracing::error!("PipeWire audio capture error: {}", e);
                 running.store(false, Ordering::SeqCst);
             }
@@ -134,17 +191,23 @@ impl AudioCapture for PipeWireAudioCapture {
     }
 
     async fn next_frame(&mut self) -> Result<AudioFrame> {
-        let rx = self.frame_rx.as_ref().ok_or(Error::CaptureNotStarted)?;
-
-        match rx.recv_timeout(std::time::Duration::from_millis(100)) {
-            Ok(frame) => Ok(frame),
-            Err(crossbeam_channel::RecvTimeoutError::Timeout) => {
-                Err(Error::Timeout("Audio frame timeout".into()))
-            }
-            Err(crossbeam_channel::RecvTimeoutError::Disconnected) => {
-                Err(Error::CaptureEnded)
-            }
-        }
+        self.take_overruns();
+        let pts = self.frames_read as i64 * 1_000_000 / self.config.sample_rate as i64;
+
+        let mut data = vec![0u8; self.config.buffer_size as usize * self.frame_bytes()];
+        let len = self.read(&mut data, Duration::from_millis(100))?;
+        data.truncate(len);
+
+        let mut frame = AudioFrame::from_data(
+            data,
+            (len / self.frame_bytes()) as u32,
+            self.config.channels.channels(),
+            self.config.format,
+            self.config.sample_rate,
+        );
+        frame.pts = pts;
+        frame.duration = frame.calculated_duration_us();
+        Ok(frame)
     }
 
     fn is_active(&self) -> bool {
@@ -161,10 +224,13 @@ impl AudioCapture for PipeWireAudioCapture {
 }
 
 /// Run PipeWire capture loop
+///
+/// The process callback runs on the realtime data thread and only copies
+/// each quantum into the preallocated ring.
 fn run_pipewire_capture(
     config: AudioCaptureConfig,
     running: Arc<AtomicBool>,
-    frame_tx: crossbeam_channel::Sender<AudioFrame>,
+    mut ring: RingProducer,
 ) -> Result<()> {
     use pipewire as pw;
 
@@ -194,15 +260,12 @@ fn run_pipewire_capture(
         .map_err(|e| Error::PipeWire(format!("Failed to create stream: {}", e)))?;
 
     // Set up stream listener
-    let config_clone = config.clone();
     let running_clone = running.clone();
-    let frame_tx_clone = frame_tx.clone();
-    let mut pts: i64 = 0;
 
     let _listener = stream
         .add_local_listener_with_user_data(())
         .process(move |stream, _| {
-            if !running_clone.load(Ordering::SeqCst) {
+            if !running_clone.load(Ordering::Relaxed) {
                 return;
             }
 
@@ -219,23 +282,7 @@ fn run_pipewire_capture(
 
                 if let Some(slice) = data.data() {
                     if offset + size <= slice.len() {
-                        let audio_data = slice[offset..offset + size].to_vec();
-                        let samples = size as u32
-                            / (config_clone.channels.channels()
-                                * config_clone.format.bytes_per_sample() as u32);
-
-                        let mut frame = AudioFrame::from_data(
-                            audio_data,
-                            samples,
-                            config_clone.channels.channels(),
-                            config_clone.format,
-                            config_clone.sample_rate,
-                        );
-                        frame.pts = pts;
-                        frame.duration = frame.calculated_duration_us();
-                        pts += frame.duration;
-
-                        let _ = frame_tx_clone.try_send(frame);
+                        ring.push(&slice[offset..offset + size]);
                     }
                 }
             }
@@ -0,0 +1,429 @@
+//! Sample conversion and framing for the audio encoder
+//!
+//! One libswresample context converts captured samples to the encoder's
+//! format, rate and layout (reconfigured in place when the input changes),
+//! and an `AVAudioFifo` collects its output until a whole codec frame is
+//! ready.
+
+use super::types::SampleFormat;
+use crate::error::{Error, Result};
+
+use ffmpeg_next as ffmpeg;
+use ffmpeg_next::ffi;
+use std::ptr;
+
+fn av_error(what: &str, ret: i32) -> Error {
+    Error::Ffmpeg(format!("{}: {}", what, ffmpeg::Error::from(ret)))
+}
+
+/// FFmpeg sample format for a capture format
+pub(crate) fn av_sample_format(format: SampleFormat) -> ffi::AVSampleFormat {
+    match format {
+        SampleFormat::S16 => ffi::AVSampleFormat::AV_SAMPLE_FMT_S16,
+        SampleFormat::S32 => ffi::AVSampleFormat::AV_SAMPLE_FMT_S32,
+        SampleFormat::F32 => ffi::AVSampleFormat::AV_SAMPLE_FMT_FLT,
+        SampleFormat::S16P => ffi::AVSampleFormat::AV_SAMPLE_FMT_S16P,
+        SampleFormat::F32P => ffi::AVSampleFormat::AV_SAMPLE_FMT_FLTP,
+    }
+}
+
+/// Most channels a plane array has room for
+const MAX_PLANES: usize = 8;
+
+/// Input the resampler is currently configured for
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct InputSpec {
+    format: SampleFormat,
+    channels: u32,
+    rate: u32,
+}
+
+/// Persistent libswresample context with a reusable output buffer
+pub(crate) struct Resampler {
+    ctx: *mut ffi::SwrContext,
+    input: Option<InputSpec>,
+    out_format: ffi::AVSampleFormat,
+    out_layout: ffi::AVChannelLayout,
+    out_rate: i32,
+    /// Converted samples, one pointer per plane
+    scratch: [*mut u8; MAX_PLANES],
+    scratch_samples: i32,
+}
+
+unsafe impl Send for Resampler {}
+
+impl Resampler {
+    /// Resampler producing `format`/`layout`/`rate` (the input is set with
+    /// [`Resampler::configure`])
+    pub fn new(
+        format: ffi::AVSampleFormat,
+        layout: &ffi::AVChannelLayout,
+        rate: i32,
+    ) -> Result<Self> {
+        let mut out_layout = unsafe { std::mem::zeroed::<ffi::AVChannelLayout>() };
+        let ret = unsafe { ffi::av_channel_layout_copy(&mut out_layout, layout) };
+        if ret < 0 {
+            return Err(av_error("Failed to copy channel layout", ret));
+        }
+
+        Ok(Self {
+            ctx: ptr::null_mut(),
+            input: None,
+            out_format: format,
+            out_layout,
+            out_rate: rate,
+            scratch: [ptr::null_mut(); MAX_PLANES],
+            scratch_samples: 0,
+        })
+    }
+
+    /// Point the context at a new input; a no-op if nothing changed
+    ///
+    /// Samples still buffered for the old input are flushed to `fifo`
+    /// first.
+    pub fn configure(
+        &mut self,
+        format: SampleFormat,
+        channels: u32,
+        rate: u32,
+        fifo: &mut AudioFifo,
+    ) -> Result<()> {
+        let spec = InputSpec {
+            format,
+            channels,
+            rate,
+        };
+        if self.input == Some(spec) {
+            return Ok(());
+        }
+        if channels == 0 || channels as usize > MAX_PLANES {
+            return Err(Error::AudioEncoder(format!(
+                "Unsupported channel count: {}",
+                channels
+            )));
+        }
+        self.flush(fifo)?;
+
+        unsafe {
+            let mut in_layout = std::mem::zeroed::<ffi::AVChannelLayout>();
+            ffi::av_channel_layout_default(&mut in_layout, channels as i32);
+
+            // Reuses the existing context when there is one
+            let ret = ffi::swr_alloc_set_opts2(
+                &mut self.ctx,
+                &self.out_layout,
+                self.out_format,
+                self.out_rate,
+                &in_layout,
+                av_sample_format(format),
+                rate as i32,
+                0,
+                ptr::null_mut(),
+            );
+            ffi::av_channel_layout_uninit(&mut in_layout);
+            if ret < 0 {
+                return Err(av_error("Failed to configure resampler", ret));
+            }
+
+            let ret = ffi::swr_init(self.ctx);
+            if ret < 0 {
+                return Err(av_error("Failed to initialize resampler", ret));
+            }
+        }
+
+        tracing::debug!(
+            "Audio resampler: {:?} {}ch {}Hz -> {}Hz",
+            format,
+            channels,
+            rate,
+            self.out_rate
+        );
+        self.input = Some(spec);
+        Ok(())
+    }
+
+    /// Convert interleaved (or back-to-back planar) `data` and append the
+    /// result to `fifo`
+    pub fn convert(&mut self, data: &[u8], fifo: &mut AudioFifo) -> Result<()> {
+        let spec = self.input.ok_or(Error::EncoderNotInitialized)?;
+        let frame_bytes = spec.channels as usize * spec.format.bytes_per_sample();
+        let samples = data.len() / frame_bytes;
+        if samples == 0 {
+            return Ok(());
+        }
+
+        let mut planes = [ptr::null::<u8>(); MAX_PLANES];
+        if spec.format.is_planar() {
+            let plane_bytes = samples * spec.format.bytes_per_sample();
+            for (ch, plane) in planes.iter_mut().take(spec.channels as usize).enumerate() {
+                *plane = data[ch * plane_bytes..].as_ptr();
+            }
+        } else {
+            planes[0] = data.as_ptr();
+        }
+
+        self.run(&planes, samples as i32, fifo)
+    }
+
+    /// Drain the samples the filter is still holding back into `fifo`
+    pub fn flush(&mut self, fifo: &mut AudioFifo) -> Result<()> {
+        if self.ctx.is_null() {
+            return Ok(());
+        }
+        self.run(&[ptr::null(); MAX_PLANES], 0, fifo)
+    }
+
+    /// Add (positive) or drop `samples` gradually over the next `distance`
+    /// output samples
+    pub fn compensate(&mut self, samples: i32, distance: i32) -> Result<()> {
+        if self.ctx.is_null() {
+            return Err(Error::EncoderNotInitialized);
+        }
+        let ret = unsafe { ffi::swr_set_compensation(self.ctx, samples, distance) };
+        if ret < 0 {
+            return Err(av_error("Failed to set resampler compensation", ret));
+        }
+        Ok(())
+    }
+
+    fn run(
+        &mut self,
+        planes: &[*const u8; MAX_PLANES],
+        samples: i32,
+        fifo: &mut AudioFifo,
+    ) -> Result<()> {
+        let input = if samples > 0 {
+            planes.as_ptr()
+        } else {
+            ptr::null()
+        };
+
+        unsafe {
+            let needed = ffi::swr_get_out_samples(self.ctx, samples);
+            if needed < 0 {
+                return Err(av_error("Failed to size resampler output", needed));
+            }
+            self.reserve(needed)?;
+
+            let converted = ffi::swr_convert(
+                self.ctx,
+                self.scratch.as_ptr() as _,
+                self.scratch_samples,
+                input as _,
+                samples,
+            );
+            if converted < 0 {
+                return Err(av_error("Resampling failed", converted));
+            }
+            fifo.write(&self.scratch, converted)
+        }
+    }
+
+    /// Grow the output buffer to hold at least `samples` (never shrinks)
+    fn reserve(&mut self, samples: i32) -> Result<()> {
+        if samples <= self.scratch_samples {
+            return Ok(());
+        }
+
+        unsafe {
+            self.free_scratch();
+            // Headroom so jittery quantum sizes do not keep reallocating
+            let samples = samples.max(1024) * 2;
+            let ret = ffi::av_samples_alloc(
+                self.scratch.as_mut_ptr(),
+                ptr::null_mut(),
+                self.out_layout.nb_channels,
+                samples,
+                self.out_format,
+                0,
+            );
+            if ret < 0 {
+                return Err(av_error("Failed to allocate resampler buffer", ret));
+            }
+            self.scratch_samples = samples;
+        }
+        Ok(())
+    }
+
+    unsafe fn free_scratch(&mut self) {
+        // All planes live in the allocation behind the first pointer
+        if !self.scratch[0].is_null() {
+            ffi::av_freep(&mut self.scratch[0] as *mut *mut u8 as *mut _);
+        }
+        self.scratch = [ptr::null_mut(); MAX_PLANES];
+        self.scratch_samples = 0;
+    }
+}
+
+impl Drop for Resampler {
+    fn drop(&mut self) {
+        unsafe {
+            self.free_scratch();
+            ffi::swr_free(&mut self.ctx);
+            ffi::av_channel_layout_uninit(&mut self.out_layout);
+        }
+    }
+}
+
+/// `AVAudioFifo` in the encoder's sample format
+pub(crate) struct AudioFifo {
+    fifo: *mut ffi::AVAudioFifo,
+}
+
+unsafe impl Send for AudioFifo {}
+
+impl AudioFifo {
+    /// FIFO with room for `samples` up front (it grows if it has to)
+    pub fn new(format: ffi::AVSampleFormat, channels: i32, samples: i32) -> Result<Self> {
+        let fifo = unsafe { ffi::av_audio_fifo_alloc(format, channels, samples) };
+        if fifo.is_null() {
+            return Err(Error::AudioEncoder("Failed to allocate audio FIFO".into()));
+        }
+        Ok(Self { fifo })
+    }
+
+    /// Samples buffered
+    pub fn len(&self) -> i32 {
+        unsafe { ffi::av_audio_fifo_size(self.fifo) }
+    }
+
+    /// Append `samples` from `planes`
+    ///
+    /// # Safety
+    /// `planes` must hold `samples` in the FIFO's format.
+    unsafe fn write(&mut self, planes: &[*mut u8; MAX_PLANES], samples: i32) -> Result<()> {
+        if samples == 0 {
+            return Ok(());
+        }
+        let ret = ffi::av_audio_fifo_write(self.fifo, planes.as_ptr() as _, samples);
+        if ret < 0 {
+            return Err(av_error("Audio FIFO write failed", ret));
+        }
+        Ok(())
+    }
+
+    /// Move up to `samples` into `frame`'s buffers, returning how many
+    ///
+    /// # Safety
+    /// `frame` must be writable with room for `samples` in the FIFO's
+    /// format.
+    pub unsafe fn read_into(&mut self, frame: *mut ffi::AVFrame, samples: i32) -> i32 {
+        ffi::av_audio_fifo_read(self.fifo, (*frame).data.as_ptr() as _, samples)
+    }
+}
+
+impl Drop for AudioFifo {
+    fn drop(&mut self) {
+        unsafe { ffi::av_audio_fifo_free(self.fifo) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const FLT: ffi::AVSampleFormat = ffi::AVSampleFormat::AV_SAMPLE_FMT_FLT;
+
+    /// Resampler and FIFO producing 48 kHz stereo float
+    fn converter() -> (Resampler, AudioFifo) {
+        let mut layout = unsafe { std::mem::zeroed::<ffi::AVChannelLayout>() };
+        unsafe { ffi::av_channel_layout_default(&mut layout, 2) };
+        let resampler = Resampler::new(FLT, &layout, 48_000).unwrap();
+        unsafe { ffi::av_channel_layout_uninit(&mut layout) };
+        (resampler, AudioFifo::new(FLT, 2, 1024).unwrap())
+    }
+
+    fn tone_sample(i: usize) -> f32 {
+        (i as f32 * 0.05).sin() * 0.5
+    }
+
+    /// Interleaved stereo F32 samples `range`
+    fn tone(range: std::ops::Range<usize>) -> Vec<u8> {
+        range
+            .flat_map(|i| [tone_sample(i); 2])
+            .flat_map(f32::to_ne_bytes)
+            .collect()
+    }
+
+    #[test]
+    fn test_passthrough_keeps_every_sample() {
+        let (mut resampler, mut fifo) = converter();
+        resampler
+            .configure(SampleFormat::F32, 2, 48_000, &mut fifo)
+            .unwrap();
+        for i in 0..4 {
+            resampler
+                .convert(&tone(i * 1024..(i + 1) * 1024), &mut fifo)
+                .unwrap();
+        }
+        resampler.flush(&mut fifo).unwrap();
+        assert_eq!(fifo.len(), 4096);
+    }
+
+    #[test]
+    fn test_resampling_keeps_duration() {
+        // One second of 44.1 kHz mono S16 becomes one second at 48 kHz
+        let (mut resampler, mut fifo) = converter();
+        resampler
+            .configure(SampleFormat::S16, 1, 44_100, &mut fifo)
+            .unwrap();
+        resampler
+            .convert(&vec![0u8; 44_100 * 2], &mut fifo)
+            .unwrap();
+        resampler.flush(&mut fifo).unwrap();
+        assert!(fifo.len().abs_diff(48_000) <= 32, "{} samples", fifo.len());
+    }
+
+    #[test]
+    fn test_reconfigure_flushes_the_old_input() {
+        let (mut resampler, mut fifo) = converter();
+        resampler
+            .configure(SampleFormat::F32, 2, 44_100, &mut fifo)
+            .unwrap();
+        resampler.convert(&tone(0..4410), &mut fifo).unwrap();
+
+        // Nothing held back across the switch: 100ms at 48 kHz
+        resampler
+            .configure(SampleFormat::F32, 2, 48_000, &mut fifo)
+            .unwrap();
+        assert!(fifo.len().abs_diff(4800) <= 32, "{} samples", fifo.len());
+
+        assert!(resampler
+            .configure(SampleFormat::F32, 0, 48_000, &mut fifo)
+            .is_err());
+    }
+
+    #[test]
+    fn test_fifo_hands_out_frames_in_order() {
+        let (mut resampler, mut fifo) = converter();
+        resampler
+            .configure(SampleFormat::F32, 2, 48_000, &mut fifo)
+            .unwrap();
+        resampler.convert(&tone(0..1500), &mut fifo).unwrap();
+        resampler.flush(&mut fifo).unwrap();
+
+        unsafe {
+            let mut frame = ffi::av_frame_alloc();
+            (*frame).nb_samples = 1024;
+            (*frame).format = FLT as i32;
+            ffi::av_channel_layout_default(&mut (*frame).ch_layout, 2);
+            assert!(ffi::av_frame_get_buffer(frame, 0) >= 0);
+
+            assert_eq!(fifo.read_into(frame, 1024), 1024);
+            assert_eq!(fifo.len(), 476);
+            // The short last frame carries on where the first stopped
+            assert_eq!(fifo.read_into(frame, 1024), 476);
+            let first = *((*frame).data[0] as *const f32);
+            assert!((first - tone_sample(1024)).abs() < 1e-6);
+
+            ffi::av_frame_free(&mut frame);
+        }
+        assert_eq!(fifo.len(), 0);
+    }
+
+    #[test]
+    fn test_compensate_needs_an_input() {
+        let (mut resampler, _) = converter();
+        assert!(resampler.compensate(48, 48_000).is_err());
+    }
+}
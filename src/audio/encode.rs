@@ -2,10 +2,13 @@
 //!
 //! Supports AAC and Opus codecs.
 
+use crate::clock;
 use crate::error::{Error, Result};
+use super::convert::{AudioFifo, Resampler};
 use super::types::{AudioFrame, AudioPacket, AudioParams, ChannelLayout, SampleFormat};
 
 use ffmpeg_next as ffmpeg;
+use ffmpeg_next::ffi;
 
 /// Audio codec
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
@@ -52,6 +55,26 @@ impl AudioCodec {
         }
     }
 
+    /// Samples per frame when the encoder does not report one
+    pub fn frame_size(&self) -> u32 {
+        match self {
+            AudioCodec::Aac => 1024,
+            AudioCodec::Opus => 960, // 20ms at 48kHz
+            AudioCodec::Mp3 => 1152,
+            AudioCodec::Flac => 4608,
+        }
+    }
+
+    /// Sample format the encoder is opened with
+    pub fn sample_format(&self) -> ffi::AVSampleFormat {
+        match self {
+            AudioCodec::Aac | AudioCodec::Mp3 => ffi::AVSampleFormat::AV_SAMPLE_FMT_FLTP,
+            // libopus only takes interleaved input
+            AudioCodec::Opus => ffi::AVSampleFormat::AV_SAMPLE_FMT_FLT,
+            AudioCodec::Flac => ffi::AVSampleFormat::AV_SAMPLE_FMT_S16,
+        }
+    }
+
     /// Recommended bitrate for this codec (for stereo)
     pub fn recommended_bitrate(&self) -> u32 {
         match self {
@@ -123,6 +146,10 @@ pub trait AudioEncoder: Send {
     /// Encode audio frame
     fn encode(&mut self, frame: &AudioFrame) -> Result<Option<AudioPacket>>;
 
+    /// Encode raw samples in the configured input format, appending every
+    /// packet that completes to `packets`
+    fn encode_samples(&mut self, data: &[u8], packets: &mut Vec<AudioPacket>) -> Result<()>;
+
     /// Flush remaining frames
     fn flush(&mut self) -> Result<Vec<AudioPacket>>;
 
@@ -143,9 +170,17 @@ pub struct AudioEncoderStats {
 }
 
 /// FFmpeg-based audio encoder
+///
+/// Input goes through a persistent resampler into a FIFO, and the encoder
+/// is fed exact `frame_size` frames from it through one reused frame.
 pub struct FfmpegAudioEncoder {
     config: AudioEncoderConfig,
     encoder: Option<ffmpeg::encoder::Audio>,
+    resampler: Option<Resampler>,
+    fifo: Option<AudioFifo>,
+    frame: ffmpeg::frame::Audio,
+    /// Packets completed beyond the one `encode` returned
+    backlog: Vec<AudioPacket>,
     stats: AudioEncoderStats,
     pts: i64,
     frame_size: u32,
@@ -157,12 +192,101 @@ impl FfmpegAudioEncoder {
         Ok(Self {
             config,
             encoder: None,
+            resampler: None,
+            fifo: None,
+            frame: ffmpeg::frame::Audio::empty(),
+            backlog: Vec::new(),
             stats: AudioEncoderStats::default(),
             pts: 0,
             frame_size: 1024,
             initialized: false,
         })
     }
+
+    /// Start the timeline at `pts_us` on the pipeline clock (before the first
+    /// samples are encoded), so audio lines up with video in the muxer
+    pub fn set_start_pts(&mut self, pts_us: i64) {
+        self.pts = pts_us * self.config.sample_rate as i64 / clock::TICKS_PER_SEC as i64;
+    }
+
+    /// Stretch (positive) or squeeze the stream by `samples` spread over the
+    /// next `distance` samples, to follow clock drift
+    pub fn compensate(&mut self, samples: i32, distance: i32) -> Result<()> {
+        let (resampler, _) = self.converter()?;
+        resampler.compensate(samples, distance)
+    }
+
+    fn converter(&mut self) -> Result<(&mut Resampler, &mut AudioFifo)> {
+        match (self.resampler.as_mut(), self.fifo.as_mut()) {
+            (Some(resampler), Some(fifo)) => Ok((resampler, fifo)),
+            _ => Err(Error::EncoderNotInitialized),
+        }
+    }
+
+    /// Feed whole frames from the FIFO to the encoder (and the short
+    /// remainder too when `last`)
+    fn drain_fifo(&mut self, last: bool, packets: &mut Vec<AudioPacket>) -> Result<()> {
+        let frame_size = self.frame_size as i32;
+
+        loop {
+            let fifo = self.fifo.as_mut().ok_or(Error::EncoderNotInitialized)?;
+            let queued = fifo.len();
+            if queued == 0 || (queued < frame_size && !last) {
+                return Ok(());
+            }
+
+            let samples = unsafe {
+                let frame = self.frame.as_mut_ptr();
+                // Copies only if the encoder still holds the last frame
+                (*frame).nb_samples = frame_size;
+                let ret = ffi::av_frame_make_writable(frame);
+                if ret < 0 {
+                    return Err(Error::Ffmpeg(format!(
+                        "Audio frame not writable: {}",
+                        ffmpeg::Error::from(ret)
+                    )));
+                }
+                let samples = fifo.read_into(frame, frame_size);
+                (*frame).nb_samples = samples;
+                samples
+            };
+            self.frame.set_pts(Some(self.pts));
+            self.pts += samples as i64;
+
+            let encoder = self.encoder.as_mut().ok_or(Error::EncoderNotInitialized)?;
+            encoder
+                .send_frame(&self.frame)
+                .map_err(|e| Error::Ffmpeg(format!("Send frame failed: {}", e)))?;
+            self.receive_packets(packets)?;
+        }
+    }
+
+    /// Collect every packet the encoder has ready
+    fn receive_packets(&mut self, packets: &mut Vec<AudioPacket>) -> Result<()> {
+        let encoder = self.encoder.as_mut().ok_or(Error::EncoderNotInitialized)?;
+        let mut packet = ffmpeg::Packet::empty();
+
+        loop {
+            match encoder.receive_packet(&mut packet) {
+                Ok(()) => {
+                    self.stats.frames_encoded += 1;
+                    self.stats.bytes_output += packet.size() as u64;
+
+                    packets.push(AudioPacket {
+                        data: packet.data().unwrap_or(&[]).to_vec(),
+                        pts: packet.pts().unwrap_or(0),
+                        dts: packet.dts().unwrap_or(0),
+                        duration: packet.duration(),
+                    });
+                }
+                Err(ffmpeg::Error::Eof) => return Ok(()),
+                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => {
+                    return Ok(())
+                }
+                Err(e) => return Err(Error::Ffmpeg(format!("Receive packet failed: {}", e))),
+            }
+        }
+    }
 }
 
 impl AudioEncoder for FfmpegAudioEncoder {
@@ -191,7 +315,7 @@ impl AudioEncoder for FfmpegAudioEncoder {
         unsafe {
             let ctx = encoder.as_mut_ptr();
             (*ctx).sample_rate = self.config.sample_rate as i32;
-            (*ctx).sample_fmt = ffmpeg_next::ffi::AVSampleFormat::AV_SAMPLE_FMT_FLTP;
+            (*ctx).sample_fmt = self.config.codec.sample_format();
             (*ctx).bit_rate = self.config.bitrate as i64;
             (*ctx).time_base = ffmpeg_next::ffi::AVRational {
                 num: 1,
@@ -209,12 +333,46 @@ impl AudioEncoder for FfmpegAudioEncoder {
             .open()
             .map_err(|e| Error::Ffmpeg(format!("Failed to open audio encoder: {}", e)))?;
 
-        // Get frame size from encoder
+        // Get frame size from encoder (0 = variable, use the codec default)
         self.frame_size = unsafe { (*encoder.as_ptr()).frame_size as u32 };
         if self.frame_size == 0 {
-            self.frame_size = 1024;
+            self.frame_size = self.config.codec.frame_size();
         }
 
+        // Conversion, framing and the reused input frame
+        let format = self.config.codec.sample_format();
+        let (mut resampler, mut fifo) = unsafe {
+            let ctx = encoder.as_ptr();
+            let resampler = Resampler::new(format, &(*ctx).ch_layout, (*ctx).sample_rate)?;
+            let fifo = AudioFifo::new(
+                format,
+                (*ctx).ch_layout.nb_channels,
+                self.frame_size as i32 * 4,
+            )?;
+
+            let frame = self.frame.as_mut_ptr();
+            (*frame).format = format as i32;
+            (*frame).sample_rate = (*ctx).sample_rate;
+            (*frame).nb_samples = self.frame_size as i32;
+            let mut ret = ffi::av_channel_layout_copy(&mut (*frame).ch_layout, &(*ctx).ch_layout);
+            if ret >= 0 {
+                ret = ffi::av_frame_get_buffer(frame, 0);
+            }
+            if ret < 0 {
+                return Err(Error::Ffmpeg(format!(
+                    "Failed to allocate audio frame: {}",
+                    ffmpeg::Error::from(ret)
+                )));
+            }
+            (resampler, fifo)
+        };
+        resampler.configure(
+            self.config.input_format,
+            self.config.channels.channels(),
+            self.config.sample_rate,
+            &mut fifo,
+        )?;
+
         tracing::info!(
             "Audio encoder initialized: {} @ {}Hz, {} channels, {} kbps, frame_size={}",
             self.config.codec.display_name(),
@@ -225,6 +383,8 @@ impl AudioEncoder for FfmpegAudioEncoder {
         );
 
         self.encoder = Some(encoder);
+        self.resampler = Some(resampler);
+        self.fifo = Some(fifo);
         self.initialized = true;
         Ok(())
     }
@@ -234,81 +394,52 @@ impl AudioEncoder for FfmpegAudioEncoder {
             self.init()?;
         }
 
-        let encoder = self.encoder.as_mut().ok_or(Error::EncoderNotInitialized)?;
+        // Follows rate/layout changes without dropping what is in flight
+        let (resampler, fifo) = self.converter()?;
+        resampler.configure(frame.format, frame.channels, frame.sample_rate, fifo)?;
+        resampler.convert(&frame.data, fifo)?;
 
-        // Create FFmpeg audio frame
-        let mut ff_frame = ffmpeg::frame::Audio::new(
-            ffmpeg::format::Sample::F32(ffmpeg::format::sample::Type::Planar),
-            frame.samples as usize,
-            ffmpeg::channel_layout::ChannelLayout::STEREO,
-        );
-
-        ff_frame.set_rate(self.config.sample_rate);
-        ff_frame.set_pts(Some(self.pts));
-        self.pts += frame.samples as i64;
+        let mut packets = std::mem::take(&mut self.backlog);
+        self.drain_fifo(false, &mut packets)?;
+        if packets.is_empty() {
+            return Ok(None);
+        }
+        let first = packets.remove(0);
+        self.backlog = packets;
+        Ok(Some(first))
+    }
 
-        // Copy audio data - basic conversion
-        let plane = ff_frame.data_mut(0);
-        let copy_len = plane.len().min(frame.data.len());
-        plane[..copy_len].copy_from_slice(&frame.data[..copy_len]);
+    fn encode_samples(&mut self, data: &[u8], packets: &mut Vec<AudioPacket>) -> Result<()> {
+        if !self.initialized {
+            self.init()?;
+        }
 
-        // Send frame to encoder
-        encoder
-            .send_frame(&ff_frame)
-            .map_err(|e| Error::Ffmpeg(format!("Send frame failed: {}", e)))?;
+        let format = self.config.input_format;
+        let channels = self.config.channels.channels();
+        let rate = self.config.sample_rate;
+        let (resampler, fifo) = self.converter()?;
+        resampler.configure(format, channels, rate, fifo)?;
+        resampler.convert(data, fifo)?;
 
-        // Receive encoded packet
-        let mut packet = ffmpeg::Packet::empty();
-        match encoder.receive_packet(&mut packet) {
-            Ok(()) => {
-                self.stats.frames_encoded += 1;
-                self.stats.bytes_output += packet.size() as u64;
-
-                let audio_packet = AudioPacket {
-                    data: packet.data().unwrap_or(&[]).to_vec(),
-                    pts: packet.pts().unwrap_or(0),
-                    dts: packet.dts().unwrap_or(0),
-                    duration: packet.duration(),
-                };
-                Ok(Some(audio_packet))
-            }
-            Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => Ok(None),
-            Err(e) => Err(Error::Ffmpeg(format!("Receive packet failed: {}", e))),
-        }
+        packets.append(&mut self.backlog);
+        self.drain_fifo(false, packets)
     }
 
     fn flush(&mut self) -> Result<Vec<AudioPacket>> {
-        let encoder = self.encoder.as_mut().ok_or(Error::EncoderNotInitialized)?;
+        let mut packets = std::mem::take(&mut self.backlog);
+
+        let (resampler, fifo) = self.converter()?;
+        resampler.flush(fifo)?;
+        self.drain_fifo(true, &mut packets)?;
 
+        let encoder = self.encoder.as_mut().ok_or(Error::EncoderNotInitialized)?;
         encoder
             .send_eof()
             .map_err(|e| Error::Ffmpeg(format!("Send EOF failed: {}", e)))?;
 
-        let mut packets = Vec::new();
-        let mut packet = ffmpeg::Packet::empty();
-
-        loop {
-            match encoder.receive_packet(&mut packet) {
-                Ok(()) => {
-                    self.stats.frames_encoded += 1;
-                    self.stats.bytes_output += packet.size() as u64;
-
-                    packets.push(AudioPacket {
-                        data: packet.data().unwrap_or(&[]).to_vec(),
-                        pts: packet.pts().unwrap_or(0),
-                        dts: packet.dts().unwrap_or(0),
-                        duration: packet.duration(),
-                    });
-                }
-                Err(ffmpeg::Error::Eof) => break,
-                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => break,
-                Err(e) => {
-                    tracing::warn!("Error during flush: {}", e);
-                    break;
-                }
-            }
+        if let Err(e) = self.receive_packets(&mut packets) {
+            tracing::warn!("Error during flush: {}", e);
         }
-
         Ok(packets)
     }
 
@@ -5,7 +5,9 @@
 //! - FFmpeg audio encoding (AAC, Opus)
 
 mod capture;
+mod convert;
 mod encode;
+mod ring;
 mod types;
 
 pub use capture::{AudioCapture, AudioCaptureConfig, AudioSource, PipeWireAudioCapture};
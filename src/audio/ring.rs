@@ -0,0 +1,274 @@
+//! Single-producer single-consumer sample ring
+//!
+//! Carries raw samples out of the PipeWire realtime callback: the buffer is
+//! allocated once up front and both ends only touch atomics, so pushing a
+//! quantum never allocates, locks or blocks. Each push also bumps an
+//! eventfd (a non-blocking write) that a waiting reader sleeps on.
+//!
+//! Quanta dropped because the ring was full leave a gap at the point they
+//! were lost; the reader stops there and takes the gap's size, so silence
+//! can go back in where the samples were.
+
+use std::cell::UnsafeCell;
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+struct Shared {
+    buf: Box<[UnsafeCell<u8>]>,
+    /// Total bytes ever read
+    head: AtomicUsize,
+    /// Total bytes ever written
+    tail: AtomicUsize,
+    /// Bytes dropped because the ring was full, since the reader last took
+    /// a gap
+    gap: AtomicUsize,
+    /// Write position of that gap
+    gap_at: AtomicUsize,
+    closed: AtomicBool,
+    /// eventfd signalled on every push and on close
+    wakeup: OwnedFd,
+}
+
+// The producer only writes the free region and the consumer only reads the
+// filled one; head/tail hand ownership of bytes between them
+unsafe impl Sync for Shared {}
+
+impl Shared {
+    fn capacity(&self) -> usize {
+        self.buf.len()
+    }
+
+    fn ptr(&self) -> *mut u8 {
+        UnsafeCell::raw_get(self.buf.as_ptr())
+    }
+
+    fn signal(&self) {
+        let one = 1u64;
+        // SAFETY: eventfd writes are a single u64; never blocks (O_NONBLOCK)
+        unsafe {
+            libc::write(self.wakeup.as_raw_fd(), (&one as *const u64).cast(), 8);
+        }
+    }
+}
+
+/// Create a ring holding `capacity` bytes
+pub fn sample_ring(capacity: usize) -> std::io::Result<(RingProducer, RingConsumer)> {
+    // SAFETY: plain syscall; the fd is owned below
+    let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+    if fd < 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+    let shared = Arc::new(Shared {
+        buf: (0..capacity.max(1)).map(|_| UnsafeCell::new(0)).collect(),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        gap: AtomicUsize::new(0),
+        gap_at: AtomicUsize::new(0),
+        closed: AtomicBool::new(false),
+        // SAFETY: `fd` is a fresh eventfd nothing else owns
+        wakeup: unsafe { OwnedFd::from_raw_fd(fd) },
+    });
+    Ok((
+        RingProducer {
+            shared: shared.clone(),
+        },
+        RingConsumer { shared },
+    ))
+}
+
+/// Writing end, owned by the capture callback
+pub struct RingProducer {
+    shared: Arc<Shared>,
+}
+
+impl RingProducer {
+    /// Append `data` whole, or drop it and record a gap if it does not fit
+    /// (so the consumer never sees a partial quantum)
+    pub fn push(&mut self, data: &[u8]) -> bool {
+        let shared = &*self.shared;
+        let tail = shared.tail.load(Ordering::Relaxed);
+        let head = shared.head.load(Ordering::Acquire);
+        if data.len() > shared.capacity() - (tail - head) {
+            // Later drops before the reader gets here join this gap
+            if shared.gap.load(Ordering::Acquire) == 0 {
+                shared.gap_at.store(tail, Ordering::Relaxed);
+            }
+            shared.gap.fetch_add(data.len(), Ordering::Release);
+            return false;
+        }
+
+        let start = tail % shared.capacity();
+        let first = data.len().min(shared.capacity() - start);
+        unsafe {
+            std::ptr::copy_nonoverlapping(data.as_ptr(), shared.ptr().add(start), first);
+            std::ptr::copy_nonoverlapping(
+                data.as_ptr().add(first),
+                shared.ptr(),
+                data.len() - first,
+            );
+        }
+        shared.tail.store(tail + data.len(), Ordering::Release);
+        shared.signal();
+        true
+    }
+}
+
+impl Drop for RingProducer {
+    fn drop(&mut self) {
+        self.shared.closed.store(true, Ordering::Release);
+        self.shared.signal();
+    }
+}
+
+/// Reading end
+pub struct RingConsumer {
+    shared: Arc<Shared>,
+}
+
+impl RingConsumer {
+    /// Bytes ready to read before the next gap
+    pub fn available(&self) -> usize {
+        let shared = &*self.shared;
+        let head = shared.head.load(Ordering::Relaxed);
+        let tail = shared.tail.load(Ordering::Acquire);
+        match self.gap_at() {
+            Some(at) => tail.min(at.max(head)) - head,
+            None => tail - head,
+        }
+    }
+
+    /// Write position of the pending gap, if any
+    fn gap_at(&self) -> Option<usize> {
+        let shared = &*self.shared;
+        (shared.gap.load(Ordering::Acquire) > 0).then(|| shared.gap_at.load(Ordering::Relaxed))
+    }
+
+    /// Has reading caught up with a gap, so [`Self::take_overrun`] returns
+    /// its size?
+    pub fn at_gap(&self) -> bool {
+        let head = self.shared.head.load(Ordering::Relaxed);
+        self.gap_at().is_some_and(|at| head >= at)
+    }
+
+    /// Copy up to `buf.len()` bytes out, stopping at a gap, returning how
+    /// many were read
+    pub fn pop(&mut self, buf: &mut [u8]) -> usize {
+        let shared = &*self.shared;
+        let head = shared.head.load(Ordering::Relaxed);
+        let len = buf.len().min(self.available());
+
+        let start = head % shared.capacity();
+        let first = len.min(shared.capacity() - start);
+        unsafe {
+            std::ptr::copy_nonoverlapping(shared.ptr().add(start), buf.as_mut_ptr(), first);
+            std::ptr::copy_nonoverlapping(shared.ptr(), buf.as_mut_ptr().add(first), len - first);
+        }
+        shared.head.store(head + len, Ordering::Release);
+        len
+    }
+
+    /// Bytes the producer dropped at the current read position (0 until
+    /// reading reaches a gap)
+    pub fn take_overrun(&mut self) -> usize {
+        if !self.at_gap() {
+            return 0;
+        }
+        self.shared.gap.swap(0, Ordering::AcqRel)
+    }
+
+    /// Has the producer gone away?
+    pub fn is_closed(&self) -> bool {
+        self.shared.closed.load(Ordering::Acquire)
+    }
+
+    /// Sleep until the producer pushes or closes, or `timeout` passes
+    pub fn wait(&self, timeout: Duration) {
+        let fd = self.shared.wakeup.as_raw_fd();
+        let mut poll = libc::pollfd {
+            fd,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let ms = timeout.as_micros().div_ceil(1000).min(i32::MAX as u128) as i32;
+        let mut count = 0u64;
+        // SAFETY: one pollfd; eventfd reads are a single u64
+        unsafe {
+            if libc::poll(&mut poll, 1, ms) > 0 {
+                libc::read(fd, (&mut count as *mut u64).cast(), 8);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_wraparound_and_overrun() {
+        let (mut tx, mut rx) = sample_ring(8).unwrap();
+        let mut out = [0u8; 8];
+
+        assert!(tx.push(&[1, 2, 3, 4, 5, 6]));
+        assert_eq!(rx.pop(&mut out[..4]), 4);
+        assert_eq!(&out[..4], &[1, 2, 3, 4]);
+
+        // Wraps past the end of the buffer
+        assert!(tx.push(&[7, 8, 9, 10, 11, 12]));
+        // Full: dropped whole, leaving a gap after the samples before it
+        assert!(!tx.push(&[13, 14]));
+        assert_eq!(rx.take_overrun(), 0);
+
+        assert_eq!(rx.available(), 8);
+        assert_eq!(rx.pop(&mut out), 8);
+        assert_eq!(out, [5, 6, 7, 8, 9, 10, 11, 12]);
+        assert_eq!(rx.pop(&mut out), 0);
+        assert!(rx.at_gap());
+        assert_eq!(rx.take_overrun(), 2);
+        assert_eq!(rx.take_overrun(), 0);
+
+        assert!(!rx.is_closed());
+        drop(tx);
+        assert!(rx.is_closed());
+    }
+
+    #[test]
+    fn test_reading_stops_at_a_gap() {
+        let (mut tx, mut rx) = sample_ring(8).unwrap();
+        let mut out = [0u8; 8];
+
+        assert!(tx.push(&[1, 2, 3, 4]));
+        assert!(!tx.push(&[0; 6]));
+        assert!(!tx.push(&[0; 6]));
+        assert_eq!(rx.pop(&mut out[..2]), 2);
+
+        // Room again: what follows the gap waits behind it
+        assert!(tx.push(&[5, 6]));
+        assert_eq!(rx.available(), 2);
+        assert_eq!(rx.pop(&mut out), 2);
+        assert_eq!(&out[..2], &[3, 4]);
+        assert_eq!(rx.take_overrun(), 12);
+
+        assert_eq!(rx.pop(&mut out), 2);
+        assert_eq!(&out[..2], &[5, 6]);
+    }
+
+    #[test]
+    fn test_wait_wakes_on_push() {
+        let (mut tx, rx) = sample_ring(8).unwrap();
+        let pusher = std::thread::spawn(move || {
+            std::thread::sleep(Duration::from_millis(20));
+            tx.push(&[1]);
+        });
+
+        let start = std::time::Instant::now();
+        while rx.available() == 0 {
+            rx.wait(Duration::from_secs(5));
+        }
+        assert!(start.elapsed() < Duration::from_secs(5));
+        pusher.join().unwrap();
+        assert!(rx.is_closed());
+    }
+}
@@ -0,0 +1,434 @@
+//! Multi-source scene compositor
+//!
+//! Runs several captures at once and draws their latest frames into one
+//! canvas, each scaled into its layer rectangle and blended bottom to top.
+//! Every source feeds a keep-latest queue from its own task, so a slow or
+//! stalled source never holds back the composite; it just keeps showing
+//! its last frame. The canvas is drawn in bands of rows so each band stays
+//! in cache while all layers are blended into it.
+
+use super::{Capture, DmaBufImporter};
+use crate::clock::PipelineClock;
+use crate::config::{BackpressurePolicy, QueueConfig, SceneConfig};
+use crate::error::{Error, Result};
+use crate::pool::{FramePool, PoolKey};
+use crate::processing::kernels::{self, PlaneMut, PlaneRef};
+use crate::processing::ProcessingGraph;
+use crate::queue::{self, Push, QueueReceiver};
+use crate::types::{Frame, FrameFormat, Framerate, Rect, Resolution};
+
+use parking_lot::Mutex;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::task::JoinHandle;
+use tokio::time::{Interval, MissedTickBehavior};
+
+/// Canvas rows drawn per band
+const TILE_ROWS: u32 = 32;
+
+/// Longest a source task waits on one frame before rechecking for stop
+const SOURCE_POLL: Duration = Duration::from_millis(100);
+
+/// A layer's source frame, scaled to its rectangle
+struct LayerState {
+    graph: ProcessingGraph,
+    scaled: Option<Frame>,
+    /// pts of the source frame behind `scaled`
+    source_pts: i64,
+}
+
+/// Per-frame state, touched only from `next_frame`
+struct Renderer {
+    ticker: Option<Interval>,
+    receivers: Vec<QueueReceiver<Frame>>,
+    /// Newest frame seen from each source
+    latest: Vec<Option<Frame>>,
+    layers: Vec<LayerState>,
+    importer: Option<DmaBufImporter>,
+}
+
+/// Layer ready to draw
+struct Drawable<'a> {
+    frame: &'a Frame,
+    /// Canvas area covered (the frame's top-left lands on its origin)
+    area: Rect,
+    opacity: u8,
+    use_alpha: bool,
+}
+
+/// Capture that composites other captures according to a [`SceneConfig`]
+pub struct CompositorCapture {
+    scene: SceneConfig,
+    framerate: Framerate,
+    /// Sources while stopped (moved into their tasks while running)
+    sources: Vec<Box<dyn Capture>>,
+    tasks: Vec<JoinHandle<Box<dyn Capture>>>,
+    running: Arc<AtomicBool>,
+    frames_dropped: Arc<AtomicU64>,
+    renderer: Mutex<Renderer>,
+}
+
+impl CompositorCapture {
+    /// Compositor over `sources`, indexed by the scene's layers
+    pub fn new(
+        sources: Vec<Box<dyn Capture>>,
+        scene: SceneConfig,
+        framerate: Framerate,
+    ) -> Result<Self> {
+        let Resolution { width, height } = scene.resolution;
+        if width == 0 || height == 0 {
+            return Err(Error::Config("Scene resolution must be non-zero".into()));
+        }
+        for (i, layer) in scene.layers.iter().enumerate() {
+            if layer.source >= sources.len() {
+                return Err(Error::Config(format!(
+                    "Scene layer {} uses source {}, but only {} are configured",
+                    i,
+                    layer.source,
+                    sources.len()
+                )));
+            }
+            if layer.rect.is_empty() {
+                return Err(Error::Config(format!("Scene layer {} is empty", i)));
+            }
+        }
+
+        let layers = scene
+            .layers
+            .iter()
+            .map(|layer| LayerState {
+                graph: ProcessingGraph::new(
+                    Some(Resolution::new(layer.rect.width, layer.rect.height)),
+                    Some(FrameFormat::Bgra),
+                    None,
+                ),
+                scaled: None,
+                source_pts: i64::MIN,
+            })
+            .collect();
+
+        Ok(Self {
+            scene,
+            framerate,
+            sources,
+            tasks: Vec::new(),
+            running: Arc::new(AtomicBool::new(false)),
+            frames_dropped: Arc::new(AtomicU64::new(0)),
+            renderer: Mutex::new(Renderer {
+                ticker: None,
+                receivers: Vec::new(),
+                latest: Vec::new(),
+                layers,
+                importer: None,
+            }),
+        })
+    }
+}
+
+#[async_trait::async_trait]
+impl Capture for CompositorCapture {
+    async fn start(&mut self) -> Result<()> {
+        if self.running.load(Ordering::SeqCst) {
+            return Ok(());
+        }
+        for source in &mut self.sources {
+            source.start().await?;
+        }
+
+        self.running.store(true, Ordering::SeqCst);
+        let renderer = self.renderer.get_mut();
+        renderer.receivers.clear();
+        renderer.latest = self.sources.iter().map(|_| None).collect();
+
+        for (i, mut source) in self.sources.drain(..).enumerate() {
+            let (tx, rx) = queue::frame_queue(
+                QueueConfig::default().with_policy(BackpressurePolicy::KeepLatest),
+            );
+            renderer.receivers.push(rx);
+
+            let running = self.running.clone();
+            let dropped = self.frames_dropped.clone();
+            self.tasks.push(tokio::spawn(async move {
+                while running.load(Ordering::SeqCst) {
+                    match tokio::time::timeout(SOURCE_POLL, source.next_frame()).await {
+                        // Filler frames would replace the source's last real one
+                        Ok(Ok(frame)) if !has_content(&frame) => {}
+                        Ok(Ok(frame)) => match tx.push(frame) {
+                            Push::Disconnected => break,
+                            push => {
+                                dropped.fetch_add(push.dropped() as u64, Ordering::Relaxed);
+                            }
+                        },
+                        Ok(Err(e)) => {
+                            tracing::warn!("Scene source {} error: {}", i, e);
+                            tokio::time::sleep(SOURCE_POLL).await;
+                        }
+                        Err(_) => {}
+                    }
+                }
+                source
+            }));
+        }
+
+        let mut ticker = tokio::time::interval(Duration::from_micros(
+            self.framerate.frame_duration_us() as u64,
+        ));
+        ticker.set_missed_tick_behavior(MissedTickBehavior::Skip);
+        renderer.ticker = Some(ticker);
+
+        tracing::info!(
+            "Compositing {} layers from {} sources at {}",
+            self.scene.layers.len(),
+            self.tasks.len(),
+            self.scene.resolution
+        );
+        Ok(())
+    }
+
+    async fn stop(&mut self) -> Result<()> {
+        self.running.store(false, Ordering::SeqCst);
+        let renderer = self.renderer.get_mut();
+        renderer.ticker = None;
+        renderer.receivers.clear();
+        renderer.latest.clear();
+
+        for task in self.tasks.drain(..) {
+            let source = task
+                .await
+                .map_err(|e| Error::Pipeline(format!("Scene source task failed: {}", e)))?;
+            self.sources.push(source);
+        }
+
+        let mut result = Ok(());
+        for source in &mut self.sources {
+            if let Err(e) = source.stop().await {
+                result = Err(e);
+            }
+        }
+        result
+    }
+
+    async fn next_frame(&mut self) -> Result<Frame> {
+        if !self.running.load(Ordering::SeqCst) {
+            return Err(Error::CaptureNotStarted);
+        }
+
+        let renderer = self.renderer.get_mut();
+        renderer
+            .ticker
+            .as_mut()
+            .ok_or(Error::CaptureNotStarted)?
+            .tick()
+            .await;
+
+        for (rx, latest) in renderer.receivers.iter().zip(renderer.latest.iter_mut()) {
+            while let Ok(received) = rx.try_recv() {
+                *latest = Some(received.item);
+            }
+        }
+
+        let Renderer {
+            latest,
+            layers,
+            importer,
+            ..
+        } = renderer;
+
+        // Bring every layer's scaled frame up to date
+        for (i, (layer, state)) in self.scene.layers.iter().zip(layers.iter_mut()).enumerate() {
+            let Some(source) = latest[layer.source].as_ref() else {
+                continue;
+            };
+            if state.scaled.is_some() && (source.pts == state.source_pts || source.is_static()) {
+                continue;
+            }
+
+            let scaled = match &source.dmabuf {
+                Some(dmabuf) => importer
+                    .get_or_insert_with(Default::default)
+                    .download(dmabuf, FramePool::global())
+                    .and_then(|downloaded| state.graph.process(&downloaded)),
+                None => state.graph.process(source),
+            };
+            // Not retried: a failed frame leaves the layer on its last good one
+            state.source_pts = source.pts;
+            match scaled {
+                Ok(scaled) => state.scaled = Some(scaled),
+                Err(e) => tracing::warn!("Scene layer {} kept its last frame: {}", i, e),
+            }
+        }
+
+        let Resolution { width, height } = self.scene.resolution;
+        let drawables: Vec<Drawable> = self
+            .scene
+            .layers
+            .iter()
+            .zip(layers.iter())
+            .filter_map(|(layer, state)| {
+                let frame = state.scaled.as_ref()?;
+                let area = layer.rect.clamp(width, height);
+                let opacity = (layer.opacity.clamp(0.0, 1.0) * 255.0).round() as u8;
+                (!area.is_empty() && opacity > 0).then_some(Drawable {
+                    frame,
+                    area,
+                    opacity,
+                    use_alpha: layer.use_alpha,
+                })
+            })
+            .collect();
+
+        let key = PoolKey::packed(width, height, FrameFormat::Bgra);
+        let mut data = FramePool::global().acquire(key);
+        draw(
+            data.make_mut(),
+            key.stride as usize,
+            self.scene.resolution,
+            self.scene.background,
+            &drawables,
+        )?;
+
+        let mut frame = Frame::with_buffer(data, width, height, key.stride, FrameFormat::Bgra);
+        frame.pts = PipelineClock::global().now();
+        frame.duration = self.framerate.frame_duration_us();
+        Ok(frame)
+    }
+
+    fn is_active(&self) -> bool {
+        self.running.load(Ordering::SeqCst)
+    }
+
+    fn resolution(&self) -> Option<Resolution> {
+        Some(self.scene.resolution)
+    }
+
+    fn framerate(&self) -> Option<Framerate> {
+        Some(self.framerate)
+    }
+
+    fn frames_dropped(&self) -> u64 {
+        self.frames_dropped.load(Ordering::Relaxed)
+    }
+}
+
+/// Does `frame` carry new pixels (not an empty or unchanged filler)?
+fn has_content(frame: &Frame) -> bool {
+    !frame.is_static() && (frame.dmabuf.is_some() || !frame.data.is_empty())
+}
+
+/// Fill `canvas` (packed BGRA) with `background` and draw `layers` over it,
+/// band by band
+fn draw(
+    canvas: &mut [u8],
+    stride: usize,
+    size: Resolution,
+    background: [u8; 4],
+    layers: &[Drawable],
+) -> Result<()> {
+    let row_bytes = size.width as usize * 4;
+
+    for band in (0..size.height).step_by(TILE_ROWS as usize) {
+        let band_end = (band + TILE_ROWS).min(size.height);
+
+        for row in band..band_end {
+            let start = row as usize * stride;
+            for pixel in canvas[start..start + row_bytes].chunks_exact_mut(4) {
+                pixel.copy_from_slice(&background);
+            }
+        }
+
+        for layer in layers {
+            let area = layer.area;
+            let top = band.max(area.y);
+            let bottom = band_end.min(area.y + area.height);
+            if top >= bottom {
+                continue;
+            }
+
+            let frame = layer.frame;
+            let src_stride = frame.stride as usize;
+            let src = &frame.data[(top - area.y) as usize * src_stride..];
+            let dst = &mut canvas[top as usize * stride + area.x as usize * 4..];
+            let rows = (bottom - top) as usize;
+            let width = area.width.min(frame.width) as usize;
+
+            if layer.opacity == u8::MAX && !layer.use_alpha {
+                let len = width * 4;
+                for row in 0..rows {
+                    dst[row * stride..row * stride + len]
+                        .copy_from_slice(&src[row * src_stride..row * src_stride + len]);
+                }
+            } else {
+                kernels::blend_over(
+                    PlaneRef::new(src, src_stride),
+                    PlaneMut::new(dst, stride),
+                    width,
+                    rows,
+                    layer.opacity,
+                    layer.use_alpha,
+                )?;
+            }
+        }
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn solid(width: u32, height: u32, pixel: [u8; 4]) -> Frame {
+        let data = pixel.repeat((width * height) as usize);
+        Frame::from_data(data, width, height, width * 4, FrameFormat::Bgra)
+    }
+
+    #[test]
+    fn test_draw_layers_in_order() {
+        let size = Resolution::new(8, 40);
+        let stride = 8 * 4;
+        let mut canvas = vec![0u8; stride * 40];
+
+        let bottom = solid(4, 40, [200, 0, 0, 255]);
+        let top = solid(8, 8, [0, 0, 200, 0]);
+        let layers = [
+            Drawable {
+                frame: &bottom,
+                area: Rect::new(0, 0, 4, 40),
+                opacity: 255,
+                use_alpha: false,
+            },
+            // Clipped to the canvas, and half transparent
+            Drawable {
+                frame: &top,
+                area: Rect::new(6, 34, 8, 8).clamp(8, 40),
+                opacity: 128,
+                use_alpha: false,
+            },
+        ];
+        draw(&mut canvas, stride, size, [1, 2, 3, 255], &layers).unwrap();
+
+        let pixel = |x: usize, y: usize| &canvas[y * stride + x * 4..y * stride + x * 4 + 4];
+        assert_eq!(pixel(0, 39), &[200, 0, 0, 255]);
+        assert_eq!(pixel(5, 0), &[1, 2, 3, 255]);
+        assert_eq!(pixel(5, 39), &[1, 2, 3, 255]);
+        assert_eq!(pixel(7, 39), &[0, 1, 102, 255]);
+    }
+
+    #[test]
+    fn test_filler_frames_have_no_content() {
+        let mut frame = solid(2, 2, [0; 4]);
+        assert!(has_content(&frame));
+        frame.damage = Some(Vec::new());
+        assert!(!has_content(&frame));
+        frame.damage = Some(vec![Rect::new(0, 0, 1, 1)]);
+        assert!(has_content(&frame));
+        assert!(!has_content(&Frame::from_data(
+            Vec::new(),
+            2,
+            2,
+            8,
+            FrameFormat::Bgra
+        )));
+    }
+}
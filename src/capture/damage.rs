@@ -0,0 +1,285 @@
+//! Damage-aware frame copies
+//!
+//! Producers that attach damage regions say which parts of each buffer
+//! changed. [`DamageCanvas`] keeps a few frame buffers of its own and brings
+//! a free one up to date by copying only what changed since it was last
+//! written, so a mostly static desktop costs a few rectangles per frame
+//! instead of a full copy.
+
+use crate::pool::{FrameBuffer, FramePool, PoolKey};
+use crate::types::{Frame, FrameFormat, Rect};
+
+/// Most damage regions asked for per buffer (and tracked per canvas)
+pub(crate) const MAX_DAMAGE_RECTS: usize = 16;
+
+/// Canvases kept; the queue and the encoder may each hold one
+const CANVASES: usize = 4;
+
+/// Frames between full copies, bounding how long a producer that
+/// under-reports damage can leave stale pixels behind
+const FULL_REFRESH_FRAMES: u32 = 120;
+
+/// One plane of a source buffer
+#[derive(Debug, Clone, Copy, Default)]
+pub(crate) struct SourcePlane<'a> {
+    pub data: &'a [u8],
+    /// Offset of the plane's first row in `data`
+    pub offset: usize,
+    pub stride: usize,
+}
+
+struct Canvas {
+    data: FrameBuffer,
+    /// Regions changed since this canvas was last written (None = all)
+    stale: Option<Vec<Rect>>,
+}
+
+/// Reusable frame buffers kept current from damage regions
+pub(crate) struct DamageCanvas {
+    key: Option<PoolKey>,
+    canvases: Vec<Canvas>,
+    /// Canvas holding the newest frame
+    latest: Option<usize>,
+    since_full: u32,
+}
+
+impl DamageCanvas {
+    pub fn new() -> Self {
+        Self {
+            key: None,
+            canvases: Vec::with_capacity(CANVASES),
+            latest: None,
+            since_full: 0,
+        }
+    }
+
+    /// Frame laid out as `key` holding the content of `planes`
+    ///
+    /// `damage` is what changed since the previous call (None = unknown).
+    /// A static frame shares the previous frame's buffer; otherwise a canvas
+    /// nobody downstream still holds gets just its stale regions copied.
+    pub fn update(
+        &mut self,
+        pool: &FramePool,
+        key: PoolKey,
+        planes: &[SourcePlane],
+        damage: Option<Vec<Rect>>,
+    ) -> Frame {
+        if self.key != Some(key) {
+            self.canvases.clear();
+            self.latest = None;
+            self.key = Some(key);
+        }
+
+        self.since_full += 1;
+        let damage =
+            damage.filter(|_| self.latest.is_some() && self.since_full < FULL_REFRESH_FRAMES);
+        if damage.is_none() {
+            self.since_full = 0;
+        }
+
+        if let (Some(latest), Some(damage)) = (self.latest, &damage) {
+            if damage.is_empty() {
+                return self.frame(latest, Some(Vec::new()));
+            }
+        }
+
+        for canvas in &mut self.canvases {
+            canvas.stale = match (canvas.stale.take(), &damage) {
+                (Some(stale), Some(damage)) => Some(merge(stale, damage)),
+                _ => None,
+            };
+        }
+
+        let full = Rect::full(key.width, key.height);
+        let index = match self.canvases.iter().position(|c| c.data.is_unique()) {
+            Some(index) => index,
+            None if self.canvases.len() < CANVASES => {
+                self.canvases.push(Canvas {
+                    data: pool.acquire(key),
+                    stale: None,
+                });
+                self.canvases.len() - 1
+            }
+            None => {
+                // Every canvas is still in use downstream: one-off full copy
+                let mut data = pool.acquire(key);
+                copy_regions(&mut data, key, planes, &[full]);
+                self.latest = None;
+                let mut frame =
+                    Frame::with_buffer(data, key.width, key.height, key.stride, key.format);
+                frame.damage = damage;
+                return frame;
+            }
+        };
+
+        let canvas = &mut self.canvases[index];
+        let regions = canvas.stale.take().unwrap_or_else(|| vec![full]);
+        // Unique, so this writes in place
+        copy_regions(&mut canvas.data, key, planes, &regions);
+        canvas.stale = Some(Vec::new());
+        self.latest = Some(index);
+        self.frame(index, damage)
+    }
+
+    fn frame(&self, index: usize, damage: Option<Vec<Rect>>) -> Frame {
+        let key = self.key.expect("canvases imply a layout");
+        let mut frame = Frame::with_buffer(
+            self.canvases[index].data.clone(),
+            key.width,
+            key.height,
+            key.stride,
+            key.format,
+        );
+        frame.damage = damage;
+        frame
+    }
+}
+
+/// Add `damage` to `stale`, collapsing to one bounding box past
+/// [`MAX_DAMAGE_RECTS`]
+fn merge(mut stale: Vec<Rect>, damage: &[Rect]) -> Vec<Rect> {
+    stale.extend_from_slice(damage);
+    if stale.len() > MAX_DAMAGE_RECTS {
+        let bounds = stale.iter().fold(Rect::default(), |acc, r| acc.union(r));
+        stale.clear();
+        stale.push(bounds);
+    }
+    stale
+}
+
+/// Byte offset of luma column `x` in a row of `plane`, rounding a partly
+/// covered chroma sample up when `end`
+fn column_bytes(format: FrameFormat, plane: usize, x: u32, end: bool) -> usize {
+    let chroma = if end { x.div_ceil(2) } else { x / 2 } as usize;
+    let x = x as usize;
+    match format {
+        FrameFormat::Bgra | FrameFormat::Rgba => x * 4,
+        FrameFormat::Rgb24 => x * 3,
+        FrameFormat::Yuv444p => x,
+        FrameFormat::Nv12 if plane == 0 => x,
+        FrameFormat::Nv12 => chroma * 2,
+        FrameFormat::P010 if plane == 0 => x * 2,
+        FrameFormat::P010 => chroma * 4,
+        FrameFormat::Yuv420p if plane == 0 => x,
+        FrameFormat::Yuv420p => chroma,
+    }
+}
+
+/// Copy `regions` of `planes` into `dst` (laid out as `key`)
+fn copy_regions(dst: &mut FrameBuffer, key: PoolKey, planes: &[SourcePlane], regions: &[Rect]) {
+    let format = key.format;
+    let dst_layout = format.plane_layout(key.height, key.stride);
+    let dst = dst.make_mut();
+
+    for (plane, src) in planes.iter().enumerate().take(format.plane_count()) {
+        let (dst_offset, dst_stride) = dst_layout[plane];
+        let plane_height = format.plane_height(plane, key.height);
+        let subsampled = plane_height < key.height;
+        let row_limit = dst_stride.min(src.stride);
+
+        for rect in regions {
+            let rect = rect.clamp(key.width, key.height);
+            if rect.is_empty() {
+                continue;
+            }
+            let (top, bottom) = if subsampled {
+                (rect.y / 2, (rect.y + rect.height).div_ceil(2))
+            } else {
+                (rect.y, rect.y + rect.height)
+            };
+            let start = column_bytes(format, plane, rect.x, false);
+            let end = column_bytes(format, plane, rect.x + rect.width, true).min(row_limit);
+            if start >= end {
+                continue;
+            }
+
+            // Full-width spans of matching strides go in one copy
+            if rect.width == key.width && src.stride == dst_stride {
+                let s = src.offset + top as usize * src.stride;
+                let d = dst_offset + top as usize * dst_stride;
+                let len = (bottom.min(plane_height) - top) as usize * dst_stride;
+                let len = len
+                    .min(src.data.len().saturating_sub(s))
+                    .min(dst.len().saturating_sub(d));
+                if len > 0 {
+                    dst[d..d + len].copy_from_slice(&src.data[s..s + len]);
+                }
+                continue;
+            }
+
+            for row in top..bottom.min(plane_height) {
+                let s = src.offset + row as usize * src.stride + start;
+                let d = dst_offset + row as usize * dst_stride + start;
+                let len = end - start;
+                if s + len > src.data.len() || d + len > dst.len() {
+                    break;
+                }
+                dst[d..d + len].copy_from_slice(&src.data[s..s + len]);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn plane(data: &[u8], stride: u32) -> [SourcePlane<'_>; 1] {
+        [SourcePlane {
+            data,
+            offset: 0,
+            stride: stride as usize,
+        }]
+    }
+
+    #[test]
+    fn test_copies_damage_and_reuses_static_frames() {
+        let pool = FramePool::new();
+        let key = PoolKey::packed(4, 4, FrameFormat::Bgra);
+        let mut canvas = DamageCanvas::new();
+        let mut src = vec![1u8; key.size()];
+
+        // The first frame is copied whole whatever the damage says
+        let first = canvas.update(
+            &pool,
+            key,
+            &plane(&src, key.stride),
+            Some(vec![Rect::new(0, 0, 1, 1)]),
+        );
+        assert!(first.data.iter().all(|&b| b == 1));
+        assert!(first.damage.is_none());
+
+        // `first` is still held, so this fills a second canvas
+        src[4 * 5..4 * 6].fill(9);
+        let second = canvas.update(
+            &pool,
+            key,
+            &plane(&src, key.stride),
+            Some(vec![Rect::new(1, 1, 1, 1)]),
+        );
+        assert_eq!(&second.data[4 * 5..4 * 6], &[9; 4]);
+        assert_eq!(first.data[4 * 5], 1);
+        drop(first);
+
+        // The first canvas is free again and catches up on both damaged
+        // pixels only (the undamaged change to byte 0 is not copied)
+        src[0] = 7;
+        src[4 * 10..4 * 11].fill(5);
+        let third = canvas.update(
+            &pool,
+            key,
+            &plane(&src, key.stride),
+            Some(vec![Rect::new(2, 2, 1, 1)]),
+        );
+        assert_eq!(&third.data[4 * 5..4 * 6], &[9; 4]);
+        assert_eq!(&third.data[4 * 10..4 * 11], &[5; 4]);
+        assert_eq!(third.data[0], 1);
+
+        // Nothing changed: the same buffer again
+        let fourth = canvas.update(&pool, key, &plane(&src, key.stride), Some(Vec::new()));
+        assert!(fourth.is_static());
+        assert_eq!(fourth.data.as_ptr(), third.data.as_ptr());
+        drop(second);
+    }
+}
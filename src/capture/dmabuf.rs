@@ -8,12 +8,32 @@
 //! - KDE Plasma via PipeWire DMA-BUF
 //! - GNOME via PipeWire DMA-BUF
 
+use crate::clock::{PipelineClock, StreamClock};
 use crate::config::CaptureConfig;
 use crate::error::{Error, Result};
-use crate::types::{Frame, FrameFormat, Framerate, Resolution};
+use crate::hwaccel::{
+    find_render_node, HwDevice, HwDeviceType, HwFrame, HwFramesContext, HWFRAME_MAP_READ,
+};
+use crate::pool::{FrameBuffer, FramePool, PoolKey};
+use crate::queue::{self, QueueReceiver, QueueSender};
+use crate::threading::{self, ThreadRole};
+use crate::types::{Frame, FrameFormat, Framerate, Rect, Resolution};
 
-use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd, RawFd};
-use std::sync::atomic::{AtomicBool, Ordering};
+use super::damage::{DamageCanvas, SourcePlane};
+use super::meta::{damage_meta_pod, header_meta_pod, RawBuffer};
+
+use ffmpeg_next::ffi;
+use ffmpeg_next::format::Pixel;
+use pipewire as pw;
+use pw::spa::param::video::{VideoFormat, VideoInfoRaw};
+use pw::spa::pod::Pod;
+
+use crossbeam_channel::{Receiver, Sender};
+use std::cell::Cell;
+use std::os::unix::io::{AsRawFd, BorrowedFd, OwnedFd, RawFd};
+use std::ptr::NonNull;
+use std::rc::Rc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::Arc;
 
 /// DMA-BUF buffer information
@@ -37,9 +57,31 @@ pub struct DmaBufInfo {
     pub offsets: [u32; 4],
     /// Plane strides
     pub strides: [u32; 4],
+    /// File descriptor per plane (usually all equal to `fd`)
+    pub plane_fds: [RawFd; 4],
 }
 
 impl DmaBufInfo {
+    /// DRM fourcc compositors use for screen buffers
+    pub const SCREEN_FORMAT: u32 = DRM_FORMAT_XRGB8888;
+
+    /// Layout without a buffer behind it, for setting up import before
+    /// the first frame arrives
+    pub fn layout(width: u32, height: u32, format: u32) -> Self {
+        Self {
+            fd: -1,
+            width,
+            height,
+            stride: 0,
+            format,
+            modifier: DRM_FORMAT_MOD_INVALID,
+            num_planes: 1,
+            offsets: [0; 4],
+            strides: [0; 4],
+            plane_fds: [-1; 4],
+        }
+    }
+
     /// Check if this is a linear (untiled) buffer
     pub fn is_linear(&self) -> bool {
         self.modifier == 0 || self.modifier == DRM_FORMAT_MOD_LINEAR
@@ -47,35 +89,208 @@ impl DmaBufInfo {
 
     /// Get the equivalent FrameFormat
     pub fn frame_format(&self) -> Option<FrameFormat> {
+        drm_frame_format(self.format)
+    }
+
+    /// FFmpeg software pixel format matching the DRM fourcc
+    pub fn sw_format(&self) -> Option<Pixel> {
         match self.format {
-            DRM_FORMAT_NV12 => Some(FrameFormat::Nv12),
-            DRM_FORMAT_ARGB8888 | DRM_FORMAT_XRGB8888 => Some(FrameFormat::Bgra),
-            DRM_FORMAT_ABGR8888 | DRM_FORMAT_XBGR8888 => Some(FrameFormat::Rgba),
-            DRM_FORMAT_P010 => Some(FrameFormat::P010),
+            DRM_FORMAT_NV12 => Some(Pixel::NV12),
+            DRM_FORMAT_P010 => Some(Pixel::P010LE),
+            DRM_FORMAT_ARGB8888 => Some(Pixel::BGRA),
+            DRM_FORMAT_XRGB8888 => Some(Pixel::BGRZ),
+            DRM_FORMAT_ABGR8888 => Some(Pixel::RGBA),
+            DRM_FORMAT_XBGR8888 => Some(Pixel::RGBZ),
             _ => None,
         }
     }
 }
 
+/// FrameFormat for a DRM fourcc
+fn drm_frame_format(format: u32) -> Option<FrameFormat> {
+    match format {
+        DRM_FORMAT_NV12 => Some(FrameFormat::Nv12),
+        DRM_FORMAT_ARGB8888 | DRM_FORMAT_XRGB8888 => Some(FrameFormat::Bgra),
+        DRM_FORMAT_ABGR8888 | DRM_FORMAT_XBGR8888 => Some(FrameFormat::Rgba),
+        DRM_FORMAT_P010 => Some(FrameFormat::P010),
+        _ => None,
+    }
+}
+
 // DRM format constants
 const DRM_FORMAT_MOD_LINEAR: u64 = 0;
+/// Implicit modifier (driver-chosen layout, not described by a modifier)
+const DRM_FORMAT_MOD_INVALID: u64 = 0x00ff_ffff_ffff_ffff;
 const DRM_FORMAT_NV12: u32 = fourcc(b"NV12");
 const DRM_FORMAT_P010: u32 = fourcc(b"P010");
 const DRM_FORMAT_ARGB8888: u32 = fourcc(b"AR24");
 const DRM_FORMAT_XRGB8888: u32 = fourcc(b"XR24");
 const DRM_FORMAT_ABGR8888: u32 = fourcc(b"AB24");
 const DRM_FORMAT_XBGR8888: u32 = fourcc(b"XB24");
+// Single-plane layer formats used to describe YUV planes to FFmpeg
+const DRM_FORMAT_R8: u32 = fourcc(b"R8  ");
+const DRM_FORMAT_GR88: u32 = fourcc(b"GR88");
+const DRM_FORMAT_R16: u32 = fourcc(b"R16 ");
+const DRM_FORMAT_GR1616: u32 = fourcc(b"GR32");
 
 const fn fourcc(code: &[u8; 4]) -> u32 {
     (code[0] as u32) | ((code[1] as u32) << 8) | ((code[2] as u32) << 16) | ((code[3] as u32) << 24)
 }
 
+// Vendor modifiers (drm_fourcc.h)
+const DRM_FORMAT_MOD_VENDOR_INTEL: u64 = 0x01;
+const DRM_FORMAT_MOD_VENDOR_NVIDIA: u64 = 0x03;
+
+const fn fourcc_mod_code(vendor: u64, value: u64) -> u64 {
+    (vendor << 56) | (value & 0x00ff_ffff_ffff_ffff)
+}
+
+const I915_FORMAT_MOD_X_TILED: u64 = fourcc_mod_code(DRM_FORMAT_MOD_VENDOR_INTEL, 1);
+const I915_FORMAT_MOD_Y_TILED: u64 = fourcc_mod_code(DRM_FORMAT_MOD_VENDOR_INTEL, 2);
+const I915_FORMAT_MOD_4_TILED: u64 = fourcc_mod_code(DRM_FORMAT_MOD_VENDOR_INTEL, 9);
+
+/// NVIDIA 16Bx2 block-linear layout (`DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D`)
+const fn nvidia_block_linear(sector_layout: u64, kind_gen: u64, kind: u64, height: u64) -> u64 {
+    fourcc_mod_code(
+        DRM_FORMAT_MOD_VENDOR_NVIDIA,
+        0x10 | (height & 0xf)
+            | ((kind & 0xff) << 12)
+            | ((kind_gen & 0x3) << 20)
+            | ((sector_layout & 0x1) << 22),
+    )
+}
+
+const PCI_VENDOR_INTEL: u32 = 0x8086;
+const PCI_VENDOR_NVIDIA: u32 = 0x10de;
+
+/// DRM modifiers to offer the compositor, most preferred first
+///
+/// Tiled layouts come first so the compositor can hand over its own
+/// render targets instead of blitting into a linear buffer. The list is
+/// keyed on the PCI vendor of the first render node; AMD layouts depend on
+/// the ASIC, so they are covered by the implicit modifier. `LINEAR` and
+/// `INVALID` are always offered last.
+pub fn preferred_modifiers() -> Vec<u64> {
+    let mut modifiers = match render_node_vendor() {
+        Some(PCI_VENDOR_NVIDIA) => {
+            // Turing and later (kind 0x06), then Fermi to Volta (kind 0xfe),
+            // block heights 32..1 GOBs
+            let mut m: Vec<u64> = (0..6)
+                .rev()
+                .map(|h| nvidia_block_linear(1, 2, 0x06, h))
+                .collect();
+            m.extend((0..6).rev().map(|h| nvidia_block_linear(1, 1, 0xfe, h)));
+            m
+        }
+        Some(PCI_VENDOR_INTEL) => vec![
+            I915_FORMAT_MOD_4_TILED,
+            I915_FORMAT_MOD_Y_TILED,
+            I915_FORMAT_MOD_X_TILED,
+        ],
+        // AMD (and unknown GPUs): implicit modifier only
+        _ => Vec::new(),
+    };
+    modifiers.push(DRM_FORMAT_MOD_LINEAR);
+    modifiers.push(DRM_FORMAT_MOD_INVALID);
+    modifiers
+}
+
+/// PCI vendor id of the first DRM render node
+fn render_node_vendor() -> Option<u32> {
+    let node = find_render_node()?;
+    let name = std::path::Path::new(&node)
+        .file_name()?
+        .to_str()?
+        .to_owned();
+    let vendor = std::fs::read_to_string(format!("/sys/class/drm/{}/device/vendor", name)).ok()?;
+    u32::from_str_radix(vendor.trim().trim_start_matches("0x"), 16).ok()
+}
+
+/// A PipeWire buffer returned by the frame that held it
+#[derive(Debug)]
+struct ReturnedBuffer {
+    buffer: NonNull<pw::sys::pw_buffer>,
+    generation: u64,
+}
+
+// Only dereferenced by the capture thread that dequeued it
+unsafe impl Send for ReturnedBuffer {}
+unsafe impl Sync for ReturnedBuffer {}
+
+/// PipeWire buffer kept from the compositor while a frame made from it is
+/// alive, so it isn't rendered into while the encoder still reads it
+#[derive(Debug)]
+pub(crate) struct BufferLease {
+    returned: Option<ReturnedBuffer>,
+    returns: Sender<ReturnedBuffer>,
+}
+
+impl Drop for BufferLease {
+    fn drop(&mut self) {
+        if let Some(returned) = self.returned.take() {
+            // The capture thread is gone with its stream otherwise
+            let _ = self.returns.send(returned);
+        }
+    }
+}
+
+/// Buffers handed back by dropped frames, waiting to be queued to the
+/// producer again
+struct BufferReturns {
+    tx: Sender<ReturnedBuffer>,
+    rx: Receiver<ReturnedBuffer>,
+    /// Bumped when the stream's buffers are reallocated; leases of older
+    /// buffers are then dropped instead of requeued
+    generation: Cell<u64>,
+}
+
+impl BufferReturns {
+    fn new() -> Self {
+        let (tx, rx) = crossbeam_channel::unbounded();
+        Self {
+            tx,
+            rx,
+            generation: Cell::new(0),
+        }
+    }
+
+    fn lease(&self, buffer: NonNull<pw::sys::pw_buffer>) -> BufferLease {
+        BufferLease {
+            returned: Some(ReturnedBuffer {
+                buffer,
+                generation: self.generation.get(),
+            }),
+            returns: self.tx.clone(),
+        }
+    }
+
+    /// Returned buffers still belonging to the stream
+    fn take(&self) -> impl Iterator<Item = NonNull<pw::sys::pw_buffer>> + '_ {
+        self.rx
+            .try_iter()
+            .filter(|returned| returned.generation == self.generation.get())
+            .map(|returned| returned.buffer)
+    }
+
+    /// Queue returned buffers back to the producer (on the stream's thread)
+    fn requeue(&self, stream: &pw::stream::StreamRef) {
+        for buffer in self.take() {
+            unsafe { pw::sys::pw_stream_queue_buffer(stream.as_raw_ptr(), buffer.as_ptr()) };
+        }
+    }
+}
+
 /// DMA-BUF frame with owned file descriptor
+#[derive(Debug)]
 pub struct DmaBufFrame {
     /// Buffer information
     pub info: DmaBufInfo,
     /// Owned file descriptor (closes on drop)
     fd: Option<OwnedFd>,
+    /// Dups of plane fds that differ from `fd`
+    plane_fds: Vec<OwnedFd>,
+    /// The PipeWire buffer behind the fds, requeued once this drops
+    lease: Option<BufferLease>,
     /// Presentation timestamp
     pub pts: i64,
     /// Duration
@@ -84,14 +299,46 @@ pub struct DmaBufFrame {
 
 impl DmaBufFrame {
     /// Create a new DMA-BUF frame
-    pub fn new(info: DmaBufInfo, pts: i64) -> Self {
-        let fd = unsafe { Some(OwnedFd::from_raw_fd(info.fd)) };
-        Self {
+    ///
+    /// `info.fd` is borrowed (it belongs to the PipeWire buffer); the frame
+    /// keeps its own dup. The dup keeps the memory alive but not its
+    /// contents: captured frames also hold their buffer's lease.
+    pub fn new(mut info: DmaBufInfo, pts: i64) -> Result<Self> {
+        let source_fd = info.fd;
+        let fd = unsafe { BorrowedFd::borrow_raw(source_fd) }.try_clone_to_owned()?;
+        info.fd = fd.as_raw_fd();
+
+        // Dup each distinct plane fd once, keeping shared fds shared
+        let mut plane_fds: Vec<(RawFd, OwnedFd)> = Vec::new();
+        for i in 0..(info.num_planes as usize).min(4) {
+            let src = info.plane_fds[i];
+            if src < 0 || src == source_fd {
+                info.plane_fds[i] = info.fd;
+                continue;
+            }
+            if let Some((_, dup)) = plane_fds.iter().find(|(raw, _)| *raw == src) {
+                info.plane_fds[i] = dup.as_raw_fd();
+                continue;
+            }
+            let dup = unsafe { BorrowedFd::borrow_raw(src) }.try_clone_to_owned()?;
+            info.plane_fds[i] = dup.as_raw_fd();
+            plane_fds.push((src, dup));
+        }
+
+        Ok(Self {
             info,
-            fd,
+            fd: Some(fd),
+            plane_fds: plane_fds.into_iter().map(|(_, fd)| fd).collect(),
+            lease: None,
             pts,
             duration: 0,
-        }
+        })
+    }
+
+    /// Keep the producer's buffer until this frame is dropped
+    pub(crate) fn with_lease(mut self, lease: Option<BufferLease>) -> Self {
+        self.lease = lease;
+        self
     }
 
     /// Get the raw file descriptor
@@ -105,18 +352,23 @@ impl DmaBufFrame {
     }
 
     /// Convert to a Frame (zero-copy reference)
-    pub fn to_frame(&self) -> Frame {
-        Frame {
-            data: Vec::new(), // Empty - data is in DMA-BUF
-            width: self.info.width,
-            height: self.info.height,
-            stride: self.info.stride,
-            format: self.info.frame_format().unwrap_or(FrameFormat::Nv12),
-            pts: self.pts,
-            duration: self.duration,
-            is_keyframe: false,
-            dmabuf_fd: Some(self.fd()),
-        }
+    ///
+    /// The frame keeps the DMA-BUF alive until the last user (typically the
+    /// encoder) drops it.
+    pub fn into_frame(self) -> Frame {
+        let fd = self.fd();
+        let mut frame = Frame::with_buffer(
+            FrameBuffer::empty(), // Empty - data is in DMA-BUF
+            self.info.width,
+            self.info.height,
+            self.info.stride,
+            self.info.frame_format().unwrap_or(FrameFormat::Nv12),
+        );
+        frame.pts = self.pts;
+        frame.duration = self.duration;
+        frame.dmabuf_fd = Some(fd);
+        frame.dmabuf = Some(Arc::new(self));
+        frame
     }
 }
 
@@ -130,7 +382,9 @@ pub struct DmaBufCapture {
     resolution: Option<Resolution>,
     framerate: Option<Framerate>,
     // PipeWire stream for DMA-BUF capture
-    frame_rx: Option<crossbeam_channel::Receiver<DmaBufFrame>>,
+    frame_rx: Option<QueueReceiver<Frame>>,
+    /// Frames evicted by the queue policy
+    frames_dropped: Arc<AtomicU64>,
     _thread_handle: Option<std::thread::JoinHandle<()>>,
 }
 
@@ -143,6 +397,7 @@ impl DmaBufCapture {
             resolution: None,
             framerate: None,
             frame_rx: None,
+            frames_dropped: Arc::new(AtomicU64::new(0)),
             _thread_handle: None,
         })
     }
@@ -185,16 +440,22 @@ impl super::Capture for DmaBufCapture {
 
         self.running.store(true, Ordering::SeqCst);
 
-        // Create channel for DMA-BUF frames
-        let (frame_tx, frame_rx) = crossbeam_channel::bounded::<DmaBufFrame>(4);
+        // Queue for DMA-BUF frames; the PipeWire callback must not wait, so
+        // a blocking policy evicts instead (the pipeline applies it)
+        let mut queue_config = self.config.queue;
+        queue_config.policy = queue_config.policy.non_blocking();
+        queue_config.latency_budget_ms = None;
+        let (frame_tx, frame_rx) = queue::frame_queue::<Frame>(queue_config);
         self.frame_rx = Some(frame_rx);
 
         let config = self.config.clone();
         let running = self.running.clone();
+        let dropped = self.frames_dropped.clone();
 
         // Spawn PipeWire DMA-BUF capture thread
         let handle = std::thread::spawn(move || {
-            if let Err(e) = run_dmabuf_capture(config, running.clone(), frame_tx) {
+            threading::enter(ThreadRole::Capture);
+            if let Err(e) = run_dmabuf_capture(config, running.clone(), frame_tx, dropped) {
                 tracing::error!("DMA-BUF capture error: {}", e);
                 running.store(false, Ordering::SeqCst);
             }
@@ -216,15 +477,11 @@ impl super::Capture for DmaBufCapture {
         let rx = self.frame_rx.as_ref().ok_or(Error::CaptureNotStarted)?;
 
         match rx.recv_timeout(std::time::Duration::from_millis(100)) {
-            Ok(dmabuf_frame) => {
-                // Update resolution from first frame
-                if self.resolution.is_none() {
-                    self.resolution = Some(Resolution::new(
-                        dmabuf_frame.info.width,
-                        dmabuf_frame.info.height,
-                    ));
-                }
-                Ok(dmabuf_frame.to_frame())
+            Ok(received) => {
+                let frame = received.item;
+                // Track resolution (may change on renegotiation)
+                self.resolution = Some(frame.resolution());
+                Ok(frame)
             }
             Err(crossbeam_channel::RecvTimeoutError::Timeout) => {
                 Err(Error::Timeout("DMA-BUF frame timeout".into()))
@@ -244,16 +501,436 @@ impl super::Capture for DmaBufCapture {
     fn framerate(&self) -> Option<Framerate> {
         self.framerate
     }
+
+    fn frames_dropped(&self) -> u64 {
+        self.frames_dropped.load(Ordering::Relaxed)
+    }
+}
+
+/// PipeWire video format for a DRM fourcc
+fn drm_to_spa_format(format: u32) -> Option<VideoFormat> {
+    match format {
+        DRM_FORMAT_NV12 => Some(VideoFormat::NV12),
+        DRM_FORMAT_P010 => Some(VideoFormat::from_raw(
+            libspa_sys::SPA_VIDEO_FORMAT_P010_10LE,
+        )),
+        DRM_FORMAT_ARGB8888 => Some(VideoFormat::BGRA),
+        DRM_FORMAT_XRGB8888 => Some(VideoFormat::BGRx),
+        DRM_FORMAT_ABGR8888 => Some(VideoFormat::RGBA),
+        DRM_FORMAT_XBGR8888 => Some(VideoFormat::RGBx),
+        _ => None,
+    }
+}
+
+/// DRM fourcc for a PipeWire video format
+fn spa_to_drm_format(format: VideoFormat) -> Option<u32> {
+    DmaBufCapture::supported_formats()
+        .into_iter()
+        .find(|&drm| drm_to_spa_format(drm) == Some(format))
+}
+
+/// Serialize an EnumFormat pod for `format`
+///
+/// With `modifiers` the pod advertises DMA-BUF support: a single modifier
+/// is a fixated choice, a list is left for the producer to pick from
+/// (`DONT_FIXATE`). Without modifiers the pod only matches SHM buffers.
+fn format_pod(
+    format: VideoFormat,
+    modifiers: Option<&[u64]>,
+    resolution: Resolution,
+    framerate: Framerate,
+) -> Result<Vec<u8>> {
+    use pw::spa::param::format::{FormatProperties, MediaSubtype, MediaType};
+    use pw::spa::pod::{ChoiceValue, Property, PropertyFlags, Value};
+    use pw::spa::utils::{Choice, ChoiceEnum, ChoiceFlags, Fraction, Rectangle};
+
+    let mut obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamFormat,
+        pw::spa::param::ParamType::EnumFormat,
+        pw::spa::pod::property!(FormatProperties::MediaType, Id, MediaType::Video),
+        pw::spa::pod::property!(FormatProperties::MediaSubtype, Id, MediaSubtype::Raw),
+        pw::spa::pod::property!(FormatProperties::VideoFormat, Id, format),
+        pw::spa::pod::property!(
+            FormatProperties::VideoSize,
+            Choice,
+            Range,
+            Rectangle,
+            Rectangle {
+                width: resolution.width,
+                height: resolution.height,
+            },
+            Rectangle {
+                width: 1,
+                height: 1,
+            },
+            Rectangle {
+                width: 7680, // 8K max
+                height: 4320,
+            }
+        ),
+        pw::spa::pod::property!(
+            FormatProperties::VideoFramerate,
+            Choice,
+            Range,
+            Fraction,
+            Fraction {
+                num: framerate.num,
+                denom: framerate.den,
+            },
+            Fraction { num: 0, denom: 1 },
+            Fraction {
+                num: 1000,
+                denom: 1
+            }
+        ),
+    );
+
+    if let Some(modifiers) = modifiers {
+        let (flags, value) = match modifiers {
+            [modifier] => (PropertyFlags::MANDATORY, Value::Long(*modifier as i64)),
+            _ => (
+                PropertyFlags::MANDATORY | PropertyFlags::DONT_FIXATE,
+                Value::Choice(ChoiceValue::Long(Choice(
+                    ChoiceFlags::empty(),
+                    ChoiceEnum::Enum {
+                        default: modifiers[0] as i64,
+                        alternatives: modifiers.iter().map(|&m| m as i64).collect(),
+                    },
+                ))),
+            ),
+        };
+        obj.properties.push(Property {
+            key: FormatProperties::VideoModifier.as_raw(),
+            flags,
+            value,
+        });
+    }
+
+    serialize_pod(obj)
+}
+
+/// Serialize a Buffers pod restricting the buffer memory type
+fn buffers_pod(dmabuf: bool) -> Result<Vec<u8>> {
+    use pw::spa::pod::{ChoiceValue, Property, PropertyFlags, Value};
+    use pw::spa::utils::{Choice, ChoiceEnum, ChoiceFlags};
+
+    let data_type = if dmabuf {
+        1 << libspa_sys::SPA_DATA_DmaBuf
+    } else {
+        (1 << libspa_sys::SPA_DATA_MemFd) | (1 << libspa_sys::SPA_DATA_MemPtr)
+    };
+
+    let obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamBuffers,
+        pw::spa::param::ParamType::Buffers,
+        Property {
+            key: libspa_sys::SPA_PARAM_BUFFERS_buffers,
+            flags: PropertyFlags::empty(),
+            value: Value::Choice(ChoiceValue::Int(Choice(
+                ChoiceFlags::empty(),
+                ChoiceEnum::Range {
+                    default: 8,
+                    min: 2,
+                    max: 16,
+                },
+            ))),
+        },
+        Property {
+            key: libspa_sys::SPA_PARAM_BUFFERS_dataType,
+            flags: PropertyFlags::empty(),
+            value: Value::Choice(ChoiceValue::Int(Choice(
+                ChoiceFlags::empty(),
+                ChoiceEnum::Flags {
+                    default: data_type as i32,
+                    flags: vec![data_type as i32],
+                },
+            ))),
+        },
+    );
+
+    serialize_pod(obj)
+}
+
+pub(super) fn serialize_pod(obj: pw::spa::pod::Object) -> Result<Vec<u8>> {
+    Ok(pw::spa::pod::serialize::PodSerializer::serialize(
+        std::io::Cursor::new(Vec::new()),
+        &pw::spa::pod::Value::Object(obj),
+    )
+    .map_err(|e| Error::PipeWire(format!("Failed to serialize pod: {:?}", e)))?
+    .0
+    .into_inner())
+}
+
+fn as_pods(params: &[Vec<u8>]) -> Result<Vec<&Pod>> {
+    params
+        .iter()
+        .map(|bytes| {
+            Pod::from_bytes(bytes)
+                .ok_or_else(|| Error::PipeWire("Failed to create pod from bytes".into()))
+        })
+        .collect()
+}
+
+/// Modifier property of a negotiated format
+enum NegotiatedModifier {
+    /// No modifier: SHM buffers
+    None,
+    /// Fixated modifier: DMA-BUF buffers
+    Fixed(u64),
+    /// Producer left the choice to us (`DONT_FIXATE`)
+    Choice(Vec<u64>),
+}
+
+fn parse_modifier(param: &Pod) -> NegotiatedModifier {
+    use pw::spa::param::format::FormatProperties;
+    use pw::spa::pod::deserialize::PodDeserializer;
+    use pw::spa::pod::{ChoiceValue, PropertyFlags, Value};
+    use pw::spa::utils::{Choice, ChoiceEnum};
+
+    let Ok((_, Value::Object(obj))) = PodDeserializer::deserialize_any_from(param.as_bytes())
+    else {
+        return NegotiatedModifier::None;
+    };
+    let Some(prop) = obj
+        .properties
+        .iter()
+        .find(|p| p.key == FormatProperties::VideoModifier.as_raw())
+    else {
+        return NegotiatedModifier::None;
+    };
+
+    match &prop.value {
+        Value::Long(m) => NegotiatedModifier::Fixed(*m as u64),
+        Value::Choice(ChoiceValue::Long(Choice(_, choice))) => {
+            let (default, alternatives) = match choice {
+                ChoiceEnum::Enum {
+                    default,
+                    alternatives,
+                } => (*default, alternatives.clone()),
+                ChoiceEnum::None(default) => (*default, Vec::new()),
+                _ => return NegotiatedModifier::None,
+            };
+            if prop.flags.contains(PropertyFlags::DONT_FIXATE) && !alternatives.is_empty() {
+                NegotiatedModifier::Choice(alternatives.into_iter().map(|m| m as u64).collect())
+            } else {
+                NegotiatedModifier::Fixed(default as u64)
+            }
+        }
+        _ => NegotiatedModifier::None,
+    }
+}
+
+/// User data for the DMA-BUF stream callbacks
+struct DmaBufState {
+    frame_tx: QueueSender<Frame>,
+    frames_dropped: Arc<AtomicU64>,
+    running: Arc<AtomicBool>,
+    format: VideoInfoRaw,
+    /// Negotiated DRM fourcc
+    drm_format: Option<u32>,
+    /// Negotiated modifier (None: SHM buffers)
+    modifier: Option<u64>,
+    /// Modifiers we offered, most preferred first
+    modifiers: Vec<u64>,
+    /// EnumFormat pods we offered (re-sent when fixating a modifier)
+    enum_formats: Vec<Vec<u8>>,
+    resolution: Resolution,
+    framerate: Framerate,
+    /// Producer timestamps to pipeline PTS
+    clock: StreamClock,
+    pool: FramePool,
+    /// SHM frame buffers updated from damage regions
+    canvas: DamageCanvas,
+    /// DMA-BUFs released by the frames holding them
+    returns: Rc<BufferReturns>,
+}
+
+impl DmaBufState {
+    /// Handle a negotiated Format param
+    fn format_changed(&mut self, stream: &pw::stream::StreamRef, param: &Pod) {
+        if let Err(e) = self.format.parse(param) {
+            tracing::warn!("Failed to parse video format: {:?}", e);
+            return;
+        }
+
+        self.drm_format = spa_to_drm_format(self.format.format());
+        // Buffers are reallocated for the new format
+        let generation = &self.returns.generation;
+        generation.set(generation.get() + 1);
+        self.modifier = match parse_modifier(param) {
+            NegotiatedModifier::None => None,
+            NegotiatedModifier::Fixed(m) => Some(m),
+            NegotiatedModifier::Choice(offered) => {
+                // Fixate on our most preferred modifier the producer supports;
+                // the stream renegotiates and calls back with the fixed format
+                let Some(&pick) = self.modifiers.iter().find(|m| offered.contains(m)) else {
+                    tracing::warn!("No common DMA-BUF modifier, waiting for SHM format");
+                    return;
+                };
+                if let Err(e) = self.fixate(stream, pick) {
+                    tracing::warn!("Failed to fixate DMA-BUF modifier: {}", e);
+                }
+                return;
+            }
+        };
+
+        let dmabuf = self.modifier.is_some();
+        tracing::info!(
+            "Video format negotiated: {:?} {}x{} @ {}/{}fps ({})",
+            self.format.format(),
+            self.format.size().width,
+            self.format.size().height,
+            self.format.framerate().num,
+            self.format.framerate().denom,
+            match self.modifier {
+                Some(m) => format!("DMA-BUF, modifier {:#018x}", m),
+                None => "SHM".to_string(),
+            }
+        );
+
+        if let Err(e) = buffers_pod(dmabuf).and_then(|bytes| {
+            let params = [bytes, header_meta_pod()?, damage_meta_pod()?];
+            let mut params = as_pods(&params)?;
+            stream
+                .update_params(&mut params)
+                .map_err(|e| Error::PipeWire(format!("Failed to update params: {}", e)))
+        }) {
+            tracing::warn!("Failed to set buffer params: {}", e);
+        }
+    }
+
+    /// Offer a fixated format for `modifier`, keeping the full list as fallback
+    fn fixate(&self, stream: &pw::stream::StreamRef, modifier: u64) -> Result<()> {
+        let fixated = format_pod(
+            self.format.format(),
+            Some(&[modifier]),
+            self.resolution,
+            self.framerate,
+        )?;
+        let mut params = vec![fixated];
+        params.extend(self.enum_formats.iter().cloned());
+        let mut pods = as_pods(&params)?;
+
+        tracing::debug!("Fixating DMA-BUF modifier {:#018x}", modifier);
+        stream
+            .update_params(&mut pods)
+            .map_err(|e| Error::PipeWire(format!("Failed to update params: {}", e)))
+    }
+
+    /// Turn a dequeued buffer into a frame, stamped from the producer's
+    /// timestamp (`source_ns`) when it sets one; a DMA-BUF frame takes
+    /// `lease` on its buffer
+    fn buffer_to_frame(
+        &mut self,
+        datas: &mut [pw::spa::buffer::Data],
+        source_ns: Option<i64>,
+        damage: Option<Vec<Rect>>,
+        lease: Option<BufferLease>,
+    ) -> Option<Frame> {
+        let width = self.format.size().width;
+        let height = self.format.size().height;
+        let stamp = self.clock.stamp(source_ns);
+        let pts = stamp.pts;
+
+        let mut frame = if datas[0].type_() == pw::spa::buffer::DataType::DmaBuf {
+            let mut info = DmaBufInfo {
+                fd: datas[0].as_raw().fd as RawFd,
+                width,
+                height,
+                stride: datas[0].chunk().stride() as u32,
+                format: self.drm_format?,
+                modifier: self.modifier.unwrap_or(DRM_FORMAT_MOD_INVALID),
+                num_planes: datas.len().min(4) as u32,
+                offsets: [0; 4],
+                strides: [0; 4],
+                plane_fds: [-1; 4],
+            };
+            for (i, data) in datas.iter().take(4).enumerate() {
+                info.offsets[i] = data.chunk().offset();
+                info.strides[i] = data.chunk().stride() as u32;
+                info.plane_fds[i] = data.as_raw().fd as RawFd;
+            }
+
+            match DmaBufFrame::new(info, pts) {
+                Ok(dmabuf_frame) => {
+                    let mut frame = dmabuf_frame.with_lease(lease).into_frame();
+                    frame.damage = damage;
+                    frame
+                }
+                Err(e) => {
+                    tracing::warn!("Failed to dup DMA-BUF fd: {}", e);
+                    return None;
+                }
+            }
+        } else {
+            // SHM fallback: copy the damaged regions into a pooled buffer
+            let format = drm_frame_format(self.drm_format?)?;
+            let planes = shm_planes(datas, width, height, format)?;
+            let key = PoolKey::packed(width, height, format);
+            let mut frame =
+                self.canvas
+                    .update(&self.pool, key, &planes[..format.plane_count()], damage);
+            frame.pts = pts;
+            frame
+        };
+
+        frame.duration = stamp.duration;
+        Some(frame)
+    }
+}
+
+/// Source planes of an SHM buffer (one data per plane, or all planes in
+/// data 0)
+fn shm_planes<'a>(
+    datas: &'a mut [pw::spa::buffer::Data],
+    width: u32,
+    height: u32,
+    format: FrameFormat,
+) -> Option<[SourcePlane<'a>; 3]> {
+    let chunks: Vec<(usize, usize)> = datas
+        .iter()
+        .map(|data| {
+            let chunk = data.chunk();
+            (chunk.offset() as usize, chunk.stride().max(0) as usize)
+        })
+        .collect();
+    let src_stride0 = match chunks[0].1 {
+        s if s > 0 => s,
+        _ => format.default_stride(width) as usize,
+    };
+    let src_layout = format.plane_layout(height, src_stride0 as u32);
+    let separate = datas.len() > 1;
+    let buffers: Vec<Option<&'a [u8]>> = datas
+        .iter_mut()
+        .map(|data| data.data().map(|d| &*d))
+        .collect();
+
+    let mut planes = [SourcePlane::default(); 3];
+    for (plane, source) in planes.iter_mut().enumerate().take(format.plane_count()) {
+        *source = if separate && plane < buffers.len() {
+            SourcePlane {
+                data: buffers[plane]?,
+                offset: chunks[plane].0,
+                stride: chunks[plane].1,
+            }
+        } else {
+            SourcePlane {
+                data: buffers[0]?,
+                offset: chunks[0].0 + src_layout[plane].0,
+                stride: src_layout[plane].1,
+            }
+        };
+    }
+    Some(planes)
 }
 
 /// Run PipeWire DMA-BUF capture loop
 fn run_dmabuf_capture(
     config: CaptureConfig,
     running: Arc<AtomicBool>,
-    frame_tx: crossbeam_channel::Sender<DmaBufFrame>,
+    frame_tx: QueueSender<Frame>,
+    frames_dropped: Arc<AtomicU64>,
 ) -> Result<()> {
-    use pipewire as pw;
-
     // Initialize PipeWire
     pw::init();
 
@@ -278,118 +955,113 @@ fn run_dmabuf_capture(
     let stream = pw::stream::Stream::new(&core, "ghoststream-dmabuf", props)
         .map_err(|e| Error::PipeWire(format!("Failed to create stream: {}", e)))?;
 
-    // Set up stream listener for DMA-BUF buffers
-    let running_clone = running.clone();
-    let frame_tx_clone = frame_tx.clone();
-    let mut frame_count: u64 = 0;
-    let frame_duration = config.framerate.frame_duration_us();
-
-    let _listener = stream
-        .add_local_listener_with_user_data(())
-        .process(move |stream, _| {
-            if !running_clone.load(Ordering::SeqCst) {
-                return;
-            }
+    // One DMA-BUF EnumFormat per supported format (with the GPU's
+    // modifiers), followed by SHM formats so the same stream can fall back
+    // to copies when the producer can't share buffers
+    let resolution = Resolution::FHD_1080P;
+    let modifiers = preferred_modifiers();
+    let spa_formats: Vec<VideoFormat> = DmaBufCapture::supported_formats()
+        .into_iter()
+        .filter_map(drm_to_spa_format)
+        .collect();
 
-            if let Some(mut buffer) = stream.dequeue_buffer() {
-                let datas = buffer.datas_mut();
-                if datas.is_empty() {
-                    return;
-                }
+    let mut enum_formats = Vec::new();
+    if config.prefer_dmabuf {
+        for &format in &spa_formats {
+            enum_formats.push(format_pod(
+                format,
+                Some(&modifiers),
+                resolution,
+                config.framerate,
+            )?);
+        }
+    }
+    for &format in &spa_formats {
+        enum_formats.push(format_pod(format, None, resolution, config.framerate)?);
+    }
 
-                let data = &mut datas[0];
+    tracing::debug!(
+        "Offering {} formats, modifiers: {:x?}",
+        spa_formats.len(),
+        modifiers
+    );
 
-                // Check for DMA-BUF
-                let raw_fd = data.as_raw().fd;
-                if raw_fd >= 0 {
-                    let fd = raw_fd as i32;
-                    // This is a DMA-BUF!
-                    let chunk = data.chunk();
+    let returns = Rc::new(BufferReturns::new());
+    let state = DmaBufState {
+        frame_tx,
+        frames_dropped,
+        running: running.clone(),
+        format: Default::default(),
+        drm_format: None,
+        modifier: None,
+        modifiers,
+        enum_formats: enum_formats.clone(),
+        resolution,
+        framerate: config.framerate,
+        clock: StreamClock::new(
+            PipelineClock::global(),
+            config.framerate.frame_duration_us(),
+        ),
+        pool: FramePool::global().clone(),
+        canvas: DamageCanvas::new(),
+        returns: returns.clone(),
+    };
 
-                    let info = DmaBufInfo {
-                        fd,
-                        width: chunk.size() as u32, // Will be set properly from format
-                        height: 0,
-                        stride: chunk.stride() as u32,
-                        format: DRM_FORMAT_NV12, // Default, should come from negotiation
-                        modifier: DRM_FORMAT_MOD_LINEAR,
-                        num_planes: 1,
-                        offsets: [chunk.offset(), 0, 0, 0],
-                        strides: [chunk.stride() as u32, 0, 0, 0],
-                    };
+    let _listener = stream
+        .add_local_listener_with_user_data(state)
+        .param_changed(|stream, state, id, param| {
+            let Some(param) = param else { return };
+            if id != pw::spa::param::ParamType::Format.as_raw() {
+                return;
+            }
+            state.format_changed(stream, param);
+        })
+        .process(|stream, state| {
+            if !state.running.load(Ordering::SeqCst) {
+                return;
+            }
 
-                    let pts = (frame_count as i64) * frame_duration;
-                    let mut dmabuf_frame = DmaBufFrame::new(info, pts);
-                    dmabuf_frame.duration = frame_duration;
+            state.returns.requeue(stream);
+            let Some(mut buffer) = RawBuffer::dequeue(stream) else {
+                return;
+            };
+            let source_ns = buffer.pts_ns();
+            let damage = buffer.damage(state.format.size().width, state.format.size().height);
+            // A DMA-BUF stays with its frame (SHM frames are copies)
+            let dmabuf = buffer
+                .datas_mut()
+                .first()
+                .is_some_and(|data| data.type_() == pw::spa::buffer::DataType::DmaBuf);
+            let lease = dmabuf.then(|| state.returns.lease(buffer.keep()));
+            let datas = buffer.datas_mut();
+            if datas.is_empty() {
+                return;
+            }
 
-                    let _ = frame_tx_clone.try_send(dmabuf_frame);
-                    frame_count += 1;
-                } else {
-                    // Fall back to copying if not DMA-BUF
-                    tracing::debug!("Non-DMA-BUF buffer received, falling back to copy");
+            if let Some(frame) = state.buffer_to_frame(datas, source_ns, damage, lease) {
+                let dropped = state.frame_tx.push(frame).dropped();
+                if dropped > 0 {
+                    state
+                        .frames_dropped
+                        .fetch_add(dropped as u64, Ordering::Relaxed);
                 }
             }
         })
         .register()
         .map_err(|e| Error::PipeWire(format!("Failed to register listener: {}", e)))?;
 
-    // Build video format with DMA-BUF preference
-    let mut buffer = vec![0u8; 4096];
-
-    // Create video info for DMA-BUF
-    let mut video_info: libspa_sys::spa_video_info_raw = unsafe { std::mem::zeroed() };
-    video_info.format = libspa_sys::SPA_VIDEO_FORMAT_NV12;
-    video_info.flags = 0;
-    video_info.modifier = DRM_FORMAT_MOD_LINEAR;
-    video_info.size = libspa_sys::spa_rectangle {
-        width: 1920,
-        height: 1080,
-    };
-    video_info.framerate = libspa_sys::spa_fraction {
-        num: config.framerate.num,
-        denom: config.framerate.den,
-    };
-    video_info.max_framerate = libspa_sys::spa_fraction {
-        num: config.framerate.num,
-        denom: config.framerate.den,
-    };
-
-    let pod = unsafe {
-        let builder = libspa_sys::spa_pod_builder {
-            data: buffer.as_mut_ptr() as *mut _,
-            size: buffer.len() as u32,
-            _padding: 0,
-            state: libspa_sys::spa_pod_builder_state {
-                offset: 0,
-                flags: 0,
-                frame: std::ptr::null_mut(),
-            },
-            callbacks: libspa_sys::spa_callbacks {
-                funcs: std::ptr::null(),
-                data: std::ptr::null_mut(),
-            },
-        };
+    let mut params = as_pods(&enum_formats)?;
 
-        let pod_ptr = libspa_sys::spa_format_video_raw_build(
-            &builder as *const _ as *mut _,
-            libspa_sys::SPA_PARAM_EnumFormat,
-            &video_info as *const _ as *mut _,
-        );
-
-        if pod_ptr.is_null() {
-            return Err(Error::PipeWire("Failed to build video format pod".into()));
-        }
-
-        libspa::pod::Pod::from_raw(pod_ptr)
-    };
-
-    // Connect with DMA-BUF support
-    let flags = pw::stream::StreamFlags::AUTOCONNECT
-        | pw::stream::StreamFlags::MAP_BUFFERS
-        | pw::stream::StreamFlags::RT_PROCESS;
+    // Connect. MAP_BUFFERS has PipeWire mmap mappable buffers once, as
+    // they are added, so SHM data can be read in process; that only saves
+    // a map per frame, the damaged regions are still copied into pooled
+    // frames. DMA-BUFs are passed on by fd and never read through it.
+    // Process runs on this thread (not RT_PROCESS) so buffers released by
+    // frames can be requeued between callbacks.
+    let flags = pw::stream::StreamFlags::AUTOCONNECT | pw::stream::StreamFlags::MAP_BUFFERS;
 
     stream
-        .connect(libspa::utils::Direction::Input, None, flags, &mut [pod])
+        .connect(libspa::utils::Direction::Input, None, flags, &mut params)
         .map_err(|e| Error::PipeWire(format!("Failed to connect stream: {}", e)))?;
 
     tracing::info!("PipeWire DMA-BUF stream connected");
@@ -399,6 +1071,9 @@ fn run_dmabuf_capture(
     while running.load(Ordering::SeqCst) {
         if let Some(ml) = weak_mainloop.upgrade() {
             ml.loop_().iterate(std::time::Duration::from_millis(10));
+            // Without this, a producer whose buffers are all held by
+            // frames would never call process again
+            returns.requeue(&stream);
         } else {
             break;
         }
@@ -407,31 +1082,512 @@ fn run_dmabuf_capture(
     Ok(())
 }
 
-/// Import a DMA-BUF into an EGL image (for GPU processing)
+// ============================================================================
+// DMA-BUF Import
+// ============================================================================
+
+const AV_DRM_MAX_PLANES: usize = 4;
+
+// Mirrors of libavutil/hwcontext_drm.h (not covered by ffmpeg-sys bindings)
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct AVDRMObjectDescriptor {
+    fd: i32,
+    size: usize,
+    format_modifier: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct AVDRMPlaneDescriptor {
+    object_index: i32,
+    offset: isize,
+    pitch: isize,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct AVDRMLayerDescriptor {
+    format: u32,
+    nb_planes: i32,
+    planes: [AVDRMPlaneDescriptor; AV_DRM_MAX_PLANES],
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct AVDRMFrameDescriptor {
+    nb_objects: i32,
+    objects: [AVDRMObjectDescriptor; AV_DRM_MAX_PLANES],
+    nb_layers: i32,
+    layers: [AVDRMLayerDescriptor; AV_DRM_MAX_PLANES],
+}
+
+/// Descriptor plus the frame owning its fds, freed together by FFmpeg
+struct DrmDescriptorHolder {
+    desc: AVDRMFrameDescriptor,
+    _frame: Arc<DmaBufFrame>,
+}
+
+unsafe extern "C" fn free_drm_descriptor(opaque: *mut std::ffi::c_void, _data: *mut u8) {
+    drop(Box::from_raw(opaque as *mut DrmDescriptorHolder));
+}
+
+impl AVDRMFrameDescriptor {
+    /// Describe `info` the way FFmpeg's Vulkan/VA-API importers expect:
+    /// one object (the fd) and one layer per plane for YUV formats.
+    fn from_info(info: &DmaBufInfo) -> Result<Self> {
+        let empty_plane = AVDRMPlaneDescriptor {
+            object_index: 0,
+            offset: 0,
+            pitch: 0,
+        };
+        let empty_layer = AVDRMLayerDescriptor {
+            format: 0,
+            nb_planes: 0,
+            planes: [empty_plane; AV_DRM_MAX_PLANES],
+        };
+        let empty_object = AVDRMObjectDescriptor {
+            fd: -1,
+            size: 0,
+            format_modifier: 0,
+        };
+
+        let mut desc = Self {
+            nb_objects: 0,
+            objects: [empty_object; AV_DRM_MAX_PLANES],
+            nb_layers: 0,
+            layers: [empty_layer; AV_DRM_MAX_PLANES],
+        };
+
+        // One object per distinct fd; planes reference them by index
+        let mut object_index = [0i32; AV_DRM_MAX_PLANES];
+        for plane in 0..(info.num_planes as usize).clamp(1, AV_DRM_MAX_PLANES) {
+            let fd = if plane == 0 || info.plane_fds[plane] < 0 {
+                info.fd
+            } else {
+                info.plane_fds[plane]
+            };
+            let objects = &desc.objects[..desc.nb_objects as usize];
+            object_index[plane] = match objects.iter().position(|o| o.fd == fd) {
+                Some(index) => index as i32,
+                None => {
+                    desc.objects[desc.nb_objects as usize] = AVDRMObjectDescriptor {
+                        fd,
+                        // Size 0 lets the importer query it from the fd
+                        size: 0,
+                        format_modifier: info.modifier,
+                    };
+                    desc.nb_objects += 1;
+                    desc.nb_objects - 1
+                }
+            };
+        }
+
+        let plane_formats: &[u32] = match info.format {
+            DRM_FORMAT_NV12 => &[DRM_FORMAT_R8, DRM_FORMAT_GR88],
+            DRM_FORMAT_P010 => &[DRM_FORMAT_R16, DRM_FORMAT_GR1616],
+            DRM_FORMAT_ARGB8888 | DRM_FORMAT_XRGB8888 | DRM_FORMAT_ABGR8888
+            | DRM_FORMAT_XBGR8888 => std::slice::from_ref(&info.format),
+            other => {
+                return Err(Error::Internal(format!(
+                    "Unsupported DMA-BUF format {:#010x}",
+                    other
+                )))
+            }
+        };
+
+        if (info.num_planes as usize) < plane_formats.len() && info.num_planes > 1 {
+            return Err(Error::Internal(format!(
+                "DMA-BUF has {} planes, format needs {}",
+                info.num_planes,
+                plane_formats.len()
+            )));
+        }
+
+        for (i, &format) in plane_formats.iter().enumerate() {
+            // Single-plane descriptions of NV12 put UV right after Y
+            let (offset, pitch, object) = if i < info.num_planes as usize {
+                (info.offsets[i], info.strides[i], object_index[i])
+            } else {
+                (
+                    info.offsets[0] + info.strides[0] * info.height,
+                    info.strides[0],
+                    object_index[0],
+                )
+            };
+            desc.layers[i].format = format;
+            desc.layers[i].nb_planes = 1;
+            desc.layers[i].planes[0] = AVDRMPlaneDescriptor {
+                object_index: object,
+                offset: offset as isize,
+                pitch: pitch as isize,
+            };
+        }
+        desc.nb_layers = plane_formats.len() as i32;
+
+        Ok(desc)
+    }
+}
+
+/// Frame contexts for one negotiated buffer layout
+struct ImportContexts {
+    sw_format: Pixel,
+    width: u32,
+    height: u32,
+    vulkan: Option<HwFramesContext>,
+    cuda: Option<HwFramesContext>,
+    drm: Option<HwFramesContext>,
+}
+
+/// Imports DMA-BUFs into FFmpeg hardware frames
+///
+/// The buffer is described to FFmpeg as an `AV_PIX_FMT_DRM_PRIME` frame,
+/// mapped into Vulkan (VK_EXT_image_drm_format_modifier, honouring the
+/// negotiated modifier), and then transferred GPU-side into a CUDA frame
+/// pool through Vulkan/CUDA external memory. Nothing is read back to the
+/// CPU. [`DmaBufImporter::download`] is the CPU fallback for linear buffers
+/// when no GPU path is available.
 pub struct DmaBufImporter {
-    // EGL display and context for GPU import
+    cuda: Option<HwDevice>,
+    vulkan: Option<HwDevice>,
+    drm: Option<HwDevice>,
+    contexts: Option<ImportContexts>,
 }
 
 impl DmaBufImporter {
-    /// Create a new importer
+    /// Create an importer without GPU devices (CPU download only)
     pub fn new() -> Result<Self> {
-        Ok(Self {})
+        Ok(Self::default())
     }
 
-    /// Import a DMA-BUF for GPU access
-    pub fn import(&self, _dmabuf: &DmaBufInfo) -> Result<()> {
-        // This would use EGL_EXT_image_dma_buf_import to create an EGL image
-        // that can be used with CUDA/OpenGL for zero-copy encoding
-        //
-        // eglCreateImage(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs)
-        //
-        // For NVENC, we'd then use cuGraphicsEGLRegisterImage to make it available to CUDA
-        Ok(())
+    /// Create an importer that produces CUDA frames for NVENC
+    ///
+    /// The Vulkan device is derived from the CUDA device so both sides of
+    /// the interop copy are on the same GPU.
+    pub fn with_cuda(device: Option<&str>) -> Result<Self> {
+        let cuda = HwDevice::create(HwDeviceType::Cuda, device)?;
+        let vulkan = cuda.derive(HwDeviceType::Vulkan)?;
+        tracing::info!("DMA-BUF importer ready (DRM PRIME -> Vulkan -> CUDA)");
+        Ok(Self {
+            cuda: Some(cuda),
+            vulkan: Some(vulkan),
+            drm: None,
+            contexts: None,
+        })
+    }
+
+    /// CUDA device used for imported frames
+    pub fn cuda_device(&self) -> Option<&HwDevice> {
+        self.cuda.as_ref()
+    }
+
+    /// Describe a DMA-BUF as a DRM PRIME frame (no copy, no GPU work)
+    ///
+    /// The returned frame holds a reference to `frame`, so the fds stay open
+    /// for as long as FFmpeg uses the mapping.
+    pub fn import(&self, frame: &Arc<DmaBufFrame>) -> Result<HwFrame> {
+        let desc = AVDRMFrameDescriptor::from_info(&frame.info)?;
+        let holder = Box::into_raw(Box::new(DrmDescriptorHolder {
+            desc,
+            _frame: frame.clone(),
+        }));
+
+        let mut hw = HwFrame::alloc()?;
+        unsafe {
+            let buf = ffi::av_buffer_create(
+                &mut (*holder).desc as *mut AVDRMFrameDescriptor as *mut u8,
+                std::mem::size_of::<AVDRMFrameDescriptor>(),
+                Some(free_drm_descriptor),
+                holder as *mut std::ffi::c_void,
+                0,
+            );
+            if buf.is_null() {
+                drop(Box::from_raw(holder));
+                return Err(Error::FFmpeg("Failed to wrap DRM descriptor".into()));
+            }
+
+            let ptr = hw.as_mut_ptr();
+            (*ptr).buf[0] = buf;
+            (*ptr).data[0] = (*buf).data;
+            (*ptr).format = ffi::AVPixelFormat::AV_PIX_FMT_DRM_PRIME as i32;
+            (*ptr).width = frame.info.width as i32;
+            (*ptr).height = frame.info.height as i32;
+        }
+        hw.set_pts(frame.pts);
+
+        Ok(hw)
+    }
+
+    /// Import a DMA-BUF as a CUDA frame (requires [`Self::with_cuda`])
+    ///
+    /// The Vulkan mapping is attached to the CUDA frame so the source image
+    /// stays valid until NVENC has consumed it.
+    pub fn import_cuda(&mut self, frame: &Arc<DmaBufFrame>) -> Result<HwFrame> {
+        let drm_frame = self.import(frame)?;
+        let contexts = self.contexts_for(&frame.info)?;
+
+        if contexts.vulkan.is_none() || contexts.cuda.is_none() {
+            return Err(Error::Internal("CUDA import not configured".into()));
+        }
+        let vulkan = contexts.vulkan.as_ref().unwrap();
+        let cuda = contexts.cuda.as_ref().unwrap();
+
+        let mapped = drm_frame.map_to(vulkan, HWFRAME_MAP_READ)?;
+        let mut cuda_frame = mapped.transfer_to(cuda)?;
+        cuda_frame.attach(mapped)?;
+        cuda_frame.set_pts(frame.pts);
+
+        Ok(cuda_frame)
+    }
+
+    /// CUDA frames context matching `info` (for configuring the encoder)
+    pub fn cuda_frames(&mut self, info: &DmaBufInfo) -> Result<HwFramesContext> {
+        self.contexts_for(info)?
+            .cuda
+            .clone()
+            .ok_or_else(|| Error::Internal("CUDA import not configured".into()))
+    }
+
+    /// CPU fallback: map a linear DMA-BUF and copy it into a pooled frame
+    pub fn download(&mut self, frame: &Arc<DmaBufFrame>, pool: &FramePool) -> Result<Frame> {
+        let info = &frame.info;
+        if !info.is_linear() {
+            return Err(Error::Internal(format!(
+                "Cannot map tiled DMA-BUF (modifier {:#x}) on the CPU",
+                info.modifier
+            )));
+        }
+        let format = info.frame_format().ok_or_else(|| {
+            Error::Internal(format!("Unsupported DMA-BUF format {:#x}", info.format))
+        })?;
+
+        if self.drm.is_none() {
+            self.drm = Some(HwDevice::create(
+                HwDeviceType::Drm,
+                find_render_node().as_deref(),
+            )?);
+        }
+        let mut drm_frame = self.import(frame)?;
+        let device = self.drm.clone().unwrap();
+        let drm_frames = {
+            let contexts = self.contexts_for(info)?;
+            if contexts.drm.is_none() {
+                contexts.drm = Some(HwFramesContext::new(
+                    &device,
+                    contexts.sw_format,
+                    contexts.width,
+                    contexts.height,
+                    0,
+                )?);
+            }
+            contexts.drm.clone().unwrap()
+        };
+        unsafe {
+            (*drm_frame.as_mut_ptr()).hw_frames_ctx = ffi::av_buffer_ref(drm_frames.as_ptr());
+        }
+
+        let mapped = drm_frame.map_to_system(HWFRAME_MAP_READ)?;
+
+        let stride = format.default_stride(info.width);
+        let mut out = Frame::from_pool(pool, info.width, info.height, stride, format);
+        let layout = format.plane_layout(info.height, stride);
+        let dst = out.data.make_mut();
+        for plane in 0..format.plane_count() {
+            let (offset, dst_stride) = layout[plane];
+            let rows = format.plane_height(plane, info.height) as usize;
+            let src_stride = mapped.stride(plane);
+            let src = mapped.data(plane);
+            let row_bytes = dst_stride.min(src_stride);
+            for row in 0..rows {
+                let s = &src[row * src_stride..row * src_stride + row_bytes];
+                let d = offset + row * dst_stride;
+                dst[d..d + row_bytes].copy_from_slice(s);
+            }
+        }
+
+        out.pts = frame.pts;
+        out.duration = frame.duration;
+        Ok(out)
+    }
+
+    /// Get (or rebuild after a renegotiation) the contexts for `info`
+    fn contexts_for(&mut self, info: &DmaBufInfo) -> Result<&mut ImportContexts> {
+        let sw_format = info.sw_format().ok_or_else(|| {
+            Error::Internal(format!("Unsupported DMA-BUF format {:#x}", info.format))
+        })?;
+
+        let stale = self
+            .contexts
+            .as_ref()
+            .map(|c| c.sw_format != sw_format || c.width != info.width || c.height != info.height)
+            .unwrap_or(true);
+
+        if stale {
+            let vulkan = self
+                .vulkan
+                .as_ref()
+                .map(|dev| HwFramesContext::new(dev, sw_format, info.width, info.height, 0))
+                .transpose()?;
+            let cuda = self
+                .cuda
+                .as_ref()
+                .map(|dev| HwFramesContext::new(dev, sw_format, info.width, info.height, 0))
+                .transpose()?;
+
+            tracing::debug!(
+                "DMA-BUF import contexts: {:?} {}x{} modifier {:#x}",
+                sw_format,
+                info.width,
+                info.height,
+                info.modifier
+            );
+
+            self.contexts = Some(ImportContexts {
+                sw_format,
+                width: info.width,
+                height: info.height,
+                vulkan,
+                cuda,
+                drm: None,
+            });
+        }
+
+        Ok(self.contexts.as_mut().unwrap())
     }
 }
 
 impl Default for DmaBufImporter {
     fn default() -> Self {
-        Self {}
+        Self {
+            cuda: None,
+            vulkan: None,
+            drm: None,
+            contexts: None,
+        }
+    }
+}
+
+impl std::fmt::Debug for DmaBufImporter {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("DmaBufImporter")
+            .field("cuda", &self.cuda.is_some())
+            .field("vulkan", &self.vulkan.is_some())
+            .finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn info(fd: RawFd) -> DmaBufInfo {
+        DmaBufInfo {
+            fd,
+            width: 64,
+            height: 32,
+            stride: 256,
+            format: DRM_FORMAT_XRGB8888,
+            modifier: DRM_FORMAT_MOD_LINEAR,
+            num_planes: 1,
+            offsets: [0; 4],
+            strides: [256, 0, 0, 0],
+            plane_fds: [fd, -1, -1, -1],
+        }
+    }
+
+    #[test]
+    fn test_modifiers_round_trip_through_format_pods() {
+        let size = Resolution::new(1920, 1080);
+        let rate = Framerate::new(60, 1);
+        let parse = |modifiers: Option<&[u64]>| {
+            let bytes = format_pod(VideoFormat::BGRx, modifiers, size, rate).unwrap();
+            parse_modifier(Pod::from_bytes(&bytes).unwrap())
+        };
+
+        // A list is left to the producer, one modifier is fixated, none
+        // means SHM
+        let offered = [I915_FORMAT_MOD_Y_TILED, DRM_FORMAT_MOD_LINEAR];
+        assert!(matches!(
+            parse(Some(&offered)),
+            NegotiatedModifier::Choice(m) if m == offered
+        ));
+        assert!(matches!(
+            parse(Some(&[DRM_FORMAT_MOD_INVALID])),
+            NegotiatedModifier::Fixed(DRM_FORMAT_MOD_INVALID)
+        ));
+        assert!(matches!(parse(None), NegotiatedModifier::None));
+    }
+
+    #[test]
+    fn test_supported_formats_map_to_pipewire() {
+        for drm in DmaBufCapture::supported_formats() {
+            let spa = drm_to_spa_format(drm).unwrap();
+            assert_eq!(spa_to_drm_format(spa), Some(drm));
+            assert!(drm_frame_format(drm).is_some());
+        }
+        assert_eq!(spa_to_drm_format(VideoFormat::I420), None);
+    }
+
+    #[test]
+    fn test_modifier_codes_match_drm_fourcc() {
+        // DRM_FORMAT_MOD_* values from drm_fourcc.h
+        assert_eq!(I915_FORMAT_MOD_Y_TILED, 0x0100_0000_0000_0002);
+        assert_eq!(I915_FORMAT_MOD_4_TILED, 0x0100_0000_0000_0009);
+        assert_eq!(nvidia_block_linear(1, 2, 0x06, 0), 0x0300_0000_0060_6010);
+        assert_eq!(nvidia_block_linear(1, 2, 0x06, 5), 0x0300_0000_0060_6015);
+    }
+
+    #[test]
+    fn test_drm_descriptor_planes() {
+        // NV12 in one plane: UV follows Y in the same object
+        let mut nv12 = info(3);
+        nv12.format = DRM_FORMAT_NV12;
+        nv12.strides = [64, 0, 0, 0];
+        nv12.stride = 64;
+        let desc = AVDRMFrameDescriptor::from_info(&nv12).unwrap();
+        assert_eq!((desc.nb_objects, desc.nb_layers), (1, 2));
+        assert_eq!(desc.layers[1].format, DRM_FORMAT_GR88);
+        assert_eq!(desc.layers[1].planes[0].offset, 64 * 32);
+        assert_eq!(desc.layers[1].planes[0].object_index, 0);
+
+        // Planes with their own fd get their own object
+        nv12.num_planes = 2;
+        nv12.offsets = [0, 128, 0, 0];
+        nv12.strides = [64, 64, 0, 0];
+        nv12.plane_fds = [3, 4, -1, -1];
+        let desc = AVDRMFrameDescriptor::from_info(&nv12).unwrap();
+        assert_eq!(desc.nb_objects, 2);
+        assert_eq!(desc.objects[1].fd, 4);
+        assert_eq!(desc.layers[1].planes[0].object_index, 1);
+        assert_eq!(desc.layers[1].planes[0].offset, 128);
+
+        let mut unknown = info(3);
+        unknown.format = fourcc(b"YUYV");
+        assert!(AVDRMFrameDescriptor::from_info(&unknown).is_err());
+    }
+
+    #[test]
+    fn test_buffer_returns_with_its_last_frame() {
+        let file = tempfile::tempfile().unwrap();
+        let returns = BufferReturns::new();
+        let buffer = NonNull::dangling();
+
+        let lease = returns.lease(buffer);
+        let frame = DmaBufFrame::new(info(file.as_raw_fd()), 0)
+            .unwrap()
+            .with_lease(Some(lease))
+            .into_frame();
+        let shared = frame.share();
+
+        drop(frame);
+        assert_eq!(returns.take().count(), 0);
+        drop(shared);
+        assert_eq!(returns.take().collect::<Vec<_>>(), vec![buffer]);
+
+        // Buffers of a previous allocation are not requeued
+        let stale = returns.lease(buffer);
+        returns.generation.set(1);
+        drop(stale);
+        assert_eq!(returns.take().count(), 0);
     }
 }
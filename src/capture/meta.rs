@@ -0,0 +1,173 @@
+//! Per-buffer metadata on PipeWire buffers
+//!
+//! Producers that honour the header meta stamp each buffer with the time
+//! the frame was captured; [`crate::clock::StreamClock`] maps that onto the
+//! pipeline clock. The video damage meta lists the regions that changed
+//! since the previous buffer.
+
+use super::damage::MAX_DAMAGE_RECTS;
+use super::dmabuf::serialize_pod;
+use crate::error::Result;
+use crate::types::Rect;
+
+use pipewire as pw;
+use pw::spa::buffer::Data;
+use pw::spa::pod::{ChoiceValue, Property, PropertyFlags, Value};
+use pw::spa::utils::{Choice, ChoiceEnum, ChoiceFlags};
+use std::ptr::NonNull;
+
+/// Meta param asking the producer to attach an `spa_meta_header`
+pub(crate) fn header_meta_pod() -> Result<Vec<u8>> {
+    let obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamMeta,
+        pw::spa::param::ParamType::Meta,
+        Property {
+            key: libspa_sys::SPA_PARAM_META_type,
+            flags: PropertyFlags::empty(),
+            value: Value::Id(pw::spa::utils::Id(libspa_sys::SPA_META_Header)),
+        },
+        Property {
+            key: libspa_sys::SPA_PARAM_META_size,
+            flags: PropertyFlags::empty(),
+            value: Value::Int(std::mem::size_of::<libspa_sys::spa_meta_header>() as i32),
+        },
+    );
+
+    serialize_pod(obj)
+}
+
+/// Meta param asking the producer for up to [`MAX_DAMAGE_RECTS`] damage
+/// regions per buffer
+pub(crate) fn damage_meta_pod() -> Result<Vec<u8>> {
+    let region = std::mem::size_of::<libspa_sys::spa_meta_region>() as i32;
+    let obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamMeta,
+        pw::spa::param::ParamType::Meta,
+        Property {
+            key: libspa_sys::SPA_PARAM_META_type,
+            flags: PropertyFlags::empty(),
+            value: Value::Id(pw::spa::utils::Id(libspa_sys::SPA_META_VideoDamage)),
+        },
+        Property {
+            key: libspa_sys::SPA_PARAM_META_size,
+            flags: PropertyFlags::empty(),
+            value: Value::Choice(ChoiceValue::Int(Choice(
+                ChoiceFlags::empty(),
+                ChoiceEnum::Range {
+                    default: region * MAX_DAMAGE_RECTS as i32,
+                    min: region,
+                    max: region * MAX_DAMAGE_RECTS as i32,
+                },
+            ))),
+        },
+    );
+
+    serialize_pod(obj)
+}
+
+/// Buffer dequeued through the C API so its metas are reachable
+/// (pipewire-rs' `Buffer` only exposes the data planes); requeued on drop
+/// unless [`RawBuffer::keep`] handed it to someone else
+pub(crate) struct RawBuffer<'s> {
+    stream: &'s pw::stream::StreamRef,
+    buf: NonNull<pw::sys::pw_buffer>,
+    requeue: bool,
+}
+
+impl<'s> RawBuffer<'s> {
+    pub fn dequeue(stream: &'s pw::stream::StreamRef) -> Option<Self> {
+        let buf = unsafe { pw::sys::pw_stream_dequeue_buffer(stream.as_raw_ptr()) };
+        NonNull::new(buf).map(|buf| Self {
+            stream,
+            buf,
+            requeue: true,
+        })
+    }
+
+    /// Keep the buffer from the producer past this callback; the caller
+    /// queues it back later, on the stream's thread
+    pub fn keep(&mut self) -> NonNull<pw::sys::pw_buffer> {
+        self.requeue = false;
+        self.buf
+    }
+
+    /// Data planes
+    pub fn datas_mut(&mut self) -> &mut [Data] {
+        unsafe {
+            let spa = (*self.buf.as_ptr()).buffer;
+            if spa.is_null() || (*spa).datas.is_null() {
+                return &mut [];
+            }
+            // Data is a transparent wrapper of spa_data
+            std::slice::from_raw_parts_mut((*spa).datas as *mut Data, (*spa).n_datas as usize)
+        }
+    }
+
+    /// Producer timestamp in nanoseconds, if the header meta is present
+    /// and set
+    pub fn pts_ns(&self) -> Option<i64> {
+        let meta = self.meta(
+            libspa_sys::SPA_META_Header,
+            std::mem::size_of::<libspa_sys::spa_meta_header>(),
+        )?;
+        let header = unsafe { &*(meta.data as *const libspa_sys::spa_meta_header) };
+        (header.pts > 0).then_some(header.pts)
+    }
+
+    /// Regions that changed since the previous buffer, clamped to a
+    /// `width`x`height` frame
+    ///
+    /// None when the producer attached no damage meta. The region list
+    /// ends at the first empty region, so an empty result means nothing
+    /// changed.
+    pub fn damage(&self, width: u32, height: u32) -> Option<Vec<Rect>> {
+        let size = std::mem::size_of::<libspa_sys::spa_meta_region>();
+        let meta = self.meta(libspa_sys::SPA_META_VideoDamage, size)?;
+        let regions = unsafe {
+            std::slice::from_raw_parts(
+                meta.data as *const libspa_sys::spa_meta_region,
+                meta.size as usize / size,
+            )
+        };
+
+        let mut damage = Vec::new();
+        for meta_region in regions {
+            let region = &meta_region.region;
+            if region.size.width == 0 || region.size.height == 0 {
+                break;
+            }
+            // Regions may start off the top/left edge
+            let (x, y) = (region.position.x as i64, region.position.y as i64);
+            let right = (x + region.size.width as i64).clamp(0, width as i64);
+            let bottom = (y + region.size.height as i64).clamp(0, height as i64);
+            let (x, y) = (x.clamp(0, right), y.clamp(0, bottom));
+            let rect = Rect::new(x as u32, y as u32, (right - x) as u32, (bottom - y) as u32);
+            if !rect.is_empty() {
+                damage.push(rect);
+            }
+        }
+        Some(damage)
+    }
+
+    /// Meta of `type_` holding at least `min_size` bytes
+    fn meta(&self, type_: u32, min_size: usize) -> Option<&libspa_sys::spa_meta> {
+        unsafe {
+            let spa = (*self.buf.as_ptr()).buffer;
+            if spa.is_null() || (*spa).metas.is_null() {
+                return None;
+            }
+            let metas = std::slice::from_raw_parts((*spa).metas, (*spa).n_metas as usize);
+            metas.iter().find(|meta| {
+                meta.type_ == type_ && !meta.data.is_null() && meta.size as usize >= min_size
+            })
+        }
+    }
+}
+
+impl Drop for RawBuffer<'_> {
+    fn drop(&mut self) {
+        if self.requeue {
+            unsafe { pw::sys::pw_stream_queue_buffer(self.stream.as_raw_ptr(), self.buf.as_ptr()) };
+        }
+    }
+}
@@ -4,18 +4,28 @@
 //! - xdg-desktop-portal (recommended for Wayland)
 //! - PipeWire direct capture
 //! - DMA-BUF zero-copy (wlroots, KDE, GNOME)
+//! - Scene compositing of several of the above
+//! - Generated test patterns (benchmarks)
 
+mod compositor;
+mod damage;
 mod dmabuf;
+mod meta;
+mod pattern;
 mod portal;
 mod stream;
+mod synthetic;
 
+pub use compositor::CompositorCapture;
 pub use dmabuf::{DmaBufCapture, DmaBufFrame, DmaBufInfo, DmaBufImporter};
+pub use pattern::TestPattern;
 pub use portal::PortalCapture;
 pub use stream::CaptureStream;
+pub use synthetic::SyntheticCapture;
 
 use crate::config::{CaptureBackend, CaptureConfig};
 use crate::error::Result;
-use crate::types::Frame;
+use crate::types::{Frame, FrameFormat};
 
 /// Trait for capture sources
 #[async_trait::async_trait]
@@ -37,10 +47,33 @@ pub trait Capture: Send + Sync {
 
     /// Get current framerate
     fn framerate(&self) -> Option<crate::types::Framerate>;
+
+    /// Frames discarded before reaching `next_frame` (source queue full)
+    fn frames_dropped(&self) -> u64 {
+        0
+    }
 }
 
 /// Create a capture source based on configuration
-pub async fn create_capture(config: CaptureConfig) -> Result<Box<dyn Capture>> {
+pub async fn create_capture(mut config: CaptureConfig) -> Result<Box<dyn Capture>> {
+    let Some(scene) = config.scene.take() else {
+        return create_source(config).await;
+    };
+
+    let mut sources = Vec::with_capacity(scene.sources.len());
+    for source in &scene.sources {
+        let source = CaptureConfig {
+            scene: None,
+            ..source.clone()
+        };
+        sources.push(create_source(source).await?);
+    }
+    let framerate = config.framerate;
+    Ok(Box::new(CompositorCapture::new(sources, scene, framerate)?))
+}
+
+/// Create a single (non-composited) capture source
+async fn create_source(config: CaptureConfig) -> Result<Box<dyn Capture>> {
     let backend = if config.backend == CaptureBackend::Auto {
         detect_best_backend(&config)
     } else {
@@ -58,6 +91,7 @@ pub async fn create_capture(config: CaptureConfig) -> Result<Box<dyn Capture>> {
             let capture = PortalCapture::new(config).await?;
             Ok(Box::new(capture))
         }
+        CaptureBackend::Synthetic => Ok(Box::new(SyntheticCapture::new(config))),
         CaptureBackend::WlrExport => {
             // Use DMA-BUF zero-copy capture
             if DmaBufCapture::is_available() {
@@ -73,6 +107,24 @@ pub async fn create_capture(config: CaptureConfig) -> Result<Box<dyn Capture>> {
     }
 }
 
+/// Format and DRM fourcc of the DMA-BUFs a capture for `config` is
+/// expected to deliver, or None if it will deliver system memory frames
+///
+/// A hint for opening encoders early: screens normally come as XRGB8888,
+/// but the producer may still pick another format or fall back to shared
+/// memory.
+pub(crate) fn expected_dmabuf(config: &CaptureConfig) -> Option<(FrameFormat, u32)> {
+    let backend = match config.backend {
+        CaptureBackend::Auto => detect_best_backend(config),
+        backend => backend,
+    };
+    let dmabuf = config.scene.is_none()
+        && config.prefer_dmabuf
+        && backend == CaptureBackend::WlrExport
+        && DmaBufCapture::is_available();
+    dmabuf.then_some((FrameFormat::Bgra, DmaBufInfo::SCREEN_FORMAT))
+}
+
 /// Detect the best capture backend for this system
 fn detect_best_backend(config: &CaptureConfig) -> CaptureBackend {
     // Check for Wayland
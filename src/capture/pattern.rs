@@ -0,0 +1,204 @@
+//! Synthetic test content
+//!
+//! Deterministic frames that look enough like a real desktop to make
+//! processing and encoder measurements mean something: smooth gradients,
+//! dense text-like detail and textured objects in motion. Zero-filled
+//! frames compress to almost nothing and flatter every encoder.
+
+use crate::error::Result;
+use crate::pool::{FramePool, PoolKey};
+use crate::processing::process_frame;
+use crate::types::{Frame, FrameFormat};
+
+use serde::{Deserialize, Serialize};
+
+/// Glyph cell size in pixels
+const CELL_WIDTH: u32 = 8;
+const CELL_HEIGHT: u32 = 16;
+
+/// Moving boxes in [`TestPattern::Motion`]
+const BOXES: u32 = 6;
+
+/// Kind of synthetic content
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default, Serialize, Deserialize)]
+pub enum TestPattern {
+    /// Slowly scrolling colour gradients (smooth, banding-prone areas)
+    #[default]
+    Gradient,
+    /// Pages of glyph-like blocks with a line being typed (sharp edges,
+    /// mostly static)
+    Text,
+    /// Textured boxes crossing a gradient at different speeds (motion
+    /// search)
+    Motion,
+}
+
+impl TestPattern {
+    pub const ALL: [TestPattern; 3] = [
+        TestPattern::Gradient,
+        TestPattern::Text,
+        TestPattern::Motion,
+    ];
+
+    pub fn name(&self) -> &'static str {
+        match self {
+            TestPattern::Gradient => "gradient",
+            TestPattern::Text => "text",
+            TestPattern::Motion => "motion",
+        }
+    }
+
+    /// Frame `index` of the pattern in `format`
+    pub fn render(
+        &self,
+        index: u64,
+        width: u32,
+        height: u32,
+        format: FrameFormat,
+    ) -> Result<Frame> {
+        let frame = self.render_bgra(index, width, height);
+        if format == FrameFormat::Bgra {
+            return Ok(frame);
+        }
+        process_frame(&frame, None, Some(format))
+    }
+
+    /// Frame `index` of the pattern in packed BGRA
+    pub fn render_bgra(&self, index: u64, width: u32, height: u32) -> Frame {
+        let key = PoolKey::packed(width, height, FrameFormat::Bgra);
+        let mut data = FramePool::global().acquire(key);
+        let stride = key.stride as usize;
+        let t = index as u32;
+
+        {
+            let buf = data.make_mut();
+            match self {
+                TestPattern::Gradient => gradient(buf, stride, width, height, t),
+                TestPattern::Text => text(buf, stride, width, height, t),
+                TestPattern::Motion => {
+                    gradient(buf, stride, width, height, t / 4);
+                    boxes(buf, stride, width, height, t);
+                }
+            }
+        }
+
+        Frame::with_buffer(data, width, height, key.stride, FrameFormat::Bgra)
+    }
+}
+
+impl std::fmt::Display for TestPattern {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str(self.name())
+    }
+}
+
+/// Cheap integer hash for deterministic texture
+fn hash(a: u32, b: u32) -> u32 {
+    let mut h = a.wrapping_mul(0x9E37_79B1) ^ b.wrapping_mul(0x85EB_CA77);
+    h ^= h >> 15;
+    h = h.wrapping_mul(0x2C1B_3C6D);
+    h ^ (h >> 12)
+}
+
+fn gradient(buf: &mut [u8], stride: usize, width: u32, height: u32, t: u32) {
+    let span = (width + height).max(1);
+    for y in 0..height {
+        let row = &mut buf[y as usize * stride..][..width as usize * 4];
+        let g = (y * 255 / height.max(1)) as u8;
+        for (x, px) in row.chunks_exact_mut(4).enumerate() {
+            let x = x as u32;
+            let b = ((x * 255 / width.max(1)) as u8).wrapping_add(t as u8);
+            let r = (((x + y) * 255 / span) as u8).wrapping_add((t as u8).wrapping_mul(2));
+            px.copy_from_slice(&[b, g, r, 255]);
+        }
+    }
+}
+
+fn text(buf: &mut [u8], stride: usize, width: u32, height: u32, t: u32) {
+    let cols = (width / CELL_WIDTH).max(1);
+    let rows = (height / CELL_HEIGHT).max(1);
+    // One line is being typed, a character per frame
+    let typing_row = (t / cols) % rows;
+    let typed = t % cols;
+
+    for y in 0..height {
+        let row = &mut buf[y as usize * stride..][..width as usize * 4];
+        let (cy, gy) = (y / CELL_HEIGHT, y % CELL_HEIGHT);
+        let line_len = hash(cy, 0x11) % cols;
+
+        for (x, px) in row.chunks_exact_mut(4).enumerate() {
+            let x = x as u32;
+            let (cx, gx) = (x / CELL_WIDTH, x % CELL_WIDTH);
+            let cell = hash(cx, cy);
+            let shown = cx < line_len && cell % 7 != 0 && !(cy == typing_row && cx > typed);
+            let ink = shown
+                && (1..6).contains(&gx)
+                && (3..13).contains(&gy)
+                && hash(cell % 96, gy * CELL_WIDTH + gx) % 3 == 0;
+            let cursor = cy == typing_row && cx == typed + 1 && (t / 15) % 2 == 0;
+
+            let value = if ink || cursor { 24 } else { 240 };
+            px.copy_from_slice(&[value, value, value, 255]);
+        }
+    }
+}
+
+fn boxes(buf: &mut [u8], stride: usize, width: u32, height: u32, t: u32) {
+    let size = (height / 5).max(1);
+    for i in 0..BOXES {
+        let speed_x = 2 + hash(i, 1) % 9;
+        let speed_y = 1 + hash(i, 2) % 5;
+        let travel = |seed: u32, speed: u32, span: u32| {
+            let span = (span + size) as u64;
+            ((seed as u64 + t as u64 * speed as u64) % span) as i64 - size as i64
+        };
+        let left = travel(hash(i, 3), speed_x, width);
+        let top = travel(hash(i, 4), speed_y, height);
+        let tint = hash(i, 5);
+
+        for by in 0..size {
+            let y = top + by as i64;
+            if y < 0 || y >= height as i64 {
+                continue;
+            }
+            let row = &mut buf[y as usize * stride..][..width as usize * 4];
+            for bx in 0..size {
+                let x = left + bx as i64;
+                if x < 0 || x >= width as i64 {
+                    continue;
+                }
+                // Texture moves with the box, so motion search can find it
+                let noise = hash(bx / 4 + i * 7919, by / 4) as u8 >> 2;
+                let checker = if (bx / 16 + by / 16) % 2 == 0 {
+                    160
+                } else {
+                    64
+                };
+                let px = &mut row[x as usize * 4..x as usize * 4 + 4];
+                px.copy_from_slice(&[
+                    checker + (tint as u8 >> 3) + noise,
+                    checker + noise,
+                    checker + ((tint >> 8) as u8 >> 3),
+                    255,
+                ]);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_patterns_are_deterministic_and_move() {
+        for pattern in TestPattern::ALL {
+            let a = pattern.render_bgra(10, 64, 48);
+            let b = pattern.render_bgra(10, 64, 48);
+            let c = pattern.render_bgra(11, 64, 48);
+            assert_eq!(&a.data[..], &b.data[..], "{}", pattern);
+            assert_ne!(&a.data[..], &c.data[..], "{}", pattern);
+            assert!(a.data.iter().any(|&v| v != a.data[0]), "{}", pattern);
+        }
+    }
+}
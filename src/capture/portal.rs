@@ -3,10 +3,15 @@
 //! Uses the Portal API for secure screen sharing on Wayland.
 //! PipeWire receives the actual video frames.
 
+use crate::clock::{PipelineClock, StreamClock};
 use crate::config::CaptureConfig;
 use crate::error::{Error, Result};
+use crate::pool::{FramePool, PoolKey};
+use crate::threading::{self, ThreadRole};
 use crate::types::{Frame, FrameFormat, Framerate, Resolution};
 
+use super::damage::{DamageCanvas, SourcePlane};
+use super::meta::{damage_meta_pod, header_meta_pod, RawBuffer};
 use super::Capture;
 
 use pipewire as pw;
@@ -26,7 +31,11 @@ pub struct PortalCapture {
     frame_rx: Option<mpsc::Receiver<Frame>>,
     pipewire_thread: Option<std::thread::JoinHandle<()>>,
     frame_count: Arc<AtomicU64>,
+    /// Frames discarded because the channel was full
+    frames_dropped: Arc<AtomicU64>,
     node_id: Option<u32>,
+    /// Latest frame, repeated as unchanged when the stream goes quiet
+    last_frame: Option<Frame>,
 }
 
 impl PortalCapture {
@@ -40,7 +49,9 @@ impl PortalCapture {
             frame_rx: None,
             pipewire_thread: None,
             frame_count: Arc::new(AtomicU64::new(0)),
+            frames_dropped: Arc::new(AtomicU64::new(0)),
             node_id: None,
+            last_frame: None,
         })
     }
 
@@ -109,16 +120,19 @@ impl PortalCapture {
         let (frame_tx, frame_rx) = mpsc::channel::<Frame>(4);
         let active = self.active.clone();
         let frame_count = self.frame_count.clone();
+        let frames_dropped = self.frames_dropped.clone();
         let target_resolution = self.resolution;
         let target_fps = self.config.framerate.fps();
 
         // PipeWire needs to run on its own thread with a MainLoop
         let handle = std::thread::spawn(move || {
+            threading::enter(ThreadRole::Capture);
             if let Err(e) = run_pipewire_capture(
                 node_id,
                 frame_tx,
                 active,
                 frame_count,
+                frames_dropped,
                 target_resolution,
                 target_fps,
             ) {
@@ -158,6 +172,7 @@ impl Capture for PortalCapture {
         }
 
         self.active.store(false, Ordering::SeqCst);
+        self.last_frame = None;
 
         // Wait for PipeWire thread to finish
         if let Some(handle) = self.pipewire_thread.take() {
@@ -178,19 +193,27 @@ impl Capture for PortalCapture {
             .as_mut()
             .ok_or_else(|| Error::Pipeline("Frame receiver not initialized".into()))?;
 
-        // Wait for next frame with timeout
-        match tokio::time::timeout(std::time::Duration::from_millis(100), rx.recv()).await {
-            Ok(Some(frame)) => Ok(frame),
-            Ok(None) => Err(Error::Pipeline("Frame channel closed".into())),
-            Err(_) => {
-                // Timeout - return an empty frame to keep pipeline moving
-                let resolution = self.resolution.unwrap_or(Resolution::FHD_1080P);
-                let mut frame = Frame::new(resolution.width, resolution.height, FrameFormat::Bgra);
-                frame.pts = std::time::SystemTime::now()
-                    .duration_since(std::time::UNIX_EPOCH)
-                    .unwrap()
-                    .as_micros() as i64;
-                Ok(frame)
+        // PipeWire only sends frames when the screen changes; after a quiet
+        // 100ms, repeat the last one with no damage to keep the pipeline
+        // moving. Before the first frame there is nothing to repeat.
+        loop {
+            match tokio::time::timeout(std::time::Duration::from_millis(100), rx.recv()).await {
+                Ok(Some(frame)) => {
+                    self.last_frame = Some(frame.share());
+                    return Ok(frame);
+                }
+                Ok(None) => return Err(Error::Pipeline("Frame channel closed".into())),
+                Err(_) => {
+                    if let Some(last) = &self.last_frame {
+                        let mut frame = last.share();
+                        frame.pts = PipelineClock::global().now();
+                        frame.damage = Some(Vec::new());
+                        return Ok(frame);
+                    }
+                    if !self.active.load(Ordering::SeqCst) {
+                        return Err(Error::CaptureEnded);
+                    }
+                }
             }
         }
     }
@@ -206,6 +229,10 @@ impl Capture for PortalCapture {
     fn framerate(&self) -> Option<Framerate> {
         self.framerate
     }
+
+    fn frames_dropped(&self) -> u64 {
+        self.frames_dropped.load(Ordering::Relaxed)
+    }
 }
 
 impl Drop for PortalCapture {
@@ -225,7 +252,13 @@ impl Drop for PortalCapture {
 struct CaptureState {
     frame_tx: mpsc::Sender<Frame>,
     frame_count: Arc<AtomicU64>,
+    frames_dropped: Arc<AtomicU64>,
     format: pw::spa::param::video::VideoInfoRaw,
+    /// Producer timestamps to pipeline PTS
+    clock: StreamClock,
+    pool: FramePool,
+    /// Frame buffers updated from damage regions
+    canvas: DamageCanvas,
 }
 
 /// Run PipeWire capture loop - based on pipewire-rs streams.rs example
@@ -234,6 +267,7 @@ fn run_pipewire_capture(
     frame_tx: mpsc::Sender<Frame>,
     active: Arc<AtomicBool>,
     frame_count: Arc<AtomicU64>,
+    frames_dropped: Arc<AtomicU64>,
     target_resolution: Option<Resolution>,
     target_fps: u32,
 ) -> Result<()> {
@@ -268,7 +302,14 @@ fn run_pipewire_capture(
     let state = CaptureState {
         frame_tx,
         frame_count,
+        frames_dropped,
         format: Default::default(),
+        clock: StreamClock::new(
+            PipelineClock::global(),
+            1_000_000 / target_fps.max(1) as i64,
+        ),
+        pool: FramePool::global().clone(),
+        canvas: DamageCanvas::new(),
     };
 
     // Clone for use in main loop check
@@ -288,7 +329,7 @@ fn run_pipewire_capture(
                 }
             }
         })
-        .param_changed(|_, state, id, param| {
+        .param_changed(|stream, state, id, param| {
             // Only handle Format params
             let Some(param) = param else { return };
             if id != pw::spa::param::ParamType::Format.as_raw() {
@@ -323,12 +364,33 @@ fn run_pipewire_capture(
                 state.format.framerate().num,
                 state.format.framerate().denom,
             );
+
+            // Ask for per-buffer capture timestamps and damage regions
+            let meta = header_meta_pod().and_then(|header| {
+                let damage = damage_meta_pod()?;
+                let mut params = Vec::new();
+                for bytes in [&header, &damage] {
+                    params.push(Pod::from_bytes(bytes).ok_or_else(|| {
+                        Error::PipeWire("Failed to create pod from bytes".into())
+                    })?);
+                }
+                stream
+                    .update_params(&mut params)
+                    .map_err(|e| Error::PipeWire(format!("Failed to update params: {}", e)))
+            });
+            if let Err(e) = meta {
+                tracing::warn!("Failed to request buffer metadata: {}", e);
+            }
         })
         .process(|stream, state| {
             // Dequeue buffer from stream
-            let Some(mut buffer) = stream.dequeue_buffer() else {
+            let Some(mut buffer) = RawBuffer::dequeue(stream) else {
                 return;
             };
+            let source_ns = buffer.pts_ns();
+            let width = state.format.size().width;
+            let height = state.format.size().height;
+            let damage = buffer.damage(width, height);
 
             let datas = buffer.datas_mut();
             if datas.is_empty() {
@@ -339,6 +401,7 @@ fn run_pipewire_capture(
             let chunk = data.chunk();
             let size = chunk.size() as usize;
             let offset = chunk.offset() as usize;
+            let chunk_stride = chunk.stride();
 
             if size == 0 {
                 return;
@@ -349,10 +412,6 @@ fn run_pipewire_capture(
                 return;
             };
 
-            // Determine resolution from negotiated format
-            let width = state.format.size().width;
-            let height = state.format.size().height;
-
             // Map PipeWire format to our format
             let frame_format = match state.format.format() {
                 VideoFormat::BGRx | VideoFormat::BGRA => FrameFormat::Bgra,
@@ -366,29 +425,41 @@ fn run_pipewire_capture(
                 }
             };
 
-            // Create frame and copy data
-            let mut frame = Frame::new(width, height, frame_format);
-
-            // Calculate expected size based on format
-            let expected_size = frame.data.len();
-            let copy_size = size
-                .min(expected_size)
-                .min(slice.len().saturating_sub(offset));
-
-            if copy_size > 0 && offset < slice.len() {
-                frame.data[..copy_size].copy_from_slice(&slice[offset..offset + copy_size]);
+            // Keep the producer's stride; only damaged regions are copied
+            let stride = if chunk_stride > 0 {
+                chunk_stride as u32
+            } else {
+                frame_format.default_stride(width)
+            };
+            if offset >= slice.len() {
+                return;
             }
+            let slice = &slice[..(offset + size).min(slice.len())];
+            let layout = frame_format.plane_layout(height, stride);
+            let planes = layout.map(|(plane_offset, plane_stride)| SourcePlane {
+                data: slice,
+                offset: offset + plane_offset,
+                stride: plane_stride,
+            });
+            let key = PoolKey::new(width, height, frame_format, stride);
+            let mut frame = state.canvas.update(
+                &state.pool,
+                key,
+                &planes[..frame_format.plane_count()],
+                damage,
+            );
 
-            // Set timestamp
-            frame.pts = std::time::SystemTime::now()
-                .duration_since(std::time::UNIX_EPOCH)
-                .unwrap()
-                .as_micros() as i64;
+            // Capture time on the pipeline clock
+            let stamp = state.clock.stamp(source_ns);
+            frame.pts = stamp.pts;
+            frame.duration = stamp.duration;
 
             state.frame_count.fetch_add(1, Ordering::Relaxed);
 
             // Send frame (non-blocking, drop if channel full)
-            let _ = state.frame_tx.try_send(frame);
+            if state.frame_tx.try_send(frame).is_err() {
+                state.frames_dropped.fetch_add(1, Ordering::Relaxed);
+            }
         })
         .register()
         .map_err(|e| Error::PipeWire(format!("Failed to register stream listener: {:?}", e)))?;
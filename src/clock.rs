@@ -0,0 +1,402 @@
+//! Pipeline clock
+//!
+//! Every stream is stamped on one timeline: microseconds on
+//! CLOCK_MONOTONIC since the clock's origin, the domain PipeWire stamps
+//! buffers and graph cycles in. Producer timestamps in that domain map
+//! straight across; anything else (another clock, or plain sample counts)
+//! goes through a [`DriftEstimator`] that follows its offset and rate
+//! against the pipeline clock.
+
+use std::collections::VecDeque;
+use std::sync::OnceLock;
+use std::time::{Duration, Instant};
+
+/// Ticks per second of pipeline timestamps (the time base of every PTS)
+pub const TICKS_PER_SEC: i32 = 1_000_000;
+
+/// Producer timestamps further than this from now are not CLOCK_MONOTONIC
+const SAME_DOMAIN_NS: i64 = 1_000_000_000;
+
+/// Time base of pipeline timestamps
+pub fn time_base() -> ffmpeg_next::Rational {
+    ffmpeg_next::Rational::new(1, TICKS_PER_SEC)
+}
+
+/// CLOCK_MONOTONIC in nanoseconds (vDSO, safe on realtime threads)
+pub fn monotonic_ns() -> i64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as i64 * 1_000_000_000 + ts.tv_nsec as i64
+}
+
+/// Monotonic timeline shared by every capture path
+#[derive(Debug, Clone, Copy)]
+pub struct PipelineClock {
+    origin_ns: i64,
+    origin: Instant,
+}
+
+impl PipelineClock {
+    /// Clock starting now
+    pub fn new() -> Self {
+        Self {
+            origin: Instant::now(),
+            origin_ns: monotonic_ns(),
+        }
+    }
+
+    /// Process-wide clock (origin at first use), so audio, video and every
+    /// rendition share one timeline
+    pub fn global() -> PipelineClock {
+        static CLOCK: OnceLock<PipelineClock> = OnceLock::new();
+        *CLOCK.get_or_init(PipelineClock::new)
+    }
+
+    /// Current time in microseconds
+    pub fn now(&self) -> i64 {
+        self.from_monotonic_ns(monotonic_ns())
+    }
+
+    /// Map a CLOCK_MONOTONIC timestamp
+    pub fn from_monotonic_ns(&self, ns: i64) -> i64 {
+        (ns - self.origin_ns) / 1000
+    }
+
+    /// Instant of a pipeline timestamp
+    pub fn instant_at(&self, us: i64) -> Instant {
+        if us >= 0 {
+            self.origin + Duration::from_micros(us as u64)
+        } else {
+            self.origin
+                .checked_sub(Duration::from_micros(us.unsigned_abs()))
+                .unwrap_or(self.origin)
+        }
+    }
+
+    /// When a frame stamped `pts` was captured, or `fallback` if `pts` is
+    /// not on this timeline (later than `fallback` or implausibly old)
+    pub fn capture_instant(&self, pts: i64, fallback: Instant) -> Instant {
+        let at = self.instant_at(pts);
+        match fallback.checked_duration_since(at) {
+            Some(age) if age < Duration::from_secs(10) => at,
+            _ => fallback,
+        }
+    }
+}
+
+impl Default for PipelineClock {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Offset and rate of a foreign clock against the pipeline clock
+///
+/// Fed (source time, arrival time) pairs. Delivery delay only ever adds to
+/// the offset, so each window keeps its smallest one and a least-squares
+/// line through recent window minima gives the offset at any source time;
+/// its slope is the drift.
+#[derive(Debug, Clone)]
+pub struct DriftEstimator {
+    /// Source microseconds per window
+    window: i64,
+    max_windows: usize,
+    /// (source time, minimum offset) of completed windows
+    minima: VecDeque<(i64, i64)>,
+    /// Window start, and the minimum seen in it so far
+    current: Option<(i64, (i64, i64))>,
+}
+
+impl DriftEstimator {
+    /// Windows of `window`, fitting over the last `max_windows`
+    pub fn new(window: Duration, max_windows: usize) -> Self {
+        Self {
+            window: window.as_micros().max(1) as i64,
+            max_windows: max_windows.max(2),
+            minima: VecDeque::new(),
+            current: None,
+        }
+    }
+
+    /// Record that a point stamped `source` (us) arrived at `arrival` (us)
+    pub fn observe(&mut self, source: i64, arrival: i64) {
+        let offset = arrival - source;
+        match &mut self.current {
+            Some((start, min)) if source - *start < self.window => {
+                if offset < min.1 {
+                    *min = (source, offset);
+                }
+            }
+            current => {
+                if let Some((_, min)) = current.take() {
+                    if self.minima.len() == self.max_windows {
+                        self.minima.pop_front();
+                    }
+                    self.minima.push_back(min);
+                }
+                *current = Some((source, (source, offset)));
+            }
+        }
+    }
+
+    fn points(&self) -> impl Iterator<Item = (i64, i64)> + '_ {
+        self.minima
+            .iter()
+            .copied()
+            .chain(self.current.map(|(_, min)| min))
+    }
+
+    /// Line through the window minima as (origin x, offset at x, slope)
+    fn fit(&self) -> Option<(i64, f64, f64)> {
+        let (x0, _) = self.points().next()?;
+        let n = self.points().count() as f64;
+        let (mut sx, mut sy, mut sxx, mut sxy) = (0.0, 0.0, 0.0, 0.0);
+        for (x, y) in self.points() {
+            let x = (x - x0) as f64;
+            let y = y as f64;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+
+        let denom = n * sxx - sx * sx;
+        // Too few (or too close) points for a slope yet
+        if self.minima.is_empty() || denom.abs() < f64::EPSILON {
+            let min = self.points().map(|(_, y)| y).min()?;
+            return Some((x0, min as f64, 0.0));
+        }
+        let slope = (n * sxy - sx * sy) / denom;
+        Some((x0, (sy - slope * sx) / n, slope))
+    }
+
+    /// Estimated offset (arrival - source) at `source`, if anything was
+    /// observed
+    pub fn offset_at(&self, source: i64) -> Option<i64> {
+        let (x0, intercept, slope) = self.fit()?;
+        Some((intercept + slope * (source - x0) as f64).round() as i64)
+    }
+
+    /// Rate of the pipeline clock against the source, in parts per million
+    /// (positive: the source runs slow)
+    pub fn drift_ppm(&self) -> f64 {
+        self.fit().map_or(0.0, |(_, _, slope)| slope * 1e6)
+    }
+}
+
+/// Timestamp and duration for one frame
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Stamp {
+    pub pts: i64,
+    pub duration: i64,
+}
+
+/// Maps producer timestamps of a frame stream onto the pipeline clock
+///
+/// Frames arrive at whatever rate the producer delivers (damage-driven
+/// capture is variable rate), so durations follow the measured interval
+/// instead of the nominal framerate.
+#[derive(Debug, Clone)]
+pub struct StreamClock {
+    clock: PipelineClock,
+    drift: DriftEstimator,
+    /// Nominal frame duration (us), used until intervals are measured
+    nominal: i64,
+    /// Smoothed frame interval (us)
+    interval: Option<f64>,
+    last: Option<i64>,
+}
+
+impl StreamClock {
+    pub fn new(clock: PipelineClock, nominal_duration: i64) -> Self {
+        Self {
+            clock,
+            drift: DriftEstimator::new(Duration::from_secs(1), 30),
+            nominal: nominal_duration.max(1),
+            interval: None,
+            last: None,
+        }
+    }
+
+    /// Stamp a frame that just arrived, from its producer timestamp in
+    /// nanoseconds (`None` or 0 when the producer sets none)
+    pub fn stamp(&mut self, source_ns: Option<i64>) -> Stamp {
+        let now_ns = monotonic_ns();
+        self.stamp_at(source_ns, now_ns)
+    }
+
+    fn stamp_at(&mut self, source_ns: Option<i64>, now_ns: i64) -> Stamp {
+        let now = self.clock.from_monotonic_ns(now_ns);
+        let mapped = match source_ns.filter(|&ns| ns > 0) {
+            // Already CLOCK_MONOTONIC: exact, capture latency included
+            Some(ns) if (now_ns - ns).abs() < SAME_DOMAIN_NS => self.clock.from_monotonic_ns(ns),
+            Some(ns) => {
+                let source = ns / 1000;
+                self.drift.observe(source, now);
+                source + self.drift.offset_at(source).unwrap_or(now - source)
+            }
+            None => now,
+        };
+
+        let mut pts = mapped.min(now);
+        if let Some(last) = self.last {
+            pts = pts.max(last + 1);
+            let elapsed = (pts - last) as f64;
+            self.interval = Some(match self.interval {
+                Some(interval) => interval + (elapsed - interval) / 8.0,
+                None => elapsed,
+            });
+        }
+        self.last = Some(pts);
+
+        let duration = self
+            .interval
+            .map_or(self.nominal, |interval| interval.round() as i64)
+            .clamp(1000, 1_000_000);
+        Stamp { pts, duration }
+    }
+
+    /// Drift of a foreign producer clock, in ppm
+    pub fn drift_ppm(&self) -> f64 {
+        self.drift.drift_ppm()
+    }
+}
+
+/// Timeline of a sample-counted stream (audio)
+///
+/// The first observation anchors sample 0 on the pipeline clock; after
+/// that the device clock's drift against it shows up as a growing offset
+/// between sample time and arrival time, which [`SampleClock::error`]
+/// reports so the stream can be stretched back into line.
+#[derive(Debug, Clone)]
+pub struct SampleClock {
+    clock: PipelineClock,
+    rate: u32,
+    /// Pipeline time of sample 0
+    anchor: Option<i64>,
+    drift: DriftEstimator,
+    /// Samples inserted (positive) or removed so far to follow the clock
+    corrected: i64,
+}
+
+impl SampleClock {
+    pub fn new(clock: PipelineClock, rate: u32) -> Self {
+        Self {
+            clock,
+            rate: rate.max(1),
+            anchor: None,
+            drift: DriftEstimator::new(Duration::from_secs(2), 30),
+            corrected: 0,
+        }
+    }
+
+    fn sample_time(&self, samples: u64) -> i64 {
+        (samples as u128 * TICKS_PER_SEC as u128 / self.rate as u128) as i64
+    }
+
+    /// Record that `samples` in total had been delivered by now
+    pub fn observe(&mut self, samples: u64) {
+        let now = self.clock.now();
+        self.observe_at(samples, now);
+    }
+
+    fn observe_at(&mut self, samples: u64, now: i64) {
+        let time = self.sample_time(samples);
+        let anchor = *self.anchor.get_or_insert(now - time);
+        self.drift.observe(time, now - anchor);
+    }
+
+    /// Pipeline time of sample 0 (None until the first observation)
+    pub fn anchor(&self) -> Option<i64> {
+        self.anchor
+    }
+
+    /// Samples the stream has to gain (positive) or lose after `samples`
+    /// delivered to stay on the pipeline clock, net of earlier corrections
+    pub fn error(&self, samples: u64) -> i64 {
+        let time = self.sample_time(samples);
+        let lag = self.drift.offset_at(time).unwrap_or(0);
+        lag * self.rate as i64 / TICKS_PER_SEC as i64 - self.corrected
+    }
+
+    /// Account for `samples` inserted (or removed, if negative)
+    pub fn corrected(&mut self, samples: i64) {
+        self.corrected += samples;
+    }
+
+    /// Drift of the device clock, in ppm
+    pub fn drift_ppm(&self) -> f64 {
+        self.drift.drift_ppm()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_drift_estimate() {
+        let mut drift = DriftEstimator::new(Duration::from_secs(1), 10);
+        // Source runs 100ppm slow, with up to 5ms of delivery jitter
+        for i in 0..600i64 {
+            let source = i * 16_667;
+            let arrival = 50_000 + source + source / 10_000 + (i * 7919) % 5000;
+            drift.observe(source, arrival);
+        }
+
+        assert!((drift.drift_ppm() - 100.0).abs() < 10.0);
+        let source = 600 * 16_667;
+        let offset = drift.offset_at(source).unwrap();
+        assert!((offset - (50_000 + source / 10_000)).abs() < 200);
+    }
+
+    #[test]
+    fn test_stream_clock_vfr() {
+        let clock = PipelineClock::new();
+        let mut stream = StreamClock::new(clock, 16_667);
+        let base = clock.origin_ns;
+
+        // Producer stamps on CLOCK_MONOTONIC map straight across
+        let first = stream.stamp_at(Some(base + 10_000_000), base + 12_000_000);
+        assert_eq!(
+            first,
+            Stamp {
+                pts: 10_000,
+                duration: 16_667
+            }
+        );
+
+        // A 100ms gap (static screen) lengthens the duration
+        let second = stream.stamp_at(Some(base + 110_000_000), base + 111_000_000);
+        assert_eq!(second.pts, 110_000);
+        assert_eq!(second.duration, 100_000);
+
+        // Never goes backwards, even if the producer does
+        let third = stream.stamp_at(Some(base + 100_000_000), base + 112_000_000);
+        assert_eq!(third.pts, 110_001);
+    }
+
+    #[test]
+    fn test_sample_clock_error() {
+        let clock = PipelineClock::new();
+        let mut audio = SampleClock::new(clock, 48_000);
+
+        // One 1024-sample quantum per 21.3ms of pipeline time, but the
+        // device delivers 0.1% slow: 48 samples short per second
+        let mut samples = 0u64;
+        for i in 0..1000i64 {
+            samples += 1024;
+            let now = 1_000 + (samples as i64 * 1_000_000 / 48_000) * 1001 / 1000 + i % 3;
+            audio.observe_at(samples, now);
+        }
+
+        // ~21.3s delivered: about 1000 samples behind
+        let error = audio.error(samples);
+        assert!((900..1100).contains(&error), "error {}", error);
+        audio.corrected(error);
+        assert!(audio.error(samples).abs() < 2);
+    }
+}
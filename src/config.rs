@@ -1,12 +1,18 @@
 //! Configuration types for GhostStream
 
+use crate::capture::TestPattern;
 use crate::encode::Codec;
+use crate::error::{Error, Result};
 use crate::processing::HdrConfig;
-use crate::types::{FrameFormat, Framerate, Resolution};
+use crate::threading::CpuSet;
+use crate::types::{FrameFormat, Framerate, Rect, Resolution};
 use serde::{Deserialize, Serialize};
 
+use std::path::{Path, PathBuf};
+
 /// Capture configuration
 #[derive(Debug, Clone, Serialize, Deserialize)]
+#[serde(default)]
 pub struct CaptureConfig {
     /// Target framerate
     pub framerate: Framerate,
@@ -18,6 +24,15 @@ pub struct CaptureConfig {
     pub backend: CaptureBackend,
     /// Use DMA-BUF zero-copy if available
     pub prefer_dmabuf: bool,
+    /// Capture -> encoder queue
+    #[serde(default)]
+    pub queue: QueueConfig,
+    /// Composite several sources instead of capturing one
+    #[serde(default)]
+    pub scene: Option<SceneConfig>,
+    /// Generated frames for [`CaptureBackend::Synthetic`]
+    #[serde(default)]
+    pub synthetic: SyntheticConfig,
 }
 
 impl Default for CaptureConfig {
@@ -28,6 +43,9 @@ impl Default for CaptureConfig {
             capture_audio: false,
             backend: CaptureBackend::Auto,
             prefer_dmabuf: true,
+            queue: QueueConfig::default(),
+            scene: None,
+            synthetic: SyntheticConfig::default(),
         }
     }
 }
@@ -47,6 +65,321 @@ impl CaptureConfig {
         self.backend = backend;
         self
     }
+
+    pub fn with_queue(mut self, queue: QueueConfig) -> Self {
+        self.queue = queue;
+        self
+    }
+
+    pub fn with_scene(mut self, scene: SceneConfig) -> Self {
+        self.scene = Some(scene);
+        self
+    }
+
+    /// Capture generated test frames instead of the screen
+    pub fn with_synthetic(mut self, synthetic: SyntheticConfig) -> Self {
+        self.backend = CaptureBackend::Synthetic;
+        self.synthetic = synthetic;
+        self
+    }
+}
+
+/// Generated test source (benchmarks, headless testing)
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub struct SyntheticConfig {
+    pub resolution: Resolution,
+    pub pattern: TestPattern,
+    pub format: FrameFormat,
+    /// Distinct frames rendered up front and looped (a real capture does
+    /// not render, so neither should the source being measured)
+    pub loop_frames: u32,
+}
+
+impl Default for SyntheticConfig {
+    fn default() -> Self {
+        Self {
+            resolution: Resolution::FHD_1080P,
+            pattern: TestPattern::Motion,
+            format: FrameFormat::Bgra,
+            loop_frames: 30,
+        }
+    }
+}
+
+impl SyntheticConfig {
+    pub fn new(resolution: Resolution, pattern: TestPattern) -> Self {
+        Self {
+            resolution,
+            pattern,
+            ..Self::default()
+        }
+    }
+
+    pub fn with_format(mut self, format: FrameFormat) -> Self {
+        self.format = format;
+        self
+    }
+}
+
+/// Sources composited into one frame (picture-in-picture, overlays)
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct SceneConfig {
+    /// Composite size
+    pub resolution: Resolution,
+    /// BGRA fill behind the layers
+    #[serde(default = "SceneConfig::default_background")]
+    pub background: [u8; 4],
+    /// Captures referenced by the layers, each run with its own settings
+    /// (their `scene` is ignored)
+    pub sources: Vec<CaptureConfig>,
+    /// Layers, bottom first
+    pub layers: Vec<SceneLayer>,
+}
+
+impl SceneConfig {
+    pub fn new(resolution: Resolution) -> Self {
+        Self {
+            resolution,
+            background: Self::default_background(),
+            sources: Vec::new(),
+            layers: Vec::new(),
+        }
+    }
+
+    /// Add a source, returning its index for [`SceneLayer::new`]
+    pub fn add_source(&mut self, source: CaptureConfig) -> usize {
+        self.sources.push(source);
+        self.sources.len() - 1
+    }
+
+    pub fn with_layer(mut self, layer: SceneLayer) -> Self {
+        self.layers.push(layer);
+        self
+    }
+
+    /// Opaque black
+    fn default_background() -> [u8; 4] {
+        [0, 0, 0, 255]
+    }
+}
+
+/// One source placed in a scene
+#[derive(Debug, Clone, Copy, PartialEq, Serialize, Deserialize)]
+pub struct SceneLayer {
+    /// Index into [`SceneConfig::sources`]
+    pub source: usize,
+    /// Where the source is drawn (scaled to fit exactly)
+    pub rect: Rect,
+    /// 0.0 (hidden) to 1.0 (opaque)
+    #[serde(default = "SceneLayer::default_opacity")]
+    pub opacity: f32,
+    /// Blend with the source's alpha channel (overlays); otherwise it is
+    /// drawn opaque
+    #[serde(default)]
+    pub use_alpha: bool,
+}
+
+impl SceneLayer {
+    pub fn new(source: usize, rect: Rect) -> Self {
+        Self {
+            source,
+            rect,
+            opacity: Self::default_opacity(),
+            use_alpha: false,
+        }
+    }
+
+    pub fn with_opacity(mut self, opacity: f32) -> Self {
+        self.opacity = opacity;
+        self
+    }
+
+    pub fn with_alpha(mut self) -> Self {
+        self.use_alpha = true;
+        self
+    }
+
+    fn default_opacity() -> f32 {
+        1.0
+    }
+}
+
+/// What to do with a captured frame when the encoder falls behind
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize, Default)]
+pub enum BackpressurePolicy {
+    /// Hold capture until there is room (no frame is lost)
+    Block,
+    /// Evict the oldest queued frame
+    #[default]
+    DropOldest,
+    /// Discard the new frame
+    DropNewest,
+    /// Queue at most one frame, always the newest (lowest latency)
+    KeepLatest,
+}
+
+impl BackpressurePolicy {
+    /// Policy for producers that must never wait (PipeWire callbacks)
+    pub fn non_blocking(self) -> Self {
+        match self {
+            BackpressurePolicy::Block => BackpressurePolicy::DropOldest,
+            other => other,
+        }
+    }
+}
+
+/// Bounded frame queue settings
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+pub struct QueueConfig {
+    /// Frames the queue holds (KeepLatest always holds one)
+    pub capacity: usize,
+    pub policy: BackpressurePolicy,
+    /// Frames queued for longer than this are dropped on dequeue, as long
+    /// as a newer frame is waiting behind them
+    pub latency_budget_ms: Option<u32>,
+}
+
+impl Default for QueueConfig {
+    fn default() -> Self {
+        Self {
+            capacity: 4,
+            policy: BackpressurePolicy::DropOldest,
+            latency_budget_ms: None,
+        }
+    }
+}
+
+impl QueueConfig {
+    pub fn with_capacity(mut self, capacity: usize) -> Self {
+        self.capacity = capacity;
+        self
+    }
+
+    pub fn with_policy(mut self, policy: BackpressurePolicy) -> Self {
+        self.policy = policy;
+        self
+    }
+
+    pub fn with_latency_budget(mut self, budget_ms: u32) -> Self {
+        self.latency_budget_ms = Some(budget_ms);
+        self
+    }
+
+    /// One frame, always the newest: nothing waits behind the encoder
+    pub fn low_latency() -> Self {
+        Self {
+            capacity: 1,
+            policy: BackpressurePolicy::KeepLatest,
+            latency_budget_ms: None,
+        }
+    }
+}
+
+/// Thread placement (see [`crate::threading`])
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub struct ThreadingConfig {
+    /// Pin threads using the automatic CCD/L3 and P-core aware layout
+    pub pin: bool,
+    /// Cores per role, overriding the automatic layout ("0-7,16-23")
+    pub capture: Option<CpuSet>,
+    pub audio: Option<CpuSet>,
+    pub process: Option<CpuSet>,
+    pub encode: Option<CpuSet>,
+    pub io: Option<CpuSet>,
+    /// Run capture and audio loops SCHED_FIFO (directly or through rtkit)
+    pub realtime: bool,
+    pub realtime_priority: u8,
+}
+
+impl Default for ThreadingConfig {
+    fn default() -> Self {
+        Self {
+            pin: false,
+            capture: None,
+            audio: None,
+            process: None,
+            encode: None,
+            io: None,
+            realtime: false,
+            realtime_priority: 10,
+        }
+    }
+}
+
+impl ThreadingConfig {
+    /// Automatic layout, with realtime capture and audio
+    pub fn pinned() -> Self {
+        Self {
+            pin: true,
+            realtime: true,
+            ..Self::default()
+        }
+    }
+
+    pub fn with_encode_cpus(mut self, cpus: CpuSet) -> Self {
+        self.encode = Some(cpus);
+        self
+    }
+}
+
+/// `ghoststream daemon` settings, read from a TOML file
+#[derive(Debug, Clone, Serialize, Deserialize)]
+#[serde(default)]
+pub struct DaemonConfig {
+    /// Socket clients connect to (None = `$XDG_RUNTIME_DIR/ghoststream.sock`)
+    pub socket: Option<PathBuf>,
+    pub capture: CaptureConfig,
+    pub encoder: EncoderConfig,
+    pub threading: ThreadingConfig,
+    pub frames: FrameExportConfig,
+    /// Packets queued per client; a client further behind skips to the
+    /// next keyframe
+    pub client_queue: usize,
+}
+
+impl Default for DaemonConfig {
+    fn default() -> Self {
+        Self {
+            socket: None,
+            capture: CaptureConfig::default(),
+            encoder: EncoderConfig::default(),
+            threading: ThreadingConfig::default(),
+            frames: FrameExportConfig::default(),
+            client_queue: 64,
+        }
+    }
+}
+
+impl DaemonConfig {
+    /// Read a config file; missing fields take their defaults
+    pub fn load(path: &Path) -> Result<Self> {
+        let text = std::fs::read_to_string(path)
+            .map_err(|e| Error::Config(format!("Failed to read {}: {}", path.display(), e)))?;
+        toml::from_str(&text)
+            .map_err(|e| Error::Config(format!("Invalid config {}: {}", path.display(), e)))
+    }
+}
+
+/// Raw frames the daemon shares with its clients
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub struct FrameExportConfig {
+    /// Export captured frames (the capture then delivers CPU frames
+    /// instead of DMA-BUFs)
+    pub enabled: bool,
+    /// Frames in the ring; a reader has `slots - 1` frame times to copy one
+    pub slots: u32,
+}
+
+impl Default for FrameExportConfig {
+    fn default() -> Self {
+        Self {
+            enabled: false,
+            slots: 3,
+        }
+    }
 }
 
 /// Capture backend selection
@@ -61,10 +394,13 @@ pub enum CaptureBackend {
     PipeWire,
     /// Wlroots DMA-BUF export (for wlroots compositors)
     WlrExport,
+    /// Generated test frames (see [`SyntheticConfig`])
+    Synthetic,
 }
 
 /// Encoder configuration
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Serialize, Deserialize)]
+#[serde(default)]
 pub struct EncoderConfig {
     /// Video codec
     pub codec: Codec,
@@ -96,6 +432,19 @@ pub struct EncoderConfig {
     pub level: Option<String>,
     /// HDR configuration (None for SDR)
     pub hdr: Option<HdrConfig>,
+    /// NVENC input surfaces (None = encoder default); QSV and AMF size
+    /// their pools from `async_depth`
+    pub surfaces: Option<u32>,
+    /// Frames the encoder may hold before a packet must be read back
+    /// (None = encoder default; 0 = synchronous output)
+    pub async_depth: Option<u32>,
+    /// NVENC GPU index (None = default GPU; set by the encoder scheduler)
+    pub device: Option<u32>,
+    /// Slices per frame (None = encoder default); receivers can start
+    /// decoding a frame before all of it has arrived
+    pub slices: Option<u32>,
+    /// How a software encode spreads over many cores
+    pub parallel: CpuParallelism,
 }
 
 impl Default for EncoderConfig {
@@ -116,6 +465,11 @@ impl Default for EncoderConfig {
             profile: None,
             level: None,
             hdr: None, // SDR by default
+            surfaces: None,
+            async_depth: None,
+            device: None,
+            slices: None,
+            parallel: CpuParallelism::default(),
         }
     }
 }
@@ -161,6 +515,26 @@ impl EncoderConfig {
         self
     }
 
+    pub fn with_surfaces(mut self, surfaces: u32) -> Self {
+        self.surfaces = Some(surfaces);
+        self
+    }
+
+    pub fn with_async_depth(mut self, depth: u32) -> Self {
+        self.async_depth = Some(depth);
+        self
+    }
+
+    pub fn with_slices(mut self, slices: u32) -> Self {
+        self.slices = Some(slices);
+        self
+    }
+
+    pub fn with_parallelism(mut self, parallel: CpuParallelism) -> Self {
+        self.parallel = parallel;
+        self
+    }
+
     /// Enable HDR10 encoding
     pub fn with_hdr10(mut self) -> Self {
         self.hdr = Some(HdrConfig::hdr10());
@@ -184,6 +558,29 @@ impl EncoderConfig {
         self
     }
 
+    /// Does `other` differ from this config only in bitrate (the one change
+    /// an open encoder can take without being recreated)?
+    pub fn differs_only_in_bitrate(&self, other: &EncoderConfig) -> bool {
+        self.codec == other.codec
+            && self.resolution == other.resolution
+            && self.framerate == other.framerate
+            && self.rate_control == other.rate_control
+            && self.preset == other.preset
+            && self.tuning == other.tuning
+            && self.gop_size == other.gop_size
+            && self.b_frames == other.b_frames
+            && self.lookahead == other.lookahead
+            && self.pixel_format == other.pixel_format
+            && self.profile == other.profile
+            && self.level == other.level
+            && self.hdr == other.hdr
+            && self.surfaces == other.surfaces
+            && self.async_depth == other.async_depth
+            && self.device == other.device
+            && self.slices == other.slices
+            && self.parallel == other.parallel
+    }
+
     /// Check if HDR is enabled
     pub fn is_hdr(&self) -> bool {
         self.hdr.as_ref().map(|h| h.is_hdr()).unwrap_or(false)
@@ -195,6 +592,25 @@ impl EncoderConfig {
     }
 }
 
+/// Parallelism of software (x264/x265/SVT-AV1) encodes
+///
+/// Frame threading stops scaling at 8–16 threads; the other modes keep
+/// large core counts busy at 4K and high frame rates.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize, Default)]
+pub enum CpuParallelism {
+    /// The encoder's own frame threads
+    #[default]
+    Frames,
+    /// Frames also split into slices (x264, x265) or tiles (SVT-AV1)
+    /// encoded concurrently; keeps live latency. `EncoderConfig::slices`
+    /// sets the count, otherwise it follows the encoder's threads.
+    Slices,
+    /// Closed-GOP chunks of `gop_size` frames encoded by `workers`
+    /// encoder instances and put back in order (offline: output trails
+    /// input by about `workers` GOPs)
+    Chunks { workers: u32 },
+}
+
 /// Rate control mode
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize, Default)]
 pub enum RateControl {
@@ -261,6 +677,12 @@ impl EncoderTuning {
             EncoderTuning::Lossless => "lossless",
         }
     }
+
+    /// End-to-end low latency: no B-frames, lookahead or encoder delay,
+    /// short queues and a flush per packet on the wire
+    pub fn is_realtime(&self) -> bool {
+        matches!(self, EncoderTuning::UltraLowLatency)
+    }
 }
 
 /// High-level presets for common use cases
@@ -356,10 +778,13 @@ impl From<Preset> for EncoderConfig {
                 resolution: None,
                 framerate: Framerate::FPS_60,
                 bitrate_kbps: 8000,
+                rate_control: RateControl::Cbr,
                 preset: EncoderPreset::Fastest,
                 tuning: EncoderTuning::UltraLowLatency,
                 gop_size: 30,
                 b_frames: 0,
+                async_depth: Some(0),
+                slices: Some(4),
                 ..Default::default()
             },
             Preset::Recording => EncoderConfig {
@@ -0,0 +1,109 @@
+//! Client side of `ghoststream daemon`
+//!
+//! ```rust,no_run
+//! use ghoststream::daemon::{DaemonClient, DaemonEvent};
+//!
+//! let mut client = DaemonClient::connect(None)?;
+//! loop {
+//!     match client.next_event()? {
+//!         DaemonEvent::Packet(packet) => { /* mux or forward */ }
+//!         DaemonEvent::Frames => {
+//!             let frame = client.frames().and_then(|ring| ring.latest(0));
+//!         }
+//!         DaemonEvent::Codec(_) => {}
+//!     }
+//! }
+//! # Ok::<(), ghoststream::Error>(())
+//! ```
+
+use super::ipc::{Message, Reader, PROTOCOL_VERSION};
+use super::ring::FrameRingReader;
+use crate::error::{Error, Result};
+use crate::types::{CodecParams, Packet};
+
+use std::os::unix::net::UnixStream;
+use std::path::Path;
+use std::sync::Arc;
+
+/// What the daemon sent
+#[derive(Debug)]
+pub enum DaemonEvent {
+    /// Params of the packets that follow
+    Codec(Option<CodecParams>),
+    /// Encoded video; the first one after connecting is a keyframe
+    Packet(Packet),
+    /// A frame ring is available (or replaced the previous one)
+    Frames,
+}
+
+/// Connection to a running daemon
+///
+/// Reads block; run the client on its own thread (or in
+/// `spawn_blocking`).
+pub struct DaemonClient {
+    reader: Reader,
+    daemon_version: String,
+    params: Option<CodecParams>,
+    frames: Option<FrameRingReader>,
+}
+
+impl DaemonClient {
+    /// Connect to the daemon at `socket` (None = the default socket)
+    pub fn connect(socket: Option<&Path>) -> Result<Self> {
+        let path = socket.map_or_else(super::default_socket, Path::to_path_buf);
+        let stream = UnixStream::connect(&path).map_err(|e| {
+            Error::Daemon(format!("Failed to connect to {}: {}", path.display(), e))
+        })?;
+
+        let mut reader = Reader::new(stream);
+        let hello = match reader.read()? {
+            Message::Hello(hello) => hello,
+            _ => return Err(Error::Daemon("Daemon did not say hello".into())),
+        };
+        if hello.protocol != PROTOCOL_VERSION {
+            return Err(Error::Daemon(format!(
+                "Daemon {} speaks protocol {}, this client {}",
+                hello.version, hello.protocol, PROTOCOL_VERSION
+            )));
+        }
+
+        Ok(Self {
+            reader,
+            daemon_version: hello.version,
+            params: None,
+            frames: None,
+        })
+    }
+
+    /// Next event, blocking until one arrives
+    pub fn next_event(&mut self) -> Result<DaemonEvent> {
+        match self.reader.read()? {
+            Message::Codec(params) => {
+                self.params = params.clone();
+                Ok(DaemonEvent::Codec(params))
+            }
+            Message::Packet(packet) => Ok(DaemonEvent::Packet(packet)),
+            Message::Frames(fd) => {
+                let fd = Arc::try_unwrap(fd)
+                    .map_err(|_| Error::Internal("Frame ring fd still shared".into()))?;
+                self.frames = Some(FrameRingReader::open(fd)?);
+                Ok(DaemonEvent::Frames)
+            }
+            Message::Hello(_) => Err(Error::Daemon("Unexpected hello".into())),
+        }
+    }
+
+    pub fn daemon_version(&self) -> &str {
+        &self.daemon_version
+    }
+
+    /// Params of the current video stream
+    pub fn codec_params(&self) -> Option<&CodecParams> {
+        self.params.as_ref()
+    }
+
+    /// Raw frames, once the daemon has shared its ring
+    pub fn frames(&self) -> Option<&FrameRingReader> {
+        self.frames.as_ref()
+    }
+}
@@ -0,0 +1,338 @@
+//! Daemon wire protocol
+//!
+//! Messages on the Unix stream socket are `[len: u32][kind: u8][body]`,
+//! little-endian, with `len` counting the kind byte and the body. Control
+//! messages carry TOML; packets carry a fixed header followed by the
+//! payload. The frame ring's memfd travels as SCM_RIGHTS ancillary data
+//! on its message's first byte. The daemon only writes; clients only read.
+
+use crate::error::{Error, Result};
+use crate::types::{CodecParams, Packet};
+
+use serde::{Deserialize, Serialize};
+
+use std::collections::VecDeque;
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::Arc;
+
+/// Bumped on any incompatible change to the messages
+pub const PROTOCOL_VERSION: u32 = 1;
+
+const KIND_HELLO: u8 = 1;
+const KIND_CODEC: u8 = 2;
+const KIND_PACKET: u8 = 3;
+const KIND_FRAMES: u8 = 4;
+
+/// pts, dts, duration (i64 each) and flags (u8)
+const PACKET_HEADER: usize = 25;
+const FLAG_KEYFRAME: u8 = 1;
+
+/// Largest message a client accepts
+const MAX_MESSAGE: usize = 64 << 20;
+
+/// First message on every connection
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Hello {
+    pub protocol: u32,
+    /// Daemon's crate version
+    pub version: String,
+}
+
+/// Message from the daemon
+#[derive(Debug, Clone)]
+pub(crate) enum Message {
+    Hello(Hello),
+    /// Params of the packets that follow (None = unknown)
+    Codec(Option<CodecParams>),
+    Packet(Packet),
+    /// A new frame ring replaces the previous one
+    Frames(Arc<OwnedFd>),
+}
+
+/// Params as a TOML body (empty = None)
+#[derive(Serialize, Deserialize)]
+struct CodecBody {
+    params: Option<CodecParams>,
+}
+
+impl Message {
+    /// Header and body, except a packet's payload (which is written from
+    /// the shared packet buffer as-is)
+    fn head(&self) -> Result<Vec<u8>> {
+        let (kind, body, payload) = match self {
+            Message::Hello(hello) => (KIND_HELLO, to_toml(hello)?, 0),
+            Message::Codec(params) => (
+                KIND_CODEC,
+                to_toml(&CodecBody {
+                    params: params.clone(),
+                })?,
+                0,
+            ),
+            Message::Packet(packet) => {
+                let mut body = Vec::with_capacity(PACKET_HEADER);
+                body.extend_from_slice(&packet.pts.to_le_bytes());
+                body.extend_from_slice(&packet.dts.to_le_bytes());
+                body.extend_from_slice(&packet.duration.to_le_bytes());
+                body.push(if packet.is_keyframe { FLAG_KEYFRAME } else { 0 });
+                (KIND_PACKET, body, packet.size())
+            }
+            Message::Frames(_) => (KIND_FRAMES, Vec::new(), 0),
+        };
+
+        let len = 1 + body.len() + payload;
+        let mut head = Vec::with_capacity(5 + body.len());
+        head.extend_from_slice(&(len as u32).to_le_bytes());
+        head.push(kind);
+        head.extend_from_slice(&body);
+        Ok(head)
+    }
+}
+
+fn to_toml<T: Serialize>(value: &T) -> Result<Vec<u8>> {
+    toml::to_string(value)
+        .map(String::into_bytes)
+        .map_err(|e| Error::Daemon(format!("Failed to encode message: {}", e)))
+}
+
+/// Write `message` to a daemon-side client socket
+pub(crate) async fn write_message(
+    stream: &mut tokio::net::UnixStream,
+    message: &Message,
+) -> Result<()> {
+    use tokio::io::{AsyncWriteExt, Interest};
+
+    let head = message.head()?;
+    let mut written = 0;
+    if let Message::Frames(fd) = message {
+        // The fd goes with the first byte; the rest is plain data
+        let socket = stream.as_raw_fd();
+        while written == 0 {
+            stream.writable().await?;
+            match stream.try_io(Interest::WRITABLE, || {
+                send_with_fd(socket, &head, fd.as_raw_fd())
+            }) {
+                Ok(n) => written = n,
+                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => continue,
+                Err(e) => return Err(e.into()),
+            }
+        }
+    }
+    stream.write_all(&head[written..]).await?;
+    if let Message::Packet(packet) = message {
+        stream.write_all(&packet.data).await?;
+    }
+    Ok(())
+}
+
+/// sendmsg with one fd attached
+fn send_with_fd(socket: RawFd, bytes: &[u8], fd: RawFd) -> std::io::Result<usize> {
+    unsafe {
+        let space = libc::CMSG_SPACE(std::mem::size_of::<RawFd>() as u32) as usize;
+        let mut control = vec![0u8; space];
+        let mut iov = libc::iovec {
+            iov_base: bytes.as_ptr() as *mut libc::c_void,
+            iov_len: bytes.len(),
+        };
+        let mut msg: libc::msghdr = std::mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = space as _;
+
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(std::mem::size_of::<RawFd>() as u32) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg).cast::<RawFd>(), fd);
+
+        let sent = libc::sendmsg(socket, &msg, libc::MSG_NOSIGNAL);
+        if sent < 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(sent as usize)
+    }
+}
+
+/// recvmsg keeping any fds that arrive
+fn recv_with_fds(
+    socket: RawFd,
+    buf: &mut [u8],
+    fds: &mut VecDeque<OwnedFd>,
+) -> std::io::Result<usize> {
+    unsafe {
+        let space = libc::CMSG_SPACE((4 * std::mem::size_of::<RawFd>()) as u32) as usize;
+        let mut control = vec![0u8; space];
+        let mut iov = libc::iovec {
+            iov_base: buf.as_mut_ptr().cast(),
+            iov_len: buf.len(),
+        };
+        let mut msg: libc::msghdr = std::mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = space as _;
+
+        let received = libc::recvmsg(socket, &mut msg, libc::MSG_CMSG_CLOEXEC);
+        if received < 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg).cast::<RawFd>();
+                let count = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize)
+                    / std::mem::size_of::<RawFd>();
+                for i in 0..count {
+                    fds.push_back(OwnedFd::from_raw_fd(std::ptr::read_unaligned(data.add(i))));
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+        Ok(received as usize)
+    }
+}
+
+/// Client-side message reader over a blocking socket
+pub(crate) struct Reader {
+    stream: std::os::unix::net::UnixStream,
+    fds: VecDeque<OwnedFd>,
+}
+
+impl Reader {
+    pub fn new(stream: std::os::unix::net::UnixStream) -> Self {
+        Self {
+            stream,
+            fds: VecDeque::new(),
+        }
+    }
+
+    fn read_exact(&mut self, mut buf: &mut [u8]) -> Result<()> {
+        while !buf.is_empty() {
+            match recv_with_fds(self.stream.as_raw_fd(), buf, &mut self.fds) {
+                Ok(0) => return Err(Error::Daemon("Daemon closed the connection".into())),
+                Ok(n) => {
+                    let rest = buf;
+                    buf = &mut rest[n..];
+                }
+                Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.into()),
+            }
+        }
+        Ok(())
+    }
+
+    /// Next message, blocking until it has arrived
+    pub fn read(&mut self) -> Result<Message> {
+        let mut head = [0u8; 5];
+        self.read_exact(&mut head)?;
+        let len = u32::from_le_bytes(head[..4].try_into().expect("4 bytes")) as usize;
+        if len == 0 || len > MAX_MESSAGE {
+            return Err(Error::Daemon(format!("Bad message length {}", len)));
+        }
+        if head[4] == KIND_PACKET {
+            return self.read_packet(len - 1);
+        }
+        let mut body = vec![0u8; len - 1];
+        self.read_exact(&mut body)?;
+
+        let toml_body = |body: &[u8]| {
+            std::str::from_utf8(body)
+                .map_err(|e| Error::Daemon(format!("Bad message: {}", e)))
+                .map(str::to_string)
+        };
+        match head[4] {
+            KIND_HELLO => toml::from_str(&toml_body(&body)?)
+                .map(Message::Hello)
+                .map_err(|e| Error::Daemon(format!("Bad hello: {}", e))),
+            KIND_CODEC => toml::from_str::<CodecBody>(&toml_body(&body)?)
+                .map(|body| Message::Codec(body.params))
+                .map_err(|e| Error::Daemon(format!("Bad codec params: {}", e))),
+            KIND_FRAMES => self
+                .fds
+                .pop_front()
+                .map(|fd| Message::Frames(Arc::new(fd)))
+                .ok_or_else(|| Error::Daemon("Frame ring message without its fd".into())),
+            kind => Err(Error::Daemon(format!("Unknown message kind {}", kind))),
+        }
+    }
+
+    /// Packet body of `len` bytes; the payload is read straight into the
+    /// packet's own buffer
+    fn read_packet(&mut self, len: usize) -> Result<Message> {
+        if len < PACKET_HEADER {
+            return Err(Error::Daemon(format!(
+                "Short packet message ({} bytes)",
+                len
+            )));
+        }
+        let mut header = [0u8; PACKET_HEADER];
+        self.read_exact(&mut header)?;
+        let mut payload = vec![0u8; len - PACKET_HEADER];
+        self.read_exact(&mut payload)?;
+
+        let field =
+            |i: usize| i64::from_le_bytes(header[i * 8..i * 8 + 8].try_into().expect("8 bytes"));
+        let mut packet = Packet::new(payload, field(0), field(1), header[24] & FLAG_KEYFRAME != 0);
+        packet.duration = field(2);
+        Ok(Message::Packet(packet))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::{Read, Seek, Write};
+
+    fn write_message_blocking(
+        stream: &mut std::os::unix::net::UnixStream,
+        message: &Message,
+    ) -> Result<()> {
+        let head = message.head()?;
+        let mut written = 0;
+        if let Message::Frames(fd) = message {
+            written = send_with_fd(stream.as_raw_fd(), &head, fd.as_raw_fd())?;
+        }
+        stream.write_all(&head[written..])?;
+        if let Message::Packet(packet) = message {
+            stream.write_all(&packet.data)?;
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_messages_and_fds_cross_the_socket() {
+        let (mut tx, rx) = std::os::unix::net::UnixStream::pair().unwrap();
+        let mut reader = Reader::new(rx);
+
+        let mut packet = Packet::new(vec![1, 2, 3, 4], 2000, 1000, true);
+        packet.duration = 16_666;
+        write_message_blocking(&mut tx, &Message::Packet(packet)).unwrap();
+
+        let mut file = tempfile::tempfile().unwrap();
+        file.write_all(b"ring").unwrap();
+        let fd = Arc::new(OwnedFd::from(file));
+        write_message_blocking(&mut tx, &Message::Frames(fd)).unwrap();
+        write_message_blocking(&mut tx, &Message::Codec(None)).unwrap();
+
+        match reader.read().unwrap() {
+            Message::Packet(p) => {
+                assert_eq!((&p.data[..], p.pts, p.dts), (&[1, 2, 3, 4][..], 2000, 1000));
+                assert!(p.is_keyframe);
+                assert_eq!(p.duration, 16_666);
+            }
+            other => panic!("unexpected {:?}", other),
+        }
+        match reader.read().unwrap() {
+            Message::Frames(fd) => {
+                let mut file = std::fs::File::from(fd.try_clone().unwrap());
+                file.rewind().unwrap();
+                let mut data = Vec::new();
+                file.read_to_end(&mut data).unwrap();
+                assert_eq!(data, b"ring");
+            }
+            other => panic!("unexpected {:?}", other),
+        }
+        assert!(matches!(reader.read().unwrap(), Message::Codec(None)));
+    }
+}
@@ -0,0 +1,486 @@
+//! Shared capture and encode daemon
+//!
+//! One process owns the portal session, the capture and the encoder, and
+//! local clients (GhostCast, Nitrogen, PhantomLink) attach to it instead
+//! of each running their own. Captured frames go into a memfd ring every
+//! client maps read-only ([`ring`]); encoded packets go out over a Unix
+//! socket ([`ipc`]). Every client's queue holds the same packet buffer and
+//! writes it to the socket from there, so the only per-client copy is the
+//! kernel's.
+//! A client that falls behind skips to the next keyframe rather than
+//! holding up the others.
+
+mod client;
+pub mod ipc;
+pub mod ring;
+
+pub use client::{DaemonClient, DaemonEvent};
+pub use ring::{FrameRing, FrameRingReader};
+
+use crate::capture;
+use crate::config::{DaemonConfig, QueueConfig};
+use crate::error::{Error, Result};
+use crate::metrics::{Metrics, MetricsSnapshot};
+use crate::pipeline::{self, EncoderControl, EncoderEvent};
+use crate::queue::{self, QueueReceiver};
+use crate::threading::{self, ThreadRole};
+use crate::types::{CodecParams, Frame, Packet};
+
+use ipc::{Hello, Message, PROTOCOL_VERSION};
+
+use crossbeam_channel::RecvTimeoutError;
+use tokio::net::{UnixListener, UnixStream};
+use tokio::sync::{mpsc, watch};
+
+use std::os::unix::fs::PermissionsExt;
+use std::os::unix::io::OwnedFd;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+/// `$XDG_RUNTIME_DIR/ghoststream.sock`, or a per-user socket under /tmp
+pub fn default_socket() -> PathBuf {
+    match std::env::var_os("XDG_RUNTIME_DIR") {
+        Some(dir) if !dir.is_empty() => PathBuf::from(dir).join("ghoststream.sock"),
+        _ => {
+            let uid = unsafe { libc::getuid() };
+            std::env::temp_dir().join(format!("ghoststream-{}.sock", uid))
+        }
+    }
+}
+
+/// Capture and encoder sessions shared with local clients
+pub struct Daemon {
+    config: DaemonConfig,
+    running: Arc<AtomicBool>,
+    metrics: Arc<Metrics>,
+    encoder_control: parking_lot::Mutex<Option<EncoderControl>>,
+}
+
+impl Daemon {
+    pub fn new(mut config: DaemonConfig) -> Self {
+        // Frames are exported from CPU memory
+        if config.frames.enabled {
+            config.capture.prefer_dmabuf = false;
+        }
+        Self {
+            config,
+            running: Arc::new(AtomicBool::new(false)),
+            metrics: Arc::new(Metrics::new()),
+            encoder_control: parking_lot::Mutex::new(None),
+        }
+    }
+
+    pub fn socket(&self) -> PathBuf {
+        self.config.socket.clone().unwrap_or_else(default_socket)
+    }
+
+    /// Capture, encode and serve clients until [`Daemon::stop`]
+    pub async fn run(&self) -> Result<()> {
+        if self.running.swap(true, Ordering::SeqCst) {
+            return Err(Error::PipelineAlreadyRunning);
+        }
+
+        let socket = self.socket();
+        let listener = bind(&socket)?;
+        tracing::info!("Daemon listening on {}", socket.display());
+
+        let encoder_config = self.config.encoder.clone();
+        let dmabuf = capture::expected_dmabuf(&self.config.capture);
+        let (frame_tx, frame_rx) = queue::frame_queue::<Frame>(self.config.capture.queue);
+        let (packet_tx, packet_rx) = mpsc::channel::<EncoderEvent>(8);
+        let (codec_params_tx, codec_params_rx) =
+            tokio::sync::oneshot::channel::<Option<CodecParams>>();
+        let (control, control_rx) = EncoderControl::channel(encoder_config.clone());
+        *self.encoder_control.lock() = Some(control);
+
+        let encoder_running = self.running.clone();
+        let encoder_metrics = self.metrics.clone();
+        std::thread::spawn(move || {
+            threading::enter(ThreadRole::Encode);
+            pipeline::run_encoder(
+                encoder_config,
+                dmabuf,
+                frame_rx,
+                packet_tx,
+                codec_params_tx,
+                control_rx,
+                encoder_running,
+                encoder_metrics,
+            )
+        });
+
+        // The ring writer only ever wants the newest frame
+        let (rings_tx, rings_rx) = watch::channel::<Option<Arc<OwnedFd>>>(None);
+        let export_tx = if self.config.frames.enabled {
+            let (tx, rx) = queue::frame_queue::<Frame>(QueueConfig::low_latency());
+            let slots = self.config.frames.slots as usize;
+            let running = self.running.clone();
+            std::thread::Builder::new()
+                .name("ghoststream-frame-export".into())
+                .spawn(move || {
+                    threading::enter(ThreadRole::Io);
+                    run_frame_export(rx, slots, rings_tx, running)
+                })
+                .map_err(|e| Error::Daemon(format!("Failed to spawn export thread: {}", e)))?;
+            Some(tx)
+        } else {
+            None
+        };
+
+        // Slow readers never hold up the encoder
+        tokio::spawn(pipeline::run_capture(
+            self.config.capture.clone(),
+            frame_tx,
+            self.running.clone(),
+            self.metrics.clone(),
+            move |frame| {
+                if let Some(export_tx) = &export_tx {
+                    let _ = export_tx.push(frame.share());
+                }
+            },
+        ));
+
+        let mut hub = Hub::new(self.config.client_queue);
+        let result = serve(
+            &listener,
+            &mut hub,
+            packet_rx,
+            codec_params_rx,
+            rings_rx,
+            &self.metrics,
+        )
+        .await;
+
+        self.running.store(false, Ordering::SeqCst);
+        *self.encoder_control.lock() = None;
+        let _ = std::fs::remove_file(&socket);
+        tracing::info!("Daemon stopped");
+        result
+    }
+
+    /// Stop capture; the encoder drains and clients are disconnected
+    pub fn stop(&self) {
+        self.running.store(false, Ordering::SeqCst);
+    }
+
+    pub fn is_running(&self) -> bool {
+        self.running.load(Ordering::SeqCst)
+    }
+
+    /// Handle for changing the shared encoder (every client sees it)
+    pub fn encoder_control(&self) -> Option<EncoderControl> {
+        self.encoder_control.lock().clone()
+    }
+
+    pub fn metrics(&self) -> MetricsSnapshot {
+        self.metrics.snapshot()
+    }
+}
+
+/// Listen on `path`, replacing a socket no daemon answers on
+fn bind(path: &std::path::Path) -> Result<UnixListener> {
+    if path.exists() {
+        if std::os::unix::net::UnixStream::connect(path).is_ok() {
+            return Err(Error::Daemon(format!(
+                "A daemon is already listening on {}",
+                path.display()
+            )));
+        }
+        std::fs::remove_file(path)?;
+    }
+    if let Some(dir) = path.parent() {
+        std::fs::create_dir_all(dir)?;
+    }
+    let listener = UnixListener::bind(path)
+        .map_err(|e| Error::Daemon(format!("Failed to bind {}: {}", path.display(), e)))?;
+    // Frames are the user's screen: same user only
+    std::fs::set_permissions(path, std::fs::Permissions::from_mode(0o600))?;
+    Ok(listener)
+}
+
+/// Accept clients and fan encoder output out to them until the encoder
+/// finishes
+async fn serve(
+    listener: &UnixListener,
+    hub: &mut Hub,
+    mut packet_rx: mpsc::Receiver<EncoderEvent>,
+    mut codec_params_rx: tokio::sync::oneshot::Receiver<Option<CodecParams>>,
+    mut rings_rx: watch::Receiver<Option<Arc<OwnedFd>>>,
+    metrics: &Metrics,
+) -> Result<()> {
+    let mut params_pending = true;
+    let mut rings_open = true;
+    loop {
+        tokio::select! {
+            accepted = listener.accept() => match accepted {
+                Ok((stream, _)) => hub.attach(stream),
+                Err(e) => tracing::warn!("Failed to accept client: {}", e),
+            },
+            params = &mut codec_params_rx, if params_pending => {
+                params_pending = false;
+                hub.announce(params.ok().flatten());
+            }
+            changed = rings_rx.changed(), if rings_open => match changed {
+                Ok(()) => {
+                    if let Some(fd) = rings_rx.borrow_and_update().clone() {
+                        hub.broadcast_frames(fd);
+                    }
+                }
+                Err(_) => rings_open = false,
+            },
+            event = packet_rx.recv() => match event {
+                Some(EncoderEvent::Packet(packet, _)) => {
+                    metrics.frames_encoded.fetch_add(1, Ordering::Relaxed);
+                    metrics
+                        .bytes_written
+                        .fetch_add(packet.size() as u64, Ordering::Relaxed);
+                    hub.broadcast_packet(packet);
+                }
+                Some(EncoderEvent::CodecChanged(params)) => hub.announce(params),
+                None => return Ok(()),
+            },
+        }
+    }
+}
+
+/// An attached client
+struct ClientHandle {
+    id: u64,
+    tx: mpsc::Sender<Message>,
+    /// Dropping packets until the next keyframe
+    waiting_for_keyframe: bool,
+}
+
+/// Connected clients and what a newcomer needs to start
+struct Hub {
+    clients: Vec<ClientHandle>,
+    params: Option<CodecParams>,
+    frames: Option<Arc<OwnedFd>>,
+    queue: usize,
+    next_id: u64,
+}
+
+impl Hub {
+    fn new(queue: usize) -> Self {
+        Self {
+            clients: Vec::new(),
+            params: None,
+            frames: None,
+            // Room for the start-up messages as well
+            queue: queue.max(4),
+            next_id: 0,
+        }
+    }
+
+    fn attach(&mut self, stream: UnixStream) {
+        let (id, rx) = self.add_client();
+        tokio::spawn(run_client(id, stream, rx));
+        tracing::info!("Client {} attached ({} connected)", id, self.clients.len());
+    }
+
+    /// Register a client, its queue primed with what it needs to start
+    fn add_client(&mut self) -> (u64, mpsc::Receiver<Message>) {
+        let (tx, rx) = mpsc::channel(self.queue);
+        let hello = Hello {
+            protocol: PROTOCOL_VERSION,
+            version: crate::VERSION.to_string(),
+        };
+        let _ = tx.try_send(Message::Hello(hello));
+        if self.params.is_some() {
+            let _ = tx.try_send(Message::Codec(self.params.clone()));
+        }
+        if let Some(fd) = &self.frames {
+            let _ = tx.try_send(Message::Frames(fd.clone()));
+        }
+
+        let id = self.next_id;
+        self.next_id += 1;
+        self.clients.push(ClientHandle {
+            id,
+            tx,
+            waiting_for_keyframe: true,
+        });
+        (id, rx)
+    }
+
+    /// Messages every client must get; a client too far behind to take
+    /// one is dropped
+    fn broadcast(&mut self, message: Message) {
+        self.clients
+            .retain(|client| match client.tx.try_send(message.clone()) {
+                Ok(()) => true,
+                Err(mpsc::error::TrySendError::Full(_)) => {
+                    tracing::warn!("Client {} is not reading; disconnecting it", client.id);
+                    false
+                }
+                Err(mpsc::error::TrySendError::Closed(_)) => false,
+            });
+    }
+
+    fn announce(&mut self, params: Option<CodecParams>) {
+        self.params = params.clone();
+        self.broadcast(Message::Codec(params));
+    }
+
+    fn broadcast_frames(&mut self, fd: Arc<OwnedFd>) {
+        self.frames = Some(fd.clone());
+        self.broadcast(Message::Frames(fd));
+    }
+
+    fn broadcast_packet(&mut self, packet: Packet) {
+        self.clients.retain_mut(|client| {
+            if client.waiting_for_keyframe {
+                if !packet.is_keyframe {
+                    return true;
+                }
+                client.waiting_for_keyframe = false;
+            }
+            match client.tx.try_send(Message::Packet(packet.clone())) {
+                Ok(()) => true,
+                Err(mpsc::error::TrySendError::Full(_)) => {
+                    tracing::debug!("Client {} behind; skipping to the next keyframe", client.id);
+                    client.waiting_for_keyframe = true;
+                    true
+                }
+                Err(mpsc::error::TrySendError::Closed(_)) => {
+                    tracing::info!("Client {} detached", client.id);
+                    false
+                }
+            }
+        });
+    }
+}
+
+/// Write queued messages to one client until either side goes away
+async fn run_client(id: u64, mut stream: UnixStream, mut rx: mpsc::Receiver<Message>) {
+    while let Some(message) = rx.recv().await {
+        if let Err(e) = ipc::write_message(&mut stream, &message).await {
+            tracing::debug!("Client {} write failed: {}", id, e);
+            break;
+        }
+    }
+}
+
+/// Export thread: copy each frame into the ring, replacing the ring with
+/// a bigger one when a frame outgrows it
+fn run_frame_export(
+    frame_rx: QueueReceiver<Frame>,
+    slots: usize,
+    rings_tx: watch::Sender<Option<Arc<OwnedFd>>>,
+    running: Arc<AtomicBool>,
+) {
+    let mut ring: Option<FrameRing> = None;
+    let mut warned = false;
+    loop {
+        let frame = match frame_rx.recv_timeout(Duration::from_millis(100)) {
+            Ok(received) => received.item,
+            Err(RecvTimeoutError::Timeout) if running.load(Ordering::SeqCst) => continue,
+            Err(_) => break,
+        };
+        if frame.data.is_empty() {
+            if !warned {
+                tracing::warn!("Capture delivers DMA-BUF frames only; frames are not exported");
+                warned = true;
+            }
+            continue;
+        }
+
+        if ring
+            .as_ref()
+            .map_or(true, |ring| ring.slot_bytes() < frame.data.len())
+        {
+            let created = FrameRing::create(slots, frame.data.len())
+                .and_then(|new| Ok((new.fd().try_clone()?, new)));
+            match created {
+                Ok((fd, new)) => {
+                    ring = Some(new);
+                    rings_tx.send_replace(Some(Arc::new(fd)));
+                }
+                Err(e) => {
+                    tracing::error!("Frame export disabled: {}", e);
+                    return;
+                }
+            }
+        }
+        if let Some(ring) = ring.as_mut() {
+            ring.publish(&frame);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn packet(pts: i64, keyframe: bool) -> Packet {
+        Packet::new(vec![0; 16], pts, pts, keyframe)
+    }
+
+    /// pts of the packets queued for a client, skipping other messages
+    fn packets(rx: &mut mpsc::Receiver<Message>) -> Vec<i64> {
+        std::iter::from_fn(|| rx.try_recv().ok())
+            .filter_map(|message| match message {
+                Message::Packet(packet) => Some(packet.pts),
+                _ => None,
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_newcomer_starts_at_a_keyframe() {
+        let mut hub = Hub::new(8);
+        hub.announce(Some(CodecParams::default()));
+        let (_, mut rx) = hub.add_client();
+        assert!(matches!(rx.try_recv(), Ok(Message::Hello(_))));
+        assert!(matches!(rx.try_recv(), Ok(Message::Codec(Some(_)))));
+
+        hub.broadcast_packet(packet(1, false));
+        hub.broadcast_packet(packet(2, true));
+        hub.broadcast_packet(packet(3, false));
+        assert_eq!(packets(&mut rx), vec![2, 3]);
+    }
+
+    #[test]
+    fn test_full_queue_skips_to_the_next_keyframe() {
+        let mut hub = Hub::new(4);
+        let (_, mut slow) = hub.add_client();
+        let (_, mut fast) = hub.add_client();
+        // Drop the hellos
+        slow.try_recv().unwrap();
+        fast.try_recv().unwrap();
+
+        hub.broadcast_packet(packet(0, true));
+        for pts in 1..4 {
+            hub.broadcast_packet(packet(pts, false));
+        }
+        assert_eq!(packets(&mut fast), vec![0, 1, 2, 3]);
+
+        // The slow client's queue is full: it misses 4 and, though it has
+        // caught up meanwhile, the rest of that GOP
+        hub.broadcast_packet(packet(4, false));
+        assert_eq!(packets(&mut slow), vec![0, 1, 2, 3]);
+        hub.broadcast_packet(packet(5, false));
+        hub.broadcast_packet(packet(6, true));
+        assert_eq!(packets(&mut slow), vec![6]);
+        assert_eq!(packets(&mut fast), vec![4, 5, 6]);
+    }
+
+    #[test]
+    fn test_client_missing_a_control_message_is_dropped() {
+        let mut hub = Hub::new(4);
+        let (_, _stalled) = hub.add_client();
+        let (_, mut reading) = hub.add_client();
+        for _ in 0..4 {
+            hub.announce(None);
+            while reading.try_recv().is_ok() {}
+        }
+        assert_eq!(hub.clients.len(), 1);
+
+        // Closed receivers go at the next message
+        drop(reading);
+        hub.broadcast_packet(packet(0, true));
+        assert!(hub.clients.is_empty());
+    }
+}
@@ -0,0 +1,380 @@
+//! Shared-memory frame ring
+//!
+//! One sealed memfd holding a header and a few frame slots. The daemon
+//! writes each frame into the next slot once; every client maps the same
+//! pages read-only, so attaching another client costs no capture and no
+//! copy on the daemon's side. Slots are seqlocked: a reader copies the
+//! newest slot out and keeps the copy only if the slot's sequence did not
+//! move meanwhile.
+
+use crate::error::{Error, Result};
+use crate::pool::{FramePool, PoolKey};
+use crate::types::{Frame, FrameFormat};
+
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
+use std::ptr::NonNull;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+
+const MAGIC: u64 = u64::from_le_bytes(*b"GSFRAME\0");
+const VERSION: u32 = 1;
+
+/// Slot headers and data start on page boundaries
+const ALIGN: usize = 4096;
+
+/// Attempts before a reader gives up on a slot the writer keeps lapping
+const READ_ATTEMPTS: usize = 4;
+
+#[repr(C)]
+struct RingHeader {
+    magic: u64,
+    version: u32,
+    slots: u32,
+    /// Data bytes per slot
+    slot_bytes: u64,
+    /// Number of the newest complete frame (0 = none yet)
+    sequence: AtomicU64,
+}
+
+#[repr(C)]
+struct SlotHeader {
+    /// Twice the frame number once written, odd while being written
+    seq: AtomicU64,
+    width: u32,
+    height: u32,
+    stride: u32,
+    format: u32,
+    len: u64,
+    pts: i64,
+    duration: i64,
+}
+
+fn slot_stride(slot_bytes: usize) -> usize {
+    (std::mem::size_of::<SlotHeader>().next_multiple_of(ALIGN) + slot_bytes).next_multiple_of(ALIGN)
+}
+
+fn ring_size(slots: usize, slot_bytes: usize) -> usize {
+    std::mem::size_of::<RingHeader>().next_multiple_of(ALIGN) + slots * slot_stride(slot_bytes)
+}
+
+fn format_code(format: FrameFormat) -> u32 {
+    match format {
+        FrameFormat::Nv12 => 0,
+        FrameFormat::Yuv420p => 1,
+        FrameFormat::Yuv444p => 2,
+        FrameFormat::Bgra => 3,
+        FrameFormat::Rgba => 4,
+        FrameFormat::Rgb24 => 5,
+        FrameFormat::P010 => 6,
+    }
+}
+
+fn format_from_code(code: u32) -> Option<FrameFormat> {
+    Some(match code {
+        0 => FrameFormat::Nv12,
+        1 => FrameFormat::Yuv420p,
+        2 => FrameFormat::Yuv444p,
+        3 => FrameFormat::Bgra,
+        4 => FrameFormat::Rgba,
+        5 => FrameFormat::Rgb24,
+        6 => FrameFormat::P010,
+        _ => return None,
+    })
+}
+
+/// A shared mapping of a ring
+struct Mapping {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// The mapping is only touched through atomics and raw copies
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    fn new(fd: &OwnedFd, len: usize, writable: bool) -> Result<Self> {
+        let prot = if writable {
+            libc::PROT_READ | libc::PROT_WRITE
+        } else {
+            libc::PROT_READ
+        };
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                prot,
+                libc::MAP_SHARED,
+                fd.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(Error::Daemon(format!(
+                "Failed to map frame ring: {}",
+                std::io::Error::last_os_error()
+            )));
+        }
+        Ok(Self {
+            ptr: NonNull::new(ptr.cast()).expect("mmap returned null"),
+            len,
+        })
+    }
+
+    fn header(&self) -> &RingHeader {
+        unsafe { &*self.ptr.as_ptr().cast::<RingHeader>() }
+    }
+
+    /// Header and data of slot `index`
+    fn slot(&self, index: usize, slot_bytes: usize) -> (*mut SlotHeader, *mut u8) {
+        let offset = std::mem::size_of::<RingHeader>().next_multiple_of(ALIGN)
+            + index * slot_stride(slot_bytes);
+        let data_offset = offset + std::mem::size_of::<SlotHeader>().next_multiple_of(ALIGN);
+        debug_assert!(data_offset + slot_bytes <= self.len);
+        unsafe {
+            let base = self.ptr.as_ptr();
+            (base.add(offset).cast(), base.add(data_offset))
+        }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr.as_ptr().cast(), self.len);
+        }
+    }
+}
+
+/// Writing side, owned by the daemon
+pub struct FrameRing {
+    fd: OwnedFd,
+    map: Mapping,
+    slots: usize,
+    slot_bytes: usize,
+    written: u64,
+}
+
+impl FrameRing {
+    /// Ring of `slots` slots of `slot_bytes` each
+    pub fn create(slots: usize, slot_bytes: usize) -> Result<Self> {
+        let slots = slots.max(2);
+        let len = ring_size(slots, slot_bytes);
+
+        let fd = unsafe {
+            let raw = libc::memfd_create(
+                b"ghoststream-frames\0".as_ptr().cast(),
+                libc::MFD_CLOEXEC | libc::MFD_ALLOW_SEALING,
+            );
+            if raw < 0 {
+                return Err(Error::Daemon(format!(
+                    "memfd_create failed: {}",
+                    std::io::Error::last_os_error()
+                )));
+            }
+            OwnedFd::from_raw_fd(raw)
+        };
+        let io_err =
+            |what: &str| Error::Daemon(format!("{}: {}", what, std::io::Error::last_os_error()));
+        unsafe {
+            if libc::ftruncate(fd.as_raw_fd(), len as libc::off_t) != 0 {
+                return Err(io_err("Failed to size frame ring"));
+            }
+            // Clients can rely on the size they mapped
+            let seals = libc::F_SEAL_SHRINK | libc::F_SEAL_GROW | libc::F_SEAL_SEAL;
+            if libc::fcntl(fd.as_raw_fd(), libc::F_ADD_SEALS, seals) != 0 {
+                return Err(io_err("Failed to seal frame ring"));
+            }
+        }
+
+        let map = Mapping::new(&fd, len, true)?;
+        unsafe {
+            let header = map.ptr.as_ptr().cast::<RingHeader>();
+            (*header).magic = MAGIC;
+            (*header).version = VERSION;
+            (*header).slots = slots as u32;
+            (*header).slot_bytes = slot_bytes as u64;
+        }
+        tracing::info!("Frame ring: {} slots of {} KiB", slots, slot_bytes / 1024);
+
+        Ok(Self {
+            fd,
+            map,
+            slots,
+            slot_bytes,
+            written: 0,
+        })
+    }
+
+    /// Memfd to hand to clients
+    pub fn fd(&self) -> &OwnedFd {
+        &self.fd
+    }
+
+    /// Largest frame a slot holds
+    pub fn slot_bytes(&self) -> usize {
+        self.slot_bytes
+    }
+
+    /// Copy `frame` into the next slot and publish it
+    ///
+    /// Returns false (and writes nothing) if the frame does not fit.
+    pub fn publish(&mut self, frame: &Frame) -> bool {
+        let data: &[u8] = &frame.data;
+        if data.len() > self.slot_bytes {
+            return false;
+        }
+
+        let number = self.written + 1;
+        let (slot, dst) = self
+            .map
+            .slot((number % self.slots as u64) as usize, self.slot_bytes);
+        unsafe {
+            (*slot).seq.store(number * 2 - 1, Ordering::Relaxed);
+            fence(Ordering::Release);
+            (*slot).width = frame.width;
+            (*slot).height = frame.height;
+            (*slot).stride = frame.stride;
+            (*slot).format = format_code(frame.format);
+            (*slot).len = data.len() as u64;
+            (*slot).pts = frame.pts;
+            (*slot).duration = frame.duration;
+            std::ptr::copy_nonoverlapping(data.as_ptr(), dst, data.len());
+            (*slot).seq.store(number * 2, Ordering::Release);
+        }
+        self.map.header().sequence.store(number, Ordering::Release);
+        self.written = number;
+        true
+    }
+}
+
+/// Reading side, in a client
+pub struct FrameRingReader {
+    map: Mapping,
+    slots: usize,
+    slot_bytes: usize,
+}
+
+impl FrameRingReader {
+    /// Map a ring received from the daemon
+    pub fn open(fd: OwnedFd) -> Result<Self> {
+        let len = unsafe {
+            let mut stat: libc::stat = std::mem::zeroed();
+            if libc::fstat(fd.as_raw_fd(), &mut stat) != 0 {
+                return Err(Error::Daemon(format!(
+                    "Failed to stat frame ring: {}",
+                    std::io::Error::last_os_error()
+                )));
+            }
+            stat.st_size as usize
+        };
+        if len < std::mem::size_of::<RingHeader>() {
+            return Err(Error::Daemon("Frame ring is too small".into()));
+        }
+
+        let map = Mapping::new(&fd, len, false)?;
+        let header = map.header();
+        if header.magic != MAGIC || header.version != VERSION {
+            return Err(Error::Daemon("Not a frame ring of this version".into()));
+        }
+        let slots = header.slots as usize;
+        let slot_bytes = header.slot_bytes as usize;
+        if slots == 0 || ring_size(slots, slot_bytes) > len {
+            return Err(Error::Daemon(
+                "Frame ring header does not match its size".into(),
+            ));
+        }
+        Ok(Self {
+            map,
+            slots,
+            slot_bytes,
+        })
+    }
+
+    /// Number of the newest frame (0 = none yet)
+    pub fn sequence(&self) -> u64 {
+        self.map.header().sequence.load(Ordering::Acquire)
+    }
+
+    /// Copy of the newest frame if it is newer than frame number `after`,
+    /// with its number
+    pub fn latest(&self, after: u64) -> Option<(u64, Frame)> {
+        for _ in 0..READ_ATTEMPTS {
+            let number = self.sequence();
+            if number <= after {
+                return None;
+            }
+            if let Some(frame) = self.read(number) {
+                return Some((number, frame));
+            }
+        }
+        None
+    }
+
+    /// Frame `number`, unless the writer is on (or past) its slot
+    fn read(&self, number: u64) -> Option<Frame> {
+        let (slot, src) = self
+            .map
+            .slot((number % self.slots as u64) as usize, self.slot_bytes);
+        unsafe {
+            let seq = (*slot).seq.load(Ordering::Acquire);
+            if seq != number * 2 {
+                return None;
+            }
+            let format = format_from_code(std::ptr::read_volatile(&(*slot).format))?;
+            let width = std::ptr::read_volatile(&(*slot).width);
+            let height = std::ptr::read_volatile(&(*slot).height);
+            let stride = std::ptr::read_volatile(&(*slot).stride);
+            let len = std::ptr::read_volatile(&(*slot).len) as usize;
+            let pts = std::ptr::read_volatile(&(*slot).pts);
+            let duration = std::ptr::read_volatile(&(*slot).duration);
+
+            let key = PoolKey::new(width, height, format, stride);
+            if len > self.slot_bytes || len < key.size() {
+                return None;
+            }
+            let mut data = FramePool::global().acquire(key);
+            std::ptr::copy_nonoverlapping(src, data.make_mut().as_mut_ptr(), key.size());
+
+            fence(Ordering::Acquire);
+            if (*slot).seq.load(Ordering::Relaxed) != seq {
+                return None;
+            }
+
+            let mut frame = Frame::with_buffer(data, width, height, stride, format);
+            frame.pts = pts;
+            frame.duration = duration;
+            Some(frame)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::capture::TestPattern;
+
+    #[test]
+    fn test_reader_sees_published_frames() {
+        let first = TestPattern::Text.render_bgra(0, 64, 32);
+        let mut ring = FrameRing::create(3, first.data.len()).unwrap();
+        let reader = FrameRingReader::open(ring.fd().try_clone().unwrap()).unwrap();
+        assert!(reader.latest(0).is_none());
+
+        for i in 0..5 {
+            let mut frame = TestPattern::Text.render_bgra(i, 64, 32);
+            frame.pts = i as i64 * 1000;
+            assert!(ring.publish(&frame));
+        }
+        let (number, frame) = reader.latest(0).unwrap();
+        assert_eq!(number, 5);
+        assert_eq!(frame.pts, 4000);
+        assert_eq!(
+            &frame.data[..],
+            &TestPattern::Text.render_bgra(4, 64, 32).data[..]
+        );
+        assert!(reader.latest(5).is_none());
+
+        let big = TestPattern::Text.render_bgra(0, 128, 32);
+        assert!(!ring.publish(&big));
+    }
+}
@@ -2,11 +2,13 @@
 //!
 //! Provides H.264, HEVC, and AV1 encoding using AMD GPUs (RX 5000+, RX 6000+, RX 7000+).
 
+use crate::clock;
 use crate::config::EncoderConfig;
 use crate::error::{Error, Result};
+use crate::processing::{GpuBackend, GpuOutput, GpuScaler};
 use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
 
-use super::{Codec, Encoder, EncoderStats};
+use super::{Codec, Encoder, EncoderBackend, EncoderStats, PacketQueue};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::format::Pixel;
@@ -20,10 +22,16 @@ pub struct AmfEncoder {
     encoder: Option<ffmpeg::encoder::Video>,
     scaler: Option<Scaler>,
     stats: EncoderStats,
-    frame_count: u64,
+    /// Frames sent but not yet read back
+    packets: PacketQueue,
     start_time: Option<Instant>,
     input_resolution: Option<Resolution>,
     time_base: ffmpeg::Rational,
+    /// GPU filter used when the output is resized
+    gpu_backend: Option<GpuBackend>,
+    /// VA-API/Vulkan stage (replaces `scaler` when it could be built);
+    /// frames come back in system memory for AMF
+    gpu_scaler: Option<GpuScaler>,
 }
 
 impl AmfEncoder {
@@ -48,15 +56,21 @@ impl AmfEncoder {
             )));
         }
 
+        let gpu_backend = config
+            .resolution
+            .and(GpuBackend::select(EncoderBackend::Amf));
+
         Ok(Self {
             config,
             encoder: None,
             scaler: None,
             stats: EncoderStats::default(),
-            frame_count: 0,
+            packets: PacketQueue::default(),
             start_time: None,
             input_resolution: None,
             time_base: ffmpeg::Rational::new(1, 60),
+            gpu_backend,
+            gpu_scaler: None,
         })
     }
 
@@ -70,7 +84,12 @@ impl AmfEncoder {
     }
 
     /// Initialize encoder with specific input resolution
-    fn init_encoder(&mut self, input_width: u32, input_height: u32) -> Result<()> {
+    fn init_encoder(
+        &mut self,
+        input_width: u32,
+        input_height: u32,
+        input_format: FrameFormat,
+    ) -> Result<()> {
         let encoder_name = Self::amf_encoder_name(self.config.codec);
 
         // Find the encoder
@@ -85,6 +104,26 @@ impl AmfEncoder {
             (input_width, input_height)
         };
 
+        // Resize on the GPU when possible; the CPU scaler below is the
+        // fallback
+        let scale = input_width != out_width || input_height != out_height;
+        if scale {
+            self.gpu_scaler = self.gpu_backend.and_then(|backend| {
+                let output = GpuOutput {
+                    format: Some(Pixel::NV12),
+                    download: true,
+                    ..GpuOutput::new(Resolution::new(out_width, out_height))
+                };
+                super::system_gpu_scaler(
+                    backend,
+                    input_width,
+                    input_height,
+                    Self::to_ffmpeg_format(input_format),
+                    output,
+                )
+            });
+        }
+
         // Create encoder context
         let context = ffmpeg::codec::context::Context::new_with_codec(codec);
         let mut encoder = context
@@ -96,8 +135,8 @@ impl AmfEncoder {
         encoder.set_width(out_width);
         encoder.set_height(out_height);
         encoder.set_format(Pixel::NV12); // AMF prefers NV12
-        encoder.set_time_base(ffmpeg::Rational::new(1, 1000));
-        self.time_base = ffmpeg::Rational::new(1, 1000);
+        encoder.set_time_base(clock::time_base());
+        self.time_base = clock::time_base();
 
         encoder.set_frame_rate(Some(ffmpeg::Rational::new(
             self.config.framerate.num as i32,
@@ -105,6 +144,7 @@ impl AmfEncoder {
         )));
         encoder.set_gop(self.config.gop_size);
         encoder.set_max_b_frames(self.config.b_frames as usize);
+        super::set_latency(&mut encoder, &self.config);
 
         // Build encoder options
         let mut opts = Dictionary::new();
@@ -155,6 +195,11 @@ impl AmfEncoder {
             opts.set("bf", &self.config.b_frames.to_string());
         }
 
+        // Frames queued in the AMF component before output is polled
+        if let Some(depth) = self.config.async_depth {
+            opts.set("async_depth", &depth.max(1).to_string());
+        }
+
         // Open encoder
         let opened = encoder
             .open_with(opts)
@@ -163,8 +208,8 @@ impl AmfEncoder {
         self.encoder = Some(opened);
         self.input_resolution = Some(Resolution::new(input_width, input_height));
 
-        // Create scaler if needed
-        if input_width != out_width || input_height != out_height {
+        // Create CPU scaler if needed and the GPU can't
+        if scale && self.gpu_scaler.is_none() {
             let scaler = Scaler::get(
                 Pixel::NV12,
                 input_width,
@@ -211,38 +256,33 @@ impl Encoder for AmfEncoder {
         Ok(())
     }
 
-    fn encode(&mut self, frame: &Frame) -> Result<Option<Packet>> {
+    fn scales_on_device(&self) -> bool {
+        super::gpu_scales_on_device(
+            self.gpu_backend,
+            self.encoder.is_some(),
+            self.gpu_scaler.as_ref(),
+        )
+    }
+
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
         if self.encoder.is_none() {
-            self.init_encoder(frame.width, frame.height)?;
+            self.init_encoder(frame.width, frame.height, frame.format)?;
         }
 
-        let encoder = self.encoder.as_mut().unwrap();
-        let encode_start = Instant::now();
+        let submit_start = Instant::now();
 
-        let mut video_frame = ffmpeg::frame::Video::new(
-            Self::to_ffmpeg_format(frame.format),
-            frame.width,
-            frame.height,
-        );
-
-        // Copy frame data
-        if frame.format == FrameFormat::Nv12 {
-            let y_size = (frame.width * frame.height) as usize;
-            let uv_size = y_size / 2;
-
-            if frame.data.len() >= y_size + uv_size {
-                video_frame.data_mut(0)[..y_size].copy_from_slice(&frame.data[..y_size]);
-                video_frame.data_mut(1)[..uv_size]
-                    .copy_from_slice(&frame.data[y_size..y_size + uv_size]);
-            }
-        } else {
-            let plane_size = video_frame.data(0).len().min(frame.data.len());
-            video_frame.data_mut(0)[..plane_size].copy_from_slice(&frame.data[..plane_size]);
-        }
+        // Reference the pooled frame buffer directly (no copy)
+        let mut video_frame = super::wrap_frame(frame, Self::to_ffmpeg_format(frame.format))?;
 
         video_frame.set_pts(Some(frame.pts));
 
-        let frame_to_encode = if let Some(ref mut scaler) = self.scaler {
+        let frame_to_encode = if let Some(ref mut gpu) = self.gpu_scaler {
+            gpu.run(&video_frame)?
+        } else if let Some(scaler) = self
+            .scaler
+            .as_mut()
+            .filter(|_| super::needs_cpu_scaling(self.input_resolution, frame))
+        {
             let mut scaled = ffmpeg::frame::Video::empty();
             scaler
                 .run(&video_frame, &mut scaled)
@@ -253,46 +293,23 @@ impl Encoder for AmfEncoder {
             video_frame
         };
 
-        encoder
-            .send_frame(&frame_to_encode)
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send frame: {}", e)))?;
-
-        let mut ffmpeg_packet = ffmpeg::Packet::empty();
-        match encoder.receive_packet(&mut ffmpeg_packet) {
-            Ok(_) => {
-                let encode_time = encode_start.elapsed();
-
-                self.frame_count += 1;
-                self.stats.frames_encoded = self.frame_count;
-                self.stats.bytes_output += ffmpeg_packet.size() as u64;
-
-                let encode_ms = encode_time.as_secs_f64() * 1000.0;
-                self.stats.avg_encode_time_ms =
-                    self.stats.avg_encode_time_ms * 0.95 + encode_ms * 0.05;
+        let encoder = self.encoder.as_mut().unwrap();
+        self.packets.send(encoder, &frame_to_encode, submit_start)?;
 
-                if let Some(start) = self.start_time {
-                    let elapsed = start.elapsed().as_secs_f64();
-                    if elapsed > 0.0 {
-                        self.stats.current_bitrate_kbps =
-                            ((self.stats.bytes_output as f64 * 8.0) / elapsed / 1000.0) as u64;
-                    }
-                }
+        self.packets.record(&mut self.stats);
+        Ok(())
+    }
 
-                Ok(Some(Packet {
-                    data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                    pts: ffmpeg_packet.pts().unwrap_or(0),
-                    dts: ffmpeg_packet.dts().unwrap_or(0),
-                    duration: ffmpeg_packet.duration(),
-                    is_keyframe: ffmpeg_packet.is_key(),
-                    flags: 0,
-                }))
-            }
-            Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => Ok(None),
-            Err(e) => Err(Error::EncodingFailed(format!(
-                "Failed to receive packet: {}",
-                e
-            ))),
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        let Some(encoder) = self.encoder.as_mut() else {
+            return Ok(None);
+        };
+        let packet = self.packets.receive(encoder)?;
+        if let Some(packet) = &packet {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
+        Ok(packet)
     }
 
     fn flush(&mut self) -> Result<Vec<Packet>> {
@@ -301,39 +318,25 @@ impl Encoder for AmfEncoder {
             None => return Ok(Vec::new()),
         };
 
-        encoder
-            .send_eof()
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send EOF: {}", e)))?;
-
-        let mut packets = Vec::new();
-        loop {
-            let mut ffmpeg_packet = ffmpeg::Packet::empty();
-            match encoder.receive_packet(&mut ffmpeg_packet) {
-                Ok(_) => {
-                    self.stats.bytes_output += ffmpeg_packet.size() as u64;
-                    packets.push(Packet {
-                        data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                        pts: ffmpeg_packet.pts().unwrap_or(0),
-                        dts: ffmpeg_packet.dts().unwrap_or(0),
-                        duration: ffmpeg_packet.duration(),
-                        is_keyframe: ffmpeg_packet.is_key(),
-                        flags: 0,
-                    });
-                }
-                Err(ffmpeg::Error::Eof) => break,
-                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => continue,
-                Err(e) => {
-                    tracing::warn!("Error during flush: {}", e);
-                    break;
-                }
-            }
+        let packets = self.packets.finish(encoder)?;
+        for packet in &packets {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
 
         tracing::info!(
             "AMF encoder flushed: {} frames, {} bytes",
             self.stats.frames_encoded,
             self.stats.bytes_output,
         );
+        if let Some(gpu) = &self.gpu_scaler {
+            tracing::debug!(
+                "GPU scaling ({}): avg {:?} max {:?}",
+                gpu.backend(),
+                gpu.timing().average(),
+                gpu.timing().max
+            );
+        }
 
         Ok(packets)
     }
@@ -375,6 +378,12 @@ impl Encoder for AmfEncoder {
     }
 
     fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
+        // FFmpeg's AMF wrapper fixes the rate at open
+        if self.encoder.is_some() {
+            return Err(Error::InvalidEncoderConfig(
+                "AMF cannot change bitrate on an open encoder".into(),
+            ));
+        }
         self.config = config.clone();
         tracing::info!("AMF encoder config updated: {}kbps", config.bitrate_kbps);
         Ok(())
@@ -0,0 +1,408 @@
+//! Chunked parallel software encoding
+//!
+//! For offline work (transcodes, recordings encoded after the fact) where
+//! one libx265 or libsvtav1 instance can't keep a large machine busy. The
+//! frame stream is cut into chunks of whole GOPs; each chunk is encoded
+//! from a keyframe by its own [`SoftwareEncoder`] on a worker thread, so
+//! no reference crosses a chunk boundary, and the packets are put back in
+//! order. Output trails input by about one chunk per worker, so this is
+//! not for live streams (see [`CpuParallelism::Slices`] for those).
+//!
+//! Frames stream to the worker owning their chunk as they arrive. Frames
+//! handed over but not yet encoded are capped at half a chunk per worker:
+//! enough to keep every worker busy once their chunks are staggered, and a
+//! bound on how many pool buffers the encoder holds.
+
+use super::software::SoftwareEncoder;
+use super::{Encoder, EncoderStats};
+use crate::config::{CpuParallelism, EncoderConfig};
+use crate::error::{Error, Result};
+use crate::threading::{self, ThreadRole};
+use crate::types::{CodecParams, Frame, Packet};
+
+use crossbeam_channel::{Receiver, Sender};
+use std::collections::{BTreeMap, VecDeque};
+use std::thread::JoinHandle;
+use std::time::Instant;
+
+/// Shortest chunk worth opening an encoder for, in frames
+const MIN_CHUNK_FRAMES: u32 = 120;
+
+/// Capture buffers the queued frames may hold, in bytes
+const QUEUE_BYTES: usize = 512 << 20;
+
+/// A chunk for one worker to encode; its frames follow on `frames` until
+/// the sender is dropped
+struct Job {
+    index: u64,
+    config: EncoderConfig,
+    frames: Receiver<Frame>,
+}
+
+/// A worker's output for one job
+struct Chunk {
+    index: u64,
+    result: Result<(Vec<Packet>, Option<CodecParams>)>,
+}
+
+/// Software encoder spreading closed-GOP chunks over a worker pool
+pub struct ChunkedEncoder {
+    config: EncoderConfig,
+    chunk_frames: usize,
+    jobs: Option<Sender<Job>>,
+    results: Receiver<Chunk>,
+    workers: Vec<JoinHandle<()>>,
+    /// One credit per frame that may be queued; workers return a credit
+    /// for each frame they encode
+    credits: Receiver<()>,
+    budget: usize,
+    /// Issues the credits on the first frame, once its size is known
+    issue: Option<Sender<()>>,
+    /// Chunk being fed, and the frames sent to it
+    current: Option<Sender<Frame>>,
+    current_frames: usize,
+    /// Chunks handed to workers, and the next one to output
+    dispatched: u64,
+    next: u64,
+    /// Finished chunks waiting for an earlier one
+    finished: BTreeMap<u64, Vec<Packet>>,
+    ready: VecDeque<Packet>,
+    params: Option<CodecParams>,
+    last_dts: Option<i64>,
+    stats: EncoderStats,
+    start_time: Option<Instant>,
+    /// Submit times of the frames not yet out as packets
+    submitted: VecDeque<Instant>,
+}
+
+impl ChunkedEncoder {
+    /// Start the workers `config.parallel` asks for (one for any mode
+    /// other than [`CpuParallelism::Chunks`])
+    pub fn new(config: EncoderConfig) -> Result<Self> {
+        if !super::software::is_available(config.codec) {
+            return Err(Error::CodecNotSupported(format!(
+                "No software encoder for {}",
+                config.codec.display_name()
+            )));
+        }
+
+        let workers = match config.parallel {
+            CpuParallelism::Chunks { workers } => workers.max(1) as usize,
+            _ => 1,
+        };
+        // Each worker gets an equal share of the encoder cores
+        let cpus = threading::encode_cpus().map_or_else(
+            || std::thread::available_parallelism().map_or(4, |n| n.get()),
+            |cpus| cpus.len(),
+        );
+        let threads = (cpus / workers).max(1);
+
+        let gop = config.gop_size.max(1);
+        let chunk_frames = (gop * MIN_CHUNK_FRAMES.div_ceil(gop)) as usize;
+
+        // Submit blocks once the budget is queued; the credits are the
+        // workers' to return, so a dead pool fails instead of hanging
+        let (credit_tx, credits) =
+            crossbeam_channel::bounded(frame_budget(chunk_frames, workers, 0));
+
+        let (job_tx, job_rx) = crossbeam_channel::unbounded::<Job>();
+        let (result_tx, results) = crossbeam_channel::unbounded();
+        let mut handles = Vec::with_capacity(workers);
+        for i in 0..workers {
+            let jobs = job_rx.clone();
+            let results = result_tx.clone();
+            let credits = credit_tx.clone();
+            let handle = std::thread::Builder::new()
+                .name(format!("chunk-encode-{}", i))
+                .spawn(move || {
+                    threading::enter(ThreadRole::Encode);
+                    run_worker(jobs, results, credits, threads)
+                })
+                .map_err(|e| Error::EncoderInit(format!("Failed to spawn chunk worker: {}", e)))?;
+            handles.push(handle);
+        }
+
+        tracing::info!(
+            "Chunked {} encoder: {} workers x {} threads, {} frames per chunk",
+            config.codec.display_name(),
+            workers,
+            threads,
+            chunk_frames,
+        );
+
+        Ok(Self {
+            config,
+            chunk_frames,
+            jobs: Some(job_tx),
+            results,
+            workers: handles,
+            credits,
+            budget: 0,
+            issue: Some(credit_tx),
+            current: None,
+            current_frames: 0,
+            dispatched: 0,
+            next: 0,
+            finished: BTreeMap::new(),
+            ready: VecDeque::new(),
+            params: None,
+            last_dts: None,
+            stats: EncoderStats::default(),
+            start_time: None,
+            submitted: VecDeque::new(),
+        })
+    }
+
+    /// Send `frame` to the worker of the current chunk, opening a chunk
+    /// on its first frame
+    fn send(&mut self, frame: Frame) -> Result<()> {
+        let stopped = || Error::EncodingFailed("Chunk encoder workers stopped".into());
+        if let Some(issue) = self.issue.take() {
+            let budget = frame_budget(self.chunk_frames, self.workers.len(), frame.size_bytes());
+            self.budget = (0..budget)
+                .take_while(|_| issue.try_send(()).is_ok())
+                .count();
+            tracing::debug!("Chunked encoder queues up to {} frames", self.budget);
+        }
+        self.credits.recv().map_err(|_| stopped())?;
+
+        if self.current.is_none() {
+            let (tx, frames) = crossbeam_channel::unbounded();
+            let job = Job {
+                index: self.dispatched,
+                config: self.config.clone(),
+                frames,
+            };
+            self.jobs
+                .as_ref()
+                .and_then(|jobs| jobs.send(job).ok())
+                .ok_or_else(stopped)?;
+            self.current = Some(tx);
+            self.dispatched += 1;
+        }
+        if let Some(current) = &self.current {
+            current.send(frame).map_err(|_| stopped())?;
+        }
+
+        self.current_frames += 1;
+        if self.current_frames >= self.chunk_frames {
+            self.close_chunk();
+        }
+        Ok(())
+    }
+
+    /// End the current chunk; its worker flushes once it has the frames
+    fn close_chunk(&mut self) {
+        self.current = None;
+        self.current_frames = 0;
+    }
+
+    /// Take finished chunks, waiting for every dispatched one if `wait`
+    fn collect(&mut self, wait: bool) -> Result<()> {
+        while self.next < self.dispatched {
+            let chunk = if wait {
+                self.results
+                    .recv()
+                    .map_err(|_| Error::EncodingFailed("Chunk encoder workers stopped".into()))?
+            } else {
+                match self.results.try_recv() {
+                    Ok(chunk) => chunk,
+                    Err(_) => break,
+                }
+            };
+
+            let (packets, params) = chunk.result?;
+            if self.params.is_none() {
+                self.params = params;
+            }
+            self.finished.insert(chunk.index, packets);
+
+            while let Some(packets) = self.finished.remove(&self.next) {
+                for mut packet in packets {
+                    monotonic_dts(&mut self.last_dts, &mut packet);
+                    self.stats.record_packet(&packet, self.start_time);
+                    if let Some(submitted) = self.submitted.pop_front() {
+                        self.stats.record_latency(submitted.elapsed());
+                    }
+                    self.ready.push_back(packet);
+                }
+                self.next += 1;
+            }
+        }
+        self.stats.queue_depth = self.budget.saturating_sub(self.credits.len()) as u32;
+        Ok(())
+    }
+}
+
+/// Frames that may be queued across the pool: enough to keep half the
+/// workers' chunks fed, within [`QUEUE_BYTES`] of `frame_bytes` frames
+fn frame_budget(chunk_frames: usize, workers: usize, frame_bytes: usize) -> usize {
+    let frames = chunk_frames * workers / 2;
+    frames.min(QUEUE_BYTES / frame_bytes.max(1)).max(1)
+}
+
+/// Keep decode timestamps increasing across chunks
+///
+/// Each chunk's encoder starts its DTS ahead of the first PTS by its
+/// reordering delay, which can overlap the previous chunk's last packets.
+fn monotonic_dts(last: &mut Option<i64>, packet: &mut Packet) {
+    if let Some(last) = *last {
+        if packet.dts <= last {
+            packet.dts = last + 1;
+        }
+    }
+    *last = Some(packet.dts);
+}
+
+fn run_worker(jobs: Receiver<Job>, results: Sender<Chunk>, credits: Sender<()>, threads: usize) {
+    for job in jobs {
+        let index = job.index;
+        let result = encode_chunk(&job, &credits, threads);
+        let failed = results.send(Chunk { index, result }).is_err();
+        // Frames still coming after a failure hold credits too
+        for _ in job.frames.iter() {
+            let _ = credits.send(());
+        }
+        if failed {
+            break;
+        }
+    }
+}
+
+/// Encode `job` with a fresh encoder, which starts it on a keyframe,
+/// returning a credit as each frame is released
+fn encode_chunk(
+    job: &Job,
+    credits: &Sender<()>,
+    threads: usize,
+) -> Result<(Vec<Packet>, Option<CodecParams>)> {
+    let mut config = job.config.clone();
+    config.parallel = CpuParallelism::Frames;
+    let mut encoder = SoftwareEncoder::new(config)?.with_threads(threads);
+    encoder.init()?;
+
+    let mut packets = Vec::new();
+    for frame in job.frames.iter() {
+        let encoded = encoder.encode(&frame);
+        drop(frame);
+        let _ = credits.send(());
+        packets.extend(encoded?);
+    }
+    packets.extend(encoder.flush()?);
+    Ok((packets, encoder.codec_params()))
+}
+
+impl Encoder for ChunkedEncoder {
+    fn init(&mut self) -> Result<()> {
+        Ok(())
+    }
+
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
+        self.start_time.get_or_insert_with(Instant::now);
+        self.submitted.push_back(Instant::now());
+        self.send(frame.share())
+    }
+
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        if self.ready.is_empty() {
+            self.collect(false)?;
+        }
+        Ok(self.ready.pop_front())
+    }
+
+    fn flush(&mut self) -> Result<Vec<Packet>> {
+        self.close_chunk();
+        self.collect(true)?;
+        Ok(self.ready.drain(..).collect())
+    }
+
+    fn stats(&self) -> EncoderStats {
+        self.stats.clone()
+    }
+
+    fn codec_params(&self) -> Option<CodecParams> {
+        self.params.clone()
+    }
+
+    fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
+        // Later chunks open with the new config, but the stream's
+        // parameters and the worker pool are fixed once encoding starts
+        if self.dispatched > 0 || self.config.parallel != config.parallel {
+            super::check_in_place(&self.config, config)?;
+        }
+        self.config = config.clone();
+        tracing::info!(
+            "Chunked encoder config updated: {}kbps from the next chunk",
+            config.bitrate_kbps
+        );
+        Ok(())
+    }
+}
+
+impl Drop for ChunkedEncoder {
+    fn drop(&mut self) {
+        // Workers finish their current chunk and see the queue close
+        self.close_chunk();
+        self.jobs = None;
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::capture::TestPattern;
+    use crate::encode::software::has_x264;
+
+    #[test]
+    fn test_budget_bounds_queued_bytes() {
+        // 720p NV12 keeps half the chunks fed
+        let nv12 = 1280 * 720 * 3 / 2;
+        assert_eq!(frame_budget(120, 3, nv12), 180);
+
+        // 4K BGRA with long GOPs is held to the byte bound
+        let bgra = 3840 * 2160 * 4;
+        let budget = frame_budget(600, 3, bgra);
+        assert!(budget * bgra <= QUEUE_BYTES);
+        assert!(budget >= 1);
+        assert_eq!(frame_budget(600, 3, usize::MAX), 1);
+    }
+
+    #[test]
+    fn test_chunks_come_back_in_order() {
+        if !has_x264() {
+            println!("x264 not available, skipping test");
+            return;
+        }
+
+        // A GOP longer than the chunk: only the chunking puts keyframes
+        // at the seams
+        let config = EncoderConfig::default()
+            .with_parallelism(CpuParallelism::Chunks { workers: 3 })
+            .with_gop_size(600);
+        let duration = config.framerate.frame_duration_us();
+        let mut encoder = ChunkedEncoder::new(config).unwrap();
+        let chunk = 40;
+        encoder.chunk_frames = chunk;
+
+        let mut packets = Vec::new();
+        let mut queued = 0;
+        for i in 0..(chunk as u64 * 3 + 10) {
+            let mut frame = TestPattern::Motion.render_bgra(i, 64, 48);
+            frame.pts = i as i64 * duration;
+            packets.extend(encoder.encode(&frame).unwrap());
+            queued = queued.max(encoder.stats().queue_depth as usize);
+        }
+        packets.extend(encoder.flush().unwrap());
+
+        assert_eq!(packets.len(), chunk * 3 + 10);
+        assert!(packets.windows(2).all(|p| p[0].dts < p[1].dts));
+        for seam in packets.chunks(chunk) {
+            assert!(seam[0].is_keyframe);
+        }
+        assert!(queued <= encoder.budget);
+        assert!(encoder.codec_params().is_some());
+    }
+}
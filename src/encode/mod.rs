@@ -4,17 +4,28 @@
 //! via x264/x265/SVT-AV1 through FFmpeg.
 
 pub mod amf;
+pub mod chunked;
 pub mod nvenc;
+pub mod probe;
 pub mod qsv;
+pub mod scheduler;
 pub mod software;
 
-use crate::config::EncoderConfig;
-use crate::error::Result;
-use crate::types::{CodecParams, Frame, Packet};
+use crate::config::{CpuParallelism, EncoderConfig, RateControl};
+use crate::error::{Error, Result};
+use crate::pool::FrameBuffer;
+use crate::processing::{GpuBackend, GpuInput, GpuOutput, GpuScaler};
+use crate::types::{CodecParams, Frame, FrameFormat, Packet, PacketData, Rect, Resolution};
+
+use ffmpeg_next as ffmpeg;
+use std::collections::VecDeque;
+use std::time::{Duration, Instant};
 
 pub use amf::AmfEncoder;
+pub use chunked::ChunkedEncoder;
 pub use nvenc::NvencEncoder;
 pub use qsv::QsvEncoder;
+pub use scheduler::{EncoderDevice, EncoderScheduler, ScheduledEncoder, WarmId};
 pub use software::{CpuPreset, SoftwareEncoder};
 
 /// Supported video codecs
@@ -64,13 +75,62 @@ impl std::fmt::Display for Codec {
     }
 }
 
+/// Frames an encoder is opened for ahead of time (see [`Encoder::prepare`])
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PreparedInput {
+    pub resolution: Resolution,
+    /// Format of system memory frames
+    pub format: FrameFormat,
+    /// Format and DRM fourcc of the DMA-BUFs the capture is expected to
+    /// deliver; encoders that import them open for these instead
+    pub dmabuf: Option<(FrameFormat, u32)>,
+}
+
+impl PreparedInput {
+    /// Layout of `frame`: size, format and DRM fourcc if it is a DMA-BUF
+    pub fn layout_of(frame: &Frame) -> (Resolution, FrameFormat, Option<u32>) {
+        let fourcc = frame.dmabuf.as_ref().map(|dmabuf| dmabuf.info.format);
+        (frame.resolution(), frame.format, fourcc)
+    }
+}
+
 /// Trait for video encoders
+///
+/// Encoding is a queue: [`submit`](Encoder::submit) hands a frame to the
+/// encoder without waiting for its output, and [`receive`](Encoder::receive)
+/// drains finished packets. Hardware encoders keep up to
+/// `EncoderConfig::async_depth` frames in flight, so upload, encode and
+/// bitstream readback of consecutive frames overlap; with B-frames or
+/// lookahead one submit may release several packets, or none.
 pub trait Encoder {
     /// Initialize the encoder
     fn init(&mut self) -> Result<()>;
 
-    /// Encode a frame
-    fn encode(&mut self, frame: &Frame) -> Result<Option<Packet>>;
+    /// Open the session ahead of the first frame, for frames laid out as
+    /// `input`, so the slow part of startup overlaps with capture setup
+    ///
+    /// A first frame of another layout reopens it. The default does
+    /// nothing: the encoder opens on its first frame.
+    fn prepare(&mut self, _input: &PreparedInput) -> Result<()> {
+        Ok(())
+    }
+
+    /// Queue a frame for encoding
+    fn submit(&mut self, frame: &Frame) -> Result<()>;
+
+    /// Next finished packet, or None while every submitted frame is still
+    /// inside the encoder
+    fn receive(&mut self) -> Result<Option<Packet>>;
+
+    /// Submit a frame and drain every packet that is ready
+    fn encode(&mut self, frame: &Frame) -> Result<Vec<Packet>> {
+        self.submit(frame)?;
+        let mut packets = Vec::new();
+        while let Some(packet) = self.receive()? {
+            packets.push(packet);
+        }
+        Ok(packets)
+    }
 
     /// Flush remaining frames
     fn flush(&mut self) -> Result<Vec<Packet>>;
@@ -81,12 +141,29 @@ pub trait Encoder {
     /// Get codec parameters for muxing (extradata, resolution, etc.)
     fn codec_params(&self) -> Option<CodecParams>;
 
-    /// Reconfigure encoder (if supported)
+    /// Reconfigure a running encoder
+    ///
+    /// Before the first frame any change is taken. Once open, backends
+    /// with dynamic rate control take bitrate changes in place; anything
+    /// else returns an error and leaves the encoder as it was (the pipeline
+    /// then switches to a new encoder).
     fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()>;
+
+    /// Can this encoder take DMA-BUF frames (`Frame::dmabuf`) directly?
+    fn supports_dmabuf(&self) -> bool {
+        false
+    }
+
+    /// Does the encoder scale to `EncoderConfig::resolution` on its own
+    /// device? Frames should then be sent at capture size. Asked per
+    /// frame, as it turns false when the device stage cannot be built.
+    fn scales_on_device(&self) -> bool {
+        false
+    }
 }
 
 /// Encoder backend selection
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, serde::Serialize, serde::Deserialize, Default)]
 pub enum EncoderBackend {
     /// Automatically select best available (NVENC > QSV > AMF > Software)
     #[default]
@@ -128,8 +205,7 @@ pub fn create_encoder_with_backend(
                 Ok(Box::new(encoder))
             } else if software::is_available(config.codec) {
                 tracing::info!("No hardware encoder available, using software encoder");
-                let encoder = SoftwareEncoder::new(config)?;
-                Ok(Box::new(encoder))
+                create_software_encoder(config)
             } else {
                 Err(crate::error::Error::CodecNotSupported(format!(
                     "No encoder available for {}",
@@ -149,10 +225,68 @@ pub fn create_encoder_with_backend(
             let encoder = AmfEncoder::new(config)?;
             Ok(Box::new(encoder))
         }
-        EncoderBackend::Software => {
-            let encoder = SoftwareEncoder::new(config)?;
-            Ok(Box::new(encoder))
+        EncoderBackend::Software => create_software_encoder(config),
+    }
+}
+
+/// Software encoder for `config.parallel`: one instance, or a pool of
+/// them encoding chunks
+fn create_software_encoder(config: EncoderConfig) -> Result<Box<dyn Encoder>> {
+    match config.parallel {
+        CpuParallelism::Chunks { .. } => Ok(Box::new(ChunkedEncoder::new(config)?)),
+        CpuParallelism::Frames | CpuParallelism::Slices => {
+            Ok(Box::new(SoftwareEncoder::new(config)?))
+        }
+    }
+}
+
+/// Apply `config`'s bitrate to an open encoder
+///
+/// FFmpeg's NVENC, QSV and libx264 wrappers compare the rate fields on
+/// every frame and reconfigure the running session when they change.
+pub(crate) fn set_bitrate(encoder: &mut ffmpeg::encoder::Video, config: &EncoderConfig) {
+    let bitrate = config.bitrate_kbps as i64 * 1000;
+    let max_bitrate = match config.rate_control {
+        RateControl::Cbr => Some(bitrate),
+        _ => config.max_bitrate_kbps.map(|kbps| kbps as i64 * 1000),
+    };
+    unsafe {
+        let ctx = encoder.as_mut_ptr();
+        (*ctx).bit_rate = bitrate;
+        if let Some(max) = max_bitrate {
+            (*ctx).rc_max_rate = max;
+        }
+    }
+}
+
+/// Apply slicing and, for realtime tuning, the low-delay settings every
+/// backend shares: no B-frames and no frame reordering
+///
+/// Call after the config's own B-frame count is set.
+pub(crate) fn set_latency(encoder: &mut ffmpeg::encoder::Video, config: &EncoderConfig) {
+    if config.tuning.is_realtime() {
+        encoder.set_max_b_frames(0);
+    }
+    unsafe {
+        let ctx = encoder.as_mut_ptr();
+        if let Some(slices) = config.slices {
+            (*ctx).slices = slices as i32;
         }
+        if config.tuning.is_realtime() {
+            (*ctx).flags |= ffmpeg::ffi::AV_CODEC_FLAG_LOW_DELAY as i32;
+        }
+    }
+}
+
+/// Check that `new` can be applied in place to an encoder opened with
+/// `current`
+pub(crate) fn check_in_place(current: &EncoderConfig, new: &EncoderConfig) -> Result<()> {
+    if current.differs_only_in_bitrate(new) {
+        Ok(())
+    } else {
+        Err(Error::InvalidEncoderConfig(
+            "Only bitrate can change on an open encoder".into(),
+        ))
     }
 }
 
@@ -163,16 +297,47 @@ pub struct EncoderStats {
     pub frames_encoded: u64,
     /// Total bytes output
     pub bytes_output: u64,
-    /// Average encoding time in ms
+    /// Average time from submitting a frame to receiving its packet, in ms
+    /// (frames and packets paired in order)
     pub avg_encode_time_ms: f64,
     /// Current bitrate in kbps
     pub current_bitrate_kbps: u64,
-    /// Encoder queue depth
+    /// Frames submitted whose packet has not been received yet
     pub queue_depth: u32,
 }
 
+impl EncoderStats {
+    /// Account for a packet that came out `elapsed` after its frame went in
+    pub(crate) fn record_latency(&mut self, elapsed: Duration) {
+        self.avg_encode_time_ms = moving_average_ms(self.avg_encode_time_ms, elapsed);
+    }
+
+    /// Account for an output packet of an encoder started at `start`
+    pub(crate) fn record_packet(&mut self, packet: &Packet, start: Option<Instant>) {
+        self.frames_encoded += 1;
+        self.bytes_output += packet.size() as u64;
+        if let Some(start) = start {
+            let elapsed = start.elapsed().as_secs_f64();
+            if elapsed > 0.0 {
+                self.current_bitrate_kbps =
+                    ((self.bytes_output as f64 * 8.0) / elapsed / 1000.0) as u64;
+            }
+        }
+    }
+}
+
+/// Exponential moving average of durations, in ms
+fn moving_average_ms(average: f64, elapsed: Duration) -> f64 {
+    let ms = elapsed.as_secs_f64() * 1000.0;
+    if average == 0.0 {
+        ms
+    } else {
+        average * 0.95 + ms * 0.05
+    }
+}
+
 /// Information about available encoders
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, serde::Serialize, serde::Deserialize)]
 pub struct EncoderInfo {
     /// Is NVENC available?
     pub nvenc_available: bool,
@@ -197,7 +362,7 @@ pub struct EncoderInfo {
 }
 
 /// Intel QSV encoder availability
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, serde::Serialize, serde::Deserialize)]
 pub struct QsvEncoderInfo {
     /// Is QSV available?
     pub available: bool,
@@ -212,7 +377,7 @@ pub struct QsvEncoderInfo {
 }
 
 /// AMD AMF encoder availability
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, serde::Serialize, serde::Deserialize)]
 pub struct AmfEncoderInfo {
     /// Is AMF available?
     pub available: bool,
@@ -227,7 +392,7 @@ pub struct AmfEncoderInfo {
 }
 
 /// Software encoder availability
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, serde::Serialize, serde::Deserialize)]
 pub struct SoftwareEncoderInfo {
     /// x264 available for H.264
     pub x264: bool,
@@ -238,7 +403,13 @@ pub struct SoftwareEncoderInfo {
 }
 
 /// Get information about available encoders
+///
+/// Probed once per boot; see [`probe`].
 pub fn get_info() -> EncoderInfo {
+    probe::cached("encoders", probe_info)
+}
+
+fn probe_info() -> EncoderInfo {
     let nvenc_available = nvenc::is_available();
 
     let mut nvenc_codecs = Vec::new();
@@ -318,3 +489,421 @@ impl EncoderInfo {
         self.nvenc_av1 || self.software.svtav1
     }
 }
+
+// ============================================================================
+// Frame upload helpers
+// ============================================================================
+
+/// Wrap a frame's pooled buffer as an FFmpeg video frame without copying
+///
+/// The AVFrame holds its own reference to the buffer; the buffer returns to
+/// the pool once both the caller and the encoder have released it.
+pub(crate) fn wrap_frame(
+    frame: &Frame,
+    pixel: ffmpeg::format::Pixel,
+) -> Result<ffmpeg::frame::Video> {
+    let required = frame
+        .format
+        .buffer_size(frame.width, frame.height, frame.stride);
+    if frame.data.len() < required {
+        return Err(Error::EncodingFailed(format!(
+            "Frame buffer too small: {} bytes, need {} for {}x{} {:?}",
+            frame.data.len(),
+            required,
+            frame.width,
+            frame.height,
+            frame.format
+        )));
+    }
+
+    let mut video = ffmpeg::frame::Video::empty();
+    unsafe {
+        let opaque = Box::into_raw(Box::new(frame.data.clone()));
+        let buf = ffmpeg::ffi::av_buffer_create(
+            frame.data.as_ptr() as *mut u8,
+            frame.data.len(),
+            Some(release_frame_buffer),
+            opaque as *mut std::ffi::c_void,
+            ffmpeg::ffi::AV_BUFFER_FLAG_READONLY as i32,
+        );
+        if buf.is_null() {
+            drop(Box::from_raw(opaque));
+            return Err(Error::EncodingFailed("Failed to wrap frame buffer".into()));
+        }
+
+        let ptr = video.as_mut_ptr();
+        (*ptr).format = ffmpeg::ffi::AVPixelFormat::from(pixel) as i32;
+        (*ptr).width = frame.width as i32;
+        (*ptr).height = frame.height as i32;
+        (*ptr).buf[0] = buf;
+
+        let base = (*buf).data;
+        let layout = frame.format.plane_layout(frame.height, frame.stride);
+        for (i, (offset, stride)) in layout.iter().take(frame.format.plane_count()).enumerate() {
+            (*ptr).data[i] = base.add(*offset);
+            (*ptr).linesize[i] = *stride as i32;
+        }
+    }
+
+    Ok(video)
+}
+
+/// ROI quality offset for damaged regions (finer) and for the rest of the
+/// frame (coarser, so unchanged blocks code as skips); FFmpeg scales these
+/// to the codec's QP range
+const DAMAGED_QOFFSET: ffmpeg::ffi::AVRational = ffmpeg::ffi::AVRational { num: -1, den: 10 };
+const UNDAMAGED_QOFFSET: ffmpeg::ffi::AVRational = ffmpeg::ffi::AVRational { num: 1, den: 5 };
+
+/// Attach `frame`'s damage regions to `video` as region-of-interest side
+/// data, scaled to `video`'s size
+///
+/// Encoders that read ROIs (QSV, x264, x265) spend bits on what changed
+/// and code the rest cheaply; the rest ignore it. Frames with unknown
+/// damage get none.
+pub(crate) fn attach_damage_roi(video: &mut ffmpeg::frame::Video, frame: &Frame) {
+    let Some(damage) = &frame.damage else {
+        return;
+    };
+    let size = Resolution::new(video.width(), video.height());
+    let regions = damage
+        .iter()
+        .map(|rect| (rect.scale(frame.resolution(), size), DAMAGED_QOFFSET))
+        // The first region covering a block wins, so this one goes last
+        .chain([(Rect::full(size.width, size.height), UNDAMAGED_QOFFSET)]);
+
+    let count = damage.len() + 1;
+    let roi_size = std::mem::size_of::<ffmpeg::ffi::AVRegionOfInterest>();
+    unsafe {
+        let side = ffmpeg::ffi::av_frame_new_side_data(
+            video.as_mut_ptr(),
+            ffmpeg::ffi::AVFrameSideDataType::AV_FRAME_DATA_REGIONS_OF_INTEREST,
+            roi_size * count,
+        );
+        if side.is_null() {
+            return;
+        }
+        let rois = std::slice::from_raw_parts_mut(
+            (*side).data as *mut ffmpeg::ffi::AVRegionOfInterest,
+            count,
+        );
+        for (roi, (rect, qoffset)) in rois.iter_mut().zip(regions) {
+            *roi = ffmpeg::ffi::AVRegionOfInterest {
+                self_size: roi_size as u32,
+                top: rect.y as i32,
+                bottom: (rect.y + rect.height) as i32,
+                left: rect.x as i32,
+                right: (rect.x + rect.width) as i32,
+                qoffset,
+            };
+        }
+    }
+}
+
+/// AVBuffer free callback for [`wrap_frame`]: drops the pool handle
+unsafe extern "C" fn release_frame_buffer(opaque: *mut std::ffi::c_void, _data: *mut u8) {
+    drop(Box::from_raw(opaque as *mut FrameBuffer));
+}
+
+/// [`Encoder::scales_on_device`] for encoders with a GPU scaling stage
+///
+/// Before the session opens that stage can still be built; once it is
+/// open only a built one counts, since a failed build leaves resizing to
+/// the CPU scaler.
+pub(crate) fn gpu_scales_on_device(
+    backend: Option<GpuBackend>,
+    opened: bool,
+    scaler: Option<&GpuScaler>,
+) -> bool {
+    scaler.is_some() || (!opened && backend.is_some())
+}
+
+/// Does `frame` still need the CPU scaler set up for `input`? After GPU
+/// scaling fails the pipeline resizes frames itself, and those pass
+/// through.
+pub(crate) fn needs_cpu_scaling(input: Option<Resolution>, frame: &Frame) -> bool {
+    input == Some(frame.resolution())
+}
+
+/// GPU scaling stage for system-memory input of `width`x`height` `format`
+///
+/// Opens the backend's default device. Returns None (after logging why)
+/// when the encoder has to fall back to its CPU scaler.
+pub(crate) fn system_gpu_scaler(
+    backend: GpuBackend,
+    width: u32,
+    height: u32,
+    format: ffmpeg::format::Pixel,
+    output: GpuOutput,
+) -> Option<GpuScaler> {
+    let input = GpuInput::System {
+        format,
+        width,
+        height,
+    };
+    match backend
+        .open_device()
+        .and_then(|device| GpuScaler::new(backend, &device, input, output))
+    {
+        Ok(scaler) => Some(scaler),
+        Err(e) => {
+            tracing::warn!("GPU scaling unavailable, using CPU scaler: {}", e);
+            None
+        }
+    }
+}
+
+// ============================================================================
+// Submit/receive queue
+// ============================================================================
+
+/// Attempts to read a packet after EOF while the encoder still reports
+/// EAGAIN, and the wait between them
+const FLUSH_RETRIES: u32 = 200;
+const FLUSH_RETRY_WAIT: Duration = Duration::from_millis(1);
+
+/// Send/receive bookkeeping shared by the FFmpeg encoders
+///
+/// Frames are sent without reading output back. When the encoder refuses
+/// a frame because all its surfaces are busy, finished packets are read to
+/// free one and held until the next receive, so none are lost. Each packet
+/// read is paired with the oldest frame still inside for the encode time.
+#[derive(Debug, Default)]
+pub(crate) struct PacketQueue {
+    /// Packets read while making room for a frame
+    ready: VecDeque<Packet>,
+    /// Submit times of the frames whose packet has not been read yet
+    sent: VecDeque<Instant>,
+    avg_latency_ms: f64,
+}
+
+impl PacketQueue {
+    /// Send `frame`, whose submit began at `submitted`
+    pub fn send(
+        &mut self,
+        encoder: &mut ffmpeg::encoder::Video,
+        frame: &ffmpeg::frame::Video,
+        submitted: Instant,
+    ) -> Result<()> {
+        loop {
+            match encoder.send_frame(frame) {
+                Ok(()) => {
+                    self.sent.push_back(submitted);
+                    return Ok(());
+                }
+                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => {
+                    match read_packet(encoder)? {
+                        Some(packet) => {
+                            self.received();
+                            self.ready.push_back(packet);
+                        }
+                        None => {
+                            return Err(Error::EncodingFailed(
+                                "Encoder refused a frame with no packet ready".into(),
+                            ))
+                        }
+                    }
+                }
+                Err(e) => {
+                    return Err(Error::EncodingFailed(format!(
+                        "Failed to send frame: {}",
+                        e
+                    )))
+                }
+            }
+        }
+    }
+
+    pub fn receive(&mut self, encoder: &mut ffmpeg::encoder::Video) -> Result<Option<Packet>> {
+        if let Some(packet) = self.ready.pop_front() {
+            return Ok(Some(packet));
+        }
+        let packet = read_packet(encoder)?;
+        if packet.is_some() {
+            self.received();
+        }
+        Ok(packet)
+    }
+
+    /// Send EOF and collect every remaining packet
+    ///
+    /// Encoders still busy with frames may answer EAGAIN after EOF; they
+    /// get a bounded wait before whatever they still hold is given up.
+    pub fn finish(&mut self, encoder: &mut ffmpeg::encoder::Video) -> Result<Vec<Packet>> {
+        encoder
+            .send_eof()
+            .map_err(|e| Error::EncodingFailed(format!("Failed to send EOF: {}", e)))?;
+
+        let mut packets: Vec<Packet> = self.ready.drain(..).collect();
+        let mut retries = 0;
+        loop {
+            let mut ffmpeg_packet = ffmpeg::Packet::empty();
+            match encoder.receive_packet(&mut ffmpeg_packet) {
+                Ok(_) => {
+                    self.received();
+                    packets.push(to_packet(&ffmpeg_packet));
+                    retries = 0;
+                }
+                Err(ffmpeg::Error::Eof) => break,
+                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => {
+                    retries += 1;
+                    if retries > FLUSH_RETRIES {
+                        tracing::warn!(
+                            "Encoder still busy after EOF, giving up on {} frames",
+                            self.sent.len()
+                        );
+                        break;
+                    }
+                    std::thread::sleep(FLUSH_RETRY_WAIT);
+                }
+                Err(e) => {
+                    tracing::warn!("Error during flush: {}", e);
+                    break;
+                }
+            }
+        }
+        self.sent.clear();
+        Ok(packets)
+    }
+
+    /// A packet came out: it belongs to the oldest frame inside
+    fn received(&mut self) {
+        if let Some(submitted) = self.sent.pop_front() {
+            self.avg_latency_ms = moving_average_ms(self.avg_latency_ms, submitted.elapsed());
+        }
+    }
+
+    /// Frames inside the encoder
+    pub fn in_flight(&self) -> u32 {
+        self.sent.len() as u32
+    }
+
+    /// Copy queue depth and encode time into `stats`
+    pub fn record(&self, stats: &mut EncoderStats) {
+        stats.queue_depth = self.in_flight();
+        stats.avg_encode_time_ms = self.avg_latency_ms;
+    }
+}
+
+/// Read one packet if the encoder has finished one
+fn read_packet(encoder: &mut ffmpeg::encoder::Video) -> Result<Option<Packet>> {
+    let mut ffmpeg_packet = ffmpeg::Packet::empty();
+    match encoder.receive_packet(&mut ffmpeg_packet) {
+        Ok(_) => Ok(Some(to_packet(&ffmpeg_packet))),
+        Err(ffmpeg::Error::Eof) => Ok(None),
+        Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => Ok(None),
+        Err(e) => Err(Error::EncodingFailed(format!(
+            "Failed to receive packet: {}",
+            e
+        ))),
+    }
+}
+
+fn to_packet(ffmpeg_packet: &ffmpeg::Packet) -> Packet {
+    Packet {
+        data: ffmpeg_packet
+            .data()
+            .map(PacketData::from)
+            .unwrap_or_default(),
+        pts: ffmpeg_packet.pts().unwrap_or(0),
+        dts: ffmpeg_packet.dts().unwrap_or(0),
+        duration: ffmpeg_packet.duration(),
+        is_keyframe: ffmpeg_packet.is_key(),
+        flags: 0,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::processing::{ColorPrimaries, HdrConfig};
+
+    #[test]
+    fn test_only_bitrate_changes_in_place() {
+        let current = EncoderConfig::default().with_hdr10();
+        assert!(check_in_place(&current, &current.clone().with_bitrate_kbps(2000)).is_ok());
+        assert!(check_in_place(&current, &current.clone().with_resolution(1280, 720)).is_err());
+
+        // PQ to HLG, or new primaries, need a new stream header
+        assert!(check_in_place(&current, &current.clone().with_hlg()).is_err());
+        let mut primaries = HdrConfig::hdr10();
+        primaries.primaries = ColorPrimaries::Bt709;
+        assert!(check_in_place(&current, &current.clone().with_hdr(primaries)).is_err());
+    }
+
+    #[test]
+    fn test_gpu_scaling_falls_back_to_the_pipeline() {
+        // Until the session opens, frames come at capture size for the
+        // GPU stage to resize
+        assert!(gpu_scales_on_device(Some(GpuBackend::Vaapi), false, None));
+        assert!(!gpu_scales_on_device(None, false, None));
+
+        // Opened without one (its build failed, or no resize was needed):
+        // the pipeline resizes from then on
+        assert!(!gpu_scales_on_device(Some(GpuBackend::Vaapi), true, None));
+
+        // The CPU scaler opened on the first frame takes capture-size
+        // frames; resized ones skip it
+        let input = Some(Resolution::new(1920, 1080));
+        let captured = Frame::new(1920, 1080, FrameFormat::Nv12);
+        let resized = Frame::new(1280, 720, FrameFormat::Nv12);
+        assert!(needs_cpu_scaling(input, &captured));
+        assert!(!needs_cpu_scaling(input, &resized));
+        assert!(!needs_cpu_scaling(None, &captured));
+    }
+
+    #[test]
+    fn test_prepared_layout_tells_dmabufs_apart() {
+        use crate::capture::{DmaBufFrame, DmaBufInfo};
+        use std::os::fd::AsRawFd;
+
+        let size = Resolution::new(64, 32);
+        let shm = Frame::new(64, 32, FrameFormat::Bgra);
+        assert_eq!(
+            PreparedInput::layout_of(&shm),
+            (size, FrameFormat::Bgra, None)
+        );
+
+        // Same size and format, but a session on CUDA frames cannot take
+        // the system memory frame, nor one on another fourcc
+        let file = tempfile::tempfile().unwrap();
+        let mut info = DmaBufInfo::layout(64, 32, DmaBufInfo::SCREEN_FORMAT);
+        info.fd = file.as_raw_fd();
+        let dmabuf = DmaBufFrame::new(info, 0).unwrap().into_frame();
+        let layout = PreparedInput::layout_of(&dmabuf);
+        assert_eq!(
+            layout,
+            (size, FrameFormat::Bgra, Some(DmaBufInfo::SCREEN_FORMAT))
+        );
+        assert_ne!(layout, PreparedInput::layout_of(&shm));
+    }
+
+    #[test]
+    fn test_packet_queue_accounts_for_every_frame() {
+        if !software::has_x264() {
+            println!("x264 not available, skipping test");
+            return;
+        }
+
+        let config = EncoderConfig::default();
+        let duration = config.framerate.frame_duration_us();
+        let mut encoder = software::SoftwareEncoder::new(config).unwrap();
+        encoder.init().unwrap();
+
+        let mut received = 0;
+        for i in 0..30 {
+            let mut frame = crate::capture::TestPattern::Motion.render_bgra(i, 64, 48);
+            frame.pts = i as i64 * duration;
+            encoder.submit(&frame).unwrap();
+            while encoder.receive().unwrap().is_some() {
+                received += 1;
+            }
+            // Each frame is out as a packet or counted as inside
+            assert_eq!(received + encoder.stats().queue_depth as u64, i + 1);
+        }
+        received += encoder.flush().unwrap().len() as u64;
+
+        let stats = encoder.stats();
+        assert_eq!((received, stats.queue_depth), (30, 0));
+        assert!(stats.avg_encode_time_ms > 0.0);
+    }
+}
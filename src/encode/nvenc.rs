@@ -2,16 +2,22 @@
 //!
 //! Provides H.264, HEVC, and AV1 encoding using NVIDIA's NVENC.
 
+use crate::capture::{DmaBufImporter, DmaBufInfo};
+use crate::clock;
 use crate::config::EncoderConfig;
 use crate::error::{Error, Result};
+use crate::hwaccel::HwFramesContext;
+use crate::pool::FramePool;
+use crate::processing::{GpuBackend, GpuInput, GpuOutput, GpuScaler};
 use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
 
-use super::{Codec, Encoder, EncoderStats};
+use super::{Codec, Encoder, EncoderBackend, EncoderStats, PacketQueue, PreparedInput};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::format::Pixel;
 use ffmpeg_next::software::scaling::{Context as Scaler, Flags as ScalerFlags};
 use ffmpeg_next::Dictionary;
+use std::collections::VecDeque;
 use std::time::Instant;
 
 /// NVENC encoder using FFmpeg
@@ -20,10 +26,26 @@ pub struct NvencEncoder {
     encoder: Option<ffmpeg::encoder::Video>,
     scaler: Option<Scaler>,
     stats: EncoderStats,
-    frame_count: u64,
+    /// Frames sent but not yet read back
+    packets: PacketQueue,
     start_time: Option<Instant>,
     input_resolution: Option<Resolution>,
     time_base: ffmpeg::Rational,
+    /// DMA-BUF -> CUDA importer (created on the first DMA-BUF frame)
+    importer: Option<DmaBufImporter>,
+    /// CUDA frames the encoder was opened with (hardware input)
+    hw_input: Option<HwFramesContext>,
+    /// Set once CUDA import failed; DMA-BUFs are then downloaded
+    zero_copy_disabled: bool,
+    /// GPU filter used when the output is resized
+    gpu_backend: Option<GpuBackend>,
+    /// scale_cuda stage (replaces `scaler` when it could be built)
+    gpu_scaler: Option<GpuScaler>,
+    /// Input layout the session was opened for ahead of its first frame
+    /// (see [`PreparedInput::layout_of`])
+    prepared: Option<(Resolution, FrameFormat, Option<u32>)>,
+    /// Packets of a session closed for an input it could not take
+    drained: VecDeque<Packet>,
 }
 
 impl NvencEncoder {
@@ -48,20 +70,118 @@ impl NvencEncoder {
             )));
         }
 
+        let gpu_backend = config
+            .resolution
+            .and(GpuBackend::select(EncoderBackend::Nvenc));
+
         Ok(Self {
             config,
             encoder: None,
             scaler: None,
             stats: EncoderStats::default(),
-            frame_count: 0,
+            packets: PacketQueue::default(),
             start_time: None,
             input_resolution: None,
             time_base: ffmpeg::Rational::new(1, 60), // Default, updated on init
+            importer: None,
+            hw_input: None,
+            zero_copy_disabled: false,
+            gpu_backend,
+            gpu_scaler: None,
+            prepared: None,
+            drained: VecDeque::new(),
         })
     }
 
+    /// Set up the CUDA import path for a DMA-BUF input
+    ///
+    /// Returns the CUDA frames to open the encoder with, or None (after
+    /// logging why) if frames have to go through system memory instead.
+    fn init_hw_input(&mut self, info: &DmaBufInfo) -> Option<HwFramesContext> {
+        if self.zero_copy_disabled {
+            return None;
+        }
+
+        // Import on the GPU the encoder runs on
+        let device = self.config.device.map(|gpu| gpu.to_string());
+        let result = match self.importer.as_mut() {
+            Some(importer) => importer.cuda_frames(info),
+            None => DmaBufImporter::with_cuda(device.as_deref()).and_then(|mut importer| {
+                let frames = importer.cuda_frames(info);
+                self.importer = Some(importer);
+                frames
+            }),
+        };
+
+        match result {
+            Ok(frames) => Some(frames),
+            Err(e) => {
+                tracing::warn!("DMA-BUF zero-copy unavailable, using CPU download: {}", e);
+                self.zero_copy_disabled = true;
+                None
+            }
+        }
+    }
+
+    /// Build the scale_cuda stage for the configured output size
+    ///
+    /// Runs on the importer's CUDA device when DMA-BUFs are imported.
+    /// Returns None (after logging why) if the CPU scaler has to be used.
+    fn init_gpu_scaler(
+        &self,
+        input_width: u32,
+        input_height: u32,
+        input_format: FrameFormat,
+        hw_frames: Option<HwFramesContext>,
+    ) -> Option<GpuScaler> {
+        let backend = self.gpu_backend?;
+        let size = self.config.resolution?;
+        let input = match hw_frames {
+            Some(frames) => GpuInput::Device(frames),
+            None => GpuInput::System {
+                format: Self::to_ffmpeg_format(input_format),
+                width: input_width,
+                height: input_height,
+            },
+        };
+        let device = match self.importer.as_ref().and_then(|i| i.cuda_device()) {
+            Some(device) => Ok(device.clone()),
+            None => backend.open_device(),
+        };
+
+        match device
+            .and_then(|device| GpuScaler::new(backend, &device, input, GpuOutput::new(size)))
+        {
+            Ok(scaler) => Some(scaler),
+            Err(e) => {
+                tracing::warn!("GPU scaling unavailable, using CPU scaler: {}", e);
+                None
+            }
+        }
+    }
+
+    /// Close a session opened ahead of time; the next frame opens it
+    /// again for its own layout
+    fn close(&mut self) {
+        self.prepared = None;
+        self.encoder = None;
+        self.scaler = None;
+        self.gpu_scaler = None;
+        self.hw_input = None;
+        self.input_resolution = None;
+        self.packets = PacketQueue::default();
+    }
+
     /// Initialize encoder with specific input resolution
-    fn init_encoder(&mut self, input_width: u32, input_height: u32) -> Result<()> {
+    ///
+    /// With `hw_frames` the encoder takes CUDA frames directly.
+    fn init_encoder(
+        &mut self,
+        input_width: u32,
+        input_height: u32,
+        input_format: FrameFormat,
+        mut hw_frames: Option<HwFramesContext>,
+    ) -> Result<()> {
         let encoder_name = self.config.codec.nvenc_encoder_name();
 
         // Find the encoder
@@ -75,6 +195,21 @@ impl NvencEncoder {
             (input_width, input_height)
         };
 
+        // Resize on the GPU when possible; the CPU scaler below is the
+        // fallback and only takes system memory frames
+        let scale = input_width != out_width || input_height != out_height;
+        if scale {
+            self.gpu_scaler =
+                self.init_gpu_scaler(input_width, input_height, input_format, hw_frames.clone());
+            if self.gpu_scaler.is_none() && hw_frames.take().is_some() {
+                self.zero_copy_disabled = true;
+            }
+        }
+        let encoder_frames = match &self.gpu_scaler {
+            Some(gpu) => gpu.output_frames(),
+            None => hw_frames.as_ref(),
+        };
+
         // Create encoder context
         let context = ffmpeg::codec::context::Context::new_with_codec(codec);
         let mut encoder = context
@@ -85,9 +220,18 @@ impl NvencEncoder {
         // Set basic parameters
         encoder.set_width(out_width);
         encoder.set_height(out_height);
-        encoder.set_format(Pixel::NV12); // NVENC prefers NV12
-        encoder.set_time_base(ffmpeg::Rational::new(1, 1000)); // ms timebase
-        self.time_base = ffmpeg::Rational::new(1, 1000);
+        match encoder_frames {
+            Some(frames) => {
+                encoder.set_format(Pixel::CUDA);
+                unsafe {
+                    (*encoder.as_mut_ptr()).hw_frames_ctx =
+                        ffmpeg::ffi::av_buffer_ref(frames.as_ptr());
+                }
+            }
+            None => encoder.set_format(Pixel::NV12), // NVENC prefers NV12
+        }
+        encoder.set_time_base(clock::time_base());
+        self.time_base = clock::time_base();
 
         // Set framerate from config
         encoder.set_frame_rate(Some(ffmpeg::Rational::new(
@@ -100,10 +244,16 @@ impl NvencEncoder {
 
         // Set max B-frames
         encoder.set_max_b_frames(self.config.b_frames as usize);
+        super::set_latency(&mut encoder, &self.config);
 
         // Build encoder options
         let mut opts = Dictionary::new();
 
+        // GPU chosen by the scheduler
+        if let Some(gpu) = self.config.device {
+            opts.set("gpu", &gpu.to_string());
+        }
+
         // Preset
         opts.set("preset", self.config.preset.to_nvenc_preset());
 
@@ -132,8 +282,9 @@ impl NvencEncoder {
             }
         }
 
-        // Lookahead
-        if let Some(la) = self.config.lookahead {
+        // Lookahead (never in realtime mode: it holds frames back)
+        let realtime = self.config.tuning.is_realtime();
+        if let (Some(la), false) = (self.config.lookahead, realtime) {
             opts.set("rc-lookahead", &la.to_string());
         }
 
@@ -147,6 +298,15 @@ impl NvencEncoder {
             opts.set("zerolatency", "1");
         }
 
+        // Pipelining: `surfaces` input buffers, output held back by `delay`
+        // frames so readback overlaps the next encodes
+        if let Some(surfaces) = self.config.surfaces {
+            opts.set("surfaces", &surfaces.to_string());
+        }
+        if let (Some(depth), false) = (self.config.async_depth, realtime) {
+            opts.set("delay", &depth.to_string());
+        }
+
         // Open encoder
         let opened = encoder
             .open_with(opts)
@@ -154,9 +314,10 @@ impl NvencEncoder {
 
         self.encoder = Some(opened);
         self.input_resolution = Some(Resolution::new(input_width, input_height));
+        self.hw_input = hw_frames;
 
-        // Create scaler if input != output resolution
-        if input_width != out_width || input_height != out_height {
+        // Create CPU scaler if input != output resolution and the GPU can't
+        if scale && self.gpu_scaler.is_none() {
             let scaler = Scaler::get(
                 Pixel::NV12,
                 input_width,
@@ -173,13 +334,18 @@ impl NvencEncoder {
         self.start_time = Some(Instant::now());
 
         tracing::info!(
-            "NVENC encoder initialized: {} {}x{} @ {}kbps (preset: {}, tune: {})",
+            "NVENC encoder initialized: {} {}x{} @ {}kbps (preset: {}, tune: {}, input: {})",
             self.config.codec,
             out_width,
             out_height,
             self.config.bitrate_kbps,
             self.config.preset.to_nvenc_preset(),
-            self.config.tuning.to_nvenc_tuning()
+            self.config.tuning.to_nvenc_tuning(),
+            if self.hw_input.is_some() || self.gpu_scaler.is_some() {
+                "CUDA"
+            } else {
+                "system memory"
+            }
         );
 
         Ok(())
@@ -197,6 +363,60 @@ impl NvencEncoder {
             FrameFormat::P010 => Pixel::P010LE,
         }
     }
+
+    /// Build the FFmpeg frame to send for `frame`
+    ///
+    /// DMA-BUF frames are imported into CUDA when the encoder was opened
+    /// with hardware input, otherwise downloaded (linear buffers only).
+    fn input_frame(&mut self, frame: &Frame) -> Result<ffmpeg::frame::Video> {
+        let dmabuf = match &frame.dmabuf {
+            Some(dmabuf) => dmabuf,
+            // Reference the pooled frame buffer directly (no copy)
+            None => {
+                let video = super::wrap_frame(frame, Self::to_ffmpeg_format(frame.format))?;
+                return match &self.hw_input {
+                    Some(frames) => Ok(frames.upload(&video)?.into_video()),
+                    None => Ok(video),
+                };
+            }
+        };
+
+        if self.hw_input.is_some() && !self.zero_copy_disabled {
+            if let Some(importer) = self.importer.as_mut() {
+                match importer.import_cuda(dmabuf) {
+                    Ok(cuda_frame) => return Ok(cuda_frame.into_video()),
+                    Err(e) => {
+                        tracing::warn!("DMA-BUF import failed, using CPU download: {}", e);
+                        self.zero_copy_disabled = true;
+                    }
+                }
+            }
+        }
+
+        let importer = self.importer.get_or_insert_with(DmaBufImporter::default);
+        let mut local = importer.download(dmabuf, FramePool::global())?;
+        if let Some(format) = download_format(
+            self.hw_input.is_some(),
+            self.gpu_scaler.is_some(),
+            local.format,
+        ) {
+            local = crate::processing::process_frame(&local, None, Some(format))?;
+        }
+        let video = super::wrap_frame(&local, Self::to_ffmpeg_format(local.format))?;
+        match &self.hw_input {
+            Some(frames) => Ok(frames.upload(&video)?.into_video()),
+            None => Ok(video),
+        }
+    }
+}
+
+/// Format to convert a downloaded DMA-BUF to, if any
+///
+/// Uploads to the session's CUDA frames and the GPU scaler (built for the
+/// capture format) take it as it is; system memory input to NVENC and
+/// the CPU scaler take NV12.
+fn download_format(hw_input: bool, gpu_scaled: bool, format: FrameFormat) -> Option<FrameFormat> {
+    (!hw_input && !gpu_scaled && format != FrameFormat::Nv12).then_some(FrameFormat::Nv12)
 }
 
 impl Encoder for NvencEncoder {
@@ -205,47 +425,98 @@ impl Encoder for NvencEncoder {
         Ok(())
     }
 
-    fn encode(&mut self, frame: &Frame) -> Result<Option<Packet>> {
-        // Initialize encoder on first frame
-        if self.encoder.is_none() {
-            self.init_encoder(frame.width, frame.height)?;
+    fn prepare(&mut self, input: &PreparedInput) -> Result<()> {
+        if self.encoder.is_some() {
+            return Ok(());
+        }
+        let size = input.resolution;
+
+        // Expected DMA-BUFs get a session on CUDA frames, as the first
+        // imported frame would open
+        if let Some((format, fourcc)) = input.dmabuf {
+            let layout = DmaBufInfo::layout(size.width, size.height, fourcc);
+            if let Some(hw_frames) = self.init_hw_input(&layout) {
+                self.init_encoder(size.width, size.height, format, Some(hw_frames))?;
+                self.prepared = Some((size, format, Some(fourcc)));
+                return Ok(());
+            }
         }
 
-        let encoder = self.encoder.as_mut().unwrap();
-        let encode_start = Instant::now();
+        self.init_encoder(size.width, size.height, input.format, None)?;
+        self.prepared = Some((size, input.format, None));
+        Ok(())
+    }
 
-        // Create FFmpeg video frame
-        let mut video_frame = ffmpeg::frame::Video::new(
-            Self::to_ffmpeg_format(frame.format),
-            frame.width,
-            frame.height,
-        );
+    fn supports_dmabuf(&self) -> bool {
+        true
+    }
 
-        // Copy frame data
-        // For NV12: Y plane is full size, UV plane is half height
-        if frame.format == FrameFormat::Nv12 {
-            let y_size = (frame.width * frame.height) as usize;
-            let uv_size = y_size / 2;
+    fn scales_on_device(&self) -> bool {
+        super::gpu_scales_on_device(
+            self.gpu_backend,
+            self.encoder.is_some(),
+            self.gpu_scaler.as_ref(),
+        )
+    }
 
-            if frame.data.len() >= y_size + uv_size {
-                video_frame.data_mut(0)[..y_size].copy_from_slice(&frame.data[..y_size]);
-                video_frame.data_mut(1)[..uv_size]
-                    .copy_from_slice(&frame.data[y_size..y_size + uv_size]);
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
+        // The session opened ahead of time only fits frames of the layout
+        // it was prepared for; the driver is loaded by now, so reopening is
+        // cheap
+        if let Some(layout) = self.prepared.take() {
+            if layout != PreparedInput::layout_of(frame) {
+                tracing::debug!("First frame differs from the prepared input, reopening NVENC");
+                self.close();
             }
-        } else {
-            // For other formats, copy to first plane
-            let plane_size = video_frame.data(0).len().min(frame.data.len());
-            video_frame.data_mut(0)[..plane_size].copy_from_slice(&frame.data[..plane_size]);
         }
 
+        // A session on CUDA frames only takes imported DMA-BUFs; when the
+        // capture falls back to system memory, finish it and reopen
+        if self.hw_input.is_some() && frame.dmabuf.is_none() {
+            tracing::info!("Input moved to system memory, reopening NVENC");
+            if let Some(encoder) = self.encoder.as_mut() {
+                for packet in self.packets.finish(encoder)? {
+                    self.stats.record_packet(&packet, self.start_time);
+                    self.drained.push_back(packet);
+                }
+            }
+            self.close();
+        }
+
+        // Initialize encoder on first frame
+        if self.encoder.is_none() {
+            // Imported CUDA frames can only be resized by scale_cuda
+            let same_size = self
+                .config
+                .resolution
+                .map(|res| res.width == frame.width && res.height == frame.height)
+                .unwrap_or(true);
+            let hw_frames = match &frame.dmabuf {
+                Some(dmabuf) if same_size || self.gpu_backend.is_some() => {
+                    self.init_hw_input(&dmabuf.info)
+                }
+                _ => None,
+            };
+            self.init_encoder(frame.width, frame.height, frame.format, hw_frames)?;
+        }
+
+        let submit_start = Instant::now();
+        let mut video_frame = self.input_frame(frame)?;
+
         // Set PTS
         video_frame.set_pts(Some(frame.pts));
 
         // Note: Keyframe insertion is handled by encoder GOP settings
         // frame.is_keyframe is informational for stats/logging
 
-        // Scale if needed
-        let frame_to_encode = if let Some(ref mut scaler) = self.scaler {
+        // Scale if needed (on the GPU when available)
+        let mut frame_to_encode = if let Some(ref mut gpu) = self.gpu_scaler {
+            gpu.run(&video_frame)?
+        } else if let Some(scaler) = self
+            .scaler
+            .as_mut()
+            .filter(|_| super::needs_cpu_scaling(self.input_resolution, frame))
+        {
             let mut scaled = ffmpeg::frame::Video::empty();
             scaler
                 .run(&video_frame, &mut scaled)
@@ -255,93 +526,45 @@ impl Encoder for NvencEncoder {
         } else {
             video_frame
         };
+        super::attach_damage_roi(&mut frame_to_encode, frame);
 
-        // Send frame to encoder
-        encoder
-            .send_frame(&frame_to_encode)
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send frame: {}", e)))?;
-
-        // Receive encoded packet
-        let mut ffmpeg_packet = ffmpeg::Packet::empty();
-        match encoder.receive_packet(&mut ffmpeg_packet) {
-            Ok(_) => {
-                let encode_time = encode_start.elapsed();
-
-                self.frame_count += 1;
-                self.stats.frames_encoded = self.frame_count;
-                self.stats.bytes_output += ffmpeg_packet.size() as u64;
-
-                // Update average encode time (exponential moving average)
-                let encode_ms = encode_time.as_secs_f64() * 1000.0;
-                self.stats.avg_encode_time_ms =
-                    self.stats.avg_encode_time_ms * 0.95 + encode_ms * 0.05;
-
-                // Calculate current bitrate
-                if let Some(start) = self.start_time {
-                    let elapsed = start.elapsed().as_secs_f64();
-                    if elapsed > 0.0 {
-                        self.stats.current_bitrate_kbps =
-                            ((self.stats.bytes_output as f64 * 8.0) / elapsed / 1000.0) as u64;
-                    }
-                }
+        // Hand the frame to NVENC without waiting for its bitstream
+        let encoder = self.encoder.as_mut().unwrap();
+        self.packets.send(encoder, &frame_to_encode, submit_start)?;
 
-                let packet = Packet {
-                    data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                    pts: ffmpeg_packet.pts().unwrap_or(0),
-                    dts: ffmpeg_packet.dts().unwrap_or(0),
-                    duration: ffmpeg_packet.duration(),
-                    is_keyframe: ffmpeg_packet.is_key(),
-                    flags: 0,
-                };
+        self.packets.record(&mut self.stats);
+        Ok(())
+    }
 
-                Ok(Some(packet))
-            }
-            Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => {
-                // No packet available yet, encoder is buffering
-                Ok(None)
-            }
-            Err(e) => Err(Error::EncodingFailed(format!(
-                "Failed to receive packet: {}",
-                e
-            ))),
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        if let Some(packet) = self.drained.pop_front() {
+            return Ok(Some(packet));
+        }
+        let Some(encoder) = self.encoder.as_mut() else {
+            return Ok(None);
+        };
+        let packet = self.packets.receive(encoder)?;
+        if let Some(packet) = &packet {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
+        Ok(packet)
     }
 
     fn flush(&mut self) -> Result<Vec<Packet>> {
+        let mut packets: Vec<Packet> = self.drained.drain(..).collect();
         let encoder = match self.encoder.as_mut() {
             Some(e) => e,
-            None => return Ok(Vec::new()),
+            None => return Ok(packets),
         };
 
-        // Send EOF to encoder
-        encoder
-            .send_eof()
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send EOF: {}", e)))?;
-
-        // Drain remaining packets
-        let mut packets = Vec::new();
-        loop {
-            let mut ffmpeg_packet = ffmpeg::Packet::empty();
-            match encoder.receive_packet(&mut ffmpeg_packet) {
-                Ok(_) => {
-                    self.stats.bytes_output += ffmpeg_packet.size() as u64;
-                    packets.push(Packet {
-                        data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                        pts: ffmpeg_packet.pts().unwrap_or(0),
-                        dts: ffmpeg_packet.dts().unwrap_or(0),
-                        duration: ffmpeg_packet.duration(),
-                        is_keyframe: ffmpeg_packet.is_key(),
-                        flags: 0,
-                    });
-                }
-                Err(ffmpeg::Error::Eof) => break,
-                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => continue,
-                Err(e) => {
-                    tracing::warn!("Error during flush: {}", e);
-                    break;
-                }
-            }
+        // Send EOF and drain remaining packets
+        let finished = self.packets.finish(encoder)?;
+        for packet in &finished {
+            self.stats.record_packet(packet, self.start_time);
         }
+        packets.extend(finished);
+        self.packets.record(&mut self.stats);
 
         tracing::info!(
             "NVENC encoder flushed: {} frames, {} bytes, avg {:.2}ms/frame",
@@ -349,6 +572,14 @@ impl Encoder for NvencEncoder {
             self.stats.bytes_output,
             self.stats.avg_encode_time_ms
         );
+        if let Some(gpu) = &self.gpu_scaler {
+            tracing::debug!(
+                "GPU scaling ({}): avg {:?} max {:?}",
+                gpu.backend(),
+                gpu.timing().average(),
+                gpu.timing().max
+            );
+        }
 
         Ok(packets)
     }
@@ -392,8 +623,17 @@ impl Encoder for NvencEncoder {
     }
 
     fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
-        // For now, just update the stored config
-        // Full reconfiguration would require re-creating the encoder
+        // A session opened ahead of time takes any change by reopening on
+        // the first frame
+        if self.prepared.is_some() && !self.config.differs_only_in_bitrate(config) {
+            self.close();
+        }
+
+        // NVENC's dynamic bitrate reconfig (the session stays open)
+        if let Some(encoder) = self.encoder.as_mut() {
+            super::check_in_place(&self.config, config)?;
+            super::set_bitrate(encoder, config);
+        }
         self.config = config.clone();
         tracing::info!("Encoder config updated: {}kbps", config.bitrate_kbps);
         Ok(())
@@ -457,6 +697,44 @@ pub fn get_gpu_name() -> Option<String> {
         .map(|o| String::from_utf8_lossy(&o.stdout).trim().to_string())
 }
 
+/// Number CUDA devices in PCI bus order, as nvidia-smi does
+///
+/// CUDA orders devices fastest first by default, so the `gpu` option and
+/// the CUDA device index would name a different GPU than [`list_gpus`] on
+/// mixed hosts. An order the user set is kept.
+///
+/// This sets `CUDA_DEVICE_ORDER`, so call it at startup before spawning
+/// any thread (the async runtime, capture) that may read the environment;
+/// the library never calls it itself. It takes effect only before CUDA
+/// initialises.
+pub fn use_pci_device_order() {
+    static ONCE: std::sync::Once = std::sync::Once::new();
+    ONCE.call_once(|| {
+        if std::env::var_os("CUDA_DEVICE_ORDER").is_none() {
+            std::env::set_var("CUDA_DEVICE_ORDER", "PCI_BUS_ID");
+        }
+    });
+}
+
+/// Index (PCI bus order) and name of every NVIDIA GPU
+pub fn list_gpus() -> Vec<(u32, String)> {
+    std::process::Command::new("nvidia-smi")
+        .args(["--query-gpu=index,name", "--format=csv,noheader"])
+        .output()
+        .ok()
+        .filter(|o| o.status.success())
+        .map(|o| {
+            String::from_utf8_lossy(&o.stdout)
+                .lines()
+                .filter_map(|line| {
+                    let (index, name) = line.split_once(',')?;
+                    Some((index.trim().parse().ok()?, name.trim().to_string()))
+                })
+                .collect()
+        })
+        .unwrap_or_default()
+}
+
 /// Get NVIDIA driver version
 pub fn get_driver_version() -> Option<String> {
     std::process::Command::new("nvidia-smi")
@@ -504,6 +782,23 @@ mod tests {
         println!("NVENC Capabilities: {:?}", caps);
     }
 
+    #[test]
+    fn test_download_matches_the_next_stage() {
+        // CPU fallback after a failed import, resized by scale_cuda: the
+        // GPU scaler's buffersrc takes the capture format
+        assert_eq!(download_format(false, true, FrameFormat::Bgra), None);
+
+        // Without it, NVENC and the CPU scaler take NV12
+        assert_eq!(
+            download_format(false, false, FrameFormat::Bgra),
+            Some(FrameFormat::Nv12)
+        );
+        assert_eq!(download_format(false, false, FrameFormat::Nv12), None);
+
+        // Uploads to the session's CUDA frames keep the capture format
+        assert_eq!(download_format(true, false, FrameFormat::Bgra), None);
+    }
+
     #[test]
     fn test_encoder_creation() {
         if !is_available() {
@@ -0,0 +1,129 @@
+//! Boot-scoped cache of hardware probe results
+//!
+//! Probing opens FFmpeg encoders on every backend and shells out to
+//! `nvidia-smi`, `vainfo` and `lspci`, which together take seconds on a
+//! cold start. The hardware can't change without a reboot (short of a
+//! driver reload), so each result is kept in the runtime directory, keyed
+//! by the kernel's boot ID and this crate's version, and reused by every
+//! process until the next boot. [`clear`] forces a fresh probe.
+
+use serde::de::DeserializeOwned;
+use serde::{Deserialize, Serialize};
+
+use std::path::{Path, PathBuf};
+
+/// One cached result
+#[derive(Serialize, Deserialize)]
+struct Entry<T> {
+    boot_id: String,
+    version: String,
+    value: T,
+}
+
+/// `probe()`, or its result from earlier in this boot
+///
+/// Falls back to probing whenever the cache can't be read or written;
+/// caching never makes a probe fail.
+pub(crate) fn cached<T, F>(name: &str, probe: F) -> T
+where
+    T: Serialize + DeserializeOwned,
+    F: FnOnce() -> T,
+{
+    let Some(boot_id) = boot_id() else {
+        return probe();
+    };
+    let dir = cache_dir();
+    let path = dir.join(format!("{}.toml", name));
+
+    if let Some(entry) = std::fs::read_to_string(&path)
+        .ok()
+        .and_then(|text| toml::from_str::<Entry<T>>(&text).ok())
+    {
+        if entry.boot_id == boot_id && entry.version == crate::VERSION {
+            tracing::debug!("Using cached {} probe from {}", name, path.display());
+            return entry.value;
+        }
+    }
+
+    let entry = Entry {
+        boot_id,
+        version: crate::VERSION.to_string(),
+        value: probe(),
+    };
+    if let Err(e) = store(&dir, &path, &entry) {
+        tracing::debug!("Could not cache {} probe: {}", name, e);
+    }
+    entry.value
+}
+
+/// Forget every cached result, so the next probe looks at the hardware
+pub fn clear() -> std::io::Result<()> {
+    match std::fs::remove_dir_all(cache_dir()) {
+        Err(e) if e.kind() != std::io::ErrorKind::NotFound => Err(e),
+        _ => Ok(()),
+    }
+}
+
+/// Write `entry` next to `path` and rename it into place, so a concurrent
+/// reader sees the old file or the new one, never half of one
+fn store<T: Serialize>(dir: &Path, path: &Path, entry: &Entry<T>) -> std::io::Result<()> {
+    let text = toml::to_string(entry)
+        .map_err(|e| std::io::Error::new(std::io::ErrorKind::InvalidData, e))?;
+    std::fs::create_dir_all(dir)?;
+    let tmp = path.with_extension(format!("tmp.{}", std::process::id()));
+    std::fs::write(&tmp, text)?;
+    std::fs::rename(&tmp, path)
+}
+
+/// `$XDG_RUNTIME_DIR/ghoststream` (per user, cleared on logout), or a
+/// per-user directory under /tmp
+fn cache_dir() -> PathBuf {
+    match std::env::var_os("XDG_RUNTIME_DIR") {
+        Some(dir) if !dir.is_empty() => PathBuf::from(dir).join("ghoststream"),
+        _ => {
+            let uid = unsafe { libc::getuid() };
+            std::env::temp_dir().join(format!("ghoststream-{}", uid))
+        }
+    }
+}
+
+/// Changes on every boot
+fn boot_id() -> Option<String> {
+    std::fs::read_to_string("/proc/sys/kernel/random/boot_id")
+        .ok()
+        .map(|id| id.trim().to_string())
+        .filter(|id| !id.is_empty())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[derive(Debug, PartialEq, Serialize, Deserialize)]
+    struct Probe {
+        name: String,
+        count: u32,
+    }
+
+    #[test]
+    fn test_entry_round_trips_through_toml() {
+        let entry = Entry {
+            boot_id: "boot".into(),
+            version: crate::VERSION.into(),
+            value: vec![
+                Probe {
+                    name: "a".into(),
+                    count: 1,
+                },
+                Probe {
+                    name: "b".into(),
+                    count: 2,
+                },
+            ],
+        };
+        let text = toml::to_string(&entry).unwrap();
+        let back: Entry<Vec<Probe>> = toml::from_str(&text).unwrap();
+        assert_eq!(back.boot_id, "boot");
+        assert_eq!(back.value, entry.value);
+    }
+}
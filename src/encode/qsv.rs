@@ -2,11 +2,13 @@
 //!
 //! Provides H.264, HEVC, and AV1 encoding using Intel integrated/discrete GPUs.
 
+use crate::clock;
 use crate::config::EncoderConfig;
 use crate::error::{Error, Result};
+use crate::processing::{GpuBackend, GpuOutput, GpuScaler};
 use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
 
-use super::{Codec, Encoder, EncoderStats};
+use super::{Codec, Encoder, EncoderBackend, EncoderStats, PacketQueue};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::format::Pixel;
@@ -20,10 +22,15 @@ pub struct QsvEncoder {
     encoder: Option<ffmpeg::encoder::Video>,
     scaler: Option<Scaler>,
     stats: EncoderStats,
-    frame_count: u64,
+    /// Frames sent but not yet read back
+    packets: PacketQueue,
     start_time: Option<Instant>,
     input_resolution: Option<Resolution>,
     time_base: ffmpeg::Rational,
+    /// GPU filter used when the output is resized
+    gpu_backend: Option<GpuBackend>,
+    /// vpp_qsv stage (replaces `scaler` when it could be built)
+    gpu_scaler: Option<GpuScaler>,
 }
 
 impl QsvEncoder {
@@ -48,15 +55,21 @@ impl QsvEncoder {
             )));
         }
 
+        let gpu_backend = config
+            .resolution
+            .and(GpuBackend::select(EncoderBackend::Qsv));
+
         Ok(Self {
             config,
             encoder: None,
             scaler: None,
             stats: EncoderStats::default(),
-            frame_count: 0,
+            packets: PacketQueue::default(),
             start_time: None,
             input_resolution: None,
             time_base: ffmpeg::Rational::new(1, 60),
+            gpu_backend,
+            gpu_scaler: None,
         })
     }
 
@@ -70,7 +83,12 @@ impl QsvEncoder {
     }
 
     /// Initialize encoder with specific input resolution
-    fn init_encoder(&mut self, input_width: u32, input_height: u32) -> Result<()> {
+    fn init_encoder(
+        &mut self,
+        input_width: u32,
+        input_height: u32,
+        input_format: FrameFormat,
+    ) -> Result<()> {
         let encoder_name = Self::qsv_encoder_name(self.config.codec);
 
         // Find the encoder
@@ -85,6 +103,25 @@ impl QsvEncoder {
             (input_width, input_height)
         };
 
+        // Resize on the GPU when possible (the encoder then takes QSV
+        // surfaces); the CPU scaler below is the fallback
+        let scale = input_width != out_width || input_height != out_height;
+        if scale {
+            self.gpu_scaler = self.gpu_backend.and_then(|backend| {
+                let output = GpuOutput {
+                    format: Some(Pixel::NV12),
+                    ..GpuOutput::new(Resolution::new(out_width, out_height))
+                };
+                super::system_gpu_scaler(
+                    backend,
+                    input_width,
+                    input_height,
+                    Self::to_ffmpeg_format(input_format),
+                    output,
+                )
+            });
+        }
+
         // Create encoder context
         let context = ffmpeg::codec::context::Context::new_with_codec(codec);
         let mut encoder = context
@@ -95,9 +132,18 @@ impl QsvEncoder {
         // Set basic parameters
         encoder.set_width(out_width);
         encoder.set_height(out_height);
-        encoder.set_format(Pixel::NV12); // QSV prefers NV12
-        encoder.set_time_base(ffmpeg::Rational::new(1, 1000));
-        self.time_base = ffmpeg::Rational::new(1, 1000);
+        match self.gpu_scaler.as_ref().and_then(|gpu| gpu.output_frames()) {
+            Some(frames) => {
+                encoder.set_format(frames.kind().hw_format());
+                unsafe {
+                    (*encoder.as_mut_ptr()).hw_frames_ctx =
+                        ffmpeg::ffi::av_buffer_ref(frames.as_ptr());
+                }
+            }
+            None => encoder.set_format(Pixel::NV12), // QSV prefers NV12
+        }
+        encoder.set_time_base(clock::time_base());
+        self.time_base = clock::time_base();
 
         encoder.set_frame_rate(Some(ffmpeg::Rational::new(
             self.config.framerate.num as i32,
@@ -105,6 +151,7 @@ impl QsvEncoder {
         )));
         encoder.set_gop(self.config.gop_size);
         encoder.set_max_b_frames(self.config.b_frames as usize);
+        super::set_latency(&mut encoder, &self.config);
 
         // Build encoder options
         let mut opts = Dictionary::new();
@@ -150,6 +197,12 @@ impl QsvEncoder {
             opts.set("look_ahead", "0");
         }
 
+        // Frames in flight before output must be synced (sizes the
+        // surface pool)
+        if let Some(depth) = self.config.async_depth {
+            opts.set("async_depth", &depth.max(1).to_string());
+        }
+
         // Open encoder
         let opened = encoder
             .open_with(opts)
@@ -158,8 +211,8 @@ impl QsvEncoder {
         self.encoder = Some(opened);
         self.input_resolution = Some(Resolution::new(input_width, input_height));
 
-        // Create scaler if needed
-        if input_width != out_width || input_height != out_height {
+        // Create CPU scaler if needed and the GPU can't
+        if scale && self.gpu_scaler.is_none() {
             let scaler = Scaler::get(
                 Pixel::NV12,
                 input_width,
@@ -204,38 +257,33 @@ impl Encoder for QsvEncoder {
         Ok(())
     }
 
-    fn encode(&mut self, frame: &Frame) -> Result<Option<Packet>> {
+    fn scales_on_device(&self) -> bool {
+        super::gpu_scales_on_device(
+            self.gpu_backend,
+            self.encoder.is_some(),
+            self.gpu_scaler.as_ref(),
+        )
+    }
+
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
         if self.encoder.is_none() {
-            self.init_encoder(frame.width, frame.height)?;
+            self.init_encoder(frame.width, frame.height, frame.format)?;
         }
 
-        let encoder = self.encoder.as_mut().unwrap();
-        let encode_start = Instant::now();
+        let submit_start = Instant::now();
 
-        let mut video_frame = ffmpeg::frame::Video::new(
-            Self::to_ffmpeg_format(frame.format),
-            frame.width,
-            frame.height,
-        );
-
-        // Copy frame data
-        if frame.format == FrameFormat::Nv12 {
-            let y_size = (frame.width * frame.height) as usize;
-            let uv_size = y_size / 2;
-
-            if frame.data.len() >= y_size + uv_size {
-                video_frame.data_mut(0)[..y_size].copy_from_slice(&frame.data[..y_size]);
-                video_frame.data_mut(1)[..uv_size]
-                    .copy_from_slice(&frame.data[y_size..y_size + uv_size]);
-            }
-        } else {
-            let plane_size = video_frame.data(0).len().min(frame.data.len());
-            video_frame.data_mut(0)[..plane_size].copy_from_slice(&frame.data[..plane_size]);
-        }
+        // Reference the pooled frame buffer directly (no copy)
+        let mut video_frame = super::wrap_frame(frame, Self::to_ffmpeg_format(frame.format))?;
 
         video_frame.set_pts(Some(frame.pts));
 
-        let frame_to_encode = if let Some(ref mut scaler) = self.scaler {
+        let mut frame_to_encode = if let Some(ref mut gpu) = self.gpu_scaler {
+            gpu.run(&video_frame)?
+        } else if let Some(scaler) = self
+            .scaler
+            .as_mut()
+            .filter(|_| super::needs_cpu_scaling(self.input_resolution, frame))
+        {
             let mut scaled = ffmpeg::frame::Video::empty();
             scaler
                 .run(&video_frame, &mut scaled)
@@ -245,47 +293,25 @@ impl Encoder for QsvEncoder {
         } else {
             video_frame
         };
+        super::attach_damage_roi(&mut frame_to_encode, frame);
 
-        encoder
-            .send_frame(&frame_to_encode)
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send frame: {}", e)))?;
-
-        let mut ffmpeg_packet = ffmpeg::Packet::empty();
-        match encoder.receive_packet(&mut ffmpeg_packet) {
-            Ok(_) => {
-                let encode_time = encode_start.elapsed();
-
-                self.frame_count += 1;
-                self.stats.frames_encoded = self.frame_count;
-                self.stats.bytes_output += ffmpeg_packet.size() as u64;
-
-                let encode_ms = encode_time.as_secs_f64() * 1000.0;
-                self.stats.avg_encode_time_ms =
-                    self.stats.avg_encode_time_ms * 0.95 + encode_ms * 0.05;
-
-                if let Some(start) = self.start_time {
-                    let elapsed = start.elapsed().as_secs_f64();
-                    if elapsed > 0.0 {
-                        self.stats.current_bitrate_kbps =
-                            ((self.stats.bytes_output as f64 * 8.0) / elapsed / 1000.0) as u64;
-                    }
-                }
+        let encoder = self.encoder.as_mut().unwrap();
+        self.packets.send(encoder, &frame_to_encode, submit_start)?;
 
-                Ok(Some(Packet {
-                    data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                    pts: ffmpeg_packet.pts().unwrap_or(0),
-                    dts: ffmpeg_packet.dts().unwrap_or(0),
-                    duration: ffmpeg_packet.duration(),
-                    is_keyframe: ffmpeg_packet.is_key(),
-                    flags: 0,
-                }))
-            }
-            Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => Ok(None),
-            Err(e) => Err(Error::EncodingFailed(format!(
-                "Failed to receive packet: {}",
-                e
-            ))),
+        self.packets.record(&mut self.stats);
+        Ok(())
+    }
+
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        let Some(encoder) = self.encoder.as_mut() else {
+            return Ok(None);
+        };
+        let packet = self.packets.receive(encoder)?;
+        if let Some(packet) = &packet {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
+        Ok(packet)
     }
 
     fn flush(&mut self) -> Result<Vec<Packet>> {
@@ -294,39 +320,25 @@ impl Encoder for QsvEncoder {
             None => return Ok(Vec::new()),
         };
 
-        encoder
-            .send_eof()
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send EOF: {}", e)))?;
-
-        let mut packets = Vec::new();
-        loop {
-            let mut ffmpeg_packet = ffmpeg::Packet::empty();
-            match encoder.receive_packet(&mut ffmpeg_packet) {
-                Ok(_) => {
-                    self.stats.bytes_output += ffmpeg_packet.size() as u64;
-                    packets.push(Packet {
-                        data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                        pts: ffmpeg_packet.pts().unwrap_or(0),
-                        dts: ffmpeg_packet.dts().unwrap_or(0),
-                        duration: ffmpeg_packet.duration(),
-                        is_keyframe: ffmpeg_packet.is_key(),
-                        flags: 0,
-                    });
-                }
-                Err(ffmpeg::Error::Eof) => break,
-                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => continue,
-                Err(e) => {
-                    tracing::warn!("Error during flush: {}", e);
-                    break;
-                }
-            }
+        let packets = self.packets.finish(encoder)?;
+        for packet in &packets {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
 
         tracing::info!(
             "QSV encoder flushed: {} frames, {} bytes",
             self.stats.frames_encoded,
             self.stats.bytes_output,
         );
+        if let Some(gpu) = &self.gpu_scaler {
+            tracing::debug!(
+                "GPU scaling ({}): avg {:?} max {:?}",
+                gpu.backend(),
+                gpu.timing().average(),
+                gpu.timing().max
+            );
+        }
 
         Ok(packets)
     }
@@ -368,6 +380,11 @@ impl Encoder for QsvEncoder {
     }
 
     fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
+        // QSV resets the bitrate on the next frame
+        if let Some(encoder) = self.encoder.as_mut() {
+            super::check_in_place(&self.config, config)?;
+            super::set_bitrate(encoder, config);
+        }
         self.config = config.clone();
         tracing::info!("QSV encoder config updated: {}kbps", config.bitrate_kbps);
         Ok(())
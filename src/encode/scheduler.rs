@@ -0,0 +1,733 @@
+//! Encoder session scheduler
+//!
+//! Tracks live encoder sessions per device and places each new session on
+//! the least-loaded hardware encoder that supports the codec, spilling
+//! over to other GPUs, then QSV/AMF, then software when a device is full.
+//!
+//! Consumer NVENC caps concurrent sessions per GPU and the limit depends on
+//! the driver, so it is also learned: a device that refuses a session has
+//! its limit lowered to the sessions it already holds. Encoders open
+//! lazily on their first frame; [`ScheduledEncoder`] moves to the next
+//! device when that first open fails.
+//!
+//! Load is an estimate (pixel rate of the open sessions over a nominal
+//! throughput per device), not a hardware counter.
+
+use super::{
+    amf, nvenc, probe, qsv, software, Codec, Encoder, EncoderBackend, EncoderStats, PreparedInput,
+};
+use crate::config::EncoderConfig;
+use crate::error::{Error, Result};
+use crate::types::{CodecParams, Frame, Packet, Resolution};
+
+use parking_lot::Mutex;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, OnceLock};
+
+/// Concurrent sessions assumed for GeForce cards until a refusal shows the
+/// driver's real limit
+const NVENC_CONSUMER_SESSIONS: u32 = 8;
+
+/// Nominal throughput in pixels per second (~1080p at 500/300/300 fps per
+/// engine, ~1080p7 per CPU core at medium presets)
+const NVENC_ENGINE_CAPACITY: f64 = 1.0e9;
+const QSV_CAPACITY: f64 = 0.6e9;
+const AMF_CAPACITY: f64 = 0.6e9;
+const CPU_CORE_CAPACITY: f64 = 15.0e6;
+
+/// An encoder a session can be placed on
+#[derive(Debug, Clone, serde::Serialize, serde::Deserialize)]
+pub struct EncoderDevice {
+    pub backend: EncoderBackend,
+    /// GPU index for NVENC (0 for single-device backends)
+    pub index: u32,
+    pub name: String,
+    pub codecs: Vec<Codec>,
+    /// Concurrent sessions allowed (None = unlimited)
+    pub max_sessions: Option<u32>,
+    /// Nominal throughput in pixels per second
+    pub capacity: f64,
+}
+
+/// Sessions and estimated utilisation of a device
+#[derive(Debug, Clone)]
+pub struct DeviceLoad {
+    pub device: EncoderDevice,
+    pub sessions: u32,
+    /// Estimated utilisation in percent (can exceed 100 when overbooked)
+    pub utilization: u32,
+}
+
+struct Slot {
+    device: EncoderDevice,
+    sessions: u32,
+    /// Pixel rate of the open sessions
+    load: f64,
+}
+
+impl Slot {
+    fn utilization(&self) -> u32 {
+        (self.load / self.device.capacity * 100.0).round() as u32
+    }
+}
+
+/// Handle to a session parked by [`EncoderScheduler::prewarm`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct WarmId(u64);
+
+/// Session opened ahead of time, parked until a pipeline asks for it
+struct WarmSession {
+    id: WarmId,
+    config: EncoderConfig,
+    encoder: Box<dyn Encoder>,
+    lease: SessionLease,
+    refused: Vec<usize>,
+}
+
+// SAFETY: FFmpeg codec, scaler and hardware contexts are not tied to the
+// thread that opened them, only to one thread at a time. A parked session
+// is touched by nobody until `open` hands it to exactly one caller.
+unsafe impl Send for WarmSession {}
+
+/// Places encoder sessions on devices
+#[derive(Clone)]
+pub struct EncoderScheduler {
+    slots: Arc<Mutex<Vec<Slot>>>,
+    /// Pre-opened sessions, oldest first
+    warm: Arc<Mutex<Vec<WarmSession>>>,
+    next_warm: Arc<AtomicU64>,
+}
+
+impl EncoderScheduler {
+    /// Scheduler over `devices`, in backend preference order
+    pub fn new(devices: Vec<EncoderDevice>) -> Self {
+        let slots = devices
+            .into_iter()
+            .map(|device| Slot {
+                device,
+                sessions: 0,
+                load: 0.0,
+            })
+            .collect();
+        Self {
+            slots: Arc::new(Mutex::new(slots)),
+            warm: Arc::new(Mutex::new(Vec::new())),
+            next_warm: Arc::new(AtomicU64::new(0)),
+        }
+    }
+
+    /// Process-wide scheduler over the encoders found on this host
+    /// (probed once per boot)
+    ///
+    /// NVIDIA device indices come from nvidia-smi, in PCI order; they name
+    /// the same GPUs as CUDA's only once the application has called
+    /// [`nvenc::use_pci_device_order`] at startup.
+    pub fn global() -> &'static EncoderScheduler {
+        static GLOBAL: OnceLock<EncoderScheduler> = OnceLock::new();
+        GLOBAL.get_or_init(|| EncoderScheduler::new(probe::cached("devices", probe_devices)))
+    }
+
+    /// Every device with its current load
+    pub fn devices(&self) -> Vec<DeviceLoad> {
+        self.slots
+            .lock()
+            .iter()
+            .map(|slot| DeviceLoad {
+                device: slot.device.clone(),
+                sessions: slot.sessions,
+                utilization: slot.utilization(),
+            })
+            .collect()
+    }
+
+    /// Estimated utilisation of device `slot` in percent (0-100)
+    pub fn utilization(&self, slot: usize) -> u8 {
+        self.slots
+            .lock()
+            .get(slot)
+            .map(|slot| slot.utilization().min(100) as u8)
+            .unwrap_or(0)
+    }
+
+    /// Open and initialize an encoder on the best device for `config`
+    ///
+    /// Takes a matching session from the warm pool when there is one.
+    pub fn open(&self, config: EncoderConfig) -> Result<ScheduledEncoder> {
+        let warm = {
+            let mut pool = self.warm.lock();
+            pool.iter()
+                .position(|session| session.config.differs_only_in_bitrate(&config))
+                .map(|i| pool.remove(i))
+        };
+        if let Some(session) = warm {
+            let mut encoder = ScheduledEncoder {
+                scheduler: self.clone(),
+                config: session.config,
+                encoder: session.encoder,
+                lease: session.lease,
+                refused: session.refused,
+                opened: false,
+            };
+            encoder.reconfigure(&config)?;
+            tracing::info!("Encoder session taken from the warm pool");
+            return Ok(encoder);
+        }
+        self.open_new(config)
+    }
+
+    fn open_new(&self, config: EncoderConfig) -> Result<ScheduledEncoder> {
+        let mut refused = Vec::new();
+        let (encoder, lease) = self.place(&config, &mut refused)?;
+        Ok(ScheduledEncoder {
+            scheduler: self.clone(),
+            config,
+            encoder,
+            lease,
+            refused,
+            opened: false,
+        })
+    }
+
+    /// Open a session for `config` now and park it until [`open`] asks for
+    /// a matching one, so a pipeline that goes live later skips driver
+    /// and session setup
+    ///
+    /// `input` describes the frames it will get (see
+    /// [`Encoder::prepare`]). Parked sessions count against their device's
+    /// session limit until taken or released with [`release`].
+    ///
+    /// [`open`]: Self::open
+    /// [`release`]: Self::release
+    pub fn prewarm(&self, config: EncoderConfig, input: &PreparedInput) -> Result<WarmId> {
+        let mut session = self.open_new(config)?;
+        session.prepare(input)?;
+        Ok(self.park(session))
+    }
+
+    fn park(&self, session: ScheduledEncoder) -> WarmId {
+        let ScheduledEncoder {
+            config,
+            encoder,
+            lease,
+            refused,
+            ..
+        } = session;
+        let id = WarmId(self.next_warm.fetch_add(1, Ordering::Relaxed));
+        self.warm.lock().push(WarmSession {
+            id,
+            config,
+            encoder,
+            lease,
+            refused,
+        });
+        id
+    }
+
+    /// Close the parked session `id`, unless a pipeline took it already
+    pub fn release(&self, id: WarmId) {
+        let released = {
+            let mut pool = self.warm.lock();
+            pool.iter()
+                .position(|session| session.id == id)
+                .map(|i| pool.remove(i))
+        };
+        // Closed outside the lock
+        drop(released);
+    }
+
+    /// Sessions waiting in the warm pool
+    pub fn warm_sessions(&self) -> usize {
+        self.warm.lock().len()
+    }
+
+    /// Close every parked session
+    pub fn release_warm(&self) {
+        // Closed outside the lock
+        let released = std::mem::take(&mut *self.warm.lock());
+        drop(released);
+    }
+
+    /// Create an encoder on the best device not in `refused`, adding every
+    /// device that fails to `refused`
+    fn place(
+        &self,
+        config: &EncoderConfig,
+        refused: &mut Vec<usize>,
+    ) -> Result<(Box<dyn Encoder>, SessionLease)> {
+        loop {
+            let lease = self.reserve(config, refused)?;
+            let device = lease.device();
+
+            let mut device_config = config.clone();
+            if device.backend == EncoderBackend::Nvenc {
+                device_config.device = Some(device.index);
+            }
+            let result = super::create_encoder_with_backend(device_config, device.backend)
+                .and_then(|mut encoder| {
+                    encoder.init()?;
+                    Ok(encoder)
+                });
+
+            match result {
+                Ok(encoder) => {
+                    tracing::info!(
+                        "Encoder session on {} ({} sessions)",
+                        device.name,
+                        lease.sessions()
+                    );
+                    return Ok((encoder, lease));
+                }
+                Err(e) => {
+                    tracing::warn!("{} unavailable: {}", device.name, e);
+                    refused.push(lease.slot);
+                }
+            }
+        }
+    }
+
+    /// Reserve a session on the least-loaded device that supports the
+    /// codec and has a free session, preferring hardware
+    pub fn reserve(&self, config: &EncoderConfig, exclude: &[usize]) -> Result<SessionLease> {
+        let cost = session_cost(config);
+        let mut slots = self.slots.lock();
+
+        let best = slots
+            .iter()
+            .enumerate()
+            .filter(|(i, slot)| {
+                !exclude.contains(i)
+                    && slot.device.codecs.contains(&config.codec)
+                    && slot
+                        .device
+                        .max_sessions
+                        .map_or(true, |max| slot.sessions < max)
+            })
+            .min_by(|(_, a), (_, b)| {
+                let software = |slot: &Slot| slot.device.backend == EncoderBackend::Software;
+                let after = |slot: &Slot| (slot.load + cost) / slot.device.capacity;
+                software(a)
+                    .cmp(&software(b))
+                    .then(after(a).total_cmp(&after(b)))
+            })
+            .map(|(i, _)| i);
+
+        let Some(slot) = best else {
+            return Err(Error::EncoderInit(format!(
+                "No encoder session available for {}",
+                config.codec.display_name()
+            )));
+        };
+
+        slots[slot].sessions += 1;
+        slots[slot].load += cost;
+        Ok(SessionLease {
+            slots: self.slots.clone(),
+            slot,
+            cost,
+        })
+    }
+}
+
+/// Estimated pixel rate of a session
+fn session_cost(config: &EncoderConfig) -> f64 {
+    let Resolution { width, height } = config.resolution.unwrap_or(Resolution::FHD_1080P);
+    width as f64 * height as f64 * config.framerate.as_f64()
+}
+
+/// A reserved session; released on drop
+pub struct SessionLease {
+    slots: Arc<Mutex<Vec<Slot>>>,
+    slot: usize,
+    cost: f64,
+}
+
+impl SessionLease {
+    /// Scheduler slot of the device
+    pub fn slot(&self) -> usize {
+        self.slot
+    }
+
+    pub fn device(&self) -> EncoderDevice {
+        self.slots.lock()[self.slot].device.clone()
+    }
+
+    /// Sessions on the device, this one included
+    pub fn sessions(&self) -> u32 {
+        self.slots.lock()[self.slot].sessions
+    }
+
+    /// The session's pixel rate changed: move its load on the device
+    fn set_cost(&mut self, cost: f64) {
+        let mut slots = self.slots.lock();
+        let slot = &mut slots[self.slot];
+        slot.load = (slot.load - self.cost + cost).max(0.0);
+        self.cost = cost;
+    }
+
+    /// The device refused this session: cap it at the sessions it holds
+    /// besides this one (when it holds any; otherwise the device failed
+    /// rather than ran out of sessions)
+    fn refused(&self) {
+        let mut slots = self.slots.lock();
+        let slot = &mut slots[self.slot];
+        let others = slot.sessions.saturating_sub(1);
+        if others > 0 && slot.device.max_sessions.map_or(true, |max| others < max) {
+            tracing::info!("{} session limit is {}", slot.device.name, others);
+            slot.device.max_sessions = Some(others);
+        }
+    }
+}
+
+impl Drop for SessionLease {
+    fn drop(&mut self) {
+        let mut slots = self.slots.lock();
+        let slot = &mut slots[self.slot];
+        slot.sessions = slot.sessions.saturating_sub(1);
+        slot.load = (slot.load - self.cost).max(0.0);
+    }
+}
+
+/// Encoder holding a scheduler session
+///
+/// Moves to the next device if its first open (on the first frame) fails;
+/// that frame is retried there unless it is a DMA-BUF the new encoder
+/// cannot import.
+pub struct ScheduledEncoder {
+    scheduler: EncoderScheduler,
+    config: EncoderConfig,
+    encoder: Box<dyn Encoder>,
+    lease: SessionLease,
+    /// Slots that refused this session
+    refused: Vec<usize>,
+    /// A frame has been accepted
+    opened: bool,
+}
+
+impl ScheduledEncoder {
+    /// Scheduler slot of the current device
+    pub fn slot(&self) -> usize {
+        self.lease.slot()
+    }
+
+    /// The device refused to open the session: place it on the next one
+    fn move_device(&mut self, msg: &str) -> Result<()> {
+        let device = self.lease.device();
+        tracing::warn!("{} refused the session: {}", device.name, msg);
+        self.lease.refused();
+        self.refused.push(self.lease.slot());
+
+        let (encoder, lease) = self.scheduler.place(&self.config, &mut self.refused)?;
+        // Release the refused session only after the new one is held
+        self.encoder = encoder;
+        self.lease = lease;
+        Ok(())
+    }
+}
+
+impl Encoder for ScheduledEncoder {
+    fn init(&mut self) -> Result<()> {
+        // Initialized when placed
+        Ok(())
+    }
+
+    fn prepare(&mut self, input: &PreparedInput) -> Result<()> {
+        loop {
+            match self.encoder.prepare(input) {
+                Ok(()) => return Ok(()),
+                Err(Error::EncoderInit(msg)) if !self.opened => self.move_device(&msg)?,
+                Err(e) => return Err(e),
+            }
+        }
+    }
+
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
+        loop {
+            let msg = match self.encoder.submit(frame) {
+                Ok(()) => {
+                    self.opened = true;
+                    return Ok(());
+                }
+                Err(Error::EncoderInit(msg)) if !self.opened => msg,
+                Err(e) => return Err(e),
+            };
+            self.move_device(&msg)?;
+
+            if frame.dmabuf.is_some() && !self.encoder.supports_dmabuf() {
+                return Err(Error::EncodingFailed(
+                    "Encoder moved to a device without DMA-BUF import; frame dropped".into(),
+                ));
+            }
+        }
+    }
+
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        self.encoder.receive()
+    }
+
+    fn flush(&mut self) -> Result<Vec<Packet>> {
+        self.encoder.flush()
+    }
+
+    fn stats(&self) -> EncoderStats {
+        self.encoder.stats()
+    }
+
+    fn codec_params(&self) -> Option<CodecParams> {
+        self.encoder.codec_params()
+    }
+
+    fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
+        // The session stays on the device it was placed on
+        let mut device_config = config.clone();
+        let device = self.lease.device();
+        if device.backend == EncoderBackend::Nvenc {
+            device_config.device = Some(device.index);
+        }
+        self.encoder.reconfigure(&device_config)?;
+        self.lease.set_cost(session_cost(config));
+        self.config = config.clone();
+        Ok(())
+    }
+
+    fn supports_dmabuf(&self) -> bool {
+        self.encoder.supports_dmabuf()
+    }
+
+    fn scales_on_device(&self) -> bool {
+        self.encoder.scales_on_device()
+    }
+}
+
+/// Encoders on this host, in preference order: NVENC GPUs, QSV, AMF,
+/// software
+fn probe_devices() -> Vec<EncoderDevice> {
+    let mut devices = Vec::new();
+    let all = [Codec::H264, Codec::Hevc, Codec::Av1];
+
+    if nvenc::is_available() {
+        let codecs: Vec<Codec> = all
+            .into_iter()
+            .filter(|&c| nvenc::supports_codec(c))
+            .collect();
+        let mut gpus = nvenc::list_gpus();
+        if gpus.is_empty() {
+            gpus.push((0, nvenc::get_gpu_name().unwrap_or_else(|| "NVENC".into())));
+        }
+        for (index, name) in gpus {
+            let engines = if is_dual_encoder(&name) { 2.0 } else { 1.0 };
+            devices.push(EncoderDevice {
+                backend: EncoderBackend::Nvenc,
+                index,
+                max_sessions: name.contains("GeForce").then_some(NVENC_CONSUMER_SESSIONS),
+                name,
+                codecs: codecs.clone(),
+                capacity: NVENC_ENGINE_CAPACITY * engines,
+            });
+        }
+    }
+
+    let qsv = qsv::get_capabilities();
+    if qsv.available {
+        devices.push(EncoderDevice {
+            backend: EncoderBackend::Qsv,
+            index: 0,
+            name: qsv.gpu_info.unwrap_or_else(|| "Intel QSV".into()),
+            codecs: supported(&[
+                (Codec::H264, qsv.h264),
+                (Codec::Hevc, qsv.hevc),
+                (Codec::Av1, qsv.av1),
+            ]),
+            max_sessions: None,
+            capacity: QSV_CAPACITY,
+        });
+    }
+
+    let amf = amf::get_capabilities();
+    if amf.available {
+        devices.push(EncoderDevice {
+            backend: EncoderBackend::Amf,
+            index: 0,
+            name: amf.gpu_info.unwrap_or_else(|| "AMD AMF".into()),
+            codecs: supported(&[
+                (Codec::H264, amf.h264),
+                (Codec::Hevc, amf.hevc),
+                (Codec::Av1, amf.av1),
+            ]),
+            max_sessions: None,
+            capacity: AMF_CAPACITY,
+        });
+    }
+
+    let cpu = software::get_cpu_info();
+    devices.push(EncoderDevice {
+        backend: EncoderBackend::Software,
+        index: 0,
+        name: cpu.model.unwrap_or_else(|| "CPU".into()),
+        codecs: all
+            .into_iter()
+            .filter(|&c| software::is_available(c))
+            .collect(),
+        max_sessions: None,
+        capacity: CPU_CORE_CAPACITY * cpu.cores as f64,
+    });
+
+    devices
+}
+
+fn supported(codecs: &[(Codec, bool)]) -> Vec<Codec> {
+    codecs
+        .iter()
+        .filter(|(_, ok)| *ok)
+        .map(|(codec, _)| *codec)
+        .collect()
+}
+
+/// RTX 40/50 cards have two NVENC engines
+fn is_dual_encoder(name: &str) -> bool {
+    name.contains("RTX 40") || name.contains("RTX 50")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn device(backend: EncoderBackend, max_sessions: Option<u32>, capacity: f64) -> EncoderDevice {
+        EncoderDevice {
+            backend,
+            index: 0,
+            name: format!("{:?}", backend),
+            codecs: vec![Codec::H264],
+            max_sessions,
+            capacity,
+        }
+    }
+
+    #[test]
+    fn test_placement() {
+        let scheduler = EncoderScheduler::new(vec![
+            device(EncoderBackend::Nvenc, Some(2), 2.0e9),
+            device(EncoderBackend::Qsv, None, 0.5e9),
+            device(EncoderBackend::Software, None, 1.0e9),
+        ]);
+        let config = EncoderConfig::default();
+
+        // 1080p60 is ~6% of the NVENC device and ~25% of QSV
+        let a = scheduler.reserve(&config, &[]).unwrap();
+        let b = scheduler.reserve(&config, &[]).unwrap();
+        assert_eq!((a.slot(), b.slot()), (0, 0));
+
+        // NVENC full: spill to QSV, never to software while QSV has room
+        let c = scheduler.reserve(&config, &[]).unwrap();
+        assert_eq!(c.slot(), 1);
+        assert_eq!(scheduler.reserve(&config, &[1]).unwrap().slot(), 2);
+
+        drop(a);
+        assert_eq!(scheduler.reserve(&config, &[]).unwrap().slot(), 0);
+        assert_eq!(scheduler.devices()[1].sessions, 1);
+        assert_eq!(scheduler.utilization(1), 25);
+
+        let hevc = EncoderConfig::default().with_codec(Codec::Hevc);
+        assert!(scheduler.reserve(&hevc, &[]).is_err());
+    }
+
+    #[test]
+    fn test_learned_limit() {
+        let scheduler = EncoderScheduler::new(vec![device(EncoderBackend::Nvenc, None, 2.0e9)]);
+        let config = EncoderConfig::default();
+
+        let first = scheduler.reserve(&config, &[]).unwrap();
+        first.refused();
+        // A lone refused session is a device failure, not a limit
+        assert_eq!(scheduler.devices()[0].device.max_sessions, None);
+
+        let second = scheduler.reserve(&config, &[]).unwrap();
+        second.refused();
+        drop(second);
+        assert_eq!(scheduler.devices()[0].device.max_sessions, Some(1));
+        assert!(scheduler.reserve(&config, &[]).is_err());
+    }
+
+    /// Encoder that takes any in-place change
+    struct Idle;
+
+    impl Encoder for Idle {
+        fn init(&mut self) -> Result<()> {
+            Ok(())
+        }
+        fn submit(&mut self, _frame: &Frame) -> Result<()> {
+            Ok(())
+        }
+        fn receive(&mut self) -> Result<Option<Packet>> {
+            Ok(None)
+        }
+        fn flush(&mut self) -> Result<Vec<Packet>> {
+            Ok(Vec::new())
+        }
+        fn stats(&self) -> EncoderStats {
+            EncoderStats::default()
+        }
+        fn codec_params(&self) -> Option<CodecParams> {
+            None
+        }
+        fn reconfigure(&mut self, _config: &EncoderConfig) -> Result<()> {
+            Ok(())
+        }
+    }
+
+    fn park_idle(scheduler: &EncoderScheduler, config: &EncoderConfig) -> WarmId {
+        scheduler.park(ScheduledEncoder {
+            scheduler: scheduler.clone(),
+            config: config.clone(),
+            encoder: Box::new(Idle),
+            lease: scheduler.reserve(config, &[]).unwrap(),
+            refused: Vec::new(),
+            opened: false,
+        })
+    }
+
+    #[test]
+    fn test_warm_pool() {
+        let scheduler = EncoderScheduler::new(vec![device(EncoderBackend::Nvenc, Some(4), 2.0e9)]);
+        let config = EncoderConfig::default();
+        let sessions = || scheduler.devices()[0].sessions;
+
+        // A parked session holds its lease until taken
+        park_idle(&scheduler, &config);
+        assert_eq!((scheduler.warm_sessions(), sessions()), (1, 1));
+        let taken = scheduler
+            .open(config.clone().with_bitrate_kbps(3000))
+            .unwrap();
+        assert_eq!((scheduler.warm_sessions(), sessions()), (0, 1));
+        assert_eq!(taken.config.bitrate_kbps, 3000);
+        drop(taken);
+        assert_eq!(sessions(), 0);
+
+        // Releasing one session leaves the others parked, and is a no-op
+        // once it is gone
+        let first = park_idle(&scheduler, &config);
+        let second = park_idle(&scheduler, &config);
+        scheduler.release(first);
+        scheduler.release(first);
+        assert_eq!((scheduler.warm_sessions(), sessions()), (1, 1));
+        scheduler.release(second);
+        assert_eq!((scheduler.warm_sessions(), sessions()), (0, 0));
+    }
+
+    #[test]
+    fn test_reconfigure_moves_load() {
+        let scheduler = EncoderScheduler::new(vec![device(EncoderBackend::Nvenc, None, 2.0e9)]);
+        let config = EncoderConfig::default();
+        park_idle(&scheduler, &config);
+        let mut encoder = scheduler.open(config.clone()).unwrap();
+        assert_eq!(scheduler.utilization(0), 6);
+
+        // 1080p60 to 4K60 is four times the pixel rate
+        let mut uhd = config.clone();
+        uhd.resolution = Some(Resolution::UHD_4K);
+        encoder.reconfigure(&uhd).unwrap();
+        assert_eq!(scheduler.utilization(0), 25);
+
+        drop(encoder);
+        assert_eq!(scheduler.utilization(0), 0);
+    }
+}
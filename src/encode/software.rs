@@ -5,11 +5,13 @@
 //! - libx265 for H.265/HEVC (excellent quality)
 //! - libsvtav1 for AV1 (best for AMD Zen4/5 with AVX-512)
 
-use crate::config::EncoderConfig;
+use crate::clock;
+use crate::config::{CpuParallelism, EncoderConfig};
 use crate::error::{Error, Result};
+use crate::threading::{self, CpuSet, CpuTopology};
 use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
 
-use super::{Codec, Encoder, EncoderStats};
+use super::{Codec, Encoder, EncoderStats, PacketQueue, PreparedInput};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::format::Pixel;
@@ -106,11 +108,15 @@ pub struct SoftwareEncoder {
     encoder: Option<ffmpeg::encoder::Video>,
     scaler: Option<Scaler>,
     stats: EncoderStats,
-    frame_count: u64,
+    /// Frames sent but not yet read back
+    packets: PacketQueue,
     start_time: Option<Instant>,
     input_resolution: Option<Resolution>,
     time_base: ffmpeg::Rational,
     threads: usize,
+    /// Input size and format the encoder was opened for ahead of its
+    /// first frame
+    prepared: Option<(Resolution, FrameFormat)>,
 }
 
 impl SoftwareEncoder {
@@ -138,11 +144,12 @@ impl SoftwareEncoder {
             encoder: None,
             scaler: None,
             stats: EncoderStats::default(),
-            frame_count: 0,
+            packets: PacketQueue::default(),
             start_time: None,
             input_resolution: None,
-            time_base: ffmpeg::Rational::new(1, 1000),
+            time_base: clock::time_base(),
             threads,
+            prepared: None,
         })
     }
 
@@ -158,8 +165,28 @@ impl SoftwareEncoder {
         self
     }
 
+    /// Use `threads` encoder threads instead of the automatic count
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// Slices (or tiles) per frame in [`CpuParallelism::Slices`] mode
+    fn slice_count(&self) -> u32 {
+        self.config
+            .slices
+            .unwrap_or((self.threads / 4).clamp(2, 8) as u32)
+            .max(1)
+    }
+
     /// Get optimal thread count for encoding
     fn optimal_thread_count() -> usize {
+        // Pinned encoder threads get exactly their cores (x264/x265/SVT-AV1
+        // workers inherit the encoder thread's affinity)
+        if let Some(cpus) = threading::encode_cpus() {
+            return cpus.len().max(1);
+        }
+
         let cpus = std::thread::available_parallelism()
             .map(|p| p.get())
             .unwrap_or(4);
@@ -179,8 +206,23 @@ impl SoftwareEncoder {
         }
     }
 
+    /// Close an encoder opened ahead of time; the next frame opens it
+    /// again for its own size
+    fn close(&mut self) {
+        self.prepared = None;
+        self.encoder = None;
+        self.scaler = None;
+        self.input_resolution = None;
+        self.packets = PacketQueue::default();
+    }
+
     /// Initialize encoder with specific input resolution
-    fn init_encoder(&mut self, input_width: u32, input_height: u32) -> Result<()> {
+    fn init_encoder(
+        &mut self,
+        input_width: u32,
+        input_height: u32,
+        input_format: FrameFormat,
+    ) -> Result<()> {
         let encoder_name = Self::get_encoder_name(self.config.codec);
 
         // Find the encoder
@@ -207,8 +249,8 @@ impl SoftwareEncoder {
 
         // Use YUV420P for software encoders (most compatible)
         encoder.set_format(Pixel::YUV420P);
-        encoder.set_time_base(ffmpeg::Rational::new(1, 1000));
-        self.time_base = ffmpeg::Rational::new(1, 1000);
+        encoder.set_time_base(clock::time_base());
+        self.time_base = clock::time_base();
 
         // Set framerate from config
         encoder.set_frame_rate(Some(ffmpeg::Rational::new(
@@ -221,6 +263,7 @@ impl SoftwareEncoder {
 
         // Set max B-frames
         encoder.set_max_b_frames(self.config.b_frames as usize);
+        super::set_latency(&mut encoder, &self.config);
 
         // Build encoder options
         let mut opts = Dictionary::new();
@@ -284,6 +327,8 @@ impl SoftwareEncoder {
         }
 
         // Codec-specific optimizations for AMD
+        let mut x265_params = String::new();
+        let mut svtav1_params = Vec::new();
         match self.config.codec {
             Codec::H264 => {
                 // x264 AMD optimizations
@@ -293,15 +338,18 @@ impl SoftwareEncoder {
             Codec::Hevc => {
                 // x265 AMD optimizations
                 // Use x265-params for specific settings
-                let x265_params = format!(
+                x265_params = format!(
                     "log-level=warning:frame-threads={}:lookahead-slices=4:rc-lookahead=20",
                     thread_count.min(8) // x265 frame-threads max is typically 8-16
                 );
-                opts.set("x265-params", &x265_params);
+                // x265 sizes its pools per NUMA node and ignores affinity
+                if let Some(cpus) = threading::encode_cpus() {
+                    x265_params.push_str(&format!(":pools={}", x265_pools(&cpus)));
+                }
             }
             Codec::Av1 => {
                 // SVT-AV1 is excellent on AMD Zen4/5 with AVX-512
-                opts.set("svtav1-params", "tune=0"); // PSNR tuning
+                svtav1_params = vec!["tune=0".to_string()]; // PSNR tuning
                 // Enable film grain synthesis for better quality
             }
         }
@@ -318,11 +366,39 @@ impl SoftwareEncoder {
                 }
                 Codec::Av1 => {
                     // SVT-AV1 low latency
-                    opts.set("svtav1-params", "rc=1:pred-struct=1");
+                    svtav1_params = vec!["rc=1".to_string(), "pred-struct=1".to_string()];
                 }
             }
         }
 
+        // Split each frame so its parts encode concurrently
+        if self.config.parallel == CpuParallelism::Slices {
+            let slices = self.slice_count();
+            match self.config.codec {
+                Codec::H264 => {
+                    opts.set(
+                        "x264-params",
+                        &format!("sliced-threads=1:slices={}", slices),
+                    );
+                }
+                Codec::Hevc => {
+                    x265_params.push_str(&format!(":slices={}", slices));
+                }
+                Codec::Av1 => {
+                    // log2 tile counts, columns first
+                    let log2 = u32::BITS - (slices - 1).leading_zeros();
+                    svtav1_params.push(format!("tile-columns={}", ((log2 + 1) / 2).min(4)));
+                    svtav1_params.push(format!("tile-rows={}", log2 / 2));
+                }
+            }
+        }
+        if !x265_params.is_empty() {
+            opts.set("x265-params", &x265_params);
+        }
+        if !svtav1_params.is_empty() {
+            opts.set("svtav1-params", &svtav1_params.join(":"));
+        }
+
         // Open encoder
         let opened = encoder
             .open_with(opts)
@@ -331,9 +407,9 @@ impl SoftwareEncoder {
         self.encoder = Some(opened);
         self.input_resolution = Some(Resolution::new(input_width, input_height));
 
-        // Create scaler if input != output resolution or format conversion needed
+        // Scale/convert from the capture's format to YUV420P
         let scaler = Scaler::get(
-            Pixel::NV12, // Input from capture is typically NV12 or BGRA
+            Self::to_ffmpeg_format(input_format),
             input_width,
             input_height,
             Pixel::YUV420P, // Software encoders prefer YUV420P
@@ -382,54 +458,38 @@ impl Encoder for SoftwareEncoder {
         Ok(())
     }
 
-    fn encode(&mut self, frame: &Frame) -> Result<Option<Packet>> {
-        // Initialize encoder on first frame
+    fn prepare(&mut self, input: &PreparedInput) -> Result<()> {
         if self.encoder.is_none() {
-            self.init_encoder(frame.width, frame.height)?;
+            let size = input.resolution;
+            self.init_encoder(size.width, size.height, input.format)?;
+            self.prepared = Some((size, input.format));
         }
+        Ok(())
+    }
 
-        let encoder = self.encoder.as_mut().unwrap();
-        let encode_start = Instant::now();
-
-        // Create FFmpeg video frame
-        let mut video_frame = ffmpeg::frame::Video::new(
-            Self::to_ffmpeg_format(frame.format),
-            frame.width,
-            frame.height,
-        );
-
-        // Copy frame data based on format
-        match frame.format {
-            FrameFormat::Nv12 => {
-                let y_size = (frame.width * frame.height) as usize;
-                let uv_size = y_size / 2;
-                if frame.data.len() >= y_size + uv_size {
-                    video_frame.data_mut(0)[..y_size].copy_from_slice(&frame.data[..y_size]);
-                    video_frame.data_mut(1)[..uv_size]
-                        .copy_from_slice(&frame.data[y_size..y_size + uv_size]);
-                }
-            }
-            FrameFormat::Yuv420p => {
-                let y_size = (frame.width * frame.height) as usize;
-                let uv_size = y_size / 4;
-                if frame.data.len() >= y_size + uv_size * 2 {
-                    video_frame.data_mut(0)[..y_size].copy_from_slice(&frame.data[..y_size]);
-                    video_frame.data_mut(1)[..uv_size]
-                        .copy_from_slice(&frame.data[y_size..y_size + uv_size]);
-                    video_frame.data_mut(2)[..uv_size]
-                        .copy_from_slice(&frame.data[y_size + uv_size..y_size + uv_size * 2]);
-                }
-            }
-            _ => {
-                let plane_size = video_frame.data(0).len().min(frame.data.len());
-                video_frame.data_mut(0)[..plane_size].copy_from_slice(&frame.data[..plane_size]);
+    fn submit(&mut self, frame: &Frame) -> Result<()> {
+        // The encoder opened ahead of time fits frames of one size and
+        // format
+        if let Some(input) = self.prepared.take() {
+            if input != (frame.resolution(), frame.format) {
+                self.close();
             }
         }
 
+        // Initialize encoder on first frame
+        if self.encoder.is_none() {
+            self.init_encoder(frame.width, frame.height, frame.format)?;
+        }
+
+        let submit_start = Instant::now();
+
+        // Reference the pooled frame buffer directly (no copy)
+        let mut video_frame = super::wrap_frame(frame, Self::to_ffmpeg_format(frame.format))?;
+
         video_frame.set_pts(Some(frame.pts));
 
         // Scale/convert to YUV420P for encoding
-        let frame_to_encode = if let Some(ref mut scaler) = self.scaler {
+        let mut frame_to_encode = if let Some(ref mut scaler) = self.scaler {
             let mut scaled = ffmpeg::frame::Video::empty();
             scaler
                 .run(&video_frame, &mut scaled)
@@ -439,51 +499,26 @@ impl Encoder for SoftwareEncoder {
         } else {
             video_frame
         };
+        super::attach_damage_roi(&mut frame_to_encode, frame);
 
         // Send frame to encoder
-        encoder
-            .send_frame(&frame_to_encode)
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send frame: {}", e)))?;
-
-        // Receive encoded packet
-        let mut ffmpeg_packet = ffmpeg::Packet::empty();
-        match encoder.receive_packet(&mut ffmpeg_packet) {
-            Ok(_) => {
-                let encode_time = encode_start.elapsed();
-
-                self.frame_count += 1;
-                self.stats.frames_encoded = self.frame_count;
-                self.stats.bytes_output += ffmpeg_packet.size() as u64;
-
-                let encode_ms = encode_time.as_secs_f64() * 1000.0;
-                self.stats.avg_encode_time_ms =
-                    self.stats.avg_encode_time_ms * 0.95 + encode_ms * 0.05;
-
-                if let Some(start) = self.start_time {
-                    let elapsed = start.elapsed().as_secs_f64();
-                    if elapsed > 0.0 {
-                        self.stats.current_bitrate_kbps =
-                            ((self.stats.bytes_output as f64 * 8.0) / elapsed / 1000.0) as u64;
-                    }
-                }
+        let encoder = self.encoder.as_mut().unwrap();
+        self.packets.send(encoder, &frame_to_encode, submit_start)?;
 
-                let packet = Packet {
-                    data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                    pts: ffmpeg_packet.pts().unwrap_or(0),
-                    dts: ffmpeg_packet.dts().unwrap_or(0),
-                    duration: ffmpeg_packet.duration(),
-                    is_keyframe: ffmpeg_packet.is_key(),
-                    flags: 0,
-                };
+        self.packets.record(&mut self.stats);
+        Ok(())
+    }
 
-                Ok(Some(packet))
-            }
-            Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => Ok(None),
-            Err(e) => Err(Error::EncodingFailed(format!(
-                "Failed to receive packet: {}",
-                e
-            ))),
+    fn receive(&mut self) -> Result<Option<Packet>> {
+        let Some(encoder) = self.encoder.as_mut() else {
+            return Ok(None);
+        };
+        let packet = self.packets.receive(encoder)?;
+        if let Some(packet) = &packet {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
+        Ok(packet)
     }
 
     fn flush(&mut self) -> Result<Vec<Packet>> {
@@ -492,33 +527,11 @@ impl Encoder for SoftwareEncoder {
             None => return Ok(Vec::new()),
         };
 
-        encoder
-            .send_eof()
-            .map_err(|e| Error::EncodingFailed(format!("Failed to send EOF: {}", e)))?;
-
-        let mut packets = Vec::new();
-        loop {
-            let mut ffmpeg_packet = ffmpeg::Packet::empty();
-            match encoder.receive_packet(&mut ffmpeg_packet) {
-                Ok(_) => {
-                    self.stats.bytes_output += ffmpeg_packet.size() as u64;
-                    packets.push(Packet {
-                        data: ffmpeg_packet.data().map(|d| d.to_vec()).unwrap_or_default(),
-                        pts: ffmpeg_packet.pts().unwrap_or(0),
-                        dts: ffmpeg_packet.dts().unwrap_or(0),
-                        duration: ffmpeg_packet.duration(),
-                        is_keyframe: ffmpeg_packet.is_key(),
-                        flags: 0,
-                    });
-                }
-                Err(ffmpeg::Error::Eof) => break,
-                Err(ffmpeg::Error::Other { errno }) if errno == ffmpeg::error::EAGAIN => continue,
-                Err(e) => {
-                    tracing::warn!("Error during flush: {}", e);
-                    break;
-                }
-            }
+        let packets = self.packets.finish(encoder)?;
+        for packet in &packets {
+            self.stats.record_packet(packet, self.start_time);
         }
+        self.packets.record(&mut self.stats);
 
         tracing::info!(
             "Software encoder flushed: {} frames, {} bytes, avg {:.2}ms/frame",
@@ -567,6 +580,23 @@ impl Encoder for SoftwareEncoder {
     }
 
     fn reconfigure(&mut self, config: &EncoderConfig) -> Result<()> {
+        // An encoder opened ahead of time takes any change by reopening on
+        // the first frame
+        if self.prepared.is_some() && !self.config.differs_only_in_bitrate(config) {
+            self.close();
+        }
+
+        // Only libx264 reconfigures a running encoder
+        if let Some(encoder) = self.encoder.as_mut() {
+            if self.config.codec != Codec::H264 {
+                return Err(Error::InvalidEncoderConfig(format!(
+                    "{} cannot change bitrate on an open encoder",
+                    Self::get_encoder_name(self.config.codec)
+                )));
+            }
+            super::check_in_place(&self.config, config)?;
+            super::set_bitrate(encoder, config);
+        }
         self.config = config.clone();
         tracing::info!("Software encoder config updated: {}kbps", config.bitrate_kbps);
         Ok(())
@@ -581,6 +611,20 @@ impl Drop for SoftwareEncoder {
     }
 }
 
+/// x265 `pools` value giving each NUMA node only its share of `cpus`
+/// ("8,-" = eight threads on node 0, none on node 1)
+fn x265_pools(cpus: &CpuSet) -> String {
+    CpuTopology::global()
+        .per_node(cpus)
+        .iter()
+        .map(|&count| match count {
+            0 => "-".to_string(),
+            n => n.to_string(),
+        })
+        .collect::<Vec<_>>()
+        .join(",")
+}
+
 // ============================================================================
 // Software Encoder Detection
 // ============================================================================
@@ -647,7 +691,7 @@ fn detect_amd_cpu() -> (bool, Option<String>) {
 }
 
 /// CPU information
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, serde::Serialize, serde::Deserialize)]
 pub struct CpuInfo {
     pub cores: usize,
     pub is_amd: bool,
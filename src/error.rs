@@ -107,6 +107,13 @@ pub enum Error {
     #[error("Muxer error: {0}")]
     Muxer(String),
 
+    #[error("Replay buffer error: {0}")]
+    Replay(String),
+
+    // Daemon errors
+    #[error("Daemon error: {0}")]
+    Daemon(String),
+
     // General errors
     #[error("Configuration error: {0}")]
     Config(String),
@@ -0,0 +1,526 @@
+//! Hardware device and frame contexts
+//!
+//! Thin RAII wrappers over FFmpeg's hwcontext API (`AVHWDeviceContext`,
+//! `AVHWFramesContext` and hardware `AVFrame`s) so GPU surfaces can move
+//! between capture, processing and the encoders without touching system
+//! memory.
+
+use crate::error::{Error, Result};
+
+use ffmpeg_next as ffmpeg;
+use ffmpeg_next::ffi;
+use ffmpeg_next::format::Pixel;
+
+use std::ffi::CString;
+use std::ptr;
+
+// AV_HWFRAME_MAP_* flags (anonymous enum in hwcontext.h)
+pub(crate) const HWFRAME_MAP_READ: i32 = 1 << 0;
+
+/// Hardware device type
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum HwDeviceType {
+    /// NVIDIA CUDA (NVENC input surfaces)
+    Cuda,
+    /// Vulkan (DMA-BUF import, scale_vulkan)
+    Vulkan,
+    /// DRM PRIME (raw DMA-BUF descriptors)
+    Drm,
+    /// VA-API (Intel/AMD)
+    Vaapi,
+    /// Intel Quick Sync
+    Qsv,
+}
+
+impl HwDeviceType {
+    fn to_ffmpeg(self) -> ffi::AVHWDeviceType {
+        match self {
+            HwDeviceType::Cuda => ffi::AVHWDeviceType::AV_HWDEVICE_TYPE_CUDA,
+            HwDeviceType::Vulkan => ffi::AVHWDeviceType::AV_HWDEVICE_TYPE_VULKAN,
+            HwDeviceType::Drm => ffi::AVHWDeviceType::AV_HWDEVICE_TYPE_DRM,
+            HwDeviceType::Vaapi => ffi::AVHWDeviceType::AV_HWDEVICE_TYPE_VAAPI,
+            HwDeviceType::Qsv => ffi::AVHWDeviceType::AV_HWDEVICE_TYPE_QSV,
+        }
+    }
+
+    /// Pixel format of frames living on this device
+    pub fn hw_format(self) -> Pixel {
+        match self {
+            HwDeviceType::Cuda => Pixel::CUDA,
+            HwDeviceType::Vulkan => Pixel::VULKAN,
+            HwDeviceType::Drm => Pixel::DRM_PRIME,
+            HwDeviceType::Vaapi => Pixel::VAAPI,
+            HwDeviceType::Qsv => Pixel::QSV,
+        }
+    }
+
+    /// Short name (as used by FFmpeg's `-init_hw_device`)
+    pub fn name(self) -> &'static str {
+        match self {
+            HwDeviceType::Cuda => "cuda",
+            HwDeviceType::Vulkan => "vulkan",
+            HwDeviceType::Drm => "drm",
+            HwDeviceType::Vaapi => "vaapi",
+            HwDeviceType::Qsv => "qsv",
+        }
+    }
+}
+
+impl std::fmt::Display for HwDeviceType {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}", self.name())
+    }
+}
+
+/// First DRM render node (`/dev/dri/renderD*`)
+pub fn find_render_node() -> Option<String> {
+    let mut nodes: Vec<String> = std::fs::read_dir("/dev/dri")
+        .ok()?
+        .filter_map(|e| e.ok())
+        .map(|e| e.path().to_string_lossy().into_owned())
+        .filter(|p| p.contains("renderD"))
+        .collect();
+    nodes.sort();
+    nodes.into_iter().next()
+}
+
+fn av_error(what: &str, ret: i32) -> Error {
+    Error::FFmpeg(format!("{}: {}", what, ffmpeg::Error::from(ret)))
+}
+
+/// Reference to an FFmpeg hardware device context
+pub struct HwDevice {
+    ptr: *mut ffi::AVBufferRef,
+    kind: HwDeviceType,
+}
+
+// AVBufferRef refcounting is atomic and device contexts are thread-safe
+unsafe impl Send for HwDevice {}
+unsafe impl Sync for HwDevice {}
+
+impl HwDevice {
+    /// Open a device (`device` is backend specific, e.g. a CUDA ordinal or
+    /// a DRM render node path; `None` picks the default)
+    pub fn create(kind: HwDeviceType, device: Option<&str>) -> Result<Self> {
+        ffmpeg::init().map_err(|e| Error::FFmpeg(e.to_string()))?;
+
+        let device = device
+            .map(|d| CString::new(d).map_err(|e| Error::Internal(e.to_string())))
+            .transpose()?;
+
+        let mut ptr = ptr::null_mut();
+        let ret = unsafe {
+            ffi::av_hwdevice_ctx_create(
+                &mut ptr,
+                kind.to_ffmpeg(),
+                device.as_ref().map(|d| d.as_ptr()).unwrap_or(ptr::null()),
+                ptr::null_mut(),
+                0,
+            )
+        };
+        if ret < 0 || ptr.is_null() {
+            return Err(av_error(&format!("Failed to open {} device", kind), ret));
+        }
+
+        Ok(Self { ptr, kind })
+    }
+
+    /// Derive a device of another type on the same physical GPU
+    pub fn derive(&self, kind: HwDeviceType) -> Result<Self> {
+        let mut ptr = ptr::null_mut();
+        let ret =
+            unsafe { ffi::av_hwdevice_ctx_create_derived(&mut ptr, kind.to_ffmpeg(), self.ptr, 0) };
+        if ret < 0 || ptr.is_null() {
+            return Err(av_error(
+                &format!("Failed to derive {} device from {}", kind, self.kind),
+                ret,
+            ));
+        }
+
+        Ok(Self { ptr, kind })
+    }
+
+    /// Device type
+    pub fn kind(&self) -> HwDeviceType {
+        self.kind
+    }
+
+    /// Raw `AVBufferRef` (borrowed)
+    pub fn as_ptr(&self) -> *mut ffi::AVBufferRef {
+        self.ptr
+    }
+}
+
+impl Clone for HwDevice {
+    fn clone(&self) -> Self {
+        let ptr = unsafe { ffi::av_buffer_ref(self.ptr) };
+        assert!(!ptr.is_null(), "av_buffer_ref failed");
+        Self {
+            ptr,
+            kind: self.kind,
+        }
+    }
+}
+
+impl Drop for HwDevice {
+    fn drop(&mut self) {
+        unsafe { ffi::av_buffer_unref(&mut self.ptr) };
+    }
+}
+
+impl std::fmt::Debug for HwDevice {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("HwDevice")
+            .field("kind", &self.kind)
+            .finish()
+    }
+}
+
+/// Pool of hardware frames with a fixed format and size
+pub struct HwFramesContext {
+    ptr: *mut ffi::AVBufferRef,
+    kind: HwDeviceType,
+    sw_format: Pixel,
+    width: u32,
+    height: u32,
+}
+
+unsafe impl Send for HwFramesContext {}
+unsafe impl Sync for HwFramesContext {}
+
+impl HwFramesContext {
+    /// Create a frames context on `device`
+    ///
+    /// `pool_size` of 0 lets FFmpeg grow the pool on demand (not supported
+    /// by every backend).
+    pub fn new(
+        device: &HwDevice,
+        sw_format: Pixel,
+        width: u32,
+        height: u32,
+        pool_size: u32,
+    ) -> Result<Self> {
+        unsafe {
+            let mut ptr = ffi::av_hwframe_ctx_alloc(device.as_ptr());
+            if ptr.is_null() {
+                return Err(Error::FFmpeg(format!(
+                    "Failed to allocate {} frames context",
+                    device.kind()
+                )));
+            }
+
+            let frames = (*ptr).data as *mut ffi::AVHWFramesContext;
+            (*frames).format = device.kind().hw_format().into();
+            (*frames).sw_format = sw_format.into();
+            (*frames).width = width as i32;
+            (*frames).height = height as i32;
+            (*frames).initial_pool_size = pool_size as i32;
+
+            let ret = ffi::av_hwframe_ctx_init(ptr);
+            if ret < 0 {
+                ffi::av_buffer_unref(&mut ptr);
+                return Err(av_error(
+                    &format!(
+                        "Failed to init {} frames ({:?} {}x{})",
+                        device.kind(),
+                        sw_format,
+                        width,
+                        height
+                    ),
+                    ret,
+                ));
+            }
+
+            Ok(Self {
+                ptr,
+                kind: device.kind(),
+                sw_format,
+                width,
+                height,
+            })
+        }
+    }
+
+    /// Reference an existing frames context (e.g. one a filter created)
+    ///
+    /// # Safety
+    /// `ptr` must reference an initialised `AVHWFramesContext` on a `kind`
+    /// device.
+    pub unsafe fn from_ref(ptr: *mut ffi::AVBufferRef, kind: HwDeviceType) -> Result<Self> {
+        let ptr = ffi::av_buffer_ref(ptr);
+        if ptr.is_null() {
+            return Err(Error::FFmpeg("Failed to reference frames context".into()));
+        }
+        let frames = (*ptr).data as *const ffi::AVHWFramesContext;
+        Ok(Self {
+            ptr,
+            kind,
+            sw_format: Pixel::from((*frames).sw_format),
+            width: (*frames).width as u32,
+            height: (*frames).height as u32,
+        })
+    }
+
+    /// Take a frame from the pool
+    pub fn get_buffer(&self) -> Result<HwFrame> {
+        let mut frame = HwFrame::alloc()?;
+        let ret = unsafe { ffi::av_hwframe_get_buffer(self.ptr, frame.as_mut_ptr(), 0) };
+        if ret < 0 {
+            return Err(av_error(&format!("Failed to get {} frame", self.kind), ret));
+        }
+        Ok(frame)
+    }
+
+    /// Upload a system-memory frame into a new frame from the pool
+    pub fn upload(&self, src: &ffmpeg::frame::Video) -> Result<HwFrame> {
+        let mut dst = self.get_buffer()?;
+        let ret = unsafe { ffi::av_hwframe_transfer_data(dst.as_mut_ptr(), src.as_ptr(), 0) };
+        if ret < 0 {
+            return Err(av_error(
+                &format!("Failed to upload frame to {}", self.kind),
+                ret,
+            ));
+        }
+        dst.set_pts(src.pts().unwrap_or(0));
+        Ok(dst)
+    }
+
+    /// Does this context hold frames of the given layout?
+    pub fn matches(&self, sw_format: Pixel, width: u32, height: u32) -> bool {
+        self.sw_format == sw_format && self.width == width && self.height == height
+    }
+
+    /// Device type of the frames
+    pub fn kind(&self) -> HwDeviceType {
+        self.kind
+    }
+
+    /// Underlying software pixel format
+    pub fn sw_format(&self) -> Pixel {
+        self.sw_format
+    }
+
+    pub fn width(&self) -> u32 {
+        self.width
+    }
+
+    pub fn height(&self) -> u32 {
+        self.height
+    }
+
+    /// Raw `AVBufferRef` (borrowed)
+    pub fn as_ptr(&self) -> *mut ffi::AVBufferRef {
+        self.ptr
+    }
+}
+
+impl Clone for HwFramesContext {
+    fn clone(&self) -> Self {
+        let ptr = unsafe { ffi::av_buffer_ref(self.ptr) };
+        assert!(!ptr.is_null(), "av_buffer_ref failed");
+        Self {
+            ptr,
+            kind: self.kind,
+            sw_format: self.sw_format,
+            width: self.width,
+            height: self.height,
+        }
+    }
+}
+
+impl Drop for HwFramesContext {
+    fn drop(&mut self) {
+        unsafe { ffi::av_buffer_unref(&mut self.ptr) };
+    }
+}
+
+impl std::fmt::Debug for HwFramesContext {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("HwFramesContext")
+            .field("kind", &self.kind)
+            .field("sw_format", &self.sw_format)
+            .field("width", &self.width)
+            .field("height", &self.height)
+            .finish()
+    }
+}
+
+/// Owned `AVFrame`, normally referencing a GPU surface
+pub struct HwFrame {
+    ptr: *mut ffi::AVFrame,
+}
+
+// Hardware frames are refcounted surfaces; moving the handle between
+// threads is fine as long as only one thread uses it at a time.
+unsafe impl Send for HwFrame {}
+
+impl HwFrame {
+    /// Allocate an empty frame
+    pub fn alloc() -> Result<Self> {
+        let ptr = unsafe { ffi::av_frame_alloc() };
+        if ptr.is_null() {
+            return Err(Error::FFmpeg("Failed to allocate AVFrame".into()));
+        }
+        Ok(Self { ptr })
+    }
+
+    /// Take ownership of a raw frame
+    ///
+    /// # Safety
+    /// `ptr` must be a valid frame from `av_frame_alloc` that nothing else
+    /// frees.
+    pub unsafe fn from_raw(ptr: *mut ffi::AVFrame) -> Self {
+        Self { ptr }
+    }
+
+    /// Give up ownership of the raw frame
+    pub fn into_raw(self) -> *mut ffi::AVFrame {
+        let ptr = self.ptr;
+        std::mem::forget(self);
+        ptr
+    }
+
+    /// Convert into an ffmpeg-next frame (e.g. to hand to an encoder)
+    pub fn into_video(self) -> ffmpeg::frame::Video {
+        unsafe { ffmpeg::frame::Video::wrap(self.into_raw()) }
+    }
+
+    pub fn as_ptr(&self) -> *const ffi::AVFrame {
+        self.ptr
+    }
+
+    pub fn as_mut_ptr(&mut self) -> *mut ffi::AVFrame {
+        self.ptr
+    }
+
+    pub fn width(&self) -> u32 {
+        unsafe { (*self.ptr).width as u32 }
+    }
+
+    pub fn height(&self) -> u32 {
+        unsafe { (*self.ptr).height as u32 }
+    }
+
+    /// Pixel format (`CUDA`, `VULKAN`, `DRM_PRIME`, ...)
+    pub fn format(&self) -> Pixel {
+        unsafe {
+            Pixel::from(std::mem::transmute::<i32, ffi::AVPixelFormat>(
+                (*self.ptr).format,
+            ))
+        }
+    }
+
+    pub fn pts(&self) -> i64 {
+        unsafe { (*self.ptr).pts }
+    }
+
+    pub fn set_pts(&mut self, pts: i64) {
+        unsafe { (*self.ptr).pts = pts };
+    }
+
+    /// Copy into a new frame from `frames` (GPU to GPU where the backends
+    /// support interop, e.g. Vulkan -> CUDA)
+    pub fn transfer_to(&self, frames: &HwFramesContext) -> Result<HwFrame> {
+        let mut dst = frames.get_buffer()?;
+        let ret = unsafe { ffi::av_hwframe_transfer_data(dst.ptr, self.ptr, 0) };
+        if ret < 0 {
+            return Err(av_error(
+                &format!(
+                    "Failed to transfer {:?} frame to {}",
+                    self.format(),
+                    frames.kind()
+                ),
+                ret,
+            ));
+        }
+        dst.set_pts(self.pts());
+        Ok(dst)
+    }
+
+    /// Map into a frame of `frames` without copying
+    pub fn map_to(&self, frames: &HwFramesContext, flags: i32) -> Result<HwFrame> {
+        let mut dst = HwFrame::alloc()?;
+        unsafe {
+            (*dst.ptr).hw_frames_ctx = ffi::av_buffer_ref(frames.as_ptr());
+            (*dst.ptr).format = ffi::AVPixelFormat::from(frames.kind().hw_format()) as i32;
+            let ret = ffi::av_hwframe_map(dst.ptr, self.ptr, flags);
+            if ret < 0 {
+                return Err(av_error(
+                    &format!(
+                        "Failed to map {:?} frame to {}",
+                        self.format(),
+                        frames.kind()
+                    ),
+                    ret,
+                ));
+            }
+        }
+        dst.set_pts(self.pts());
+        Ok(dst)
+    }
+
+    /// Map into system memory (`dst` gets the software format)
+    pub fn map_to_system(&self, flags: i32) -> Result<ffmpeg::frame::Video> {
+        let mut dst = ffmpeg::frame::Video::empty();
+        let ret = unsafe { ffi::av_hwframe_map(dst.as_mut_ptr(), self.ptr, flags) };
+        if ret < 0 {
+            return Err(av_error(
+                &format!("Failed to map {:?} frame to system memory", self.format()),
+                ret,
+            ));
+        }
+        Ok(dst)
+    }
+
+    /// Keep `other` alive for as long as this frame (or any reference to
+    /// it, e.g. inside an encoder) exists
+    pub fn attach(&mut self, other: HwFrame) -> Result<()> {
+        unsafe {
+            let raw = other.into_raw();
+            let buf = ffi::av_buffer_create(
+                raw as *mut u8,
+                std::mem::size_of::<ffi::AVFrame>(),
+                Some(free_attached_frame),
+                ptr::null_mut(),
+                0,
+            );
+            if buf.is_null() {
+                drop(HwFrame::from_raw(raw));
+                return Err(Error::FFmpeg("Failed to attach frame".into()));
+            }
+            ffi::av_buffer_unref(&mut (*self.ptr).opaque_ref);
+            (*self.ptr).opaque_ref = buf;
+        }
+        Ok(())
+    }
+}
+
+unsafe extern "C" fn free_attached_frame(_opaque: *mut std::ffi::c_void, data: *mut u8) {
+    let mut frame = data as *mut ffi::AVFrame;
+    ffi::av_frame_free(&mut frame);
+}
+
+impl Clone for HwFrame {
+    fn clone(&self) -> Self {
+        let ptr = unsafe { ffi::av_frame_clone(self.ptr) };
+        assert!(!ptr.is_null(), "av_frame_clone failed");
+        Self { ptr }
+    }
+}
+
+impl Drop for HwFrame {
+    fn drop(&mut self) {
+        unsafe { ffi::av_frame_free(&mut self.ptr) };
+    }
+}
+
+impl std::fmt::Debug for HwFrame {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("HwFrame")
+            .field("format", &self.format())
+            .field("width", &self.width())
+            .field("height", &self.height())
+            .field("pts", &self.pts())
+            .finish()
+    }
+}
@@ -0,0 +1,494 @@
+//! Encoder ladder (ABR renditions)
+//!
+//! One capture feeds every rendition. Each captured frame runs through a
+//! shared downscale tree: a rendition is scaled from the smallest rendition
+//! already produced for that frame that is at least its size, so 1080p60 +
+//! 720p30 + 480p30 costs one capture, one 1080p pass and two cheap
+//! downscales. Each rendition then encodes on its own thread (one NVENC
+//! session or CPU encoder each) and writes to its own output, which may be
+//! an [`Output::Multiple`].
+//!
+//! Video only; audio is not muxed into ladder outputs.
+
+use crate::capture::DmaBufImporter;
+use crate::clock;
+use crate::config::{CaptureConfig, EncoderConfig, Preset};
+use crate::error::{Error, Result};
+use crate::metrics::{Metrics, MetricsSnapshot, Stage};
+use crate::output::{self, Output};
+use crate::pipeline::{self, EncoderControl, EncoderEvent};
+use crate::pool::FramePool;
+use crate::processing::ProcessingGraph;
+use crate::queue::{self, QueueReceiver, QueueSender};
+use crate::threading::{self, ThreadRole};
+use crate::types::{CodecParams, Frame, FrameFormat, Framerate, Resolution};
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// One output of a ladder
+#[derive(Debug, Clone)]
+pub struct Rendition {
+    /// Label used in logs
+    pub name: String,
+    pub encoder: EncoderConfig,
+    pub output: Output,
+}
+
+impl Rendition {
+    pub fn new(name: impl Into<String>, encoder: EncoderConfig, output: Output) -> Self {
+        Self {
+            name: name.into(),
+            encoder,
+            output,
+        }
+    }
+
+    /// Rendition from a preset, named after it
+    pub fn from_preset(preset: Preset, output: Output) -> Self {
+        Self::new(
+            format!("{:?}", preset),
+            EncoderConfig::from_preset(preset),
+            output,
+        )
+    }
+}
+
+/// Multi-rendition pipeline sharing capture and scaling
+pub struct Ladder {
+    capture_config: CaptureConfig,
+    renditions: Vec<Rendition>,
+    running: Arc<AtomicBool>,
+    /// Capture and scale tree
+    metrics: Arc<Metrics>,
+    /// Encode and output, per rendition
+    rendition_metrics: Vec<Arc<Metrics>>,
+    /// Encoder control channels of the running renditions
+    controls: parking_lot::Mutex<Vec<EncoderControl>>,
+}
+
+impl Ladder {
+    pub fn new(capture: CaptureConfig, renditions: Vec<Rendition>) -> Result<Self> {
+        if renditions.is_empty() {
+            return Err(Error::Pipeline(
+                "Ladder needs at least one rendition".into(),
+            ));
+        }
+
+        let rendition_metrics = renditions
+            .iter()
+            .map(|_| Arc::new(Metrics::new()))
+            .collect();
+        Ok(Self {
+            capture_config: capture,
+            renditions,
+            running: Arc::new(AtomicBool::new(false)),
+            metrics: Arc::new(Metrics::new()),
+            rendition_metrics,
+            controls: parking_lot::Mutex::new(Vec::new()),
+        })
+    }
+
+    pub fn renditions(&self) -> &[Rendition] {
+        &self.renditions
+    }
+
+    /// Start capture, the scale tree and one encoder + output per rendition
+    pub async fn start(&self) -> Result<()> {
+        if self.running.load(Ordering::SeqCst) {
+            return Err(Error::PipelineAlreadyRunning);
+        }
+        self.running.store(true, Ordering::SeqCst);
+        tracing::info!("Ladder starting with {} renditions", self.renditions.len());
+
+        // A slow rendition drops its own frames instead of holding up the
+        // tree (and with it every other rendition)
+        let rendition_queue = self
+            .capture_config
+            .queue
+            .with_policy(self.capture_config.queue.policy.non_blocking());
+
+        let mut senders = Vec::with_capacity(self.renditions.len());
+        let mut controls = Vec::with_capacity(self.renditions.len());
+        for (rendition, metrics) in self.renditions.iter().zip(&self.rendition_metrics) {
+            let (frame_tx, frame_rx) = queue::frame_queue::<Frame>(rendition_queue);
+            let (packet_tx, packet_rx) = tokio::sync::mpsc::channel::<EncoderEvent>(8);
+            let (codec_params_tx, codec_params_rx) =
+                tokio::sync::oneshot::channel::<Option<CodecParams>>();
+            let (control, control_rx) = EncoderControl::channel(rendition.encoder.clone());
+            senders.push(frame_tx);
+            controls.push(control);
+
+            let encoder_config = rendition.encoder.clone();
+            let encoder_running = self.running.clone();
+            let encoder_metrics = metrics.clone();
+            std::thread::spawn(move || {
+                threading::enter(ThreadRole::Encode);
+                pipeline::run_encoder(
+                    encoder_config,
+                    // The tree hands every encoder system memory frames
+                    None,
+                    frame_rx,
+                    packet_tx,
+                    codec_params_tx,
+                    control_rx,
+                    encoder_running,
+                    encoder_metrics,
+                )
+            });
+
+            tokio::spawn(run_output(
+                rendition.name.clone(),
+                rendition.output.clone(),
+                codec_params_rx,
+                packet_rx,
+                metrics.clone(),
+            ));
+        }
+
+        *self.controls.lock() = controls;
+
+        let (frame_tx, frame_rx) = queue::frame_queue::<Frame>(self.capture_config.queue);
+        let encoders: Vec<EncoderConfig> =
+            self.renditions.iter().map(|r| r.encoder.clone()).collect();
+        let source_rate = self.capture_config.framerate;
+        let tree_metrics = self.metrics.clone();
+        std::thread::spawn(move || {
+            threading::enter(ThreadRole::Process);
+            let tree = ScaleTree::new(&encoders, source_rate);
+            run_tree(tree, frame_rx, senders, tree_metrics);
+        });
+
+        tokio::spawn(pipeline::run_capture(
+            self.capture_config.clone(),
+            frame_tx,
+            self.running.clone(),
+            self.metrics.clone(),
+            |_| {},
+        ));
+
+        Ok(())
+    }
+
+    /// Stop capture; the tree, encoders and outputs drain and finish
+    pub async fn stop(&self) -> Result<()> {
+        if !self.running.load(Ordering::SeqCst) {
+            return Ok(());
+        }
+
+        self.running.store(false, Ordering::SeqCst);
+        tracing::info!("Ladder stop requested");
+
+        // Give time for cleanup
+        tokio::time::sleep(tokio::time::Duration::from_millis(200)).await;
+
+        Ok(())
+    }
+
+    pub fn is_running(&self) -> bool {
+        self.running.load(Ordering::SeqCst)
+    }
+
+    /// Capture and scale-tree metrics
+    pub fn metrics(&self) -> MetricsSnapshot {
+        self.metrics.snapshot()
+    }
+
+    /// Encode and output metrics of rendition `index`
+    pub fn rendition_metrics(&self, index: usize) -> Option<MetricsSnapshot> {
+        self.rendition_metrics.get(index).map(|m| m.snapshot())
+    }
+
+    /// Handle for reconfiguring the encoder of rendition `index` while the
+    /// ladder runs
+    ///
+    /// The scale tree keeps producing the original rendition size; a new
+    /// resolution is scaled again on the encoder thread.
+    pub fn rendition_control(&self, index: usize) -> Option<EncoderControl> {
+        if !self.is_running() {
+            return None;
+        }
+        self.controls.lock().get(index).cloned()
+    }
+}
+
+/// Scale-tree thread: build every due rendition of each frame and hand it
+/// to that rendition's encoder, keeping the capture stamp
+fn run_tree(
+    mut tree: ScaleTree,
+    frame_rx: QueueReceiver<Frame>,
+    senders: Vec<QueueSender<Frame>>,
+    metrics: Arc<Metrics>,
+) {
+    let mut dmabuf_importer: Option<DmaBufImporter> = None;
+
+    loop {
+        let received = match frame_rx.recv_timeout(Duration::from_millis(100)) {
+            Ok(received) => received,
+            Err(crossbeam_channel::RecvTimeoutError::Timeout) => continue,
+            Err(crossbeam_channel::RecvTimeoutError::Disconnected) => break,
+        };
+        let (mut frame, captured) = (received.item, received.queued_at);
+        if received.stale > 0 {
+            metrics
+                .frames_dropped
+                .fetch_add(received.stale as u64, Ordering::Relaxed);
+        }
+        metrics.record(Stage::Queue, captured.elapsed());
+        metrics.frame_queue.set(frame_rx.len());
+        // Renditions are stamped with the capture time, not this queue's
+        let captured = clock::PipelineClock::global().capture_instant(frame.pts, captured);
+
+        // The tree scales on the CPU
+        if let Some(dmabuf) = frame.dmabuf.clone() {
+            let importer = dmabuf_importer.get_or_insert_with(Default::default);
+            match importer.download(&dmabuf, FramePool::global()) {
+                Ok(f) => frame = f,
+                Err(e) => {
+                    tracing::error!("DMA-BUF download failed: {}", e);
+                    metrics.frames_dropped.fetch_add(1, Ordering::Relaxed);
+                    continue;
+                }
+            }
+        }
+
+        let start = Instant::now();
+        let outputs = tree.process(&frame);
+        metrics.record(Stage::Process, start.elapsed());
+
+        for (index, output) in outputs.into_iter().enumerate() {
+            match output {
+                Some(Ok(frame)) => {
+                    // Non-blocking policy: Full never comes back
+                    let _ = senders[index].push_at(frame, captured);
+                }
+                Some(Err(e)) => {
+                    tracing::error!("Rendition {} processing error: {}", index, e);
+                }
+                None => {}
+            }
+        }
+    }
+
+    tracing::info!("Scale tree stopped");
+}
+
+/// Output task of one rendition
+async fn run_output(
+    name: String,
+    config: Output,
+    codec_params_rx: tokio::sync::oneshot::Receiver<Option<CodecParams>>,
+    mut packet_rx: tokio::sync::mpsc::Receiver<EncoderEvent>,
+    metrics: Arc<Metrics>,
+) {
+    let params = codec_params_rx.await.ok().flatten();
+    if params.is_none() {
+        tracing::warn!("Rendition {}: no codec params available", name);
+    }
+
+    let mut output = match output::create_output(config).await {
+        Ok(o) => o,
+        Err(e) => {
+            tracing::error!("Rendition {}: failed to create output: {}", name, e);
+            return;
+        }
+    };
+    output.set_metrics(metrics.clone());
+    if let Err(e) = output.init_with_codec(params.as_ref()).await {
+        tracing::error!("Rendition {}: failed to init output: {}", name, e);
+        return;
+    }
+
+    while let Some(event) = packet_rx.recv().await {
+        metrics.packet_queue.set(packet_rx.len());
+        let (packet, captured) = match event {
+            EncoderEvent::Packet(packet, captured) => (packet, captured),
+            EncoderEvent::CodecChanged(params) => {
+                if let Err(e) = output.update_codec(params.as_ref()).await {
+                    tracing::error!("Rendition {}: output codec update failed: {}", name, e);
+                }
+                continue;
+            }
+        };
+        metrics.frames_encoded.fetch_add(1, Ordering::Relaxed);
+        metrics
+            .bytes_written
+            .fetch_add(packet.size() as u64, Ordering::Relaxed);
+
+        let start = Instant::now();
+        if let Err(e) = output.write(&packet).await {
+            tracing::error!("Rendition {} output error: {}", name, e);
+        }
+        metrics.record(Stage::Write, start.elapsed());
+        if let Some(captured) = captured {
+            metrics.record(Stage::GlassToWire, captured.elapsed());
+        }
+    }
+
+    if let Err(e) = output.finish().await {
+        tracing::error!("Rendition {}: failed to finish output: {}", name, e);
+    }
+}
+
+/// Downscale tree over a set of renditions
+struct ScaleTree {
+    nodes: Vec<TreeNode>,
+}
+
+struct TreeNode {
+    graph: ProcessingGraph,
+    pacer: FramePacer,
+}
+
+impl ScaleTree {
+    fn new(encoders: &[EncoderConfig], source_rate: Framerate) -> Self {
+        let nodes = encoders
+            .iter()
+            .map(|config| TreeNode {
+                graph: ProcessingGraph::from_config(config),
+                pacer: FramePacer::new(source_rate, config.framerate),
+            })
+            .collect();
+        Self { nodes }
+    }
+
+    /// Frames of the renditions due for `frame`, indexed like the
+    /// renditions (None = skipped by its framerate)
+    fn process(&mut self, frame: &Frame) -> Vec<Option<Result<Frame>>> {
+        let input = frame.resolution();
+        let due: Vec<bool> = self.nodes.iter_mut().map(|n| n.pacer.tick()).collect();
+
+        // Largest first, so every rendition can be scaled from a bigger one
+        let mut order: Vec<usize> = (0..self.nodes.len()).filter(|&i| due[i]).collect();
+        order.sort_by_key(|&i| {
+            std::cmp::Reverse(area(self.nodes[i].graph.resolution().unwrap_or(input)))
+        });
+
+        let mut outputs: Vec<Option<Result<Frame>>> = std::iter::repeat_with(|| None)
+            .take(self.nodes.len())
+            .collect();
+        let mut built: Vec<(usize, Resolution, FrameFormat)> = Vec::new();
+
+        for index in order {
+            let node = &mut self.nodes[index];
+            let target = node.graph.resolution().unwrap_or(input);
+            let candidates: Vec<(Resolution, FrameFormat)> = built
+                .iter()
+                .map(|&(_, res, format)| (res, format))
+                .collect();
+
+            let result = match node
+                .graph
+                .format()
+                .and_then(|format| pick_source(&candidates, target, format))
+            {
+                Some(pick) => {
+                    let parent = built[pick].0;
+                    match &outputs[parent] {
+                        Some(Ok(source)) => node.graph.process(source),
+                        _ => unreachable!("only built frames are candidates"),
+                    }
+                }
+                None => node.graph.process(frame),
+            };
+
+            if let Ok(out) = &result {
+                built.push((index, out.resolution(), out.format));
+            }
+            outputs[index] = Some(result);
+        }
+
+        outputs
+    }
+}
+
+fn area(resolution: Resolution) -> u64 {
+    resolution.width as u64 * resolution.height as u64
+}
+
+/// Smallest candidate in `format` that covers `target` in both dimensions
+fn pick_source(
+    candidates: &[(Resolution, FrameFormat)],
+    target: Resolution,
+    format: FrameFormat,
+) -> Option<usize> {
+    candidates
+        .iter()
+        .enumerate()
+        .filter(|(_, (res, f))| {
+            *f == format && res.width >= target.width && res.height >= target.height
+        })
+        .min_by_key(|(_, (res, _))| area(*res))
+        .map(|(i, _)| i)
+}
+
+/// Decimates a source framerate to a rendition's
+struct FramePacer {
+    /// Output frames per source frame (capped at 1)
+    step: f64,
+    credit: f64,
+}
+
+impl FramePacer {
+    fn new(source: Framerate, target: Framerate) -> Self {
+        let source = source.as_f64();
+        let step = if source > 0.0 {
+            (target.as_f64() / source).min(1.0)
+        } else {
+            1.0
+        };
+        // The first frame is always due
+        Self { step, credit: 1.0 }
+    }
+
+    /// Is the next source frame due for this rendition?
+    fn tick(&mut self) -> bool {
+        if self.credit >= 1.0 - 1e-9 {
+            self.credit -= 1.0;
+            self.credit += self.step;
+            true
+        } else {
+            self.credit += self.step;
+            false
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_pick_source() {
+        let built = [
+            (Resolution::FHD_1080P, FrameFormat::Nv12),
+            (Resolution::HD_720P, FrameFormat::Nv12),
+            (Resolution::HD_720P, FrameFormat::P010),
+        ];
+        let sd = Resolution::new(854, 480);
+        assert_eq!(pick_source(&built, sd, FrameFormat::Nv12), Some(1));
+        assert_eq!(
+            pick_source(&built, Resolution::HD_720P, FrameFormat::P010),
+            Some(2)
+        );
+        assert_eq!(
+            pick_source(&built, Resolution::FHD_1080P, FrameFormat::P010),
+            None
+        );
+        assert_eq!(pick_source(&[], sd, FrameFormat::Nv12), None);
+    }
+
+    #[test]
+    fn test_frame_pacer() {
+        let mut half = FramePacer::new(Framerate::FPS_60, Framerate::FPS_30);
+        let due: Vec<bool> = (0..6).map(|_| half.tick()).collect();
+        assert_eq!(due, [true, false, true, false, true, false]);
+
+        let mut full = FramePacer::new(Framerate::FPS_60, Framerate::FPS_120);
+        assert!((0..10).all(|_| full.tick()));
+
+        let mut third = FramePacer::new(Framerate::new(90, 1), Framerate::FPS_30);
+        assert_eq!((0..90).filter(|_| third.tick()).count(), 30);
+    }
+}
@@ -28,24 +28,40 @@
 //! }
 //! ```
 
+pub mod abr;
 pub mod audio;
 pub mod capture;
+pub mod clock;
 pub mod config;
+pub mod daemon;
 pub mod encode;
 pub mod error;
+pub mod hwaccel;
+pub mod ladder;
+pub mod metrics;
 pub mod output;
 pub mod pipeline;
+pub mod pool;
 pub mod processing;
+pub mod queue;
+pub mod threading;
 pub mod types;
 
 // Re-exports for convenience
-pub use config::{CaptureConfig, EncoderConfig, Preset};
+pub use abr::AbrConfig;
+pub use clock::PipelineClock;
+pub use config::{CaptureConfig, EncoderConfig, Preset, SceneConfig, SceneLayer, ThreadingConfig};
 pub use encode::Codec;
 pub use error::{Error, Result};
-pub use output::{AvMuxer, Container, MuxerPacket, Output, StreamType};
-pub use pipeline::{AudioConfig, Pipeline, PipelineBuilder};
+pub use ladder::{Ladder, Rendition};
+pub use metrics::{MetricsSnapshot, Stage};
+pub use output::{
+    AvMuxer, Container, MuxerPacket, Output, ReplayConfig, ReplayHandle, Segmentation, StreamType,
+};
+pub use pipeline::{AudioConfig, EncoderControl, Pipeline, PipelineBuilder};
+pub use pool::{FrameBuffer, FramePool};
 pub use processing::{HdrConfig, Hdr10Metadata, ContentLightLevel, TransferFunction, ColorPrimaries};
-pub use types::{Frame, FrameFormat, Resolution};
+pub use types::{Frame, FrameFormat, Packet, PacketData, Resolution};
 
 /// Library version
 pub const VERSION: &str = env!("CARGO_PKG_VERSION");
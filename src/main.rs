@@ -2,14 +2,23 @@
 //!
 //! Command-line interface for testing and using GhostStream.
 
-use clap::{Parser, Subcommand, ValueEnum};
+use clap::{Args, Parser, Subcommand, ValueEnum};
 use ghoststream::{
-    config::{EncoderConfig, Preset},
+    capture::TestPattern,
+    config::{
+        CaptureConfig, DaemonConfig, EncoderConfig, Preset, SyntheticConfig, ThreadingConfig,
+    },
+    daemon::Daemon,
     encode::{get_info, Codec, EncoderBackend},
     output::{Container, Output},
-    PipelineBuilder,
+    threading, FrameFormat, Pipeline, PipelineBuilder, Resolution, Stage,
 };
 
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
 /// Encoder backend for CLI
 #[derive(Debug, Clone, Copy, ValueEnum, Default)]
 enum Backend {
@@ -45,12 +54,26 @@ impl From<Backend> for EncoderBackend {
 struct Cli {
     #[command(subcommand)]
     command: Commands,
+
+    /// Pin capture, encode and I/O threads to separate cores (CCD/L3 and
+    /// P-core aware)
+    #[arg(long, global = true)]
+    pin_threads: bool,
+
+    /// Run capture and audio threads SCHED_FIFO (directly or via rtkit)
+    #[arg(long, global = true)]
+    realtime: bool,
 }
 
 #[derive(Subcommand)]
 enum Commands {
     /// Show system information and encoder capabilities
-    Info,
+    Info {
+        /// Probe the hardware again instead of using this boot's cached
+        /// results
+        #[arg(long)]
+        refresh: bool,
+    },
 
     /// Start screen capture and encoding
     Capture {
@@ -84,7 +107,11 @@ enum Commands {
     },
 
     /// Run encoder benchmark
+    #[command(args_conflicts_with_subcommands = true)]
     Bench {
+        #[command(subcommand)]
+        target: Option<BenchTarget>,
+
         /// Codec to benchmark
         #[arg(short, long, default_value = "h264")]
         codec: String,
@@ -100,10 +127,80 @@ enum Commands {
 
     /// List available presets
     Presets,
+
+    /// Share one capture and encoder with local clients until Ctrl+C
+    Daemon {
+        /// TOML config file (defaults apply to anything it leaves out)
+        #[arg(short, long)]
+        config: Option<PathBuf>,
+    },
+}
+
+#[derive(Subcommand)]
+enum BenchTarget {
+    /// Drive whole pipelines from a synthetic capture source
+    Pipeline(PipelineBenchArgs),
+}
+
+#[derive(Args)]
+struct PipelineBenchArgs {
+    /// Resolution of the generated frames
+    #[arg(short, long, default_value = "1920x1080")]
+    resolution: String,
+
+    /// Framerate (the highest tried with --sweep)
+    #[arg(short, long, default_value = "60")]
+    fps: u32,
+
+    /// Step through 30/60/120/144/240 fps up to --fps and report the
+    /// highest rate sustained without drops
+    #[arg(long)]
+    sweep: bool,
+
+    /// Video codec (h264, hevc, av1)
+    #[arg(short, long, default_value = "h264")]
+    codec: String,
+
+    /// Bitrate in kbps
+    #[arg(short, long, default_value = "8000")]
+    bitrate: u32,
+
+    /// Where packets go: "null", "srt" (local loopback) or a file path
+    #[arg(short, long, default_value = "null")]
+    output: String,
+
+    /// Pipelines run side by side
+    #[arg(short, long, default_value = "1")]
+    streams: u32,
+
+    /// Seconds measured per run (after one second of warm-up)
+    #[arg(short, long, default_value = "10")]
+    duration: u64,
+
+    /// Generated content
+    #[arg(long, value_enum, default_value = "motion")]
+    pattern: PatternArg,
+}
+
+/// Test pattern for CLI
+#[derive(Debug, Clone, Copy, ValueEnum)]
+enum PatternArg {
+    Gradient,
+    Text,
+    Motion,
+}
+
+impl From<PatternArg> for TestPattern {
+    fn from(p: PatternArg) -> Self {
+        match p {
+            PatternArg::Gradient => TestPattern::Gradient,
+            PatternArg::Text => TestPattern::Text,
+            PatternArg::Motion => TestPattern::Motion,
+        }
+    }
 }
 
-#[tokio::main]
-async fn main() -> anyhow::Result<()> {
+fn main() -> anyhow::Result<()> {
     // Initialize logging
     tracing_subscriber::fmt()
         .with_env_filter(
@@ -114,8 +211,30 @@ async fn main() -> anyhow::Result<()> {
 
     let cli = Cli::parse();
 
-    match cli.command {
-        Commands::Info => cmd_info(),
+    // The daemon's file can place threads too, so read it first
+    let daemon = match &cli.command {
+        Commands::Daemon { config } => Some(load_daemon_config(config.as_deref())?),
+        _ => None,
+    };
+    let mut threads = daemon
+        .as_ref()
+        .map_or_else(ThreadingConfig::default, |d| d.threading.clone());
+    threads.pin |= cli.pin_threads;
+    threads.realtime |= cli.realtime;
+
+    // Before the runtime, so its workers start in place (and no other
+    // thread reads the environment yet)
+    threading::configure(threads);
+    ghoststream::encode::nvenc::use_pci_device_order();
+    threading::runtime_builder()
+        .build()?
+        .block_on(run(cli.command, daemon))
+}
+
+/// Run `command`; `daemon` is its config if main already loaded it
+async fn run(command: Commands, daemon: Option<DaemonConfig>) -> anyhow::Result<()> {
+    match command {
+        Commands::Info { refresh } => cmd_info(refresh),
         Commands::Capture {
             output,
             codec,
@@ -125,12 +244,37 @@ async fn main() -> anyhow::Result<()> {
             preset,
             encoder,
         } => cmd_capture(output, codec, bitrate, resolution, fps, preset, encoder).await,
-        Commands::Bench { codec, frames, encoder } => cmd_bench(codec, frames, encoder).await,
+        Commands::Bench {
+            target: Some(BenchTarget::Pipeline(args)),
+            ..
+        } => cmd_bench_pipeline(args).await,
+        Commands::Bench {
+            codec,
+            frames,
+            encoder,
+            target: None,
+        } => cmd_bench(codec, frames, encoder).await,
         Commands::Presets => cmd_presets(),
+        Commands::Daemon { config } => {
+            let config = match daemon {
+                Some(loaded) => loaded,
+                None => load_daemon_config(config.as_deref())?,
+            };
+            cmd_daemon(config).await
+        }
     }
 }
 
-fn cmd_info() -> anyhow::Result<()> {
+/// The daemon's config file, or the defaults without one
+fn load_daemon_config(path: Option<&std::path::Path>) -> ghoststream::Result<DaemonConfig> {
+    path.map_or_else(|| Ok(DaemonConfig::default()), DaemonConfig::load)
+}
+
+fn cmd_info(refresh: bool) -> anyhow::Result<()> {
+    if refresh {
+        ghoststream::encode::probe::clear()?;
+    }
+
     println!("GhostStream System Information");
     println!("==============================\n");
 
@@ -360,10 +504,51 @@ async fn cmd_capture(
     println!("  Frames captured: {}", stats.frames_captured);
     println!("  Frames encoded: {}", stats.frames_encoded);
     println!("  Bytes written: {}", stats.bytes_written);
+    println!(
+        "  Buffer pool: {} hits, {} misses",
+        stats.pool_hits, stats.pool_misses
+    );
+
+    let metrics = pipeline.metrics();
+    println!("  Frames dropped: {}", metrics.frames_dropped);
+    println!("  Frames unchanged: {}", metrics.frames_static);
+    println!("  Packets dropped: {}", metrics.packets_dropped);
+    println!(
+        "  Queue peaks: {} frames, {} packets",
+        metrics.frame_queue_max, metrics.packet_queue_max
+    );
+    println!("\nLatency:");
+    for stage in ghoststream::Stage::ALL {
+        println!("  {:<14} {}", stage.name(), metrics.latency(stage));
+    }
 
     Ok(())
 }
 
+async fn cmd_daemon(config: DaemonConfig) -> anyhow::Result<()> {
+    let daemon = Daemon::new(config);
+    println!("GhostStream daemon on {}", daemon.socket().display());
+    println!("Press Ctrl+C to stop.\n");
+
+    let serve = daemon.run();
+    tokio::pin!(serve);
+    tokio::select! {
+        result = &mut serve => return Ok(result?),
+        _ = tokio::signal::ctrl_c() => {}
+    }
+
+    println!("\nStopping...");
+    daemon.stop();
+    serve.await?;
+
+    let metrics = daemon.metrics();
+    println!("\nStatistics:");
+    println!("  Frames captured: {}", metrics.frames_captured);
+    println!("  Frames encoded: {}", metrics.frames_encoded);
+    println!("  Frames dropped: {}", metrics.frames_dropped);
+    Ok(())
+}
+
 async fn cmd_bench(codec: String, frames: u32, backend: Backend) -> anyhow::Result<()> {
     println!("GhostStream Encoder Benchmark");
     println!("=============================\n");
@@ -401,17 +586,31 @@ async fn cmd_bench(codec: String, frames: u32, backend: Backend) -> anyhow::Resu
     let mut encoder = ghoststream::encode::create_encoder_with_backend(config, encoder_backend)?;
     encoder.init()?;
 
+    // Moving, textured content rendered up front; blank frames cost an
+    // encoder next to nothing
+    let clip = (0..60)
+        .map(|i| TestPattern::Motion.render(i, 1920, 1080, FrameFormat::Nv12))
+        .collect::<ghoststream::Result<Vec<_>>>()?;
+    let mut latencies = Vec::with_capacity(frames as usize);
+
     let start = std::time::Instant::now();
 
     for i in 0..frames {
-        let mut f =
-            ghoststream::types::Frame::new(1920, 1080, ghoststream::types::FrameFormat::Nv12);
+        let mut f = clip[i as usize % clip.len()].share();
         f.pts = i as i64 * 16667; // ~60fps
+        let submitted = std::time::Instant::now();
         let _ = encoder.encode(&f)?;
+        latencies.push(submitted.elapsed());
     }
 
     let _ = encoder.flush()?;
     let elapsed = start.elapsed();
+    latencies.sort_unstable();
+    let percentile = |q: f64| {
+        latencies
+            .get(((latencies.len().max(1) - 1) as f64 * q).round() as usize)
+            .map_or(0.0, |d| d.as_secs_f64() * 1000.0)
+    };
 
     let fps = frames as f64 / elapsed.as_secs_f64();
     let ms_per_frame = elapsed.as_millis() as f64 / frames as f64;
@@ -420,6 +619,11 @@ async fn cmd_bench(codec: String, frames: u32, backend: Backend) -> anyhow::Resu
     println!("  Total time: {:.2}s", elapsed.as_secs_f64());
     println!("  Encoding FPS: {:.1}", fps);
     println!("  ms/frame: {:.2}", ms_per_frame);
+    println!(
+        "  Frame latency p50/p99: {:.2}/{:.2} ms",
+        percentile(0.50),
+        percentile(0.99)
+    );
     println!(
         "  Realtime capable (60fps): {}",
         if fps >= 60.0 { "Yes" } else { "No" }
@@ -441,6 +645,251 @@ async fn cmd_bench(codec: String, frames: u32, backend: Backend) -> anyhow::Resu
     Ok(())
 }
 
+/// Framerates tried by `bench pipeline --sweep`
+const SWEEP_FPS: [u32; 5] = [30, 60, 120, 144, 240];
+
+/// First SRT loopback port (one per stream)
+const SRT_LOOPBACK_PORT: u16 = 19_000;
+
+/// Counts from one pipeline over the measured window
+struct StreamRun {
+    captured: u64,
+    encoded: u64,
+    dropped: u64,
+    metrics: ghoststream::MetricsSnapshot,
+}
+
+async fn cmd_bench_pipeline(args: PipelineBenchArgs) -> anyhow::Result<()> {
+    println!("GhostStream Pipeline Benchmark");
+    println!("==============================\n");
+
+    let size = args
+        .resolution
+        .split_once('x')
+        .and_then(|(w, h)| Some(Resolution::new(w.parse().ok()?, h.parse().ok()?)))
+        .ok_or_else(|| anyhow::anyhow!("Invalid resolution: {}", args.resolution))?;
+
+    let codec = match args.codec.to_lowercase().as_str() {
+        "h264" | "avc" => Codec::H264,
+        "h265" | "hevc" => Codec::Hevc,
+        "av1" => Codec::Av1,
+        _ => Codec::H264,
+    };
+
+    let rates: Vec<u32> = if args.sweep {
+        SWEEP_FPS
+            .into_iter()
+            .filter(|&fps| fps <= args.fps)
+            .collect()
+    } else {
+        vec![args.fps]
+    };
+
+    println!("Codec: {}", codec);
+    println!("Resolution: {}", size);
+    println!("Pattern: {}", TestPattern::from(args.pattern));
+    println!("Output: {}", args.output);
+    println!("Streams: {}", args.streams);
+    println!();
+
+    let mut sustained = None;
+    for fps in rates {
+        println!(
+            "--- {} fps x {} streams, {}s ---",
+            fps, args.streams, args.duration
+        );
+        let ok = run_pipeline_bench(&args, size, codec, fps).await?;
+        println!();
+        if ok {
+            sustained = Some(fps);
+        } else if args.sweep {
+            break;
+        }
+    }
+
+    if args.sweep {
+        match sustained {
+            Some(fps) => println!("Max sustainable: {} fps x {} streams", fps, args.streams),
+            None => println!("Max sustainable: none of the tried rates ran without drops"),
+        }
+    }
+
+    Ok(())
+}
+
+/// Run `args.streams` pipelines at `fps`; true if every frame made it
+async fn run_pipeline_bench(
+    args: &PipelineBenchArgs,
+    size: Resolution,
+    codec: Codec,
+    fps: u32,
+) -> anyhow::Result<bool> {
+    let mut pipelines = Vec::with_capacity(args.streams as usize);
+    let mut received = Vec::new();
+
+    for i in 0..args.streams {
+        let capture = CaptureConfig::default()
+            .with_fps(fps)
+            .with_synthetic(SyntheticConfig::new(size, args.pattern.into()));
+        let encoder = EncoderConfig::default()
+            .with_codec(codec)
+            .with_resolution(size.width, size.height)
+            .with_bitrate_kbps(args.bitrate)
+            .with_framerate(fps);
+
+        let output = match args.output.as_str() {
+            "null" => Output::Null,
+            "srt" => {
+                let port = SRT_LOOPBACK_PORT + i as u16;
+                received.push(srt_loopback(port));
+                Output::srt(format!("srt://127.0.0.1:{}", port), 120)
+            }
+            path => {
+                let container = if path.ends_with(".mp4") {
+                    Container::Mp4
+                } else if path.ends_with(".webm") {
+                    Container::WebM
+                } else if path.ends_with(".ts") {
+                    Container::Ts
+                } else {
+                    Container::Matroska
+                };
+                let path = if args.streams > 1 {
+                    let (stem, ext) = path
+                        .rsplit_once('.')
+                        .unwrap_or((path, container.extension()));
+                    format!("{}-{}.{}", stem, i, ext)
+                } else {
+                    path.to_string()
+                };
+                Output::file(path, container)
+            }
+        };
+
+        pipelines.push(Pipeline::new(capture, encoder, output)?);
+    }
+
+    for pipeline in &pipelines {
+        pipeline.start().await?;
+    }
+
+    // Encoder and output start-up is not what is being measured
+    tokio::time::sleep(Duration::from_secs(1)).await;
+    for pipeline in &pipelines {
+        pipeline.reset_latency();
+    }
+    let before: Vec<_> = pipelines.iter().map(|p| p.metrics()).collect();
+    let cpu_before = cpu_time();
+    let start = Instant::now();
+
+    tokio::time::sleep(Duration::from_secs(args.duration)).await;
+
+    let wall = start.elapsed();
+    let cpu = cpu_time().saturating_sub(cpu_before);
+    let runs: Vec<StreamRun> = pipelines
+        .iter()
+        .zip(&before)
+        .map(|(pipeline, before)| {
+            let metrics = pipeline.metrics();
+            StreamRun {
+                captured: metrics.frames_captured - before.frames_captured,
+                encoded: metrics.frames_encoded - before.frames_encoded,
+                dropped: metrics.frames_dropped - before.frames_dropped,
+                metrics,
+            }
+        })
+        .collect();
+
+    for pipeline in &pipelines {
+        pipeline.stop().await?;
+    }
+
+    let expected = (fps as f64 * wall.as_secs_f64()) as u64;
+    let mut ok = true;
+    for (i, run) in runs.iter().enumerate() {
+        let encoded_fps = run.encoded as f64 / wall.as_secs_f64();
+        // A few frames may still be inside the encoder when the window ends
+        let kept_up = run.dropped == 0 && run.encoded + fps as u64 / 2 >= expected;
+        ok &= kept_up;
+
+        println!(
+            "Stream {}: {} captured, {} encoded ({:.1} fps), {} dropped{}",
+            i,
+            run.captured,
+            run.encoded,
+            encoded_fps,
+            run.dropped,
+            if kept_up { "" } else { "  <- fell behind" }
+        );
+        for stage in Stage::ALL {
+            let latency = run.metrics.latency(stage);
+            let busy = latency.mean.as_secs_f64() * latency.count as f64;
+            println!("  {:<14} {}", stage.name(), latency);
+            if matches!(stage, Stage::Process | Stage::Submit | Stage::Write) {
+                // Share of one core over the measured window
+                println!(
+                    "  {:<14} {:.1}% busy",
+                    "",
+                    busy / wall.as_secs_f64() * 100.0
+                );
+            }
+        }
+    }
+
+    for (i, bytes) in received.iter().enumerate() {
+        println!(
+            "SRT loopback {}: {:.1} MB received",
+            i,
+            bytes.load(Ordering::Relaxed) as f64 / 1_000_000.0
+        );
+    }
+    println!(
+        "Process CPU: {:.0}% ({:.1} cores)",
+        cpu.as_secs_f64() / wall.as_secs_f64() * 100.0,
+        cpu.as_secs_f64() / wall.as_secs_f64()
+    );
+
+    Ok(ok)
+}
+
+/// User + system CPU time of this process
+fn cpu_time() -> Duration {
+    let mut usage = unsafe { std::mem::zeroed::<libc::rusage>() };
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return Duration::ZERO;
+    }
+    let micros = |t: libc::timeval| t.tv_sec as u64 * 1_000_000 + t.tv_usec as u64;
+    Duration::from_micros(micros(usage.ru_utime) + micros(usage.ru_stime))
+}
+
+/// Local SRT listener that reads a stream and discards it, counting bytes
+///
+/// The thread is left to end on its own when the sender disconnects.
+fn srt_loopback(port: u16) -> Arc<AtomicU64> {
+    let bytes = Arc::new(AtomicU64::new(0));
+    let counter = bytes.clone();
+
+    std::thread::Builder::new()
+        .name(format!("srt-loopback-{}", port))
+        .spawn(move || {
+            let url = format!("srt://127.0.0.1:{}?mode=listener", port);
+            let mut input = match ffmpeg_next::format::input(&url) {
+                Ok(input) => input,
+                Err(e) => {
+                    eprintln!("SRT loopback on port {} failed: {}", port, e);
+                    return;
+                }
+            };
+            let mut packet = ffmpeg_next::Packet::empty();
+            while packet.read(&mut input).is_ok() {
+                counter.fetch_add(packet.size() as u64, Ordering::Relaxed);
+            }
+        })
+        .expect("failed to spawn SRT loopback thread");
+
+    bytes
+}
+
 fn cmd_presets() -> anyhow::Result<()> {
     println!("Available Presets");
     println!("=================\n");
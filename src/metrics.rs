@@ -0,0 +1,361 @@
+//! Pipeline instrumentation
+//!
+//! Counters, queue gauges and per-stage latency histograms, all plain
+//! atomics so the hot path never takes a lock. Each stage is recorded by a
+//! single thread (capture/output task or encoder thread), so the relaxed
+//! increments are uncontended; readers take a [`MetricsSnapshot`] at any
+//! time.
+//!
+//! Histograms are log-linear in the style of HdrHistogram: values are
+//! microseconds, exact below 32us and bucketed with ~3% relative error
+//! above, up to about 9.5 hours.
+
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::time::Duration;
+
+/// log2 of the sub-buckets per power of two
+const SUB_BITS: u32 = 5;
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+/// Highest tracked bit of a value (larger values are clamped)
+const MAX_BIT: u32 = 35;
+const BUCKETS: usize = (MAX_BIT - SUB_BITS + 2) as usize * SUB_BUCKETS;
+const MAX_VALUE: u64 = (1 << (MAX_BIT + 1)) - 1;
+
+/// Pipeline stage with a latency histogram
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Stage {
+    /// Capture to the encoder thread picking the frame up
+    Queue,
+    /// Scale/convert
+    Process,
+    /// Encoder submit call (upload and queueing)
+    Submit,
+    /// Submit to the frame's packet coming out of the encoder
+    Encode,
+    /// Output write / mux
+    Write,
+    /// Capture to the packet being written
+    GlassToWire,
+}
+
+impl Stage {
+    pub const ALL: [Stage; 6] = [
+        Stage::Queue,
+        Stage::Process,
+        Stage::Submit,
+        Stage::Encode,
+        Stage::Write,
+        Stage::GlassToWire,
+    ];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::Queue => "queue",
+            Stage::Process => "process",
+            Stage::Submit => "submit",
+            Stage::Encode => "encode",
+            Stage::Write => "write",
+            Stage::GlassToWire => "glass-to-wire",
+        }
+    }
+}
+
+impl std::fmt::Display for Stage {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}", self.name())
+    }
+}
+
+fn bucket_index(value: u64) -> usize {
+    let value = value.min(MAX_VALUE);
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let bit = 63 - value.leading_zeros();
+    let mantissa = (value >> (bit - SUB_BITS)) as usize;
+    (bit - SUB_BITS + 1) as usize * SUB_BUCKETS + (mantissa - SUB_BUCKETS)
+}
+
+/// Highest value that lands in bucket `index`
+fn bucket_value(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    let group = (index / SUB_BUCKETS) as u32;
+    let mantissa = (index % SUB_BUCKETS + SUB_BUCKETS) as u64;
+    let shift = group - 1;
+    (mantissa << shift) + (1 << shift) - 1
+}
+
+/// Lock-free latency histogram
+pub struct Histogram {
+    buckets: Box<[AtomicU64]>,
+    count: AtomicU64,
+    /// Sum of recorded values in microseconds
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Histogram {
+    pub fn new() -> Self {
+        Self {
+            buckets: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, elapsed: Duration) {
+        let micros = elapsed.as_micros().min(u64::MAX as u128) as u64;
+        self.buckets[bucket_index(micros)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(micros, Ordering::Relaxed);
+        self.max.fetch_max(micros, Ordering::Relaxed);
+    }
+
+    /// Count, mean, p50/p99/p99.9 and max
+    ///
+    /// Concurrent records may be partially visible; percentiles are
+    /// computed from the buckets actually read.
+    pub fn summary(&self) -> LatencySummary {
+        let counts: Vec<u64> = self
+            .buckets
+            .iter()
+            .map(|b| b.load(Ordering::Relaxed))
+            .collect();
+        let count: u64 = counts.iter().sum();
+        if count == 0 {
+            return LatencySummary::default();
+        }
+
+        let max = self.max.load(Ordering::Relaxed);
+        let percentile = |q: f64| {
+            let rank = ((q * count as f64).ceil() as u64).clamp(1, count);
+            let mut seen = 0;
+            for (i, &n) in counts.iter().enumerate() {
+                seen += n;
+                if seen >= rank {
+                    return Duration::from_micros(bucket_value(i).min(max));
+                }
+            }
+            Duration::from_micros(max)
+        };
+
+        let sum = self.sum.load(Ordering::Relaxed);
+        let recorded = self.count.load(Ordering::Relaxed).max(1);
+        LatencySummary {
+            count,
+            mean: Duration::from_micros(sum / recorded),
+            p50: percentile(0.50),
+            p99: percentile(0.99),
+            p999: percentile(0.999),
+            max: Duration::from_micros(max),
+        }
+    }
+
+    pub fn reset(&self) {
+        for bucket in self.buckets.iter() {
+            bucket.store(0, Ordering::Relaxed);
+        }
+        self.count.store(0, Ordering::Relaxed);
+        self.sum.store(0, Ordering::Relaxed);
+        self.max.store(0, Ordering::Relaxed);
+    }
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl std::fmt::Debug for Histogram {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Histogram")
+            .field("summary", &self.summary())
+            .finish()
+    }
+}
+
+/// Latency percentiles of one stage
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LatencySummary {
+    pub count: u64,
+    pub mean: Duration,
+    pub p50: Duration,
+    pub p99: Duration,
+    pub p999: Duration,
+    pub max: Duration,
+}
+
+impl std::fmt::Display for LatencySummary {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "p50 {:.2}ms p99 {:.2}ms p99.9 {:.2}ms max {:.2}ms (n={})",
+            self.p50.as_secs_f64() * 1000.0,
+            self.p99.as_secs_f64() * 1000.0,
+            self.p999.as_secs_f64() * 1000.0,
+            self.max.as_secs_f64() * 1000.0,
+            self.count
+        )
+    }
+}
+
+/// Current and peak depth of a channel
+#[derive(Debug, Default)]
+pub struct QueueGauge {
+    depth: AtomicUsize,
+    max: AtomicUsize,
+}
+
+impl QueueGauge {
+    pub fn set(&self, depth: usize) {
+        self.depth.store(depth, Ordering::Relaxed);
+        self.max.fetch_max(depth, Ordering::Relaxed);
+    }
+
+    pub fn depth(&self) -> usize {
+        self.depth.load(Ordering::Relaxed)
+    }
+
+    pub fn max(&self) -> usize {
+        self.max.load(Ordering::Relaxed)
+    }
+}
+
+/// Shared pipeline metrics
+#[derive(Debug, Default)]
+pub struct Metrics {
+    pub frames_captured: AtomicU64,
+    pub frames_encoded: AtomicU64,
+    /// Frames lost to queue policy, latency budget or processing/encode
+    /// errors
+    pub frames_dropped: AtomicU64,
+    /// Unchanged frames re-sent without processing
+    pub frames_static: AtomicU64,
+    /// Packets an output dropped while it fell behind
+    pub packets_dropped: AtomicU64,
+    pub bytes_written: AtomicU64,
+    /// Captured frames waiting for the encoder thread
+    pub frame_queue: QueueGauge,
+    /// Encoded packets waiting for the output
+    pub packet_queue: QueueGauge,
+    /// Scheduler slot of the encoder session, plus one (0 = none)
+    encoder_device: AtomicUsize,
+    latency: [Histogram; Stage::ALL.len()],
+}
+
+impl Metrics {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn record(&self, stage: Stage, elapsed: Duration) {
+        self.histogram(stage).record(elapsed);
+    }
+
+    pub fn histogram(&self, stage: Stage) -> &Histogram {
+        &self.latency[stage as usize]
+    }
+
+    /// Start every stage's latency over (e.g. after a warm-up)
+    pub fn reset_latency(&self) {
+        for histogram in &self.latency {
+            histogram.reset();
+        }
+    }
+
+    /// Record the scheduler slot the encoder runs on
+    pub fn set_encoder_device(&self, slot: usize) {
+        self.encoder_device.store(slot + 1, Ordering::Relaxed);
+    }
+
+    /// Scheduler slot the encoder runs on, once it has one
+    pub fn encoder_device(&self) -> Option<usize> {
+        self.encoder_device.load(Ordering::Relaxed).checked_sub(1)
+    }
+
+    /// Read everything (~48 KB of relaxed loads, no locks)
+    pub fn snapshot(&self) -> MetricsSnapshot {
+        MetricsSnapshot {
+            frames_captured: self.frames_captured.load(Ordering::Relaxed),
+            frames_encoded: self.frames_encoded.load(Ordering::Relaxed),
+            frames_dropped: self.frames_dropped.load(Ordering::Relaxed),
+            frames_static: self.frames_static.load(Ordering::Relaxed),
+            packets_dropped: self.packets_dropped.load(Ordering::Relaxed),
+            bytes_written: self.bytes_written.load(Ordering::Relaxed),
+            frame_queue_depth: self.frame_queue.depth(),
+            frame_queue_max: self.frame_queue.max(),
+            packet_queue_depth: self.packet_queue.depth(),
+            packet_queue_max: self.packet_queue.max(),
+            latency: Stage::ALL.map(|stage| self.histogram(stage).summary()),
+        }
+    }
+}
+
+/// Point-in-time copy of [`Metrics`]
+#[derive(Debug, Clone, Default)]
+pub struct MetricsSnapshot {
+    pub frames_captured: u64,
+    pub frames_encoded: u64,
+    pub frames_dropped: u64,
+    pub frames_static: u64,
+    pub packets_dropped: u64,
+    pub bytes_written: u64,
+    pub frame_queue_depth: usize,
+    pub frame_queue_max: usize,
+    pub packet_queue_depth: usize,
+    pub packet_queue_max: usize,
+    latency: [LatencySummary; Stage::ALL.len()],
+}
+
+impl MetricsSnapshot {
+    /// Latency of `stage`
+    pub fn latency(&self, stage: Stage) -> &LatencySummary {
+        &self.latency[stage as usize]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_bucket_bounds() {
+        let mut last = 0;
+        for value in [0, 1, 31, 32, 33, 63, 64, 1000, 16_667, 1 << 30, MAX_VALUE] {
+            let index = bucket_index(value);
+            assert!(index < BUCKETS);
+            assert!(index >= last);
+            last = index;
+
+            let upper = bucket_value(index);
+            assert!(upper >= value);
+            // Within one sub-bucket (~3%)
+            assert!(upper - value <= value / SUB_BUCKETS as u64);
+        }
+        assert_eq!(bucket_index(u64::MAX), bucket_index(MAX_VALUE));
+    }
+
+    #[test]
+    fn test_percentiles() {
+        let histogram = Histogram::new();
+        for ms in 1..=1000 {
+            histogram.record(Duration::from_micros(ms * 100));
+        }
+        histogram.record(Duration::from_millis(500));
+
+        let summary = histogram.summary();
+        assert_eq!(summary.count, 1001);
+        assert_eq!(summary.max, Duration::from_millis(500));
+        let near = |d: Duration, us: u64| d.as_micros().abs_diff(us as u128) <= us as u128 / 30;
+        assert!(near(summary.p50, 50_000), "{:?}", summary.p50);
+        assert!(near(summary.p99, 99_000), "{:?}", summary.p99);
+        assert!(near(summary.p999, 100_000), "{:?}", summary.p999);
+
+        histogram.reset();
+        assert_eq!(histogram.summary(), LatencySummary::default());
+    }
+}
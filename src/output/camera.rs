@@ -6,20 +6,37 @@
 //! Uses RawOutputSink trait since virtual cameras need raw video frames,
 //! not encoded packets. Use the capture -> camera pipeline directly
 //! for optimal performance (no encoding/decoding overhead).
-
+//!
+//! Frames reach the PipeWire thread by reference through a keep-latest
+//! queue: pooled buffers are shared, not cloned, and linear DMA-BUFs are
+//! read straight from their mapping (made once per buffer), so the only
+//! copy is the one into the PipeWire buffer. A frame the camera had no time
+//! to show goes back to its pool at once. The PipeWire thread sleeps in its
+//! loop until an eventfd signals a new frame.
+
+use crate::capture::DmaBufFrame;
+use crate::config::QueueConfig;
 use crate::error::{Error, Result};
+use crate::pool::FrameBuffer;
 use crate::processing::convert_colorspace;
-use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
+use crate::queue::{self, Push, QueueReceiver, QueueSender};
+use crate::threading::{self, ThreadRole};
+use crate::types::{CodecParams, Frame, FrameFormat, Packet, PacketData, Resolution};
 
 use super::{OutputSink, RawOutputSink};
 
 use pipewire as pw;
 use pw::spa::param::video::VideoFormat;
 use pw::spa::pod::Pod;
+use pw::spa::support::system::IoFlags;
 
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::os::unix::io::{AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd};
+use std::rc::Rc;
 use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::Arc;
-use std::sync::mpsc;
+use std::time::Duration;
 
 /// Virtual camera output
 pub struct VirtualCamera {
@@ -27,7 +44,8 @@ pub struct VirtualCamera {
     initialized: bool,
     bytes_written: Arc<AtomicU64>,
     active: Arc<AtomicBool>,
-    frame_tx: Option<mpsc::Sender<Vec<u8>>>,
+    frame_tx: Option<QueueSender<CameraFrame>>,
+    wakeup: Option<Arc<Wakeup>>,
     pipewire_thread: Option<std::thread::JoinHandle<()>>,
     width: u32,
     height: u32,
@@ -43,6 +61,7 @@ impl VirtualCamera {
             bytes_written: Arc::new(AtomicU64::new(0)),
             active: Arc::new(AtomicBool::new(false)),
             frame_tx: None,
+            wakeup: None,
             pipewire_thread: None,
             width: 1920,
             height: 1080,
@@ -64,15 +83,18 @@ impl VirtualCamera {
     }
 
     /// Start the PipeWire camera thread
-    fn start_pipewire_camera(&mut self) -> Result<mpsc::Sender<Vec<u8>>> {
-        let (frame_tx, frame_rx) = mpsc::channel::<Vec<u8>>();
+    fn start_pipewire_camera(&mut self) -> Result<QueueSender<CameraFrame>> {
+        let (frame_tx, frame_rx) = queue::frame_queue(QueueConfig::low_latency());
+        let wakeup = Arc::new(Wakeup::new()?);
+        self.wakeup = Some(wakeup.clone());
         let active = self.active.clone();
         let name = self.name.clone();
         let width = self.width;
         let height = self.height;
 
         let handle = std::thread::spawn(move || {
-            if let Err(e) = run_virtual_camera(name, width, height, frame_rx, active) {
+            threading::enter(ThreadRole::Io);
+            if let Err(e) = run_virtual_camera(name, width, height, frame_rx, wakeup, active) {
                 tracing::error!("Virtual camera error: {}", e);
             }
         });
@@ -80,6 +102,269 @@ impl VirtualCamera {
         self.pipewire_thread = Some(handle);
         Ok(frame_tx)
     }
+
+    /// Hand a frame to the PipeWire thread, replacing one it has not shown
+    fn send(&mut self, frame: CameraFrame) {
+        let Some(tx) = &self.frame_tx else { return };
+        match tx.push(frame) {
+            Push::Queued { dropped } => {
+                if dropped > 0 {
+                    tracing::trace!("Virtual camera skipped {} frame(s)", dropped);
+                }
+                if let Some(wakeup) = &self.wakeup {
+                    wakeup.signal();
+                }
+            }
+            Push::Disconnected => {
+                tracing::warn!("Virtual camera '{}' thread stopped", self.name);
+                self.frame_tx = None;
+            }
+            _ => {}
+        }
+    }
+
+    /// Stop the PipeWire thread and wait for it
+    fn stop(&mut self) {
+        self.active.store(false, Ordering::SeqCst);
+        drop(self.frame_tx.take());
+        if let Some(wakeup) = self.wakeup.take() {
+            wakeup.signal();
+        }
+        if let Some(handle) = self.pipewire_thread.take() {
+            let _ = handle.join();
+        }
+    }
+}
+
+/// eventfd the camera signals after queueing a frame, polled by the
+/// PipeWire loop alongside its own fds
+struct Wakeup(OwnedFd);
+
+impl Wakeup {
+    fn new() -> Result<Self> {
+        // SAFETY: plain syscall; the fd is owned below
+        let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        // SAFETY: `fd` is a fresh eventfd nothing else owns
+        Ok(Self(unsafe { OwnedFd::from_raw_fd(fd) }))
+    }
+
+    fn signal(&self) {
+        let one = 1u64;
+        // SAFETY: eventfd writes are a single u64
+        unsafe {
+            libc::write(self.0.as_raw_fd(), (&one as *const u64).cast(), 8);
+        }
+    }
+
+    fn drain(&self) {
+        let mut count = 0u64;
+        // SAFETY: eventfd reads are a single u64
+        unsafe {
+            libc::read(self.0.as_raw_fd(), (&mut count as *mut u64).cast(), 8);
+        }
+    }
+}
+
+impl AsRawFd for Wakeup {
+    fn as_raw_fd(&self) -> RawFd {
+        self.0.as_raw_fd()
+    }
+}
+
+/// Frame on its way to the PipeWire thread, by reference
+enum CameraFrame {
+    /// BGRA rows `stride` bytes apart
+    Buffer { data: FrameBuffer, stride: u32 },
+    /// Raw BGRA bytes passed through an encoded-packet interface
+    Packet(PacketData),
+    /// Linear BGRA/BGRx DMA-BUF
+    DmaBuf(Arc<DmaBufFrame>),
+}
+
+impl CameraFrame {
+    /// Copy the frame into `dst` (`height` rows `dst_stride` apart),
+    /// returning the bytes written
+    fn copy_to(
+        &self,
+        dst: &mut [u8],
+        dst_stride: usize,
+        height: usize,
+        maps: &mut DmaBufMaps,
+    ) -> usize {
+        match self {
+            CameraFrame::Buffer { data, stride } => {
+                copy_rows(data, *stride as usize, dst, dst_stride, height)
+            }
+            CameraFrame::Packet(data) => copy_rows(data, dst_stride, dst, dst_stride, height),
+            CameraFrame::DmaBuf(frame) => match maps.get(frame) {
+                Some(map) => {
+                    let stride = frame.info.strides[0].max(frame.info.stride) as usize;
+                    map.sync(DMA_BUF_SYNC_READ);
+                    let written = copy_rows(map.plane(frame), stride, dst, dst_stride, height);
+                    map.sync(DMA_BUF_SYNC_READ | DMA_BUF_SYNC_END);
+                    written
+                }
+                None => 0,
+            },
+        }
+    }
+}
+
+/// Row-by-row copy between buffers of different strides
+fn copy_rows(
+    src: &[u8],
+    src_stride: usize,
+    dst: &mut [u8],
+    dst_stride: usize,
+    height: usize,
+) -> usize {
+    let row = src_stride.min(dst_stride);
+    if src_stride == dst_stride {
+        let len = src.len().min(dst.len()).min(dst_stride * height);
+        dst[..len].copy_from_slice(&src[..len]);
+        return len;
+    }
+
+    let mut written = 0;
+    for (src_row, dst_row) in src
+        .chunks(src_stride)
+        .zip(dst.chunks_mut(dst_stride))
+        .take(height)
+    {
+        let n = row.min(src_row.len()).min(dst_row.len());
+        dst_row[..n].copy_from_slice(&src_row[..n]);
+        written += dst_row.len();
+    }
+    written
+}
+
+/// `DMA_BUF_IOCTL_SYNC`: _IOW('b', 0, struct dma_buf_sync)
+const DMA_BUF_IOCTL_SYNC: u64 = 0x4008_6200;
+const DMA_BUF_SYNC_READ: u64 = 1;
+const DMA_BUF_SYNC_END: u64 = 4;
+
+/// Mappings kept at most; capture pools hold a handful of buffers
+const MAX_DMABUF_MAPS: usize = 8;
+
+/// Read-only CPU mappings of the DMA-BUFs seen so far
+///
+/// Capture rotates through a small buffer pool, so each buffer is mapped
+/// once and reused. A frame's lease keeps its buffer's contents stable
+/// while it is read; reads are bracketed by cache syncs.
+#[derive(Default)]
+struct DmaBufMaps {
+    maps: VecDeque<DmaBufMap>,
+}
+
+impl DmaBufMaps {
+    /// Mapping of `frame`'s buffer, made on first sight
+    fn get(&mut self, frame: &DmaBufFrame) -> Option<&DmaBufMap> {
+        let key = buffer_key(frame.fd())?;
+        let len = mapping_len(frame);
+        if let Some(i) = self
+            .maps
+            .iter()
+            .position(|map| map.key == key && map.len == len)
+        {
+            return self.maps.get(i);
+        }
+
+        let map = DmaBufMap::new(frame, key, len)?;
+        if self.maps.len() >= MAX_DMABUF_MAPS {
+            self.maps.pop_front();
+        }
+        self.maps.push_back(map);
+        self.maps.back()
+    }
+}
+
+/// Bytes of `frame`'s first plane, from the start of the buffer
+fn mapping_len(frame: &DmaBufFrame) -> usize {
+    let info = &frame.info;
+    let stride = info.strides[0].max(info.stride) as usize;
+    info.offsets[0] as usize + stride * info.height as usize
+}
+
+/// (device, inode) of the buffer behind `fd`: frames hold their own dups,
+/// so the fd number does not identify the buffer
+fn buffer_key(fd: RawFd) -> Option<(u64, u64)> {
+    if fd < 0 {
+        return None;
+    }
+    let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+    // SAFETY: fstat fills `stat` for an fd we hold open
+    if unsafe { libc::fstat(fd, &mut stat) } != 0 {
+        return None;
+    }
+    Some((stat.st_dev as u64, stat.st_ino as u64))
+}
+
+/// Read-only CPU mapping of one DMA-BUF, holding its own fd
+struct DmaBufMap {
+    ptr: *mut libc::c_void,
+    len: usize,
+    key: (u64, u64),
+    fd: OwnedFd,
+}
+
+impl DmaBufMap {
+    fn new(frame: &DmaBufFrame, key: (u64, u64), len: usize) -> Option<Self> {
+        if len == 0 {
+            return None;
+        }
+        // SAFETY: the frame holds `fd` open for the duration of the call
+        let fd = unsafe { BorrowedFd::borrow_raw(frame.fd()) }
+            .try_clone_to_owned()
+            .ok()?;
+
+        // SAFETY: maps `len` bytes of a DMA-BUF we hold open, read-only
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                fd.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return None;
+        }
+        Some(Self { ptr, len, key, fd })
+    }
+
+    fn sync(&self, flags: u64) {
+        // SAFETY: struct dma_buf_sync is a single u64 of flags
+        unsafe {
+            libc::ioctl(
+                self.fd.as_raw_fd(),
+                DMA_BUF_IOCTL_SYNC as libc::Ioctl,
+                &flags,
+            );
+        }
+    }
+
+    /// First plane of `frame`
+    fn plane(&self, frame: &DmaBufFrame) -> &[u8] {
+        let offset = (frame.info.offsets[0] as usize).min(self.len);
+        // SAFETY: the mapping covers `len` bytes
+        unsafe {
+            std::slice::from_raw_parts((self.ptr as *const u8).add(offset), self.len - offset)
+        }
+    }
+}
+
+impl Drop for DmaBufMap {
+    fn drop(&mut self) {
+        // SAFETY: mapped in `new`
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
 }
 
 /// RawOutputSink implementation for proper raw frame handling
@@ -119,20 +404,35 @@ impl RawOutputSink for VirtualCamera {
             .await?;
         }
 
-        if let Some(ref tx) = self.frame_tx {
-            // Convert to BGRA if needed (PipeWire expects BGRx/BGRA)
-            let frame_data = if frame.format == FrameFormat::Bgra {
-                frame.data.clone()
-            } else {
-                convert_colorspace(&frame.data, frame.format, FrameFormat::Bgra, frame.width, frame.height)?
-            };
-
-            // Send frame data to PipeWire thread
-            let _ = tx.send(frame_data);
-        }
+        // PipeWire expects BGRx/BGRA; those are handed over by reference
+        let camera_frame = match &frame.dmabuf {
+            Some(dmabuf) if frame.data.is_empty() => {
+                if !dmabuf.info.is_linear() || frame.format != FrameFormat::Bgra {
+                    return Err(Error::VirtualCamera(
+                        "Virtual camera needs linear BGRA DMA-BUFs".into(),
+                    ));
+                }
+                CameraFrame::DmaBuf(dmabuf.clone())
+            }
+            _ if frame.format == FrameFormat::Bgra => CameraFrame::Buffer {
+                data: frame.data.clone(),
+                stride: frame.stride,
+            },
+            _ => CameraFrame::Buffer {
+                data: FrameBuffer::from_vec(convert_colorspace(
+                    &frame.data,
+                    frame.format,
+                    FrameFormat::Bgra,
+                    frame.width,
+                    frame.height,
+                )?),
+                stride: frame.width * 4,
+            },
+        };
+        self.send(camera_frame);
 
         self.bytes_written
-            .fetch_add(frame.data.len() as u64, Ordering::Relaxed);
+            .fetch_add(frame.stride as u64 * frame.height as u64, Ordering::Relaxed);
         Ok(())
     }
 
@@ -141,12 +441,7 @@ impl RawOutputSink for VirtualCamera {
             return Ok(());
         }
 
-        self.active.store(false, Ordering::SeqCst);
-        drop(self.frame_tx.take());
-
-        if let Some(handle) = self.pipewire_thread.take() {
-            let _ = handle.join();
-        }
+        self.stop();
 
         tracing::info!("Virtual camera '{}' stopped", self.name);
         self.initialized = false;
@@ -193,9 +488,7 @@ impl OutputSink for VirtualCamera {
         }
 
         // Pass through raw data - caller must ensure packet.data is raw frame bytes
-        if let Some(ref tx) = self.frame_tx {
-            let _ = tx.send(packet.data.clone());
-        }
+        self.send(CameraFrame::Packet(packet.data.clone()));
 
         self.bytes_written
             .fetch_add(packet.size() as u64, Ordering::Relaxed);
@@ -206,6 +499,11 @@ impl OutputSink for VirtualCamera {
         RawOutputSink::finish(self).await
     }
 
+    /// Raw frames carry no codec state
+    async fn update_codec(&mut self, _codec_params: Option<&CodecParams>) -> Result<()> {
+        Ok(())
+    }
+
     fn bytes_written(&self) -> u64 {
         self.bytes_written.load(Ordering::Relaxed)
     }
@@ -213,11 +511,7 @@ impl OutputSink for VirtualCamera {
 
 impl Drop for VirtualCamera {
     fn drop(&mut self) {
-        self.active.store(false, Ordering::SeqCst);
-        drop(self.frame_tx.take());
-        if let Some(handle) = self.pipewire_thread.take() {
-            let _ = handle.join();
-        }
+        self.stop();
     }
 }
 
@@ -230,7 +524,8 @@ fn run_virtual_camera(
     name: String,
     width: u32,
     height: u32,
-    frame_rx: mpsc::Receiver<Vec<u8>>,
+    frame_rx: QueueReceiver<CameraFrame>,
+    wakeup: Arc<Wakeup>,
     active: Arc<AtomicBool>,
 ) -> Result<()> {
     tracing::info!(
@@ -270,17 +565,23 @@ fn run_virtual_camera(
 
     // State for callbacks
     struct CameraState {
-        frame_rx: mpsc::Receiver<Vec<u8>>,
+        /// Frame waiting for the next process cycle
+        latest: Rc<RefCell<Option<CameraFrame>>>,
+        maps: DmaBufMaps,
         frame_size: usize,
         stride: u32,
+        height: u32,
     }
 
     let stride = width * 4; // BGRx = 4 bytes per pixel
     let frame_size = (height * stride) as usize;
+    let latest = Rc::new(RefCell::new(None));
     let state = CameraState {
-        frame_rx,
+        latest: latest.clone(),
+        maps: DmaBufMaps::default(),
         frame_size,
         stride,
+        height,
     };
 
     let active_clone = active.clone();
@@ -299,51 +600,34 @@ fn run_virtual_camera(
             }
         })
         .process(|stream, state| {
-            // Get buffer to fill
+            // Only new frames are queued; consumers keep showing the last
+            let Some(frame) = state.latest.borrow_mut().take() else {
+                return;
+            };
             let Some(mut buffer) = stream.dequeue_buffer() else {
                 return;
             };
 
             let datas = buffer.datas_mut();
-            if datas.is_empty() {
+            let Some(data) = datas.first_mut() else {
                 return;
-            }
+            };
 
-            let data = &mut datas[0];
-
-            // Try to get next frame from channel
-            if let Ok(frame_data) = state.frame_rx.try_recv() {
-                // Write frame data to buffer
-                if let Some(slice) = data.data() {
-                    let copy_size = frame_data.len().min(slice.len()).min(state.frame_size);
-
-                    // Safety: we're writing to the PipeWire buffer
-                    unsafe {
-                        let dst = slice.as_ptr() as *mut u8;
-                        std::ptr::copy_nonoverlapping(frame_data.as_ptr(), dst, copy_size);
-                    }
-
-                    // Set chunk metadata
-                    let chunk = data.chunk_mut();
-                    *chunk.offset_mut() = 0;
-                    *chunk.stride_mut() = state.stride as i32;
-                    *chunk.size_mut() = state.frame_size as u32;
-                }
-            } else {
-                // No frame available, output black frame
-                if let Some(slice) = data.data() {
-                    let clear_size = slice.len().min(state.frame_size);
-
-                    unsafe {
-                        let dst = slice.as_ptr() as *mut u8;
-                        std::ptr::write_bytes(dst, 0, clear_size);
-                    }
-
-                    let chunk = data.chunk_mut();
-                    *chunk.offset_mut() = 0;
-                    *chunk.stride_mut() = state.stride as i32;
-                    *chunk.size_mut() = state.frame_size as u32;
-                }
+            if let Some(slice) = data.data() {
+                let written = frame
+                    .copy_to(
+                        slice,
+                        state.stride as usize,
+                        state.height as usize,
+                        &mut state.maps,
+                    )
+                    .min(state.frame_size);
+
+                // Set chunk metadata
+                let chunk = data.chunk_mut();
+                *chunk.offset_mut() = 0;
+                *chunk.stride_mut() = state.stride as i32;
+                *chunk.size_mut() = written as u32;
             }
         })
         .register()
@@ -410,11 +694,73 @@ fn run_virtual_camera(
 
     tracing::info!("Virtual camera '{}' ready", name);
 
-    // Run main loop
+    // Sleep in the loop until PipeWire or a queued frame wakes it
+    let _wakeup_source = mainloop
+        .loop_()
+        .add_io(wakeup, IoFlags::IN, |wakeup| wakeup.drain());
+
+    // Run main loop; as the driver, start a cycle for every new frame
     while active_clone.load(Ordering::SeqCst) {
-        mainloop.loop_().iterate(std::time::Duration::from_millis(16));
+        mainloop.loop_().iterate(Duration::from_secs(1));
+        match frame_rx.try_recv() {
+            Ok(received) => {
+                *latest.borrow_mut() = Some(received.item);
+                let _ = stream.trigger_process();
+            }
+            Err(crossbeam_channel::TryRecvError::Empty) => {}
+            Err(crossbeam_channel::TryRecvError::Disconnected) => break,
+        }
     }
 
     tracing::info!("Virtual camera stopped");
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_copy_rows_same_stride() {
+        let src: Vec<u8> = (0..32).collect();
+        let mut dst = vec![0u8; 32];
+        assert_eq!(copy_rows(&src, 16, &mut dst, 16, 2), 32);
+        assert_eq!(dst, src);
+
+        // Never past `height` rows
+        let mut dst = vec![0u8; 32];
+        assert_eq!(copy_rows(&src, 16, &mut dst, 16, 1), 16);
+        assert_eq!(&dst[..16], &src[..16]);
+        assert!(dst[16..].iter().all(|&b| b == 0));
+    }
+
+    #[test]
+    fn test_copy_rows_drops_source_padding() {
+        // Two 8-byte rows with 4 bytes of padding each
+        let src: Vec<u8> = (0..24).collect();
+        let mut dst = vec![0u8; 16];
+        assert_eq!(copy_rows(&src, 12, &mut dst, 8, 2), 16);
+        assert_eq!(&dst[..8], &src[..8]);
+        assert_eq!(&dst[8..], &src[12..20]);
+    }
+
+    #[test]
+    fn test_copy_rows_pads_destination() {
+        let src: Vec<u8> = (1..=16).collect();
+        let mut dst = vec![0u8; 24];
+        assert_eq!(copy_rows(&src, 8, &mut dst, 12, 2), 24);
+        assert_eq!(&dst[..8], &src[..8]);
+        assert_eq!(&dst[8..12], &[0; 4]);
+        assert_eq!(&dst[12..20], &src[8..]);
+    }
+
+    #[test]
+    fn test_copy_rows_short_source() {
+        // One row of a two-row frame: the rest is left alone
+        let src = vec![7u8; 12];
+        let mut dst = vec![0u8; 16];
+        assert_eq!(copy_rows(&src, 12, &mut dst, 8, 2), 8);
+        assert!(dst[..8].iter().all(|&b| b == 7));
+        assert!(dst[8..].iter().all(|&b| b == 0));
+    }
+}
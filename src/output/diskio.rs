@@ -0,0 +1,561 @@
+//! Buffered disk I/O for recordings
+//!
+//! The muxer writes into a custom AVIO context that gathers its output in
+//! large page-aligned chunks. A dedicated writer thread puts each chunk on
+//! disk with a positional write, starts its writeback straight away and
+//! drops it from the page cache once it is written. A long recording
+//! streams to disk at a steady rate instead of piling up dirty pages and
+//! flushing them in bursts, and a slow disk only stalls the muxer once
+//! every chunk is in flight. With direct I/O, aligned chunks bypass the
+//! page cache entirely.
+
+use crate::error::{Error, Result};
+use crate::threading::{self, ThreadRole};
+
+use crossbeam_channel::{Receiver, Sender};
+use ffmpeg_next as ffmpeg;
+use parking_lot::Mutex;
+use std::alloc::{self, Layout};
+use std::ffi::{c_int, c_void, CString};
+use std::fs::{File, OpenOptions};
+use std::ops::{Deref, DerefMut};
+use std::os::unix::fs::{FileExt, OpenOptionsExt};
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr::NonNull;
+use std::sync::Arc;
+use std::thread::JoinHandle;
+
+/// Bytes gathered before a chunk goes to the writer thread
+const CHUNK_SIZE: usize = 4 << 20;
+/// Alignment of chunk buffers and direct I/O offsets
+const ALIGN: usize = 4096;
+/// Chunks queued to the writer thread before the muxer waits
+const CHUNKS_IN_FLIGHT: usize = 4;
+/// AVIO buffer in front of the chunks
+const AVIO_BUFFER_SIZE: usize = 64 << 10;
+
+/// Page-aligned chunk buffer
+struct ChunkBuf {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// SAFETY: the allocation is owned by the buffer alone
+unsafe impl Send for ChunkBuf {}
+
+impl ChunkBuf {
+    fn layout() -> Layout {
+        Layout::from_size_align(CHUNK_SIZE, ALIGN).expect("valid chunk layout")
+    }
+
+    fn new() -> Self {
+        let layout = Self::layout();
+        // SAFETY: the layout has a non-zero size
+        let ptr = unsafe { alloc::alloc(layout) };
+        let ptr = NonNull::new(ptr).unwrap_or_else(|| alloc::handle_alloc_error(layout));
+        Self { ptr, len: 0 }
+    }
+
+    fn data(&self) -> &[u8] {
+        // SAFETY: the first `len` bytes have been written
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+
+    /// Append as much of `data` as fits, returning the bytes taken
+    fn fill(&mut self, data: &[u8]) -> usize {
+        let n = data.len().min(CHUNK_SIZE - self.len);
+        // SAFETY: `n` bytes fit after `len`
+        unsafe {
+            std::ptr::copy_nonoverlapping(data.as_ptr(), self.ptr.as_ptr().add(self.len), n);
+        }
+        self.len += n;
+        n
+    }
+
+    fn is_full(&self) -> bool {
+        self.len == CHUNK_SIZE
+    }
+}
+
+impl Drop for ChunkBuf {
+    fn drop(&mut self) {
+        // SAFETY: allocated in `new` with the same layout
+        unsafe { alloc::dealloc(self.ptr.as_ptr(), Self::layout()) }
+    }
+}
+
+/// A chunk and where it goes in the file
+struct Chunk {
+    offset: u64,
+    buf: ChunkBuf,
+}
+
+/// Muxer side of the writer: gathers AVIO writes into chunks
+struct Staging {
+    buf: ChunkBuf,
+    /// File offset of the start of `buf`
+    offset: u64,
+    /// File size so far
+    size: u64,
+    tx: Option<Sender<Chunk>>,
+    /// Buffers handed back by the writer thread
+    free: Receiver<ChunkBuf>,
+    error: Arc<Mutex<Option<String>>>,
+}
+
+impl Staging {
+    fn position(&self) -> u64 {
+        self.offset + self.buf.len as u64
+    }
+
+    fn write(&mut self, mut data: &[u8]) -> bool {
+        if self.error.lock().is_some() {
+            return false;
+        }
+        while !data.is_empty() {
+            let n = self.buf.fill(data);
+            data = &data[n..];
+            if self.buf.is_full() && !self.submit(self.aligned_len()) {
+                return false;
+            }
+        }
+        self.size = self.size.max(self.position());
+        true
+    }
+
+    /// Hand the first `len` bytes of the chunk to the writer thread; the
+    /// rest starts the next chunk
+    fn submit(&mut self, len: usize) -> bool {
+        if len == 0 {
+            return true;
+        }
+        let mut next = self.free.try_recv().unwrap_or_else(|_| ChunkBuf::new());
+        next.len = 0;
+        next.fill(&self.buf.data()[len..]);
+        self.buf.len = len;
+
+        let chunk = Chunk {
+            offset: self.offset,
+            buf: std::mem::replace(&mut self.buf, next),
+        };
+        self.offset += len as u64;
+        match &self.tx {
+            Some(tx) => tx.send(chunk).is_ok(),
+            None => false,
+        }
+    }
+
+    /// Length of a full chunk to submit so the next one starts on an
+    /// alignment boundary again after a flush or seek left it unaligned
+    fn aligned_len(&self) -> usize {
+        match (self.offset % ALIGN as u64) as usize {
+            0 => self.buf.len,
+            misalign => self.buf.len - misalign,
+        }
+    }
+
+    /// Submit everything written so far; the next full chunk realigns
+    fn flush(&mut self) -> bool {
+        self.submit(self.buf.len)
+    }
+
+    fn seek(&mut self, target: u64) -> bool {
+        if target == self.position() {
+            return true;
+        }
+        let submitted = self.submit(self.buf.len);
+        self.offset = target;
+        submitted
+    }
+}
+
+unsafe extern "C" fn write_packet(opaque: *mut c_void, buf: *const u8, size: c_int) -> c_int {
+    // SAFETY: opaque is the Staging of the DiskWriter that owns this AVIO
+    // context, and only the muxer thread calls into it
+    let staging = &mut *(opaque as *mut Staging);
+    let data = std::slice::from_raw_parts(buf, size.max(0) as usize);
+    if staging.write(data) {
+        size
+    } else {
+        -libc::EIO
+    }
+}
+
+unsafe extern "C" fn seek(opaque: *mut c_void, offset: i64, whence: c_int) -> i64 {
+    // SAFETY: as in write_packet
+    let staging = &mut *(opaque as *mut Staging);
+    let whence = whence & !(ffmpeg::ffi::AVSEEK_FORCE as c_int);
+    let target = match whence {
+        w if w == ffmpeg::ffi::AVSEEK_SIZE as c_int => return staging.size as i64,
+        libc::SEEK_SET => offset,
+        libc::SEEK_CUR => staging.position() as i64 + offset,
+        libc::SEEK_END => staging.size as i64 + offset,
+        _ => return -libc::EINVAL as i64,
+    };
+    if target < 0 {
+        return -libc::EINVAL as i64;
+    }
+    if staging.seek(target as u64) {
+        target
+    } else {
+        -libc::EIO as i64
+    }
+}
+
+/// Writer thread side: puts chunks on disk
+struct Writer {
+    file: File,
+    /// Second descriptor opened with O_DIRECT, for aligned chunks
+    direct: Option<File>,
+    /// Last chunk whose writeback was started
+    previous: Option<(u64, usize)>,
+}
+
+impl Writer {
+    fn run(
+        mut self,
+        rx: Receiver<Chunk>,
+        free: Sender<ChunkBuf>,
+        error: Arc<Mutex<Option<String>>>,
+    ) {
+        for chunk in rx {
+            if error.lock().is_none() {
+                if let Err(e) = self.write(&chunk) {
+                    tracing::error!("Recording write failed: {}", e);
+                    *error.lock() = Some(e.to_string());
+                }
+            }
+            let _ = free.send(chunk.buf);
+        }
+
+        if let Err(e) = self.file.sync_data() {
+            error.lock().get_or_insert(e.to_string());
+        }
+    }
+
+    fn write(&mut self, chunk: &Chunk) -> std::io::Result<()> {
+        let data = chunk.buf.data();
+        let aligned = chunk.offset % ALIGN as u64 == 0 && data.len() % ALIGN == 0;
+        if let (Some(direct), true) = (&self.direct, aligned) {
+            // Falls back to the page cache if the filesystem refuses
+            if direct.write_all_at(data, chunk.offset).is_ok() {
+                return Ok(());
+            }
+        }
+        self.file.write_all_at(data, chunk.offset)?;
+        self.writeback(chunk.offset, data.len());
+        Ok(())
+    }
+
+    /// Start writeback of this chunk, then wait for the previous one and
+    /// drop it from the page cache
+    fn writeback(&mut self, offset: u64, len: usize) {
+        let fd = self.file.as_raw_fd();
+        // SAFETY: plain syscalls on an open descriptor; failures only cost
+        // the hint
+        unsafe {
+            libc::sync_file_range(
+                fd,
+                offset as libc::off64_t,
+                len as libc::off64_t,
+                libc::SYNC_FILE_RANGE_WRITE,
+            );
+            if let Some((offset, len)) = self.previous.replace((offset, len)) {
+                libc::sync_file_range(
+                    fd,
+                    offset as libc::off64_t,
+                    len as libc::off64_t,
+                    libc::SYNC_FILE_RANGE_WAIT_BEFORE
+                        | libc::SYNC_FILE_RANGE_WRITE
+                        | libc::SYNC_FILE_RANGE_WAIT_AFTER,
+                );
+                libc::posix_fadvise(
+                    fd,
+                    offset as libc::off_t,
+                    len as libc::off_t,
+                    libc::POSIX_FADV_DONTNEED,
+                );
+            }
+        }
+    }
+}
+
+/// File written through a chunking AVIO context and a writer thread
+pub(crate) struct DiskWriter {
+    avio: *mut ffmpeg::ffi::AVIOContext,
+    staging: *mut Staging,
+    thread: Option<JoinHandle<()>>,
+    error: Arc<Mutex<Option<String>>>,
+}
+
+// SAFETY: the AVIO context and staging are only used by whoever owns the
+// writer
+unsafe impl Send for DiskWriter {}
+
+impl DiskWriter {
+    /// Create (or truncate) `path`; `direct_io` writes aligned chunks with
+    /// O_DIRECT where the filesystem supports it
+    pub(crate) fn create(path: &Path, direct_io: bool) -> Result<Self> {
+        let file = OpenOptions::new()
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)
+            .map_err(|e| {
+                Error::FileOutput(format!("Failed to create {}: {}", path.display(), e))
+            })?;
+
+        let direct = if direct_io {
+            match OpenOptions::new()
+                .write(true)
+                .custom_flags(libc::O_DIRECT)
+                .open(path)
+            {
+                Ok(direct) => Some(direct),
+                Err(e) => {
+                    tracing::debug!("Direct I/O unavailable for {}: {}", path.display(), e);
+                    None
+                }
+            }
+        } else {
+            None
+        };
+
+        let (tx, rx) = crossbeam_channel::bounded(CHUNKS_IN_FLIGHT);
+        let (free_tx, free_rx) = crossbeam_channel::unbounded();
+        let error = Arc::new(Mutex::new(None));
+
+        let writer = Writer {
+            file,
+            direct,
+            previous: None,
+        };
+        let thread_error = error.clone();
+        let thread = std::thread::Builder::new()
+            .name("recording-io".into())
+            .spawn(move || {
+                threading::enter(ThreadRole::Io);
+                writer.run(rx, free_tx, thread_error)
+            })
+            .map_err(|e| Error::FileOutput(format!("Failed to start writer thread: {}", e)))?;
+
+        let staging = Box::into_raw(Box::new(Staging {
+            buf: ChunkBuf::new(),
+            offset: 0,
+            size: 0,
+            tx: Some(tx),
+            free: free_rx,
+            error: error.clone(),
+        }));
+        let mut disk = Self {
+            avio: std::ptr::null_mut(),
+            staging,
+            thread: Some(thread),
+            error,
+        };
+
+        unsafe {
+            let buffer = ffmpeg::ffi::av_malloc(AVIO_BUFFER_SIZE) as *mut u8;
+            if buffer.is_null() {
+                return Err(Error::FileOutput("Failed to allocate AVIO buffer".into()));
+            }
+            disk.avio = ffmpeg::ffi::avio_alloc_context(
+                buffer,
+                AVIO_BUFFER_SIZE as c_int,
+                1,
+                staging as *mut c_void,
+                None,
+                Some(write_packet),
+                Some(seek),
+            );
+            if disk.avio.is_null() {
+                ffmpeg::ffi::av_free(buffer as *mut c_void);
+                return Err(Error::FileOutput("Failed to allocate AVIO context".into()));
+            }
+        }
+
+        Ok(disk)
+    }
+
+    /// Output context for `format` that writes through this writer
+    pub(crate) fn open_output(&self, path: &Path, format: &str) -> Result<RecordingOutput> {
+        let url = CString::new(path.to_string_lossy().as_bytes())
+            .map_err(|_| Error::FileOutput(format!("Invalid path: {}", path.display())))?;
+        let format = CString::new(format)
+            .map_err(|_| Error::FileOutput(format!("Invalid format: {}", format)))?;
+
+        unsafe {
+            let mut ctx = std::ptr::null_mut();
+            let ret = ffmpeg::ffi::avformat_alloc_output_context2(
+                &mut ctx,
+                std::ptr::null(),
+                format.as_ptr(),
+                url.as_ptr(),
+            );
+            if ret < 0 {
+                return Err(Error::FileOutput(format!(
+                    "Failed to create output context: {}",
+                    ffmpeg::Error::from(ret)
+                )));
+            }
+            (*ctx).pb = self.avio;
+            (*ctx).flags |= ffmpeg::ffi::AVFMT_FLAG_CUSTOM_IO as c_int;
+            Ok(RecordingOutput(Some(
+                ffmpeg::format::context::Output::wrap(ctx),
+            )))
+        }
+    }
+
+    /// Push everything muxed so far to the writer thread, so a completed
+    /// fragment reaches the disk as a whole
+    pub(crate) fn flush(&mut self) -> Result<()> {
+        // SAFETY: avio and staging live until drop
+        let flushed = unsafe {
+            ffmpeg::ffi::avio_flush(self.avio);
+            (*self.staging).flush()
+        };
+        if flushed {
+            Ok(())
+        } else {
+            Err(self.failure())
+        }
+    }
+
+    /// Write out everything, wait for the data to reach the disk and return
+    /// the file size
+    pub(crate) fn close(mut self) -> Result<u64> {
+        self.shutdown();
+        if self.error.lock().is_some() {
+            return Err(self.failure());
+        }
+        // SAFETY: the writer thread has exited; staging lives until drop
+        Ok(unsafe { (*self.staging).size })
+    }
+
+    fn failure(&self) -> Error {
+        let reason = self
+            .error
+            .lock()
+            .clone()
+            .unwrap_or_else(|| "writer stopped".into());
+        Error::FileOutput(format!("Failed to write recording: {}", reason))
+    }
+
+    fn shutdown(&mut self) {
+        if !self.avio.is_null() {
+            // SAFETY: avio and staging live until drop
+            unsafe {
+                ffmpeg::ffi::avio_flush(self.avio);
+                let staging = &mut *self.staging;
+                let len = staging.buf.len;
+                staging.submit(len);
+                staging.tx = None;
+            }
+        }
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+impl Drop for DiskWriter {
+    fn drop(&mut self) {
+        self.shutdown();
+        // SAFETY: nothing references the context or the staging any more;
+        // a RecordingOutput detaches itself before it is freed
+        unsafe {
+            if !self.avio.is_null() {
+                ffmpeg::ffi::av_freep(&mut (*self.avio).buffer as *mut *mut u8 as *mut c_void);
+                ffmpeg::ffi::avio_context_free(&mut self.avio);
+            }
+            drop(Box::from_raw(self.staging));
+        }
+    }
+}
+
+/// Output context writing through a [`DiskWriter`]
+///
+/// The context does not own its AVIO context: it is detached before the
+/// context is freed, so FFmpeg never tries to close it.
+pub(crate) struct RecordingOutput(Option<ffmpeg::format::context::Output>);
+
+impl Deref for RecordingOutput {
+    type Target = ffmpeg::format::context::Output;
+
+    fn deref(&self) -> &Self::Target {
+        self.0.as_ref().expect("output context")
+    }
+}
+
+impl DerefMut for RecordingOutput {
+    fn deref_mut(&mut self) -> &mut Self::Target {
+        self.0.as_mut().expect("output context")
+    }
+}
+
+impl Drop for RecordingOutput {
+    fn drop(&mut self) {
+        if let Some(mut ctx) = self.0.take() {
+            // SAFETY: the AVIO context belongs to the DiskWriter
+            unsafe { (*ctx.as_mut_ptr()).pb = std::ptr::null_mut() };
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn staging() -> (Staging, Receiver<Chunk>) {
+        let (tx, rx) = crossbeam_channel::unbounded();
+        let (_, free) = crossbeam_channel::unbounded();
+        let staging = Staging {
+            buf: ChunkBuf::new(),
+            offset: 0,
+            size: 0,
+            tx: Some(tx),
+            free,
+            error: Arc::new(Mutex::new(None)),
+        };
+        (staging, rx)
+    }
+
+    #[test]
+    fn test_flush_submits_whole_buffer_and_realigns() {
+        let (mut staging, rx) = staging();
+        assert!(staging.write(&[1; 5000]));
+        assert!(staging.flush());
+
+        let chunk = rx.try_recv().unwrap();
+        assert_eq!((chunk.offset, chunk.buf.len), (0, 5000));
+        assert_eq!((staging.offset, staging.buf.len), (5000, 0));
+
+        // The next full chunk ends on a boundary and the rest carries over
+        assert!(staging.write(&vec![2; CHUNK_SIZE]));
+        let chunk = rx.try_recv().unwrap();
+        let misalign = 5000 % ALIGN;
+        assert_eq!((chunk.offset, chunk.buf.len), (5000, CHUNK_SIZE - misalign));
+        assert_eq!(staging.offset % ALIGN as u64, 0);
+        assert_eq!(staging.buf.len, misalign);
+
+        // A seek back (header patch) ends the chunk where it stands and
+        // chunks realign once writing resumes at the end
+        let end = staging.position();
+        assert!(staging.seek(16));
+        assert!(staging.write(&[3; 8]));
+        assert!(staging.seek(end));
+        let tail = rx.try_recv().unwrap();
+        let patch = rx.try_recv().unwrap();
+        assert_eq!(
+            (tail.offset, tail.buf.len),
+            (end - misalign as u64, misalign)
+        );
+        assert_eq!((patch.offset, patch.buf.data()), (16, &[3u8; 8][..]));
+        assert!(staging.write(&vec![4; CHUNK_SIZE]));
+        let chunk = rx.try_recv().unwrap();
+        assert_eq!(chunk.offset, end);
+        assert_eq!((chunk.offset + chunk.buf.len as u64) % ALIGN as u64, 0);
+        assert_eq!(staging.size, end + CHUNK_SIZE as u64);
+    }
+}
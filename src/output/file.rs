@@ -1,51 +1,161 @@
 //! File output (recording)
 //!
 //! Writes encoded video to MKV, MP4, WebM, or TS files using FFmpeg muxer.
+//! Output goes through a [`DiskWriter`] in large aligned chunks. A
+//! [`Segmentation`] fragments the file (MP4/CMAF, Matroska clusters) so it
+//! survives a crash, and/or rolls over to a new file by time or size so
+//! finished segments can be uploaded while recording continues.
 
 use crate::encode::Codec;
 use crate::error::{Error, Result};
 use crate::types::{CodecParams, Packet};
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use std::sync::atomic::{AtomicU64, Ordering};
 
-use super::{Container, OutputSink};
+use super::diskio::{DiskWriter, RecordingOutput};
+use super::{Container, OutputSink, Segmentation};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::codec::Id as CodecId;
 
+/// `base` with a segment number: `rec.mp4` is followed by `rec-1.mp4`,
+/// `rec-2.mp4`, ...
+pub(crate) fn segment_path(base: &Path, segment: u32) -> PathBuf {
+    let stem = base
+        .file_stem()
+        .map(|s| s.to_string_lossy().into_owned())
+        .unwrap_or_default();
+    let name = match base.extension() {
+        Some(ext) => format!("{}-{}.{}", stem, segment, ext.to_string_lossy()),
+        None => format!("{}-{}", stem, segment),
+    };
+    base.with_file_name(name)
+}
+
 /// File output for recording
 pub struct FileOutput {
+    /// Path of the open file, and the path the recording was started at
     path: PathBuf,
+    base: PathBuf,
     container: Container,
+    segments: Segmentation,
+    direct_io: bool,
     initialized: bool,
     bytes_written: AtomicU64,
-    // FFmpeg muxer
-    output_ctx: Option<ffmpeg::format::context::Output>,
+    // FFmpeg muxer; dropped before the writer it writes through
+    output_ctx: Option<RecordingOutput>,
+    writer: Option<DiskWriter>,
     stream_index: usize,
     time_base: ffmpeg::Rational,
     frame_count: u64,
+    /// Files started after a codec change or roll-over (`name-1.mp4`, ...)
+    segment: u32,
+    /// Codec of the open file, reused when rolling over
+    codec_params: Option<CodecParams>,
+    /// PTS of the first packet of the open file; each file's timestamps
+    /// start there, however late in the process it was opened
+    segment_origin: Option<i64>,
+    segment_bytes: u64,
+    on_segment: Option<Box<dyn Fn(&Path) + Send>>,
 }
 
 impl FileOutput {
     /// Create a new file output
     pub fn new(path: impl Into<PathBuf>, container: Container) -> Self {
+        let path = path.into();
         Self {
-            path: path.into(),
+            base: path.clone(),
+            path,
             container,
+            segments: Segmentation::default(),
+            direct_io: false,
             initialized: false,
             bytes_written: AtomicU64::new(0),
             output_ctx: None,
+            writer: None,
             stream_index: 0,
-            time_base: ffmpeg::Rational::new(1, 1000),
+            time_base: crate::clock::time_base(),
             frame_count: 0,
+            segment: 0,
+            codec_params: None,
+            segment_origin: None,
+            segment_bytes: 0,
+            on_segment: None,
         }
     }
 
+    /// Fragment the recording and/or roll over to new files
+    pub fn with_segments(mut self, segments: Segmentation) -> Self {
+        self.segments = segments;
+        self
+    }
+
+    /// Write aligned chunks with O_DIRECT, bypassing the page cache
+    pub fn with_direct_io(mut self, enabled: bool) -> Self {
+        self.direct_io = enabled;
+        self
+    }
+
+    /// Call `f` with the path of each file once it is complete and on disk
+    /// (e.g. to upload finished segments)
+    pub fn on_segment(mut self, f: impl Fn(&Path) + Send + 'static) -> Self {
+        self.on_segment = Some(Box::new(f));
+        self
+    }
+
     /// Get the output path
     pub fn path(&self) -> &PathBuf {
         &self.path
     }
 
+    /// Path of the next file after a codec change
+    fn next_segment_path(&mut self) -> PathBuf {
+        self.segment += 1;
+        segment_path(&self.base, self.segment)
+    }
+
+    /// Has the current rolling segment reached its time or size limit?
+    fn segment_full(&self, packet: &Packet) -> bool {
+        let Some(origin) = self.segment_origin else {
+            return false;
+        };
+        let elapsed = (packet.dts - origin) as f64 * self.time_base.numerator() as f64
+            / self.time_base.denominator().max(1) as f64;
+        let bytes = self.segment_bytes;
+        let limits = &self.segments;
+        limits.max_secs.is_some_and(|secs| elapsed >= secs as f64)
+            || limits.max_bytes.is_some_and(|max| bytes >= max)
+    }
+
+    /// Close the current segment and continue in the next file
+    async fn roll_over(&mut self) -> Result<()> {
+        let codec_params = self.codec_params.clone();
+        self.finish().await?;
+        self.path = self.next_segment_path();
+        self.frame_count = 0;
+        self.init_with_codec(codec_params.as_ref()).await
+    }
+
+    /// Muxer options for the fragment length
+    fn header_options(&self) -> ffmpeg::Dictionary<'static> {
+        let mut options = ffmpeg::Dictionary::new();
+        if let Some(ms) = self.segments.fragment_ms {
+            match self.container {
+                Container::Mp4 => {
+                    let flags = "+frag_keyframe+empty_moov+default_base_moof+cmaf";
+                    options.set("movflags", flags);
+                    options.set("frag_duration", &(ms as u64 * 1000).to_string());
+                }
+                Container::Matroska | Container::WebM => {
+                    options.set("cluster_time_limit", &ms.to_string());
+                }
+                // Transport streams need no index to play
+                Container::Ts => {}
+            }
+        }
+        options
+    }
+
     /// Map GhostStream codec to FFmpeg codec ID
     fn codec_to_ffmpeg(codec: Codec) -> CodecId {
         match codec {
@@ -68,12 +178,9 @@ impl FileOutput {
             }
         }
 
-        // Create output context with format hint
-        let mut output_ctx = ffmpeg::format::output_as(
-            &self.path,
-            self.container.ffmpeg_format(),
-        )
-        .map_err(|e| Error::FileOutput(format!("Failed to create output context: {}", e)))?;
+        // Create output context with format hint, writing through our own I/O
+        let writer = DiskWriter::create(&self.path, self.direct_io)?;
+        let mut output_ctx = writer.open_output(&self.path, self.container.ffmpeg_format())?;
 
         // Find encoder for codec parameters
         let codec_id = Self::codec_to_ffmpeg(codec_params.codec);
@@ -146,10 +253,12 @@ impl FileOutput {
         stream.set_rate(ffmpeg::Rational::new(fps, 1));
 
         // Write header
-        output_ctx.write_header()
+        output_ctx.write_header_with(self.header_options())
             .map_err(|e| Error::FileOutput(format!("Failed to write header: {}", e)))?;
 
         self.output_ctx = Some(output_ctx);
+        self.writer = Some(writer);
+        self.codec_params = Some(codec_params.clone());
 
         tracing::info!(
             "File output initialized: {} ({}, {:?}, {}x{})",
@@ -192,15 +301,21 @@ impl OutputSink for FileOutput {
             self.init_with_codec(None).await?;
         }
 
+        // Roll over at a keyframe so every segment starts decodable
+        if packet.is_keyframe && self.segment_full(packet) {
+            self.roll_over().await?;
+        }
+        let origin = *self.segment_origin.get_or_insert(packet.pts);
+
         let output_ctx = self.output_ctx.as_mut()
             .ok_or_else(|| Error::FileOutput("Output not initialized".into()))?;
 
         // Create FFmpeg packet
-        let mut pkt = ffmpeg::Packet::copy(&packet.data);
+        let mut pkt = super::wrap_packet(packet)?;
 
         // Set packet properties
-        pkt.set_pts(Some(packet.pts));
-        pkt.set_dts(Some(packet.dts));
+        pkt.set_pts(Some(packet.pts - origin));
+        pkt.set_dts(Some(packet.dts - origin));
         pkt.set_duration(packet.duration);
         pkt.set_stream(self.stream_index);
 
@@ -219,8 +334,16 @@ impl OutputSink for FileOutput {
             .map_err(|e| Error::FileOutput(format!("Failed to write packet: {}", e)))?;
 
         self.frame_count += 1;
+        self.segment_bytes += packet.size() as u64;
         self.bytes_written.fetch_add(packet.size() as u64, Ordering::Relaxed);
 
+        // A keyframe closed the previous fragment: get it on disk
+        if packet.is_keyframe && self.segments.fragment_ms.is_some() {
+            if let Some(writer) = self.writer.as_mut() {
+                writer.flush()?;
+            }
+        }
+
         Ok(())
     }
 
@@ -229,13 +352,27 @@ impl OutputSink for FileOutput {
             return Ok(());
         }
 
-        if let Some(ref mut output_ctx) = self.output_ctx {
-            // Write trailer
-            output_ctx.write_trailer()
-                .map_err(|e| Error::FileOutput(format!("Failed to write trailer: {}", e)))?;
-        }
+        // Write trailer, then wait for the file to reach the disk
+        let trailer = match self.output_ctx.take() {
+            Some(mut output_ctx) => output_ctx
+                .write_trailer()
+                .map_err(|e| Error::FileOutput(format!("Failed to write trailer: {}", e))),
+            None => Ok(()),
+        };
+        let closed = match self.writer.take() {
+            Some(writer) => tokio::task::spawn_blocking(move || writer.close())
+                .await
+                .map_err(|e| Error::FileOutput(format!("Writer thread failed: {}", e)))
+                .and_then(|closed| closed),
+            None => Ok(0),
+        };
+
+        self.initialized = false;
+        self.segment_origin = None;
+        self.segment_bytes = 0;
+        trailer?;
+        let bytes = closed?;
 
-        let bytes = self.bytes_written.load(Ordering::Relaxed);
         tracing::info!(
             "File output finished: {} ({} frames, {} bytes, {:.2} MB)",
             self.path.display(),
@@ -244,11 +381,22 @@ impl OutputSink for FileOutput {
             bytes as f64 / 1_000_000.0
         );
 
-        self.output_ctx = None;
-        self.initialized = false;
+        if let Some(on_segment) = &self.on_segment {
+            on_segment(&self.path);
+        }
         Ok(())
     }
 
+    /// A file cannot change streams midway: close it and continue in the
+    /// next segment file
+    async fn update_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        self.finish().await?;
+        self.path = self.next_segment_path();
+        self.frame_count = 0;
+        tracing::info!("Codec changed, continuing in {}", self.path.display());
+        self.init_with_codec(codec_params).await
+    }
+
     fn bytes_written(&self) -> u64 {
         self.bytes_written.load(Ordering::Relaxed)
     }
@@ -262,6 +410,11 @@ impl Drop for FileOutput {
                 let _ = output_ctx.write_trailer();
             }
         }
+        // Detach the muxer before its writer goes away
+        self.output_ctx = None;
+        if let Some(writer) = self.writer.take() {
+            let _ = writer.close();
+        }
     }
 }
 
@@ -284,4 +437,32 @@ mod tests {
         assert_eq!(Container::WebM.ffmpeg_format(), "webm");
         assert_eq!(Container::Ts.ffmpeg_format(), "mpegts");
     }
+
+    #[test]
+    fn test_rolling_limits() {
+        let segments = Segmentation::rolling(2).with_max_bytes(1_000_000);
+        let mut file = FileOutput::new("/tmp/rec.mp4", Container::Mp4).with_segments(segments);
+        let keyframe = |dts| Packet::new(vec![0; 16], dts, dts, true);
+
+        // No segment open yet
+        assert!(!file.segment_full(&keyframe(5_000_000)));
+
+        file.segment_origin = Some(1_000_000);
+        assert!(!file.segment_full(&keyframe(2_999_999)));
+        assert!(file.segment_full(&keyframe(3_000_000)));
+
+        file.segment_bytes = 1_000_000;
+        assert!(file.segment_full(&keyframe(1_500_000)));
+    }
+
+    #[test]
+    fn test_segment_paths() {
+        let mut file = FileOutput::new("/tmp/take-2.mkv", Container::Matroska);
+        assert_eq!(file.next_segment_path(), PathBuf::from("/tmp/take-2-1.mkv"));
+        assert_eq!(file.next_segment_path(), PathBuf::from("/tmp/take-2-2.mkv"));
+        assert_eq!(
+            segment_path(Path::new("/tmp/raw"), 3),
+            PathBuf::from("/tmp/raw-3")
+        );
+    }
 }
@@ -0,0 +1,94 @@
+//! Send-side link statistics of network outputs
+//!
+//! Streaming sinks record how long each write blocked, how much the muxer
+//! still holds in its I/O buffer and how far their writer queue is
+//! behind. The adaptive bitrate controller samples these to detect uplink
+//! congestion before the connection drops.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+/// Counters shared between a sink and whoever watches it
+#[derive(Debug, Default)]
+pub struct LinkStats {
+    bytes_sent: AtomicU64,
+    writes: AtomicU64,
+    /// Total time spent blocked in writes
+    write_time_us: AtomicU64,
+    /// Bytes accepted by the muxer but not yet handed to the socket
+    buffered_bytes: AtomicU64,
+    /// Packets waiting on the sink's writer queue
+    queued_packets: AtomicU64,
+    packets_dropped: AtomicU64,
+    errors: AtomicU64,
+}
+
+impl LinkStats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Record a completed write of `bytes` that took `elapsed`
+    pub fn record_write(&self, elapsed: Duration, bytes: usize) {
+        self.writes.fetch_add(1, Ordering::Relaxed);
+        self.bytes_sent.fetch_add(bytes as u64, Ordering::Relaxed);
+        self.write_time_us
+            .fetch_add(elapsed.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub fn record_error(&self) {
+        self.errors.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub(crate) fn set_buffered(&self, bytes: u64) {
+        self.buffered_bytes.store(bytes, Ordering::Relaxed);
+    }
+
+    pub(crate) fn set_queued(&self, packets: usize) {
+        self.queued_packets.store(packets as u64, Ordering::Relaxed);
+    }
+
+    pub(crate) fn record_dropped(&self, packets: u64) {
+        self.packets_dropped.fetch_add(packets, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> LinkSnapshot {
+        LinkSnapshot {
+            bytes_sent: self.bytes_sent.load(Ordering::Relaxed),
+            writes: self.writes.load(Ordering::Relaxed),
+            write_time: Duration::from_micros(self.write_time_us.load(Ordering::Relaxed)),
+            buffered_bytes: self.buffered_bytes.load(Ordering::Relaxed),
+            queued_packets: self.queued_packets.load(Ordering::Relaxed),
+            packets_dropped: self.packets_dropped.load(Ordering::Relaxed),
+            errors: self.errors.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Point-in-time copy of [`LinkStats`]
+///
+/// Counters are cumulative; `buffered_bytes` and `queued_packets` are
+/// levels.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LinkSnapshot {
+    pub bytes_sent: u64,
+    pub writes: u64,
+    pub write_time: Duration,
+    pub buffered_bytes: u64,
+    pub queued_packets: u64,
+    pub packets_dropped: u64,
+    pub errors: u64,
+}
+
+/// Bytes the muxer of `ctx` holds in its AVIO buffer
+pub(crate) fn avio_buffered(ctx: &ffmpeg_next::format::context::Output) -> u64 {
+    // SAFETY: pb belongs to the open output context; buf_ptr and buffer
+    // point into the same allocation
+    unsafe {
+        let pb = (*ctx.as_ptr()).pb;
+        if pb.is_null() || (*pb).buffer.is_null() {
+            return 0;
+        }
+        (*pb).buf_ptr.offset_from((*pb).buffer).max(0) as u64
+    }
+}
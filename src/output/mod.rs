@@ -7,21 +7,54 @@
 //! - A/V Muxing
 
 mod camera;
+mod diskio;
 mod file;
+mod link;
 mod muxer;
+mod netio;
+mod replay;
 mod rtmp;
 mod srt;
 
 pub use camera::VirtualCamera;
+pub(crate) use file::segment_path;
 pub use file::FileOutput;
+pub use link::{LinkSnapshot, LinkStats};
 pub use muxer::{AvMuxer, MuxerPacket, StreamType};
+pub use netio::NetworkOutput;
+pub use replay::{ReplayBuffer, ReplayConfig, ReplayHandle};
 pub use rtmp::{RtmpOutput, RtmpService};
 pub use srt::{SrtMode, SrtOutput, SrtStats};
 
-use crate::error::Result;
-use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution};
+use crate::audio::{AudioPacket, AudioParams};
+use crate::error::{Error, Result};
+use crate::metrics::Metrics;
+use crate::types::{CodecParams, Frame, FrameFormat, Packet, PacketData, Resolution};
+
+use ffmpeg_next as ffmpeg;
 use serde::{Deserialize, Serialize};
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+use tokio::sync::{mpsc, oneshot};
+
+/// Packets queued per destination of a [`MultiOutput`] before its
+/// [`DropPolicy`] applies (2s at 60fps)
+const SINK_QUEUE_PACKETS: usize = 120;
+
+/// Queue depth of low-latency destinations: headroom for a late write or
+/// two (~150ms of 60fps video and its audio). A queue that keeps up stays
+/// empty and adds no delay; only a sink already this far behind skips to
+/// the next keyframe.
+pub(crate) const LOW_LATENCY_QUEUE_PACKETS: usize = 16;
+
+/// Backlog a [`DropPolicy::Block`] destination may build before it drops
+/// to the next keyframe after all (30s at 60fps)
+const BLOCK_QUEUE_PACKETS: usize = 1800;
+
+/// Room left on a destination's channel for codec changes, which are
+/// queued whatever the depth
+const SINK_CONTROL_MESSAGES: usize = 8;
 
 /// Output destination configuration
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -38,6 +71,15 @@ pub enum Output {
         path: PathBuf,
         /// Container format
         container: Container,
+        /// Fragmenting and file rotation
+        #[serde(default)]
+        segments: Segmentation,
+        /// Write aligned chunks with O_DIRECT where the filesystem allows
+        #[serde(default)]
+        direct_io: bool,
+        /// Called with the path of each finished file
+        #[serde(skip)]
+        on_segment: Option<SegmentHook>,
     },
 
     /// RTMP streaming (Twitch, YouTube, etc.)
@@ -54,6 +96,10 @@ pub enum Output {
         latency_ms: u32,
     },
 
+    /// In-memory instant replay, saved on demand through its handle
+    #[serde(skip)]
+    Replay(ReplayHandle),
+
     /// Multiple outputs (e.g., record + stream)
     Multiple(Vec<Output>),
 
@@ -69,10 +115,39 @@ impl Output {
 
     /// Create a file output
     pub fn file(path: impl Into<PathBuf>, container: Container) -> Self {
+        Self::segmented_file(path, container, Segmentation::default())
+    }
+
+    /// Create a file output that is fragmented and/or split into segments
+    pub fn segmented_file(
+        path: impl Into<PathBuf>,
+        container: Container,
+        segments: Segmentation,
+    ) -> Self {
         Output::File {
             path: path.into(),
             container,
+            segments,
+            direct_io: false,
+            on_segment: None,
+        }
+    }
+
+    /// Write a file output with direct I/O; other outputs are unchanged
+    pub fn with_direct_io(mut self, enabled: bool) -> Self {
+        if let Output::File { direct_io, .. } = &mut self {
+            *direct_io = enabled;
+        }
+        self
+    }
+
+    /// Call `f` with the path of each file a file output finishes (every
+    /// segment, then the last one at stop); other outputs are unchanged
+    pub fn on_segment(mut self, f: impl Fn(&Path) + Send + Sync + 'static) -> Self {
+        if let Output::File { on_segment, .. } = &mut self {
+            *on_segment = Some(SegmentHook(Arc::new(f)));
         }
+        self
     }
 
     /// Create an RTMP streaming output
@@ -88,6 +163,11 @@ impl Output {
         }
     }
 
+    /// Create an instant replay output
+    pub fn replay(handle: ReplayHandle) -> Self {
+        Output::Replay(handle)
+    }
+
     /// Create a multi-output (record + stream, etc.)
     pub fn multiple(outputs: Vec<Output>) -> Self {
         Output::Multiple(outputs)
@@ -103,6 +183,16 @@ impl Output {
             _ => Output::Multiple(vec![self, other]),
         }
     }
+
+    /// Does this output keep encoded video locally (a file or the replay
+    /// buffer)?
+    pub fn records_locally(&self) -> bool {
+        match self {
+            Output::File { .. } | Output::Replay(_) => true,
+            Output::Multiple(outputs) => outputs.iter().any(Output::records_locally),
+            _ => false,
+        }
+    }
 }
 
 impl Default for Output {
@@ -113,6 +203,22 @@ impl Default for Output {
     }
 }
 
+/// Callback for finished recording files, see [`Output::on_segment`]
+#[derive(Clone)]
+pub struct SegmentHook(Arc<dyn Fn(&Path) + Send + Sync>);
+
+impl SegmentHook {
+    pub(crate) fn call(&self, path: &Path) {
+        (self.0)(path)
+    }
+}
+
+impl std::fmt::Debug for SegmentHook {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str("SegmentHook")
+    }
+}
+
 /// Container format for file output
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize, Default)]
 pub enum Container {
@@ -149,9 +255,62 @@ impl Container {
     }
 }
 
+/// How a recording is laid out on disk
+///
+/// The default is a single file, finalized when the recording stops.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
+pub struct Segmentation {
+    /// Fragment (MP4/CMAF) or cluster (Matroska/WebM) length in ms; the
+    /// file stays playable up to the last fragment if the process dies
+    pub fragment_ms: Option<u32>,
+    /// Start a new file at the first keyframe after this many seconds
+    pub max_secs: Option<u32>,
+    /// Start a new file at the first keyframe after this many bytes
+    pub max_bytes: Option<u64>,
+}
+
+impl Segmentation {
+    /// Fragmented MP4 (CMAF) / Matroska with `fragment_ms` fragments
+    pub fn fragmented(fragment_ms: u32) -> Self {
+        Self {
+            fragment_ms: Some(fragment_ms),
+            ..Default::default()
+        }
+    }
+
+    /// A new file every `secs` seconds
+    pub fn rolling(secs: u32) -> Self {
+        Self {
+            max_secs: Some(secs),
+            ..Default::default()
+        }
+    }
+
+    pub fn with_fragments(mut self, fragment_ms: u32) -> Self {
+        self.fragment_ms = Some(fragment_ms);
+        self
+    }
+
+    pub fn with_max_bytes(mut self, bytes: u64) -> Self {
+        self.max_bytes = Some(bytes);
+        self
+    }
+
+    /// Does the recording roll over to new files?
+    pub fn is_rolling(&self) -> bool {
+        self.max_secs.is_some() || self.max_bytes.is_some()
+    }
+}
+
 /// Trait for output sinks (encoded packets)
 #[async_trait::async_trait]
 pub trait OutputSink: Send {
+    /// Connect ahead of the codec params, so that init only has to write
+    /// the stream header. Sinks without a connection do nothing.
+    async fn prepare(&mut self) -> Result<()> {
+        Ok(())
+    }
+
     /// Initialize the output with optional codec parameters
     async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()>;
 
@@ -166,8 +325,47 @@ pub trait OutputSink: Send {
     /// Flush and finalize
     async fn finish(&mut self) -> Result<()>;
 
+    /// Switch to new codec parameters mid-stream (the encoder was
+    /// replaced); packets that follow use them
+    ///
+    /// The default restarts the output: finish, then init again.
+    async fn update_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        self.finish().await?;
+        self.init_with_codec(codec_params).await
+    }
+
+    /// Drop a connection already known to be broken, skipping the
+    /// trailer and anything else that would wait on the peer; the next
+    /// init connects again. The default finishes the sink.
+    async fn abort(&mut self) -> Result<()> {
+        self.finish().await
+    }
+
     /// Get bytes written
     fn bytes_written(&self) -> u64;
+
+    /// Audio stream that follows through `write_audio`; call before init.
+    /// Sinks without audio ignore it.
+    fn set_audio(&mut self, _params: &AudioParams) {}
+
+    /// Write an encoded audio packet
+    async fn write_audio(&mut self, _packet: &AudioPacket) -> Result<()> {
+        Ok(())
+    }
+
+    /// Trade throughput for latency (realtime tuning): keep queues short
+    /// (`LOW_LATENCY_QUEUE_PACKETS`) and push every packet to the wire as
+    /// soon as it is muxed. Call before init.
+    fn set_low_latency(&mut self, _enabled: bool) {}
+
+    /// Count packets this sink drops in `metrics`
+    fn set_metrics(&mut self, _metrics: Arc<Metrics>) {}
+
+    /// Send-side statistics of the network links behind this sink (empty
+    /// for local outputs)
+    fn link_stats(&self) -> Vec<Arc<LinkStats>> {
+        Vec::new()
+    }
 }
 
 /// Trait for raw frame output sinks (uncompressed frames)
@@ -191,6 +389,22 @@ pub trait RawOutputSink: Send {
     fn bytes_written(&self) -> u64;
 }
 
+fn file_output(
+    path: PathBuf,
+    container: Container,
+    segments: Segmentation,
+    direct_io: bool,
+    on_segment: Option<SegmentHook>,
+) -> FileOutput {
+    let file = FileOutput::new(path, container)
+        .with_segments(segments)
+        .with_direct_io(direct_io);
+    match on_segment {
+        Some(hook) => file.on_segment(move |path| hook.call(path)),
+        None => file,
+    }
+}
+
 /// Create an output sink from configuration
 pub async fn create_output(output: Output) -> Result<Box<dyn OutputSink>> {
     match output {
@@ -198,18 +412,18 @@ pub async fn create_output(output: Output) -> Result<Box<dyn OutputSink>> {
             let camera = VirtualCamera::new(name);
             Ok(Box::new(camera))
         }
-        Output::File { path, container } => {
-            let file = FileOutput::new(path, container);
-            Ok(Box::new(file))
-        }
-        Output::Rtmp { url } => {
-            let rtmp = RtmpOutput::new(url);
-            Ok(Box::new(rtmp))
-        }
-        Output::Srt { url, latency_ms } => {
-            let srt = SrtOutput::new(url, latency_ms);
-            Ok(Box::new(srt))
-        }
+        Output::File {
+            path,
+            container,
+            segments,
+            direct_io,
+            on_segment,
+        } => Ok(Box::new(file_output(
+            path, container, segments, direct_io, on_segment,
+        ))),
+        Output::Rtmp { url } => Ok(Box::new(rtmp_output(url))),
+        Output::Srt { url, latency_ms } => Ok(Box::new(srt_output(url, latency_ms))),
+        Output::Replay(handle) => Ok(Box::new(ReplayBuffer::new(&handle))),
         Output::Multiple(outputs) => {
             let multi = MultiOutput::new(outputs).await?;
             Ok(Box::new(multi))
@@ -218,57 +432,157 @@ pub async fn create_output(output: Output) -> Result<Box<dyn OutputSink>> {
     }
 }
 
+/// RTMP output on its own I/O thread
+fn rtmp_output(url: String) -> NetworkOutput {
+    let rtmp = RtmpOutput::new(url);
+    NetworkOutput::new(format!("RTMP {}", rtmp.url_masked()), Box::new(rtmp))
+}
+
+/// SRT output on its own I/O thread
+fn srt_output(url: String, latency_ms: u32) -> NetworkOutput {
+    let srt = SrtOutput::new(url, latency_ms);
+    NetworkOutput::new(format!("SRT {}", srt.url()), Box::new(srt))
+}
+
+/// What a [`MultiOutput`] destination does when it falls behind
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum DropPolicy {
+    /// Keep queueing, up to `BLOCK_QUEUE_PACKETS`; nothing is lost and
+    /// the others carry on. A destination stalled past that drops to the
+    /// next keyframe, counted like any other drop.
+    Block,
+    /// Drop packets until the next keyframe so the stream stays decodable
+    #[default]
+    SkipToKeyframe,
+}
+
+impl DropPolicy {
+    /// Recordings keep every packet; live destinations drop instead
+    pub fn for_output(output: &Output) -> Self {
+        match output {
+            Output::File { .. } | Output::Replay(_) => DropPolicy::Block,
+            _ => DropPolicy::SkipToKeyframe,
+        }
+    }
+}
+
 /// Multi-output that writes to multiple destinations simultaneously
+///
+/// Each destination runs on its own writer task behind its own queue, so a
+/// slow or stuck one (e.g. an RTMP ingest, a busy disk) never delays the
+/// others: writes here never wait. Packets are shared, not copied, between
+/// destinations.
 pub struct MultiOutput {
-    outputs: Vec<Box<dyn OutputSink>>,
+    sinks: Vec<SinkWorker>,
+    started: bool,
+    /// Packets queued per destination before its policy applies
+    queue: usize,
+    metrics: Option<Arc<Metrics>>,
 }
 
 impl MultiOutput {
     /// Create a multi-output from a list of output configs
     pub async fn new(configs: Vec<Output>) -> Result<Self> {
-        let mut outputs = Vec::with_capacity(configs.len());
+        let mut sinks = Vec::with_capacity(configs.len());
 
         for config in configs {
+            let policy = DropPolicy::for_output(&config);
             // Create each output directly to avoid async recursion
             let output: Box<dyn OutputSink> = match config {
                 Output::VirtualCamera { name } => Box::new(VirtualCamera::new(name)),
-                Output::File { path, container } => Box::new(FileOutput::new(path, container)),
-                Output::Rtmp { url } => Box::new(RtmpOutput::new(url)),
-                Output::Srt { url, latency_ms } => Box::new(SrtOutput::new(url, latency_ms)),
+                Output::File {
+                    path,
+                    container,
+                    segments,
+                    direct_io,
+                    on_segment,
+                } => Box::new(file_output(
+                    path, container, segments, direct_io, on_segment,
+                )),
+                Output::Rtmp { url } => Box::new(rtmp_output(url)),
+                Output::Srt { url, latency_ms } => Box::new(srt_output(url, latency_ms)),
+                Output::Replay(handle) => Box::new(ReplayBuffer::new(&handle)),
                 Output::Multiple(_) => {
                     tracing::warn!("Nested multi-output not supported, skipping");
                     continue;
                 }
                 Output::Null => Box::new(NullOutput::default()),
             };
-            outputs.push(output);
+            sinks.push(SinkWorker::new(sinks.len(), output, policy));
         }
 
-        if outputs.is_empty() {
+        if sinks.is_empty() {
             return Err(crate::error::Error::OutputInit(
                 "No valid outputs in multi-output".into(),
             ));
         }
 
-        tracing::info!("Multi-output created with {} destinations", outputs.len());
-        Ok(Self { outputs })
+        tracing::info!("Multi-output created with {} destinations", sinks.len());
+        Ok(Self {
+            sinks,
+            started: false,
+            queue: SINK_QUEUE_PACKETS,
+            metrics: None,
+        })
+    }
+
+    /// Override the drop policy of destination `index`
+    pub fn set_policy(&mut self, index: usize, policy: DropPolicy) {
+        if let Some(sink) = self.sinks.get_mut(index) {
+            sink.policy = policy;
+        }
+    }
+
+    /// Packets dropped per destination
+    pub fn packets_dropped(&self) -> Vec<u64> {
+        self.sinks.iter().map(|sink| sink.dropped).collect()
     }
 }
 
 #[async_trait::async_trait]
 impl OutputSink for MultiOutput {
+    async fn prepare(&mut self) -> Result<()> {
+        // Destinations connect concurrently; one that fails connects again
+        // at init
+        let connects = self
+            .sinks
+            .iter_mut()
+            .filter_map(|worker| worker.sink.as_mut().map(|sink| (worker.index, sink)))
+            .map(|(index, sink)| async move {
+                if let Err(e) = sink.prepare().await {
+                    tracing::warn!("Output {} did not connect ahead of time: {}", index, e);
+                }
+            });
+        futures::future::join_all(connects).await;
+        Ok(())
+    }
+
     async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
-        let mut errors = Vec::new();
+        // Destinations connect concurrently on their own tasks
+        let pending: Vec<_> = self
+            .sinks
+            .iter_mut()
+            .map(|sink| sink.start(codec_params.cloned(), self.queue, self.metrics.clone()))
+            .collect();
+        self.started = true;
 
-        for (i, output) in self.outputs.iter_mut().enumerate() {
-            if let Err(e) = output.init_with_codec(codec_params).await {
-                tracing::error!("Failed to init output {}: {}", i, e);
+        let mut errors = Vec::new();
+        for (sink, ready) in self.sinks.iter_mut().zip(pending) {
+            let result = match ready {
+                Some(ready) => ready.await.unwrap_or_else(|_| {
+                    Err(Error::OutputInit("Output writer exited during init".into()))
+                }),
+                None => continue,
+            };
+            if let Err(e) = result {
+                tracing::error!("Failed to init output {}: {}", sink.index, e);
+                sink.tx = None;
                 errors.push(e);
             }
         }
 
         // Return first error if all failed
-        if errors.len() == self.outputs.len() && !errors.is_empty() {
+        if errors.len() == self.sinks.len() && !errors.is_empty() {
             return Err(errors.remove(0));
         }
 
@@ -276,12 +590,40 @@ impl OutputSink for MultiOutput {
     }
 
     async fn write(&mut self, packet: &Packet) -> Result<()> {
-        // Write to all outputs, continuing even if some fail
-        for (i, output) in self.outputs.iter_mut().enumerate() {
-            if let Err(e) = output.write(packet).await {
-                tracing::error!("Output {} write error: {}", i, e);
-                // Continue writing to other outputs
-            }
+        if !self.started {
+            self.init_with_codec(None).await?;
+        }
+
+        // Queue to all outputs, continuing even if some fail
+        for sink in &mut self.sinks {
+            sink.send(packet);
+        }
+        Ok(())
+    }
+
+    async fn write_audio(&mut self, packet: &AudioPacket) -> Result<()> {
+        if !self.started {
+            return Ok(());
+        }
+
+        let packet = Arc::new(AudioPacket {
+            data: packet.data.clone(),
+            ..*packet
+        });
+        for sink in &mut self.sinks {
+            sink.send_audio(&packet);
+        }
+        Ok(())
+    }
+
+    async fn update_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        if !self.started {
+            return self.init_with_codec(codec_params).await;
+        }
+
+        // In order with the packets, never dropped
+        for sink in &mut self.sinks {
+            sink.push(SinkMessage::Codec(codec_params.cloned()));
         }
         Ok(())
     }
@@ -289,9 +631,9 @@ impl OutputSink for MultiOutput {
     async fn finish(&mut self) -> Result<()> {
         let mut errors = Vec::new();
 
-        for (i, output) in self.outputs.iter_mut().enumerate() {
-            if let Err(e) = output.finish().await {
-                tracing::error!("Failed to finish output {}: {}", i, e);
+        for sink in &mut self.sinks {
+            if let Err(e) = sink.finish().await {
+                tracing::error!("Failed to finish output {}: {}", sink.index, e);
                 errors.push(e);
             }
         }
@@ -306,8 +648,279 @@ impl OutputSink for MultiOutput {
 
     fn bytes_written(&self) -> u64 {
         // Return max bytes across all outputs (they should all be roughly the same)
-        self.outputs.iter().map(|o| o.bytes_written()).max().unwrap_or(0)
+        self.sinks
+            .iter()
+            .map(|sink| sink.bytes.load(Ordering::Relaxed))
+            .max()
+            .unwrap_or(0)
+    }
+
+    fn set_audio(&mut self, params: &AudioParams) {
+        for sink in self.sinks.iter_mut().filter_map(|s| s.sink.as_mut()) {
+            sink.set_audio(params);
+        }
     }
+
+    fn set_low_latency(&mut self, enabled: bool) {
+        self.queue = if enabled {
+            LOW_LATENCY_QUEUE_PACKETS
+        } else {
+            SINK_QUEUE_PACKETS
+        };
+        for sink in self.sinks.iter_mut().filter_map(|s| s.sink.as_mut()) {
+            sink.set_low_latency(enabled);
+        }
+    }
+
+    fn set_metrics(&mut self, metrics: Arc<Metrics>) {
+        for sink in self.sinks.iter_mut().filter_map(|s| s.sink.as_mut()) {
+            sink.set_metrics(metrics.clone());
+        }
+        self.metrics = Some(metrics);
+    }
+
+    fn link_stats(&self) -> Vec<Arc<LinkStats>> {
+        self.sinks
+            .iter()
+            .filter_map(|sink| sink.link.clone())
+            .collect()
+    }
+}
+
+/// Item on a destination's queue
+enum SinkMessage {
+    Packet(Packet),
+    /// Encoded audio, shared between destinations
+    Audio(Arc<AudioPacket>),
+    /// Codec change ahead of the packets that follow
+    Codec(Option<CodecParams>),
+}
+
+/// One [`MultiOutput`] destination and its writer task
+struct SinkWorker {
+    index: usize,
+    policy: DropPolicy,
+    /// Sink until `start` moves it onto its task
+    sink: Option<Box<dyn OutputSink>>,
+    tx: Option<mpsc::Sender<SinkMessage>>,
+    task: Option<tokio::task::JoinHandle<Result<()>>>,
+    /// Messages on the queue, and the depth at which the policy applies
+    queued: Arc<AtomicUsize>,
+    queue: usize,
+    /// Dropping packets until the next keyframe
+    skipping: bool,
+    /// Backlog past `queue` already reported (Block)
+    behind: bool,
+    dropped: u64,
+    metrics: Option<Arc<Metrics>>,
+    /// Mirrors the sink's `bytes_written`
+    bytes: Arc<AtomicU64>,
+    /// Link of a network sink; also counts this queue's drops
+    link: Option<Arc<LinkStats>>,
+}
+
+impl SinkWorker {
+    fn new(index: usize, sink: Box<dyn OutputSink>, policy: DropPolicy) -> Self {
+        let link = sink.link_stats().into_iter().next();
+        Self {
+            index,
+            policy,
+            link,
+            sink: Some(sink),
+            tx: None,
+            task: None,
+            queued: Arc::new(AtomicUsize::new(0)),
+            queue: SINK_QUEUE_PACKETS,
+            skipping: false,
+            behind: false,
+            dropped: 0,
+            metrics: None,
+            bytes: Arc::new(AtomicU64::new(0)),
+        }
+    }
+
+    /// Spawn the writer task; the receiver reports the sink's init result
+    fn start(
+        &mut self,
+        codec_params: Option<CodecParams>,
+        queue: usize,
+        metrics: Option<Arc<Metrics>>,
+    ) -> Option<oneshot::Receiver<Result<()>>> {
+        let sink = self.sink.take()?;
+        let (tx, rx) = mpsc::channel(BLOCK_QUEUE_PACKETS.max(queue) + SINK_CONTROL_MESSAGES);
+        let (ready_tx, ready_rx) = oneshot::channel();
+        self.tx = Some(tx);
+        self.queue = queue.max(1);
+        self.metrics = metrics;
+        self.task = Some(tokio::spawn(run_sink(
+            sink,
+            codec_params,
+            rx,
+            self.queued.clone(),
+            ready_tx,
+            self.bytes.clone(),
+        )));
+        Some(ready_rx)
+    }
+
+    /// Is the queue at the depth where the policy applies?
+    fn full(&self) -> bool {
+        self.queued.load(Ordering::Relaxed) >= self.queue
+    }
+
+    /// Is the queue past the backlog even `Block` takes?
+    fn overflowing(&self) -> bool {
+        self.queued.load(Ordering::Relaxed) >= BLOCK_QUEUE_PACKETS.max(self.queue)
+    }
+
+    /// Queue a message whatever the depth (up to the channel's room)
+    fn push(&mut self, message: SinkMessage) {
+        let Some(tx) = &self.tx else { return };
+        match tx.try_send(message) {
+            Ok(()) => {
+                self.queued.fetch_add(1, Ordering::Relaxed);
+            }
+            Err(mpsc::error::TrySendError::Full(_)) => {
+                tracing::error!("Output {} queue full, message lost", self.index);
+            }
+            Err(mpsc::error::TrySendError::Closed(_)) => {
+                tracing::error!("Output {} writer stopped", self.index);
+                self.tx = None;
+            }
+        }
+    }
+
+    /// Queue a packet according to the drop policy
+    fn send(&mut self, packet: &Packet) {
+        if self.tx.is_none() {
+            return;
+        }
+        if self.skipping && !packet.is_keyframe {
+            self.record_dropped();
+            return;
+        }
+
+        match (self.policy, self.full()) {
+            (DropPolicy::SkipToKeyframe, true) => {
+                if !self.skipping {
+                    tracing::warn!(
+                        "Output {} falling behind, dropping until the next keyframe",
+                        self.index
+                    );
+                }
+                self.skipping = true;
+                self.record_dropped();
+                return;
+            }
+            (DropPolicy::Block, true) if self.overflowing() => {
+                if !self.skipping {
+                    tracing::warn!(
+                        "Output {} stalled with {} packets queued, dropping until the next keyframe",
+                        self.index,
+                        BLOCK_QUEUE_PACKETS.max(self.queue)
+                    );
+                }
+                self.skipping = true;
+                self.record_dropped();
+                return;
+            }
+            (DropPolicy::Block, true) if !self.behind => {
+                tracing::warn!(
+                    "Output {} is {} packets behind, queueing on",
+                    self.index,
+                    self.queue
+                );
+                self.behind = true;
+            }
+            (DropPolicy::Block, false) => self.behind = false,
+            _ => {}
+        }
+
+        self.skipping = false;
+        self.push(SinkMessage::Packet(packet.clone()));
+    }
+
+    /// Queue an audio packet; live destinations drop it when full,
+    /// recordings once they overflow
+    fn send_audio(&mut self, packet: &Arc<AudioPacket>) {
+        if self.tx.is_none() {
+            return;
+        }
+        let full = match self.policy {
+            DropPolicy::SkipToKeyframe => self.full(),
+            DropPolicy::Block => self.overflowing(),
+        };
+        if full {
+            self.record_dropped();
+            return;
+        }
+        self.push(SinkMessage::Audio(packet.clone()));
+    }
+
+    fn record_dropped(&mut self) {
+        self.dropped += 1;
+        if let Some(link) = &self.link {
+            link.record_dropped(1);
+        }
+        if let Some(metrics) = &self.metrics {
+            metrics.packets_dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Close the queue, let the writer drain it and finish the sink
+    async fn finish(&mut self) -> Result<()> {
+        self.tx = None;
+        if let Some(mut sink) = self.sink.take() {
+            return sink.finish().await;
+        }
+        match self.task.take() {
+            Some(task) => task
+                .await
+                .map_err(|e| Error::Internal(format!("Output writer panicked: {}", e)))?,
+            None => Ok(()),
+        }
+    }
+}
+
+/// Writer task of one destination
+async fn run_sink(
+    mut sink: Box<dyn OutputSink>,
+    codec_params: Option<CodecParams>,
+    mut rx: mpsc::Receiver<SinkMessage>,
+    queued: Arc<AtomicUsize>,
+    ready: oneshot::Sender<Result<()>>,
+    bytes: Arc<AtomicU64>,
+) -> Result<()> {
+    if let Err(e) = sink.init_with_codec(codec_params.as_ref()).await {
+        let _ = ready.send(Err(e));
+        return Ok(());
+    }
+    let _ = ready.send(Ok(()));
+
+    while let Some(message) = rx.recv().await {
+        queued.fetch_sub(1, Ordering::Relaxed);
+        match message {
+            SinkMessage::Packet(packet) => {
+                if let Err(e) = sink.write(&packet).await {
+                    tracing::error!("Output write error: {}", e);
+                    // Keep writing later packets
+                }
+            }
+            SinkMessage::Audio(packet) => {
+                if let Err(e) = sink.write_audio(&packet).await {
+                    tracing::error!("Output audio write error: {}", e);
+                }
+            }
+            SinkMessage::Codec(params) => {
+                if let Err(e) = sink.update_codec(params.as_ref()).await {
+                    tracing::error!("Output codec change failed: {}", e);
+                }
+            }
+        }
+        bytes.store(sink.bytes_written(), Ordering::Relaxed);
+    }
+
+    sink.finish().await
 }
 
 /// Null output (discards all packets)
@@ -335,3 +948,226 @@ impl OutputSink for NullOutput {
         self.bytes
     }
 }
+
+/// Wrap a packet's shared payload as an FFmpeg packet without copying
+///
+/// The AVPacket holds its own reference to the payload. The buffer is
+/// flagged read-only, so muxers that rewrite data (bitstream filters) make
+/// their own copy.
+pub(crate) fn wrap_packet(packet: &Packet) -> Result<ffmpeg::Packet> {
+    let mut pkt = ffmpeg::Packet::empty();
+    unsafe {
+        let padded = packet.data.padded();
+        let opaque = Box::into_raw(Box::new(packet.data.clone()));
+        let buf = ffmpeg::ffi::av_buffer_create(
+            padded.as_ptr() as *mut u8,
+            padded.len(),
+            Some(release_packet_data),
+            opaque as *mut std::ffi::c_void,
+            ffmpeg::ffi::AV_BUFFER_FLAG_READONLY as i32,
+        );
+        if buf.is_null() {
+            drop(Box::from_raw(opaque));
+            return Err(Error::Internal("Failed to wrap packet data".into()));
+        }
+
+        let ptr = pkt.as_mut_ptr();
+        (*ptr).buf = buf;
+        (*ptr).data = (*buf).data;
+        (*ptr).size = packet.data.len() as i32;
+    }
+    Ok(pkt)
+}
+
+/// AVBuffer free callback for [`wrap_packet`]: drops the payload handle
+unsafe extern "C" fn release_packet_data(opaque: *mut std::ffi::c_void, _data: *mut u8) {
+    drop(Box::from_raw(opaque as *mut PacketData));
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_file_options_only_apply_to_files() {
+        let output = Output::file("rec.mkv", Container::Matroska)
+            .with_direct_io(true)
+            .on_segment(|_| {});
+        assert!(matches!(
+            output,
+            Output::File {
+                direct_io: true,
+                on_segment: Some(_),
+                ..
+            }
+        ));
+        assert!(matches!(
+            Output::Null.with_direct_io(true).on_segment(|_| {}),
+            Output::Null
+        ));
+    }
+
+    /// Sink that writes a packet per permit of `gate`
+    struct Gated {
+        gate: Arc<tokio::sync::Semaphore>,
+        written: Arc<AtomicU64>,
+    }
+
+    #[async_trait::async_trait]
+    impl OutputSink for Gated {
+        async fn init_with_codec(&mut self, _codec_params: Option<&CodecParams>) -> Result<()> {
+            Ok(())
+        }
+        async fn write(&mut self, _packet: &Packet) -> Result<()> {
+            self.gate.acquire().await.unwrap().forget();
+            self.written.fetch_add(1, Ordering::Relaxed);
+            Ok(())
+        }
+        async fn finish(&mut self) -> Result<()> {
+            Ok(())
+        }
+        fn bytes_written(&self) -> u64 {
+            0
+        }
+    }
+
+    fn gated(
+        permits: usize,
+    ) -> (
+        Box<dyn OutputSink>,
+        Arc<tokio::sync::Semaphore>,
+        Arc<AtomicU64>,
+    ) {
+        let gate = Arc::new(tokio::sync::Semaphore::new(permits));
+        let written = Arc::new(AtomicU64::new(0));
+        let sink = Gated {
+            gate: gate.clone(),
+            written: written.clone(),
+        };
+        (Box::new(sink), gate, written)
+    }
+
+    fn multi(sinks: Vec<(Box<dyn OutputSink>, DropPolicy)>, queue: usize) -> MultiOutput {
+        MultiOutput {
+            sinks: sinks
+                .into_iter()
+                .enumerate()
+                .map(|(i, (sink, policy))| SinkWorker::new(i, sink, policy))
+                .collect(),
+            started: false,
+            queue,
+            metrics: None,
+        }
+    }
+
+    fn packet(i: i64, gop: i64) -> Packet {
+        Packet::new(vec![0; 16], i, i, i % gop == 0)
+    }
+
+    #[tokio::test]
+    async fn test_stalled_recording_does_not_hold_up_streams() {
+        let (recording, disk, recorded) = gated(0);
+        let (stream, _, streamed) = gated(1000);
+        let mut output = multi(
+            vec![
+                (recording, DropPolicy::Block),
+                (stream, DropPolicy::SkipToKeyframe),
+            ],
+            4,
+        );
+        output.init_with_codec(None).await.unwrap();
+
+        for i in 0..20 {
+            output.write(&packet(i, 10)).await.unwrap();
+            tokio::task::yield_now().await;
+        }
+        assert_eq!(streamed.load(Ordering::Relaxed), 20);
+        assert_eq!(recorded.load(Ordering::Relaxed), 0);
+
+        // The recording catches up without losing anything
+        disk.add_permits(20);
+        output.finish().await.unwrap();
+        assert_eq!(recorded.load(Ordering::Relaxed), 20);
+        assert_eq!(output.packets_dropped(), vec![0, 0]);
+    }
+
+    #[tokio::test]
+    async fn test_stalled_recording_backlog_is_capped() {
+        let (recording, disk, recorded) = gated(0);
+        let mut output = multi(vec![(recording, DropPolicy::Block)], 4);
+        output.init_with_codec(None).await.unwrap();
+
+        // Queued up to the cap, then dropped and counted
+        let cap = BLOCK_QUEUE_PACKETS as i64;
+        for i in 0..cap + 10 {
+            output.write(&packet(i, 10)).await.unwrap();
+        }
+        assert_eq!(output.packets_dropped(), vec![10]);
+
+        // Once drained, the next keyframe resumes the recording
+        disk.add_permits(BLOCK_QUEUE_PACKETS + 1);
+        while recorded.load(Ordering::Relaxed) < cap as u64 {
+            tokio::task::yield_now().await;
+        }
+        output.write(&packet(cap + 10, 10)).await.unwrap();
+        output.finish().await.unwrap();
+        assert_eq!(recorded.load(Ordering::Relaxed), cap as u64 + 1);
+        assert_eq!(output.packets_dropped(), vec![10]);
+    }
+
+    #[tokio::test]
+    async fn test_live_sink_skips_to_keyframe() {
+        let (stream, gate, streamed) = gated(0);
+        let mut output = multi(vec![(stream, DropPolicy::SkipToKeyframe)], 2);
+        let metrics = Arc::new(Metrics::new());
+        output.set_metrics(metrics.clone());
+        output.init_with_codec(None).await.unwrap();
+
+        // Two queued, then dropped until a keyframe finds room
+        for i in 0..6 {
+            output.write(&packet(i, 4)).await.unwrap();
+        }
+        assert_eq!(output.packets_dropped(), vec![4]);
+        assert_eq!(metrics.snapshot().packets_dropped, 4);
+
+        // Audio is dropped, and counted, while the queue is full
+        output
+            .write_audio(&AudioPacket::new(vec![0; 8], 0, 0))
+            .await
+            .unwrap();
+        assert_eq!(output.packets_dropped(), vec![5]);
+
+        gate.add_permits(10);
+        for i in 6..9 {
+            tokio::task::yield_now().await;
+            output.write(&packet(i, 4)).await.unwrap();
+        }
+        output.finish().await.unwrap();
+        // 8 is the keyframe that ends the skip
+        assert_eq!(streamed.load(Ordering::Relaxed), 3);
+        assert_eq!(metrics.snapshot().packets_dropped, 7);
+    }
+
+    #[tokio::test]
+    async fn test_low_latency_queue_rides_out_a_late_write() {
+        let (stream, gate, streamed) = gated(0);
+        let mut output = multi(vec![(stream, DropPolicy::SkipToKeyframe)], 0);
+        output.set_low_latency(true);
+        output.init_with_codec(None).await.unwrap();
+
+        // A stalled write does not cost the rest of the GOP
+        let depth = LOW_LATENCY_QUEUE_PACKETS as i64;
+        for i in 0..depth {
+            output.write(&packet(i, 600)).await.unwrap();
+        }
+        assert_eq!(output.packets_dropped(), vec![0]);
+
+        // Only a sink that stays behind skips
+        output.write(&packet(depth, 600)).await.unwrap();
+        assert_eq!(output.packets_dropped(), vec![1]);
+
+        gate.add_permits(depth as usize);
+        output.finish().await.unwrap();
+        assert_eq!(streamed.load(Ordering::Relaxed), depth as u64);
+    }
+}
@@ -1,6 +1,11 @@
 //! Audio/Video Muxer
 //!
 //! Combines video and audio streams into a single container.
+//!
+//! Both streams are stamped on the pipeline clock ([`crate::clock`]), so
+//! FFmpeg's interleaving queue orders them by capture time. Each stream's
+//! DTS is kept strictly increasing, since drift correction and VFR capture
+//! can otherwise produce a repeated DTS near a correction.
 
 use crate::audio::{AudioParams, AudioPacket};
 use crate::encode::Codec;
@@ -53,6 +58,36 @@ pub struct AvMuxer {
     bytes_written: AtomicU64,
     video_frames: u64,
     audio_frames: u64,
+    /// Last DTS written per stream, in the stream's input time base
+    video_dts: Option<i64>,
+    audio_dts: Option<i64>,
+    /// PTS (pipeline microseconds) of the first video packet; both streams
+    /// are rebased to start there, however late in the process the file
+    /// was opened
+    origin: Option<i64>,
+}
+
+/// Raise `packet`'s DTS above `last` if needed (PTS never below DTS)
+fn monotonic_dts(pkt: &mut ffmpeg::Packet, last: &mut Option<i64>) {
+    let mut dts = pkt.dts().unwrap_or(0);
+    if let Some(last) = *last {
+        dts = dts.max(last + 1);
+    }
+    pkt.set_dts(Some(dts));
+    pkt.set_pts(Some(pkt.pts().unwrap_or(dts).max(dts)));
+    *last = Some(dts);
+}
+
+/// `us` microseconds in ticks of `time_base`
+fn ticks(us: i64, time_base: ffmpeg::Rational) -> i64 {
+    let scale = time_base.numerator().max(1) as i128 * 1_000_000;
+    (us as i128 * time_base.denominator() as i128 / scale) as i64
+}
+
+/// Microseconds of `ticks` in `time_base`
+fn micros(ticks: Option<i64>, time_base: ffmpeg::Rational) -> Option<i64> {
+    let scale = time_base.numerator() as i128 * 1_000_000;
+    ticks.map(|t| (t as i128 * scale / time_base.denominator().max(1) as i128) as i64)
 }
 
 impl AvMuxer {
@@ -68,12 +103,15 @@ impl AvMuxer {
             output_ctx,
             video_stream_index: 0,
             audio_stream_index: None,
-            video_time_base: ffmpeg::Rational::new(1, 1000),
+            video_time_base: crate::clock::time_base(),
             audio_time_base: None,
             initialized: false,
             bytes_written: AtomicU64::new(0),
             video_frames: 0,
             audio_frames: 0,
+            video_dts: None,
+            audio_dts: None,
+            origin: None,
         })
     }
 
@@ -235,11 +273,13 @@ impl AvMuxer {
             return Err(Error::Muxer("Muxer not started".into()));
         }
 
-        let mut pkt = ffmpeg::Packet::copy(&packet.data);
-        pkt.set_pts(Some(packet.pts));
-        pkt.set_dts(Some(packet.dts));
+        let origin = *self.origin.get_or_insert(packet.pts);
+        let mut pkt = super::wrap_packet(packet)?;
+        pkt.set_pts(Some(packet.pts - origin));
+        pkt.set_dts(Some(packet.dts - origin));
         pkt.set_duration(packet.duration);
         pkt.set_stream(self.video_stream_index);
+        monotonic_dts(&mut pkt, &mut self.video_dts);
 
         if packet.is_keyframe {
             pkt.set_flags(ffmpeg::codec::packet::Flags::KEY);
@@ -272,11 +312,21 @@ impl AvMuxer {
         let audio_time_base = self.audio_time_base
             .ok_or_else(|| Error::Muxer("Audio time base not set".into()))?;
 
+        // Audio from before the first video frame falls outside the file
+        let Some(origin) = self.origin else {
+            return Ok(());
+        };
+        let origin = ticks(origin, audio_time_base);
+        if packet.pts < origin {
+            return Ok(());
+        }
+
         let mut pkt = ffmpeg::Packet::copy(&packet.data);
-        pkt.set_pts(Some(packet.pts));
-        pkt.set_dts(Some(packet.dts));
+        pkt.set_pts(Some(packet.pts - origin));
+        pkt.set_dts(Some(packet.dts - origin));
         pkt.set_duration(packet.duration);
         pkt.set_stream(stream_index);
+        monotonic_dts(&mut pkt, &mut self.audio_dts);
 
         // Rescale timestamps
         let stream = self.output_ctx.stream(stream_index)
@@ -318,6 +368,9 @@ impl AvMuxer {
             self.audio_frames,
             bytes as f64 / 1_000_000.0
         );
+        if let Some(skew) = self.skew_us() {
+            tracing::info!("A/V skew at end: {:.1}ms", skew as f64 / 1000.0);
+        }
 
         self.initialized = false;
         Ok(())
@@ -328,6 +381,14 @@ impl AvMuxer {
         self.bytes_written.load(Ordering::Relaxed)
     }
 
+    /// How far the last audio DTS is ahead of the last video DTS, in
+    /// microseconds (None until both streams have written)
+    pub fn skew_us(&self) -> Option<i64> {
+        let video = micros(self.video_dts, self.video_time_base)?;
+        let audio = micros(self.audio_dts, self.audio_time_base?)?;
+        Some(audio - video)
+    }
+
     /// Check if audio is configured
     pub fn has_audio(&self) -> bool {
         self.audio_stream_index.is_some()
@@ -358,3 +419,21 @@ impl Drop for AvMuxer {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_origin_converts_between_time_bases() {
+        let audio = ffmpeg::Rational::new(1, 48_000);
+        // Ten minutes into the process
+        let origin_us = 600_000_000;
+        assert_eq!(ticks(origin_us, audio), 28_800_000);
+        assert_eq!(
+            micros(Some(ticks(origin_us, audio)), audio),
+            Some(origin_us)
+        );
+        assert_eq!(ticks(origin_us, crate::clock::time_base()), origin_us);
+    }
+}
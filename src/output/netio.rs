@@ -0,0 +1,692 @@
+//! Network output I/O
+//!
+//! FFmpeg's network muxing (connect, `write_interleaved`, trailer) blocks.
+//! [`NetworkOutput`] runs a streaming sink on its own I/O thread behind a
+//! bounded packet ring, so a slow or dead ingest never stalls the
+//! pipeline's runtime. When the connection drops, the thread reconnects
+//! in the background and resumes from the last keyframe it buffered.
+//!
+//! Blocking calls are bounded by an AVIO interrupt callback deadline
+//! ([`IoDeadline`]).
+
+use crate::error::{Error, Result};
+use crate::metrics::Metrics;
+use crate::threading::{self, ThreadRole};
+use crate::types::{CodecParams, Packet};
+
+use super::{LinkStats, OutputSink, LOW_LATENCY_QUEUE_PACKETS};
+
+use ffmpeg_next as ffmpeg;
+use std::ffi::{c_int, c_void, CString};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::sync::oneshot;
+
+/// Default limit on a single blocking network call
+pub const DEFAULT_IO_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Packets between the pipeline and the I/O thread (4s at 60fps)
+const RING_PACKETS: usize = 240;
+
+/// Packets kept from the last keyframe while disconnected
+const RESUME_PACKETS: usize = 600;
+
+const RECONNECT_BACKOFF_MIN: Duration = Duration::from_millis(500);
+const RECONNECT_BACKOFF_MAX: Duration = Duration::from_secs(10);
+
+/// Deadline checked by FFmpeg's interrupt callback during blocking I/O
+#[derive(Debug)]
+pub(crate) struct IoDeadline {
+    epoch: Instant,
+    /// Milliseconds after `epoch`, 0 when disarmed
+    deadline_ms: AtomicU64,
+}
+
+impl IoDeadline {
+    pub(crate) fn new() -> Arc<Self> {
+        Arc::new(Self {
+            epoch: Instant::now(),
+            deadline_ms: AtomicU64::new(0),
+        })
+    }
+
+    /// Interrupt blocking calls that run past `timeout` from now
+    pub(crate) fn arm(&self, timeout: Duration) {
+        let deadline = self.epoch.elapsed() + timeout;
+        self.deadline_ms
+            .store((deadline.as_millis() as u64).max(1), Ordering::Relaxed);
+    }
+
+    pub(crate) fn disarm(&self) {
+        self.deadline_ms.store(0, Ordering::Relaxed);
+    }
+
+    fn expired(&self) -> bool {
+        let deadline = self.deadline_ms.load(Ordering::Relaxed);
+        deadline != 0 && self.epoch.elapsed().as_millis() as u64 >= deadline
+    }
+}
+
+unsafe extern "C" fn interrupt_io(opaque: *mut c_void) -> c_int {
+    // SAFETY: opaque is the IoDeadline the owning output keeps alive for
+    // the lifetime of the context
+    let deadline = &*(opaque as *const IoDeadline);
+    deadline.expired() as c_int
+}
+
+/// Open a network output context whose I/O is interruptible by `deadline`
+///
+/// Like `ffmpeg::format::output_as_with`, but with the interrupt callback
+/// installed before the protocol opens, so connect is bounded too. The
+/// caller must keep `deadline` alive as long as the context.
+pub(crate) fn open_output(
+    url: &str,
+    format: &str,
+    options: ffmpeg::Dictionary,
+    deadline: &Arc<IoDeadline>,
+) -> std::result::Result<ffmpeg::format::context::Output, ffmpeg::Error> {
+    use ffmpeg::ffi;
+
+    let url = CString::new(url).map_err(|_| ffmpeg::Error::InvalidData)?;
+    let format = CString::new(format).map_err(|_| ffmpeg::Error::InvalidData)?;
+
+    unsafe {
+        let mut ctx = std::ptr::null_mut();
+        let ret = ffi::avformat_alloc_output_context2(
+            &mut ctx,
+            std::ptr::null(),
+            format.as_ptr(),
+            url.as_ptr(),
+        );
+        if ret < 0 {
+            return Err(ffmpeg::Error::from(ret));
+        }
+
+        (*ctx).interrupt_callback = ffi::AVIOInterruptCB {
+            callback: Some(interrupt_io),
+            opaque: Arc::as_ptr(deadline) as *mut c_void,
+        };
+
+        let mut opts = options.disown();
+        let ret = ffi::avio_open2(
+            &mut (*ctx).pb,
+            url.as_ptr(),
+            ffi::AVIO_FLAG_WRITE as c_int,
+            &(*ctx).interrupt_callback,
+            &mut opts,
+        );
+        ffmpeg::Dictionary::own(opts);
+        if ret < 0 {
+            ffi::avformat_free_context(ctx);
+            return Err(ffmpeg::Error::from(ret));
+        }
+
+        Ok(ffmpeg::format::context::Output::wrap(ctx))
+    }
+}
+
+/// Hand every packet to the protocol as soon as it is muxed: no muxer
+/// delay and an AVIO flush per packet
+pub(crate) fn set_flush_per_packet(ctx: &mut ffmpeg::format::context::Output) {
+    unsafe {
+        let ctx = ctx.as_mut_ptr();
+        (*ctx).flush_packets = 1;
+        (*ctx).max_delay = 0;
+    }
+}
+
+/// Write `packet`, bypassing the interleaving queue when `direct`
+pub(crate) fn write_packet(
+    packet: &ffmpeg::Packet,
+    ctx: &mut ffmpeg::format::context::Output,
+    direct: bool,
+) -> std::result::Result<(), ffmpeg::Error> {
+    if direct {
+        packet.write(ctx).map(|_| ())
+    } else {
+        packet.write_interleaved(ctx)
+    }
+}
+
+/// Item on the I/O ring
+enum IoMessage {
+    Packet(Packet),
+    /// Codec change ahead of the packets that follow
+    Codec(Option<CodecParams>),
+}
+
+/// Streaming sink on a dedicated I/O thread
+///
+/// `write` never blocks: packets go onto a bounded ring, and when the ring
+/// is full they are dropped until the next keyframe. Drops and ring depth
+/// show up in the sink's [`LinkStats`].
+pub struct NetworkOutput {
+    label: String,
+    /// Sink until the I/O thread takes it
+    sink: Option<Box<dyn OutputSink>>,
+    tx: Option<crossbeam_channel::Sender<IoMessage>>,
+    thread: Option<std::thread::JoinHandle<Result<()>>>,
+    link: Option<Arc<LinkStats>>,
+    metrics: Option<Arc<Metrics>>,
+    /// Mirrors the sink's `bytes_written`
+    bytes: Arc<AtomicU64>,
+    /// Dropping packets until the next keyframe
+    skipping: bool,
+    max_reconnects: Option<u32>,
+    /// Ring capacity in packets
+    ring: usize,
+}
+
+impl NetworkOutput {
+    /// Run `sink` on its own I/O thread; `label` names it in logs
+    pub fn new(label: impl Into<String>, sink: Box<dyn OutputSink>) -> Self {
+        let link = sink.link_stats().into_iter().next();
+        Self {
+            label: label.into(),
+            sink: Some(sink),
+            tx: None,
+            thread: None,
+            link,
+            metrics: None,
+            bytes: Arc::new(AtomicU64::new(0)),
+            skipping: false,
+            max_reconnects: None,
+            ring: RING_PACKETS,
+        }
+    }
+
+    /// Give up after `attempts` failed reconnects in a row (default: keep
+    /// trying)
+    pub fn with_max_reconnects(mut self, attempts: u32) -> Self {
+        self.max_reconnects = Some(attempts);
+        self
+    }
+
+    fn record_dropped(&self) {
+        if let Some(link) = &self.link {
+            link.record_dropped(1);
+        }
+        if let Some(metrics) = &self.metrics {
+            metrics.packets_dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+#[async_trait::async_trait]
+impl OutputSink for NetworkOutput {
+    async fn prepare(&mut self) -> Result<()> {
+        let Some(mut sink) = self.sink.take() else {
+            return Ok(());
+        };
+
+        // Connecting blocks; keep it off the runtime
+        let label = self.label.clone();
+        let (sink, result) = tokio::task::spawn_blocking(move || {
+            let result = futures::executor::block_on(sink.prepare());
+            (sink, result)
+        })
+        .await
+        .map_err(|e| Error::Internal(format!("{} connect task failed: {}", label, e)))?;
+        self.sink = Some(sink);
+        result
+    }
+
+    async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        if self.tx.is_some() {
+            return Ok(());
+        }
+        let sink = self
+            .sink
+            .take()
+            .ok_or_else(|| Error::OutputInit(format!("{} already finished", self.label)))?;
+
+        let (tx, rx) = crossbeam_channel::bounded(self.ring);
+        let (ready_tx, ready_rx) = oneshot::channel();
+        let worker = IoWorker {
+            label: self.label.clone(),
+            sink,
+            codec_params: codec_params.cloned(),
+            link: self.link.clone(),
+            metrics: self.metrics.clone(),
+            bytes: self.bytes.clone(),
+            max_reconnects: self.max_reconnects,
+        };
+        let thread = std::thread::Builder::new()
+            .name("ghoststream-net-io".into())
+            .spawn(move || {
+                threading::enter(ThreadRole::Io);
+                worker.run(rx, ready_tx)
+            })
+            .map_err(|e| Error::OutputInit(format!("Failed to spawn I/O thread: {}", e)))?;
+
+        // Connect happens on the I/O thread; only this task waits for it
+        let ready = ready_rx.await.unwrap_or_else(|_| {
+            Err(Error::OutputInit(format!(
+                "{} I/O thread exited during connect",
+                self.label
+            )))
+        });
+        ready?;
+
+        self.tx = Some(tx);
+        self.thread = Some(thread);
+        Ok(())
+    }
+
+    async fn write(&mut self, packet: &Packet) -> Result<()> {
+        if self.tx.is_none() {
+            self.init_with_codec(None).await?;
+        }
+        let tx = self.tx.as_ref().expect("connected above");
+
+        if let Some(link) = &self.link {
+            link.set_queued(tx.len());
+        }
+        if self.skipping && !packet.is_keyframe {
+            self.record_dropped();
+            return Ok(());
+        }
+
+        match tx.try_send(IoMessage::Packet(packet.clone())) {
+            Ok(()) => {
+                self.skipping = false;
+                Ok(())
+            }
+            Err(crossbeam_channel::TrySendError::Full(_)) => {
+                if !self.skipping {
+                    tracing::warn!(
+                        "{} falling behind, dropping until the next keyframe",
+                        self.label
+                    );
+                }
+                self.skipping = true;
+                self.record_dropped();
+                Ok(())
+            }
+            Err(crossbeam_channel::TrySendError::Disconnected(_)) => {
+                self.tx = None;
+                Err(Error::Streaming(format!(
+                    "{} I/O thread stopped",
+                    self.label
+                )))
+            }
+        }
+    }
+
+    async fn update_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        let Some(tx) = &self.tx else {
+            return self.init_with_codec(codec_params).await;
+        };
+
+        // Never dropped: wait for ring space without blocking the runtime
+        let mut message = IoMessage::Codec(codec_params.cloned());
+        loop {
+            match tx.try_send(message) {
+                Ok(()) => return Ok(()),
+                Err(crossbeam_channel::TrySendError::Full(m)) => {
+                    message = m;
+                    tokio::time::sleep(Duration::from_millis(1)).await;
+                }
+                Err(crossbeam_channel::TrySendError::Disconnected(_)) => {
+                    return Err(Error::Streaming(format!(
+                        "{} I/O thread stopped",
+                        self.label
+                    )));
+                }
+            }
+        }
+    }
+
+    async fn finish(&mut self) -> Result<()> {
+        self.tx = None;
+        if let Some(mut sink) = self.sink.take() {
+            return sink.finish().await;
+        }
+        let Some(thread) = self.thread.take() else {
+            return Ok(());
+        };
+
+        // The thread drains the ring and closes the connection
+        tokio::task::spawn_blocking(move || thread.join())
+            .await
+            .map_err(|e| Error::Internal(format!("I/O join failed: {}", e)))?
+            .map_err(|_| Error::Internal("Output I/O thread panicked".into()))?
+    }
+
+    fn bytes_written(&self) -> u64 {
+        self.bytes.load(Ordering::Relaxed)
+    }
+
+    fn set_low_latency(&mut self, enabled: bool) {
+        self.ring = if enabled {
+            LOW_LATENCY_QUEUE_PACKETS
+        } else {
+            RING_PACKETS
+        };
+        if let Some(sink) = &mut self.sink {
+            sink.set_low_latency(enabled);
+        }
+    }
+
+    fn set_metrics(&mut self, metrics: Arc<Metrics>) {
+        self.metrics = Some(metrics);
+    }
+
+    fn link_stats(&self) -> Vec<Arc<LinkStats>> {
+        self.link.iter().cloned().collect()
+    }
+}
+
+/// State of one I/O thread
+struct IoWorker {
+    label: String,
+    sink: Box<dyn OutputSink>,
+    codec_params: Option<CodecParams>,
+    link: Option<Arc<LinkStats>>,
+    metrics: Option<Arc<Metrics>>,
+    bytes: Arc<AtomicU64>,
+    max_reconnects: Option<u32>,
+}
+
+impl IoWorker {
+    /// Connect, then write packets until the ring closes, reconnecting
+    /// with backoff whenever a write fails
+    fn run(
+        mut self,
+        rx: crossbeam_channel::Receiver<IoMessage>,
+        ready: oneshot::Sender<Result<()>>,
+    ) -> Result<()> {
+        use futures::executor::block_on;
+
+        if let Err(e) = block_on(self.sink.init_with_codec(self.codec_params.as_ref())) {
+            let _ = ready.send(Err(e));
+            return Ok(());
+        }
+        let _ = ready.send(Ok(()));
+
+        let mut connected = true;
+        // Packets from the last keyframe on, held while disconnected
+        let mut resume: Vec<Packet> = Vec::new();
+        let mut attempts = 0;
+        let mut backoff = RECONNECT_BACKOFF_MIN;
+        let mut retry_at = Instant::now();
+
+        loop {
+            let message = if connected {
+                match rx.recv() {
+                    Ok(message) => Some(message),
+                    Err(_) => break,
+                }
+            } else {
+                match rx.recv_timeout(retry_at.saturating_duration_since(Instant::now())) {
+                    Ok(message) => Some(message),
+                    Err(crossbeam_channel::RecvTimeoutError::Timeout) => None,
+                    Err(crossbeam_channel::RecvTimeoutError::Disconnected) => break,
+                }
+            };
+
+            match message {
+                Some(IoMessage::Packet(packet)) if connected => {
+                    if let Err(e) = block_on(self.sink.write(&packet)) {
+                        tracing::warn!("{} write failed, reconnecting: {}", self.label, e);
+                        self.disconnect();
+                        connected = false;
+                        retry_at = Instant::now();
+                        backoff = RECONNECT_BACKOFF_MIN;
+                        self.hold(&mut resume, packet);
+                    }
+                }
+                Some(IoMessage::Packet(packet)) => self.hold(&mut resume, packet),
+                Some(IoMessage::Codec(params)) => {
+                    self.codec_params = params;
+                    if connected {
+                        if let Err(e) = block_on(self.sink.update_codec(self.codec_params.as_ref()))
+                        {
+                            tracing::warn!("{} codec change failed: {}", self.label, e);
+                            self.disconnect();
+                            connected = false;
+                            retry_at = Instant::now();
+                        }
+                    } else {
+                        // The held GOP belongs to the old encoder
+                        self.drop_held(&mut resume);
+                    }
+                }
+                None => {}
+            }
+            self.bytes
+                .store(self.sink.bytes_written(), Ordering::Relaxed);
+
+            if connected || Instant::now() < retry_at {
+                continue;
+            }
+            if self.max_reconnects.is_some_and(|max| attempts >= max) {
+                let _ = block_on(self.sink.finish());
+                return Err(Error::Streaming(format!(
+                    "{}: giving up after {} reconnect attempts",
+                    self.label, attempts
+                )));
+            }
+
+            attempts += 1;
+            tracing::info!("Reconnecting {} (attempt {})", self.label, attempts);
+            match block_on(self.sink.init_with_codec(self.codec_params.as_ref())) {
+                Ok(()) => {
+                    tracing::info!(
+                        "{} reconnected, resuming with {} held packets",
+                        self.label,
+                        resume.len()
+                    );
+                    connected = true;
+                    attempts = 0;
+                    for packet in resume.drain(..) {
+                        if let Err(e) = block_on(self.sink.write(&packet)) {
+                            tracing::warn!("{} resume failed: {}", self.label, e);
+                            self.disconnect();
+                            connected = false;
+                            retry_at = Instant::now() + backoff;
+                            break;
+                        }
+                    }
+                }
+                Err(e) => {
+                    tracing::warn!("{} reconnect failed: {}", self.label, e);
+                    retry_at = Instant::now() + backoff;
+                    backoff = (backoff * 2).min(RECONNECT_BACKOFF_MAX);
+                }
+            }
+        }
+
+        block_on(self.sink.finish())
+    }
+
+    /// Close a broken connection so the next init reconnects; no trailer,
+    /// which would only wait out the deadline on a dead link
+    fn disconnect(&mut self) {
+        let _ = futures::executor::block_on(self.sink.abort());
+    }
+
+    /// Keep `packet` for the resume: a keyframe starts a fresh GOP, and
+    /// anything before the first keyframe cannot be decoded
+    fn hold(&self, resume: &mut Vec<Packet>, packet: Packet) {
+        if packet.is_keyframe {
+            self.drop_held(resume);
+        } else if resume.is_empty() || resume.len() >= RESUME_PACKETS {
+            self.drop_held(resume);
+            self.count_dropped(1);
+            return;
+        }
+        resume.push(packet);
+    }
+
+    fn drop_held(&self, resume: &mut Vec<Packet>) {
+        self.count_dropped(resume.len() as u64);
+        resume.clear();
+    }
+
+    fn count_dropped(&self, packets: u64) {
+        if packets == 0 {
+            return;
+        }
+        if let Some(link) = &self.link {
+            link.record_dropped(packets);
+        }
+        if let Some(metrics) = &self.metrics {
+            metrics
+                .packets_dropped
+                .fetch_add(packets, Ordering::Relaxed);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use parking_lot::Mutex;
+
+    #[test]
+    fn test_deadline() {
+        let deadline = IoDeadline::new();
+        assert!(!deadline.expired());
+        deadline.arm(Duration::from_secs(3600));
+        assert!(!deadline.expired());
+        deadline.arm(Duration::ZERO);
+        assert!(deadline.expired());
+        deadline.disarm();
+        assert!(!deadline.expired());
+    }
+
+    /// Sink whose writes fail while `fail` is set (once each), each
+    /// waiting for a `gate` permit if there is one
+    #[derive(Default)]
+    struct Flaky {
+        gate: Option<Arc<tokio::sync::Semaphore>>,
+        fail: Arc<Mutex<Vec<i64>>>,
+        written: Arc<Mutex<Vec<i64>>>,
+        aborts: Arc<AtomicU64>,
+    }
+
+    #[async_trait::async_trait]
+    impl OutputSink for Flaky {
+        async fn init_with_codec(&mut self, _codec_params: Option<&CodecParams>) -> Result<()> {
+            Ok(())
+        }
+        async fn write(&mut self, packet: &Packet) -> Result<()> {
+            if let Some(gate) = &self.gate {
+                gate.acquire().await.unwrap().forget();
+            }
+            let mut fail = self.fail.lock();
+            if let Some(i) = fail.iter().position(|&pts| pts == packet.pts) {
+                fail.remove(i);
+                return Err(Error::Streaming("broken pipe".into()));
+            }
+            self.written.lock().push(packet.pts);
+            Ok(())
+        }
+        async fn abort(&mut self) -> Result<()> {
+            self.aborts.fetch_add(1, Ordering::Relaxed);
+            Ok(())
+        }
+        async fn finish(&mut self) -> Result<()> {
+            Ok(())
+        }
+        fn bytes_written(&self) -> u64 {
+            0
+        }
+    }
+
+    fn worker(sink: Flaky) -> (IoWorker, Arc<LinkStats>) {
+        let link = Arc::new(LinkStats::new());
+        let worker = IoWorker {
+            label: "test".into(),
+            sink: Box::new(sink),
+            codec_params: None,
+            link: Some(link.clone()),
+            metrics: None,
+            bytes: Arc::new(AtomicU64::new(0)),
+            max_reconnects: None,
+        };
+        (worker, link)
+    }
+
+    fn packet(pts: i64, is_keyframe: bool) -> Packet {
+        Packet::new(vec![0; 8], pts, pts, is_keyframe)
+    }
+
+    #[test]
+    fn test_hold_keeps_the_last_gop() {
+        let (worker, link) = worker(Flaky::default());
+        let dropped = || link.snapshot().packets_dropped;
+        let mut resume = Vec::new();
+
+        // Nothing before the first keyframe can be decoded
+        worker.hold(&mut resume, packet(0, false));
+        assert!(resume.is_empty());
+        assert_eq!(dropped(), 1);
+
+        worker.hold(&mut resume, packet(1, true));
+        worker.hold(&mut resume, packet(2, false));
+        assert_eq!(resume.len(), 2);
+
+        // A new keyframe replaces the held GOP
+        worker.hold(&mut resume, packet(3, true));
+        assert_eq!(resume.iter().map(|p| p.pts).collect::<Vec<_>>(), vec![3]);
+        assert_eq!(dropped(), 3);
+
+        // A GOP too long to hold is given up
+        for pts in 4..4 + RESUME_PACKETS as i64 {
+            worker.hold(&mut resume, packet(pts, false));
+        }
+        assert!(resume.is_empty());
+        assert_eq!(dropped(), 3 + RESUME_PACKETS as u64 + 1);
+    }
+
+    #[test]
+    fn test_broken_link_is_aborted_and_resumed() {
+        let sink = Flaky::default();
+        let (fail, written, aborts) =
+            (sink.fail.clone(), sink.written.clone(), sink.aborts.clone());
+        fail.lock().push(1);
+        let (worker, link) = worker(sink);
+
+        let (tx, rx) = crossbeam_channel::unbounded();
+        let (ready_tx, _ready) = oneshot::channel();
+        for (pts, key) in [(0, true), (1, false), (2, true), (3, false)] {
+            tx.send(IoMessage::Packet(packet(pts, key))).unwrap();
+        }
+        drop(tx);
+        worker.run(rx, ready_tx).unwrap();
+
+        // The failed write dropped its (undecodable) packet, the link was
+        // closed without a trailer and writing went on after reconnecting
+        assert_eq!(aborts.load(Ordering::Relaxed), 1);
+        assert_eq!(*written.lock(), vec![0, 2, 3]);
+        assert_eq!(link.snapshot().packets_dropped, 1);
+    }
+
+    #[tokio::test]
+    async fn test_low_latency_ring_rides_out_a_late_write() {
+        let gate = Arc::new(tokio::sync::Semaphore::new(0));
+        let sink = Flaky {
+            gate: Some(gate.clone()),
+            ..Default::default()
+        };
+        let written = sink.written.clone();
+        let metrics = Arc::new(Metrics::new());
+        let mut output = NetworkOutput::new("test", Box::new(sink));
+        output.set_low_latency(true);
+        output.set_metrics(metrics.clone());
+        output.init_with_codec(None).await.unwrap();
+
+        let depth = LOW_LATENCY_QUEUE_PACKETS as i64;
+        for pts in 0..depth {
+            output.write(&packet(pts, pts == 0)).await.unwrap();
+        }
+        assert_eq!(metrics.snapshot().packets_dropped, 0);
+
+        gate.add_permits(depth as usize);
+        output.finish().await.unwrap();
+        assert_eq!(written.lock().len(), depth as usize);
+    }
+}
@@ -0,0 +1,650 @@
+//! Instant replay
+//!
+//! [`ReplayBuffer`] keeps the last N seconds of encoded video and audio in
+//! memory, one GOP per entry, so the oldest is evicted whole and every clip
+//! starts on a keyframe. Payloads live in fixed-size slabs preallocated up
+//! front, which caps memory whatever the bitrate; an evicted GOP hands its
+//! slabs straight back. [`ReplayHandle::save`] dumps the buffer through an
+//! [`AvMuxer`] on a blocking thread while encoding carries on; requests are
+//! served by a task of the buffer's own, not from the write path.
+
+use super::{AvMuxer, Container, OutputSink, StreamType};
+use crate::audio::{AudioPacket, AudioParams};
+use crate::error::{Error, Result};
+use crate::types::{CodecParams, Packet};
+
+use parking_lot::Mutex;
+use std::collections::VecDeque;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use tokio::sync::{mpsc, oneshot};
+
+/// Payload slab size
+const SLAB_SIZE: usize = 1 << 20;
+
+/// Replay buffer settings
+#[derive(Debug, Clone, Copy)]
+pub struct ReplayConfig {
+    /// Seconds of video kept
+    pub seconds: u32,
+    /// Payload memory, allocated up front
+    pub max_bytes: usize,
+    /// Container of saved clips
+    pub container: Container,
+}
+
+impl Default for ReplayConfig {
+    fn default() -> Self {
+        Self {
+            seconds: 30,
+            // 30s at 60 Mbps
+            max_bytes: 256 << 20,
+            container: Container::Mp4,
+        }
+    }
+}
+
+impl ReplayConfig {
+    pub fn new(seconds: u32) -> Self {
+        Self {
+            seconds,
+            ..Default::default()
+        }
+    }
+
+    pub fn with_max_bytes(mut self, bytes: usize) -> Self {
+        self.max_bytes = bytes;
+        self
+    }
+
+    pub fn with_container(mut self, container: Container) -> Self {
+        self.container = container;
+        self
+    }
+}
+
+struct SaveRequest {
+    path: PathBuf,
+    reply: oneshot::Sender<Result<PathBuf>>,
+}
+
+/// Trigger for a [`ReplayBuffer`]; cheap to clone
+#[derive(Clone)]
+pub struct ReplayHandle {
+    config: ReplayConfig,
+    tx: mpsc::UnboundedSender<SaveRequest>,
+    /// Taken by the buffer serving this handle
+    rx: Arc<Mutex<Option<mpsc::UnboundedReceiver<SaveRequest>>>>,
+}
+
+impl std::fmt::Debug for ReplayHandle {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("ReplayHandle")
+            .field("config", &self.config)
+            .finish()
+    }
+}
+
+impl ReplayHandle {
+    pub fn new(config: ReplayConfig) -> Self {
+        let (tx, rx) = mpsc::unbounded_channel();
+        Self {
+            config,
+            tx,
+            rx: Arc::new(Mutex::new(Some(rx))),
+        }
+    }
+
+    pub fn config(&self) -> ReplayConfig {
+        self.config
+    }
+
+    /// Write what is buffered to `path`; returns once the clip is complete
+    pub async fn save(&self, path: impl Into<PathBuf>) -> Result<PathBuf> {
+        let (reply, done) = oneshot::channel();
+        let request = SaveRequest {
+            path: path.into(),
+            reply,
+        };
+        self.tx
+            .send(request)
+            .map_err(|_| Error::Replay("Replay buffer is not running".into()))?;
+        done.await
+            .map_err(|_| Error::Replay("Replay buffer stopped before saving".into()))?
+    }
+}
+
+/// Preallocated payload slabs, shared by the buffer and clips being saved
+struct SlabPool {
+    free: Mutex<Vec<Box<[u8]>>>,
+}
+
+impl SlabPool {
+    fn new(count: usize) -> Arc<Self> {
+        let free = (0..count)
+            .map(|_| vec![0u8; SLAB_SIZE].into_boxed_slice())
+            .collect();
+        Arc::new(Self {
+            free: Mutex::new(free),
+        })
+    }
+
+    fn take(self: &Arc<Self>) -> Option<Slab> {
+        let data = self.free.lock().pop()?;
+        Some(Slab {
+            data,
+            pool: self.clone(),
+        })
+    }
+}
+
+/// A slab checked out of the pool; returns to it when dropped
+struct Slab {
+    data: Box<[u8]>,
+    pool: Arc<SlabPool>,
+}
+
+impl Drop for Slab {
+    fn drop(&mut self) {
+        let data = std::mem::take(&mut self.data);
+        self.pool.free.lock().push(data);
+    }
+}
+
+/// Where a packet's payload sits in its GOP
+#[derive(Debug, Clone, Copy)]
+struct Entry {
+    stream: StreamType,
+    offset: usize,
+    len: usize,
+    pts: i64,
+    dts: i64,
+    duration: i64,
+    keyframe: bool,
+}
+
+impl Entry {
+    fn video(packet: &Packet) -> Self {
+        Self {
+            stream: StreamType::Video,
+            offset: 0,
+            len: packet.size(),
+            pts: packet.pts,
+            dts: packet.dts,
+            duration: packet.duration,
+            keyframe: packet.is_keyframe,
+        }
+    }
+
+    fn audio(packet: &AudioPacket) -> Self {
+        Self {
+            stream: StreamType::Audio,
+            offset: 0,
+            len: packet.size(),
+            pts: packet.pts,
+            dts: packet.dts,
+            duration: packet.duration,
+            keyframe: false,
+        }
+    }
+}
+
+/// Packets from one keyframe up to the next, payloads back to back across
+/// its slabs
+struct Gop {
+    slabs: Vec<Slab>,
+    len: usize,
+    packets: Vec<Entry>,
+    /// Video PTS of the opening keyframe
+    start: i64,
+    /// Opens on a keyframe; false for the rest of a GOP frozen by a save
+    keyframe: bool,
+}
+
+impl Gop {
+    fn new(start: i64, keyframe: bool) -> Self {
+        Self {
+            slabs: Vec::new(),
+            len: 0,
+            packets: Vec::new(),
+            start,
+            keyframe,
+        }
+    }
+
+    /// Append a payload; false if the pool cannot hold it
+    fn push(&mut self, pool: &Arc<SlabPool>, mut entry: Entry, data: &[u8]) -> bool {
+        let needed = (self.len + data.len()).div_ceil(SLAB_SIZE);
+        let mut slabs = Vec::with_capacity(needed.saturating_sub(self.slabs.len()));
+        for _ in self.slabs.len()..needed {
+            match pool.take() {
+                Some(slab) => slabs.push(slab),
+                // Dropping `slabs` hands them back
+                None => return false,
+            }
+        }
+        self.slabs.append(&mut slabs);
+
+        entry.offset = self.len;
+        let mut rest = data;
+        while !rest.is_empty() {
+            let slab = &mut self.slabs[self.len / SLAB_SIZE].data;
+            let at = self.len % SLAB_SIZE;
+            let n = rest.len().min(SLAB_SIZE - at);
+            slab[at..at + n].copy_from_slice(&rest[..n]);
+            self.len += n;
+            rest = &rest[n..];
+        }
+        self.packets.push(entry);
+        true
+    }
+
+    fn payload(&self, entry: &Entry) -> Vec<u8> {
+        let mut data = Vec::with_capacity(entry.len);
+        let mut at = entry.offset;
+        while data.len() < entry.len {
+            let slab = &self.slabs[at / SLAB_SIZE].data;
+            let start = at % SLAB_SIZE;
+            let n = (entry.len - data.len()).min(SLAB_SIZE - start);
+            data.extend_from_slice(&slab[start..start + n]);
+            at += n;
+        }
+        data
+    }
+}
+
+/// Output that keeps the last seconds of the stream for instant replay
+pub struct ReplayBuffer {
+    store: Arc<Mutex<Store>>,
+    requests: Option<mpsc::UnboundedReceiver<SaveRequest>>,
+    server: Option<tokio::task::JoinHandle<()>>,
+}
+
+/// What the buffer holds, shared with the task serving saves
+struct Store {
+    config: ReplayConfig,
+    pool: Arc<SlabPool>,
+    /// Closed GOPs, oldest first; clips being saved hold their own refs
+    gops: VecDeque<Arc<Gop>>,
+    /// GOP being filled; None until the first keyframe
+    current: Option<Gop>,
+    video: Option<CodecParams>,
+    audio: Option<AudioParams>,
+    bytes: u64,
+}
+
+impl ReplayBuffer {
+    /// Buffer serving `handle`; allocates its memory cap up front
+    pub fn new(handle: &ReplayHandle) -> Self {
+        let config = handle.config;
+        let requests = handle.rx.lock().take();
+        if requests.is_none() {
+            tracing::warn!("Replay handle already has a buffer; saves go to the first one");
+        }
+        Self {
+            store: Arc::new(Mutex::new(Store::new(config))),
+            requests,
+            server: None,
+        }
+    }
+
+    /// Seconds buffered, from the oldest keyframe to the newest packet
+    pub fn buffered_secs(&self) -> f64 {
+        self.store.lock().buffered_secs()
+    }
+
+    /// Start the task answering save requests
+    fn serve(&mut self) {
+        let Some(mut requests) = self.requests.take() else {
+            return;
+        };
+        let store = self.store.clone();
+        self.server = Some(tokio::spawn(async move {
+            while let Some(request) = requests.recv().await {
+                store.lock().save(request);
+            }
+        }));
+    }
+
+    /// Stop serving saves; requests still queued are answered with an error
+    async fn stop_serving(&mut self) {
+        if let Some(server) = self.server.take() {
+            server.abort();
+            let _ = server.await;
+        }
+    }
+}
+
+impl Drop for ReplayBuffer {
+    fn drop(&mut self) {
+        if let Some(server) = &self.server {
+            server.abort();
+        }
+    }
+}
+
+impl Store {
+    fn new(config: ReplayConfig) -> Self {
+        let slabs = (config.max_bytes / SLAB_SIZE).max(1);
+        tracing::info!(
+            "Replay buffer: {}s in up to {} MB",
+            config.seconds,
+            (slabs * SLAB_SIZE) >> 20
+        );
+        Self {
+            config,
+            pool: SlabPool::new(slabs),
+            gops: VecDeque::new(),
+            current: None,
+            video: None,
+            audio: None,
+            bytes: 0,
+        }
+    }
+
+    fn buffered_secs(&self) -> f64 {
+        let start = self.gops.front().map(|gop| gop.start);
+        let end = self
+            .current
+            .as_ref()
+            .and_then(|gop| {
+                gop.packets
+                    .iter()
+                    .rev()
+                    .find(|e| e.stream == StreamType::Video)
+            })
+            .map(|entry| entry.pts);
+        match (start, end) {
+            (Some(start), Some(end)) => self.seconds(end - start),
+            _ => 0.0,
+        }
+    }
+
+    fn seconds(&self, ticks: i64) -> f64 {
+        let (num, den) = self
+            .video
+            .as_ref()
+            .map_or((1, crate::clock::TICKS_PER_SEC), |p| {
+                (p.time_base_num, p.time_base_den)
+            });
+        ticks as f64 * num as f64 / den.max(1) as f64
+    }
+
+    fn push_video(&mut self, packet: &Packet) {
+        if packet.is_keyframe {
+            if let Some(gop) = self.current.take() {
+                self.gops.push_back(Arc::new(gop));
+            }
+            self.current = Some(Gop::new(packet.pts, true));
+            self.trim(packet.pts);
+        }
+        self.store(Entry::video(packet), &packet.data);
+    }
+
+    fn push_audio(&mut self, packet: &AudioPacket) {
+        self.store(Entry::audio(packet), &packet.data);
+    }
+
+    fn store(&mut self, entry: Entry, data: &[u8]) {
+        loop {
+            // Nothing is kept before the first keyframe
+            let Some(gop) = self.current.as_mut() else {
+                return;
+            };
+            if gop.push(&self.pool, entry, data) {
+                self.bytes += data.len() as u64;
+                return;
+            }
+            if !self.evict_oldest() {
+                tracing::warn!(
+                    "Replay buffer smaller than one GOP, dropping until the next keyframe"
+                );
+                self.current = None;
+                return;
+            }
+        }
+    }
+
+    /// Drop GOPs the window no longer needs
+    fn trim(&mut self, now: i64) {
+        let window = self.config.seconds as f64;
+        while let Some(next) = self.gops.iter().skip(1).find(|gop| gop.keyframe) {
+            if self.seconds(now - next.start) < window {
+                break;
+            }
+            self.evict_oldest();
+        }
+    }
+
+    /// Drop the oldest GOP, with the rest of it frozen by saves
+    fn evict_oldest(&mut self) -> bool {
+        if self.gops.pop_front().is_none() {
+            return false;
+        }
+        while self.gops.front().is_some_and(|gop| !gop.keyframe) {
+            self.gops.pop_front();
+        }
+        // The open GOP may continue one just evicted
+        if self.gops.is_empty() && self.current.as_ref().is_some_and(|gop| !gop.keyframe) {
+            self.current = None;
+        }
+        true
+    }
+
+    /// Snapshot the buffer and write it out on a blocking thread
+    fn save(&mut self, request: SaveRequest) {
+        // Freeze the open GOP so the clip runs up to now
+        if let Some(gop) = self.current.take() {
+            let start = gop.start;
+            self.gops.push_back(Arc::new(gop));
+            self.current = Some(Gop::new(start, false));
+        }
+
+        let Some(video) = self.video.clone() else {
+            let _ = request
+                .reply
+                .send(Err(Error::Replay("No video stream yet".into())));
+            return;
+        };
+        let clip = Clip {
+            gops: self.gops.iter().cloned().collect(),
+            video,
+            audio: self.audio.clone(),
+            container: self.config.container,
+        };
+        tracing::info!(
+            "Saving replay ({:.1}s) to {}",
+            self.buffered_secs(),
+            request.path.display()
+        );
+
+        tokio::task::spawn_blocking(move || {
+            let result = clip.write(&request.path).map(|()| request.path.clone());
+            if let Err(e) = &result {
+                tracing::error!("Replay save failed: {}", e);
+            }
+            let _ = request.reply.send(result);
+        });
+    }
+
+    fn clear(&mut self) {
+        self.gops.clear();
+        self.current = None;
+    }
+}
+
+#[async_trait::async_trait]
+impl OutputSink for ReplayBuffer {
+    async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        self.store.lock().video = Some(codec_params.cloned().unwrap_or_default());
+        self.serve();
+        Ok(())
+    }
+
+    async fn write(&mut self, packet: &Packet) -> Result<()> {
+        self.store.lock().push_video(packet);
+        Ok(())
+    }
+
+    async fn write_audio(&mut self, packet: &AudioPacket) -> Result<()> {
+        self.store.lock().push_audio(packet);
+        Ok(())
+    }
+
+    fn set_audio(&mut self, params: &AudioParams) {
+        self.store.lock().audio = Some(params.clone());
+    }
+
+    /// Buffered GOPs no longer match the stream: start over
+    async fn update_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
+        let mut store = self.store.lock();
+        store.clear();
+        store.video = Some(codec_params.cloned().unwrap_or_default());
+        Ok(())
+    }
+
+    async fn finish(&mut self) -> Result<()> {
+        self.stop_serving().await;
+        self.store.lock().clear();
+        Ok(())
+    }
+
+    fn bytes_written(&self) -> u64 {
+        self.store.lock().bytes
+    }
+}
+
+/// GOPs captured by a save
+struct Clip {
+    gops: Vec<Arc<Gop>>,
+    video: CodecParams,
+    audio: Option<AudioParams>,
+    container: Container,
+}
+
+impl Clip {
+    fn write(&self, path: &Path) -> Result<()> {
+        let first = self
+            .gops
+            .iter()
+            .flat_map(|gop| gop.packets.iter())
+            .find(|entry| entry.stream == StreamType::Video)
+            .ok_or_else(|| Error::Replay("Nothing buffered yet".into()))?;
+
+        let mut muxer = AvMuxer::new(path, self.container.ffmpeg_format())?;
+        muxer.add_video_stream(&self.video)?;
+        if let Some(audio) = &self.audio {
+            muxer.add_audio_stream(audio)?;
+        }
+        muxer.start()?;
+
+        // The clip starts at zero on its first keyframe; audio follows on
+        // the same clock
+        let video_origin = first.dts;
+        let origin_secs = video_origin as f64 * self.video.time_base_num as f64
+            / self.video.time_base_den.max(1) as f64;
+        let audio_origin = self
+            .audio
+            .as_ref()
+            .map_or(0, |audio| (origin_secs * audio.sample_rate as f64) as i64);
+
+        for gop in &self.gops {
+            for entry in &gop.packets {
+                match entry.stream {
+                    StreamType::Video => {
+                        let mut packet = Packet::new(
+                            gop.payload(entry),
+                            entry.pts - video_origin,
+                            entry.dts - video_origin,
+                            entry.keyframe,
+                        );
+                        packet.duration = entry.duration;
+                        muxer.write_video(&packet)?;
+                    }
+                    StreamType::Audio if muxer.has_audio() && entry.pts >= audio_origin => {
+                        let mut packet = AudioPacket::new(
+                            gop.payload(entry),
+                            entry.pts - audio_origin,
+                            entry.dts - audio_origin,
+                        );
+                        packet.duration = entry.duration;
+                        muxer.write_audio(&packet)?;
+                    }
+                    StreamType::Audio => {}
+                }
+            }
+        }
+
+        muxer.finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn buffer(config: ReplayConfig) -> Store {
+        let mut store = Store::new(config);
+        store.video = Some(CodecParams::default());
+        store
+    }
+
+    fn keyframe(pts: i64, size: usize) -> Packet {
+        Packet::new(vec![pts as u8; size], pts, pts, true)
+    }
+
+    #[test]
+    fn test_window_evicts_whole_gops() {
+        let mut replay = buffer(ReplayConfig::new(2).with_max_bytes(4 << 20));
+        for pts in [0, 1_000_000, 2_000_000, 3_000_000] {
+            replay.push_video(&keyframe(pts, 100));
+            let delta = pts + 500_000;
+            replay.push_video(&Packet::new(vec![0; 10], delta, delta, false));
+        }
+
+        // 1s and 2s still cover the last two seconds
+        let starts: Vec<i64> = replay.gops.iter().map(|gop| gop.start).collect();
+        assert_eq!(starts, vec![1_000_000, 2_000_000]);
+        assert_eq!(replay.buffered_secs(), 2.5);
+    }
+
+    #[test]
+    fn test_memory_cap() {
+        let mut replay = buffer(ReplayConfig::new(60).with_max_bytes(3 * SLAB_SIZE));
+
+        // Each GOP needs two of the three slabs
+        let big = SLAB_SIZE + SLAB_SIZE / 2;
+        replay.push_video(&keyframe(0, big));
+        replay.push_video(&keyframe(1_000_000, big));
+        let starts: Vec<i64> = replay.gops.iter().map(|gop| gop.start).collect();
+        assert!(starts.is_empty());
+
+        let gop = replay.current.as_ref().unwrap();
+        assert_eq!(gop.start, 1_000_000);
+        assert_eq!(gop.payload(&gop.packets[0]), vec![1_000_000i64 as u8; big]);
+
+        // Larger than the whole buffer: skipped until the next keyframe
+        replay.push_video(&keyframe(2_000_000, 4 * SLAB_SIZE));
+        assert!(replay.current.is_none());
+        assert_eq!(replay.pool.free.lock().len(), 3);
+    }
+
+    #[tokio::test]
+    async fn test_save_is_served_without_writes() {
+        let handle = ReplayHandle::new(ReplayConfig::new(10));
+        let mut replay = ReplayBuffer::new(&handle);
+        replay.init_with_codec(None).await.unwrap();
+
+        // Answered by the buffer's own task, with nothing written
+        let saved = tokio::time::timeout(
+            std::time::Duration::from_secs(5),
+            handle.save(std::env::temp_dir().join("ghoststream-replay-test.mkv")),
+        )
+        .await
+        .expect("save request not served");
+        assert!(matches!(saved, Err(Error::Replay(_))));
+
+        replay.finish().await.unwrap();
+        assert!(handle.save("unused.mkv").await.is_err());
+    }
+}
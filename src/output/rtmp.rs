@@ -6,8 +6,11 @@ use crate::encode::Codec;
 use crate::error::{Error, Result};
 use crate::types::{CodecParams, Packet};
 use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
-use super::OutputSink;
+use super::netio::{self, IoDeadline};
+use super::{LinkStats, OutputSink};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::codec::Id as CodecId;
@@ -19,6 +22,8 @@ pub struct RtmpOutput {
     bytes_written: AtomicU64,
     // FFmpeg muxer
     output_ctx: Option<ffmpeg::format::context::Output>,
+    /// Connection opened by `prepare`, before its stream is known
+    opened: Option<ffmpeg::format::context::Output>,
     video_stream_index: usize,
     #[allow(dead_code)] // Reserved for A/V muxing
     audio_stream_index: Option<usize>,
@@ -26,8 +31,13 @@ pub struct RtmpOutput {
     frame_count: u64,
     // Connection state
     connected: bool,
-    reconnect_attempts: u32,
-    max_reconnect_attempts: u32,
+    /// Bound on each blocking connect/write; outlives `output_ctx`
+    io_timeout: Duration,
+    deadline: Arc<IoDeadline>,
+    /// Flush every packet straight to the socket
+    low_latency: bool,
+    // Send-side congestion signals
+    link: Arc<LinkStats>,
 }
 
 impl RtmpOutput {
@@ -38,19 +48,22 @@ impl RtmpOutput {
             initialized: false,
             bytes_written: AtomicU64::new(0),
             output_ctx: None,
+            opened: None,
             video_stream_index: 0,
             audio_stream_index: None,
-            time_base: ffmpeg::Rational::new(1, 1000),
+            time_base: crate::clock::time_base(),
             frame_count: 0,
             connected: false,
-            reconnect_attempts: 0,
-            max_reconnect_attempts: 5,
+            io_timeout: netio::DEFAULT_IO_TIMEOUT,
+            deadline: IoDeadline::new(),
+            low_latency: false,
+            link: Arc::new(LinkStats::new()),
         }
     }
 
-    /// Set maximum reconnection attempts
-    pub fn with_max_reconnects(mut self, attempts: u32) -> Self {
-        self.max_reconnect_attempts = attempts;
+    /// Limit each blocking connect or write (default 5s)
+    pub fn with_timeout(mut self, timeout: Duration) -> Self {
+        self.io_timeout = timeout;
         self
     }
 
@@ -73,13 +86,36 @@ impl RtmpOutput {
         }
     }
 
-    /// Initialize the RTMP connection
-    fn init_rtmp(&mut self, codec_params: &CodecParams) -> Result<()> {
+    /// Open the connection (the RTMP handshake and publish happen here)
+    /// without any streams yet
+    fn open(&self) -> Result<ffmpeg::format::context::Output> {
         // Validate URL
         if !self.url.starts_with("rtmp://") && !self.url.starts_with("rtmps://") {
             return Err(Error::Rtmp("URL must start with rtmp:// or rtmps://".into()));
         }
 
+        // Initialize FFmpeg
+        ffmpeg::init().map_err(|e| Error::Ffmpeg(e.to_string()))?;
+
+        // Set RTMP-specific options
+        let mut options = ffmpeg::Dictionary::new();
+        options.set("flvflags", "no_duration_filesize");
+        options.set("rtmp_live", "live");
+
+        // Create output context for RTMP (FLV format)
+        self.deadline.arm(self.io_timeout);
+        let result = netio::open_output(&self.url, "flv", options, &self.deadline);
+        self.deadline.disarm();
+        let mut output_ctx =
+            result.map_err(|e| Error::Rtmp(format!("Failed to create RTMP output: {}", e)))?;
+        if self.low_latency {
+            netio::set_flush_per_packet(&mut output_ctx);
+        }
+        Ok(output_ctx)
+    }
+
+    /// Initialize the RTMP connection
+    fn init_rtmp(&mut self, codec_params: &CodecParams) -> Result<()> {
         // RTMP only supports H.264 and AAC natively
         // HEVC/AV1 require enhanced RTMP (not widely supported)
         if codec_params.codec != Codec::H264 {
@@ -89,18 +125,43 @@ impl RtmpOutput {
             );
         }
 
-        // Initialize FFmpeg
-        ffmpeg::init().map_err(|e| Error::Ffmpeg(e.to_string()))?;
+        // A connection opened early by `prepare` can go stale while the
+        // encoder starts; a failed header on it gets one fresh connection
+        let output_ctx = match self.opened.take() {
+            Some(opened) => match self.start_stream(opened, codec_params) {
+                Ok(output_ctx) => output_ctx,
+                Err(e) => {
+                    tracing::warn!("Early RTMP connection failed ({}), reconnecting", e);
+                    let fresh = self.open()?;
+                    self.start_stream(fresh, codec_params)?
+                }
+            },
+            None => {
+                let fresh = self.open()?;
+                self.start_stream(fresh, codec_params)?
+            }
+        };
 
-        // Set RTMP-specific options
-        let mut options = ffmpeg::Dictionary::new();
-        options.set("flvflags", "no_duration_filesize");
-        options.set("rtmp_live", "live");
+        self.output_ctx = Some(output_ctx);
+        self.connected = true;
 
-        // Create output context for RTMP (FLV format)
-        let mut output_ctx = ffmpeg::format::output_as_with(&self.url, "flv", options)
-            .map_err(|e| Error::Rtmp(format!("Failed to create RTMP output: {}", e)))?;
+        tracing::info!(
+            "RTMP connected: {} ({:?}, {}x{})",
+            self.url_masked(),
+            codec_params.codec,
+            codec_params.resolution.width,
+            codec_params.resolution.height,
+        );
+
+        Ok(())
+    }
 
+    /// Add the video stream to `output_ctx` and write the FLV header
+    fn start_stream(
+        &mut self,
+        mut output_ctx: ffmpeg::format::context::Output,
+        codec_params: &CodecParams,
+    ) -> Result<ffmpeg::format::context::Output> {
         // Find encoder for codec parameters
         let codec_id = Self::codec_to_ffmpeg(codec_params.codec);
         let codec = ffmpeg::encoder::find(codec_id)
@@ -160,25 +221,14 @@ impl RtmpOutput {
         let fps = codec_params.framerate.num as i32;
         stream.set_rate(ffmpeg::Rational::new(fps, 1));
 
-        // Write header (this initiates the RTMP connection)
+        // Write header (FLV header and stream metadata)
         tracing::info!("Connecting to RTMP server: {}", self.url_masked());
 
-        output_ctx
-            .write_header()
-            .map_err(|e| Error::Rtmp(format!("Failed to connect to RTMP server: {}", e)))?;
-
-        self.output_ctx = Some(output_ctx);
-        self.connected = true;
-
-        tracing::info!(
-            "RTMP connected: {} ({:?}, {}x{})",
-            self.url_masked(),
-            codec_params.codec,
-            codec_params.resolution.width,
-            codec_params.resolution.height,
-        );
-
-        Ok(())
+        self.deadline.arm(self.io_timeout);
+        let result = output_ctx.write_header();
+        self.deadline.disarm();
+        result.map_err(|e| Error::Rtmp(format!("Failed to connect to RTMP server: {}", e)))?;
+        Ok(output_ctx)
     }
 
     /// Initialize with default codec params
@@ -186,36 +236,21 @@ impl RtmpOutput {
         let default_params = CodecParams::default();
         self.init_rtmp(&default_params)
     }
-
-    /// Attempt to reconnect
-    #[allow(dead_code)] // Will be used for automatic reconnection
-    fn try_reconnect(&mut self) -> Result<()> {
-        if self.reconnect_attempts >= self.max_reconnect_attempts {
-            return Err(Error::Rtmp(format!(
-                "Max reconnection attempts ({}) exceeded",
-                self.max_reconnect_attempts
-            )));
-        }
-
-        self.reconnect_attempts += 1;
-        tracing::warn!(
-            "RTMP connection lost, attempting reconnect ({}/{})",
-            self.reconnect_attempts,
-            self.max_reconnect_attempts
-        );
-
-        // Reset state
-        self.output_ctx = None;
-        self.connected = false;
-        self.initialized = false;
-
-        // Try to reconnect
-        self.init_default()
-    }
 }
 
 #[async_trait::async_trait]
 impl OutputSink for RtmpOutput {
+    async fn prepare(&mut self) -> Result<()> {
+        if !self.initialized && self.opened.is_none() {
+            tracing::info!(
+                "Connecting to RTMP server ahead of the stream: {}",
+                self.url_masked()
+            );
+            self.opened = Some(self.open()?);
+        }
+        Ok(())
+    }
+
     async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
         if self.initialized {
             return Ok(());
@@ -240,7 +275,7 @@ impl OutputSink for RtmpOutput {
         })?;
 
         // Create FFmpeg packet
-        let mut pkt = ffmpeg::Packet::copy(&packet.data);
+        let mut pkt = super::wrap_packet(packet)?;
 
         pkt.set_pts(Some(packet.pts));
         pkt.set_dts(Some(packet.dts));
@@ -258,34 +293,50 @@ impl OutputSink for RtmpOutput {
 
         pkt.rescale_ts(self.time_base, stream.time_base());
 
-        // Write packet
-        match pkt.write_interleaved(output_ctx) {
+        // Write packet; the time it blocks tracks the socket backlog
+        let start = Instant::now();
+        self.deadline.arm(self.io_timeout);
+        let result = netio::write_packet(&pkt, output_ctx, self.low_latency);
+        self.deadline.disarm();
+        self.link
+            .set_buffered(super::link::avio_buffered(output_ctx));
+        match result {
             Ok(()) => {
+                self.link.record_write(start.elapsed(), packet.size());
                 self.frame_count += 1;
                 self.bytes_written
                     .fetch_add(packet.size() as u64, Ordering::Relaxed);
-                self.reconnect_attempts = 0; // Reset on successful write
                 Ok(())
             }
             Err(e) => {
+                self.link.record_error();
                 tracing::error!("RTMP write error: {}", e);
-                // Try to reconnect on network errors
-                // Note: In production, you'd want more sophisticated error handling
+                // Reconnecting is up to the I/O thread (NetworkOutput)
                 Err(Error::Rtmp(format!("Write failed: {}", e)))
             }
         }
     }
 
     async fn finish(&mut self) -> Result<()> {
+        self.opened = None;
         if !self.initialized {
             return Ok(());
         }
 
-        if let Some(ref mut output_ctx) = self.output_ctx {
-            output_ctx
-                .write_trailer()
-                .map_err(|e| Error::Rtmp(format!("Failed to write trailer: {}", e)))?;
-        }
+        // Reset even when the trailer fails so the next init reconnects
+        let trailer = match self.output_ctx.as_mut() {
+            Some(output_ctx) => {
+                self.deadline.arm(self.io_timeout);
+                let result = output_ctx.write_trailer();
+                self.deadline.disarm();
+                result
+            }
+            None => Ok(()),
+        };
+        self.output_ctx = None;
+        self.initialized = false;
+        self.connected = false;
+        trailer.map_err(|e| Error::Rtmp(format!("Failed to write trailer: {}", e)))?;
 
         let bytes = self.bytes_written.load(Ordering::Relaxed);
         tracing::info!(
@@ -296,22 +347,41 @@ impl OutputSink for RtmpOutput {
             bytes as f64 / 1_000_000.0
         );
 
+        Ok(())
+    }
+
+    async fn abort(&mut self) -> Result<()> {
+        // Closing flushes the AVIO buffer: interrupt that at once
+        self.deadline.arm(Duration::ZERO);
+        self.opened = None;
         self.output_ctx = None;
+        self.deadline.disarm();
+        if self.initialized {
+            tracing::info!("RTMP connection dropped: {}", self.url_masked());
+        }
         self.initialized = false;
         self.connected = false;
-
         Ok(())
     }
 
     fn bytes_written(&self) -> u64 {
         self.bytes_written.load(Ordering::Relaxed)
     }
+
+    fn set_low_latency(&mut self, enabled: bool) {
+        self.low_latency = enabled;
+    }
+
+    fn link_stats(&self) -> Vec<Arc<LinkStats>> {
+        vec![self.link.clone()]
+    }
 }
 
 impl Drop for RtmpOutput {
     fn drop(&mut self) {
         if self.initialized {
             if let Some(ref mut output_ctx) = self.output_ctx {
+                self.deadline.arm(self.io_timeout);
                 let _ = output_ctx.write_trailer();
             }
         }
@@ -6,8 +6,11 @@ use crate::encode::Codec;
 use crate::error::{Error, Result};
 use crate::types::{CodecParams, Packet};
 use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
-use super::OutputSink;
+use super::netio::{self, IoDeadline};
+use super::{LinkStats, OutputSink};
 
 use ffmpeg_next as ffmpeg;
 use ffmpeg_next::codec::Id as CodecId;
@@ -33,6 +36,8 @@ pub struct SrtOutput {
     bytes_written: AtomicU64,
     // FFmpeg muxer
     output_ctx: Option<ffmpeg::format::context::Output>,
+    /// Connection opened by `prepare`, before its stream is known
+    opened: Option<ffmpeg::format::context::Output>,
     video_stream_index: usize,
     #[allow(dead_code)] // Reserved for A/V muxing
     audio_stream_index: Option<usize>,
@@ -45,6 +50,14 @@ pub struct SrtOutput {
     streamid: Option<String>,
     pbkeylen: Option<u32>,
     max_bandwidth: Option<i64>,
+    /// Bound on each blocking connect/write; outlives `output_ctx`
+    io_timeout: Duration,
+    deadline: Arc<IoDeadline>,
+    /// Flush every packet straight to the socket
+    low_latency: bool,
+    // Send-side congestion signals
+    link: Arc<LinkStats>,
+    connected_at: Option<Instant>,
 }
 
 impl SrtOutput {
@@ -61,15 +74,21 @@ impl SrtOutput {
             initialized: false,
             bytes_written: AtomicU64::new(0),
             output_ctx: None,
+            opened: None,
             video_stream_index: 0,
             audio_stream_index: None,
-            time_base: ffmpeg::Rational::new(1, 1000),
+            time_base: crate::clock::time_base(),
             frame_count: 0,
             connected: false,
             passphrase: None,
             streamid: None,
             pbkeylen: None,
             max_bandwidth: None,
+            io_timeout: netio::DEFAULT_IO_TIMEOUT,
+            deadline: IoDeadline::new(),
+            low_latency: false,
+            link: Arc::new(LinkStats::new()),
+            connected_at: None,
         }
     }
 
@@ -103,11 +122,39 @@ impl SrtOutput {
         self
     }
 
+    /// Limit each blocking connect or write (default 5s)
+    pub fn with_timeout(mut self, timeout: Duration) -> Self {
+        self.io_timeout = timeout;
+        self
+    }
+
     /// Get the SRT URL
     pub fn url(&self) -> &str {
         &self.url
     }
 
+    /// Send-side statistics of the connection
+    ///
+    /// FFmpeg's libsrt protocol does not expose the socket's `srt_bstats`,
+    /// so RTT, loss and retransmissions stay zero; the send buffer is the
+    /// muxer's pending bytes and bandwidth the throughput since connect.
+    pub fn stats(&self) -> SrtStats {
+        let link = self.link.snapshot();
+        let elapsed = self
+            .connected_at
+            .map(|t| t.elapsed().as_secs_f64())
+            .unwrap_or(0.0);
+        SrtStats {
+            bandwidth_mbps: if elapsed > 0.0 {
+                link.bytes_sent as f64 * 8.0 / elapsed / 1_000_000.0
+            } else {
+                0.0
+            },
+            send_buffer_bytes: link.buffered_bytes,
+            ..Default::default()
+        }
+    }
+
     /// Map codec to FFmpeg codec ID
     fn codec_to_ffmpeg(codec: Codec) -> CodecId {
         match codec {
@@ -162,8 +209,8 @@ impl SrtOutput {
         format!("{}{}{}", url, separator, params.join("&"))
     }
 
-    /// Initialize the SRT connection
-    fn init_srt(&mut self, codec_params: &CodecParams) -> Result<()> {
+    /// Open the SRT connection without any streams yet
+    fn open(&self) -> Result<ffmpeg::format::context::Output> {
         // Validate URL
         if !self.url.starts_with("srt://") {
             return Err(Error::Srt("URL must start with srt://".into()));
@@ -176,9 +223,59 @@ impl SrtOutput {
         let full_url = self.build_srt_url();
 
         // Create output context for MPEG-TS over SRT
-        let mut output_ctx = ffmpeg::format::output_as(&full_url, "mpegts")
-            .map_err(|e| Error::Srt(format!("Failed to create SRT output: {}", e)))?;
+        self.deadline.arm(self.io_timeout);
+        let options = ffmpeg::Dictionary::new();
+        let result = netio::open_output(&full_url, "mpegts", options, &self.deadline);
+        self.deadline.disarm();
+        let mut output_ctx =
+            result.map_err(|e| Error::Srt(format!("Failed to create SRT output: {}", e)))?;
+        if self.low_latency {
+            netio::set_flush_per_packet(&mut output_ctx);
+        }
+        Ok(output_ctx)
+    }
+
+    /// Initialize the SRT connection
+    fn init_srt(&mut self, codec_params: &CodecParams) -> Result<()> {
+        // A connection opened early by `prepare` can go stale while the
+        // encoder starts; a failed header on it gets one fresh connection
+        let output_ctx = match self.opened.take() {
+            Some(opened) => match self.start_stream(opened, codec_params) {
+                Ok(output_ctx) => output_ctx,
+                Err(e) => {
+                    tracing::warn!("Early SRT connection failed ({}), reconnecting", e);
+                    let fresh = self.open()?;
+                    self.start_stream(fresh, codec_params)?
+                }
+            },
+            None => {
+                let fresh = self.open()?;
+                self.start_stream(fresh, codec_params)?
+            }
+        };
 
+        self.output_ctx = Some(output_ctx);
+        self.connected = true;
+        self.connected_at = Some(Instant::now());
+
+        tracing::info!(
+            "SRT connected: {} ({:?}, {}x{}, latency: {}ms)",
+            self.url,
+            codec_params.codec,
+            codec_params.resolution.width,
+            codec_params.resolution.height,
+            self.latency_ms,
+        );
+
+        Ok(())
+    }
+
+    /// Add the video stream to `output_ctx` and write the MPEG-TS header
+    fn start_stream(
+        &mut self,
+        mut output_ctx: ffmpeg::format::context::Output,
+        codec_params: &CodecParams,
+    ) -> Result<ffmpeg::format::context::Output> {
         // Find encoder for codec parameters
         let codec_id = Self::codec_to_ffmpeg(codec_params.codec);
         let codec = ffmpeg::encoder::find(codec_id)
@@ -246,23 +343,11 @@ impl SrtOutput {
             self.mode
         );
 
-        output_ctx
-            .write_header()
-            .map_err(|e| Error::Srt(format!("Failed to connect via SRT: {}", e)))?;
-
-        self.output_ctx = Some(output_ctx);
-        self.connected = true;
-
-        tracing::info!(
-            "SRT connected: {} ({:?}, {}x{}, latency: {}ms)",
-            self.url,
-            codec_params.codec,
-            codec_params.resolution.width,
-            codec_params.resolution.height,
-            self.latency_ms,
-        );
-
-        Ok(())
+        self.deadline.arm(self.io_timeout);
+        let result = output_ctx.write_header();
+        self.deadline.disarm();
+        result.map_err(|e| Error::Srt(format!("Failed to connect via SRT: {}", e)))?;
+        Ok(output_ctx)
     }
 
     /// Initialize with default codec params
@@ -274,6 +359,14 @@ impl SrtOutput {
 
 #[async_trait::async_trait]
 impl OutputSink for SrtOutput {
+    async fn prepare(&mut self) -> Result<()> {
+        if !self.initialized && self.opened.is_none() {
+            tracing::info!("Connecting via SRT ahead of the stream: {}", self.url);
+            self.opened = Some(self.open()?);
+        }
+        Ok(())
+    }
+
     async fn init_with_codec(&mut self, codec_params: Option<&CodecParams>) -> Result<()> {
         if self.initialized {
             return Ok(());
@@ -298,7 +391,7 @@ impl OutputSink for SrtOutput {
         })?;
 
         // Create FFmpeg packet
-        let mut pkt = ffmpeg::Packet::copy(&packet.data);
+        let mut pkt = super::wrap_packet(packet)?;
 
         pkt.set_pts(Some(packet.pts));
         pkt.set_dts(Some(packet.dts));
@@ -316,9 +409,18 @@ impl OutputSink for SrtOutput {
 
         pkt.rescale_ts(self.time_base, stream.time_base());
 
-        // Write packet
-        pkt.write_interleaved(output_ctx)
-            .map_err(|e| Error::Srt(format!("Write failed: {}", e)))?;
+        // Write packet; libsrt blocks while the send buffer is full
+        let start = Instant::now();
+        self.deadline.arm(self.io_timeout);
+        let result = netio::write_packet(&pkt, output_ctx, self.low_latency);
+        self.deadline.disarm();
+        self.link
+            .set_buffered(super::link::avio_buffered(output_ctx));
+        result.map_err(|e| {
+            self.link.record_error();
+            Error::Srt(format!("Write failed: {}", e))
+        })?;
+        self.link.record_write(start.elapsed(), packet.size());
 
         self.frame_count += 1;
         self.bytes_written
@@ -328,15 +430,25 @@ impl OutputSink for SrtOutput {
     }
 
     async fn finish(&mut self) -> Result<()> {
+        self.opened = None;
         if !self.initialized {
             return Ok(());
         }
 
-        if let Some(ref mut output_ctx) = self.output_ctx {
-            output_ctx
-                .write_trailer()
-                .map_err(|e| Error::Srt(format!("Failed to write trailer: {}", e)))?;
-        }
+        // Reset even when the trailer fails so the next init reconnects
+        let trailer = match self.output_ctx.as_mut() {
+            Some(output_ctx) => {
+                self.deadline.arm(self.io_timeout);
+                let result = output_ctx.write_trailer();
+                self.deadline.disarm();
+                result
+            }
+            None => Ok(()),
+        };
+        self.output_ctx = None;
+        self.initialized = false;
+        self.connected = false;
+        trailer.map_err(|e| Error::Srt(format!("Failed to write trailer: {}", e)))?;
 
         let bytes = self.bytes_written.load(Ordering::Relaxed);
         tracing::info!(
@@ -347,22 +459,41 @@ impl OutputSink for SrtOutput {
             bytes as f64 / 1_000_000.0
         );
 
+        Ok(())
+    }
+
+    async fn abort(&mut self) -> Result<()> {
+        // Closing flushes the AVIO buffer: interrupt that at once
+        self.deadline.arm(Duration::ZERO);
+        self.opened = None;
         self.output_ctx = None;
+        self.deadline.disarm();
+        if self.initialized {
+            tracing::info!("SRT connection dropped: {}", self.url);
+        }
         self.initialized = false;
         self.connected = false;
-
         Ok(())
     }
 
     fn bytes_written(&self) -> u64 {
         self.bytes_written.load(Ordering::Relaxed)
     }
+
+    fn set_low_latency(&mut self, enabled: bool) {
+        self.low_latency = enabled;
+    }
+
+    fn link_stats(&self) -> Vec<Arc<LinkStats>> {
+        vec![self.link.clone()]
+    }
 }
 
 impl Drop for SrtOutput {
     fn drop(&mut self) {
         if self.initialized {
             if let Some(ref mut output_ctx) = self.output_ctx {
+                self.deadline.arm(self.io_timeout);
                 let _ = output_ctx.write_trailer();
             }
         }
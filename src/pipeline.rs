@@ -3,18 +3,31 @@
 //! Connects capture → process → encode → output
 //! Supports both video-only and A/V pipelines.
 
+use crate::abr::{self, AbrConfig};
 use crate::audio::{self, AudioCapture, AudioEncoder};
 use crate::capture;
+use crate::clock;
 use crate::config::{CaptureConfig, EncoderConfig};
-use crate::encode;
+use crate::encode::{self, Encoder, PreparedInput, WarmId};
 use crate::error::{Error, Result};
-use crate::output::{self, AvMuxer, Output, OutputSink};
+use crate::ladder::{Ladder, Rendition};
+use crate::metrics::{Metrics, MetricsSnapshot, Stage};
+use crate::output::{self, AvMuxer, Container, Output, OutputSink, SegmentHook};
+use crate::pool::FramePool;
 use crate::processing;
+use crate::queue::{self, Push};
+use crate::threading::{self, ThreadRole};
 use crate::types::{CodecParams, Frame, FrameFormat, Packet, Resolution, Stats};
 
+use std::collections::VecDeque;
+use std::path::{Path, PathBuf};
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::Arc;
-use tokio::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// Frames the encoder may hold before emitting their packet (B-frames,
+/// lookahead)
+const MAX_IN_FLIGHT: usize = 64;
 
 /// Audio configuration for pipeline
 #[derive(Debug, Clone)]
@@ -49,15 +62,21 @@ impl Default for AudioConfig {
 /// Video processing pipeline
 pub struct Pipeline {
     capture_config: CaptureConfig,
-    encoder_config: EncoderConfig,
+    encoder_config: parking_lot::Mutex<EncoderConfig>,
+    /// Control channel of the running encoder thread
+    encoder_control: parking_lot::Mutex<Option<EncoderControl>>,
     #[allow(dead_code)] // Used when audio is enabled
     audio_config: AudioConfig,
     output_config: Output,
     running: Arc<AtomicBool>,
-    stats: Arc<Mutex<Stats>>,
+    metrics: Arc<Metrics>,
     // Audio components (initialized when audio_config.enabled)
     #[allow(dead_code)] // Will be used in start() for A/V pipeline
     audio_running: Arc<AtomicBool>,
+    /// Adaptive bitrate for streaming outputs
+    abr: Option<AbrConfig>,
+    /// Sessions parked by `prewarm`, released on drop unless taken
+    warm: parking_lot::Mutex<Vec<WarmId>>,
 }
 
 impl Pipeline {
@@ -75,19 +94,22 @@ impl Pipeline {
     ) -> Result<Self> {
         Ok(Self {
             capture_config: capture,
-            encoder_config: encoder,
+            encoder_config: parking_lot::Mutex::new(encoder),
+            encoder_control: parking_lot::Mutex::new(None),
             audio_config: audio,
             output_config: output,
             running: Arc::new(AtomicBool::new(false)),
-            stats: Arc::new(Mutex::new(Stats::default())),
+            metrics: Arc::new(Metrics::new()),
             audio_running: Arc::new(AtomicBool::new(false)),
+            abr: None,
+            warm: parking_lot::Mutex::new(Vec::new()),
         })
     }
 
     /// Create pipeline from preset
     pub fn from_preset(preset: crate::config::Preset, output: Output) -> Result<Self> {
         let encoder_config = EncoderConfig::from_preset(preset);
-        Self::new(CaptureConfig::default(), encoder_config, output)
+        Self::new(capture_for(&encoder_config), encoder_config, output)
     }
 
     /// Create pipeline from preset with audio
@@ -97,7 +119,37 @@ impl Pipeline {
         output: Output,
     ) -> Result<Self> {
         let encoder_config = EncoderConfig::from_preset(preset);
-        Self::new_with_audio(CaptureConfig::default(), encoder_config, audio, output)
+        Self::new_with_audio(capture_for(&encoder_config), encoder_config, audio, output)
+    }
+
+    /// Adapt the encoder bitrate to the uplink of RTMP/SRT outputs (not
+    /// used with the A/V muxer, or when the output also records locally)
+    pub fn set_adaptive_bitrate(&mut self, config: Option<AbrConfig>) {
+        self.abr = config;
+    }
+
+    /// Open this pipeline's encoder session now and park it in the
+    /// scheduler's warm pool, so [`start`](Self::start) goes live without
+    /// waiting for driver and session setup
+    ///
+    /// Meant for long-lived pipelines that sit idle before going live.
+    /// Needs a fixed encoder resolution. Blocks while the session opens.
+    pub fn prewarm(&self) -> Result<()> {
+        let config = self.encoder_config.lock().clone();
+        let dmabuf = capture::expected_dmabuf(&self.capture_config);
+        let input = prepared_input(&config, dmabuf).ok_or_else(|| {
+            Error::Config("Pre-warming the encoder needs a fixed resolution".into())
+        })?;
+        // Opened where the encoder thread would open it: software encoders
+        // start their workers here, and those keep this thread's placement
+        let id = std::thread::spawn(move || {
+            threading::enter(ThreadRole::Encode);
+            encode::EncoderScheduler::global().prewarm(config, &input)
+        })
+        .join()
+        .map_err(|_| Error::Internal("Encoder pre-warm thread panicked".into()))??;
+        self.warm.lock().push(id);
+        Ok(())
     }
 
     /// Start the pipeline
@@ -115,25 +167,33 @@ impl Pipeline {
 
         // Clone configs for use in tasks
         let capture_config = self.capture_config.clone();
-        let encoder_config = self.encoder_config.clone();
+        let encoder_config = self.encoder_config.lock().clone();
         let audio_config = self.audio_config.clone();
         let output_config = self.output_config.clone();
         let running = self.running.clone();
         let audio_running = self.audio_running.clone();
-        let stats = self.stats.clone();
-
-        // Determine processing needs
-        let target_resolution = encoder_config.resolution;
-        let target_format = if encoder_config.pixel_format.is_nvenc_native() {
-            Some(encoder_config.pixel_format)
-        } else {
-            Some(FrameFormat::Nv12)
+        let metrics = self.metrics.clone();
+
+        // Create channels for frame/packet communication; the frame queue
+        // applies the backpressure policy and stamps each frame, and packets
+        // carry the capture time of their frame
+        let (frame_tx, frame_rx) = queue::frame_queue::<Frame>(capture_config.queue);
+        let dmabuf = capture::expected_dmabuf(&capture_config);
+        let realtime = encoder_config.tuning.is_realtime();
+        let packet_depth = if realtime { 1 } else { 8 };
+        let (packet_tx, mut packet_rx) = tokio::sync::mpsc::channel::<EncoderEvent>(packet_depth);
+        let (control, control_rx) = EncoderControl::channel(encoder_config.clone());
+        *self.encoder_control.lock() = Some(control.clone());
+        // One encoder feeds every destination, so steering it by the uplink
+        // would degrade recordings along with the stream
+        let abr = match self.abr.clone() {
+            Some(_) if output_config.records_locally() => {
+                tracing::warn!("Adaptive bitrate is off: the output also records locally");
+                None
+            }
+            abr => abr.map(|config| (config, control)),
         };
 
-        // Create channels for frame/packet communication
-        let (frame_tx, frame_rx) = crossbeam_channel::bounded::<Frame>(4);
-        let (packet_tx, mut packet_rx) = tokio::sync::mpsc::channel::<Packet>(8);
-
         // Audio channels (only used if audio enabled)
         let (audio_packet_tx, mut audio_packet_rx) =
             tokio::sync::mpsc::channel::<audio::AudioPacket>(16);
@@ -153,6 +213,7 @@ impl Pipeline {
             let audio_config_clone = audio_config.clone();
 
             std::thread::spawn(move || {
+                threading::enter(ThreadRole::Audio);
                 if let Err(e) = run_audio_pipeline(
                     audio_config_clone,
                     audio_running_clone,
@@ -169,106 +230,64 @@ impl Pipeline {
 
         // Spawn video encoder thread (blocking, non-Send encoder lives here)
         let encoder_running = running.clone();
+        let encoder_metrics = metrics.clone();
         std::thread::spawn(move || {
-            // Create encoder in this thread
-            let mut encoder = match encode::create_encoder(encoder_config) {
-                Ok(e) => e,
-                Err(e) => {
-                    tracing::error!("Failed to create encoder: {}", e);
-                    let _ = codec_params_tx.send(None);
-                    return;
-                }
-            };
-
-            if let Err(e) = encoder.init() {
-                tracing::error!("Failed to initialize encoder: {}", e);
-                let _ = codec_params_tx.send(None);
-                return;
-            }
-
-            tracing::info!("Encoder thread started");
-
-            // Track if we've sent codec params
-            let mut codec_params_sent = false;
-            let mut codec_params_tx = Some(codec_params_tx);
-
-            // Process frames until shutdown
-            while encoder_running.load(Ordering::SeqCst) {
-                match frame_rx.recv_timeout(std::time::Duration::from_millis(100)) {
-                    Ok(frame) => {
-                        // Process frame (scale/convert if needed)
-                        let processed = match processing::process_frame(
-                            &frame,
-                            target_resolution,
-                            target_format,
-                        ) {
-                            Ok(f) => f,
-                            Err(e) => {
-                                tracing::error!("Processing error: {}", e);
-                                continue;
-                            }
-                        };
-
-                        // Encode
-                        match encoder.encode(&processed) {
-                            Ok(Some(packet)) => {
-                                // Send codec params after first successful encode
-                                if !codec_params_sent {
-                                    if let Some(tx) = codec_params_tx.take() {
-                                        let params = encoder.codec_params();
-                                        let _ = tx.send(params);
-                                        codec_params_sent = true;
-                                    }
-                                }
+            threading::enter(ThreadRole::Encode);
+            run_encoder(
+                encoder_config,
+                dmabuf,
+                frame_rx,
+                packet_tx,
+                codec_params_tx,
+                control_rx,
+                encoder_running,
+                encoder_metrics,
+            )
+        });
 
-                                if packet_tx.blocking_send(packet).is_err() {
-                                    tracing::debug!("Output channel closed");
-                                    break;
-                                }
-                            }
-                            Ok(None) => {} // Buffered
-                            Err(e) => {
-                                tracing::error!("Encode error: {}", e);
-                            }
-                        }
+        // Spawn capture + output task (async)
+        tokio::spawn(async move {
+            let start_capture = async {
+                // Create capture
+                let mut capture = match capture::create_capture(capture_config).await {
+                    Ok(c) => c,
+                    Err(e) => {
+                        tracing::error!("Failed to create capture: {}", e);
+                        return None;
                     }
-                    Err(crossbeam_channel::RecvTimeoutError::Timeout) => continue,
-                    Err(crossbeam_channel::RecvTimeoutError::Disconnected) => break,
-                }
-            }
-
-            // If we never sent codec params, send None now
-            if let Some(tx) = codec_params_tx.take() {
-                let _ = tx.send(None);
-            }
+                };
 
-            // Flush encoder
-            tracing::debug!("Flushing encoder");
-            if let Ok(packets) = encoder.flush() {
-                for packet in packets {
-                    let _ = packet_tx.blocking_send(packet);
+                // Start capture
+                if let Err(e) = capture.start().await {
+                    tracing::error!("Failed to start capture: {}", e);
+                    return None;
                 }
-            }
-
-            tracing::info!("Encoder thread stopped");
-        });
+                Some(capture)
+            };
 
-        // Spawn capture + output task (async)
-        tokio::spawn(async move {
-            // Create capture
-            let mut capture = match capture::create_capture(capture_config).await {
-                Ok(c) => c,
-                Err(e) => {
-                    tracing::error!("Failed to create capture: {}", e);
-                    return;
+            // Meanwhile (a portal dialog may be waiting for the user) the
+            // output connects; file recordings with audio go through the
+            // A/V muxer instead
+            let early_output = !(audio_enabled && matches!(output_config, Output::File { .. }));
+            let connect_output = async {
+                if !early_output {
+                    return None;
+                }
+                let mut output = match output::create_output(output_config.clone()).await {
+                    Ok(o) => o,
+                    Err(e) => return Some(Err(e)),
+                };
+                output.set_low_latency(realtime);
+                if let Err(e) = output.prepare().await {
+                    tracing::warn!("Output will connect once the stream starts: {}", e);
                 }
+                Some(Ok(output))
             };
 
-            // Start capture
-            if let Err(e) = capture.start().await {
-                tracing::error!("Failed to start capture: {}", e);
+            let (capture, connected_output) = tokio::join!(start_capture, connect_output);
+            let Some(mut capture) = capture else {
                 return;
-            }
+            };
 
             tracing::info!("Capture started, waiting for codec params from encoder");
 
@@ -318,48 +337,57 @@ impl Pipeline {
             // Output handler - either video-only OutputSink or A/V AvMuxer
             enum OutputHandler {
                 VideoOnly(Box<dyn OutputSink>),
-                AudioVideo(AvMuxer),
+                AudioVideo(AvRecording),
             }
 
             let mut output_handler = match (&output_config, use_av_muxer) {
-                (Output::File { path, container }, true) => {
+                (
+                    Output::File {
+                        path,
+                        container,
+                        segments,
+                        direct_io,
+                        on_segment,
+                    },
+                    true,
+                ) => {
                     // Use AvMuxer for file output with audio
-                    let mut muxer = match AvMuxer::new(path, container.ffmpeg_format()) {
-                        Ok(m) => m,
+                    if *segments != Default::default() {
+                        tracing::warn!(
+                            "Segmented recording is video-only, writing {} as one file",
+                            path.display()
+                        );
+                    }
+                    if *direct_io {
+                        tracing::warn!(
+                            "Direct I/O is video-only, writing {} through the page cache",
+                            path.display()
+                        );
+                    }
+                    let recording = match AvRecording::open(
+                        path,
+                        *container,
+                        video_params.as_ref(),
+                        audio_params.clone(),
+                        on_segment.clone(),
+                    ) {
+                        Ok(r) => r,
                         Err(e) => {
                             tracing::error!("Failed to create A/V muxer: {}", e);
                             return;
                         }
                     };
 
-                    // Add video stream
-                    if let Some(ref params) = video_params {
-                        if let Err(e) = muxer.add_video_stream(params) {
-                            tracing::error!("Failed to add video stream: {}", e);
-                            return;
-                        }
-                    }
-
-                    // Add audio stream
-                    if let Some(ref params) = audio_params {
-                        if let Err(e) = muxer.add_audio_stream(params) {
-                            tracing::error!("Failed to add audio stream: {}", e);
-                            return;
-                        }
-                    }
-
-                    // Start muxer (write header)
-                    if let Err(e) = muxer.start() {
-                        tracing::error!("Failed to start muxer: {}", e);
-                        return;
-                    }
-
                     tracing::info!("A/V muxer initialized for {}", path.display());
-                    OutputHandler::AudioVideo(muxer)
+                    OutputHandler::AudioVideo(recording)
                 }
                 _ => {
                     // Use standard OutputSink for video-only or non-file outputs
-                    let mut output = match output::create_output(output_config).await {
+                    let created = match connected_output {
+                        Some(result) => result,
+                        None => output::create_output(output_config).await,
+                    };
+                    let mut output = match created {
                         Ok(o) => o,
                         Err(e) => {
                             tracing::error!("Failed to create output: {}", e);
@@ -368,17 +396,33 @@ impl Pipeline {
                     };
 
                     // Initialize with video codec params
+                    output.set_low_latency(realtime);
+                    output.set_metrics(metrics.clone());
+                    if let Some(ref params) = audio_params {
+                        output.set_audio(params);
+                    }
                     if let Err(e) = output.init_with_codec(video_params.as_ref()).await {
                         tracing::error!("Failed to init output: {}", e);
                         return;
                     }
 
+                    // Steer the encoder from the output's congestion signals
+                    let links = output.link_stats();
+                    if let (Some((config, control)), false) = (abr, links.is_empty()) {
+                        abr::spawn(config, control, links, running.clone());
+                    }
+
                     OutputHandler::VideoOnly(output)
                 }
             };
 
             tracing::info!("Output initialized, entering main loop");
 
+            // Frame held back by a full queue under the Block policy; capture
+            // pauses until it is queued while packets keep draining
+            let mut pending: Option<Frame> = None;
+            let mut capture_dropped = 0;
+
             // Main loop: capture frames, send to encoder, receive packets, write output
             loop {
                 tokio::select! {
@@ -387,18 +431,31 @@ impl Pipeline {
                         break;
                     }
 
+                    // Retry the held frame
+                    _ = tokio::time::sleep(tokio::time::Duration::from_millis(1)), if pending.is_some() => {
+                        let frame = pending.take().expect("guarded by is_some");
+                        if !queue_frame(&frame_tx, frame, &mut pending, &metrics) {
+                            break;
+                        }
+                    }
+
                     // Capture next frame
-                    frame_result = capture.next_frame() => {
+                    frame_result = capture.next_frame(), if pending.is_none() => {
+                        // Frames the source itself discarded
+                        let dropped = capture.frames_dropped();
+                        if dropped > capture_dropped {
+                            metrics
+                                .frames_dropped
+                                .fetch_add(dropped - capture_dropped, Ordering::Relaxed);
+                            capture_dropped = dropped;
+                        }
+
                         match frame_result {
                             Ok(frame) => {
-                                {
-                                    let mut s = stats.lock().await;
-                                    s.frames_captured += 1;
-                                }
+                                metrics.frames_captured.fetch_add(1, Ordering::Relaxed);
 
                                 // Send to encoder thread
-                                if frame_tx.send(frame).is_err() {
-                                    tracing::debug!("Encoder channel closed");
+                                if !queue_frame(&frame_tx, frame, &mut pending, &metrics) {
                                     break;
                                 }
                             }
@@ -410,32 +467,62 @@ impl Pipeline {
                     }
 
                     // Receive encoded video packets
-                    Some(packet) = packet_rx.recv() => {
-                        {
-                            let mut s = stats.lock().await;
-                            s.frames_encoded += 1;
-                            s.bytes_written += packet.size() as u64;
-                        }
+                    Some(event) = packet_rx.recv() => {
+                        metrics.packet_queue.set(packet_rx.len());
+                        let (packet, captured) = match event {
+                            EncoderEvent::Packet(packet, captured) => (packet, captured),
+                            EncoderEvent::CodecChanged(params) => {
+                                match &mut output_handler {
+                                    OutputHandler::VideoOnly(output) => {
+                                        if let Err(e) = output.update_codec(params.as_ref()).await {
+                                            tracing::error!("Output codec update failed: {}", e);
+                                        }
+                                    }
+                                    OutputHandler::AudioVideo(recording) => {
+                                        if let Err(e) = recording.update_codec(params.as_ref()) {
+                                            tracing::error!("A/V muxer codec update failed: {}", e);
+                                        }
+                                    }
+                                }
+                                continue;
+                            }
+                        };
+                        metrics.frames_encoded.fetch_add(1, Ordering::Relaxed);
+                        metrics
+                            .bytes_written
+                            .fetch_add(packet.size() as u64, Ordering::Relaxed);
 
+                        let start = Instant::now();
                         match &mut output_handler {
                             OutputHandler::VideoOnly(output) => {
                                 if let Err(e) = output.write(&packet).await {
                                     tracing::error!("Output error: {}", e);
                                 }
                             }
-                            OutputHandler::AudioVideo(muxer) => {
-                                if let Err(e) = muxer.write_video(&packet) {
+                            OutputHandler::AudioVideo(recording) => {
+                                if let Err(e) = recording.muxer.write_video(&packet) {
                                     tracing::error!("Muxer video write error: {}", e);
                                 }
                             }
                         }
+                        metrics.record(Stage::Write, start.elapsed());
+                        if let Some(captured) = captured {
+                            metrics.record(Stage::GlassToWire, captured.elapsed());
+                        }
                     }
 
-                    // Receive encoded audio packets (only when using A/V muxer)
+                    // Receive encoded audio packets
                     Some(audio_packet) = audio_packet_rx.recv() => {
-                        if let OutputHandler::AudioVideo(muxer) = &mut output_handler {
-                            if let Err(e) = muxer.write_audio(&audio_packet) {
-                                tracing::error!("Muxer audio write error: {}", e);
+                        match &mut output_handler {
+                            OutputHandler::VideoOnly(output) => {
+                                if let Err(e) = output.write_audio(&audio_packet).await {
+                                    tracing::error!("Output audio write error: {}", e);
+                                }
+                            }
+                            OutputHandler::AudioVideo(recording) => {
+                                if let Err(e) = recording.muxer.write_audio(&audio_packet) {
+                                    tracing::error!("Muxer audio write error: {}", e);
+                                }
                             }
                         }
                     }
@@ -447,21 +534,35 @@ impl Pipeline {
             let _ = capture.stop().await;
 
             // Drain remaining video packets
-            while let Ok(packet) = packet_rx.try_recv() {
+            while let Ok(event) = packet_rx.try_recv() {
+                let packet = match event {
+                    EncoderEvent::Packet(packet, _) => packet,
+                    EncoderEvent::CodecChanged(params) => {
+                        match &mut output_handler {
+                            OutputHandler::VideoOnly(output) => {
+                                let _ = output.update_codec(params.as_ref()).await;
+                            }
+                            OutputHandler::AudioVideo(recording) => {
+                                let _ = recording.update_codec(params.as_ref());
+                            }
+                        }
+                        continue;
+                    }
+                };
                 match &mut output_handler {
                     OutputHandler::VideoOnly(output) => {
                         let _ = output.write(&packet).await;
                     }
-                    OutputHandler::AudioVideo(muxer) => {
-                        let _ = muxer.write_video(&packet);
+                    OutputHandler::AudioVideo(recording) => {
+                        let _ = recording.muxer.write_video(&packet);
                     }
                 }
             }
 
             // Drain remaining audio packets
             while let Ok(audio_packet) = audio_packet_rx.try_recv() {
-                if let OutputHandler::AudioVideo(muxer) = &mut output_handler {
-                    let _ = muxer.write_audio(&audio_packet);
+                if let OutputHandler::AudioVideo(recording) = &mut output_handler {
+                    let _ = recording.muxer.write_audio(&audio_packet);
                 }
             }
 
@@ -470,8 +571,8 @@ impl Pipeline {
                 OutputHandler::VideoOnly(mut output) => {
                     let _ = output.finish().await;
                 }
-                OutputHandler::AudioVideo(mut muxer) => {
-                    let _ = muxer.finish();
+                OutputHandler::AudioVideo(mut recording) => {
+                    let _ = recording.finish();
                 }
             }
         });
@@ -501,23 +602,703 @@ impl Pipeline {
 
     /// Get current statistics
     pub async fn stats(&self) -> Stats {
-        self.stats.lock().await.clone()
+        let metrics = self.metrics();
+        let pool = FramePool::global().stats();
+        Stats {
+            frames_captured: metrics.frames_captured,
+            frames_encoded: metrics.frames_encoded,
+            frames_dropped: metrics.frames_dropped,
+            avg_encode_latency_ms: metrics.latency(Stage::Encode).mean.as_secs_f64() * 1000.0,
+            bytes_written: metrics.bytes_written,
+            gpu_encoder_util: self
+                .metrics
+                .encoder_device()
+                .map(|slot| encode::EncoderScheduler::global().utilization(slot))
+                .unwrap_or(0),
+            pool_hits: pool.hits,
+            pool_misses: pool.misses,
+            ..Default::default()
+        }
+    }
+
+    /// Counters, queue depths and per-stage latency percentiles
+    ///
+    /// Lock-free; cheap enough to poll every frame.
+    pub fn metrics(&self) -> MetricsSnapshot {
+        self.metrics.snapshot()
+    }
+
+    /// Clear the per-stage latency histograms; counters keep running
+    pub fn reset_latency(&self) {
+        self.metrics.reset_latency();
     }
 
     /// Update encoder configuration (runtime reconfiguration)
-    pub async fn reconfigure_encoder(&mut self, config: EncoderConfig) -> Result<()> {
-        self.encoder_config = config;
-        // Note: Actual reconfiguration would need to communicate with running encoder
+    ///
+    /// Applied to the running encoder without stopping capture (see
+    /// [`EncoderControl`]) and kept for the next start.
+    pub async fn reconfigure_encoder(&self, config: EncoderConfig) -> Result<()> {
+        *self.encoder_config.lock() = config.clone();
+        match self.encoder_control() {
+            Some(control) => control.reconfigure(config),
+            None => Ok(()),
+        }
+    }
+
+    /// Handle for reconfiguring the running encoder, e.g. from a rate
+    /// controller; None before start or after stop
+    pub fn encoder_control(&self) -> Option<EncoderControl> {
+        if !self.is_running() {
+            return None;
+        }
+        self.encoder_control.lock().clone()
+    }
+}
+
+impl Drop for Pipeline {
+    fn drop(&mut self) {
+        // Warm sessions nobody took would hold their device's slot
+        let scheduler = encode::EncoderScheduler::global();
+        for id in self.warm.get_mut().drain(..) {
+            scheduler.release(id);
+        }
+    }
+}
+
+/// Default capture settings for `encoder`: realtime tuning gets a
+/// one-frame, newest-wins queue
+fn capture_for(encoder: &EncoderConfig) -> CaptureConfig {
+    let mut capture = CaptureConfig::default();
+    if encoder.tuning.is_realtime() {
+        capture.queue = crate::config::QueueConfig::low_latency();
+    }
+    capture
+}
+
+/// Frames the encoder thread will send for `config`, when known before
+/// capture starts: processed to the output size and the graph's format,
+/// or the capture's `dmabuf` layout for encoders that import DMA-BUFs
+fn prepared_input(
+    config: &EncoderConfig,
+    dmabuf: Option<(FrameFormat, u32)>,
+) -> Option<PreparedInput> {
+    let format = processing::ProcessingGraph::from_config(config).format()?;
+    Some(PreparedInput {
+        resolution: config.resolution?,
+        format,
+        dmabuf,
+    })
+}
+
+/// A/V recording; after a codec change it continues in the next segment
+/// file, since a file's streams are fixed once its header is written
+struct AvRecording {
+    muxer: AvMuxer,
+    base: PathBuf,
+    /// File currently written
+    path: PathBuf,
+    container: Container,
+    audio_params: Option<audio::AudioParams>,
+    segment: u32,
+    on_segment: Option<SegmentHook>,
+}
+
+impl AvRecording {
+    fn open(
+        path: &Path,
+        container: Container,
+        video_params: Option<&CodecParams>,
+        audio_params: Option<audio::AudioParams>,
+        on_segment: Option<SegmentHook>,
+    ) -> Result<Self> {
+        let muxer = open_av_muxer(path, container, video_params, audio_params.as_ref())?;
+        Ok(Self {
+            muxer,
+            base: path.to_path_buf(),
+            path: path.to_path_buf(),
+            container,
+            audio_params,
+            segment: 0,
+            on_segment,
+        })
+    }
+
+    /// Close the current file and open the next one with `video_params`
+    fn update_codec(&mut self, video_params: Option<&CodecParams>) -> Result<()> {
+        self.finish()?;
+        self.segment += 1;
+        self.path = output::segment_path(&self.base, self.segment);
+        tracing::info!("Codec changed, continuing in {}", self.path.display());
+        self.muxer = open_av_muxer(
+            &self.path,
+            self.container,
+            video_params,
+            self.audio_params.as_ref(),
+        )?;
+        Ok(())
+    }
+
+    /// Finalize the current file and report it to the segment hook
+    fn finish(&mut self) -> Result<()> {
+        self.muxer.finish()?;
+        if let Some(hook) = &self.on_segment {
+            hook.call(&self.path);
+        }
         Ok(())
     }
 }
 
+/// Open an A/V file and write its header
+fn open_av_muxer(
+    path: &Path,
+    container: Container,
+    video_params: Option<&CodecParams>,
+    audio_params: Option<&audio::AudioParams>,
+) -> Result<AvMuxer> {
+    let mut muxer = AvMuxer::new(path, container.ffmpeg_format())?;
+    if let Some(params) = video_params {
+        muxer.add_video_stream(params)?;
+    }
+    if let Some(params) = audio_params {
+        muxer.add_audio_stream(params)?;
+    }
+    muxer.start()?;
+    Ok(muxer)
+}
+
+/// Output of an encoder thread
+pub(crate) enum EncoderEvent {
+    /// Encoded packet and the queue stamp of its frame
+    Packet(Packet, Option<Instant>),
+    /// The encoder was replaced; the packets that follow use these params
+    CodecChanged(Option<CodecParams>),
+}
+
+/// Handle for reconfiguring a running encoder
+///
+/// Bitrate changes apply in place before the next frame where the backend
+/// supports it. Anything else (resolution, codec, ...) swaps in a new
+/// encoder at the next GOP boundary: the old one is drained, the new one
+/// starts with an IDR and outputs get its codec params, while capture keeps
+/// running.
+#[derive(Debug, Clone)]
+pub struct EncoderControl {
+    tx: crossbeam_channel::Sender<EncoderConfig>,
+    /// Latest configuration queued (or the initial one)
+    current: Arc<parking_lot::Mutex<EncoderConfig>>,
+}
+
+impl EncoderControl {
+    pub(crate) fn channel(
+        initial: EncoderConfig,
+    ) -> (Self, crossbeam_channel::Receiver<EncoderConfig>) {
+        let (tx, rx) = crossbeam_channel::unbounded();
+        let current = Arc::new(parking_lot::Mutex::new(initial));
+        (Self { tx, current }, rx)
+    }
+
+    /// Queue a new configuration (the latest one wins)
+    pub fn reconfigure(&self, config: EncoderConfig) -> Result<()> {
+        *self.current.lock() = config.clone();
+        self.tx
+            .send(config)
+            .map_err(|_| Error::Pipeline("Encoder thread is not running".into()))
+    }
+
+    /// The configuration last queued by any holder of this control
+    pub fn config(&self) -> EncoderConfig {
+        self.current.lock().clone()
+    }
+}
+
+/// Codec params still to be sent
+enum Announce {
+    /// First params; the output waits for them before it starts
+    Initial(tokio::sync::oneshot::Sender<Option<CodecParams>>),
+    /// Params sent before the first frame, from a session opened ahead of
+    /// time; sent again in-band if the encoder's differ once it runs
+    Early(CodecParams),
+    /// Params of a replacement encoder, sent in-band
+    Changed,
+    Done,
+}
+
+/// Capture task of the ladder and the daemon: feed `frame_tx` until
+/// shutdown, showing each frame to `tap` first
+///
+/// Clears `running` when the capture cannot start, so the encoders and
+/// outputs behind it wind down too.
+pub(crate) async fn run_capture(
+    config: CaptureConfig,
+    frame_tx: queue::QueueSender<Frame>,
+    running: Arc<AtomicBool>,
+    metrics: Arc<Metrics>,
+    mut tap: impl FnMut(&Frame) + Send,
+) {
+    let mut capture = match capture::create_capture(config).await {
+        Ok(c) => c,
+        Err(e) => {
+            tracing::error!("Failed to create capture: {}", e);
+            running.store(false, Ordering::SeqCst);
+            return;
+        }
+    };
+    if let Err(e) = capture.start().await {
+        tracing::error!("Failed to start capture: {}", e);
+        running.store(false, Ordering::SeqCst);
+        return;
+    }
+
+    let mut capture_dropped = 0;
+    'capture: while running.load(Ordering::SeqCst) {
+        let result = tokio::time::timeout(Duration::from_millis(100), capture.next_frame()).await;
+
+        // Frames the source itself discarded
+        let dropped = capture.frames_dropped();
+        if dropped > capture_dropped {
+            metrics
+                .frames_dropped
+                .fetch_add(dropped - capture_dropped, Ordering::Relaxed);
+            capture_dropped = dropped;
+        }
+
+        let mut frame = match result {
+            Ok(Ok(frame)) => frame,
+            Ok(Err(e)) => {
+                tracing::error!("Capture error: {}", e);
+                continue;
+            }
+            Err(_) => continue,
+        };
+        metrics.frames_captured.fetch_add(1, Ordering::Relaxed);
+        tap(&frame);
+
+        // Under the Block policy wait for the consumer, checking for
+        // shutdown
+        loop {
+            let push = frame_tx.push(frame);
+            metrics
+                .frames_dropped
+                .fetch_add(push.dropped() as u64, Ordering::Relaxed);
+            match push {
+                Push::Full(back) if running.load(Ordering::SeqCst) => {
+                    frame = back;
+                    tokio::time::sleep(Duration::from_millis(1)).await;
+                }
+                Push::Disconnected => break 'capture,
+                _ => break,
+            }
+        }
+        metrics.frame_queue.set(frame_tx.len());
+    }
+
+    let _ = capture.stop().await;
+    tracing::info!("Capture stopped");
+}
+
+/// Encoder thread: process and encode queued frames until shutdown or
+/// until the queue closes, then flush
+///
+/// With a fixed output size the encoder opens before any frame arrives and
+/// its codec params go out right away, so the output sets up while capture
+/// starts. Otherwise they go out after the first packet (None if the
+/// encoder never produced one). Packets carry the queue stamp of their
+/// frame. `dmabuf` is the layout of the DMA-BUFs the capture is expected
+/// to deliver (see [`capture::expected_dmabuf`]).
+#[allow(clippy::too_many_arguments)]
+pub(crate) fn run_encoder(
+    encoder_config: EncoderConfig,
+    dmabuf: Option<(FrameFormat, u32)>,
+    frame_rx: queue::QueueReceiver<Frame>,
+    packet_tx: tokio::sync::mpsc::Sender<EncoderEvent>,
+    codec_params_tx: tokio::sync::oneshot::Sender<Option<CodecParams>>,
+    control: crossbeam_channel::Receiver<EncoderConfig>,
+    encoder_running: Arc<AtomicBool>,
+    metrics: Arc<Metrics>,
+) {
+    // Scale/convert stage for the frames this encoder expects
+    let mut graph = processing::ProcessingGraph::from_config(&encoder_config);
+    let mut config = encoder_config.clone();
+
+    // Create encoder in this thread, on the device the scheduler picks
+    let mut encoder = match encode::EncoderScheduler::global().open(encoder_config) {
+        Ok(e) => e,
+        Err(e) => {
+            tracing::error!("Failed to create encoder: {}", e);
+            let _ = codec_params_tx.send(None);
+            return;
+        }
+    };
+
+    tracing::info!("Encoder thread started");
+
+    // Open the session now, while capture is still starting (a portal
+    // dialog may be up)
+    if let Some(input) = prepared_input(&config, dmabuf) {
+        let start = Instant::now();
+        match encoder.prepare(&input) {
+            Ok(()) => tracing::debug!("Encoder opened ahead of capture in {:?}", start.elapsed()),
+            Err(e) => tracing::warn!("Encoder will open on the first frame: {}", e),
+        }
+    }
+
+    let mut dmabuf_importer: Option<capture::DmaBufImporter> = None;
+    let mut announce = match encoder.codec_params() {
+        Some(params) => {
+            let _ = codec_params_tx.send(Some(params.clone()));
+            Announce::Early(params)
+        }
+        None => Announce::Initial(codec_params_tx),
+    };
+
+    // Configuration waiting for the next GOP boundary, and frames submitted
+    // to the current encoder
+    let mut pending_swap: Option<EncoderConfig> = None;
+    let mut submitted: u64 = 0;
+
+    // Capture and submit times of frames inside the encoder, by pts
+    let mut in_flight: VecDeque<InFlight> = VecDeque::new();
+
+    // Last processed frame and the graph target it was made for, re-sent
+    // while the capture reports no damage
+    let mut last_processed: Option<(Option<Resolution>, Option<FrameFormat>, Frame)> = None;
+
+    // Process frames until shutdown
+    'frames: while encoder_running.load(Ordering::SeqCst) {
+        match frame_rx.recv_timeout(Duration::from_millis(100)) {
+            Ok(received) => {
+                let (mut frame, captured) = (received.item, received.queued_at);
+                if received.stale > 0 {
+                    metrics
+                        .frames_dropped
+                        .fetch_add(received.stale as u64, Ordering::Relaxed);
+                }
+                metrics.record(Stage::Queue, captured.elapsed());
+                metrics.frame_queue.set(frame_rx.len());
+                if received.stale > 0 {
+                    // The evicted frames' damage is lost with them
+                    frame.damage = None;
+                }
+
+                // Reconfiguration: in place if the encoder can take it,
+                // otherwise a new encoder at the next GOP boundary
+                if let Some(requested) = control.try_iter().last() {
+                    match encoder.reconfigure(&requested) {
+                        Ok(()) => {
+                            if !config.differs_only_in_bitrate(&requested) {
+                                // Not opened yet, so it took everything
+                                graph = processing::ProcessingGraph::from_config(&requested);
+                            }
+                            config = requested;
+                            pending_swap = None;
+                        }
+                        Err(e) => {
+                            tracing::info!("Encoder change needs a new encoder: {}", e);
+                            pending_swap = Some(requested);
+                        }
+                    }
+                }
+                let gop_boundary = config.gop_size == 0 || submitted % config.gop_size as u64 == 0;
+                if gop_boundary {
+                    if let Some(next) = pending_swap.take() {
+                        match encode::EncoderScheduler::global().open(next.clone()) {
+                            Ok(replacement) => {
+                                // Drain the old encoder so its GOP completes
+                                // on the wire
+                                let mut old = std::mem::replace(&mut encoder, replacement);
+                                for packet in old.flush().unwrap_or_default() {
+                                    if !send_packet(
+                                        packet,
+                                        &old,
+                                        &mut announce,
+                                        &mut in_flight,
+                                        &packet_tx,
+                                        &metrics,
+                                    ) {
+                                        break 'frames;
+                                    }
+                                }
+                                drop(old);
+
+                                tracing::info!(
+                                    "Encoder switched to {} {:?} at {}kbps",
+                                    next.codec,
+                                    next.resolution,
+                                    next.bitrate_kbps
+                                );
+                                graph = processing::ProcessingGraph::from_config(&next);
+                                config = next;
+                                submitted = 0;
+                                if matches!(announce, Announce::Done) {
+                                    announce = Announce::Changed;
+                                }
+                            }
+                            Err(e) => {
+                                tracing::error!(
+                                    "Failed to open new encoder, keeping the current one: {}",
+                                    e
+                                );
+                            }
+                        }
+                    }
+                }
+
+                // Checked per frame: the scheduler may move the session to
+                // another backend when its first open fails
+                metrics.set_encoder_device(encoder.slot());
+
+                // DMA-BUF frames go straight to encoders that can import
+                // them; everything else gets a CPU copy before processing
+                if let Some(dmabuf) = frame.dmabuf.clone() {
+                    if !encoder.supports_dmabuf() {
+                        let importer = dmabuf_importer.get_or_insert_with(Default::default);
+                        match importer.download(&dmabuf, FramePool::global()) {
+                            Ok(mut f) => {
+                                f.damage = frame.damage.take();
+                                frame = f;
+                            }
+                            Err(e) => {
+                                tracing::error!("DMA-BUF download failed: {}", e);
+                                metrics.frames_dropped.fetch_add(1, Ordering::Relaxed);
+                                continue;
+                            }
+                        }
+                    }
+                }
+
+                // Encoders that resize on their GPU get frames at capture
+                // size
+                let target = if encoder.scales_on_device() {
+                    None
+                } else {
+                    config.resolution
+                };
+                let format = graph.format();
+                graph.set_target(target, format);
+
+                // Process frame (scale/convert if needed). Nothing changed
+                // since the last one: send that again under the new
+                // timestamp and let the encoder code it as skips.
+                let mut processed = match &last_processed {
+                    Some((last_target, last_format, last))
+                        if frame.is_static()
+                            && frame.dmabuf.is_none()
+                            && *last_target == target
+                            && *last_format == format =>
+                    {
+                        metrics.frames_static.fetch_add(1, Ordering::Relaxed);
+                        let mut repeat = last.share();
+                        repeat.pts = frame.pts;
+                        repeat.duration = frame.duration;
+                        repeat.damage = Some(Vec::new());
+                        repeat
+                    }
+                    _ if frame.dmabuf.is_some() => frame,
+                    _ => {
+                        let start = Instant::now();
+                        let result = graph.process(&frame);
+                        metrics.record(Stage::Process, start.elapsed());
+                        match result {
+                            Ok(f) => f,
+                            Err(e) => {
+                                tracing::error!("Processing error: {}", e);
+                                metrics.frames_dropped.fetch_add(1, Ordering::Relaxed);
+                                continue;
+                            }
+                        }
+                    }
+                };
+                last_processed = processed
+                    .dmabuf
+                    .is_none()
+                    .then(|| (target, format, processed.share()));
+                if gop_boundary {
+                    // Keyframes are coded whole, without ROI hints
+                    processed.damage = None;
+                }
+
+                // Submit, then drain every packet the encoder has
+                // finished (zero or more with B-frames/lookahead)
+                if in_flight.len() >= MAX_IN_FLIGHT {
+                    in_flight.pop_front();
+                }
+                let start = Instant::now();
+                in_flight.push_back(InFlight {
+                    pts: processed.pts,
+                    captured: clock::PipelineClock::global()
+                        .capture_instant(processed.pts, captured),
+                    submitted: start,
+                });
+                let result = encoder.submit(&processed);
+                metrics.record(Stage::Submit, start.elapsed());
+                match result {
+                    Ok(()) => submitted += 1,
+                    Err(e) => {
+                        tracing::error!("Encode error: {}", e);
+                        metrics.frames_dropped.fetch_add(1, Ordering::Relaxed);
+                        in_flight.pop_back();
+                    }
+                }
+
+                loop {
+                    let packet = match encoder.receive() {
+                        Ok(Some(packet)) => packet,
+                        Ok(None) => break,
+                        Err(e) => {
+                            tracing::error!("Encode error: {}", e);
+                            break;
+                        }
+                    };
+
+                    if !send_packet(
+                        packet,
+                        &encoder,
+                        &mut announce,
+                        &mut in_flight,
+                        &packet_tx,
+                        &metrics,
+                    ) {
+                        tracing::debug!("Output channel closed");
+                        break 'frames;
+                    }
+                    metrics
+                        .packet_queue
+                        .set(packet_tx.max_capacity() - packet_tx.capacity());
+                }
+            }
+            Err(crossbeam_channel::RecvTimeoutError::Timeout) => continue,
+            Err(crossbeam_channel::RecvTimeoutError::Disconnected) => break,
+        }
+    }
+
+    // Flush encoder
+    tracing::debug!("Flushing encoder");
+    if let Ok(packets) = encoder.flush() {
+        for packet in packets {
+            if !send_packet(
+                packet,
+                &encoder,
+                &mut announce,
+                &mut in_flight,
+                &packet_tx,
+                &metrics,
+            ) {
+                break;
+            }
+        }
+    }
+
+    // If we never sent codec params, send None now
+    if let Announce::Initial(tx) = announce {
+        let _ = tx.send(None);
+    }
+
+    let timings = graph.timings();
+    tracing::debug!(
+        "Processing ({:?}): scale avg {:?} max {:?}, convert avg {:?} max {:?}, transfer avg {:?} max {:?}",
+        graph.path(),
+        timings.scale.average(),
+        timings.scale.max,
+        timings.convert.average(),
+        timings.convert.max,
+        timings.transfer.average(),
+        timings.transfer.max
+    );
+
+    tracing::info!("Encoder thread stopped");
+}
+
+/// Send a packet from `encoder`, preceded by its codec params when they
+/// are due. Returns false once the output is gone.
+fn send_packet(
+    packet: Packet,
+    encoder: &dyn encode::Encoder,
+    announce: &mut Announce,
+    in_flight: &mut VecDeque<InFlight>,
+    packet_tx: &tokio::sync::mpsc::Sender<EncoderEvent>,
+    metrics: &Metrics,
+) -> bool {
+    match std::mem::replace(announce, Announce::Done) {
+        Announce::Initial(tx) => {
+            let _ = tx.send(encoder.codec_params());
+        }
+        Announce::Early(sent) => {
+            let params = encoder.codec_params();
+            if params.as_ref() != Some(&sent)
+                && packet_tx
+                    .blocking_send(EncoderEvent::CodecChanged(params))
+                    .is_err()
+            {
+                return false;
+            }
+        }
+        Announce::Changed => {
+            let event = EncoderEvent::CodecChanged(encoder.codec_params());
+            if packet_tx.blocking_send(event).is_err() {
+                return false;
+            }
+        }
+        Announce::Done => {}
+    }
+
+    let captured = take_in_flight(in_flight, packet.pts).map(|frame| {
+        metrics.record(Stage::Encode, frame.submitted.elapsed());
+        frame.captured
+    });
+    packet_tx
+        .blocking_send(EncoderEvent::Packet(packet, captured))
+        .is_ok()
+}
+
+/// Queue a captured frame, counting evictions; a frame the queue is too
+/// full to take is parked in `pending`. Returns false once the encoder is
+/// gone.
+fn queue_frame(
+    frame_tx: &queue::QueueSender<Frame>,
+    frame: Frame,
+    pending: &mut Option<Frame>,
+    metrics: &Metrics,
+) -> bool {
+    let push = frame_tx.push(frame);
+    let dropped = push.dropped();
+    if dropped > 0 {
+        metrics
+            .frames_dropped
+            .fetch_add(dropped as u64, Ordering::Relaxed);
+    }
+    match push {
+        Push::Full(frame) => *pending = Some(frame),
+        Push::Disconnected => {
+            tracing::debug!("Encoder channel closed");
+            return false;
+        }
+        Push::Queued { .. } | Push::Dropped => {}
+    }
+    metrics.frame_queue.set(frame_tx.len());
+    true
+}
+
+/// A frame inside the encoder
+struct InFlight {
+    pts: i64,
+    captured: Instant,
+    submitted: Instant,
+}
+
+/// The in-flight frame a packet came from
+fn take_in_flight(in_flight: &mut VecDeque<InFlight>, pts: i64) -> Option<InFlight> {
+    let pos = in_flight.iter().position(|frame| frame.pts == pts)?;
+    in_flight.remove(pos)
+}
+
 /// Builder for pipeline configuration
 pub struct PipelineBuilder {
     capture: CaptureConfig,
     encoder: EncoderConfig,
     audio: AudioConfig,
     output: Output,
+    renditions: Vec<Rendition>,
+    abr: Option<AbrConfig>,
 }
 
 impl PipelineBuilder {
@@ -527,6 +1308,8 @@ impl PipelineBuilder {
             encoder: EncoderConfig::default(),
             audio: AudioConfig::default(),
             output: Output::default(),
+            renditions: Vec::new(),
+            abr: None,
         }
     }
 
@@ -547,6 +1330,7 @@ impl PipelineBuilder {
 
     pub fn preset(mut self, preset: crate::config::Preset) -> Self {
         self.encoder = EncoderConfig::from_preset(preset);
+        self.capture.queue = capture_for(&self.encoder).queue;
         self
     }
 
@@ -603,8 +1387,34 @@ impl PipelineBuilder {
         self
     }
 
+    /// Add a ladder rendition (see [`PipelineBuilder::build_ladder`])
+    pub fn rendition(mut self, rendition: Rendition) -> Self {
+        self.renditions.push(rendition);
+        self
+    }
+
+    /// Add a ladder rendition from a preset
+    pub fn rendition_preset(self, preset: crate::config::Preset, output: Output) -> Self {
+        self.rendition(Rendition::from_preset(preset, output))
+    }
+
+    /// Adapt the bitrate to the uplink of streaming outputs
+    pub fn adaptive_bitrate(mut self, config: AbrConfig) -> Self {
+        self.abr = Some(config);
+        self
+    }
+
     pub fn build(self) -> Result<Pipeline> {
-        Pipeline::new_with_audio(self.capture, self.encoder, self.audio, self.output)
+        let mut pipeline =
+            Pipeline::new_with_audio(self.capture, self.encoder, self.audio, self.output)?;
+        pipeline.set_adaptive_bitrate(self.abr);
+        Ok(pipeline)
+    }
+
+    /// Build a multi-rendition pipeline from the capture config and the
+    /// added renditions (encoder, output and audio settings are unused)
+    pub fn build_ladder(self) -> Result<Ladder> {
+        Ladder::new(self.capture, self.renditions)
     }
 }
 
@@ -647,6 +1457,10 @@ fn run_audio_pipeline(
         input_format: audio::SampleFormat::F32,
     };
 
+    let frame_bytes =
+        capture_config.channels.channels() as usize * capture_config.format.bytes_per_sample();
+    let quantum = capture_config.buffer_size as usize;
+
     // Create capture and encoder
     let mut capture = audio::PipeWireAudioCapture::new(capture_config)?;
     let mut encoder = audio::FfmpegAudioEncoder::new(encoder_config)?;
@@ -672,38 +1486,79 @@ fn run_audio_pipeline(
 
     tracing::info!("Audio capture started");
 
-    // Process audio frames until shutdown
-    while running.load(Ordering::SeqCst) {
-        // Get next audio frame (with timeout)
-        let frame = rt.block_on(async {
-            tokio::time::timeout(
-                tokio::time::Duration::from_millis(100),
-                capture.next_frame(),
-            )
-            .await
-        });
+    // Drain the capture ring straight into the encoder; the buffers are
+    // reused for the whole session, overruns are filled from `silence`
+    let mut samples = vec![0u8; quantum * frame_bytes];
+    let silence = vec![0u8; quantum.max(1) * frame_bytes];
+    let mut packets = Vec::new();
+
+    // Sample count against the pipeline clock: anchors the first sample to
+    // the video timeline and follows the device clock's drift
+    let rate = config.sample_rate as u64;
+    let mut sync = clock::SampleClock::new(clock::PipelineClock::global(), config.sample_rate);
+    let mut delivered: u64 = 0;
+    let mut checked: u64 = 0;
+
+    'capture: while running.load(Ordering::SeqCst) {
+        // Samples lost to an overrun come before what is read next
+        let lost = capture.take_overruns() as usize;
+        let len = match capture.read(&mut samples, Duration::from_millis(100)) {
+            Ok(len) => len,
+            Err(Error::Timeout(_)) if lost == 0 => continue,
+            Err(Error::Timeout(_)) => 0,
+            Err(e) => {
+                tracing::error!("Audio capture error: {}", e);
+                break;
+            }
+        };
 
-        match frame {
-            Ok(Ok(audio_frame)) => {
-                // Encode the audio frame
-                match encoder.encode(&audio_frame) {
-                    Ok(Some(packet)) => {
-                        if packet_tx.blocking_send(packet).is_err() {
-                            tracing::debug!("Audio packet channel closed");
-                            break;
-                        }
-                    }
-                    Ok(None) => {} // Buffered
-                    Err(e) => {
-                        tracing::error!("Audio encode error: {}", e);
-                    }
+        delivered += (lost + len / frame_bytes) as u64;
+        sync.observe(delivered);
+        if checked == 0 {
+            encoder.set_start_pts(sync.anchor().unwrap_or(0));
+            checked = delivered;
+        } else if delivered - checked >= rate {
+            // Once a second, stretch audio back onto the clock (at most 1%)
+            checked = delivered;
+            let error = sync.error(delivered);
+            if error.unsigned_abs() >= rate / 200 {
+                let step = error.clamp(-(rate as i64 / 100), rate as i64 / 100);
+                match encoder.compensate(step as i32, rate as i32) {
+                    Ok(()) => sync.corrected(step),
+                    Err(e) => tracing::warn!("Audio drift correction failed: {}", e),
                 }
+                tracing::debug!(
+                    "Audio clock drift {:.1}ppm, correcting {} samples",
+                    sync.drift_ppm(),
+                    step
+                );
             }
-            Ok(Err(Error::Timeout(_))) => continue,
-            Ok(Err(e)) => {
-                tracing::error!("Audio capture error: {}", e);
+        }
+
+        // Fill overruns with silence where the samples were lost, so audio
+        // keeps pace with the clock
+        if lost > 0 {
+            tracing::warn!("Audio capture overrun: {} frames dropped", lost);
+            let mut gap = lost * frame_bytes;
+            while gap > 0 {
+                let n = gap.min(silence.len());
+                if let Err(e) = encoder.encode_samples(&silence[..n], &mut packets) {
+                    tracing::error!("Audio encode error: {}", e);
+                    break;
+                }
+                gap -= n;
+            }
+        }
+
+        if let Err(e) = encoder.encode_samples(&samples[..len], &mut packets) {
+            tracing::error!("Audio encode error: {}", e);
+        }
+        for packet in packets.drain(..) {
+            if packet_tx.blocking_send(packet).is_err() {
+                // The output went away; `running` belongs to the pipeline
+                tracing::debug!("Audio packet channel closed");
+                break 'capture;
             }
-            Err(_) => continue, // Timeout from tokio::time::timeout
         }
     }
 
@@ -0,0 +1,389 @@
+//! Frame buffer pool
+//!
+//! Recycles fixed-size frame buffers so the hot path (capture -> processing ->
+//! encode -> output) does not hit the allocator, or memset, on every frame.
+//!
+//! Buffers are grouped into slabs keyed by `(width, height, format, stride)`
+//! and handed out as refcounted [`FrameBuffer`] handles. Cloning a handle is
+//! a refcount bump; when the last handle is dropped the underlying slab goes
+//! back onto the free list of the pool it came from.
+
+use crate::types::FrameFormat;
+
+use parking_lot::Mutex;
+use std::collections::HashMap;
+use std::ops::{Deref, DerefMut};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, OnceLock, Weak};
+
+/// Slab key - buffers are only recycled between frames with identical layout
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct PoolKey {
+    pub width: u32,
+    pub height: u32,
+    pub format: FrameFormat,
+    /// Row stride of the first plane in bytes
+    pub stride: u32,
+}
+
+impl PoolKey {
+    pub fn new(width: u32, height: u32, format: FrameFormat, stride: u32) -> Self {
+        Self {
+            width,
+            height,
+            format,
+            stride,
+        }
+    }
+
+    /// Key for a tightly packed frame (default stride for the format)
+    pub fn packed(width: u32, height: u32, format: FrameFormat) -> Self {
+        Self::new(width, height, format, format.default_stride(width))
+    }
+
+    /// Buffer size in bytes for this layout
+    pub fn size(&self) -> usize {
+        self.format
+            .buffer_size(self.width, self.height, self.stride)
+    }
+}
+
+/// Pool counters
+#[derive(Debug, Clone, Copy, Default)]
+pub struct PoolStats {
+    /// Buffers served from a free list
+    pub hits: u64,
+    /// Buffers that had to be allocated
+    pub misses: u64,
+    /// Buffers returned to a free list on drop
+    pub returned: u64,
+    /// Buffers freed on drop because their free list was full
+    pub discarded: u64,
+    /// Buffers currently sitting in free lists
+    pub free_buffers: usize,
+    /// Bytes currently sitting in free lists
+    pub free_bytes: usize,
+}
+
+struct PoolShared {
+    free: Mutex<HashMap<PoolKey, Vec<Vec<u8>>>>,
+    max_free_per_key: usize,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    returned: AtomicU64,
+    discarded: AtomicU64,
+}
+
+impl PoolShared {
+    fn take(&self, key: &PoolKey) -> Option<Vec<u8>> {
+        let buf = self.free.lock().get_mut(key).and_then(|list| list.pop());
+        match buf {
+            Some(_) => self.hits.fetch_add(1, Ordering::Relaxed),
+            None => self.misses.fetch_add(1, Ordering::Relaxed),
+        };
+        buf
+    }
+
+    fn release(&self, key: PoolKey, data: Vec<u8>) {
+        let mut free = self.free.lock();
+        let list = free.entry(key).or_default();
+        if list.len() < self.max_free_per_key {
+            list.push(data);
+            self.returned.fetch_add(1, Ordering::Relaxed);
+        } else {
+            drop(free);
+            self.discarded.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Shared pool of frame buffers
+///
+/// Cheap to clone; all clones refer to the same free lists.
+#[derive(Clone)]
+pub struct FramePool {
+    shared: Arc<PoolShared>,
+}
+
+impl FramePool {
+    /// Free buffers kept per key by default (covers the capture and encoder
+    /// queues plus a couple of frames in flight)
+    pub const DEFAULT_MAX_FREE_PER_KEY: usize = 8;
+
+    /// Create a new, empty pool
+    pub fn new() -> Self {
+        Self::with_max_free_per_key(Self::DEFAULT_MAX_FREE_PER_KEY)
+    }
+
+    /// Create a pool that keeps at most `max` free buffers per key
+    pub fn with_max_free_per_key(max: usize) -> Self {
+        Self {
+            shared: Arc::new(PoolShared {
+                free: Mutex::new(HashMap::new()),
+                max_free_per_key: max,
+                hits: AtomicU64::new(0),
+                misses: AtomicU64::new(0),
+                returned: AtomicU64::new(0),
+                discarded: AtomicU64::new(0),
+            }),
+        }
+    }
+
+    /// Process-wide pool shared by capture, processing, encoders and outputs
+    pub fn global() -> &'static FramePool {
+        static GLOBAL: OnceLock<FramePool> = OnceLock::new();
+        GLOBAL.get_or_init(FramePool::new)
+    }
+
+    /// Get a buffer for `key`
+    ///
+    /// Contents are unspecified (usually a previous frame); callers are
+    /// expected to overwrite the whole buffer.
+    pub fn acquire(&self, key: PoolKey) -> FrameBuffer {
+        let size = key.size();
+        let data = match self.shared.take(&key) {
+            Some(data) => data,
+            None => vec![0u8; size],
+        };
+        debug_assert_eq!(data.len(), size);
+
+        FrameBuffer {
+            inner: Arc::new(Slab {
+                data,
+                origin: Some((Arc::downgrade(&self.shared), key)),
+            }),
+        }
+    }
+
+    /// Get a zero-filled buffer for `key`
+    pub fn acquire_zeroed(&self, key: PoolKey) -> FrameBuffer {
+        let mut buf = self.acquire(key);
+        if let Some(data) = buf.get_mut() {
+            data.fill(0);
+        }
+        buf
+    }
+
+    /// Allocate `count` buffers for `key` up front so the first frames
+    /// don't miss
+    pub fn preallocate(&self, key: PoolKey, count: usize) {
+        let size = key.size();
+        let mut free = self.shared.free.lock();
+        let list = free.entry(key).or_default();
+        while list.len() < count.min(self.shared.max_free_per_key) {
+            list.push(vec![0u8; size]);
+        }
+    }
+
+    /// Drop all free buffers (e.g. after a resolution change)
+    pub fn clear(&self) {
+        self.shared.free.lock().clear();
+    }
+
+    /// Get pool counters
+    pub fn stats(&self) -> PoolStats {
+        let (free_buffers, free_bytes) = {
+            let free = self.shared.free.lock();
+            free.iter().fold((0, 0), |(n, bytes), (key, list)| {
+                (n + list.len(), bytes + list.len() * key.size())
+            })
+        };
+
+        PoolStats {
+            hits: self.shared.hits.load(Ordering::Relaxed),
+            misses: self.shared.misses.load(Ordering::Relaxed),
+            returned: self.shared.returned.load(Ordering::Relaxed),
+            discarded: self.shared.discarded.load(Ordering::Relaxed),
+            free_buffers,
+            free_bytes,
+        }
+    }
+}
+
+impl Default for FramePool {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl std::fmt::Debug for FramePool {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("FramePool")
+            .field("stats", &self.stats())
+            .finish()
+    }
+}
+
+/// Backing storage of a [`FrameBuffer`]
+struct Slab {
+    data: Vec<u8>,
+    /// Pool to return to on drop (None for buffers wrapped from a `Vec`)
+    origin: Option<(Weak<PoolShared>, PoolKey)>,
+}
+
+impl Drop for Slab {
+    fn drop(&mut self) {
+        if let Some((pool, key)) = self.origin.take() {
+            if let Some(pool) = pool.upgrade() {
+                pool.release(key, std::mem::take(&mut self.data));
+            }
+        }
+    }
+}
+
+/// Refcounted frame buffer handle
+///
+/// Derefs to `[u8]`. Mutable access is copy-on-write: if the buffer is
+/// shared, the first mutable borrow copies it into a fresh buffer from the
+/// same pool, so other holders never observe the write.
+#[derive(Clone)]
+pub struct FrameBuffer {
+    inner: Arc<Slab>,
+}
+
+impl FrameBuffer {
+    /// Wrap an existing allocation (not returned to any pool)
+    pub fn from_vec(data: Vec<u8>) -> Self {
+        Self {
+            inner: Arc::new(Slab { data, origin: None }),
+        }
+    }
+
+    /// Empty buffer (e.g. for DMA-BUF frames that carry no CPU data)
+    pub fn empty() -> Self {
+        Self::from_vec(Vec::new())
+    }
+
+    /// Layout key if this buffer came from a pool
+    pub fn key(&self) -> Option<PoolKey> {
+        self.inner.origin.as_ref().map(|(_, key)| *key)
+    }
+
+    /// Is this the only handle to the buffer?
+    pub fn is_unique(&self) -> bool {
+        Arc::strong_count(&self.inner) == 1
+    }
+
+    /// Mutable access without copying, if this is the only handle
+    pub fn get_mut(&mut self) -> Option<&mut [u8]> {
+        Arc::get_mut(&mut self.inner).map(|slab| slab.data.as_mut_slice())
+    }
+
+    /// Mutable access, copying the buffer first if it is shared
+    pub fn make_mut(&mut self) -> &mut [u8] {
+        if Arc::get_mut(&mut self.inner).is_none() {
+            let copy = match &self.inner.origin {
+                Some((pool, key)) => match pool.upgrade() {
+                    Some(shared) => {
+                        let mut buf = FramePool { shared }.acquire(*key);
+                        buf.get_mut()
+                            .expect("freshly acquired buffer is unique")
+                            .copy_from_slice(&self.inner.data);
+                        buf
+                    }
+                    None => Self::from_vec(self.inner.data.clone()),
+                },
+                None => Self::from_vec(self.inner.data.clone()),
+            };
+            *self = copy;
+        }
+
+        Arc::get_mut(&mut self.inner)
+            .expect("buffer is unique after copy-on-write")
+            .data
+            .as_mut_slice()
+    }
+}
+
+impl Default for FrameBuffer {
+    fn default() -> Self {
+        Self::empty()
+    }
+}
+
+impl From<Vec<u8>> for FrameBuffer {
+    fn from(data: Vec<u8>) -> Self {
+        Self::from_vec(data)
+    }
+}
+
+impl Deref for FrameBuffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.inner.data
+    }
+}
+
+impl DerefMut for FrameBuffer {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        self.make_mut()
+    }
+}
+
+impl AsRef<[u8]> for FrameBuffer {
+    fn as_ref(&self) -> &[u8] {
+        self
+    }
+}
+
+impl std::fmt::Debug for FrameBuffer {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("FrameBuffer")
+            .field("len", &self.inner.data.len())
+            .field("key", &self.key())
+            .field("refs", &Arc::strong_count(&self.inner))
+            .finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_buffer_returns_to_pool() {
+        let pool = FramePool::new();
+        let key = PoolKey::packed(64, 32, FrameFormat::Bgra);
+
+        let buf = pool.acquire(key);
+        assert_eq!(buf.len(), 64 * 32 * 4);
+        drop(buf);
+
+        let _buf = pool.acquire(key);
+        let stats = pool.stats();
+        assert_eq!(stats.misses, 1);
+        assert_eq!(stats.hits, 1);
+        assert_eq!(stats.returned, 1);
+    }
+
+    #[test]
+    fn test_shared_buffer_is_copy_on_write() {
+        let pool = FramePool::new();
+        let key = PoolKey::packed(16, 16, FrameFormat::Nv12);
+
+        let mut a = pool.acquire_zeroed(key);
+        let b = a.clone();
+        assert!(!a.is_unique());
+
+        a[0] = 42;
+        assert_eq!(a[0], 42);
+        assert_eq!(b[0], 0);
+        assert!(a.is_unique());
+        assert_eq!(a.key(), Some(key));
+    }
+
+    #[test]
+    fn test_free_list_is_bounded() {
+        let pool = FramePool::with_max_free_per_key(2);
+        let key = PoolKey::packed(8, 8, FrameFormat::Bgra);
+
+        let bufs: Vec<_> = (0..4).map(|_| pool.acquire(key)).collect();
+        drop(bufs);
+
+        let stats = pool.stats();
+        assert_eq!(stats.returned, 2);
+        assert_eq!(stats.discarded, 2);
+        assert_eq!(stats.free_buffers, 2);
+    }
+}
@@ -1,47 +1,58 @@
-//! Colorspace conversion using FFmpeg swscale
-
-use crate::error::{Error, Result};
-use crate::types::FrameFormat;
-
-use ffmpeg_next as ffmpeg;
-use ffmpeg_next::format::Pixel;
-use ffmpeg_next::software::scaling::{Context as SwsContext, Flags as SwsFlags};
-
-/// Map FrameFormat to FFmpeg Pixel format
-fn format_to_pixel(format: FrameFormat) -> Option<Pixel> {
-    match format {
-        FrameFormat::Bgra => Some(Pixel::BGRA),
-        FrameFormat::Rgba => Some(Pixel::RGBA),
-        FrameFormat::Nv12 => Some(Pixel::NV12),
-        FrameFormat::P010 => Some(Pixel::P010LE),
-        FrameFormat::Yuv420p => Some(Pixel::YUV420P),
-        FrameFormat::Yuv444p => Some(Pixel::YUV444P),
-        FrameFormat::Rgb24 => Some(Pixel::RGB24),
-    }
-}
-
-/// Colorspace converter using FFmpeg swscale
+//! Colorspace conversion
+//!
+//! Packed RGB -> NV12/P010, NV12 -> P010 and BGRA <-> RGBA run on the SIMD
+//! kernels; everything else goes through a cached swscale context.
+
+use super::hdr::ColorMatrix;
+use super::kernels::{self, PlaneMut, PlaneRef};
+use super::sws::{self, SwsCache};
+use crate::error::Result;
+use crate::pool::PoolKey;
+use crate::types::{Frame, FrameFormat};
+
+use ffmpeg_next::software::scaling::Flags as SwsFlags;
+
+/// Colorspace converter
+///
+/// Keeps its swscale contexts between frames.
 pub struct ColorspaceConverter {
-    // Cached scaler context (could be extended to cache multiple contexts)
+    cache: SwsCache,
 }
 
 impl ColorspaceConverter {
     pub fn new() -> Self {
-        // Initialize FFmpeg once
-        let _ = ffmpeg::init();
-        Self {}
+        Self {
+            cache: SwsCache::new(),
+        }
     }
 
     /// Convert frame colorspace
     pub fn convert(
-        &self,
+        &mut self,
         input: &[u8],
         src_format: FrameFormat,
         dst_format: FrameFormat,
         width: u32,
         height: u32,
     ) -> Result<Vec<u8>> {
-        convert_colorspace(input, src_format, dst_format, width, height)
+        convert_packed(
+            &mut self.cache,
+            input,
+            src_format,
+            dst_format,
+            width,
+            height,
+        )
+    }
+
+    /// Convert `frame` to `format` into a pooled buffer
+    pub fn process(&mut self, frame: &Frame, format: FrameFormat) -> Result<Frame> {
+        let src = PoolKey::new(frame.width, frame.height, frame.format, frame.stride);
+        let dst = PoolKey::packed(frame.width, frame.height, format);
+        let mut out = sws::output_frame(frame, dst);
+        let output = out.data.get_mut().expect("pooled buffer is unique");
+        convert_into(&mut self.cache, &frame.data, src, output, dst)?;
+        Ok(out)
     }
 }
 
@@ -51,7 +62,7 @@ impl Default for ColorspaceConverter {
     }
 }
 
-/// Convert frame colorspace using FFmpeg swscale
+/// Convert frame colorspace
 pub fn convert_colorspace(
     input: &[u8],
     src_format: FrameFormat,
@@ -59,314 +70,115 @@ pub fn convert_colorspace(
     width: u32,
     height: u32,
 ) -> Result<Vec<u8>> {
-    if src_format == dst_format {
-        return Ok(input.to_vec());
-    }
-
-    // Simple swaps don't need swscale
-    match (src_format, dst_format) {
-        (FrameFormat::Bgra, FrameFormat::Rgba) | (FrameFormat::Rgba, FrameFormat::Bgra) => {
-            return bgra_rgba_swap(input);
-        }
-        // P010 conversions use specialized HDR code
-        (FrameFormat::Bgra, FrameFormat::P010) => {
-            return super::hdr::bgra_to_p010(input, width as usize, height as usize);
-        }
-        (FrameFormat::Rgba, FrameFormat::P010) => {
-            let bgra = bgra_rgba_swap(input)?;
-            return super::hdr::bgra_to_p010(&bgra, width as usize, height as usize);
-        }
-        (FrameFormat::Nv12, FrameFormat::P010) => {
-            return super::hdr::nv12_to_p010(input, width as usize, height as usize);
-        }
-        _ => {}
-    }
-
-    // Use FFmpeg swscale for other conversions
-    let src_pixel = format_to_pixel(src_format).ok_or_else(|| {
-        Error::ColorspaceConversion(format!("Unsupported source format: {:?}", src_format))
-    })?;
-
-    let dst_pixel = format_to_pixel(dst_format).ok_or_else(|| {
-        Error::ColorspaceConversion(format!("Unsupported destination format: {:?}", dst_format))
-    })?;
-
-    convert_with_swscale(input, src_pixel, dst_pixel, width, height)
+    sws::with_thread_cache(|cache| {
+        convert_packed(cache, input, src_format, dst_format, width, height)
+    })
 }
 
-/// Convert using FFmpeg swscale
-fn convert_with_swscale(
+/// Convert a tightly packed buffer
+fn convert_packed(
+    cache: &mut SwsCache,
     input: &[u8],
-    src_pixel: Pixel,
-    dst_pixel: Pixel,
+    src_format: FrameFormat,
+    dst_format: FrameFormat,
     width: u32,
     height: u32,
 ) -> Result<Vec<u8>> {
-    let _ = ffmpeg::init();
-
-    // Create scaling context (also handles colorspace conversion)
-    let mut scaler = SwsContext::get(
-        src_pixel,
-        width,
-        height,
-        dst_pixel,
-        width,
-        height,
-        SwsFlags::BILINEAR,
-    )
-    .map_err(|e| Error::ColorspaceConversion(format!("Failed to create scaler: {}", e)))?;
-
-    // Create source frame
-    let mut src_frame = ffmpeg::frame::Video::new(src_pixel, width, height);
-
-    // Copy input data to source frame
-    copy_to_frame(input, &mut src_frame, src_pixel, width, height)?;
-
-    // Create destination frame
-    let mut dst_frame = ffmpeg::frame::Video::new(dst_pixel, width, height);
-
-    // Run conversion
-    scaler
-        .run(&src_frame, &mut dst_frame)
-        .map_err(|e| Error::ColorspaceConversion(format!("Conversion failed: {}", e)))?;
+    if src_format == dst_format {
+        return Ok(input.to_vec());
+    }
 
-    // Extract output data
-    copy_from_frame(&dst_frame, dst_pixel, width, height)
+    let src = PoolKey::packed(width, height, src_format);
+    let dst = PoolKey::packed(width, height, dst_format);
+    let mut output = vec![0u8; dst.size()];
+    convert_into(cache, input, src, &mut output, dst)?;
+    Ok(output)
 }
 
-/// Copy input buffer to FFmpeg frame
-fn copy_to_frame(
+/// Convert `input` laid out as `src` into `output` laid out as `dst`
+fn convert_into(
+    cache: &mut SwsCache,
     input: &[u8],
-    frame: &mut ffmpeg::frame::Video,
-    pixel: Pixel,
-    width: u32,
-    height: u32,
+    src: PoolKey,
+    output: &mut [u8],
+    dst: PoolKey,
 ) -> Result<()> {
-    match pixel {
-        Pixel::BGRA | Pixel::RGBA => {
-            // Packed 4-byte format
-            let stride = (width * 4) as usize;
-            let frame_stride = frame.stride(0);
-            let plane = frame.data_mut(0);
-
-            for y in 0..height as usize {
-                let src_start = y * stride;
-                let src_end = src_start + stride;
-                let dst_start = y * frame_stride;
-
-                if src_end <= input.len() && dst_start + stride <= plane.len() {
-                    plane[dst_start..dst_start + stride]
-                        .copy_from_slice(&input[src_start..src_end]);
-                }
-            }
-        }
-        Pixel::NV12 => {
-            // Y plane + interleaved UV plane
-            let y_size = (width * height) as usize;
-            let y_stride = frame.stride(0);
-            let uv_stride = frame.stride(1);
-
-            // Copy Y plane
-            {
-                let y_plane = frame.data_mut(0);
-                for y in 0..height as usize {
-                    let src_start = y * width as usize;
-                    let dst_start = y * y_stride;
-                    let copy_len = width as usize;
-
-                    if src_start + copy_len <= input.len() && src_start + copy_len <= y_size {
-                        y_plane[dst_start..dst_start + copy_len]
-                            .copy_from_slice(&input[src_start..src_start + copy_len]);
-                    }
-                }
-            }
-
-            // Copy UV plane
-            {
-                let uv_plane = frame.data_mut(1);
-                let uv_height = height as usize / 2;
-                let uv_width = width as usize;
-
-                for y in 0..uv_height {
-                    let src_start = y_size + y * uv_width;
-                    let dst_start = y * uv_stride;
-                    let copy_len = uv_width;
-
-                    if src_start + copy_len <= input.len() {
-                        uv_plane[dst_start..dst_start + copy_len]
-                            .copy_from_slice(&input[src_start..src_start + copy_len]);
-                    }
-                }
-            }
-        }
-        Pixel::YUV420P => {
-            // Three separate planes
-            let y_size = (width * height) as usize;
-            let uv_size = y_size / 4;
-            let half_height = height as usize / 2;
-            let half_width = width as usize / 2;
-
-            let y_stride = frame.stride(0);
-            let u_stride = frame.stride(1);
-            let v_stride = frame.stride(2);
-
-            // Y plane
-            {
-                let y_plane = frame.data_mut(0);
-                for y in 0..height as usize {
-                    let src_start = y * width as usize;
-                    let dst_start = y * y_stride;
-                    let copy_len = width as usize;
-                    if src_start + copy_len <= y_size {
-                        y_plane[dst_start..dst_start + copy_len]
-                            .copy_from_slice(&input[src_start..src_start + copy_len]);
-                    }
-                }
-            }
-
-            // U plane
-            {
-                let u_plane = frame.data_mut(1);
-                for y in 0..half_height {
-                    let src_start = y_size + y * half_width;
-                    let dst_start = y * u_stride;
-                    if src_start + half_width <= input.len() {
-                        u_plane[dst_start..dst_start + half_width]
-                            .copy_from_slice(&input[src_start..src_start + half_width]);
-                    }
-                }
-            }
-
-            // V plane
-            {
-                let v_plane = frame.data_mut(2);
-                for y in 0..half_height {
-                    let src_start = y_size + uv_size + y * half_width;
-                    let dst_start = y * v_stride;
-                    if src_start + half_width <= input.len() {
-                        v_plane[dst_start..dst_start + half_width]
-                            .copy_from_slice(&input[src_start..src_start + half_width]);
-                    }
-                }
-            }
-        }
-        _ => {
-            // Fallback: copy directly to first plane
-            let plane = frame.data_mut(0);
-            let copy_len = input.len().min(plane.len());
-            plane[..copy_len].copy_from_slice(&input[..copy_len]);
-        }
+    if !convert_with_kernels(input, src, output, dst)? {
+        cache.run(input, src, output, dst, SwsFlags::BILINEAR)?;
     }
-
     Ok(())
 }
 
-/// Copy data from FFmpeg frame to output buffer
-fn copy_from_frame(
-    frame: &ffmpeg::frame::Video,
-    pixel: Pixel,
-    width: u32,
-    height: u32,
-) -> Result<Vec<u8>> {
-    match pixel {
-        Pixel::BGRA | Pixel::RGBA => {
-            // Packed 4-byte format
-            let stride = (width * 4) as usize;
-            let mut output = vec![0u8; stride * height as usize];
-            let plane = frame.data(0);
-            let frame_stride = frame.stride(0);
-
-            for y in 0..height as usize {
-                let src_start = y * frame_stride;
-                let dst_start = y * stride;
-                output[dst_start..dst_start + stride]
-                    .copy_from_slice(&plane[src_start..src_start + stride]);
-            }
+/// Do the SIMD kernels cover `src` -> `dst` at the same size?
+pub(super) fn kernel_supports(src: FrameFormat, dst: FrameFormat) -> bool {
+    matches!(
+        (src, dst),
+        (FrameFormat::Bgra, FrameFormat::Rgba)
+            | (FrameFormat::Rgba, FrameFormat::Bgra)
+            | (
+                FrameFormat::Bgra | FrameFormat::Rgba,
+                FrameFormat::Nv12 | FrameFormat::P010
+            )
+            | (FrameFormat::Nv12, FrameFormat::P010)
+    )
+}
 
-            Ok(output)
+/// Run the conversion on the SIMD kernels; `false` if they don't cover it
+pub(super) fn convert_with_kernels(
+    input: &[u8],
+    src: PoolKey,
+    output: &mut [u8],
+    dst: PoolKey,
+) -> Result<bool> {
+    let (width, height) = (src.width as usize, src.height as usize);
+    let src_planes = src.format.plane_layout(src.height, src.stride);
+    let dst_planes = dst.format.plane_layout(dst.height, dst.stride);
+    let source = |plane: usize| {
+        let (offset, stride) = src_planes[plane];
+        PlaneRef::new(input.get(offset..).unwrap_or_default(), stride)
+    };
+
+    // Only the NV12/P010 outputs have a second plane
+    let split = match dst.format.plane_count() {
+        1 => output.len(),
+        _ => dst_planes[1].0.min(output.len()),
+    };
+    let (y, uv) = output.split_at_mut(split);
+    let y = PlaneMut::new(y, dst_planes[0].1);
+    let uv = PlaneMut::new(uv, dst_planes[1].1);
+
+    match (src.format, dst.format) {
+        (FrameFormat::Bgra, FrameFormat::Rgba) | (FrameFormat::Rgba, FrameFormat::Bgra) => {
+            kernels::swap_rb(source(0), y, width, height)?;
         }
-        Pixel::NV12 => {
-            // Y plane + interleaved UV plane
-            let y_size = (width * height) as usize;
-            let uv_size = y_size / 2;
-            let mut output = vec![0u8; y_size + uv_size];
-
-            // Copy Y plane
-            let y_plane = frame.data(0);
-            let y_stride = frame.stride(0);
-            for y in 0..height as usize {
-                let src_start = y * y_stride;
-                let dst_start = y * width as usize;
-                output[dst_start..dst_start + width as usize]
-                    .copy_from_slice(&y_plane[src_start..src_start + width as usize]);
-            }
-
-            // Copy UV plane
-            let uv_plane = frame.data(1);
-            let uv_stride = frame.stride(1);
-            let uv_height = height as usize / 2;
-            for y in 0..uv_height {
-                let src_start = y * uv_stride;
-                let dst_start = y_size + y * width as usize;
-                output[dst_start..dst_start + width as usize]
-                    .copy_from_slice(&uv_plane[src_start..src_start + width as usize]);
-            }
-
-            Ok(output)
+        (FrameFormat::Bgra | FrameFormat::Rgba, FrameFormat::Nv12) => {
+            kernels::rgb_to_nv12(
+                source(0),
+                y,
+                uv,
+                width,
+                height,
+                src.format,
+                ColorMatrix::Bt709,
+            )?;
         }
-        Pixel::YUV420P => {
-            // Three separate planes
-            let y_size = (width * height) as usize;
-            let uv_size = y_size / 4;
-            let mut output = vec![0u8; y_size + uv_size * 2];
-
-            // Y plane
-            let y_plane = frame.data(0);
-            let y_stride = frame.stride(0);
-            for y in 0..height as usize {
-                let src_start = y * y_stride;
-                let dst_start = y * width as usize;
-                output[dst_start..dst_start + width as usize]
-                    .copy_from_slice(&y_plane[src_start..src_start + width as usize]);
-            }
-
-            // U plane
-            let u_plane = frame.data(1);
-            let u_stride = frame.stride(1);
-            let half_height = height as usize / 2;
-            let half_width = width as usize / 2;
-            for y in 0..half_height {
-                let src_start = y * u_stride;
-                let dst_start = y_size + y * half_width;
-                output[dst_start..dst_start + half_width]
-                    .copy_from_slice(&u_plane[src_start..src_start + half_width]);
-            }
-
-            // V plane
-            let v_plane = frame.data(2);
-            let v_stride = frame.stride(2);
-            for y in 0..half_height {
-                let src_start = y * v_stride;
-                let dst_start = y_size + uv_size + y * half_width;
-                output[dst_start..dst_start + half_width]
-                    .copy_from_slice(&v_plane[src_start..src_start + half_width]);
-            }
-
-            Ok(output)
+        // P010 output is the HDR path
+        (FrameFormat::Bgra | FrameFormat::Rgba, FrameFormat::P010) => {
+            kernels::rgb_to_p010(
+                source(0),
+                y,
+                uv,
+                width,
+                height,
+                src.format,
+                ColorMatrix::Bt2020Ncl,
+            )?;
         }
-        _ => {
-            // Fallback: copy from first plane
-            let plane = frame.data(0);
-            Ok(plane.to_vec())
+        (FrameFormat::Nv12, FrameFormat::P010) => {
+            kernels::nv12_to_p010(source(0), source(1), y, uv, width, height)?;
         }
+        _ => return Ok(false),
     }
-}
 
-/// BGRA <-> RGBA swap (just swap R and B channels)
-fn bgra_rgba_swap(input: &[u8]) -> Result<Vec<u8>> {
-    let mut output = input.to_vec();
-    for chunk in output.chunks_exact_mut(4) {
-        chunk.swap(0, 2); // Swap B and R
-    }
-    Ok(output)
+    Ok(true)
 }
@@ -0,0 +1,472 @@
+//! GPU scale/convert stage
+//!
+//! Runs FFmpeg's hardware filters (`scale_cuda`, `vpp_qsv`, `scale_vaapi`,
+//! `scale_vulkan`) on the encoder's device, so frames are resized where they
+//! are encoded instead of by swscale on the CPU. Device frames go through
+//! untouched; system-memory frames are uploaded at capture size. The output
+//! stays on the device (the encoder opens with the filter's frames), or is
+//! downloaded for encoders that only take system memory.
+
+use super::graph::StageTiming;
+use super::scale::ScaleAlgorithm;
+use crate::encode::EncoderBackend;
+use crate::error::{Error, Result};
+use crate::hwaccel::{find_render_node, HwDevice, HwDeviceType, HwFramesContext};
+use crate::types::Resolution;
+
+use ffmpeg_next as ffmpeg;
+use ffmpeg_next::ffi;
+use ffmpeg_next::format::Pixel;
+
+use std::ffi::{CStr, CString};
+use std::ptr;
+use std::time::Instant;
+
+// AV_BUFFERSRC_FLAG_KEEP_REF (anonymous enum in buffersrc.h)
+const BUFFERSRC_FLAG_KEEP_REF: i32 = 8;
+
+/// Hardware filter family
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum GpuBackend {
+    /// `scale_cuda` (NVENC)
+    Cuda,
+    /// `vpp_qsv` (Quick Sync)
+    Qsv,
+    /// `scale_vaapi` (Intel/AMD)
+    Vaapi,
+    /// `scale_vulkan`
+    Vulkan,
+}
+
+impl GpuBackend {
+    /// Candidates for an encoder backend, best first
+    ///
+    /// AMF has no Linux hardware-frame input in FFmpeg, so its scaling runs
+    /// on the AMD GPU through VA-API/Vulkan and the result is downloaded.
+    pub fn for_encoder(backend: EncoderBackend) -> &'static [GpuBackend] {
+        match backend {
+            EncoderBackend::Nvenc => &[GpuBackend::Cuda],
+            EncoderBackend::Qsv => &[GpuBackend::Qsv],
+            EncoderBackend::Amf => &[GpuBackend::Vaapi, GpuBackend::Vulkan],
+            EncoderBackend::Auto | EncoderBackend::Software => &[],
+        }
+    }
+
+    /// First candidate whose filter this FFmpeg build has
+    pub fn select(backend: EncoderBackend) -> Option<GpuBackend> {
+        Self::for_encoder(backend)
+            .iter()
+            .copied()
+            .find(|gpu| gpu.is_available())
+    }
+
+    /// Device the filter runs on
+    pub fn device_type(self) -> HwDeviceType {
+        match self {
+            GpuBackend::Cuda => HwDeviceType::Cuda,
+            GpuBackend::Qsv => HwDeviceType::Qsv,
+            GpuBackend::Vaapi => HwDeviceType::Vaapi,
+            GpuBackend::Vulkan => HwDeviceType::Vulkan,
+        }
+    }
+
+    /// FFmpeg filter name
+    pub fn filter_name(self) -> &'static str {
+        match self {
+            GpuBackend::Cuda => "scale_cuda",
+            GpuBackend::Qsv => "vpp_qsv",
+            GpuBackend::Vaapi => "scale_vaapi",
+            GpuBackend::Vulkan => "scale_vulkan",
+        }
+    }
+
+    /// Is the filter compiled into FFmpeg?
+    pub fn is_available(self) -> bool {
+        if ffmpeg::init().is_err() {
+            return false;
+        }
+        let name = CString::new(self.filter_name()).expect("filter name has no NUL");
+        unsafe { !ffi::avfilter_get_by_name(name.as_ptr()).is_null() }
+    }
+
+    /// Open the default device for this backend
+    pub fn open_device(self) -> Result<HwDevice> {
+        match self {
+            GpuBackend::Vaapi => {
+                HwDevice::create(HwDeviceType::Vaapi, find_render_node().as_deref())
+            }
+            _ => HwDevice::create(self.device_type(), None),
+        }
+    }
+
+    /// Filter options for the output size and software format
+    fn filter_args(self, size: Resolution, format: &str, algorithm: ScaleAlgorithm) -> String {
+        let Resolution { width, height } = size;
+        match self {
+            GpuBackend::Cuda => {
+                let interp = match algorithm {
+                    ScaleAlgorithm::Nearest => "nearest",
+                    ScaleAlgorithm::Bilinear => "bilinear",
+                    ScaleAlgorithm::Bicubic => "bicubic",
+                    ScaleAlgorithm::Lanczos => "lanczos",
+                };
+                format!("w={width}:h={height}:format={format}:interp_algo={interp}")
+            }
+            GpuBackend::Qsv => format!("w={width}:h={height}:format={format}"),
+            GpuBackend::Vaapi => {
+                let mode = match algorithm {
+                    ScaleAlgorithm::Nearest | ScaleAlgorithm::Bilinear => "fast",
+                    ScaleAlgorithm::Bicubic | ScaleAlgorithm::Lanczos => "hq",
+                };
+                format!("w={width}:h={height}:format={format}:mode={mode}")
+            }
+            GpuBackend::Vulkan => {
+                let scaler = match algorithm {
+                    ScaleAlgorithm::Nearest => "nearest",
+                    _ => "bilinear",
+                };
+                format!("w={width}:h={height}:format={format}:scaler={scaler}")
+            }
+        }
+    }
+}
+
+impl std::fmt::Display for GpuBackend {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}", self.filter_name())
+    }
+}
+
+/// Frames fed to the stage
+#[derive(Debug, Clone)]
+pub enum GpuInput {
+    /// Frames already on the device (e.g. imported DMA-BUFs)
+    Device(HwFramesContext),
+    /// System-memory frames, uploaded before the filter
+    System {
+        format: Pixel,
+        width: u32,
+        height: u32,
+    },
+}
+
+impl GpuInput {
+    fn sw_format(&self) -> Pixel {
+        match self {
+            GpuInput::Device(frames) => frames.sw_format(),
+            GpuInput::System { format, .. } => *format,
+        }
+    }
+}
+
+/// What the stage produces
+#[derive(Debug, Clone, Copy)]
+pub struct GpuOutput {
+    pub size: Resolution,
+    /// Software format (None keeps the input's)
+    pub format: Option<Pixel>,
+    /// Copy the result back to system memory
+    pub download: bool,
+    pub algorithm: ScaleAlgorithm,
+}
+
+impl GpuOutput {
+    /// `size` in the input format, left on the device
+    pub fn new(size: Resolution) -> Self {
+        Self {
+            size,
+            format: None,
+            download: false,
+            algorithm: ScaleAlgorithm::default(),
+        }
+    }
+}
+
+/// Hardware scale/convert filter graph with a fixed input and output
+pub struct GpuScaler {
+    graph: *mut ffi::AVFilterGraph,
+    source: *mut ffi::AVFilterContext,
+    sink: *mut ffi::AVFilterContext,
+    backend: GpuBackend,
+    size: Resolution,
+    /// Device frames the graph outputs (None when downloading)
+    frames: Option<HwFramesContext>,
+    timing: StageTiming,
+}
+
+impl GpuScaler {
+    /// Build a graph turning `input` into `output` on `device`
+    pub fn new(
+        backend: GpuBackend,
+        device: &HwDevice,
+        input: GpuInput,
+        output: GpuOutput,
+    ) -> Result<Self> {
+        let graph = unsafe { ffi::avfilter_graph_alloc() };
+        if graph.is_null() {
+            return Err(Error::Scaling("Failed to allocate filter graph".into()));
+        }
+        let mut scaler = Self {
+            graph,
+            source: ptr::null_mut(),
+            sink: ptr::null_mut(),
+            backend,
+            size: output.size,
+            frames: None,
+            timing: StageTiming::default(),
+        };
+
+        let format = pixel_name(output.format.unwrap_or_else(|| input.sw_format()))?;
+        unsafe { scaler.build(device, &input, &format, output)? };
+
+        tracing::info!(
+            "GPU scaling via {}: {:?} -> {}x{} {} ({})",
+            backend,
+            input,
+            output.size.width,
+            output.size.height,
+            format,
+            if output.download {
+                "downloaded"
+            } else {
+                "on device"
+            }
+        );
+        Ok(scaler)
+    }
+
+    /// Link source -> [hwupload] -> scale -> [hwdownload -> format] -> sink
+    unsafe fn build(
+        &mut self,
+        device: &HwDevice,
+        input: &GpuInput,
+        format: &str,
+        output: GpuOutput,
+    ) -> Result<()> {
+        let (pix_fmt, width, height) = match input {
+            GpuInput::Device(frames) => {
+                (device.kind().hw_format(), frames.width(), frames.height())
+            }
+            GpuInput::System {
+                format,
+                width,
+                height,
+            } => (*format, *width, *height),
+        };
+
+        self.source = self.alloc_filter("buffer", "in", device)?;
+        if let GpuInput::Device(frames) = input {
+            let params = ffi::av_buffersrc_parameters_alloc();
+            if params.is_null() {
+                return Err(Error::Scaling(
+                    "Failed to allocate buffersrc parameters".into(),
+                ));
+            }
+            (*params).hw_frames_ctx = frames.as_ptr();
+            let ret = ffi::av_buffersrc_parameters_set(self.source, params);
+            ffi::av_free(params as *mut std::ffi::c_void);
+            check(ret, "Failed to set filter input frames")?;
+        }
+        let source_args = format!(
+            "video_size={}x{}:pix_fmt={}:time_base=1/1000:pixel_aspect=1/1",
+            width,
+            height,
+            ffi::AVPixelFormat::from(pix_fmt) as i32
+        );
+        init_filter(self.source, &source_args)?;
+
+        let mut chain = Vec::new();
+        if matches!(input, GpuInput::System { .. }) {
+            // QSV surfaces are allocated up front; leave room for the scaler
+            let args = if self.backend == GpuBackend::Qsv {
+                "extra_hw_frames=8"
+            } else {
+                ""
+            };
+            chain.push(("hwupload", args.to_string()));
+        }
+        chain.push((
+            self.backend.filter_name(),
+            self.backend
+                .filter_args(output.size, format, output.algorithm),
+        ));
+        if output.download {
+            chain.push(("hwdownload", String::new()));
+            chain.push(("format", format!("pix_fmts={}", format)));
+        }
+
+        let mut last = self.source;
+        for (i, (name, args)) in chain.iter().enumerate() {
+            let filter = self.alloc_filter(name, &format!("f{}", i), device)?;
+            init_filter(filter, args)?;
+            link(last, filter)?;
+            last = filter;
+        }
+
+        self.sink = self.alloc_filter("buffersink", "out", device)?;
+        init_filter(self.sink, "")?;
+        link(last, self.sink)?;
+
+        check(
+            ffi::avfilter_graph_config(self.graph, ptr::null_mut()),
+            "Failed to configure filter graph",
+        )?;
+
+        if !output.download {
+            let frames = ffi::av_buffersink_get_hw_frames_ctx(self.sink);
+            if frames.is_null() {
+                return Err(Error::Scaling(format!(
+                    "{} did not produce device frames",
+                    self.backend
+                )));
+            }
+            self.frames = Some(HwFramesContext::from_ref(frames, device.kind())?);
+        }
+        Ok(())
+    }
+
+    unsafe fn alloc_filter(
+        &mut self,
+        filter: &str,
+        name: &str,
+        device: &HwDevice,
+    ) -> Result<*mut ffi::AVFilterContext> {
+        let filter_c = CString::new(filter).expect("filter name has no NUL");
+        let name_c = CString::new(name).expect("filter name has no NUL");
+        let kind = ffi::avfilter_get_by_name(filter_c.as_ptr());
+        if kind.is_null() {
+            return Err(Error::Scaling(format!(
+                "FFmpeg filter {} not found",
+                filter
+            )));
+        }
+        let ctx = ffi::avfilter_graph_alloc_filter(self.graph, kind, name_c.as_ptr());
+        if ctx.is_null() {
+            return Err(Error::Scaling(format!(
+                "Failed to allocate filter {}",
+                filter
+            )));
+        }
+        (*ctx).hw_device_ctx = ffi::av_buffer_ref(device.as_ptr());
+        Ok(ctx)
+    }
+
+    /// Scale one frame (pts is carried through)
+    pub fn run(&mut self, frame: &ffmpeg::frame::Video) -> Result<ffmpeg::frame::Video> {
+        let start = Instant::now();
+        let ret = unsafe {
+            ffi::av_buffersrc_add_frame_flags(
+                self.source,
+                frame.as_ptr() as *mut ffi::AVFrame,
+                BUFFERSRC_FLAG_KEEP_REF,
+            )
+        };
+        check(ret, "Failed to feed GPU scaler")?;
+
+        let mut output = ffmpeg::frame::Video::empty();
+        let ret = unsafe { ffi::av_buffersink_get_frame(self.sink, output.as_mut_ptr()) };
+        if ret < 0 {
+            return Err(Error::Scaling(format!(
+                "{} produced no frame: {}",
+                self.backend,
+                ffmpeg::Error::from(ret)
+            )));
+        }
+        self.timing.record(start.elapsed());
+        Ok(output)
+    }
+
+    pub fn backend(&self) -> GpuBackend {
+        self.backend
+    }
+
+    /// Output size
+    pub fn size(&self) -> Resolution {
+        self.size
+    }
+
+    /// Device frames to open the encoder with (None when downloading)
+    pub fn output_frames(&self) -> Option<&HwFramesContext> {
+        self.frames.as_ref()
+    }
+
+    /// Submit-to-output time per frame
+    pub fn timing(&self) -> &StageTiming {
+        &self.timing
+    }
+}
+
+impl Drop for GpuScaler {
+    fn drop(&mut self) {
+        unsafe { ffi::avfilter_graph_free(&mut self.graph) };
+    }
+}
+
+impl std::fmt::Debug for GpuScaler {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("GpuScaler")
+            .field("backend", &self.backend)
+            .field("size", &self.size)
+            .field("frames", &self.frames)
+            .finish()
+    }
+}
+
+fn check(ret: i32, what: &str) -> Result<()> {
+    if ret < 0 {
+        return Err(Error::Scaling(format!(
+            "{}: {}",
+            what,
+            ffmpeg::Error::from(ret)
+        )));
+    }
+    Ok(())
+}
+
+unsafe fn init_filter(ctx: *mut ffi::AVFilterContext, args: &str) -> Result<()> {
+    let args_c = CString::new(args).map_err(|e| Error::Internal(e.to_string()))?;
+    let args_ptr = if args.is_empty() {
+        ptr::null()
+    } else {
+        args_c.as_ptr()
+    };
+    let name = CStr::from_ptr((*(*ctx).filter).name).to_string_lossy();
+    check(
+        ffi::avfilter_init_str(ctx, args_ptr),
+        &format!("Failed to init {} ({})", name, args),
+    )
+}
+
+unsafe fn link(src: *mut ffi::AVFilterContext, dst: *mut ffi::AVFilterContext) -> Result<()> {
+    check(ffi::avfilter_link(src, 0, dst, 0), "Failed to link filters")
+}
+
+/// FFmpeg's name for a pixel format (as filter options expect)
+fn pixel_name(format: Pixel) -> Result<String> {
+    let name = unsafe { ffi::av_get_pix_fmt_name(format.into()) };
+    if name.is_null() {
+        return Err(Error::Scaling(format!("Unknown pixel format {:?}", format)));
+    }
+    Ok(unsafe { CStr::from_ptr(name) }
+        .to_string_lossy()
+        .into_owned())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_backend_selection() {
+        assert_eq!(
+            GpuBackend::for_encoder(EncoderBackend::Nvenc),
+            &[GpuBackend::Cuda]
+        );
+        assert!(GpuBackend::for_encoder(EncoderBackend::Software).is_empty());
+        assert_eq!(GpuBackend::Cuda.device_type(), HwDeviceType::Cuda);
+
+        let args =
+            GpuBackend::Cuda.filter_args(Resolution::FHD_1080P, "nv12", ScaleAlgorithm::Lanczos);
+        assert_eq!(args, "w=1920:h=1080:format=nv12:interp_algo=lanczos");
+    }
+}
@@ -0,0 +1,309 @@
+//! Compiled processing graph
+//!
+//! Built once from the encoder configuration. For each input layout the
+//! graph picks the cheapest path and runs it without intermediate
+//! allocations:
+//! - same size, kernel-supported formats: one SIMD conversion pass
+//! - scaling and/or other formats: one fused swscale pass
+//! - SDR -> HDR10/HLG: one fused transfer + P010 pass, preceded by a
+//!   swscale pass into a reused buffer when scaling
+
+use super::convert;
+use super::hdr::HdrConfig;
+use super::kernels::{PlaneMut, PlaneRef};
+use super::scale::ScaleAlgorithm;
+use super::sws::{self, SwsCache};
+use super::transfer::SdrToHdr;
+use crate::config::EncoderConfig;
+use crate::error::{Error, Result};
+use crate::pool::PoolKey;
+use crate::types::{Frame, FrameFormat, Resolution};
+
+use std::time::{Duration, Instant};
+
+/// Path chosen for an input layout
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ProcessingPath {
+    /// Input already matches; the buffer is shared
+    Passthrough,
+    /// SIMD format conversion
+    Kernel,
+    /// Single swscale pass (scale and/or convert)
+    Swscale,
+    /// SDR -> HDR transfer + P010 pass
+    Transfer,
+    /// swscale into a scratch buffer, then the transfer pass
+    ScaleTransfer,
+}
+
+/// Timing of one stage
+#[derive(Debug, Clone, Copy, Default)]
+pub struct StageTiming {
+    /// Frames that ran this stage
+    pub frames: u64,
+    pub total: Duration,
+    pub max: Duration,
+}
+
+impl StageTiming {
+    pub(super) fn record(&mut self, elapsed: Duration) {
+        self.frames += 1;
+        self.total += elapsed;
+        self.max = self.max.max(elapsed);
+    }
+
+    /// Mean time per frame
+    pub fn average(&self) -> Duration {
+        if self.frames == 0 {
+            Duration::ZERO
+        } else {
+            self.total / self.frames as u32
+        }
+    }
+}
+
+/// Per-stage timings
+#[derive(Debug, Clone, Copy, Default)]
+pub struct GraphTimings {
+    /// swscale passes (fused scale + convert counts here)
+    pub scale: StageTiming,
+    /// SIMD conversion passes
+    pub convert: StageTiming,
+    /// SDR -> HDR transfer passes
+    pub transfer: StageTiming,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Plan {
+    input: PoolKey,
+    output: PoolKey,
+    path: ProcessingPath,
+}
+
+/// Scale/convert/transfer stage compiled for a fixed output
+pub struct ProcessingGraph {
+    resolution: Option<Resolution>,
+    format: Option<FrameFormat>,
+    algorithm: ScaleAlgorithm,
+    transfer: Option<SdrToHdr>,
+    cache: SwsCache,
+    plan: Option<Plan>,
+    /// Scaled frame ahead of the transfer pass
+    scratch: Vec<u8>,
+    timings: GraphTimings,
+}
+
+impl ProcessingGraph {
+    /// Graph producing `resolution` (None = input size) in `format`
+    /// (None = input format), with the HDR transfer from `hdr` when the
+    /// output is P010
+    pub fn new(
+        resolution: Option<Resolution>,
+        format: Option<FrameFormat>,
+        hdr: Option<&HdrConfig>,
+    ) -> Self {
+        Self {
+            resolution,
+            format,
+            algorithm: ScaleAlgorithm::default(),
+            transfer: hdr.and_then(|hdr| SdrToHdr::new(hdr.transfer)),
+            cache: SwsCache::new(),
+            plan: None,
+            scratch: Vec::new(),
+            timings: GraphTimings::default(),
+        }
+    }
+
+    /// Graph for the frames an encoder expects
+    pub fn from_config(config: &EncoderConfig) -> Self {
+        let format = if config.pixel_format.is_nvenc_native() {
+            config.pixel_format
+        } else {
+            FrameFormat::Nv12
+        };
+        Self::new(config.resolution, Some(format), config.hdr.as_ref())
+    }
+
+    pub fn with_algorithm(mut self, algorithm: ScaleAlgorithm) -> Self {
+        self.algorithm = algorithm;
+        self.plan = None;
+        self
+    }
+
+    /// Change the output (recompiles on the next frame if it differs)
+    pub fn set_target(&mut self, resolution: Option<Resolution>, format: Option<FrameFormat>) {
+        if resolution != self.resolution || format != self.format {
+            self.resolution = resolution;
+            self.format = format;
+            self.plan = None;
+        }
+    }
+
+    /// Output resolution (None = input size)
+    pub fn resolution(&self) -> Option<Resolution> {
+        self.resolution
+    }
+
+    /// Output format (None = input format)
+    pub fn format(&self) -> Option<FrameFormat> {
+        self.format
+    }
+
+    /// Path compiled for the last input, if any
+    pub fn path(&self) -> Option<ProcessingPath> {
+        self.plan.map(|plan| plan.path)
+    }
+
+    pub fn timings(&self) -> &GraphTimings {
+        &self.timings
+    }
+
+    /// Process a frame
+    ///
+    /// Passthrough shares the input buffer; every other path writes one
+    /// pooled output buffer.
+    pub fn process(&mut self, frame: &Frame) -> Result<Frame> {
+        let input = PoolKey::new(frame.width, frame.height, frame.format, frame.stride);
+        let plan = match self.plan {
+            Some(plan) if plan.input == input => plan,
+            _ => {
+                let plan = self.compile(input);
+                tracing::debug!(
+                    "Processing {}x{} {:?} -> {}x{} {:?} via {:?}",
+                    input.width,
+                    input.height,
+                    input.format,
+                    plan.output.width,
+                    plan.output.height,
+                    plan.output.format,
+                    plan.path
+                );
+                self.plan = Some(plan);
+                plan
+            }
+        };
+
+        if plan.path == ProcessingPath::Passthrough {
+            let mut shared = frame.share();
+            shared.dmabuf_fd = None;
+            shared.dmabuf = None;
+            return Ok(shared);
+        }
+
+        let output = plan.output;
+        let mut out = sws::output_frame(frame, output);
+        let dst = out.data.get_mut().expect("pooled buffer is unique");
+        let flags = self.algorithm.to_sws_flags();
+
+        match plan.path {
+            ProcessingPath::Passthrough => unreachable!("handled above"),
+            ProcessingPath::Kernel => {
+                let start = Instant::now();
+                if !convert::convert_with_kernels(&frame.data, input, dst, output)? {
+                    return Err(Error::ColorspaceConversion(format!(
+                        "No kernel for {:?} -> {:?}",
+                        input.format, output.format
+                    )));
+                }
+                self.timings.convert.record(start.elapsed());
+            }
+            ProcessingPath::Swscale => {
+                let start = Instant::now();
+                self.cache.run(&frame.data, input, dst, output, flags)?;
+                self.timings.scale.record(start.elapsed());
+            }
+            ProcessingPath::Transfer => {
+                let start = Instant::now();
+                self.run_transfer(&frame.data, input, dst, output)?;
+                self.timings.transfer.record(start.elapsed());
+            }
+            ProcessingPath::ScaleTransfer => {
+                let scaled = PoolKey::packed(output.width, output.height, input.format);
+                let mut scratch = std::mem::take(&mut self.scratch);
+                scratch.resize(scaled.size(), 0);
+
+                let start = Instant::now();
+                let result = self
+                    .cache
+                    .run(&frame.data, input, &mut scratch, scaled, flags);
+                self.timings.scale.record(start.elapsed());
+
+                let result = result.and_then(|()| {
+                    let start = Instant::now();
+                    self.run_transfer(&scratch, scaled, dst, output)?;
+                    self.timings.transfer.record(start.elapsed());
+                    Ok(())
+                });
+                self.scratch = scratch;
+                result?;
+            }
+        }
+
+        Ok(out)
+    }
+
+    fn compile(&self, input: PoolKey) -> Plan {
+        let (width, height) = self
+            .resolution
+            .map(|res| (res.width, res.height))
+            .unwrap_or((input.width, input.height));
+        let format = self.format.unwrap_or(input.format);
+        let output = PoolKey::packed(width, height, format);
+
+        let scale = (width, height) != (input.width, input.height);
+        let sdr_input = matches!(input.format, FrameFormat::Bgra | FrameFormat::Rgba);
+        let path = if self.transfer.is_some() && sdr_input && format == FrameFormat::P010 {
+            if scale {
+                ProcessingPath::ScaleTransfer
+            } else {
+                ProcessingPath::Transfer
+            }
+        } else if !scale && format == input.format {
+            ProcessingPath::Passthrough
+        } else if !scale && convert::kernel_supports(input.format, format) {
+            ProcessingPath::Kernel
+        } else {
+            ProcessingPath::Swscale
+        };
+
+        Plan {
+            input,
+            output,
+            path,
+        }
+    }
+
+    fn run_transfer(
+        &mut self,
+        input: &[u8],
+        src: PoolKey,
+        output: &mut [u8],
+        dst: PoolKey,
+    ) -> Result<()> {
+        let transfer = self
+            .transfer
+            .as_mut()
+            .expect("transfer path requires an HDR transfer");
+        let planes = dst.format.plane_layout(dst.height, dst.stride);
+        let (y, uv) = output.split_at_mut(planes[1].0.min(output.len()));
+        transfer.rgb_to_p010(
+            PlaneRef::new(input, src.stride as usize),
+            PlaneMut::new(y, planes[0].1),
+            PlaneMut::new(uv, planes[1].1),
+            src.width as usize,
+            src.height as usize,
+            src.format,
+        )
+    }
+}
+
+impl std::fmt::Debug for ProcessingGraph {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("ProcessingGraph")
+            .field("resolution", &self.resolution)
+            .field("format", &self.format)
+            .field("transfer", &self.transfer)
+            .field("path", &self.path())
+            .finish()
+    }
+}
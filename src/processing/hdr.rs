@@ -6,11 +6,14 @@
 //! - P010 (10-bit NV12) format conversion
 //! - Optional HDR to SDR tonemapping
 
+use super::kernels::{self, PlaneMut, PlaneRef};
 use crate::error::{Error, Result};
 use crate::types::FrameFormat;
 
+use serde::{Deserialize, Serialize};
+
 /// HDR transfer function
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
 pub enum TransferFunction {
     /// SDR (BT.709 gamma)
     #[default]
@@ -33,7 +36,7 @@ impl TransferFunction {
 }
 
 /// Color primaries (color gamut)
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
 pub enum ColorPrimaries {
     /// BT.709 (SDR, HD)
     #[default]
@@ -56,7 +59,7 @@ impl ColorPrimaries {
 }
 
 /// Color matrix coefficients
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
 pub enum ColorMatrix {
     /// BT.709
     #[default]
@@ -79,7 +82,7 @@ impl ColorMatrix {
 }
 
 /// HDR10 static metadata (SMPTE ST 2086)
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
 pub struct Hdr10Metadata {
     /// Red primary X (0.0-1.0)
     pub red_primary_x: f32,
@@ -132,7 +135,7 @@ impl Hdr10Metadata {
 }
 
 /// Content Light Level Info (MaxCLL, MaxFALL)
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
 pub struct ContentLightLevel {
     /// Maximum Content Light Level (nits)
     pub max_cll: u16,
@@ -155,7 +158,7 @@ impl ContentLightLevel {
 }
 
 /// Complete HDR configuration
-#[derive(Debug, Clone, Default)]
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
 pub struct HdrConfig {
     /// Transfer function
     pub transfer: TransferFunction,
@@ -238,93 +241,62 @@ impl HdrConfig {
 /// Convert BGRA to P010 (10-bit NV12)
 /// P010 format: 16-bit little-endian, with 10 bits of data in the high bits
 pub fn bgra_to_p010(input: &[u8], width: usize, height: usize) -> Result<Vec<u8>> {
-    let y_size = width * height * 2; // 16-bit per sample
-    let uv_size = (width / 2) * (height / 2) * 4; // 16-bit per U and V
-    let mut output = vec![0u8; y_size + uv_size];
-
-    // Y plane (16-bit little-endian, 10-bit data in high bits)
-    for y in 0..height {
-        for x in 0..width {
-            let idx = (y * width + x) * 4;
-            let b = input[idx] as f32;
-            let g = input[idx + 1] as f32;
-            let r = input[idx + 2] as f32;
-
-            // BT.2020 RGB to Y (slightly different coefficients than BT.709)
-            let y_val = (0.2627 * r + 0.6780 * g + 0.0593 * b) as u16;
-            // Shift to 10-bit in 16-bit container (high 10 bits)
-            let y_10bit = (y_val.min(255) as u16) << 6;
-
-            let out_idx = (y * width + x) * 2;
-            output[out_idx] = (y_10bit & 0xFF) as u8;
-            output[out_idx + 1] = ((y_10bit >> 8) & 0xFF) as u8;
-        }
-    }
-
-    // UV plane (interleaved, subsampled 2x2, 16-bit each)
-    let uv_offset = y_size;
-    for y in (0..height).step_by(2) {
-        for x in (0..width).step_by(2) {
-            let idx = (y * width + x) * 4;
-            let b = input[idx] as f32;
-            let g = input[idx + 1] as f32;
-            let r = input[idx + 2] as f32;
-
-            // BT.2020 RGB to U, V
-            let u_val = ((-0.1396 * r - 0.3604 * g + 0.5 * b) + 128.0) as u16;
-            let v_val = ((0.5 * r - 0.4598 * g - 0.0402 * b) + 128.0) as u16;
-
-            // Shift to 10-bit in 16-bit container
-            let u_10bit = (u_val.clamp(0, 255) as u16) << 6;
-            let v_10bit = (v_val.clamp(0, 255) as u16) << 6;
-
-            let uv_idx = uv_offset + (y / 2) * width * 2 + x * 2;
-            output[uv_idx] = (u_10bit & 0xFF) as u8;
-            output[uv_idx + 1] = ((u_10bit >> 8) & 0xFF) as u8;
-            output[uv_idx + 2] = (v_10bit & 0xFF) as u8;
-            output[uv_idx + 3] = ((v_10bit >> 8) & 0xFF) as u8;
-        }
-    }
+    rgb_to_p010(input, FrameFormat::Bgra, width, height)
+}
 
+/// Convert packed BGRA/RGBA to P010 with the BT.2020 matrix
+pub fn rgb_to_p010(
+    input: &[u8],
+    format: FrameFormat,
+    width: usize,
+    height: usize,
+) -> Result<Vec<u8>> {
+    let (mut output, stride) = alloc_p010(width, height);
+    let (y, uv) = output.split_at_mut(stride * height);
+    kernels::rgb_to_p010(
+        PlaneRef::new(input, width * 4),
+        PlaneMut::new(y, stride),
+        PlaneMut::new(uv, stride),
+        width,
+        height,
+        format,
+        ColorMatrix::Bt2020Ncl,
+    )?;
     Ok(output)
 }
 
 /// Convert NV12 (8-bit) to P010 (10-bit)
 pub fn nv12_to_p010(input: &[u8], width: usize, height: usize) -> Result<Vec<u8>> {
-    let y_size_8bit = width * height;
-    let uv_size_8bit = (width / 2) * (height / 2) * 2;
-
-    if input.len() < y_size_8bit + uv_size_8bit {
+    let src_stride = FrameFormat::Nv12.default_stride(width as u32);
+    let src_size = FrameFormat::Nv12.buffer_size(width as u32, height as u32, src_stride);
+    let src_stride = src_stride as usize;
+    if input.len() < src_size {
         return Err(Error::ColorspaceConversion(
-            "Input buffer too small for NV12".into()
+            "Input buffer too small for NV12".into(),
         ));
     }
 
-    let y_size_10bit = width * height * 2;
-    let uv_size_10bit = (width / 2) * (height / 2) * 4;
-    let mut output = vec![0u8; y_size_10bit + uv_size_10bit];
-
-    // Convert Y plane (8-bit to 10-bit in 16-bit container)
-    for i in 0..y_size_8bit {
-        let y_10bit = (input[i] as u16) << 6;
-        let out_idx = i * 2;
-        output[out_idx] = (y_10bit & 0xFF) as u8;
-        output[out_idx + 1] = ((y_10bit >> 8) & 0xFF) as u8;
-    }
-
-    // Convert UV plane (8-bit interleaved to 10-bit interleaved)
-    let uv_in_offset = y_size_8bit;
-    let uv_out_offset = y_size_10bit;
-    for i in 0..uv_size_8bit {
-        let uv_10bit = (input[uv_in_offset + i] as u16) << 6;
-        let out_idx = uv_out_offset + i * 2;
-        output[out_idx] = (uv_10bit & 0xFF) as u8;
-        output[out_idx + 1] = ((uv_10bit >> 8) & 0xFF) as u8;
-    }
-
+    let (mut output, stride) = alloc_p010(width, height);
+    let (src_y, src_uv) = input.split_at(src_stride * height);
+    let (y, uv) = output.split_at_mut(stride * height);
+    kernels::nv12_to_p010(
+        PlaneRef::new(src_y, src_stride),
+        PlaneRef::new(src_uv, src_stride),
+        PlaneMut::new(y, stride),
+        PlaneMut::new(uv, stride),
+        width,
+        height,
+    )?;
     Ok(output)
 }
 
+/// Tightly packed P010 buffer and its stride
+fn alloc_p010(width: usize, height: usize) -> (Vec<u8>, usize) {
+    let stride = FrameFormat::P010.default_stride(width as u32);
+    let size = FrameFormat::P010.buffer_size(width as u32, height as u32, stride);
+    (vec![0u8; size], stride as usize)
+}
+
 /// Apply PQ (SMPTE ST 2084) transfer function
 /// Converts linear light to PQ encoded value
 pub fn linear_to_pq(linear: f32) -> f32 {
@@ -354,6 +326,36 @@ pub fn pq_to_linear(pq: f32) -> f32 {
     10000.0 * (num / den).powf(1.0 / M1)
 }
 
+/// Apply the HLG (ARIB STD-B67) OETF
+/// Converts normalized scene light (0-1) to the HLG signal
+pub fn hlg_oetf(scene: f32) -> f32 {
+    const A: f32 = 0.17883277;
+    const B: f32 = 0.28466892; // 1 - 4A
+    const C: f32 = 0.55991073; // 0.5 - A * ln(4A)
+
+    let e = scene.max(0.0);
+    if e <= 1.0 / 12.0 {
+        (3.0 * e).sqrt()
+    } else {
+        A * (12.0 * e - B).ln() + C
+    }
+}
+
+/// Inverse HLG OETF
+/// Converts the HLG signal to normalized scene light
+pub fn hlg_inverse_oetf(signal: f32) -> f32 {
+    const A: f32 = 0.17883277;
+    const B: f32 = 0.28466892;
+    const C: f32 = 0.55991073;
+
+    let e = signal.max(0.0);
+    if e <= 0.5 {
+        e * e / 3.0
+    } else {
+        (((e - C) / A).exp() + B) / 12.0
+    }
+}
+
 /// Simple HDR to SDR tonemapping (Reinhard)
 pub fn tonemap_reinhard(hdr_linear: f32, max_luminance: f32) -> f32 {
     let scaled = hdr_linear / max_luminance;
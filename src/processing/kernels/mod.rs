@@ -0,0 +1,583 @@
+//! Pixel conversion kernels
+//!
+//! Stride-aware converters for the hot CPU paths:
+//! - BGRA/RGBA -> NV12 and P010 (BT.709 or BT.2020 matrix)
+//! - NV12 -> P010
+//! - R/B channel swap (BGRA <-> RGBA)
+//! - Alpha blending of packed 4-byte pixels (compositing)
+//!
+//! Row kernels are selected once at runtime (AVX-512, AVX2, NEON, or the
+//! scalar fallback). Every variant uses the same fixed-point arithmetic, so
+//! output is bit-identical to the scalar reference.
+//!
+//! YUV output is limited range; chroma is the rounded mean of each 2x2
+//! block (the last column/row is replicated for odd sizes).
+
+mod scalar;
+
+#[cfg(target_arch = "aarch64")]
+mod neon;
+#[cfg(target_arch = "x86_64")]
+mod x86;
+
+use super::hdr::ColorMatrix;
+use crate::error::{Error, Result};
+use crate::types::FrameFormat;
+
+use std::sync::OnceLock;
+
+/// Instruction set used by the kernels
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Isa {
+    Scalar,
+    Avx2,
+    Avx512,
+    Neon,
+}
+
+impl std::fmt::Display for Isa {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let name = match self {
+            Isa::Scalar => "scalar",
+            Isa::Avx2 => "AVX2",
+            Isa::Avx512 => "AVX-512",
+            Isa::Neon => "NEON",
+        };
+        f.write_str(name)
+    }
+}
+
+/// Source plane in a caller-owned buffer
+#[derive(Debug, Clone, Copy)]
+pub struct PlaneRef<'a> {
+    pub data: &'a [u8],
+    /// Row stride in bytes
+    pub stride: usize,
+}
+
+/// Destination plane in a caller-owned buffer
+#[derive(Debug)]
+pub struct PlaneMut<'a> {
+    pub data: &'a mut [u8],
+    /// Row stride in bytes
+    pub stride: usize,
+}
+
+impl<'a> PlaneRef<'a> {
+    pub fn new(data: &'a [u8], stride: usize) -> Self {
+        Self { data, stride }
+    }
+
+    pub(super) fn row(&self, y: usize, len: usize) -> &'a [u8] {
+        &self.data[y * self.stride..y * self.stride + len]
+    }
+}
+
+impl<'a> PlaneMut<'a> {
+    pub fn new(data: &'a mut [u8], stride: usize) -> Self {
+        Self { data, stride }
+    }
+
+    pub(super) fn row(&mut self, y: usize, len: usize) -> &mut [u8] {
+        &mut self.data[y * self.stride..y * self.stride + len]
+    }
+}
+
+// Fixed point: 8-bit output uses Q15 weights; 10-bit output uses the same
+// weights with two fewer fractional bits (876/255 = 4 * 219/255).
+const SHIFT_8: u32 = 15;
+const SHIFT_10: u32 = 13;
+/// Luma offset (16 << 15 == 64 << 13)
+const Y_OFFSET: i32 = 16 << 15;
+/// Chroma offset for a 2x2 sum (128 << 17 == 512 << 15)
+const C_OFFSET: i32 = 128 << 17;
+
+/// Integer RGB -> YUV weights, indexed by byte position within a pixel
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Coeffs {
+    pub y: [i32; 3],
+    pub u: [i32; 3],
+    pub v: [i32; 3],
+}
+
+impl Coeffs {
+    /// Weights for a packed 4-byte source format (BGRA or RGBA)
+    ///
+    /// BT.2020 CL has no linear matrix; it is treated as NCL.
+    pub fn new(matrix: ColorMatrix, format: FrameFormat) -> Result<Self> {
+        let (kr, kb) = match matrix {
+            ColorMatrix::Bt709 => (0.2126, 0.0722),
+            ColorMatrix::Bt2020Ncl | ColorMatrix::Bt2020Cl => (0.2627, 0.0593),
+        };
+        let q = |x: f64| (x * (1 << SHIFT_8) as f64).round() as i32;
+        let luma = 219.0 / 255.0;
+        let chroma = 224.0 / 255.0;
+
+        // Derive the green weights from the totals so white stays at 235 and
+        // greys have exactly neutral chroma
+        let (yr, yb) = (q(kr * luma), q(kb * luma));
+        let y_rgb = [yr, q(luma) - yr - yb, yb];
+
+        let (ur, ub) = (q(-kr / (2.0 * (1.0 - kb)) * chroma), q(0.5 * chroma));
+        let u_rgb = [ur, -ur - ub, ub];
+
+        let (vr, vb) = (q(0.5 * chroma), q(-kb / (2.0 * (1.0 - kr)) * chroma));
+        let v_rgb = [vr, -vr - vb, vb];
+
+        // Byte order of the source pixel
+        let order = match format {
+            FrameFormat::Bgra => [2, 1, 0],
+            FrameFormat::Rgba => [0, 1, 2],
+            other => {
+                return Err(Error::ColorspaceConversion(format!(
+                    "Unsupported packed RGB format: {:?}",
+                    other
+                )))
+            }
+        };
+        let reorder = |w: [i32; 3]| [w[order[0]], w[order[1]], w[order[2]]];
+
+        Ok(Self {
+            y: reorder(y_rgb),
+            u: reorder(u_rgb),
+            v: reorder(v_rgb),
+        })
+    }
+}
+
+type LumaRow = fn(&[u8], &mut [u8], usize, &Coeffs);
+type ChromaRow = fn(&[u8], &[u8], &mut [u8], usize, &Coeffs);
+type CopyRow = fn(&[u8], &mut [u8], usize);
+type BlendRow = fn(&[u8], &mut [u8], usize, u8, bool);
+
+/// Row kernels for one instruction set
+pub(crate) struct RowKernels {
+    pub isa: Isa,
+    /// Packed RGB row -> 8-bit luma
+    pub luma8: LumaRow,
+    /// Packed RGB row -> P010 luma
+    pub luma10: LumaRow,
+    /// Two packed RGB rows -> interleaved 8-bit UV
+    pub chroma8: ChromaRow,
+    /// Two packed RGB rows -> interleaved P010 UV
+    pub chroma10: ChromaRow,
+    /// 8-bit samples -> P010 samples
+    pub widen: CopyRow,
+    /// Swap bytes 0 and 2 of each pixel
+    pub swap_rb: CopyRow,
+    /// Blend a packed row over another in place (opacity, use source
+    /// alpha)
+    pub blend: BlendRow,
+}
+
+static SCALAR: RowKernels = RowKernels {
+    isa: Isa::Scalar,
+    luma8: scalar::luma8,
+    luma10: scalar::luma10,
+    chroma8: scalar::chroma8,
+    chroma10: scalar::chroma10,
+    widen: scalar::widen,
+    swap_rb: scalar::swap_rb,
+    blend: scalar::blend,
+};
+
+/// Kernels for `isa`, if this CPU supports it
+pub(crate) fn kernels_for(isa: Isa) -> Option<&'static RowKernels> {
+    match isa {
+        Isa::Scalar => Some(&SCALAR),
+        #[cfg(target_arch = "x86_64")]
+        Isa::Avx2 if std::arch::is_x86_feature_detected!("avx2") => Some(&x86::AVX2),
+        #[cfg(target_arch = "x86_64")]
+        Isa::Avx512
+            if std::arch::is_x86_feature_detected!("avx512f")
+                && std::arch::is_x86_feature_detected!("avx512bw") =>
+        {
+            Some(&x86::AVX512)
+        }
+        #[cfg(target_arch = "aarch64")]
+        Isa::Neon if std::arch::is_aarch64_feature_detected!("neon") => Some(&neon::NEON),
+        _ => None,
+    }
+}
+
+/// Best kernels for this CPU (detected once)
+pub(crate) fn kernels() -> &'static RowKernels {
+    static BEST: OnceLock<&'static RowKernels> = OnceLock::new();
+    BEST.get_or_init(|| {
+        let best = [Isa::Avx512, Isa::Avx2, Isa::Neon]
+            .into_iter()
+            .find_map(kernels_for)
+            .unwrap_or(&SCALAR);
+        tracing::debug!("Pixel conversion kernels: {}", best.isa);
+        best
+    })
+}
+
+/// Instruction set the conversion kernels run on
+pub fn active_isa() -> Isa {
+    kernels().isa
+}
+
+/// Check that `plane` holds `rows` rows of `row_bytes`
+pub(super) fn check_plane(
+    len: usize,
+    stride: usize,
+    row_bytes: usize,
+    rows: usize,
+    what: &str,
+) -> Result<()> {
+    if rows == 0 || row_bytes == 0 {
+        return Ok(());
+    }
+    if stride < row_bytes || len < stride * (rows - 1) + row_bytes {
+        return Err(Error::ColorspaceConversion(format!(
+            "{} plane too small: {} bytes, stride {}, need {} rows of {}",
+            what, len, stride, rows, row_bytes
+        )));
+    }
+    Ok(())
+}
+
+/// Convert packed BGRA/RGBA to NV12
+pub fn rgb_to_nv12(
+    src: PlaneRef,
+    y: PlaneMut,
+    uv: PlaneMut,
+    width: usize,
+    height: usize,
+    src_format: FrameFormat,
+    matrix: ColorMatrix,
+) -> Result<()> {
+    let coeffs = Coeffs::new(matrix, src_format)?;
+    rgb_to_yuv420(kernels(), src, y, uv, width, height, &coeffs, false)
+}
+
+/// Convert packed BGRA/RGBA to P010 (10-bit samples in the high bits)
+pub fn rgb_to_p010(
+    src: PlaneRef,
+    y: PlaneMut,
+    uv: PlaneMut,
+    width: usize,
+    height: usize,
+    src_format: FrameFormat,
+    matrix: ColorMatrix,
+) -> Result<()> {
+    let coeffs = Coeffs::new(matrix, src_format)?;
+    rgb_to_yuv420(kernels(), src, y, uv, width, height, &coeffs, true)
+}
+
+#[allow(clippy::too_many_arguments)]
+fn rgb_to_yuv420(
+    k: &RowKernels,
+    src: PlaneRef,
+    mut y: PlaneMut,
+    mut uv: PlaneMut,
+    width: usize,
+    height: usize,
+    coeffs: &Coeffs,
+    ten_bit: bool,
+) -> Result<()> {
+    let bytes = if ten_bit { 2 } else { 1 };
+    let src_row = width * 4;
+    let y_row = width * bytes;
+    let uv_row = width.div_ceil(2) * 2 * bytes;
+    let uv_rows = height.div_ceil(2);
+
+    check_plane(src.data.len(), src.stride, src_row, height, "Source")?;
+    check_plane(y.data.len(), y.stride, y_row, height, "Y")?;
+    check_plane(uv.data.len(), uv.stride, uv_row, uv_rows, "UV")?;
+
+    let (luma, chroma) = if ten_bit {
+        (k.luma10, k.chroma10)
+    } else {
+        (k.luma8, k.chroma8)
+    };
+
+    for row in 0..uv_rows {
+        let top = 2 * row;
+        let bottom = (top + 1).min(height - 1);
+        let src0 = src.row(top, src_row);
+        let src1 = src.row(bottom, src_row);
+
+        luma(src0, y.row(top, y_row), width, coeffs);
+        if bottom != top {
+            luma(src1, y.row(bottom, y_row), width, coeffs);
+        }
+        chroma(src0, src1, uv.row(row, uv_row), width, coeffs);
+    }
+
+    Ok(())
+}
+
+/// Convert NV12 to P010 (8-bit limited range -> 10-bit limited range)
+pub fn nv12_to_p010(
+    src_y: PlaneRef,
+    src_uv: PlaneRef,
+    mut y: PlaneMut,
+    mut uv: PlaneMut,
+    width: usize,
+    height: usize,
+) -> Result<()> {
+    let k = kernels();
+    let uv_width = width.div_ceil(2) * 2;
+    let uv_rows = height.div_ceil(2);
+
+    check_plane(src_y.data.len(), src_y.stride, width, height, "Source Y")?;
+    check_plane(
+        src_uv.data.len(),
+        src_uv.stride,
+        uv_width,
+        uv_rows,
+        "Source UV",
+    )?;
+    check_plane(y.data.len(), y.stride, width * 2, height, "Y")?;
+    check_plane(uv.data.len(), uv.stride, uv_width * 2, uv_rows, "UV")?;
+
+    for row in 0..height {
+        (k.widen)(src_y.row(row, width), y.row(row, width * 2), width);
+    }
+    for row in 0..uv_rows {
+        (k.widen)(
+            src_uv.row(row, uv_width),
+            uv.row(row, uv_width * 2),
+            uv_width,
+        );
+    }
+
+    Ok(())
+}
+
+/// Swap R and B of packed 4-byte pixels (BGRA <-> RGBA)
+pub fn swap_rb(src: PlaneRef, mut dst: PlaneMut, width: usize, height: usize) -> Result<()> {
+    let k = kernels();
+    let row_bytes = width * 4;
+
+    check_plane(src.data.len(), src.stride, row_bytes, height, "Source")?;
+    check_plane(dst.data.len(), dst.stride, row_bytes, height, "Destination")?;
+
+    for row in 0..height {
+        (k.swap_rb)(src.row(row, row_bytes), dst.row(row, row_bytes), width);
+    }
+
+    Ok(())
+}
+
+/// Blend packed 4-byte `src` over `dst` in place
+///
+/// Each pixel is weighted by `opacity`, times its own alpha when
+/// `src_alpha` is set (BGRx producers leave the alpha byte undefined, so it
+/// is treated as 255 otherwise). All four bytes are blended, rounding like
+/// `(s * a + d * (255 - a)) / 255`.
+pub fn blend_over(
+    src: PlaneRef,
+    mut dst: PlaneMut,
+    width: usize,
+    height: usize,
+    opacity: u8,
+    src_alpha: bool,
+) -> Result<()> {
+    let k = kernels();
+    let row_bytes = width * 4;
+
+    check_plane(src.data.len(), src.stride, row_bytes, height, "Source")?;
+    check_plane(dst.data.len(), dst.stride, row_bytes, height, "Destination")?;
+
+    for row in 0..height {
+        (k.blend)(
+            src.row(row, row_bytes),
+            dst.row(row, row_bytes),
+            width,
+            opacity,
+            src_alpha,
+        );
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Deterministic test pattern (xorshift)
+    fn noise(len: usize, seed: u32) -> Vec<u8> {
+        let mut state = seed.max(1);
+        (0..len)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                (state >> 24) as u8
+            })
+            .collect()
+    }
+
+    fn simd_kernels() -> Vec<&'static RowKernels> {
+        [Isa::Avx2, Isa::Avx512, Isa::Neon]
+            .into_iter()
+            .filter_map(kernels_for)
+            .collect()
+    }
+
+    fn convert_with(
+        k: &RowKernels,
+        src: &[u8],
+        width: usize,
+        height: usize,
+        format: FrameFormat,
+        matrix: ColorMatrix,
+        ten_bit: bool,
+    ) -> (Vec<u8>, Vec<u8>) {
+        let bytes = if ten_bit { 2 } else { 1 };
+        // Padded strides to exercise stride handling
+        let y_stride = width * bytes + 16;
+        let uv_stride = width.div_ceil(2) * 2 * bytes + 8;
+        let mut y = vec![0u8; y_stride * height];
+        let mut uv = vec![0u8; uv_stride * height.div_ceil(2)];
+        let coeffs = Coeffs::new(matrix, format).unwrap();
+        rgb_to_yuv420(
+            k,
+            PlaneRef::new(src, width * 4 + 12),
+            PlaneMut::new(&mut y, y_stride),
+            PlaneMut::new(&mut uv, uv_stride),
+            width,
+            height,
+            &coeffs,
+            ten_bit,
+        )
+        .unwrap();
+        (y, uv)
+    }
+
+    #[test]
+    fn test_simd_matches_scalar() {
+        let sizes = [(1, 1), (3, 3), (16, 2), (37, 19), (64, 8), (130, 7)];
+        let formats = [FrameFormat::Bgra, FrameFormat::Rgba];
+        let matrices = [ColorMatrix::Bt709, ColorMatrix::Bt2020Ncl];
+
+        for k in simd_kernels() {
+            for (i, &(w, h)) in sizes.iter().enumerate() {
+                let src = noise((w * 4 + 12) * h, i as u32 + 1);
+                for &format in &formats {
+                    for &matrix in &matrices {
+                        for ten_bit in [false, true] {
+                            let expected =
+                                convert_with(&SCALAR, &src, w, h, format, matrix, ten_bit);
+                            let actual = convert_with(k, &src, w, h, format, matrix, ten_bit);
+                            assert_eq!(
+                                expected, actual,
+                                "{} {}x{} {:?} {:?} 10-bit={}",
+                                k.isa, w, h, format, matrix, ten_bit
+                            );
+                        }
+                    }
+                }
+            }
+
+            for len in [1, 15, 16, 33, 100] {
+                let src = noise(len * 4, len as u32);
+                let mut expected = vec![0u8; len * 4];
+                let mut actual = vec![0u8; len * 4];
+                (SCALAR.swap_rb)(&src, &mut expected, len);
+                (k.swap_rb)(&src, &mut actual, len);
+                assert_eq!(expected, actual, "{} swap_rb {}", k.isa, len);
+
+                let mut expected = vec![0u8; len * 8];
+                let mut actual = vec![0u8; len * 8];
+                (SCALAR.widen)(&src[..len * 2], &mut expected, len * 2);
+                (k.widen)(&src[..len * 2], &mut actual, len * 2);
+                assert_eq!(expected, actual, "{} widen {}", k.isa, len);
+
+                let over = noise(len * 4, len as u32 + 7);
+                for (opacity, src_alpha) in [(255, false), (255, true), (77, false), (200, true)] {
+                    let mut expected = over.clone();
+                    let mut actual = over.clone();
+                    (SCALAR.blend)(&src, &mut expected, len, opacity, src_alpha);
+                    (k.blend)(&src, &mut actual, len, opacity, src_alpha);
+                    assert_eq!(expected, actual, "{} blend {} {}", k.isa, len, opacity);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_reference_levels() {
+        let white = [255u8; 4 * 4];
+        let black = [0, 0, 0, 255].repeat(4);
+
+        let (y, uv) = convert_with(
+            &SCALAR,
+            &white.repeat(2),
+            2,
+            2,
+            FrameFormat::Bgra,
+            ColorMatrix::Bt709,
+            false,
+        );
+        assert_eq!(&y[..2], &[235, 235]);
+        assert_eq!(&uv[..2], &[128, 128]);
+
+        let (y, uv) = convert_with(
+            &SCALAR,
+            &black.repeat(2),
+            2,
+            2,
+            FrameFormat::Bgra,
+            ColorMatrix::Bt2020Ncl,
+            true,
+        );
+        assert_eq!(u16::from_le_bytes([y[0], y[1]]), 64 << 6);
+        assert_eq!(u16::from_le_bytes([uv[0], uv[1]]), 512 << 6);
+
+        // Pure blue has maximum Cb
+        let blue = [255, 0, 0, 255].repeat(8);
+        let (_, uv) = convert_with(
+            &SCALAR,
+            &blue,
+            2,
+            2,
+            FrameFormat::Bgra,
+            ColorMatrix::Bt709,
+            false,
+        );
+        assert_eq!(uv[0], 240);
+    }
+
+    #[test]
+    fn test_blend_levels() {
+        let src = [200u8, 100, 0, 128];
+        let mut dst = [0u8, 100, 255, 255];
+        (SCALAR.blend)(&src, &mut dst, 1, 255, false);
+        assert_eq!(dst, [200, 100, 0, 255]);
+
+        // Half-transparent source at full opacity, or opaque at half
+        for (opacity, src_alpha, alpha) in [(255, true, 191), (128, false, 255)] {
+            let mut dst = [0u8, 100, 255, 255];
+            (SCALAR.blend)(&src, &mut dst, 1, opacity, src_alpha);
+            assert_eq!(dst, [100, 100, 127, alpha]);
+        }
+    }
+
+    #[test]
+    fn test_nv12_to_p010_levels() {
+        let src_y = [16u8, 235, 128, 0];
+        let src_uv = [128u8, 240];
+        let mut y = [0u8; 8];
+        let mut uv = [0u8; 4];
+        nv12_to_p010(
+            PlaneRef::new(&src_y, 2),
+            PlaneRef::new(&src_uv, 2),
+            PlaneMut::new(&mut y, 4),
+            PlaneMut::new(&mut uv, 4),
+            2,
+            2,
+        )
+        .unwrap();
+
+        let sample = |b: &[u8], i: usize| u16::from_le_bytes([b[2 * i], b[2 * i + 1]]) >> 6;
+        assert_eq!(sample(&y, 0), 64);
+        assert_eq!(sample(&y, 1), 940);
+        assert_eq!(sample(&uv, 0), 512);
+        assert_eq!(sample(&uv, 1), 960);
+    }
+}
@@ -0,0 +1,228 @@
+//! NEON kernels
+//!
+//! `vld4q_u8` deinterleaves 16 pixels into one register per byte position;
+//! weighted sums are widened to 32 bits and shifted exactly as the scalar
+//! code does. Row tails fall back to the scalar kernels.
+
+use super::{scalar, Coeffs, Isa, RowKernels, C_OFFSET, SHIFT_10, SHIFT_8, Y_OFFSET};
+
+use std::arch::aarch64::*;
+
+pub(super) static NEON: RowKernels = RowKernels {
+    isa: Isa::Neon,
+    luma8: |src, dst, width, c| unsafe { luma_neon(src, dst, width, c, false) },
+    luma10: |src, dst, width, c| unsafe { luma_neon(src, dst, width, c, true) },
+    chroma8: |row0, row1, dst, width, c| unsafe { chroma_neon(row0, row1, dst, width, c, false) },
+    chroma10: |row0, row1, dst, width, c| unsafe { chroma_neon(row0, row1, dst, width, c, true) },
+    widen: |src, dst, len| unsafe { widen_neon(src, dst, len) },
+    swap_rb: |src, dst, width| unsafe { swap_rb_neon(src, dst, width) },
+    blend: |src, dst, width, opacity, alpha| unsafe { blend_neon(src, dst, width, opacity, alpha) },
+};
+
+fn shift(ten_bit: bool) -> u32 {
+    if ten_bit {
+        SHIFT_10
+    } else {
+        SHIFT_8
+    }
+}
+
+/// Weighted sum of three 8-lane inputs, shifted right by `shift`
+#[inline(always)]
+unsafe fn weigh(p: [int16x8_t; 3], w: &[i32; 3], bias: int32x4_t, shift: int32x4_t) -> uint16x8_t {
+    let lo = vmlal_n_s16(bias, vget_low_s16(p[0]), w[0] as i16);
+    let lo = vmlal_n_s16(lo, vget_low_s16(p[1]), w[1] as i16);
+    let lo = vmlal_n_s16(lo, vget_low_s16(p[2]), w[2] as i16);
+    let hi = vmlal_n_s16(bias, vget_high_s16(p[0]), w[0] as i16);
+    let hi = vmlal_n_s16(hi, vget_high_s16(p[1]), w[1] as i16);
+    let hi = vmlal_n_s16(hi, vget_high_s16(p[2]), w[2] as i16);
+    // Negative shift counts shift right (arithmetic), saturating narrow
+    // clamps below at zero
+    vcombine_u16(
+        vqmovun_s32(vshlq_s32(lo, shift)),
+        vqmovun_s32(vshlq_s32(hi, shift)),
+    )
+}
+
+/// Clamp to 10 bits and move to the high bits of each sample
+#[inline(always)]
+unsafe fn to_p010(v: uint16x8_t) -> uint16x8_t {
+    vshlq_n_u16::<6>(vminq_u16(v, vdupq_n_u16(1023)))
+}
+
+#[target_feature(enable = "neon")]
+unsafe fn luma_neon(src: &[u8], dst: &mut [u8], width: usize, c: &Coeffs, ten_bit: bool) {
+    let shift = shift(ten_bit);
+    let bias = vdupq_n_s32(Y_OFFSET + (1 << (shift - 1)));
+    let count = vdupq_n_s32(-(shift as i32));
+    let bytes = if ten_bit { 2 } else { 1 };
+
+    let s = src.as_ptr();
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 16 <= width {
+        let px = vld4q_u8(s.add(x * 4));
+        let lo = [px.0, px.1, px.2].map(|b| vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(b))));
+        let hi = [px.0, px.1, px.2].map(|b| vreinterpretq_s16_u16(vmovl_high_u8(b)));
+        let y0 = weigh(lo, &c.y, bias, count);
+        let y1 = weigh(hi, &c.y, bias, count);
+
+        if ten_bit {
+            vst1q_u8(d.add(x * 2), vreinterpretq_u8_u16(to_p010(y0)));
+            vst1q_u8(d.add(x * 2 + 16), vreinterpretq_u8_u16(to_p010(y1)));
+        } else {
+            vst1q_u8(d.add(x), vcombine_u8(vqmovn_u16(y0), vqmovn_u16(y1)));
+        }
+        x += 16;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::luma10
+        } else {
+            scalar::luma8
+        };
+        tail(&src[x * 4..], &mut dst[x * bytes..], width - x, c);
+    }
+}
+
+#[target_feature(enable = "neon")]
+unsafe fn chroma_neon(
+    row0: &[u8],
+    row1: &[u8],
+    dst: &mut [u8],
+    width: usize,
+    c: &Coeffs,
+    ten_bit: bool,
+) {
+    let shift = shift(ten_bit);
+    let bias = vdupq_n_s32(C_OFFSET + (1 << (shift + 1)));
+    let count = vdupq_n_s32(-(shift as i32 + 2));
+    let bytes = if ten_bit { 4 } else { 2 };
+
+    let (s0, s1) = (row0.as_ptr(), row1.as_ptr());
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 16 <= width {
+        let a = vld4q_u8(s0.add(x * 4));
+        let b = vld4q_u8(s1.add(x * 4));
+        // 2x2 block sums for 8 output samples
+        let sums = [(a.0, b.0), (a.1, b.1), (a.2, b.2)]
+            .map(|(a, b)| vreinterpretq_s16_u16(vpadalq_u8(vpaddlq_u8(a), b)));
+        let u = weigh(sums, &c.u, bias, count);
+        let v = weigh(sums, &c.v, bias, count);
+
+        if ten_bit {
+            let (u, v) = (to_p010(u), to_p010(v));
+            vst1q_u8(d.add(x * 2), vreinterpretq_u8_u16(vzip1q_u16(u, v)));
+            vst1q_u8(d.add(x * 2 + 16), vreinterpretq_u8_u16(vzip2q_u16(u, v)));
+        } else {
+            vst2_u8(d.add(x), uint8x8x2_t(vqmovn_u16(u), vqmovn_u16(v)));
+        }
+        x += 16;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::chroma10
+        } else {
+            scalar::chroma8
+        };
+        tail(
+            &row0[x * 4..],
+            &row1[x * 4..],
+            &mut dst[x / 2 * bytes..],
+            width - x,
+            c,
+        );
+    }
+}
+
+#[target_feature(enable = "neon")]
+unsafe fn widen_neon(src: &[u8], dst: &mut [u8], len: usize) {
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut i = 0;
+    while i + 16 <= len {
+        let v = vld1q_u8(s.add(i));
+        vst1q_u8(
+            d.add(i * 2),
+            vreinterpretq_u8_u16(vshll_n_u8::<8>(vget_low_u8(v))),
+        );
+        vst1q_u8(
+            d.add(i * 2 + 16),
+            vreinterpretq_u8_u16(vshll_high_n_u8::<8>(v)),
+        );
+        i += 16;
+    }
+    if i < len {
+        scalar::widen(&src[i..], &mut dst[i * 2..], len - i);
+    }
+}
+
+#[target_feature(enable = "neon")]
+unsafe fn swap_rb_neon(src: &[u8], dst: &mut [u8], width: usize) {
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut x = 0;
+    while x + 16 <= width {
+        let px = vld4q_u8(s.add(x * 4));
+        vst4q_u8(d.add(x * 4), uint8x16x4_t(px.2, px.1, px.0, px.3));
+        x += 16;
+    }
+    if x < width {
+        scalar::swap_rb(&src[x * 4..], &mut dst[x * 4..], width - x);
+    }
+}
+
+/// `x / 255` narrowed to 8 bits, rounded as [`scalar::div255`]
+#[inline(always)]
+unsafe fn div255(x: uint16x8_t) -> uint8x8_t {
+    let x = vaddq_u16(x, vdupq_n_u16(128));
+    vshrn_n_u16::<8>(vaddq_u16(x, vshrq_n_u16::<8>(x)))
+}
+
+#[inline(always)]
+unsafe fn mix(s: uint8x16_t, d: uint8x16_t, a: uint8x16_t, inv: uint8x16_t) -> uint8x16_t {
+    let lo = vmlal_u8(
+        vmull_u8(vget_low_u8(s), vget_low_u8(a)),
+        vget_low_u8(d),
+        vget_low_u8(inv),
+    );
+    let hi = vmlal_high_u8(vmull_high_u8(s, a), d, inv);
+    vcombine_u8(div255(lo), div255(hi))
+}
+
+#[target_feature(enable = "neon")]
+unsafe fn blend_neon(src: &[u8], dst: &mut [u8], width: usize, opacity: u8, src_alpha: bool) {
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let opacity = vdup_n_u8(opacity);
+    let mut x = 0;
+    while x + 16 <= width {
+        let sp = vld4q_u8(s.add(x * 4));
+        let dp = vld4q_u8(d.add(x * 4));
+        let alpha = if src_alpha { sp.3 } else { vdupq_n_u8(255) };
+        let a = vcombine_u8(
+            div255(vmull_u8(vget_low_u8(alpha), opacity)),
+            div255(vmull_u8(vget_high_u8(alpha), opacity)),
+        );
+        let inv = vsubq_u8(vdupq_n_u8(255), a);
+        vst4q_u8(
+            d.add(x * 4),
+            uint8x16x4_t(
+                mix(sp.0, dp.0, a, inv),
+                mix(sp.1, dp.1, a, inv),
+                mix(sp.2, dp.2, a, inv),
+                mix(alpha, dp.3, a, inv),
+            ),
+        );
+        x += 16;
+    }
+    if x < width {
+        scalar::blend(
+            &src[x * 4..],
+            &mut dst[x * 4..],
+            width - x,
+            opacity,
+            src_alpha,
+        );
+    }
+}
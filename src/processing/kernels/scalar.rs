@@ -0,0 +1,90 @@
+//! Scalar reference kernels
+//!
+//! Also used by the SIMD kernels for row tails.
+
+use super::{Coeffs, C_OFFSET, SHIFT_10, SHIFT_8, Y_OFFSET};
+
+#[inline(always)]
+fn luma(c: &Coeffs, px: &[u8], shift: u32) -> i32 {
+    let sum = c.y[0] * px[0] as i32 + c.y[1] * px[1] as i32 + c.y[2] * px[2] as i32;
+    (sum + Y_OFFSET + (1 << (shift - 1))) >> shift
+}
+
+#[inline(always)]
+fn chroma(w: &[i32; 3], sums: &[i32; 3], shift: u32) -> i32 {
+    let sum = w[0] * sums[0] + w[1] * sums[1] + w[2] * sums[2];
+    (sum + C_OFFSET + (1 << (shift + 1))) >> (shift + 2)
+}
+
+/// Sums of the 2x2 block starting at column `x` (edge pixels replicated)
+#[inline(always)]
+fn block_sums(row0: &[u8], row1: &[u8], x: usize, width: usize) -> [i32; 3] {
+    let a = x * 4;
+    let b = (x + 1).min(width - 1) * 4;
+    let mut sums = [0; 3];
+    for (i, sum) in sums.iter_mut().enumerate() {
+        *sum = row0[a + i] as i32 + row0[b + i] as i32 + row1[a + i] as i32 + row1[b + i] as i32;
+    }
+    sums
+}
+
+pub(super) fn luma8(src: &[u8], dst: &mut [u8], width: usize, c: &Coeffs) {
+    for (px, out) in src.chunks_exact(4).zip(dst.iter_mut()).take(width) {
+        *out = luma(c, px, SHIFT_8).clamp(0, 255) as u8;
+    }
+}
+
+pub(super) fn luma10(src: &[u8], dst: &mut [u8], width: usize, c: &Coeffs) {
+    for (px, out) in src.chunks_exact(4).zip(dst.chunks_exact_mut(2)).take(width) {
+        let y = (luma(c, px, SHIFT_10).clamp(0, 1023) as u16) << 6;
+        out.copy_from_slice(&y.to_le_bytes());
+    }
+}
+
+pub(super) fn chroma8(row0: &[u8], row1: &[u8], dst: &mut [u8], width: usize, c: &Coeffs) {
+    for (i, out) in dst.chunks_exact_mut(2).take(width.div_ceil(2)).enumerate() {
+        let sums = block_sums(row0, row1, 2 * i, width);
+        out[0] = chroma(&c.u, &sums, SHIFT_8).clamp(0, 255) as u8;
+        out[1] = chroma(&c.v, &sums, SHIFT_8).clamp(0, 255) as u8;
+    }
+}
+
+pub(super) fn chroma10(row0: &[u8], row1: &[u8], dst: &mut [u8], width: usize, c: &Coeffs) {
+    for (i, out) in dst.chunks_exact_mut(4).take(width.div_ceil(2)).enumerate() {
+        let sums = block_sums(row0, row1, 2 * i, width);
+        let u = (chroma(&c.u, &sums, SHIFT_10).clamp(0, 1023) as u16) << 6;
+        let v = (chroma(&c.v, &sums, SHIFT_10).clamp(0, 1023) as u16) << 6;
+        out[..2].copy_from_slice(&u.to_le_bytes());
+        out[2..].copy_from_slice(&v.to_le_bytes());
+    }
+}
+
+/// 8-bit sample `s` becomes the P010 sample `(s << 2) << 6`
+pub(super) fn widen(src: &[u8], dst: &mut [u8], len: usize) {
+    for (&s, out) in src.iter().zip(dst.chunks_exact_mut(2)).take(len) {
+        out.copy_from_slice(&((s as u16) << 8).to_le_bytes());
+    }
+}
+
+pub(super) fn swap_rb(src: &[u8], dst: &mut [u8], width: usize) {
+    for (px, out) in src.chunks_exact(4).zip(dst.chunks_exact_mut(4)).take(width) {
+        out.copy_from_slice(&[px[2], px[1], px[0], px[3]]);
+    }
+}
+
+/// `x / 255`, rounded (exact for `x <= 255 * 255`)
+#[inline(always)]
+pub(super) fn div255(x: u32) -> u32 {
+    let x = x + 128;
+    (x + (x >> 8)) >> 8
+}
+
+pub(super) fn blend(src: &[u8], dst: &mut [u8], width: usize, opacity: u8, src_alpha: bool) {
+    for (px, out) in src.chunks_exact(4).zip(dst.chunks_exact_mut(4)).take(width) {
+        let alpha = if src_alpha { px[3] } else { 255 };
+        let a = div255(alpha as u32 * opacity as u32);
+        for (&s, d) in [px[0], px[1], px[2], alpha].iter().zip(out.iter_mut()) {
+            *d = div255(s as u32 * a + *d as u32 * (255 - a)) as u8;
+        }
+    }
+}
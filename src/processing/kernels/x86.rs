@@ -0,0 +1,515 @@
+//! AVX2 and AVX-512 kernels
+//!
+//! Pixels are split into 16-bit pairs (bytes 0/2 and 1/3) so one
+//! `madd_epi16` per pair computes the weighted sums in 32-bit lanes, exactly
+//! as the scalar code does. Row tails fall back to the scalar kernels.
+
+use super::{scalar, Coeffs, Isa, RowKernels, C_OFFSET, SHIFT_10, SHIFT_8, Y_OFFSET};
+
+use std::arch::x86_64::*;
+
+pub(super) static AVX2: RowKernels = RowKernels {
+    isa: Isa::Avx2,
+    luma8: |src, dst, width, c| unsafe { luma_avx2(src, dst, width, c, false) },
+    luma10: |src, dst, width, c| unsafe { luma_avx2(src, dst, width, c, true) },
+    chroma8: |row0, row1, dst, width, c| unsafe { chroma_avx2(row0, row1, dst, width, c, false) },
+    chroma10: |row0, row1, dst, width, c| unsafe { chroma_avx2(row0, row1, dst, width, c, true) },
+    widen: |src, dst, len| unsafe { widen_avx2(src, dst, len) },
+    swap_rb: |src, dst, width| unsafe { swap_rb_avx2(src, dst, width) },
+    blend: |src, dst, width, opacity, alpha| unsafe { blend_avx2(src, dst, width, opacity, alpha) },
+};
+
+pub(super) static AVX512: RowKernels = RowKernels {
+    isa: Isa::Avx512,
+    luma8: |src, dst, width, c| unsafe { luma_avx512(src, dst, width, c, false) },
+    luma10: |src, dst, width, c| unsafe { luma_avx512(src, dst, width, c, true) },
+    chroma8: |row0, row1, dst, width, c| unsafe { chroma_avx512(row0, row1, dst, width, c, false) },
+    chroma10: |row0, row1, dst, width, c| unsafe { chroma_avx512(row0, row1, dst, width, c, true) },
+    widen: |src, dst, len| unsafe { widen_avx512(src, dst, len) },
+    swap_rb: |src, dst, width| unsafe { swap_rb_avx512(src, dst, width) },
+    blend: |src, dst, width, opacity, alpha| unsafe {
+        blend_avx512(src, dst, width, opacity, alpha)
+    },
+};
+
+/// Shuffle broadcasting each pixel's 16-bit alpha to its four channels
+/// (two unpacked pixels per 128-bit lane)
+const ALPHA_LANE: [i8; 16] = [6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15];
+
+/// Alpha byte forced to 255 unless the source alpha is used
+fn alpha_fill(src_alpha: bool) -> i32 {
+    if src_alpha {
+        0
+    } else {
+        0xff00_0000u32 as i32
+    }
+}
+
+/// Weight pairs for (byte 0, byte 2) and (byte 1, byte 3)
+fn weight_pairs(w: &[i32; 3]) -> (i32, i32) {
+    ((w[0] & 0xffff) | (w[2] << 16), w[1] & 0xffff)
+}
+
+fn shift(ten_bit: bool) -> u32 {
+    if ten_bit {
+        SHIFT_10
+    } else {
+        SHIFT_8
+    }
+}
+
+// ============================================================================
+// AVX2
+// ============================================================================
+
+/// Split pixels into (byte 0, byte 2) and (byte 1, byte 3) 16-bit pairs
+#[inline(always)]
+unsafe fn split_avx2(px: __m256i) -> (__m256i, __m256i) {
+    let mask = _mm256_set1_epi32(0x00ff_00ff);
+    (
+        _mm256_and_si256(px, mask),
+        _mm256_and_si256(_mm256_srli_epi32::<8>(px), mask),
+    )
+}
+
+#[inline(always)]
+unsafe fn weigh_avx2(lo: __m256i, hi: __m256i, w: (i32, i32)) -> __m256i {
+    _mm256_add_epi32(
+        _mm256_madd_epi16(lo, _mm256_set1_epi32(w.0)),
+        _mm256_madd_epi16(hi, _mm256_set1_epi32(w.1)),
+    )
+}
+
+#[inline(always)]
+unsafe fn clamp_avx2(x: __m256i, max: i32) -> __m256i {
+    _mm256_min_epi32(
+        _mm256_max_epi32(x, _mm256_setzero_si256()),
+        _mm256_set1_epi32(max),
+    )
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn luma_avx2(src: &[u8], dst: &mut [u8], width: usize, c: &Coeffs, ten_bit: bool) {
+    let shift = shift(ten_bit);
+    let w = weight_pairs(&c.y);
+    let bias = _mm256_set1_epi32(Y_OFFSET + (1 << (shift - 1)));
+    let count = _mm_cvtsi32_si128(shift as i32);
+    let bytes = if ten_bit { 2 } else { 1 };
+
+    let s = src.as_ptr();
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 16 <= width {
+        let yv = |offset: usize| {
+            let (lo, hi) = split_avx2(_mm256_loadu_si256(s.add(offset * 4) as *const __m256i));
+            _mm256_sra_epi32(_mm256_add_epi32(weigh_avx2(lo, hi, w), bias), count)
+        };
+        let y0 = yv(x);
+        let y1 = yv(x + 8);
+
+        if ten_bit {
+            let y0 = _mm256_slli_epi32::<6>(clamp_avx2(y0, 1023));
+            let y1 = _mm256_slli_epi32::<6>(clamp_avx2(y1, 1023));
+            let packed = _mm256_permute4x64_epi64::<0xd8>(_mm256_packus_epi32(y0, y1));
+            _mm256_storeu_si256(d.add(x * 2) as *mut __m256i, packed);
+        } else {
+            let words = _mm256_packs_epi32(y0, y1);
+            let bytes8 = _mm256_packus_epi16(words, words);
+            let ordered =
+                _mm256_permutevar8x32_epi32(bytes8, _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5));
+            _mm_storeu_si128(d.add(x) as *mut __m128i, _mm256_castsi256_si128(ordered));
+        }
+        x += 16;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::luma10
+        } else {
+            scalar::luma8
+        };
+        tail(&src[x * 4..], &mut dst[x * bytes..], width - x, c);
+    }
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn chroma_avx2(
+    row0: &[u8],
+    row1: &[u8],
+    dst: &mut [u8],
+    width: usize,
+    c: &Coeffs,
+    ten_bit: bool,
+) {
+    let shift = shift(ten_bit);
+    let wu = weight_pairs(&c.u);
+    let wv = weight_pairs(&c.v);
+    let bias = _mm256_set1_epi32(C_OFFSET + (1 << (shift + 1)));
+    let count = _mm_cvtsi32_si128(shift as i32 + 2);
+    let bytes = if ten_bit { 4 } else { 2 };
+
+    let (s0, s1) = (row0.as_ptr(), row1.as_ptr());
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 16 <= width {
+        // Vertical sums of 8 pixels, as 16-bit pairs
+        let sums = |offset: usize| {
+            let (a_lo, a_hi) = split_avx2(_mm256_loadu_si256(s0.add(offset * 4) as *const __m256i));
+            let (b_lo, b_hi) = split_avx2(_mm256_loadu_si256(s1.add(offset * 4) as *const __m256i));
+            (_mm256_add_epi16(a_lo, b_lo), _mm256_add_epi16(a_hi, b_hi))
+        };
+        let (lo0, hi0) = sums(x);
+        let (lo1, hi1) = sums(x + 8);
+
+        // Horizontal pair sums; blocks come out as 0 1 4 5 | 2 3 6 7
+        let lo = _mm256_hadd_epi32(lo0, lo1);
+        let hi = _mm256_hadd_epi32(hi0, hi1);
+
+        let u = _mm256_sra_epi32(_mm256_add_epi32(weigh_avx2(lo, hi, wu), bias), count);
+        let v = _mm256_sra_epi32(_mm256_add_epi32(weigh_avx2(lo, hi, wv), bias), count);
+
+        if ten_bit {
+            let u = _mm256_slli_epi32::<6>(clamp_avx2(u, 1023));
+            let v = _mm256_slli_epi32::<6>(clamp_avx2(v, 1023));
+            let uv = _mm256_or_si256(u, _mm256_slli_epi32::<16>(v));
+            let ordered = _mm256_permute4x64_epi64::<0xd8>(uv);
+            _mm256_storeu_si256(d.add(x * 2) as *mut __m256i, ordered);
+        } else {
+            let uv = _mm256_or_si256(
+                clamp_avx2(u, 255),
+                _mm256_slli_epi32::<8>(clamp_avx2(v, 255)),
+            );
+            let words = _mm256_packus_epi32(uv, uv);
+            let ordered =
+                _mm256_permutevar8x32_epi32(words, _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5));
+            _mm_storeu_si128(d.add(x) as *mut __m128i, _mm256_castsi256_si128(ordered));
+        }
+        x += 16;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::chroma10
+        } else {
+            scalar::chroma8
+        };
+        tail(
+            &row0[x * 4..],
+            &row1[x * 4..],
+            &mut dst[x / 2 * bytes..],
+            width - x,
+            c,
+        );
+    }
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn widen_avx2(src: &[u8], dst: &mut [u8], len: usize) {
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut i = 0;
+    while i + 16 <= len {
+        let v = _mm256_cvtepu8_epi16(_mm_loadu_si128(s.add(i) as *const __m128i));
+        _mm256_storeu_si256(d.add(i * 2) as *mut __m256i, _mm256_slli_epi16::<8>(v));
+        i += 16;
+    }
+    if i < len {
+        scalar::widen(&src[i..], &mut dst[i * 2..], len - i);
+    }
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn swap_rb_avx2(src: &[u8], dst: &mut [u8], width: usize) {
+    let shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+        14, 13, 12, 15,
+    );
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut x = 0;
+    while x + 8 <= width {
+        let v = _mm256_loadu_si256(s.add(x * 4) as *const __m256i);
+        _mm256_storeu_si256(
+            d.add(x * 4) as *mut __m256i,
+            _mm256_shuffle_epi8(v, shuffle),
+        );
+        x += 8;
+    }
+    if x < width {
+        scalar::swap_rb(&src[x * 4..], &mut dst[x * 4..], width - x);
+    }
+}
+
+/// `x / 255` in 16-bit lanes, rounded as [`scalar::div255`]
+#[inline(always)]
+unsafe fn div255_avx2(x: __m256i) -> __m256i {
+    let x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    _mm256_srli_epi16::<8>(_mm256_add_epi16(x, _mm256_srli_epi16::<8>(x)))
+}
+
+/// Blend unpacked 16-bit pixels
+#[inline(always)]
+unsafe fn blend16_avx2(s: __m256i, d: __m256i, opacity: __m256i, shuffle: __m256i) -> __m256i {
+    let a = div255_avx2(_mm256_mullo_epi16(_mm256_shuffle_epi8(s, shuffle), opacity));
+    let inv = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+    div255_avx2(_mm256_add_epi16(
+        _mm256_mullo_epi16(s, a),
+        _mm256_mullo_epi16(d, inv),
+    ))
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn blend_avx2(src: &[u8], dst: &mut [u8], width: usize, opacity: u8, src_alpha: bool) {
+    let shuffle =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128(ALPHA_LANE.as_ptr() as *const __m128i));
+    let fill = _mm256_set1_epi32(alpha_fill(src_alpha));
+    let opacity16 = _mm256_set1_epi16(opacity as i16);
+    let zero = _mm256_setzero_si256();
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut x = 0;
+    while x + 8 <= width {
+        let sv = _mm256_or_si256(_mm256_loadu_si256(s.add(x * 4) as *const __m256i), fill);
+        let dv = _mm256_loadu_si256(d.add(x * 4) as *const __m256i);
+        let lo = blend16_avx2(
+            _mm256_unpacklo_epi8(sv, zero),
+            _mm256_unpacklo_epi8(dv, zero),
+            opacity16,
+            shuffle,
+        );
+        let hi = blend16_avx2(
+            _mm256_unpackhi_epi8(sv, zero),
+            _mm256_unpackhi_epi8(dv, zero),
+            opacity16,
+            shuffle,
+        );
+        _mm256_storeu_si256(d.add(x * 4) as *mut __m256i, _mm256_packus_epi16(lo, hi));
+        x += 8;
+    }
+    if x < width {
+        scalar::blend(
+            &src[x * 4..],
+            &mut dst[x * 4..],
+            width - x,
+            opacity,
+            src_alpha,
+        );
+    }
+}
+
+// ============================================================================
+// AVX-512 (F + BW)
+// ============================================================================
+
+#[inline(always)]
+unsafe fn split_avx512(px: __m512i) -> (__m512i, __m512i) {
+    let mask = _mm512_set1_epi32(0x00ff_00ff);
+    (
+        _mm512_and_si512(px, mask),
+        _mm512_and_si512(_mm512_srli_epi32::<8>(px), mask),
+    )
+}
+
+#[inline(always)]
+unsafe fn weigh_avx512(lo: __m512i, hi: __m512i, w: (i32, i32)) -> __m512i {
+    _mm512_add_epi32(
+        _mm512_madd_epi16(lo, _mm512_set1_epi32(w.0)),
+        _mm512_madd_epi16(hi, _mm512_set1_epi32(w.1)),
+    )
+}
+
+#[inline(always)]
+unsafe fn clamp_avx512(x: __m512i, max: i32) -> __m512i {
+    _mm512_min_epi32(
+        _mm512_max_epi32(x, _mm512_setzero_si512()),
+        _mm512_set1_epi32(max),
+    )
+}
+
+#[target_feature(enable = "avx512f,avx512bw")]
+unsafe fn luma_avx512(src: &[u8], dst: &mut [u8], width: usize, c: &Coeffs, ten_bit: bool) {
+    let shift = shift(ten_bit);
+    let w = weight_pairs(&c.y);
+    let bias = _mm512_set1_epi32(Y_OFFSET + (1 << (shift - 1)));
+    let count = _mm_cvtsi32_si128(shift as i32);
+    let bytes = if ten_bit { 2 } else { 1 };
+
+    let s = src.as_ptr();
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 16 <= width {
+        let (lo, hi) = split_avx512(_mm512_loadu_si512(s.add(x * 4) as *const _));
+        let y = _mm512_sra_epi32(_mm512_add_epi32(weigh_avx512(lo, hi, w), bias), count);
+
+        if ten_bit {
+            let y = _mm512_slli_epi32::<6>(clamp_avx512(y, 1023));
+            _mm256_storeu_si256(d.add(x * 2) as *mut __m256i, _mm512_cvtepi32_epi16(y));
+        } else {
+            let y = clamp_avx512(y, 255);
+            _mm_storeu_si128(d.add(x) as *mut __m128i, _mm512_cvtepi32_epi8(y));
+        }
+        x += 16;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::luma10
+        } else {
+            scalar::luma8
+        };
+        tail(&src[x * 4..], &mut dst[x * bytes..], width - x, c);
+    }
+}
+
+#[target_feature(enable = "avx512f,avx512bw")]
+unsafe fn chroma_avx512(
+    row0: &[u8],
+    row1: &[u8],
+    dst: &mut [u8],
+    width: usize,
+    c: &Coeffs,
+    ten_bit: bool,
+) {
+    let shift = shift(ten_bit);
+    let wu = weight_pairs(&c.u);
+    let wv = weight_pairs(&c.v);
+    let bias = _mm512_set1_epi32(C_OFFSET + (1 << (shift + 1)));
+    let count = _mm_cvtsi32_si128(shift as i32 + 2);
+    let bytes = if ten_bit { 4 } else { 2 };
+    // Even 32-bit elements of (a, b)
+    let evens = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+
+    let (s0, s1) = (row0.as_ptr(), row1.as_ptr());
+    let d = dst.as_mut_ptr();
+    let mut x = 0;
+    while x + 32 <= width {
+        // Vertical sums of 16 pixels, then add each odd pixel onto its
+        // even neighbour
+        let pairs = |offset: usize| {
+            let (a_lo, a_hi) = split_avx512(_mm512_loadu_si512(s0.add(offset * 4) as *const _));
+            let (b_lo, b_hi) = split_avx512(_mm512_loadu_si512(s1.add(offset * 4) as *const _));
+            let lo = _mm512_add_epi16(a_lo, b_lo);
+            let hi = _mm512_add_epi16(a_hi, b_hi);
+            (
+                _mm512_add_epi32(lo, _mm512_srli_epi64::<32>(lo)),
+                _mm512_add_epi32(hi, _mm512_srli_epi64::<32>(hi)),
+            )
+        };
+        let (lo0, hi0) = pairs(x);
+        let (lo1, hi1) = pairs(x + 16);
+        let lo = _mm512_permutex2var_epi32(lo0, evens, lo1);
+        let hi = _mm512_permutex2var_epi32(hi0, evens, hi1);
+
+        let u = _mm512_sra_epi32(_mm512_add_epi32(weigh_avx512(lo, hi, wu), bias), count);
+        let v = _mm512_sra_epi32(_mm512_add_epi32(weigh_avx512(lo, hi, wv), bias), count);
+
+        if ten_bit {
+            let u = _mm512_slli_epi32::<6>(clamp_avx512(u, 1023));
+            let v = _mm512_slli_epi32::<6>(clamp_avx512(v, 1023));
+            let uv = _mm512_or_si512(u, _mm512_slli_epi32::<16>(v));
+            _mm512_storeu_si512(d.add(x * 2) as *mut _, uv);
+        } else {
+            let uv = _mm512_or_si512(
+                clamp_avx512(u, 255),
+                _mm512_slli_epi32::<8>(clamp_avx512(v, 255)),
+            );
+            _mm256_storeu_si256(d.add(x) as *mut __m256i, _mm512_cvtepi32_epi16(uv));
+        }
+        x += 32;
+    }
+
+    if x < width {
+        let tail = if ten_bit {
+            scalar::chroma10
+        } else {
+            scalar::chroma8
+        };
+        tail(
+            &row0[x * 4..],
+            &row1[x * 4..],
+            &mut dst[x / 2 * bytes..],
+            width - x,
+            c,
+        );
+    }
+}
+
+#[target_feature(enable = "avx512f,avx512bw")]
+unsafe fn widen_avx512(src: &[u8], dst: &mut [u8], len: usize) {
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut i = 0;
+    while i + 32 <= len {
+        let v = _mm512_cvtepu8_epi16(_mm256_loadu_si256(s.add(i) as *const __m256i));
+        _mm512_storeu_si512(d.add(i * 2) as *mut _, _mm512_slli_epi16::<8>(v));
+        i += 32;
+    }
+    if i < len {
+        scalar::widen(&src[i..], &mut dst[i * 2..], len - i);
+    }
+}
+
+#[target_feature(enable = "avx512f,avx512bw")]
+unsafe fn swap_rb_avx512(src: &[u8], dst: &mut [u8], width: usize) {
+    let lane = [2i8, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15];
+    let shuffle = _mm512_broadcast_i32x4(_mm_loadu_si128(lane.as_ptr() as *const __m128i));
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut x = 0;
+    while x + 16 <= width {
+        let v = _mm512_loadu_si512(s.add(x * 4) as *const _);
+        _mm512_storeu_si512(d.add(x * 4) as *mut _, _mm512_shuffle_epi8(v, shuffle));
+        x += 16;
+    }
+    if x < width {
+        scalar::swap_rb(&src[x * 4..], &mut dst[x * 4..], width - x);
+    }
+}
+
+#[inline(always)]
+unsafe fn div255_avx512(x: __m512i) -> __m512i {
+    let x = _mm512_add_epi16(x, _mm512_set1_epi16(128));
+    _mm512_srli_epi16::<8>(_mm512_add_epi16(x, _mm512_srli_epi16::<8>(x)))
+}
+
+#[inline(always)]
+unsafe fn blend16_avx512(s: __m512i, d: __m512i, opacity: __m512i, shuffle: __m512i) -> __m512i {
+    let a = div255_avx512(_mm512_mullo_epi16(_mm512_shuffle_epi8(s, shuffle), opacity));
+    let inv = _mm512_sub_epi16(_mm512_set1_epi16(255), a);
+    div255_avx512(_mm512_add_epi16(
+        _mm512_mullo_epi16(s, a),
+        _mm512_mullo_epi16(d, inv),
+    ))
+}
+
+#[target_feature(enable = "avx512f,avx512bw")]
+unsafe fn blend_avx512(src: &[u8], dst: &mut [u8], width: usize, opacity: u8, src_alpha: bool) {
+    let shuffle = _mm512_broadcast_i32x4(_mm_loadu_si128(ALPHA_LANE.as_ptr() as *const __m128i));
+    let fill = _mm512_set1_epi32(alpha_fill(src_alpha));
+    let opacity16 = _mm512_set1_epi16(opacity as i16);
+    let zero = _mm512_setzero_si512();
+    let (s, d) = (src.as_ptr(), dst.as_mut_ptr());
+    let mut x = 0;
+    while x + 16 <= width {
+        let sv = _mm512_or_si512(_mm512_loadu_si512(s.add(x * 4) as *const _), fill);
+        let dv = _mm512_loadu_si512(d.add(x * 4) as *const _);
+        let lo = blend16_avx512(
+            _mm512_unpacklo_epi8(sv, zero),
+            _mm512_unpacklo_epi8(dv, zero),
+            opacity16,
+            shuffle,
+        );
+        let hi = blend16_avx512(
+            _mm512_unpackhi_epi8(sv, zero),
+            _mm512_unpackhi_epi8(dv, zero),
+            opacity16,
+            shuffle,
+        );
+        _mm512_storeu_si512(d.add(x * 4) as *mut _, _mm512_packus_epi16(lo, hi));
+        x += 16;
+    }
+    if x < width {
+        scalar::blend(
+            &src[x * 4..],
+            &mut dst[x * 4..],
+            width - x,
+            opacity,
+            src_alpha,
+        );
+    }
+}
@@ -4,58 +4,53 @@
 //! - Resolution scaling
 //! - Colorspace conversion
 //! - HDR to SDR tonemapping
+//! - SDR to HDR10/HLG transfer mapping
 //! - P010 (10-bit) format support
+//! - SIMD pixel conversion kernels
+//! - GPU scaling on the encoder's device (CUDA, QSV, VA-API, Vulkan)
+//! - A compiled processing graph that fuses the above into one pass
 
 mod convert;
+mod gpu;
+mod graph;
 pub mod hdr;
+pub mod kernels;
 mod scale;
+mod sws;
+mod transfer;
 
 pub use convert::{convert_colorspace, ColorspaceConverter};
+pub use gpu::{GpuBackend, GpuInput, GpuOutput, GpuScaler};
+pub use graph::{GraphTimings, ProcessingGraph, ProcessingPath, StageTiming};
 pub use hdr::{
     ColorMatrix, ColorPrimaries, ContentLightLevel, Hdr10Metadata, HdrConfig, TransferFunction,
 };
 pub use scale::{scale_frame, scale_nv12, ScaleAlgorithm, Scaler};
+pub use sws::SwsCache;
+pub use transfer::{SdrToHdr, SDR_WHITE_NITS};
 
 use crate::error::Result;
 use crate::types::{Frame, FrameFormat, Resolution};
 
+use std::cell::RefCell;
+
 /// Process a frame (scale, convert, etc.)
+///
+/// When no scaling or conversion is needed the input buffer is shared with
+/// the returned frame rather than copied. Uses a per-thread
+/// [`ProcessingGraph`]; long-lived stages should own one.
 pub fn process_frame(
     frame: &Frame,
     target_resolution: Option<Resolution>,
     target_format: Option<FrameFormat>,
 ) -> Result<Frame> {
-    let mut result = frame.data.clone();
-    let mut width = frame.width;
-    let mut height = frame.height;
-    let mut format = frame.format;
-
-    // Scale if needed
-    if let Some(res) = target_resolution {
-        if res.width != frame.width || res.height != frame.height {
-            result = scale::scale_frame(&result, frame.width, frame.height, res.width, res.height)?;
-            width = res.width;
-            height = res.height;
-        }
+    thread_local! {
+        static GRAPH: RefCell<ProcessingGraph> =
+            RefCell::new(ProcessingGraph::new(None, None, None));
     }
-
-    // Convert colorspace if needed
-    if let Some(fmt) = target_format {
-        if fmt != frame.format {
-            result = convert::convert_colorspace(&result, format, fmt, width, height)?;
-            format = fmt;
-        }
-    }
-
-    Ok(Frame {
-        data: result,
-        width,
-        height,
-        stride: width * 4, // Adjust based on format
-        format,
-        pts: frame.pts,
-        duration: frame.duration,
-        is_keyframe: frame.is_keyframe,
-        dmabuf_fd: None, // Processing breaks zero-copy
+    GRAPH.with(|graph| {
+        let mut graph = graph.borrow_mut();
+        graph.set_target(target_resolution, target_format);
+        graph.process(frame)
     })
 }
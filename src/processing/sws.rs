@@ -0,0 +1,265 @@
+//! Cached swscale contexts
+//!
+//! Contexts are created once per (source size/format, destination
+//! size/format, flags) and run directly between caller-owned buffers, so a
+//! scale or conversion is a single `sws_scale` call with no staging frames.
+
+use crate::error::{Error, Result};
+use crate::pool::{FramePool, PoolKey};
+use crate::types::{Frame, FrameFormat};
+
+use ffmpeg_next as ffmpeg;
+use ffmpeg_next::ffi;
+use ffmpeg_next::format::Pixel;
+use ffmpeg_next::software::scaling::{Context as SwsContext, Flags as SwsFlags};
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+
+/// Contexts kept before the cache is flushed (resolution changes are rare)
+const MAX_CONTEXTS: usize = 8;
+
+/// Map FrameFormat to FFmpeg Pixel format
+fn format_to_pixel(format: FrameFormat) -> Pixel {
+    match format {
+        FrameFormat::Bgra => Pixel::BGRA,
+        FrameFormat::Rgba => Pixel::RGBA,
+        FrameFormat::Nv12 => Pixel::NV12,
+        FrameFormat::P010 => Pixel::P010LE,
+        FrameFormat::Yuv420p => Pixel::YUV420P,
+        FrameFormat::Yuv444p => Pixel::YUV444P,
+        FrameFormat::Rgb24 => Pixel::RGB24,
+    }
+}
+
+/// swscale matrix for a YUV format, matching the SIMD kernels
+fn sws_colorspace(format: FrameFormat) -> Option<i32> {
+    match format {
+        FrameFormat::P010 => Some(ffi::SWS_CS_BT2020 as i32),
+        FrameFormat::Nv12 | FrameFormat::Yuv420p | FrameFormat::Yuv444p => {
+            Some(ffi::SWS_CS_ITU709 as i32)
+        }
+        FrameFormat::Bgra | FrameFormat::Rgba | FrameFormat::Rgb24 => None,
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct SwsKey {
+    src_width: u32,
+    src_height: u32,
+    src_format: FrameFormat,
+    dst_width: u32,
+    dst_height: u32,
+    dst_format: FrameFormat,
+    flags: i32,
+}
+
+/// Cache of swscale contexts
+pub struct SwsCache {
+    contexts: HashMap<SwsKey, SwsContext>,
+}
+
+impl SwsCache {
+    pub fn new() -> Self {
+        // Initialize FFmpeg once
+        let _ = ffmpeg::init();
+        Self {
+            contexts: HashMap::new(),
+        }
+    }
+
+    /// Number of cached contexts
+    pub fn len(&self) -> usize {
+        self.contexts.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.contexts.is_empty()
+    }
+
+    /// Scale/convert `input` laid out as `src` into `output` laid out as `dst`
+    pub fn run(
+        &mut self,
+        input: &[u8],
+        src: PoolKey,
+        output: &mut [u8],
+        dst: PoolKey,
+        flags: SwsFlags,
+    ) -> Result<()> {
+        let scaling = (src.width, src.height) != (dst.width, dst.height);
+        let err = |msg: String| {
+            if scaling {
+                Error::Scaling(msg)
+            } else {
+                Error::ColorspaceConversion(msg)
+            }
+        };
+
+        if input.len() < src.size() {
+            return Err(err(format!(
+                "Input buffer too small: {} < {} ({}x{} {:?})",
+                input.len(),
+                src.size(),
+                src.width,
+                src.height,
+                src.format
+            )));
+        }
+        if output.len() < dst.size() {
+            return Err(err(format!(
+                "Output buffer too small: {} < {} ({}x{} {:?})",
+                output.len(),
+                dst.size(),
+                dst.width,
+                dst.height,
+                dst.format
+            )));
+        }
+
+        let context = self.context(src, dst, flags).map_err(err)?;
+        // swscale only reads through the source pointers
+        let (src_data, src_stride) = planes(input.as_ptr() as *mut u8, src);
+        let (dst_data, dst_stride) = planes(output.as_mut_ptr(), dst);
+
+        let ret = unsafe {
+            ffi::sws_scale(
+                context.as_mut_ptr(),
+                src_data.as_ptr() as *const *const u8,
+                src_stride.as_ptr(),
+                0,
+                src.height as i32,
+                dst_data.as_ptr(),
+                dst_stride.as_ptr(),
+            )
+        };
+        if ret < 0 {
+            return Err(err(format!(
+                "sws_scale failed: {}",
+                ffmpeg::Error::from(ret)
+            )));
+        }
+
+        Ok(())
+    }
+
+    fn context(
+        &mut self,
+        src: PoolKey,
+        dst: PoolKey,
+        flags: SwsFlags,
+    ) -> std::result::Result<&mut SwsContext, String> {
+        let key = SwsKey {
+            src_width: src.width,
+            src_height: src.height,
+            src_format: src.format,
+            dst_width: dst.width,
+            dst_height: dst.height,
+            dst_format: dst.format,
+            flags: flags.bits(),
+        };
+
+        if !self.contexts.contains_key(&key) {
+            if self.contexts.len() >= MAX_CONTEXTS {
+                self.contexts.clear();
+            }
+
+            let mut context = SwsContext::get(
+                format_to_pixel(src.format),
+                src.width,
+                src.height,
+                format_to_pixel(dst.format),
+                dst.width,
+                dst.height,
+                flags,
+            )
+            .map_err(|e| format!("Failed to create scaler: {}", e))?;
+            set_colorspace(&mut context, src.format, dst.format);
+
+            tracing::debug!(
+                "Created swscale context {}x{} {:?} -> {}x{} {:?}",
+                src.width,
+                src.height,
+                src.format,
+                dst.width,
+                dst.height,
+                dst.format
+            );
+            self.contexts.insert(key, context);
+        }
+
+        Ok(self
+            .contexts
+            .get_mut(&key)
+            .expect("context was just inserted"))
+    }
+}
+
+impl Default for SwsCache {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Plane pointers and strides of a buffer laid out as `layout`
+fn planes(base: *mut u8, layout: PoolKey) -> ([*mut u8; 4], [i32; 4]) {
+    let mut data = [std::ptr::null_mut(); 4];
+    let mut strides = [0; 4];
+    let planes = layout.format.plane_layout(layout.height, layout.stride);
+    for (i, &(offset, stride)) in planes.iter().take(layout.format.plane_count()).enumerate() {
+        data[i] = base.wrapping_add(offset);
+        strides[i] = stride as i32;
+    }
+    (data, strides)
+}
+
+/// Use the kernels' matrices and limited range (swscale defaults to BT.601)
+fn set_colorspace(context: &mut SwsContext, src: FrameFormat, dst: FrameFormat) {
+    let (src_cs, dst_cs) = (sws_colorspace(src), sws_colorspace(dst));
+    if src_cs.is_none() && dst_cs.is_none() {
+        return;
+    }
+
+    let default = ffi::SWS_CS_DEFAULT as i32;
+    unsafe {
+        ffi::sws_setColorspaceDetails(
+            context.as_mut_ptr(),
+            ffi::sws_getCoefficients(src_cs.unwrap_or(default)),
+            src_cs.is_none() as i32,
+            ffi::sws_getCoefficients(dst_cs.unwrap_or(default)),
+            dst_cs.is_none() as i32,
+            0,
+            1 << 16,
+            1 << 16,
+        );
+    }
+}
+
+/// New pooled frame laid out as `layout`, with `src`'s timing
+pub(super) fn output_frame(src: &Frame, layout: PoolKey) -> Frame {
+    let mut out = Frame::from_pool(
+        FramePool::global(),
+        layout.width,
+        layout.height,
+        layout.stride,
+        layout.format,
+    );
+    out.pts = src.pts;
+    out.duration = src.duration;
+    out.is_keyframe = src.is_keyframe;
+    out.damage = src.damage.as_ref().map(|damage| {
+        damage
+            .iter()
+            .map(|rect| rect.scale(src.resolution(), out.resolution()))
+            .collect()
+    });
+    out
+}
+
+thread_local! {
+    static THREAD_CACHE: RefCell<SwsCache> = RefCell::new(SwsCache::new());
+}
+
+/// Run `f` with this thread's cache (backs the free conversion functions)
+pub(super) fn with_thread_cache<R>(f: impl FnOnce(&mut SwsCache) -> R) -> R {
+    THREAD_CACHE.with(|cache| f(&mut cache.borrow_mut()))
+}
@@ -0,0 +1,243 @@
+//! SDR -> HDR transfer mapping
+//!
+//! Captured desktops are SDR (sRGB, BT.709 primaries). For HDR10/HLG output
+//! each pixel is linearised, moved to BT.2020 primaries with SDR white at the
+//! BT.2408 reference level, re-encoded with PQ or HLG and written as P010 in
+//! the same pass. Work is done two rows at a time so the intermediate signal
+//! stays in cache.
+
+use super::hdr::{hlg_inverse_oetf, hlg_oetf, linear_to_pq, TransferFunction};
+use super::kernels::{check_plane, PlaneMut, PlaneRef};
+use crate::error::{Error, Result};
+use crate::types::FrameFormat;
+
+/// Luminance of SDR white in HDR output (ITU-R BT.2408)
+pub const SDR_WHITE_NITS: f32 = 203.0;
+
+/// HLG signal level of SDR white (ITU-R BT.2408)
+const HLG_SDR_WHITE: f32 = 0.75;
+
+/// Intervals in the linear -> signal table
+///
+/// PQ and HLG are steep near black, so the table is spaced evenly in the
+/// fourth root of linear light rather than in linear light itself; that
+/// keeps interpolation well under a 10-bit code everywhere.
+const OETF_STEPS: usize = 1024;
+
+/// BT.709 -> BT.2020 primaries in linear light (ITU-R BT.2087)
+const BT709_TO_BT2020: [[f32; 3]; 3] = [
+    [0.6274, 0.3293, 0.0433],
+    [0.0691, 0.9195, 0.0114],
+    [0.0164, 0.0880, 0.8956],
+];
+
+/// BT.2020 NCL luma weights
+const KR: f32 = 0.2627;
+const KB: f32 = 0.0593;
+
+/// SDR BGRA/RGBA -> PQ/HLG P010 converter
+pub struct SdrToHdr {
+    transfer: TransferFunction,
+    /// sRGB code value -> linear light (SDR white = 1.0)
+    eotf: [f32; 256],
+    /// Fourth root of linear light (SDR white = 1.0) -> HDR signal,
+    /// `OETF_STEPS + 1` samples
+    oetf: Vec<f32>,
+    /// R'G'B' signal of the row pair being converted
+    rows: Vec<[f32; 3]>,
+}
+
+impl SdrToHdr {
+    /// Converter for `transfer`, or `None` for SDR output
+    pub fn new(transfer: TransferFunction) -> Option<Self> {
+        if transfer == TransferFunction::Sdr {
+            return None;
+        }
+        let hlg_white = hlg_inverse_oetf(HLG_SDR_WHITE);
+        let signal = |linear: f32| match transfer {
+            TransferFunction::Pq => linear_to_pq(linear * SDR_WHITE_NITS),
+            _ => hlg_oetf(linear * hlg_white),
+        };
+
+        Some(Self {
+            transfer,
+            eotf: std::array::from_fn(|i| srgb_to_linear(i as f32 / 255.0)),
+            oetf: (0..=OETF_STEPS)
+                .map(|i| signal((i as f32 / OETF_STEPS as f32).powi(4)))
+                .collect(),
+            rows: Vec::new(),
+        })
+    }
+
+    pub fn transfer(&self) -> TransferFunction {
+        self.transfer
+    }
+
+    /// Convert packed BGRA/RGBA to P010 carrying the HDR signal
+    pub fn rgb_to_p010(
+        &mut self,
+        src: PlaneRef,
+        mut y: PlaneMut,
+        mut uv: PlaneMut,
+        width: usize,
+        height: usize,
+        src_format: FrameFormat,
+    ) -> Result<()> {
+        let order = match src_format {
+            FrameFormat::Bgra => [2, 1, 0],
+            FrameFormat::Rgba => [0, 1, 2],
+            other => {
+                return Err(Error::ColorspaceConversion(format!(
+                    "Unsupported SDR source format: {:?}",
+                    other
+                )))
+            }
+        };
+
+        let uv_rows = height.div_ceil(2);
+        let uv_row = width.div_ceil(2) * 4;
+        check_plane(src.data.len(), src.stride, width * 4, height, "Source")?;
+        check_plane(y.data.len(), y.stride, width * 2, height, "Y")?;
+        check_plane(uv.data.len(), uv.stride, uv_row, uv_rows, "UV")?;
+
+        let Self {
+            eotf, oetf, rows, ..
+        } = self;
+        rows.resize(width * 2, [0.0; 3]);
+        let (top_signal, bottom_signal) = rows.split_at_mut(width);
+
+        for row in 0..uv_rows {
+            let top = 2 * row;
+            let bottom = (top + 1).min(height - 1);
+
+            for (line, signal) in [(top, &mut *top_signal), (bottom, &mut *bottom_signal)] {
+                let pixels = src.row(line, width * 4);
+                for (out, px) in signal.iter_mut().zip(pixels.chunks_exact(4)) {
+                    let linear = order.map(|i| eotf[px[i] as usize]);
+                    *out = BT709_TO_BT2020.map(|m| {
+                        sample(oetf, m[0] * linear[0] + m[1] * linear[1] + m[2] * linear[2])
+                    });
+                }
+
+                let luma = y.row(line, width * 2);
+                for (out, rgb) in luma.chunks_exact_mut(2).zip(signal.iter()) {
+                    out.copy_from_slice(&p010_sample(64.0 + 876.0 * luma_of(rgb)));
+                }
+            }
+
+            // Chroma from the mean signal of each 2x2 block
+            let chroma = uv.row(row, uv_row);
+            for (i, out) in chroma.chunks_exact_mut(4).enumerate() {
+                let a = 2 * i;
+                let b = (a + 1).min(width - 1);
+                let mut rgb = [0.0f32; 3];
+                for px in [
+                    top_signal[a],
+                    top_signal[b],
+                    bottom_signal[a],
+                    bottom_signal[b],
+                ] {
+                    for (sum, c) in rgb.iter_mut().zip(px) {
+                        *sum += c * 0.25;
+                    }
+                }
+                let luma = luma_of(&rgb);
+                let cb = (rgb[2] - luma) / (2.0 * (1.0 - KB));
+                let cr = (rgb[0] - luma) / (2.0 * (1.0 - KR));
+                out[..2].copy_from_slice(&p010_sample(512.0 + 896.0 * cb));
+                out[2..].copy_from_slice(&p010_sample(512.0 + 896.0 * cr));
+            }
+        }
+
+        Ok(())
+    }
+}
+
+impl std::fmt::Debug for SdrToHdr {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("SdrToHdr")
+            .field("transfer", &self.transfer)
+            .finish()
+    }
+}
+
+/// sRGB EOTF
+fn srgb_to_linear(v: f32) -> f32 {
+    if v <= 0.04045 {
+        v / 12.92
+    } else {
+        ((v + 0.055) / 1.055).powf(2.4)
+    }
+}
+
+/// Interpolated table lookup for linear light in 0..=1
+#[inline(always)]
+fn sample(table: &[f32], linear: f32) -> f32 {
+    let pos = linear.clamp(0.0, 1.0).sqrt().sqrt() * OETF_STEPS as f32;
+    let i = (pos as usize).min(OETF_STEPS - 1);
+    let frac = pos - i as f32;
+    table[i] + (table[i + 1] - table[i]) * frac
+}
+
+#[inline(always)]
+fn luma_of(rgb: &[f32; 3]) -> f32 {
+    KR * rgb[0] + (1.0 - KR - KB) * rgb[1] + KB * rgb[2]
+}
+
+/// 10-bit code value -> little-endian P010 sample
+#[inline(always)]
+fn p010_sample(code: f32) -> [u8; 2] {
+    (((code.round() as i32).clamp(0, 1023) as u16) << 6).to_le_bytes()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_sdr_white_levels() {
+        let src = [255u8; 2 * 2 * 4];
+        let mut y = [0u8; 8];
+        let mut uv = [0u8; 4];
+        let mut pq = SdrToHdr::new(TransferFunction::Pq).unwrap();
+        pq.rgb_to_p010(
+            PlaneRef::new(&src, 8),
+            PlaneMut::new(&mut y, 4),
+            PlaneMut::new(&mut uv, 4),
+            2,
+            2,
+            FrameFormat::Bgra,
+        )
+        .unwrap();
+
+        let sample = |b: &[u8], i: usize| u16::from_le_bytes([b[2 * i], b[2 * i + 1]]) >> 6;
+        // 203 nits is PQ ~0.58
+        let expected = (64.0 + 876.0 * linear_to_pq(SDR_WHITE_NITS)).round() as u16;
+        assert_eq!(sample(&y, 0), expected);
+        assert_eq!(sample(&y, 3), expected);
+        assert!(sample(&uv, 0).abs_diff(512) <= 1);
+        assert!(sample(&uv, 1).abs_diff(512) <= 1);
+
+        assert!(SdrToHdr::new(TransferFunction::Sdr).is_none());
+    }
+
+    #[test]
+    fn test_oetf_table_accuracy() {
+        let hlg_white = hlg_inverse_oetf(HLG_SDR_WHITE);
+        for transfer in [TransferFunction::Pq, TransferFunction::Hlg] {
+            let converter = SdrToHdr::new(transfer).unwrap();
+            let exact = |linear: f32| match transfer {
+                TransferFunction::Pq => linear_to_pq(linear * SDR_WHITE_NITS),
+                _ => hlg_oetf(linear * hlg_white),
+            };
+
+            // Dense near black, where a linearly spaced table was off by
+            // several codes
+            let worst = (1..=20_000)
+                .map(|i| (i as f32 / 20_000.0).powi(3))
+                .map(|linear| (sample(&converter.oetf, linear) - exact(linear)).abs() * 876.0)
+                .fold(0.0f32, f32::max);
+            assert!(worst < 0.05, "{:?}: {} codes off", transfer, worst);
+        }
+    }
+}
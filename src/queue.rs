@@ -0,0 +1,248 @@
+//! Bounded frame queue with a backpressure policy
+//!
+//! Carries frames from capture to the encoder. Every item is stamped when
+//! it is pushed so the consumer can see (and bound) queueing latency.
+//! Nothing here blocks: under [`BackpressurePolicy::Block`] a full queue
+//! hands the frame back so the producer decides how to wait, which keeps
+//! async loops servicing their other work.
+
+use crate::config::{BackpressurePolicy, QueueConfig};
+
+use crossbeam_channel::{Receiver, RecvTimeoutError, Sender, TryRecvError, TrySendError};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// Result of [`QueueSender::push`]
+#[derive(Debug)]
+pub enum Push<T> {
+    /// Queued, after evicting `dropped` older items
+    Queued { dropped: usize },
+    /// Queue full; the new item was discarded (DropNewest)
+    Dropped,
+    /// Queue full; the item is handed back (Block)
+    Full(T),
+    /// The receiver is gone
+    Disconnected,
+}
+
+impl<T> Push<T> {
+    /// Items lost by this push
+    pub fn dropped(&self) -> usize {
+        match self {
+            Push::Queued { dropped } => *dropped,
+            Push::Dropped => 1,
+            Push::Full(_) | Push::Disconnected => 0,
+        }
+    }
+}
+
+/// Item taken from the queue
+#[derive(Debug)]
+pub struct Received<T> {
+    pub item: T,
+    /// When the item was pushed
+    pub queued_at: Instant,
+    /// Older items skipped for exceeding the latency budget
+    pub stale: usize,
+}
+
+/// Create a queue
+pub fn frame_queue<T>(config: QueueConfig) -> (QueueSender<T>, QueueReceiver<T>) {
+    let capacity = match config.policy {
+        BackpressurePolicy::KeepLatest => 1,
+        _ => config.capacity.max(1),
+    };
+    let (tx, rx) = crossbeam_channel::bounded(capacity);
+    let closed = Arc::new(AtomicBool::new(false));
+
+    let sender = QueueSender {
+        tx,
+        // Lets the producer evict from the head
+        evict: rx.clone(),
+        policy: config.policy,
+        closed: closed.clone(),
+    };
+    let receiver = QueueReceiver {
+        rx,
+        budget: config
+            .latency_budget_ms
+            .map(|ms| Duration::from_millis(ms as u64)),
+        closed,
+    };
+    (sender, receiver)
+}
+
+/// Producer half
+#[derive(Debug)]
+pub struct QueueSender<T> {
+    tx: Sender<(T, Instant)>,
+    evict: Receiver<(T, Instant)>,
+    policy: BackpressurePolicy,
+    closed: Arc<AtomicBool>,
+}
+
+impl<T> QueueSender<T> {
+    /// Queue `item` according to the policy (never blocks)
+    pub fn push(&self, item: T) -> Push<T> {
+        self.push_at(item, Instant::now())
+    }
+
+    /// Queue `item` stamped `queued_at` instead of now (for stages that
+    /// forward an item and keep its original stamp)
+    pub fn push_at(&self, item: T, queued_at: Instant) -> Push<T> {
+        if self.closed.load(Ordering::Acquire) {
+            return Push::Disconnected;
+        }
+
+        let mut entry = (item, queued_at);
+        let mut dropped = 0;
+        loop {
+            match self.tx.try_send(entry) {
+                Ok(()) => return Push::Queued { dropped },
+                Err(TrySendError::Disconnected(_)) => return Push::Disconnected,
+                Err(TrySendError::Full(back)) => match self.policy {
+                    BackpressurePolicy::Block => return Push::Full(back.0),
+                    BackpressurePolicy::DropNewest => return Push::Dropped,
+                    BackpressurePolicy::DropOldest | BackpressurePolicy::KeepLatest => {
+                        // The consumer may win the race; either way there is
+                        // room on the next attempt
+                        if self.evict.try_recv().is_ok() {
+                            dropped += 1;
+                        }
+                        entry = back;
+                    }
+                },
+            }
+        }
+    }
+
+    /// Items currently queued
+    pub fn len(&self) -> usize {
+        self.tx.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.tx.is_empty()
+    }
+
+    pub fn policy(&self) -> BackpressurePolicy {
+        self.policy
+    }
+}
+
+/// Consumer half
+#[derive(Debug)]
+pub struct QueueReceiver<T> {
+    rx: Receiver<(T, Instant)>,
+    budget: Option<Duration>,
+    closed: Arc<AtomicBool>,
+}
+
+impl<T> QueueReceiver<T> {
+    /// Wait for the next item
+    ///
+    /// Items older than the latency budget are skipped while a newer one is
+    /// queued; the newest item is always delivered, however old.
+    pub fn recv_timeout(&self, timeout: Duration) -> Result<Received<T>, RecvTimeoutError> {
+        let (item, queued_at) = self.rx.recv_timeout(timeout)?;
+        Ok(self.skip_stale(item, queued_at))
+    }
+
+    /// Take the next item if one is queued
+    pub fn try_recv(&self) -> Result<Received<T>, TryRecvError> {
+        let (item, queued_at) = self.rx.try_recv()?;
+        Ok(self.skip_stale(item, queued_at))
+    }
+
+    fn skip_stale(&self, mut item: T, mut queued_at: Instant) -> Received<T> {
+        let mut stale = 0;
+        if let Some(budget) = self.budget {
+            while queued_at.elapsed() > budget {
+                match self.rx.try_recv() {
+                    Ok(next) => {
+                        (item, queued_at) = next;
+                        stale += 1;
+                    }
+                    Err(_) => break,
+                }
+            }
+        }
+        Received {
+            item,
+            queued_at,
+            stale,
+        }
+    }
+
+    /// Items currently queued
+    pub fn len(&self) -> usize {
+        self.rx.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.rx.is_empty()
+    }
+}
+
+impl<T> Drop for QueueReceiver<T> {
+    fn drop(&mut self) {
+        self.closed.store(true, Ordering::Release);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn queue(policy: BackpressurePolicy) -> (QueueSender<u32>, QueueReceiver<u32>) {
+        frame_queue(QueueConfig::default().with_capacity(2).with_policy(policy))
+    }
+
+    fn drain(rx: &QueueReceiver<u32>) -> Vec<u32> {
+        std::iter::from_fn(|| rx.try_recv().ok().map(|r| r.item)).collect()
+    }
+
+    #[test]
+    fn test_policies() {
+        let (tx, rx) = queue(BackpressurePolicy::DropOldest);
+        let dropped: usize = (0..5).map(|i| tx.push(i).dropped()).sum();
+        assert_eq!(dropped, 3);
+        assert_eq!(drain(&rx), [3, 4]);
+
+        let (tx, rx) = queue(BackpressurePolicy::DropNewest);
+        assert!(matches!(tx.push(0), Push::Queued { dropped: 0 }));
+        tx.push(1);
+        assert!(matches!(tx.push(2), Push::Dropped));
+        assert_eq!(drain(&rx), [0, 1]);
+
+        let (tx, rx) = queue(BackpressurePolicy::Block);
+        tx.push(0);
+        tx.push(1);
+        assert!(matches!(tx.push(2), Push::Full(2)));
+        assert_eq!(drain(&rx), [0, 1]);
+
+        let (tx, rx) = queue(BackpressurePolicy::KeepLatest);
+        for i in 0..3 {
+            tx.push(i);
+        }
+        assert_eq!(drain(&rx), [2]);
+
+        drop(rx);
+        assert!(matches!(tx.push(3), Push::Disconnected));
+    }
+
+    #[test]
+    fn test_latency_budget() {
+        let config = QueueConfig::default().with_latency_budget(5);
+        let (tx, rx) = frame_queue::<u32>(config);
+        tx.push(0);
+        tx.push(1);
+        std::thread::sleep(Duration::from_millis(10));
+        tx.push(2);
+
+        let received = rx.try_recv().unwrap();
+        assert_eq!(received.item, 2);
+        assert_eq!(received.stale, 2);
+    }
+}
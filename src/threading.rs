@@ -0,0 +1,698 @@
+//! Thread placement and real-time scheduling
+//!
+//! Every pipeline thread has a [`ThreadRole`] and calls [`enter`] as it
+//! starts. Once a [`ThreadingConfig`] is installed with [`configure`], that
+//! pins the thread to its role's cores and, for capture and audio loops,
+//! asks for SCHED_FIFO (through rtkit when the process may not set it
+//! itself). Threads inherit the affinity of the thread that starts them,
+//! so x264/x265/SVT-AV1 workers stay on the encoder's cores.
+//!
+//! The automatic layout keeps encoders on the L3 domains of performance
+//! cores (CCDs on Zen, the one with the most cache first) and moves
+//! capture, audio and I/O off them: onto one CCD of the encoders' NUMA
+//! node when there are several, otherwise onto E-cores or one reserved
+//! core.
+
+use crate::config::ThreadingConfig;
+use crate::error::{Error, Result};
+
+use parking_lot::RwLock;
+use serde::{Deserialize, Serialize};
+
+use std::path::Path;
+use std::sync::OnceLock;
+
+/// Physical cores needed before one is set aside for capture and I/O
+const MIN_CORES_TO_RESERVE: usize = 4;
+
+/// rtkit's default limits: highest priority it grants, and the
+/// RLIMIT_RTTIME it requires (µs of CPU a realtime thread may use
+/// without blocking)
+const RTKIT_MAX_PRIORITY: u8 = 20;
+const RTKIT_RTTIME_US: libc::rlim_t = 200_000;
+
+/// What a thread does, which decides where it runs
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum ThreadRole {
+    /// PipeWire video capture loops
+    Capture,
+    /// Audio capture and encoding
+    Audio,
+    /// Frame work off the encoder threads (async runtime workers, ladder
+    /// scaling)
+    Process,
+    /// Video encoder threads (which also convert their frames)
+    Encode,
+    /// Network, disk and virtual camera writers
+    Io,
+}
+
+impl ThreadRole {
+    pub const ALL: [ThreadRole; 5] = [
+        ThreadRole::Capture,
+        ThreadRole::Audio,
+        ThreadRole::Process,
+        ThreadRole::Encode,
+        ThreadRole::Io,
+    ];
+
+    /// Loops that miss frames or samples when preempted
+    pub fn is_realtime(&self) -> bool {
+        matches!(self, ThreadRole::Capture | ThreadRole::Audio)
+    }
+
+    pub fn name(&self) -> &'static str {
+        match self {
+            ThreadRole::Capture => "capture",
+            ThreadRole::Audio => "audio",
+            ThreadRole::Process => "process",
+            ThreadRole::Encode => "encode",
+            ThreadRole::Io => "io",
+        }
+    }
+}
+
+/// Set of logical CPUs, written as the kernel writes CPU lists
+/// ("0-7,16-23")
+#[derive(Debug, Clone, Default, PartialEq, Eq, Hash, Serialize, Deserialize)]
+#[serde(try_from = "String", into = "String")]
+pub struct CpuSet(Vec<usize>);
+
+impl CpuSet {
+    pub fn new(cpus: impl IntoIterator<Item = usize>) -> Self {
+        let mut cpus: Vec<usize> = cpus.into_iter().collect();
+        cpus.sort_unstable();
+        cpus.dedup();
+        Self(cpus)
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.0.is_empty()
+    }
+
+    pub fn contains(&self, cpu: usize) -> bool {
+        self.0.binary_search(&cpu).is_ok()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        self.0.iter().copied()
+    }
+
+    pub fn union(&self, other: &CpuSet) -> CpuSet {
+        CpuSet::new(self.iter().chain(other.iter()))
+    }
+
+    pub fn difference(&self, other: &CpuSet) -> CpuSet {
+        CpuSet::new(self.iter().filter(|&cpu| !other.contains(cpu)))
+    }
+}
+
+impl std::str::FromStr for CpuSet {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        let invalid = || Error::Config(format!("Invalid CPU list: {:?}", s));
+        let mut cpus = Vec::new();
+        for part in s.split(',').map(str::trim).filter(|p| !p.is_empty()) {
+            let (first, last) = match part.split_once('-') {
+                Some((a, b)) => (a.trim(), b.trim()),
+                None => (part, part),
+            };
+            let first: usize = first.parse().map_err(|_| invalid())?;
+            let last: usize = last.parse().map_err(|_| invalid())?;
+            if first > last {
+                return Err(invalid());
+            }
+            cpus.extend(first..=last);
+        }
+        Ok(CpuSet::new(cpus))
+    }
+}
+
+impl std::fmt::Display for CpuSet {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let mut cpus = self.iter().peekable();
+        let mut first = true;
+        while let Some(start) = cpus.next() {
+            let mut end = start;
+            while cpus.peek() == Some(&(end + 1)) {
+                end = cpus.next().expect("peeked");
+            }
+            if !first {
+                f.write_str(",")?;
+            }
+            first = false;
+            if end == start {
+                write!(f, "{}", start)?;
+            } else {
+                write!(f, "{}-{}", start, end)?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl TryFrom<String> for CpuSet {
+    type Error = Error;
+
+    fn try_from(s: String) -> Result<Self> {
+        s.parse()
+    }
+}
+
+impl From<CpuSet> for String {
+    fn from(cpus: CpuSet) -> Self {
+        cpus.to_string()
+    }
+}
+
+/// One logical CPU
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Cpu {
+    pub id: usize,
+    /// Physical core (package, core id); SMT siblings share it
+    pub core: (usize, usize),
+    /// Lowest CPU sharing this CPU's L3
+    pub l3: usize,
+    /// Size of that L3 in bytes (0 = unknown)
+    pub l3_bytes: u64,
+    pub node: usize,
+    /// E-core (Intel hybrid) or little core
+    pub efficient: bool,
+}
+
+/// Logical CPUs of this host and how they share cores, caches and memory
+#[derive(Debug, Clone, Default)]
+pub struct CpuTopology {
+    cpus: Vec<Cpu>,
+}
+
+impl CpuTopology {
+    pub fn from_cpus(mut cpus: Vec<Cpu>) -> Self {
+        cpus.sort_by_key(|cpu| cpu.id);
+        Self { cpus }
+    }
+
+    /// Topology of this host (read once)
+    pub fn global() -> &'static CpuTopology {
+        static GLOBAL: OnceLock<CpuTopology> = OnceLock::new();
+        GLOBAL.get_or_init(|| CpuTopology::from_sysfs(Path::new("/sys/devices")))
+    }
+
+    /// Read the topology below `root` (normally /sys/devices)
+    fn from_sysfs(root: &Path) -> Self {
+        let read = |path: &Path| std::fs::read_to_string(path).ok();
+        let list = |path: &Path| read(path).and_then(|s| s.trim().parse::<CpuSet>().ok());
+
+        let online = list(&root.join("system/cpu/online")).unwrap_or_else(|| {
+            let count = std::thread::available_parallelism().map_or(1, |n| n.get());
+            CpuSet::new(0..count)
+        });
+
+        // Intel hybrid parts list their E-cores under a separate PMU
+        let atoms = list(&root.join("cpu_atom/cpus")).unwrap_or_default();
+
+        let mut nodes = Vec::new();
+        if let Ok(entries) = std::fs::read_dir(root.join("system/node")) {
+            for entry in entries.flatten() {
+                let name = entry.file_name().to_string_lossy().into_owned();
+                if let Some(node) = name.strip_prefix("node").and_then(|n| n.parse().ok()) {
+                    if let Some(cpus) = list(&entry.path().join("cpulist")) {
+                        nodes.push((node, cpus));
+                    }
+                }
+            }
+        }
+
+        let number = |path: &Path| read(path).and_then(|s| s.trim().parse::<usize>().ok());
+        let mut capacities = Vec::new();
+        let mut cpus: Vec<Cpu> = online
+            .iter()
+            .map(|id| {
+                let dir = root.join(format!("system/cpu/cpu{}", id));
+                let package = number(&dir.join("topology/physical_package_id")).unwrap_or(0);
+                let core = number(&dir.join("topology/core_id")).unwrap_or(id);
+                let (l3, l3_bytes) = l3_cache(&dir).unwrap_or((0, 0));
+                let node = nodes
+                    .iter()
+                    .find(|(_, cpus)| cpus.contains(id))
+                    .map_or(0, |(node, _)| *node);
+                capacities.push(number(&dir.join("cpu_capacity")));
+                Cpu {
+                    id,
+                    core: (package, core),
+                    l3,
+                    l3_bytes,
+                    node,
+                    efficient: atoms.contains(id),
+                }
+            })
+            .collect();
+
+        // Little cores on big.LITTLE report a lower capacity
+        let max_capacity = capacities.iter().flatten().max().copied();
+        for (cpu, capacity) in cpus.iter_mut().zip(capacities) {
+            if let (Some(capacity), Some(max)) = (capacity, max_capacity) {
+                cpu.efficient |= capacity < max;
+            }
+        }
+
+        Self::from_cpus(cpus)
+    }
+
+    pub fn cpus(&self) -> &[Cpu] {
+        &self.cpus
+    }
+
+    pub fn all(&self) -> CpuSet {
+        CpuSet::new(self.cpus.iter().map(|cpu| cpu.id))
+    }
+
+    /// CPUs of `set` on each NUMA node, indexed by node
+    pub fn per_node(&self, set: &CpuSet) -> Vec<usize> {
+        let nodes = self.cpus.iter().map(|cpu| cpu.node + 1).max().unwrap_or(1);
+        let mut counts = vec![0; nodes];
+        for cpu in self.cpus.iter().filter(|cpu| set.contains(cpu.id)) {
+            counts[cpu.node] += 1;
+        }
+        counts
+    }
+
+    /// Automatic layout: see the module docs
+    ///
+    /// Returns an empty layout (no pinning) on hosts too small to split.
+    pub fn layout(&self) -> ThreadLayout {
+        let performance: Vec<&Cpu> = match self.cpus.iter().any(|cpu| !cpu.efficient) {
+            true => self.cpus.iter().filter(|cpu| !cpu.efficient).collect(),
+            false => self.cpus.iter().collect(),
+        };
+        let efficient = CpuSet::new(
+            self.cpus
+                .iter()
+                .filter(|cpu| cpu.efficient && performance.iter().all(|p| p.id != cpu.id))
+                .map(|cpu| cpu.id),
+        );
+
+        // L3 domains of performance cores, most cache first
+        let mut domains: Vec<(usize, u64, usize, CpuSet)> = Vec::new();
+        for cpu in &performance {
+            match domains.iter_mut().find(|d| d.0 == cpu.l3) {
+                Some(domain) => domain.3 = domain.3.union(&CpuSet::new([cpu.id])),
+                None => domains.push((cpu.l3, cpu.l3_bytes, cpu.node, CpuSet::new([cpu.id]))),
+            }
+        }
+        domains.sort_by(|a, b| {
+            b.1.cmp(&a.1)
+                .then(b.3.len().cmp(&a.3.len()))
+                .then(a.0.cmp(&b.0))
+        });
+
+        if domains.len() >= 2 {
+            // The rest share the smallest other CCD, on the encoders'
+            // memory node when possible; encoders get every other one
+            let node = domains[0].2;
+            let side_index = (1..domains.len())
+                .rev()
+                .find(|&i| domains[i].2 == node)
+                .unwrap_or(domains.len() - 1);
+            let side = domains[side_index].3.clone();
+            let encode = domains
+                .iter()
+                .enumerate()
+                .filter(|&(i, _)| i != side_index)
+                .fold(CpuSet::default(), |set, (_, d)| set.union(&d.3));
+            let io = if efficient.is_empty() {
+                side.clone()
+            } else {
+                efficient
+            };
+            return ThreadLayout {
+                capture: Some(side.clone()),
+                audio: Some(side.clone()),
+                process: Some(side),
+                encode: Some(encode),
+                io: Some(io),
+            };
+        }
+
+        // One domain: set the last physical performance core aside for
+        // the capture and audio loops
+        let all_performance = CpuSet::new(performance.iter().map(|cpu| cpu.id));
+        let mut cores: Vec<(usize, usize)> = performance.iter().map(|cpu| cpu.core).collect();
+        cores.sort_unstable();
+        cores.dedup();
+        if cores.len() < MIN_CORES_TO_RESERVE {
+            if efficient.is_empty() {
+                return ThreadLayout::default();
+            }
+            return ThreadLayout {
+                capture: Some(all_performance.clone()),
+                audio: Some(all_performance.clone()),
+                process: Some(all_performance.clone()),
+                encode: Some(all_performance),
+                io: Some(efficient),
+            };
+        }
+
+        let reserved_core = *cores.last().expect("at least one core");
+        let reserved = CpuSet::new(
+            performance
+                .iter()
+                .filter(|cpu| cpu.core == reserved_core)
+                .map(|cpu| cpu.id),
+        );
+        let encode = all_performance.difference(&reserved);
+        let io = if efficient.is_empty() {
+            reserved.clone()
+        } else {
+            efficient
+        };
+        ThreadLayout {
+            capture: Some(reserved.clone()),
+            audio: Some(reserved),
+            process: Some(all_performance),
+            encode: Some(encode),
+            io: Some(io),
+        }
+    }
+}
+
+/// L3 of the CPU at `dir`: the lowest CPU sharing it and its size
+fn l3_cache(dir: &Path) -> Option<(usize, u64)> {
+    let entries = std::fs::read_dir(dir.join("cache")).ok()?;
+    for entry in entries.flatten() {
+        let path = entry.path();
+        let level = std::fs::read_to_string(path.join("level")).ok();
+        if level.as_deref().map(str::trim) != Some("3") {
+            continue;
+        }
+        let shared: CpuSet = std::fs::read_to_string(path.join("shared_cpu_list"))
+            .ok()?
+            .trim()
+            .parse()
+            .ok()?;
+        let size = std::fs::read_to_string(path.join("size"))
+            .ok()
+            .and_then(|s| parse_size(s.trim()))
+            .unwrap_or(0);
+        return Some((shared.iter().next()?, size));
+    }
+    None
+}
+
+/// "32768K" -> bytes
+fn parse_size(s: &str) -> Option<u64> {
+    let (digits, unit) = match s.find(|c: char| !c.is_ascii_digit()) {
+        Some(i) => s.split_at(i),
+        None => (s, ""),
+    };
+    let scale = match unit {
+        "" => 1,
+        "K" => 1 << 10,
+        "M" => 1 << 20,
+        "G" => 1 << 30,
+        _ => return None,
+    };
+    digits.parse::<u64>().ok().map(|n| n * scale)
+}
+
+/// Cores for each role (None = wherever the OS puts it)
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct ThreadLayout {
+    pub capture: Option<CpuSet>,
+    pub audio: Option<CpuSet>,
+    pub process: Option<CpuSet>,
+    pub encode: Option<CpuSet>,
+    pub io: Option<CpuSet>,
+}
+
+impl ThreadLayout {
+    /// Layout for `config`: its sets, and the automatic layout for the
+    /// rest when it pins
+    pub fn plan(topology: &CpuTopology, config: &ThreadingConfig) -> Self {
+        let auto = if config.pin {
+            topology.layout()
+        } else {
+            ThreadLayout::default()
+        };
+        let pick = |set: &Option<CpuSet>, auto: Option<CpuSet>| {
+            set.clone().filter(|s| !s.is_empty()).or(auto)
+        };
+        Self {
+            capture: pick(&config.capture, auto.capture),
+            audio: pick(&config.audio, auto.audio),
+            process: pick(&config.process, auto.process),
+            encode: pick(&config.encode, auto.encode),
+            io: pick(&config.io, auto.io),
+        }
+    }
+
+    pub fn cpus(&self, role: ThreadRole) -> Option<&CpuSet> {
+        match role {
+            ThreadRole::Capture => self.capture.as_ref(),
+            ThreadRole::Audio => self.audio.as_ref(),
+            ThreadRole::Process => self.process.as_ref(),
+            ThreadRole::Encode => self.encode.as_ref(),
+            ThreadRole::Io => self.io.as_ref(),
+        }
+    }
+}
+
+/// Installed configuration and the layout planned from it
+#[derive(Default)]
+struct Policy {
+    config: ThreadingConfig,
+    layout: ThreadLayout,
+}
+
+fn policy() -> &'static RwLock<Policy> {
+    static POLICY: OnceLock<RwLock<Policy>> = OnceLock::new();
+    POLICY.get_or_init(Default::default)
+}
+
+/// Install `config` for threads started from now on
+///
+/// Call before building pipelines (and before the async runtime, see
+/// [`runtime_builder`]); threads already running keep their placement.
+pub fn configure(config: ThreadingConfig) {
+    let layout = ThreadLayout::plan(CpuTopology::global(), &config);
+    for role in ThreadRole::ALL {
+        if let Some(cpus) = layout.cpus(role) {
+            tracing::info!("{} threads on CPUs {}", role.name(), cpus);
+        }
+    }
+    *policy().write() = Policy { config, layout };
+}
+
+/// Layout in effect
+pub fn layout() -> ThreadLayout {
+    policy().read().layout.clone()
+}
+
+/// CPUs encoder threads are pinned to, if they are
+pub fn encode_cpus() -> Option<CpuSet> {
+    policy().read().layout.encode.clone()
+}
+
+/// Place the calling thread as `role` requires
+///
+/// Never fails: a thread that can't be pinned or made realtime runs as
+/// it would have (the reason is logged).
+pub fn enter(role: ThreadRole) {
+    let (cpus, realtime) = {
+        let policy = policy().read();
+        let realtime = (policy.config.realtime && role.is_realtime())
+            .then_some(policy.config.realtime_priority);
+        (policy.layout.cpus(role).cloned(), realtime)
+    };
+
+    if let Some(cpus) = cpus {
+        if let Err(e) = set_affinity(&cpus) {
+            tracing::warn!(
+                "Could not pin {} thread to CPUs {}: {}",
+                role.name(),
+                cpus,
+                e
+            );
+        }
+    }
+    if let Some(priority) = realtime {
+        match make_realtime(priority) {
+            Ok(via) => tracing::debug!("{} thread runs SCHED_FIFO ({})", role.name(), via),
+            Err(e) => tracing::warn!("{} thread stays SCHED_OTHER: {}", role.name(), e),
+        }
+    }
+}
+
+/// Multi-threaded tokio runtime whose workers run as
+/// [`ThreadRole::Process`], one per CPU of that role when it is pinned
+pub fn runtime_builder() -> tokio::runtime::Builder {
+    let mut builder = tokio::runtime::Builder::new_multi_thread();
+    builder
+        .enable_all()
+        .on_thread_start(|| enter(ThreadRole::Process));
+    if let Some(cpus) = policy().read().layout.process.as_ref() {
+        builder.worker_threads(cpus.len().max(1));
+    }
+    builder
+}
+
+fn set_affinity(cpus: &CpuSet) -> std::io::Result<()> {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        for cpu in cpus.iter().filter(|&cpu| cpu < libc::CPU_SETSIZE as usize) {
+            libc::CPU_SET(cpu, &mut set);
+        }
+        // pid 0: the calling thread
+        if libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) != 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+/// Switch the calling thread to SCHED_FIFO at `priority`, directly when
+/// the process may (CAP_SYS_NICE or RLIMIT_RTPRIO), otherwise through
+/// rtkit. Children fall back to SCHED_OTHER on fork.
+fn make_realtime(priority: u8) -> std::result::Result<&'static str, String> {
+    let param = libc::sched_param {
+        sched_priority: priority.clamp(1, 99) as i32,
+    };
+    let policy = libc::SCHED_FIFO | libc::SCHED_RESET_ON_FORK;
+    if unsafe { libc::sched_setscheduler(0, policy, &param) } == 0 {
+        return Ok("direct");
+    }
+    let direct = std::io::Error::last_os_error();
+    rtkit_realtime(priority)
+        .map(|()| "rtkit")
+        .map_err(|e| format!("{}; rtkit: {}", direct, e))
+}
+
+/// Ask rtkit (org.freedesktop.RealtimeKit1) to make the calling thread
+/// realtime
+fn rtkit_realtime(priority: u8) -> std::result::Result<(), String> {
+    use ashpd::zbus;
+
+    // rtkit only serves processes whose realtime threads can't hog a CPU
+    unsafe {
+        let mut limit: libc::rlimit = std::mem::zeroed();
+        if libc::getrlimit(libc::RLIMIT_RTTIME, &mut limit) == 0 && limit.rlim_max > RTKIT_RTTIME_US
+        {
+            limit.rlim_cur = RTKIT_RTTIME_US;
+            limit.rlim_max = RTKIT_RTTIME_US;
+            libc::setrlimit(libc::RLIMIT_RTTIME, &limit);
+        }
+    }
+
+    let thread = unsafe { libc::syscall(libc::SYS_gettid) } as u64;
+    let priority = priority.clamp(1, RTKIT_MAX_PRIORITY) as u32;
+
+    // Called from plain threads, which have no runtime of their own
+    let runtime = tokio::runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()
+        .map_err(|e| e.to_string())?;
+    runtime.block_on(async {
+        let connection = zbus::Connection::system()
+            .await
+            .map_err(|e| e.to_string())?;
+        connection
+            .call_method(
+                Some("org.freedesktop.RealtimeKit1"),
+                "/org/freedesktop/RealtimeKit1",
+                Some("org.freedesktop.RealtimeKit1"),
+                "MakeThreadRealtime",
+                &(thread, priority),
+            )
+            .await
+            .map(|_| ())
+            .map_err(|e| e.to_string())
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// `cores` physical cores per L3 domain with two SMT threads each,
+    /// numbered like Linux does (siblings in the second half)
+    fn topology(domains: &[(usize, u64)], efficient: usize) -> CpuTopology {
+        let cores: usize = domains.iter().map(|d| d.0).sum();
+        let mut cpus = Vec::new();
+        let mut core = 0;
+        for &(count, bytes) in domains {
+            let l3 = core;
+            for _ in 0..count {
+                for thread in 0..2 {
+                    cpus.push(Cpu {
+                        id: core + thread * cores,
+                        core: (0, core),
+                        l3,
+                        l3_bytes: bytes,
+                        node: 0,
+                        efficient: false,
+                    });
+                }
+                core += 1;
+            }
+        }
+        for i in 0..efficient {
+            cpus.push(Cpu {
+                id: cores * 2 + i,
+                core: (0, cores + i),
+                l3: 0,
+                l3_bytes: domains[0].1,
+                node: 0,
+                efficient: true,
+            });
+        }
+        CpuTopology::from_cpus(cpus)
+    }
+
+    #[test]
+    fn test_cpu_list_round_trips() {
+        let set: CpuSet = "0-3, 8,10-11".parse().unwrap();
+        assert_eq!(set.iter().collect::<Vec<_>>(), vec![0, 1, 2, 3, 8, 10, 11]);
+        assert_eq!(set.to_string(), "0-3,8,10-11");
+        assert!("3-1".parse::<CpuSet>().is_err());
+    }
+
+    #[test]
+    fn test_dual_ccd_keeps_encoders_on_the_big_cache() {
+        // 7950X3D: the V-cache CCD comes second in CPU order
+        let topology = topology(&[(8, 32 << 20), (8, 96 << 20)], 0);
+        let layout = topology.layout();
+        assert_eq!(layout.encode.unwrap().to_string(), "8-15,24-31");
+        assert_eq!(layout.capture.unwrap().to_string(), "0-7,16-23");
+    }
+
+    #[test]
+    fn test_extra_ccds_go_to_the_encoders() {
+        // Four CCDs: capture and I/O take one, encoders the other three
+        let topology = topology(&[(8, 32 << 20); 4], 0);
+        let layout = topology.layout();
+        assert_eq!(layout.encode.unwrap().to_string(), "0-23,32-55");
+        assert_eq!(layout.capture.unwrap().to_string(), "24-31,56-63");
+    }
+
+    #[test]
+    fn test_hybrid_reserves_a_p_core_and_moves_io_to_e_cores() {
+        let topology = topology(&[(8, 36 << 20)], 16);
+        let layout = topology.layout();
+        assert_eq!(layout.capture.unwrap().to_string(), "7,15");
+        assert_eq!(layout.encode.unwrap().to_string(), "0-6,8-14");
+        assert_eq!(layout.io.unwrap().to_string(), "16-31");
+    }
+
+    #[test]
+    fn test_small_hosts_are_not_pinned() {
+        assert_eq!(
+            topology(&[(2, 8 << 20)], 0).layout(),
+            ThreadLayout::default()
+        );
+    }
+}
@@ -1,6 +1,10 @@
 //! Common types used throughout GhostStream
 
+use crate::capture::DmaBufFrame;
+use crate::pool::{FrameBuffer, FramePool, PoolKey};
+
 use serde::{Deserialize, Serialize};
+use std::sync::Arc;
 
 /// Video resolution
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Serialize, Deserialize)]
@@ -45,6 +49,76 @@ impl std::fmt::Display for Resolution {
     }
 }
 
+/// Rectangle in frame pixels
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
+pub struct Rect {
+    pub x: u32,
+    pub y: u32,
+    pub width: u32,
+    pub height: u32,
+}
+
+impl Rect {
+    pub const fn new(x: u32, y: u32, width: u32, height: u32) -> Self {
+        Self {
+            x,
+            y,
+            width,
+            height,
+        }
+    }
+
+    /// Whole `width`x`height` frame
+    pub const fn full(width: u32, height: u32) -> Self {
+        Self::new(0, 0, width, height)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.width == 0 || self.height == 0
+    }
+
+    pub fn area(&self) -> u64 {
+        self.width as u64 * self.height as u64
+    }
+
+    /// Part of this rectangle inside a `width`x`height` frame
+    pub fn clamp(&self, width: u32, height: u32) -> Self {
+        let x = self.x.min(width);
+        let y = self.y.min(height);
+        Self::new(x, y, self.width.min(width - x), self.height.min(height - y))
+    }
+
+    /// Smallest rectangle covering both
+    pub fn union(&self, other: &Self) -> Self {
+        if self.is_empty() {
+            return *other;
+        }
+        if other.is_empty() {
+            return *self;
+        }
+        let x = self.x.min(other.x);
+        let y = self.y.min(other.y);
+        let right = (self.x + self.width).max(other.x + other.width);
+        let bottom = (self.y + self.height).max(other.y + other.height);
+        Self::new(x, y, right - x, bottom - y)
+    }
+
+    /// Map from a `from`-sized frame onto a `to`-sized one, rounding
+    /// outwards so the result still covers the same pixels
+    pub fn scale(&self, from: Resolution, to: Resolution) -> Self {
+        if from == to || from.width == 0 || from.height == 0 {
+            return *self;
+        }
+        let floor = |v: u32, to: u32, from: u32| (v as u64 * to as u64 / from as u64) as u32;
+        let ceil = |v: u32, to: u32, from: u32| (v as u64 * to as u64).div_ceil(from as u64) as u32;
+        let x = floor(self.x, to.width, from.width);
+        let y = floor(self.y, to.height, from.height);
+        let right = ceil(self.x + self.width, to.width, from.width);
+        let bottom = ceil(self.y + self.height, to.height, from.height);
+        Self::new(x, y, right - x, bottom - y).clamp(to.width, to.height)
+    }
+}
+
 /// Frame format / pixel format
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Serialize, Deserialize)]
 pub enum FrameFormat {
@@ -76,6 +150,80 @@ impl FrameFormat {
         }
     }
 
+    /// Default (tightly packed) stride in bytes of the first plane
+    ///
+    /// NV12/P010 round odd widths up so the interleaved UV row fits.
+    pub fn default_stride(&self, width: u32) -> u32 {
+        match self {
+            FrameFormat::Yuv420p | FrameFormat::Yuv444p => width,
+            FrameFormat::Nv12 => width.next_multiple_of(2),
+            FrameFormat::Bgra | FrameFormat::Rgba => width * 4,
+            FrameFormat::Rgb24 => width * 3,
+            FrameFormat::P010 => width.next_multiple_of(2) * 2,
+        }
+    }
+
+    /// Buffer size in bytes for a frame with the given first-plane stride
+    ///
+    /// Chroma planes are assumed to follow the luma plane contiguously,
+    /// with the stride implied by the format (same as luma for NV12/P010,
+    /// half for YUV420P).
+    pub fn buffer_size(&self, width: u32, height: u32, stride: u32) -> usize {
+        let _ = width;
+        let stride = stride as usize;
+        let height = height as usize;
+        let chroma_height = (height + 1) / 2;
+        match self {
+            FrameFormat::Nv12 | FrameFormat::P010 => stride * height + stride * chroma_height,
+            FrameFormat::Yuv420p => stride * height + 2 * ((stride + 1) / 2) * chroma_height,
+            FrameFormat::Yuv444p => stride * height * 3,
+            FrameFormat::Bgra | FrameFormat::Rgba | FrameFormat::Rgb24 => stride * height,
+        }
+    }
+
+    /// Number of planes in a frame buffer of this format
+    pub fn plane_count(&self) -> usize {
+        match self {
+            FrameFormat::Nv12 | FrameFormat::P010 => 2,
+            FrameFormat::Yuv420p | FrameFormat::Yuv444p => 3,
+            FrameFormat::Bgra | FrameFormat::Rgba | FrameFormat::Rgb24 => 1,
+        }
+    }
+
+    /// `(offset, stride)` in bytes of each plane, matching [`Self::buffer_size`]
+    ///
+    /// Entries past [`Self::plane_count`] are `(0, 0)`.
+    pub fn plane_layout(&self, height: u32, stride: u32) -> [(usize, usize); 3] {
+        let stride = stride as usize;
+        let luma = stride * height as usize;
+        match self {
+            FrameFormat::Nv12 | FrameFormat::P010 => [(0, stride), (luma, stride), (0, 0)],
+            FrameFormat::Yuv420p => {
+                let chroma_stride = (stride + 1) / 2;
+                let chroma = chroma_stride * ((height as usize + 1) / 2);
+                [
+                    (0, stride),
+                    (luma, chroma_stride),
+                    (luma + chroma, chroma_stride),
+                ]
+            }
+            FrameFormat::Yuv444p => [(0, stride), (luma, stride), (luma * 2, stride)],
+            FrameFormat::Bgra | FrameFormat::Rgba | FrameFormat::Rgb24 => {
+                [(0, stride), (0, 0), (0, 0)]
+            }
+        }
+    }
+
+    /// Number of rows in `plane` for a frame of `height` lines
+    pub fn plane_height(&self, plane: usize, height: u32) -> u32 {
+        match self {
+            FrameFormat::Nv12 | FrameFormat::P010 | FrameFormat::Yuv420p if plane > 0 => {
+                (height + 1) / 2
+            }
+            _ => height,
+        }
+    }
+
     /// Is this a hardware-friendly format for NVENC?
     pub fn is_nvenc_native(&self) -> bool {
         matches!(self, FrameFormat::Nv12 | FrameFormat::P010)
@@ -91,8 +239,8 @@ impl Default for FrameFormat {
 /// A video frame
 #[derive(Debug)]
 pub struct Frame {
-    /// Raw frame data
-    pub data: Vec<u8>,
+    /// Raw frame data (pooled, refcounted)
+    pub data: FrameBuffer,
     /// Frame width
     pub width: u32,
     /// Frame height
@@ -109,22 +257,55 @@ pub struct Frame {
     pub is_keyframe: bool,
     /// DMA-BUF file descriptor (for zero-copy)
     pub dmabuf_fd: Option<i32>,
+    /// DMA-BUF backing this frame (keeps `dmabuf_fd` open)
+    pub dmabuf: Option<Arc<DmaBufFrame>>,
+    /// Regions changed since the previous frame (None = unknown, treat the
+    /// whole frame as changed; empty = nothing changed)
+    pub damage: Option<Vec<Rect>>,
 }
 
 impl Frame {
-    /// Create a new frame with allocated buffer
+    /// Create a new zero-filled frame from the global pool
     pub fn new(width: u32, height: u32, format: FrameFormat) -> Self {
-        let size = (width as f32 * height as f32 * format.bytes_per_pixel()) as usize;
+        let key = PoolKey::packed(width, height, format);
+        let data = FramePool::global().acquire_zeroed(key);
+        Self::with_buffer(data, width, height, key.stride, format)
+    }
+
+    /// Create a frame backed by a pooled buffer
+    ///
+    /// The buffer is not cleared; the caller is expected to overwrite it.
+    pub fn from_pool(
+        pool: &FramePool,
+        width: u32,
+        height: u32,
+        stride: u32,
+        format: FrameFormat,
+    ) -> Self {
+        let key = PoolKey::new(width, height, format, stride);
+        Self::with_buffer(pool.acquire(key), width, height, stride, format)
+    }
+
+    /// Create a frame around an existing buffer handle
+    pub fn with_buffer(
+        data: FrameBuffer,
+        width: u32,
+        height: u32,
+        stride: u32,
+        format: FrameFormat,
+    ) -> Self {
         Self {
-            data: vec![0u8; size],
+            data,
             width,
             height,
-            stride: width * 4, // Default stride, adjust based on format
+            stride,
             format,
             pts: 0,
             duration: 0,
             is_keyframe: false,
             dmabuf_fd: None,
+            dmabuf: None,
+            damage: None,
         }
     }
 
@@ -136,16 +317,23 @@ impl Frame {
         stride: u32,
         format: FrameFormat,
     ) -> Self {
+        Self::with_buffer(FrameBuffer::from_vec(data), width, height, stride, format)
+    }
+
+    /// Share this frame's buffer with a second frame (refcount bump, no copy)
+    pub fn share(&self) -> Self {
         Self {
-            data,
-            width,
-            height,
-            stride,
-            format,
-            pts: 0,
-            duration: 0,
-            is_keyframe: false,
-            dmabuf_fd: None,
+            data: self.data.clone(),
+            width: self.width,
+            height: self.height,
+            stride: self.stride,
+            format: self.format,
+            pts: self.pts,
+            duration: self.duration,
+            is_keyframe: self.is_keyframe,
+            dmabuf_fd: self.dmabuf_fd,
+            dmabuf: self.dmabuf.clone(),
+            damage: self.damage.clone(),
         }
     }
 
@@ -154,6 +342,12 @@ impl Frame {
         Resolution::new(self.width, self.height)
     }
 
+    /// Did the producer report that nothing changed since the previous
+    /// frame?
+    pub fn is_static(&self) -> bool {
+        self.damage.as_ref().is_some_and(|damage| damage.is_empty())
+    }
+
     /// Is this a zero-copy frame (DMA-BUF)?
     pub fn is_zero_copy(&self) -> bool {
         self.dmabuf_fd.is_some()
@@ -166,10 +360,13 @@ impl Frame {
 }
 
 /// Encoded packet (output from encoder)
-#[derive(Debug)]
+///
+/// Cloning shares the payload, so one packet can be handed to several
+/// outputs without copying.
+#[derive(Debug, Clone)]
 pub struct Packet {
     /// Encoded data
-    pub data: Vec<u8>,
+    pub data: PacketData,
     /// Presentation timestamp
     pub pts: i64,
     /// Decode timestamp
@@ -185,7 +382,7 @@ pub struct Packet {
 impl Packet {
     pub fn new(data: Vec<u8>, pts: i64, dts: i64, is_keyframe: bool) -> Self {
         Self {
-            data,
+            data: data.into(),
             pts,
             dts,
             duration: 0,
@@ -200,6 +397,79 @@ impl Packet {
     }
 }
 
+/// Zeroed bytes kept after a packet payload (FFmpeg may read up to 64
+/// bytes past the end of packet data)
+pub const PACKET_PADDING: usize = 64;
+
+/// Immutable, reference-counted packet payload
+///
+/// The buffer carries [`PACKET_PADDING`] so it can be handed to FFmpeg
+/// as-is.
+#[derive(Clone)]
+pub struct PacketData {
+    buf: Arc<Vec<u8>>,
+    len: usize,
+}
+
+impl PacketData {
+    /// Handles sharing this payload (including this one)
+    pub fn ref_count(&self) -> usize {
+        Arc::strong_count(&self.buf)
+    }
+
+    /// Payload followed by the zeroed padding
+    pub fn padded(&self) -> &[u8] {
+        &self.buf
+    }
+}
+
+impl From<Vec<u8>> for PacketData {
+    fn from(mut data: Vec<u8>) -> Self {
+        let len = data.len();
+        data.resize(len + PACKET_PADDING, 0);
+        Self {
+            buf: Arc::new(data),
+            len,
+        }
+    }
+}
+
+impl From<&[u8]> for PacketData {
+    fn from(data: &[u8]) -> Self {
+        let mut buf = Vec::with_capacity(data.len() + PACKET_PADDING);
+        buf.extend_from_slice(data);
+        buf.into()
+    }
+}
+
+impl Default for PacketData {
+    fn default() -> Self {
+        Vec::new().into()
+    }
+}
+
+impl std::ops::Deref for PacketData {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.buf[..self.len]
+    }
+}
+
+impl AsRef<[u8]> for PacketData {
+    fn as_ref(&self) -> &[u8] {
+        self
+    }
+}
+
+impl std::fmt::Debug for PacketData {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("PacketData")
+            .field("len", &self.len)
+            .finish()
+    }
+}
+
 /// Framerate representation
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
 pub struct Framerate {
@@ -257,7 +527,7 @@ impl std::fmt::Display for Framerate {
 }
 
 /// Codec parameters for muxing
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 pub struct CodecParams {
     /// Codec type
     pub codec: crate::encode::Codec,
@@ -283,7 +553,7 @@ impl Default for CodecParams {
             resolution: Resolution::FHD_1080P,
             framerate: Framerate::FPS_60,
             time_base_num: 1,
-            time_base_den: 1000,
+            time_base_den: crate::clock::TICKS_PER_SEC,
             bitrate: 6_000_000,
         }
     }
@@ -300,7 +570,7 @@ pub struct Stats {
     pub frames_dropped: u64,
     /// Current encoding FPS
     pub encoding_fps: f64,
-    /// Average encoding latency in ms
+    /// Average time from submitting a frame to its packet, in ms
     pub avg_encode_latency_ms: f64,
     /// Current bitrate in kbps
     pub current_bitrate_kbps: u64,
@@ -308,4 +578,8 @@ pub struct Stats {
     pub bytes_written: u64,
     /// GPU encoder utilization (0-100)
     pub gpu_encoder_util: u8,
+    /// Frame buffers served from the pool
+    pub pool_hits: u64,
+    /// Frame buffers that had to be allocated
+    pub pool_misses: u64,
 }